@@ -21,8 +21,9 @@ enum settings_ram_profiles
     kRamProfileMinimal       = kRamProfileS1Memory,
 };
 
-#define DEFAULT_LIBS_PATH "libs/"
-#define DEFAULT_LOG_PATH  "log/"
+#define DEFAULT_LIBS_PATH       "libs/"
+#define DEFAULT_LOG_PATH        "log/"
+#define DEFAULT_WRITE_BUDGET_MB 64
 
 static struct core_settings_s *settings = NULL;
 
@@ -155,12 +156,72 @@ static void parseConfigPartOfJson(const cJSON *config_array)
     }
 }
 
+static void parseCpuAffinityPartOfJson(const cJSON *affinity_obj)
+{
+    if (affinity_obj == NULL)
+    {
+        return;
+    }
+    if (! cJSON_IsObject(affinity_obj))
+    {
+        printError("CoreSettings: \"cpu-affinity\" must be an object\n");
+        exit(1);
+    }
+
+    // "workers": "auto" or a cpu list like "0-7,16-23"
+    getStringFromJsonObject(&(settings->worker_cpus), affinity_obj, "workers");
+    getStringFromJsonObject(&(settings->helper_cpus), affinity_obj, "helpers");
+    getStringFromJsonObject(&(settings->irq_interface), affinity_obj, "irq-locality");
+    getBoolFromJsonObjectOrDefault(&(settings->numa_local_pools), affinity_obj, "numa-pools", false);
+}
+
+static void parseHugePagesPartOfJson(const cJSON *misc_obj)
+{
+    // "huge-pages": "2mb" or "1gb" backs the pools with huge page slabs, off by default
+    char *huge_pages = NULL;
+    if (! getStringFromJsonObject(&huge_pages, misc_obj, "huge-pages"))
+    {
+        settings->huge_pages = kSlabPageNormal;
+        return;
+    }
+    stringLowerCase(huge_pages);
+
+    if (0 == strcmp(huge_pages, "2mb"))
+    {
+        settings->huge_pages = kSlabPage2MB;
+    }
+    else if (0 == strcmp(huge_pages, "1gb"))
+    {
+        settings->huge_pages = kSlabPage1GB;
+    }
+    else if (0 == strcmp(huge_pages, "off"))
+    {
+        settings->huge_pages = kSlabPageNormal;
+    }
+    else
+    {
+        printError("CoreSettings: huge-pages can hold \"2mb\" or \"1gb\" or \"off\" \n");
+        exit(1);
+    }
+    memoryFree(huge_pages);
+}
+
 static void parseMiscPartOfJson(cJSON *misc_obj)
 {
 
     if (cJSON_IsObject(misc_obj) && (misc_obj->child != NULL))
     {
         getStringFromJsonObjectOrDefault(&(settings->libs_path), misc_obj, "libs-path", DEFAULT_LIBS_PATH);
+        getStringFromJsonObject(&(settings->metrics_listen), misc_obj, "metrics");
+        getBoolFromJsonObjectOrDefault(&(settings->loop_stats), misc_obj, "loop-stats", false);
+        getIntFromJsonObjectOrDefault(&(settings->write_budget_mb), misc_obj, "write-budget", DEFAULT_WRITE_BUDGET_MB);
+        if (settings->write_budget_mb < 0)
+        {
+            printError("CoreSettings: write-budget must be 0 (unlimited) or more megabytes\n");
+            exit(1);
+        }
+        parseCpuAffinityPartOfJson(cJSON_GetObjectItemCaseSensitive(misc_obj, "cpu-affinity"));
+        parseHugePagesPartOfJson(misc_obj);
         if (! getIntFromJsonObjectOrDefault(&(settings->workers_count), misc_obj, "workers", getNCPU()))
         {
             printf("workers unspecified in json (misc), fallback to cpu cores: %d\n", settings->workers_count);
@@ -242,8 +303,9 @@ static void parseMiscPartOfJson(cJSON *misc_obj)
     }
     else
     {
-        settings->libs_path     = stringDuplicate(DEFAULT_LIBS_PATH);
-        settings->workers_count = getNCPU();
+        settings->libs_path       = stringDuplicate(DEFAULT_LIBS_PATH);
+        settings->workers_count   = getNCPU();
+        settings->write_budget_mb = DEFAULT_WRITE_BUDGET_MB;
         printf("misc block unspecified in json, using defaults. cpu cores: %d\n", settings->workers_count);
     }
 }
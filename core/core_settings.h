@@ -27,6 +27,17 @@ struct core_settings_s
     int   workers_count;
     int   ram_profile;
     char *libs_path;
+    char *metrics_listen; // NULL when the metrics endpoint is disabled
+    bool  loop_stats;
+    int   write_budget_mb; // misc.write-budget, bytes the write queues of one worker may hold, 0 is unlimited
+
+    // misc.cpu-affinity, all NULL / false leaves threads and memory where the os puts them
+    char *worker_cpus;
+    char *helper_cpus;
+    char *irq_interface;
+    bool  numa_local_pools;
+
+    int huge_pages; // misc.huge-pages, a slab_page_size_t
 
     vec_config_path_t config_paths;
 };
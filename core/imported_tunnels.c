@@ -53,6 +53,10 @@
 #include "tunnels/layer3/tcp/manipulator/tcp_manipulator.h"
 #endif
 
+#ifdef INCLUDE_LAYER3_FUSED
+#include "tunnels/layer3/fused/layer3_fused.h"
+#endif
+
 #ifdef INCLUDE_TCP_LISTENER
 #include "tunnels/adapters/listener/tcp/tcp_listener.h"
 #endif
@@ -355,4 +359,8 @@ void loadImportedTunnelsIntoCore(void)
 #ifdef INCLUDE_MUX_CLIENT
     USING(MuxServer);
 #endif
+
+#ifdef INCLUDE_LAYER3_FUSED
+    layer3fusedRegisterShapes();
+#endif
 }
@@ -42,6 +42,14 @@ int main(void)
         .dns_logger_data     = (logger_construction_data_t) {.log_file_path = getCoreSettings()->dns_log_file_fullpath,
                                                              .log_level     = getCoreSettings()->dns_log_level,
                                                              .log_console   = getCoreSettings()->dns_log_console},
+        .metrics_listen_address = getCoreSettings()->metrics_listen,
+        .loop_stats             = getCoreSettings()->loop_stats,
+        .write_budget_mb        = (uint32_t) getCoreSettings()->write_budget_mb,
+        .worker_cpus            = getCoreSettings()->worker_cpus,
+        .helper_cpus            = getCoreSettings()->helper_cpus,
+        .irq_interface          = getCoreSettings()->irq_interface,
+        .numa_local_pools       = getCoreSettings()->numa_local_pools,
+        .huge_pages             = (slab_page_size_t) getCoreSettings()->huge_pages,
     };
 
     // core logger is available after ww setup
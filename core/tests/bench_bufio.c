@@ -0,0 +1,857 @@
+/*
+    Bufio benchmark
+
+    Measures the primitives of ww/bufio that every byte goes through:
+
+        pool-get-reuse        buffer_pool get/reuse on one thread, per ram profile width (the bufcount of a worker
+                              pool), in bursts that cross the recharge and shrink points
+        pool-walk             touches one random cache line of each of thousands of pooled buffers, with the
+                              buffers malloc'ed and carved from a huge page slab (slab.h), reports dTLB read
+                              misses per touch next to the time when perf counters are readable
+        pool-cross-thread     one thread takes buffers from its pool and hands them over a ring to another thread
+                              that reuses them into its own pool, the two pools meet in the master pools
+        generic-pool          generic_pool get/reuse (the line and context pools)
+        append-merge / concat sbufAppendMerge and sbufConcat of a payload of the given size onto a buffer
+        stream-read-exact     buffer_stream exact reads of frames that straddle the 1500 byte buffers pushed in,
+        stream-read-view      as plain buffers (copies when a frame spans) and as views (never copies)
+        frame-merge           length prefixed frames arriving in 512 byte reads, cut by merging the whole backlog on
+        frame-decoder         every read and pushing it back (the old way) and by frame_decoder
+        master-contention     n threads taking and returning batches on one master pool
+        context-queue         push/pop of the context queue
+
+    Every case is run several times and the best round is kept, random sizes come from a fixed seed so two runs do
+    the same work. The results are one json document with ns per operation; given an older document it fails when a
+    case got slower than the tolerance allows, so it can gate a change:
+
+        ./bench_bufio -o new.json
+        ./bench_bufio --baseline old.json --tolerance 10
+
+    WW_BENCH_COMMIT is copied into the document. Configure with -DBUILD_BENCHMARKS=ON, the program links ww.
+
+*/
+#include "wwapi.h"
+
+#include "buffer_stream.h"
+#include "context_queue.h"
+#include "frame_decoder.h"
+
+#include <time.h>
+
+#ifdef OS_LINUX
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+enum
+{
+    kRounds        = 5,
+    kSeed          = 0x5EED,
+    kMaxResults    = 64,
+    kRingSize      = 1024,
+    kMaxThreads    = 8,
+    kMasterBatch   = 16,
+    kStreamBufSize = 1500,
+    kFrameReadSize = 512,
+    kWalkBuffers   = 4096
+};
+
+typedef struct bench_result_s
+{
+    char   name[48];
+    double ns_per_op;
+    double ops;
+    double dtlb_misses_per_op; // < 0 when not measured
+
+} bench_result_t;
+
+static bench_result_t results[kMaxResults];
+static int            results_len;
+static uint64_t       rng_state;
+static double         round_dtlb_misses_per_op; // set by the cases that read the dTLB counter
+
+/* --------------------------------------------------- helpers --------------------------------------------------- */
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint32_t nextRandom(void)
+{
+    // xorshift64, the sequence only depends on kSeed
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t) rng_state;
+}
+
+typedef double (*BenchRoutine)(void *arg, uint64_t *ops);
+
+// runs the case kRounds times and records the best ns per operation
+static void record(const char *name, BenchRoutine fn, void *arg)
+{
+    double   best      = 1e18;
+    double   best_dtlb = -1;
+    uint64_t ops       = 0;
+    for (int r = 0; r < kRounds; r++)
+    {
+        rng_state                = kSeed;
+        round_dtlb_misses_per_op = -1;
+
+        double ns = fn(arg, &ops);
+        if (ns < best)
+        {
+            best      = ns;
+            best_dtlb = round_dtlb_misses_per_op;
+        }
+    }
+
+    bench_result_t *res = &results[results_len++];
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    res->ns_per_op          = best;
+    res->ops                = (double) ops;
+    res->dtlb_misses_per_op = best_dtlb;
+    if (best_dtlb >= 0)
+    {
+        fprintf(stderr, "%-32s %10.2f ns/op %10.4f dtlb-misses/op\n", name, best, best_dtlb);
+    }
+    else
+    {
+        fprintf(stderr, "%-32s %10.2f ns/op\n", name, best);
+    }
+}
+
+// dTLB read misses of this thread, -1 when the perf counters are not readable (containers, perf_event_paranoid)
+static int openDtlbCounter(void)
+{
+#ifdef OS_LINUX
+    struct perf_event_attr attr;
+    memorySet(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HW_CACHE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void startCounter(int fd)
+{
+#ifdef OS_LINUX
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#else
+    (void) fd;
+#endif
+}
+
+static int64_t stopCounter(int fd)
+{
+    int64_t count = -1;
+#ifdef OS_LINUX
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+        {
+            count = -1;
+        }
+    }
+#else
+    (void) fd;
+#endif
+    return count;
+}
+
+static buffer_pool_t *createPool(master_pool_t *large, master_pool_t *small, uint32_t width)
+{
+    return bufferpoolCreate(large, small, width, 1U << 15, SMALL_BUFFER_SIZE);
+}
+
+/* ------------------------------------------------- buffer pool ------------------------------------------------- */
+
+typedef struct pool_case_s
+{
+    uint32_t width;
+    uint32_t burst;
+
+} pool_case_t;
+
+static double benchPoolGetReuse(void *arg, uint64_t *ops)
+{
+    pool_case_t   *c     = arg;
+    master_pool_t *large = masterpoolCreateWithCapacity(2 * c->width);
+    master_pool_t *small = masterpoolCreateWithCapacity(2 * c->width);
+    buffer_pool_t *pool  = createPool(large, small, c->width);
+    sbuf_t        *held[256];
+
+    const uint64_t iterations = 200000;
+    uint64_t       t0         = nowNs();
+    for (uint64_t it = 0; it < iterations; it++)
+    {
+        for (uint32_t i = 0; i < c->burst; i++)
+        {
+            held[i] = bufferpoolGetLargeBuffer(pool);
+        }
+        for (uint32_t i = 0; i < c->burst; i++)
+        {
+            bufferpoolResuesBuffer(pool, held[i]);
+        }
+    }
+    uint64_t t1 = nowNs();
+
+    *ops = iterations * c->burst * 2;
+    return (double) (t1 - t0) / (double) *ops;
+}
+
+typedef struct ring_s
+{
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    sbuf_t *items[kRingSize];
+
+} ring_t;
+
+typedef struct cross_case_s
+{
+    uint32_t       width;
+    uint64_t       count;
+    master_pool_t *large;
+    master_pool_t *small;
+    ring_t         ring;
+
+} cross_case_t;
+
+static WTHREAD_ROUTINE(crossConsumer)
+{
+    cross_case_t  *c    = userdata;
+    buffer_pool_t *pool = createPool(c->large, c->small, c->width);
+
+    for (uint64_t received = 0; received < c->count;)
+    {
+        uint32_t tail = atomicLoadExplicit(&c->ring.tail, memory_order_relaxed);
+        uint32_t head = atomicLoadExplicit(&c->ring.head, memory_order_acquire);
+        if (tail == head)
+        {
+            continue;
+        }
+        for (; tail != head; tail++, received++)
+        {
+            bufferpoolResuesBuffer(pool, c->ring.items[tail % kRingSize]);
+        }
+        atomicStoreExplicit(&c->ring.tail, tail, memory_order_release);
+    }
+    return 0;
+}
+
+static double benchPoolCrossThread(void *arg, uint64_t *ops)
+{
+    cross_case_t *c = arg;
+    c->count        = 2000000;
+    c->large        = masterpoolCreateWithCapacity(2 * c->width);
+    c->small        = masterpoolCreateWithCapacity(2 * c->width);
+    atomicStoreExplicit(&c->ring.head, 0, memory_order_relaxed);
+    atomicStoreExplicit(&c->ring.tail, 0, memory_order_relaxed);
+
+    buffer_pool_t *pool = createPool(c->large, c->small, c->width);
+
+    uint64_t  t0       = nowNs();
+    wthread_t consumer = threadCreate(crossConsumer, c);
+    for (uint64_t sent = 0; sent < c->count;)
+    {
+        uint32_t head = atomicLoadExplicit(&c->ring.head, memory_order_relaxed);
+        uint32_t tail = atomicLoadExplicit(&c->ring.tail, memory_order_acquire);
+        for (; head - tail < kRingSize && sent < c->count; head++, sent++)
+        {
+            c->ring.items[head % kRingSize] = bufferpoolGetLargeBuffer(pool);
+        }
+        atomicStoreExplicit(&c->ring.head, head, memory_order_release);
+    }
+    threadJoin(consumer);
+    uint64_t t1 = nowNs();
+
+    *ops = c->count;
+    return (double) (t1 - t0) / (double) *ops;
+}
+
+static double benchGenericPool(void *arg, uint64_t *ops)
+{
+    pool_case_t    *c    = arg;
+    master_pool_t  *mp   = masterpoolCreateWithCapacity(2 * c->width);
+    generic_pool_t *pool = genericpoolCreateWithDefaultAllocatorAndCapacity(mp, 256, c->width);
+    pool_item_t    *held[256];
+
+    const uint64_t iterations = 200000;
+    uint64_t       t0         = nowNs();
+    for (uint64_t it = 0; it < iterations; it++)
+    {
+        for (uint32_t i = 0; i < c->burst; i++)
+        {
+            held[i] = genericpoolGetItem(pool);
+        }
+        for (uint32_t i = 0; i < c->burst; i++)
+        {
+            genericpoolReuseItem(pool, held[i]);
+        }
+    }
+    uint64_t t1 = nowNs();
+
+    *ops = iterations * c->burst * 2;
+    return (double) (t1 - t0) / (double) *ops;
+}
+
+typedef struct walk_case_s
+{
+    slab_page_size_t page_size;
+    buffer_pool_t   *pool;
+    sbuf_t          *held[kWalkBuffers];
+
+} walk_case_t;
+
+static double benchPoolWalk(void *arg, uint64_t *ops)
+{
+    walk_case_t *c = arg;
+
+    if (c->pool == NULL)
+    {
+        // the pools live through the rounds, the arena of the slab is reserved once
+        master_pool_t *large = masterpoolCreateWithCapacity(kWalkBuffers);
+        master_pool_t *small = masterpoolCreateWithCapacity(kWalkBuffers);
+        masterpoolEnableSlab(large, 2 * kWalkBuffers, c->page_size);
+        c->pool = createPool(large, small, kRamProfileL2Memory);
+    }
+
+    for (uint32_t i = 0; i < kWalkBuffers; i++)
+    {
+        c->held[i] = bufferpoolGetLargeBuffer(c->pool);
+    }
+
+    const uint32_t lines = (1U << 15) / kCpuLineCacheSize;
+    const uint64_t walks = 64;
+    uint64_t       sum   = 0;
+    int            fd    = openDtlbCounter();
+
+    startCounter(fd);
+    uint64_t t0 = nowNs();
+    for (uint64_t w = 0; w < walks; w++)
+    {
+        for (uint32_t i = 0; i < kWalkBuffers; i++)
+        {
+            sbuf_t *b = c->held[nextRandom() % kWalkBuffers];
+            uint8_t *p = sbufGetMutablePtr(b) + (nextRandom() % lines) * kCpuLineCacheSize;
+            *p += 1;
+            sum += *p;
+        }
+    }
+    uint64_t t1     = nowNs();
+    int64_t  misses = stopCounter(fd);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    for (uint32_t i = 0; i < kWalkBuffers; i++)
+    {
+        bufferpoolResuesBuffer(c->pool, c->held[i]);
+    }
+
+    *ops = walks * kWalkBuffers;
+    if (misses >= 0)
+    {
+        round_dtlb_misses_per_op = (double) misses / (double) *ops;
+    }
+    // keeps the touches
+    if (sum == 0)
+    {
+        fprintf(stderr, " ");
+    }
+    return (double) (t1 - t0) / (double) *ops;
+}
+
+/* ------------------------------------------------- shift buffer ------------------------------------------------ */
+
+static master_pool_t *shared_large;
+static master_pool_t *shared_small;
+
+static double benchAppendMerge(void *arg, uint64_t *ops)
+{
+    uint32_t       size = *(uint32_t *) arg;
+    buffer_pool_t *pool = createPool(shared_large, shared_small, kRamProfileM1Memory);
+    sbuf_t        *root = bufferpoolGetLargeBuffer(pool);
+
+    const uint64_t iterations = 1000000;
+    uint64_t       t0         = nowNs();
+    for (uint64_t it = 0; it < iterations; it++)
+    {
+        sbuf_t *b2 = size <= SMALL_BUFFER_SIZE ? bufferpoolGetSmallBuffer(pool) : bufferpoolGetLargeBuffer(pool);
+        sbufSetLength(b2, size);
+        sbufSetLength(root, 128);
+        root = sbufAppendMerge(pool, root, b2);
+    }
+    uint64_t t1 = nowNs();
+
+    bufferpoolResuesBuffer(pool, root);
+    *ops = iterations;
+    return (double) (t1 - t0) / (double) *ops;
+}
+
+static double benchConcat(void *arg, uint64_t *ops)
+{
+    uint32_t size = *(uint32_t *) arg;
+    sbuf_t  *root = sbufNewWithPadding(1U << 15, 0);
+    sbuf_t  *buf  = sbufNewWithPadding(size, 0);
+    sbufSetLength(buf, size);
+    memorySet(sbufGetMutablePtr(buf), 0x5A, size);
+
+    const uint64_t iterations = 1000000;
+    uint64_t       t0         = nowNs();
+    for (uint64_t it = 0; it < iterations; it++)
+    {
+        sbufSetLength(root, 128);
+        root = sbufConcat(root, buf);
+    }
+    uint64_t t1 = nowNs();
+
+    sbufDestroy(root);
+    sbufDestroy(buf);
+    *ops = iterations;
+    return (double) (t1 - t0) / (double) *ops;
+}
+
+/* ------------------------------------------------ buffer stream ------------------------------------------------ */
+
+typedef struct stream_case_s
+{
+    uint32_t frame; // 0 means random frame sizes up to 16k
+    bool     views;
+
+} stream_case_t;
+
+static double benchStreamRead(void *arg, uint64_t *ops)
+{
+    stream_case_t   *c      = arg;
+    buffer_pool_t   *pool   = createPool(shared_large, shared_small, kRamProfileM1Memory);
+    buffer_stream_t *stream = bufferstreamCreate(pool);
+    sbuf_chain_t     chain;
+    sbufchainInit(&chain);
+
+    const uint64_t total  = 512ULL << 20;
+    uint64_t       frames = 0;
+    uint64_t       pushed = 0;
+    uint32_t       frame  = c->frame ? c->frame : 1 + nextRandom() % (1U << 14);
+
+    uint64_t t0 = nowNs();
+    while (pushed < total)
+    {
+        sbuf_t *b = bufferpoolGetSmallBuffer(pool);
+        sbufSetLength(b, kStreamBufSize);
+        bufferstreamPush(stream, b);
+        pushed += kStreamBufSize;
+
+        while (bufferstreamLen(stream) >= frame)
+        {
+            if (c->views)
+            {
+                bufferstreamReadExactView(stream, frame, &chain);
+                sbufchainRelease(pool, &chain);
+            }
+            else
+            {
+                bufferpoolResuesBuffer(pool, bufferstreamReadExact(stream, frame));
+            }
+            frames++;
+            frame = c->frame ? c->frame : 1 + nextRandom() % (1U << 14);
+        }
+    }
+    uint64_t t1 = nowNs();
+
+    bufferstreamDestroy(stream);
+    *ops = frames;
+    return (double) (t1 - t0) / (double) *ops;
+}
+
+/* ------------------------------------------------ frame decoder ------------------------------------------------ */
+
+typedef struct frame_case_s
+{
+    uint32_t payload;
+    bool     decoder;
+
+} frame_case_t;
+
+static double benchFrameDecode(void *arg, uint64_t *ops)
+{
+    frame_case_t  *c    = arg;
+    buffer_pool_t *pool = createPool(shared_large, shared_small, kRamProfileM1Memory);
+
+    // flag byte, uleb128 length, payload; the way ProtoBuf frames its data
+    uint8_t  frame[8 + (1U << 16)];
+    uint32_t header = 1;
+    frame[0]        = '\n';
+    for (uint32_t v = c->payload; v != 0 || header == 1; v >>= 7)
+    {
+        frame[header++] = (uint8_t) ((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+    }
+    const uint32_t frame_len = header + c->payload;
+    memorySet(frame + header, 0x5A, c->payload);
+
+    frame_decoder_t  decoder;
+    buffer_stream_t *stream = bufferstreamCreate(pool);
+    framedecoderInit(&decoder, pool,
+                     (frame_format_t) {.min_length    = 1,
+                                       .max_length    = 1U << 16,
+                                       .length_offset = 1,
+                                       .length_size   = kFrameLengthUleb128});
+
+    const uint64_t total  = 256ULL << 20;
+    uint64_t       frames = 0;
+    uint64_t       pushed = 0;
+
+    uint64_t t0 = nowNs();
+    while (pushed < total)
+    {
+        for (uint32_t at = 0; at < frame_len; at += kFrameReadSize)
+        {
+            uint32_t n = min((uint32_t) kFrameReadSize, frame_len - at);
+            sbuf_t  *b = bufferpoolGetSmallBuffer(pool);
+            sbufSetLength(b, n);
+            memoryCopy(sbufGetMutablePtr(b), frame + at, n);
+            pushed += n;
+
+            sbuf_t *out = NULL;
+            if (c->decoder)
+            {
+                framedecoderPush(&decoder, b);
+                while (framedecoderNextBuffer(&decoder, &out) == kFrameDecoderFrame)
+                {
+                    bufferpoolResuesBuffer(pool, out);
+                    frames++;
+                }
+                continue;
+            }
+
+            bufferstreamPush(stream, b);
+            out = bufferstreamFullRead(stream);
+            if (sbufGetBufLength(out) < frame_len)
+            {
+                bufferstreamPush(stream, out);
+                continue;
+            }
+            // the reads never straddle two frames, a complete backlog is exactly one frame
+            bufferpoolResuesBuffer(pool, out);
+            frames++;
+        }
+    }
+    uint64_t t1 = nowNs();
+
+    framedecoderDestroy(&decoder);
+    bufferstreamDestroy(stream);
+    *ops = frames;
+    return (double) (t1 - t0) / (double) *ops;
+}
+
+/* ------------------------------------------------- master pool ------------------------------------------------- */
+
+typedef struct contention_case_s
+{
+    int            threads;
+    master_pool_t *mp;
+    atomic_bool    go;
+
+} contention_case_t;
+
+static master_pool_item_t *createItemHandle(master_pool_t *pool, void *userdata)
+{
+    (void) pool;
+    (void) userdata;
+    return memoryAllocate(64);
+}
+
+static void destroyItemHandle(master_pool_t *pool, master_pool_item_t *item, void *userdata)
+{
+    (void) pool;
+    (void) userdata;
+    memoryFree(item);
+}
+
+static WTHREAD_ROUTINE(contentionWorker)
+{
+    contention_case_t  *c = userdata;
+    master_pool_item_t *items[kMasterBatch];
+
+    while (! atomicLoadExplicit(&c->go, memory_order_acquire))
+    {
+    }
+    for (int it = 0; it < 200000; it++)
+    {
+        masterpoolGetItems(c->mp, (master_pool_item_t const **) items, kMasterBatch, NULL);
+        masterpoolReuseItems(c->mp, items, kMasterBatch, NULL);
+    }
+    return 0;
+}
+
+static double benchMasterContention(void *arg, uint64_t *ops)
+{
+    contention_case_t *c = arg;
+    c->mp                = masterpoolCreateWithCapacity(kMasterBatch * (uint32_t) c->threads * 2);
+    masterpoolInstallCallBacks(c->mp, createItemHandle, destroyItemHandle);
+    atomicStoreExplicit(&c->go, false, memory_order_relaxed);
+
+    wthread_t threads[kMaxThreads];
+    for (int i = 0; i < c->threads; i++)
+    {
+        threads[i] = threadCreate(contentionWorker, c);
+    }
+    uint64_t t0 = nowNs();
+    atomicStoreExplicit(&c->go, true, memory_order_release);
+    for (int i = 0; i < c->threads; i++)
+    {
+        threadJoin(threads[i]);
+    }
+    uint64_t t1 = nowNs();
+
+    // per item taken or returned, summed over the threads
+    *ops = 200000ULL * kMasterBatch * 2 * (uint64_t) c->threads;
+    return (double) (t1 - t0) / (double) *ops;
+}
+
+/* ------------------------------------------------ context queue ------------------------------------------------ */
+
+static double benchContextQueue(void *arg, uint64_t *ops)
+{
+    uint32_t         depth = *(uint32_t *) arg;
+    context_queue_t *queue = contextqueueCreate();
+    static context_t dummies[256];
+
+    const uint64_t iterations = 200000;
+    uint64_t       t0         = nowNs();
+    for (uint64_t it = 0; it < iterations; it++)
+    {
+        for (uint32_t i = 0; i < depth; i++)
+        {
+            contextqueuePush(queue, &dummies[i]);
+        }
+        for (uint32_t i = 0; i < depth; i++)
+        {
+            contextqueuePop(queue);
+        }
+    }
+    uint64_t t1 = nowNs();
+
+    contextqueueDestory(queue);
+    *ops = iterations * depth * 2;
+    return (double) (t1 - t0) / (double) *ops;
+}
+
+/* ---------------------------------------------------- main ----------------------------------------------------- */
+
+static cJSON *resultsToJson(void)
+{
+    cJSON *doc = cJSON_CreateObject();
+    cJSON_AddStringToObject(doc, "benchmark", "bufio");
+    cJSON_AddStringToObject(doc, "commit", getenv("WW_BENCH_COMMIT") ? getenv("WW_BENCH_COMMIT") : "unknown");
+    cJSON_AddNumberToObject(doc, "seed", kSeed);
+
+    cJSON *arr = cJSON_AddArrayToObject(doc, "results");
+    for (int i = 0; i < results_len; i++)
+    {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", results[i].name);
+        cJSON_AddNumberToObject(item, "ns-per-op", results[i].ns_per_op);
+        cJSON_AddNumberToObject(item, "ops", results[i].ops);
+        if (results[i].dtlb_misses_per_op >= 0)
+        {
+            cJSON_AddNumberToObject(item, "dtlb-misses-per-op", results[i].dtlb_misses_per_op);
+        }
+        cJSON_AddItemToArray(arr, item);
+    }
+    return doc;
+}
+
+// compares with an older result document, returns the number of cases that got slower than the tolerance
+static int compareWithBaseline(const char *path, double tolerance_percent)
+{
+    char *content = readFile(path);
+    if (content == NULL)
+    {
+        printError("bench_bufio: could not read baseline \"%s\"\n", path);
+        exit(1);
+    }
+    cJSON *baseline = cJSON_Parse(content);
+    memoryFree(content);
+
+    int          regressions = 0;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(baseline, "results"))
+    {
+        const cJSON *name = cJSON_GetObjectItemCaseSensitive(item, "name");
+        const cJSON *ns   = cJSON_GetObjectItemCaseSensitive(item, "ns-per-op");
+        if (! cJSON_IsString(name) || ! cJSON_IsNumber(ns))
+        {
+            continue;
+        }
+        for (int i = 0; i < results_len; i++)
+        {
+            if (strcmp(results[i].name, name->valuestring) != 0)
+            {
+                continue;
+            }
+            double change = (results[i].ns_per_op - ns->valuedouble) * 100 / ns->valuedouble;
+            if (change > tolerance_percent)
+            {
+                fprintf(stderr, "regression: %-32s %10.2f -> %10.2f ns/op (+%.1f%%)\n", results[i].name,
+                        ns->valuedouble, results[i].ns_per_op, change);
+                regressions++;
+            }
+        }
+    }
+    cJSON_Delete(baseline);
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    const char *output_path   = NULL;
+    const char *baseline_path = NULL;
+    double      tolerance     = 10;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            output_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+        {
+            baseline_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+        {
+            tolerance = atof(argv[++i]);
+        }
+        else
+        {
+            printError("usage: bench_bufio [-o results.json] [--baseline old.json] [--tolerance percent]\n");
+            return 1;
+        }
+    }
+
+    initWLibc();
+
+    shared_large = masterpoolCreateWithCapacity(2 * kRamProfileM1Memory);
+    shared_small = masterpoolCreateWithCapacity(2 * kRamProfileM1Memory);
+
+    char name[48];
+
+    // the widths the worker pools get for each ram profile; S1 is left out, its pool of 1 recharges by cap / 2 == 0
+    static const struct
+    {
+        const char *label;
+        uint32_t    width;
+    } profiles[] = {{"s2", kRamProfileS2Memory}, {"m1", kRamProfileM1Memory}, {"m2", kRamProfileM2Memory},
+                    {"l1", kRamProfileL1Memory}, {"l2", kRamProfileL2Memory}};
+
+    for (size_t i = 0; i < ARRAY_SIZE(profiles); i++)
+    {
+        // a burst of one full pool crosses the recharge point on the way out and the shrink point on the way back
+        pool_case_t pc = {.width = profiles[i].width, .burst = min(profiles[i].width, 256U)};
+        snprintf(name, sizeof(name), "pool-get-reuse/%s", profiles[i].label);
+        record(name, benchPoolGetReuse, &pc);
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(profiles); i++)
+    {
+        static cross_case_t cc;
+        cc.width = profiles[i].width;
+        snprintf(name, sizeof(name), "pool-cross-thread/%s", profiles[i].label);
+        record(name, benchPoolCrossThread, &cc);
+    }
+    {
+        pool_case_t pc = {.width = kRamProfileM1Memory, .burst = 64};
+        record("generic-pool/m1", benchGenericPool, &pc);
+    }
+    {
+        // the slab falls back to transparent huge pages, or to malloc, when no huge pages are reserved
+        static walk_case_t walk_malloc = {.page_size = kSlabPageNormal};
+        static walk_case_t walk_slab   = {.page_size = kSlabPage2MB};
+        record("pool-walk/malloc", benchPoolWalk, &walk_malloc);
+        record("pool-walk/slab-2mb", benchPoolWalk, &walk_slab);
+    }
+
+    static uint32_t sizes[] = {64, 512, 1500, 4096, 16384};
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); i++)
+    {
+        snprintf(name, sizeof(name), "append-merge/%u", sizes[i]);
+        record(name, benchAppendMerge, &sizes[i]);
+        snprintf(name, sizeof(name), "concat/%u", sizes[i]);
+        record(name, benchConcat, &sizes[i]);
+    }
+
+    static stream_case_t frames[] = {{100, false},  {1400, false}, {4000, false}, {16000, false}, {0, false},
+                                     {100, true},   {1400, true},  {4000, true},  {16000, true},  {0, true}};
+    for (size_t i = 0; i < ARRAY_SIZE(frames); i++)
+    {
+        if (frames[i].frame == 0)
+        {
+            snprintf(name, sizeof(name), "stream-read-%s/random", frames[i].views ? "view" : "exact");
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "stream-read-%s/%u", frames[i].views ? "view" : "exact", frames[i].frame);
+        }
+        record(name, benchStreamRead, &frames[i]);
+    }
+
+    static frame_case_t frame_cases[] = {{1400, false}, {16000, false}, {65000, false},
+                                         {1400, true},  {16000, true},  {65000, true}};
+    for (size_t i = 0; i < ARRAY_SIZE(frame_cases); i++)
+    {
+        snprintf(name, sizeof(name), "frame-%s/%u", frame_cases[i].decoder ? "decoder" : "merge",
+                 frame_cases[i].payload);
+        record(name, benchFrameDecode, &frame_cases[i]);
+    }
+
+    for (int threads = 1; threads <= kMaxThreads; threads *= 2)
+    {
+        static contention_case_t ctc;
+        ctc.threads = threads;
+        snprintf(name, sizeof(name), "master-contention/%d", threads);
+        record(name, benchMasterContention, &ctc);
+    }
+
+    static uint32_t depths[] = {4, 16, 64};
+    for (size_t i = 0; i < ARRAY_SIZE(depths); i++)
+    {
+        snprintf(name, sizeof(name), "context-queue/%u", depths[i]);
+        record(name, benchContextQueue, &depths[i]);
+    }
+
+    cJSON *doc  = resultsToJson();
+    char  *text = cJSON_Print(doc);
+    if (output_path != NULL)
+    {
+        writeFile(output_path, text, strlen(text));
+    }
+    else
+    {
+        printf("%s\n", text);
+    }
+    cJSON_free(text);
+    cJSON_Delete(doc);
+
+    if (baseline_path != NULL && compareWithBaseline(baseline_path, tolerance) > 0)
+    {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,240 @@
+/*
+    Chain depth benchmark
+
+    Measures the cost of one payload travelling through 1..10 pass-through tunnels with the two call shapes:
+
+        context   the old path, a context_t is taken from a pool and locks the line at the adapter, every hop
+                  calls upStream(self, c) and finds its connection state through line->chains_state[chain_index],
+                  which points to a separately allocated object; the last node drops the context
+
+        payload   the current path, every hop calls fnPayloadU(self, line, buf) and reaches its line state at a
+                  fixed offset inside the line
+
+    Each hop touches its state in both modes so only the call shape differs. The program does not link ww, it
+    reproduces the two shapes with the same struct layouts so it can be built anywhere:
+
+        cc -O2 -o bench_chain_depth core/tests/bench_chain_depth.c
+
+    or configure with -DBUILD_BENCHMARKS=ON
+
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_DEPTH  10
+#define ITERATIONS 20000000ULL
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+typedef struct buf_s
+{
+    uint32_t len;
+    uint8_t  data[60];
+} buf_t;
+
+typedef struct conn_state_s
+{
+    uint64_t packets;
+    uint64_t bytes;
+} conn_state_t;
+
+/* ------------------------------------------------ context path ------------------------------------------------ */
+
+typedef struct old_line_s
+{
+    uint32_t refc;
+    void    *chains_state[MAX_DEPTH + 1];
+} old_line_t;
+
+typedef struct context_s
+{
+    old_line_t *line;
+    buf_t      *payload;
+    uint8_t     init : 1;
+    uint8_t     fin : 1;
+} context_t;
+
+typedef struct old_tunnel_s old_tunnel_t;
+typedef void (*OldFlowRoutine)(old_tunnel_t *self, context_t *c);
+
+struct old_tunnel_s
+{
+    old_tunnel_t  *up;
+    OldFlowRoutine upStream;
+    uint16_t       chain_index;
+};
+
+// a small free list, the old context pool
+static context_t *context_pool[64];
+static int        context_pool_len;
+
+static inline context_t *contextCreate(old_line_t *line)
+{
+    context_t *c = context_pool_len > 0 ? context_pool[--context_pool_len] : malloc(sizeof(context_t));
+    memset(c, 0, sizeof(context_t));
+    c->line = line;
+    line->refc++;
+    return c;
+}
+
+static inline void contextDestroy(context_t *c)
+{
+    c->line->refc--;
+    if (context_pool_len < 64)
+    {
+        context_pool[context_pool_len++] = c;
+    }
+    else
+    {
+        free(c);
+    }
+}
+
+static NOINLINE void oldPassThrough(old_tunnel_t *self, context_t *c)
+{
+    conn_state_t *cstate = c->line->chains_state[self->chain_index];
+    cstate->packets++;
+    cstate->bytes += c->payload->len;
+    self->up->upStream(self->up, c);
+}
+
+static NOINLINE void oldSink(old_tunnel_t *self, context_t *c)
+{
+    conn_state_t *cstate = c->line->chains_state[self->chain_index];
+    cstate->packets++;
+    cstate->bytes += c->payload->len;
+    contextDestroy(c);
+}
+
+static double runContextPath(int depth, buf_t *buf)
+{
+    old_tunnel_t tunnels[MAX_DEPTH + 1];
+    old_line_t   line = {.refc = 1};
+
+    for (int i = 0; i <= depth; i++)
+    {
+        tunnels[i] = (old_tunnel_t) {.up          = i < depth ? &tunnels[i + 1] : NULL,
+                                     .upStream    = i < depth ? oldPassThrough : oldSink,
+                                     .chain_index = (uint16_t) i};
+        line.chains_state[i] = calloc(1, sizeof(conn_state_t));
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (uint64_t i = 0; i < ITERATIONS; i++)
+    {
+        context_t *c = contextCreate(&line);
+        c->payload   = buf;
+        tunnels[0].upStream(&tunnels[0], c);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    uint64_t check = 0;
+    for (int i = 0; i <= depth; i++)
+    {
+        check += ((conn_state_t *) line.chains_state[i])->packets;
+        free(line.chains_state[i]);
+    }
+    if (check != ITERATIONS * (uint64_t) (depth + 1))
+    {
+        fprintf(stderr, "context path lost packets\n");
+        exit(1);
+    }
+    return ((double) (t1.tv_sec - t0.tv_sec) * 1e9 + (double) (t1.tv_nsec - t0.tv_nsec)) / (double) ITERATIONS;
+}
+
+/* ------------------------------------------------ payload path ------------------------------------------------ */
+
+typedef struct new_line_s
+{
+    uint32_t refc;
+    uint8_t  alive;
+    _Alignas(8) uint8_t tunnels_line_state[];
+} new_line_t;
+
+typedef struct new_tunnel_s new_tunnel_t;
+typedef void (*PayloadRoutine)(new_tunnel_t *self, new_line_t *line, buf_t *payload);
+
+struct new_tunnel_s
+{
+    new_tunnel_t  *up;
+    PayloadRoutine fnPayloadU;
+    uint16_t       lstate_offset;
+};
+
+static inline void *lineGetState(new_tunnel_t *t, new_line_t *l)
+{
+    return ((uint8_t *) l->tunnels_line_state) + t->lstate_offset;
+}
+
+static NOINLINE void newPassThrough(new_tunnel_t *self, new_line_t *line, buf_t *payload)
+{
+    conn_state_t *ls = lineGetState(self, line);
+    ls->packets++;
+    ls->bytes += payload->len;
+    self->up->fnPayloadU(self->up, line, payload);
+}
+
+static NOINLINE void newSink(new_tunnel_t *self, new_line_t *line, buf_t *payload)
+{
+    conn_state_t *ls = lineGetState(self, line);
+    ls->packets++;
+    ls->bytes += payload->len;
+}
+
+static double runPayloadPath(int depth, buf_t *buf)
+{
+    new_tunnel_t tunnels[MAX_DEPTH + 1];
+    new_line_t  *line = calloc(1, sizeof(new_line_t) + sizeof(conn_state_t) * (MAX_DEPTH + 1));
+    line->refc        = 1;
+    line->alive       = 1;
+
+    for (int i = 0; i <= depth; i++)
+    {
+        tunnels[i] = (new_tunnel_t) {.up            = i < depth ? &tunnels[i + 1] : NULL,
+                                     .fnPayloadU    = i < depth ? newPassThrough : newSink,
+                                     .lstate_offset = (uint16_t) (i * sizeof(conn_state_t))};
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (uint64_t i = 0; i < ITERATIONS; i++)
+    {
+        tunnels[0].fnPayloadU(&tunnels[0], line, buf);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    uint64_t check = 0;
+    for (int i = 0; i <= depth; i++)
+    {
+        check += ((conn_state_t *) lineGetState(&tunnels[i], line))->packets;
+    }
+    free(line);
+    if (check != ITERATIONS * (uint64_t) (depth + 1))
+    {
+        fprintf(stderr, "payload path lost packets\n");
+        exit(1);
+    }
+    return ((double) (t1.tv_sec - t0.tv_sec) * 1e9 + (double) (t1.tv_nsec - t0.tv_nsec)) / (double) ITERATIONS;
+}
+
+int main(void)
+{
+    buf_t buf = {.len = sizeof(buf.data)};
+
+    printf("%-6s %14s %14s %8s\n", "depth", "context ns/pkt", "payload ns/pkt", "speedup");
+    for (int depth = 1; depth <= MAX_DEPTH; depth++)
+    {
+        double before = runContextPath(depth, &buf);
+        double after  = runPayloadPath(depth, &buf);
+        printf("%-6d %14.2f %14.2f %7.2fx\n", depth, before, after, before / after);
+    }
+    return 0;
+}
@@ -0,0 +1,287 @@
+/*
+    Chain fusion benchmark
+
+    Measures one layer3 shape, Layer3Receiver -> Layer3IpOverrider -> Layer3Sender -> device, on 64 byte ipv4
+    packets with the two dispatch forms:
+
+        chained   every node is its own routine and calls the next one through tunnel_t::up (what the nodes do
+                  when they live in separate libraries), per packet and with bursts of 64
+
+        fused     the per packet steps of the three nodes called back to back from one routine, as generated by
+                  CHAINFUSION_DEFINE3 in ww/net/chain_fusion.h, the hops inline into each other
+
+    The steps are the same code in both forms (packet check, source ip override, ip header checksum) so only the
+    dispatch differs. The program does not link ww:
+
+        cc -O2 -o bench_chain_fusion core/tests/bench_chain_fusion.c
+
+    or configure with -DBUILD_BENCHMARKS=ON
+
+*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BURST      64
+#define ITERATIONS 400000ULL // bursts
+#define ROUNDS     7
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+typedef struct buf_s
+{
+    uint32_t len;
+    uint8_t  data[64];
+} buf_t;
+
+typedef struct tunnel_s tunnel_t;
+typedef void (*PayloadRoutine)(tunnel_t *self, buf_t *payload);
+typedef void (*BurstRoutine)(tunnel_t *self, buf_t **payloads, uint32_t count);
+
+struct tunnel_s
+{
+    tunnel_t      *up;
+    PayloadRoutine fnPayloadU;
+    BurstRoutine   fnPayloadBurstU;
+    uint32_t       ov_4;
+    uint64_t       packets;
+};
+
+/* --------------------------------------------------- steps --------------------------------------------------- */
+
+static inline bool receiverStep(tunnel_t *t, buf_t *p)
+{
+    (void) t;
+    return (p->data[0] >> 4) == 4 && p->len >= 20;
+}
+
+static inline bool overriderStep(tunnel_t *t, buf_t *p)
+{
+    memcpy(&p->data[12], &t->ov_4, sizeof(t->ov_4));
+    return true;
+}
+
+static inline uint16_t ipChecksum(const uint8_t *h, unsigned int len)
+{
+    uint32_t sum = 0;
+    for (unsigned int i = 0; i < len; i += 2)
+    {
+        sum += (uint32_t) ((h[i] << 8) | h[i + 1]);
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t) ~sum;
+}
+
+static inline void senderStep(tunnel_t *t, buf_t *p)
+{
+    (void) t;
+    p->data[10]    = 0;
+    p->data[11]    = 0;
+    uint16_t check = ipChecksum(p->data, (p->data[0] & 0x0F) * 4);
+    p->data[10]    = (uint8_t) (check >> 8);
+    p->data[11]    = (uint8_t) check;
+}
+
+/* -------------------------------------------------- device --------------------------------------------------- */
+
+static NOINLINE void deviceWrite(tunnel_t *self, buf_t *payload)
+{
+    self->packets += payload->data[11] != 0xFF ? 1 : 0;
+}
+
+static NOINLINE void deviceWriteBurst(tunnel_t *self, buf_t **payloads, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        self->packets += payloads[i]->data[11] != 0xFF ? 1 : 0;
+    }
+}
+
+/* -------------------------------------------------- chained -------------------------------------------------- */
+
+static NOINLINE void receiverPayload(tunnel_t *self, buf_t *p)
+{
+    if (! receiverStep(self, p))
+    {
+        return;
+    }
+    self->up->fnPayloadU(self->up, p);
+}
+
+static NOINLINE void overriderPayload(tunnel_t *self, buf_t *p)
+{
+    overriderStep(self, p);
+    self->up->fnPayloadU(self->up, p);
+}
+
+static NOINLINE void senderPayload(tunnel_t *self, buf_t *p)
+{
+    senderStep(self, p);
+    self->up->fnPayloadU(self->up, p);
+}
+
+static NOINLINE void receiverBurst(tunnel_t *self, buf_t **ps, uint32_t count)
+{
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (receiverStep(self, ps[i]))
+        {
+            ps[kept++] = ps[i];
+        }
+    }
+    self->up->fnPayloadBurstU(self->up, ps, kept);
+}
+
+static NOINLINE void overriderBurst(tunnel_t *self, buf_t **ps, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        overriderStep(self, ps[i]);
+    }
+    self->up->fnPayloadBurstU(self->up, ps, count);
+}
+
+static NOINLINE void senderBurst(tunnel_t *self, buf_t **ps, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        senderStep(self, ps[i]);
+    }
+    self->up->fnPayloadBurstU(self->up, ps, count);
+}
+
+/* --------------------------------------------------- fused --------------------------------------------------- */
+
+static NOINLINE void fusedPayload(tunnel_t *t0, buf_t *p)
+{
+    tunnel_t *t1 = t0->up;
+    tunnel_t *t2 = t1->up;
+    if (! receiverStep(t0, p) || ! overriderStep(t1, p))
+    {
+        return;
+    }
+    senderStep(t2, p);
+    t2->up->fnPayloadU(t2->up, p);
+}
+
+static NOINLINE void fusedBurst(tunnel_t *t0, buf_t **ps, uint32_t count)
+{
+    tunnel_t *t1   = t0->up;
+    tunnel_t *t2   = t1->up;
+    uint32_t  kept = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (! receiverStep(t0, ps[i]) || ! overriderStep(t1, ps[i]))
+        {
+            continue;
+        }
+        ps[kept++] = ps[i];
+    }
+    for (uint32_t i = 0; i < kept; i++)
+    {
+        senderStep(t2, ps[i]);
+    }
+    t2->up->fnPayloadBurstU(t2->up, ps, kept);
+}
+
+/* -------------------------------------------------- harness -------------------------------------------------- */
+
+static inline double min(double a, double b)
+{
+    return a < b ? a : b;
+}
+
+static tunnel_t tunnels[4];
+
+static void setup(bool fused)
+{
+    memset(tunnels, 0, sizeof(tunnels));
+    for (int i = 0; i < 3; i++)
+    {
+        tunnels[i].up = &tunnels[i + 1];
+    }
+    tunnels[1].ov_4 = 0x0100000A;
+
+    tunnels[0].fnPayloadU      = fused ? fusedPayload : receiverPayload;
+    tunnels[0].fnPayloadBurstU = fused ? fusedBurst : receiverBurst;
+    tunnels[1].fnPayloadU      = overriderPayload;
+    tunnels[1].fnPayloadBurstU = overriderBurst;
+    tunnels[2].fnPayloadU      = senderPayload;
+    tunnels[2].fnPayloadBurstU = senderBurst;
+    tunnels[3].fnPayloadU      = deviceWrite;
+    tunnels[3].fnPayloadBurstU = deviceWriteBurst;
+}
+
+static double run(bool fused, bool burst, buf_t *packets)
+{
+    buf_t *array[BURST];
+
+    setup(fused);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (uint64_t it = 0; it < ITERATIONS; it++)
+    {
+        if (burst)
+        {
+            for (int i = 0; i < BURST; i++)
+            {
+                array[i] = &packets[i];
+            }
+            tunnels[0].fnPayloadBurstU(&tunnels[0], array, BURST);
+        }
+        else
+        {
+            for (int i = 0; i < BURST; i++)
+            {
+                tunnels[0].fnPayloadU(&tunnels[0], &packets[i]);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (tunnels[3].packets != ITERATIONS * BURST)
+    {
+        fprintf(stderr, "lost packets\n");
+        exit(1);
+    }
+    return ((double) (t1.tv_sec - t0.tv_sec) * 1e9 + (double) (t1.tv_nsec - t0.tv_nsec)) /
+           (double) (ITERATIONS * BURST);
+}
+
+int main(void)
+{
+    static buf_t packets[BURST];
+    for (int i = 0; i < BURST; i++)
+    {
+        packets[i].len     = sizeof(packets[i].data);
+        packets[i].data[0] = 0x45;
+        packets[i].data[9] = 17;
+    }
+
+    // best of several rounds, the runs are short enough to be disturbed by anything else on the machine
+    double chained_single = 1e9, fused_single = 1e9, chained_burst = 1e9, fused_burst = 1e9;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        chained_single = min(chained_single, run(false, false, packets));
+        fused_single   = min(fused_single, run(true, false, packets));
+        chained_burst  = min(chained_burst, run(false, true, packets));
+        fused_burst    = min(fused_burst, run(true, true, packets));
+    }
+
+    printf("%-10s %14s %14s %8s\n", "mode", "chained ns/pkt", "fused ns/pkt", "speedup");
+    printf("%-10s %14.2f %14.2f %7.2fx\n", "packet", chained_single, fused_single, chained_single / fused_single);
+    printf("%-10s %14.2f %14.2f %7.2fx\n", "burst-64", chained_burst, fused_burst, chained_burst / fused_burst);
+    return 0;
+}
@@ -0,0 +1,735 @@
+/*
+    End to end benchmark
+
+    Runs a real node graph in process and drives traffic through it from sockets the harness owns:
+
+        client sockets ---> [entry]  graph of nodes  [sink address] ---> echo server
+                       <---                                          <---
+
+    The graph comes from a spec file, which is a normal config file (the "config" object) plus the benchmark
+    parameters:
+
+        {
+            "name": "tcp-mux",
+            "workers": 2,
+            "entry": "127.0.0.1:21001",        the address of the first listener of the graph
+            "sink": "127.0.0.1:21002",         the harness echo server, the last connector of the graph targets it
+            "payload-sizes": [64, 1024, 16384, 65536],
+            "concurrency": [1, 16, 128],
+            "duration-ms": 2000,
+            "setup": ["ip netns add ..."],     optional shell commands, e.g. for a tun pair in a namespace
+            "teardown": ["ip netns del ..."],
+            "config": { "name": "...", "nodes": [ ... ] }
+        }
+
+    For every (payload size, concurrency) pair the clients run ping-pong exchanges over persistent connections:
+    write one payload, wait until the echo of it is back, repeat. A round trip is one latency sample, the chain
+    carries each payload twice (up and down). Then a connection phase opens, uses (1 byte echo) and closes
+    connections with the same concurrency to count connections per second.
+
+    Reported per pair:
+
+        gbps            bytes carried by the chain in both directions
+        exchanges/s     completed round trips
+        latency us      p50 / p99 / p999 of the round trips
+        cpu ns/byte     cpu time of the process minus the cpu time of the harness threads, per carried byte
+        conn/s          completed connections of the connection phase
+
+    The output is one json document (stdout, or the file given with -o), WW_BENCH_COMMIT is copied into it so the
+    results of several commits can be compared:
+
+        WW_BENCH_COMMIT=$(git rev-parse --short HEAD) ./bench_e2e core/tests/e2e/tcp_mux.json -o mux.json
+
+    The core cannot be restarted in one process, so each run takes one spec. Configure with -DBUILD_BENCHMARKS=ON,
+    the binary links the same tunnels as the core (the INCLUDE_* options). Linux only.
+
+*/
+#include "wwapi.h"
+
+#include "imported_tunnels.h"
+#include "loggers/core_logger.h"
+#include "wproc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+enum
+{
+    kMaxConcurrency   = 1024,
+    kMaxMatrixEntries = 16,
+    kEchoBufferSize   = 1 << 18,
+    kWarmupMs         = 200,
+    kConnectPhaseMs   = 1000,
+    kStartupTimeoutMs = 5000,
+    kMaxSamples       = 1 << 22
+};
+
+typedef struct bench_spec_s
+{
+    char       *name;
+    int         workers;
+    sockaddr_u  entry;
+    sockaddr_u  sink;
+    int         payload_sizes[kMaxMatrixEntries];
+    int         concurrency[kMaxMatrixEntries];
+    int         payload_sizes_len;
+    int         concurrency_len;
+    int         duration_ms;
+    cJSON      *root;
+    const cJSON *setup;
+    const cJSON *teardown;
+
+} bench_spec_t;
+
+typedef struct echo_conn_s
+{
+    int      fd;
+    uint32_t head;
+    uint32_t len;
+    uint8_t *buf;
+
+} echo_conn_t;
+
+typedef struct client_conn_s
+{
+    int                fd;
+    uint32_t           sent;
+    uint32_t           received;
+    unsigned long long started_us;
+
+} client_conn_t;
+
+typedef struct bench_result_s
+{
+    int    payload_size;
+    int    concurrency;
+    double gbps;
+    double exchanges_per_sec;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    double cpu_ns_per_byte;
+    double conns_per_sec;
+
+} bench_result_t;
+
+static atomic_bool   echo_stop;
+static atomic_ullong echo_cpu_us;
+static int           echo_listen_fd = -1;
+
+/* --------------------------------------------------- helpers --------------------------------------------------- */
+
+static unsigned long long threadCpuUs(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return (unsigned long long) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+           (unsigned long long) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static unsigned long long processCpuUs(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (unsigned long long) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+           (unsigned long long) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int connectTo(const sockaddr_u *addr)
+{
+    int fd = socket(addr->sa.sa_family, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    setNonBlocking(fd);
+    if (connect(fd, &addr->sa, SOCKADDR_LEN(addr)) != 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool parseAddress(sockaddr_u *dest, const cJSON *root, const char *key)
+{
+    char *value = NULL;
+    if (! getStringFromJsonObject(&value, root, key))
+    {
+        return false;
+    }
+    char *colon = strrchr(value, ':');
+    if (colon == NULL)
+    {
+        memoryFree(value);
+        return false;
+    }
+    *colon = '\0';
+    sockaddrSetIp(dest, value);
+    sockaddrSetPort(dest, (uint16_t) atoi(colon + 1));
+    memoryFree(value);
+    return true;
+}
+
+static int parseIntArray(int *dest, const cJSON *root, const char *key)
+{
+    const cJSON *arr = cJSON_GetObjectItemCaseSensitive(root, key);
+    const cJSON *item;
+    int          len = 0;
+    cJSON_ArrayForEach(item, arr)
+    {
+        if (cJSON_IsNumber(item) && item->valueint > 0 && len < kMaxMatrixEntries)
+        {
+            dest[len++] = item->valueint;
+        }
+    }
+    return len;
+}
+
+static void runCommands(const cJSON *commands)
+{
+    const cJSON *item;
+    cJSON_ArrayForEach(item, commands)
+    {
+        if (cJSON_IsString(item) && execCmd(item->valuestring).exit_code != 0)
+        {
+            printError("bench_e2e: command failed: %s\n", item->valuestring);
+            exit(1);
+        }
+    }
+}
+
+static int compareUll(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(unsigned long long *sorted, size_t len, double p)
+{
+    if (len == 0)
+    {
+        return 0;
+    }
+    size_t index = (size_t) (p * (double) (len - 1));
+    return (double) sorted[index];
+}
+
+/* ------------------------------------------------- echo server ------------------------------------------------- */
+
+static WTHREAD_ROUTINE(echoThread)
+{
+    (void) userdata;
+    static struct pollfd pfds[kMaxConcurrency + 1];
+    static echo_conn_t   conns[kMaxConcurrency];
+    int                  conns_len = 0;
+
+    unsigned long long cpu_start = threadCpuUs();
+
+    while (! atomicLoadExplicit(&echo_stop, memory_order_relaxed))
+    {
+        pfds[0] = (struct pollfd) {.fd = echo_listen_fd, .events = POLLIN};
+        for (int i = 0; i < conns_len; i++)
+        {
+            short events = 0;
+            if (conns[i].len < kEchoBufferSize)
+            {
+                events |= POLLIN;
+            }
+            if (conns[i].len > 0)
+            {
+                events |= POLLOUT;
+            }
+            pfds[i + 1] = (struct pollfd) {.fd = conns[i].fd, .events = events};
+        }
+
+        if (poll(pfds, (nfds_t) conns_len + 1, 50) <= 0)
+        {
+            atomicStoreExplicit(&echo_cpu_us, threadCpuUs() - cpu_start, memory_order_relaxed);
+            continue;
+        }
+
+        if (pfds[0].revents & POLLIN)
+        {
+            int fd;
+            while (conns_len < kMaxConcurrency && (fd = accept(echo_listen_fd, NULL, NULL)) >= 0)
+            {
+                setNonBlocking(fd);
+                if (conns[conns_len].buf == NULL)
+                {
+                    conns[conns_len].buf = memoryAllocate(kEchoBufferSize);
+                }
+                conns[conns_len].fd   = fd;
+                conns[conns_len].head = 0;
+                conns[conns_len].len  = 0;
+                conns_len++;
+            }
+        }
+
+        for (int i = conns_len - 1; i >= 0; i--)
+        {
+            echo_conn_t *c      = &conns[i];
+            short        events = pfds[i + 1].revents;
+            bool         closed = (events & (POLLERR | POLLHUP)) != 0;
+
+            if (! closed && (events & POLLIN))
+            {
+                // the buffer is a ring, read into the free part after the pending bytes
+                uint32_t tail  = (c->head + c->len) % kEchoBufferSize;
+                uint32_t space = min(kEchoBufferSize - c->len, kEchoBufferSize - tail);
+                ssize_t  n     = recv(c->fd, c->buf + tail, space, 0);
+                if (n == 0 || (n < 0 && errno != EAGAIN))
+                {
+                    closed = true;
+                }
+                else if (n > 0)
+                {
+                    c->len += (uint32_t) n;
+                }
+            }
+            if (! closed && c->len > 0)
+            {
+                uint32_t chunk = min(c->len, kEchoBufferSize - c->head);
+                ssize_t  n     = send(c->fd, c->buf + c->head, chunk, MSG_NOSIGNAL);
+                if (n < 0 && errno != EAGAIN)
+                {
+                    closed = true;
+                }
+                else if (n > 0)
+                {
+                    c->head = (c->head + (uint32_t) n) % kEchoBufferSize;
+                    c->len -= (uint32_t) n;
+                }
+            }
+            if (closed)
+            {
+                close(c->fd);
+                uint8_t *buf = c->buf;
+                *c           = conns[--conns_len];
+                conns[conns_len].buf = buf;
+            }
+        }
+        atomicStoreExplicit(&echo_cpu_us, threadCpuUs() - cpu_start, memory_order_relaxed);
+    }
+    return 0;
+}
+
+/* --------------------------------------------------- clients --------------------------------------------------- */
+
+static void waitForEntry(const bench_spec_t *spec)
+{
+    unsigned long long deadline = getHRTimeUs() + kStartupTimeoutMs * 1000ULL;
+    while (getHRTimeUs() < deadline)
+    {
+        int fd = socket(spec->entry.sa.sa_family, SOCK_STREAM, 0);
+        if (connect(fd, &spec->entry.sa, SOCKADDR_LEN(&spec->entry)) == 0)
+        {
+            close(fd);
+            return;
+        }
+        close(fd);
+        usleep(20000);
+    }
+    printError("bench_e2e: the graph did not start listening on the entry address\n");
+    exit(1);
+}
+
+static void runExchanges(const bench_spec_t *spec, int payload_size, int concurrency, bench_result_t *result)
+{
+    static struct pollfd      pfds[kMaxConcurrency];
+    static client_conn_t      conns[kMaxConcurrency];
+    static unsigned long long samples[kMaxSamples];
+    size_t                    samples_len = 0;
+
+    uint8_t *payload = memoryAllocate((size_t) payload_size);
+    uint8_t *sink    = memoryAllocate((size_t) payload_size);
+    memorySet(payload, 0x5A, (size_t) payload_size);
+
+    for (int i = 0; i < concurrency; i++)
+    {
+        conns[i] = (client_conn_t) {.fd = connectTo(&spec->entry), .started_us = getHRTimeUs()};
+        if (conns[i].fd < 0)
+        {
+            printError("bench_e2e: connect to the entry failed\n");
+            exit(1);
+        }
+    }
+
+    unsigned long long begin_us        = getHRTimeUs();
+    unsigned long long measure_from_us = begin_us + kWarmupMs * 1000ULL;
+    unsigned long long end_us          = measure_from_us + (unsigned long long) spec->duration_ms * 1000ULL;
+    unsigned long long exchanges       = 0;
+    unsigned long long cpu_process     = 0;
+    unsigned long long cpu_self        = 0;
+    unsigned long long cpu_echo        = 0;
+    bool               measuring       = false;
+
+    for (;;)
+    {
+        unsigned long long now = getHRTimeUs();
+        if (! measuring && now >= measure_from_us)
+        {
+            measuring   = true;
+            cpu_process = processCpuUs();
+            cpu_self    = threadCpuUs();
+            cpu_echo    = atomicLoadExplicit(&echo_cpu_us, memory_order_relaxed);
+        }
+        if (now >= end_us)
+        {
+            break;
+        }
+
+        for (int i = 0; i < concurrency; i++)
+        {
+            pfds[i] = (struct pollfd) {.fd     = conns[i].fd,
+                                       .events = conns[i].sent < (uint32_t) payload_size ? POLLOUT : POLLIN};
+        }
+        if (poll(pfds, (nfds_t) concurrency, 50) <= 0)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < concurrency; i++)
+        {
+            client_conn_t *c = &conns[i];
+            if (pfds[i].revents & (POLLERR | POLLHUP))
+            {
+                printError("bench_e2e: the graph closed a client connection\n");
+                exit(1);
+            }
+            if (pfds[i].revents & POLLOUT)
+            {
+                ssize_t n = send(c->fd, payload + c->sent, (size_t) payload_size - c->sent, MSG_NOSIGNAL);
+                if (n > 0)
+                {
+                    c->sent += (uint32_t) n;
+                }
+            }
+            if (pfds[i].revents & POLLIN)
+            {
+                ssize_t n = recv(c->fd, sink, (size_t) payload_size - c->received, 0);
+                if (n > 0)
+                {
+                    c->received += (uint32_t) n;
+                }
+            }
+            if (c->received == (uint32_t) payload_size)
+            {
+                unsigned long long done_us = getHRTimeUs();
+                if (measuring)
+                {
+                    exchanges++;
+                    if (samples_len < kMaxSamples)
+                    {
+                        samples[samples_len++] = done_us - c->started_us;
+                    }
+                }
+                c->sent       = 0;
+                c->received   = 0;
+                c->started_us = done_us;
+            }
+        }
+    }
+
+    unsigned long long elapsed_us   = end_us - measure_from_us;
+    unsigned long long harness_cpu  = (threadCpuUs() - cpu_self) +
+                                     (atomicLoadExplicit(&echo_cpu_us, memory_order_relaxed) - cpu_echo);
+    unsigned long long process_cpu  = processCpuUs() - cpu_process;
+    double             carried      = (double) exchanges * (double) payload_size * 2;
+
+    qsort(samples, samples_len, sizeof(samples[0]), compareUll);
+
+    result->payload_size      = payload_size;
+    result->concurrency       = concurrency;
+    result->gbps              = carried * 8 / ((double) elapsed_us * 1000);
+    result->exchanges_per_sec = (double) exchanges * 1e6 / (double) elapsed_us;
+    result->p50_us            = percentile(samples, samples_len, 0.50);
+    result->p99_us            = percentile(samples, samples_len, 0.99);
+    result->p999_us           = percentile(samples, samples_len, 0.999);
+    result->cpu_ns_per_byte =
+        carried > 0 ? (double) (process_cpu > harness_cpu ? process_cpu - harness_cpu : 0) * 1000 / carried : 0;
+
+    for (int i = 0; i < concurrency; i++)
+    {
+        close(conns[i].fd);
+    }
+    memoryFree(payload);
+    memoryFree(sink);
+}
+
+// open, echo 1 byte, close; every slot starts over as soon as its connection is done
+static double runConnections(const bench_spec_t *spec, int concurrency)
+{
+    static struct pollfd pfds[kMaxConcurrency];
+    static int           fds[kMaxConcurrency];
+    static bool          written[kMaxConcurrency];
+
+    for (int i = 0; i < concurrency; i++)
+    {
+        fds[i]     = connectTo(&spec->entry);
+        written[i] = false;
+    }
+
+    unsigned long long begin_us = getHRTimeUs();
+    unsigned long long end_us   = begin_us + kConnectPhaseMs * 1000ULL;
+    unsigned long long done     = 0;
+    uint8_t            byte     = 0x5A;
+
+    while (getHRTimeUs() < end_us)
+    {
+        for (int i = 0; i < concurrency; i++)
+        {
+            pfds[i] = (struct pollfd) {.fd = fds[i], .events = written[i] ? POLLIN : POLLOUT};
+        }
+        if (poll(pfds, (nfds_t) concurrency, 50) <= 0)
+        {
+            continue;
+        }
+        for (int i = 0; i < concurrency; i++)
+        {
+            bool restart = (pfds[i].revents & (POLLERR | POLLHUP)) != 0;
+
+            if (! restart && ! written[i] && (pfds[i].revents & POLLOUT))
+            {
+                written[i] = send(fds[i], &byte, 1, MSG_NOSIGNAL) == 1;
+            }
+            else if (! restart && written[i] && (pfds[i].revents & POLLIN))
+            {
+                uint8_t back;
+                if (recv(fds[i], &back, 1, 0) == 1)
+                {
+                    done++;
+                }
+                restart = true;
+            }
+            if (restart)
+            {
+                close(fds[i]);
+                fds[i]     = connectTo(&spec->entry);
+                written[i] = false;
+            }
+        }
+    }
+
+    for (int i = 0; i < concurrency; i++)
+    {
+        close(fds[i]);
+    }
+    return (double) done * 1e6 / (double) (getHRTimeUs() - begin_us);
+}
+
+/* ---------------------------------------------------- main ----------------------------------------------------- */
+
+static void parseSpec(bench_spec_t *spec, const char *path)
+{
+    char *content = readFile(path);
+    if (content == NULL)
+    {
+        printError("bench_e2e: could not read spec file \"%s\"\n", path);
+        exit(1);
+    }
+    spec->root = cJSON_Parse(content);
+    memoryFree(content);
+
+    if (! cJSON_IsObject(spec->root) || ! getStringFromJsonObject(&spec->name, spec->root, "name") ||
+        ! parseAddress(&spec->entry, spec->root, "entry") || ! parseAddress(&spec->sink, spec->root, "sink") ||
+        ! cJSON_IsObject(cJSON_GetObjectItemCaseSensitive(spec->root, "config")))
+    {
+        printError("bench_e2e: spec \"%s\" needs name, entry, sink and config\n", path);
+        exit(1);
+    }
+
+    getIntFromJsonObjectOrDefault(&spec->workers, spec->root, "workers", 1);
+    getIntFromJsonObjectOrDefault(&spec->duration_ms, spec->root, "duration-ms", 2000);
+    spec->payload_sizes_len = parseIntArray(spec->payload_sizes, spec->root, "payload-sizes");
+    spec->concurrency_len   = parseIntArray(spec->concurrency, spec->root, "concurrency");
+    spec->setup             = cJSON_GetObjectItemCaseSensitive(spec->root, "setup");
+    spec->teardown          = cJSON_GetObjectItemCaseSensitive(spec->root, "teardown");
+
+    if (spec->payload_sizes_len == 0 || spec->concurrency_len == 0)
+    {
+        printError("bench_e2e: spec \"%s\" needs payload-sizes and concurrency\n", path);
+        exit(1);
+    }
+    for (int i = 0; i < spec->concurrency_len; i++)
+    {
+        spec->concurrency[i] = min(spec->concurrency[i], kMaxConcurrency);
+    }
+}
+
+static WTHREAD_ROUTINE(coreThread)
+{
+    (void) userdata;
+    socketmanagerStart();
+    runMainThread();
+    return 0;
+}
+
+static void startCore(const bench_spec_t *spec)
+{
+    // the graph is loaded through the normal config parser, so it gets its own file
+    static const char *config_path = "bench_e2e_config.json";
+    char              *config      = cJSON_Print(cJSON_GetObjectItemCaseSensitive(spec->root, "config"));
+    if (! writeFile(config_path, config, strlen(config)))
+    {
+        printError("bench_e2e: could not write \"%s\"\n", config_path);
+        exit(1);
+    }
+    cJSON_free(config);
+
+    ww_construction_data_t runtime_data = {
+        .workers_count = (unsigned int) max(1, spec->workers),
+        .ram_profile   = kRamProfileM1Memory,
+        .internal_logger_data =
+            (logger_construction_data_t) {.log_file_path = "bench_e2e_internal.log", .log_level = stringDuplicate("ERROR")},
+        .core_logger_data =
+            (logger_construction_data_t) {.log_file_path = "bench_e2e_core.log", .log_level = stringDuplicate("ERROR")},
+        .network_logger_data =
+            (logger_construction_data_t) {.log_file_path = "bench_e2e_network.log", .log_level = stringDuplicate("ERROR")},
+        .dns_logger_data =
+            (logger_construction_data_t) {.log_file_path = "bench_e2e_dns.log", .log_level = stringDuplicate("ERROR")},
+    };
+
+    createGlobalState(runtime_data);
+    loadImportedTunnelsIntoCore();
+    nodemanagerRunConfigFile(parseConfigFile(config_path));
+
+    threadCreate(coreThread, NULL);
+    waitForEntry(spec);
+}
+
+static void startEcho(const bench_spec_t *spec)
+{
+    echo_listen_fd = socket(spec->sink.sa.sa_family, SOCK_STREAM, 0);
+    int one        = 1;
+    setsockopt(echo_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(echo_listen_fd, &spec->sink.sa, SOCKADDR_LEN(&spec->sink)) != 0 || listen(echo_listen_fd, 4096) != 0)
+    {
+        printError("bench_e2e: could not listen on the sink address\n");
+        exit(1);
+    }
+    setNonBlocking(echo_listen_fd);
+    threadCreate(echoThread, NULL);
+}
+
+static cJSON *resultsToJson(const bench_spec_t *spec, const bench_result_t *results, int count)
+{
+    cJSON *doc = cJSON_CreateObject();
+    cJSON_AddStringToObject(doc, "benchmark", spec->name);
+    cJSON_AddStringToObject(doc, "commit", getenv("WW_BENCH_COMMIT") ? getenv("WW_BENCH_COMMIT") : "unknown");
+    cJSON_AddNumberToObject(doc, "timestamp", (double) time(NULL));
+    cJSON_AddNumberToObject(doc, "workers", spec->workers);
+
+    // the node types of the graph in config order, the pairs of the chain
+    cJSON       *nodes = cJSON_AddArrayToObject(doc, "nodes");
+    const cJSON *node;
+    cJSON_ArrayForEach(node, cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(spec->root, "config"),
+                                                              "nodes"))
+    {
+        const cJSON *type = cJSON_GetObjectItemCaseSensitive(node, "type");
+        if (cJSON_IsString(type))
+        {
+            cJSON_AddItemToArray(nodes, cJSON_CreateString(type->valuestring));
+        }
+    }
+
+    cJSON *arr = cJSON_AddArrayToObject(doc, "results");
+    for (int i = 0; i < count; i++)
+    {
+        const bench_result_t *r    = &results[i];
+        cJSON                *item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "payload-size", r->payload_size);
+        cJSON_AddNumberToObject(item, "concurrency", r->concurrency);
+        cJSON_AddNumberToObject(item, "gbps", r->gbps);
+        cJSON_AddNumberToObject(item, "exchanges-per-sec", r->exchanges_per_sec);
+        cJSON_AddNumberToObject(item, "latency-p50-us", r->p50_us);
+        cJSON_AddNumberToObject(item, "latency-p99-us", r->p99_us);
+        cJSON_AddNumberToObject(item, "latency-p999-us", r->p999_us);
+        cJSON_AddNumberToObject(item, "cpu-ns-per-byte", r->cpu_ns_per_byte);
+        cJSON_AddNumberToObject(item, "connections-per-sec", r->conns_per_sec);
+        cJSON_AddItemToArray(arr, item);
+    }
+    return doc;
+}
+
+int main(int argc, char **argv)
+{
+    const char *spec_path   = NULL;
+    const char *output_path = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            output_path = argv[++i];
+        }
+        else
+        {
+            spec_path = argv[i];
+        }
+    }
+    if (spec_path == NULL)
+    {
+        printError("usage: bench_e2e <spec.json> [-o results.json]\n");
+        return 1;
+    }
+
+    initWLibc();
+
+    static bench_spec_t spec;
+    parseSpec(&spec, spec_path);
+    runCommands(spec.setup);
+
+    startEcho(&spec);
+    startCore(&spec);
+
+    static bench_result_t results[kMaxMatrixEntries * kMaxMatrixEntries];
+    int                   results_len = 0;
+
+    for (int pi = 0; pi < spec.payload_sizes_len; pi++)
+    {
+        for (int ci = 0; ci < spec.concurrency_len; ci++)
+        {
+            bench_result_t *r = &results[results_len++];
+            runExchanges(&spec, spec.payload_sizes[pi], spec.concurrency[ci], r);
+            r->conns_per_sec = runConnections(&spec, spec.concurrency[ci]);
+
+            fprintf(stderr, "%-16s payload %6d  concurrency %4d  %8.3f gbps  p50 %8.1f us  p99 %8.1f us  %8.0f conn/s\n",
+                    spec.name, r->payload_size, r->concurrency, r->gbps, r->p50_us, r->p99_us, r->conns_per_sec);
+        }
+    }
+
+    atomicStoreExplicit(&echo_stop, true, memory_order_relaxed);
+    runCommands(spec.teardown);
+
+    cJSON *doc  = resultsToJson(&spec, results, results_len);
+    char  *text = cJSON_Print(doc);
+    if (output_path != NULL)
+    {
+        writeFile(output_path, text, strlen(text));
+    }
+    else
+    {
+        printf("%s\n", text);
+    }
+    cJSON_free(text);
+    cJSON_Delete(doc);
+
+    // the workers have no shutdown path, leave without joining them
+    fflush(stdout);
+    _exit(0);
+}
@@ -9,7 +9,7 @@
 bool applyFreeBindRandomDestIp(tunnel_t* self,connection_context_t *dest_ctx)
 {
 
-    tcp_connector_state_t* state = TSTATE(self);
+    tcp_connector_state_t* state = tunnelGetState(self);
 
     unsigned int seed = fastRand();
 
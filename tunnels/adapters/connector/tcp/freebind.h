@@ -1,5 +1,5 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
 #include "types.h"
 
 
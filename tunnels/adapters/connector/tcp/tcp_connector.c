@@ -5,57 +5,141 @@
 #include "freebind.h"
 #include "wsocket.h"
 #include "loggers/network_logger.h"
+#include "managers/socket_manager.h"
 #include "sync_dns.h"
 #include "tunnel.h"
 #include "types.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
+enum tcp_connector_metrics_e
+{
+    kTcpConnectorMetricBytesUp,
+    kTcpConnectorMetricBytesDown,
+    kTcpConnectorMetricUpstreamEjections,
+    kTcpConnectorMetricQueuedBytes
+};
+
+static const metric_desc_t kTcpConnectorMetrics[] = {
+    [kTcpConnectorMetricBytesUp]   = {.name = "ww_tcpconnector_bytes_up_total",
+                                      .help = "bytes written to the upstream sockets",
+                                      .type = kMetricTypeCounter},
+    [kTcpConnectorMetricBytesDown] = {.name = "ww_tcpconnector_bytes_down_total",
+                                      .help = "bytes read from the upstream sockets",
+                                      .type = kMetricTypeCounter},
+    [kTcpConnectorMetricUpstreamEjections] = {.name = "ww_tcpconnector_upstream_ejections_total",
+                                              .help = "upstreams ejected after failed connects",
+                                              .type = kMetricTypeCounter},
+    [kTcpConnectorMetricQueuedBytes]       = {.name = "ww_tcpconnector_write_queued_bytes",
+                                              .help = "bytes waiting to be written to the upstream sockets",
+                                              .type = kMetricTypeGauge},
+};
+
+static void reportConnectFailure(tcp_connector_lstate_t *ls)
+{
+    tcp_connector_state_t *state = tunnelGetState(ls->tunnel);
+    if (ls->upstream_selected &&
+        upstreamsOnConnectFailed(state->upstreams, ls->upstream_index, wloopNowMS(getWorkerLoop(getWID()))))
+    {
+        tunnelMetricAdd(ls->tunnel, kTcpConnectorMetricUpstreamEjections, 1);
+    }
 
+    // the listeners of this chain stop getting new clients from their balance group for a while
+    tcp_connector_failures_t *failures = &state->connect_failures[getWID()];
+    if (++(failures->count) >= kTcpConnectorUnhealthyFailures)
+    {
+        failures->count = 0;
+        LOGW("TcpConnector: %d connects in a row failed, marking the chain unhealthy for %d seconds",
+             kTcpConnectorUnhealthyFailures, kTcpConnectorUnhealthyHoldMs / 1000);
+        socketacceptorSetChainUnhealthy(tunnelGetChain(ls->tunnel), kTcpConnectorUnhealthyHoldMs);
+    }
+}
 
-static void cleanup(tcp_connector_con_state_t *cstate, bool flush_queue)
+static void raceDestroy(tcp_connector_race_t *race)
 {
-    if (cstate->io)
+    if (race->timer != NULL)
     {
-        weventSetUserData(cstate->io, NULL);
-        while (contextqueueLen(cstate->data_queue) > 0)
+        wtimerDelete(race->timer);
+    }
+    for (int i = 0; i < race->addrs_count; i++)
+    {
+        if (race->attempts[i] != NULL)
+        {
+            weventSetUserData(race->attempts[i], NULL);
+            wioClose(race->attempts[i]);
+        }
+    }
+    race->ls->race = NULL;
+    memoryFree(race);
+}
+
+static void cleanup(tcp_connector_lstate_t *ls, bool flush_queue)
+{
+    if (ls->race != NULL)
+    {
+        raceDestroy(ls->race);
+    }
+    if (ls->upstream_selected)
+    {
+        tcp_connector_state_t *state = tunnelGetState(ls->tunnel);
+        if (! ls->established)
+        {
+            upstreamsOnConnectAborted(state->upstreams, ls->upstream_index);
+        }
+        upstreamsOnLineClosed(state->upstreams, ls->upstream_index);
+    }
+    if (ls->io)
+    {
+        weventSetUserData(ls->io, NULL);
+        while (bufferqueueLen(ls->data_queue) > 0)
         {
             // all data must be written before sending fin, event loop will hold them for us
-            context_t *cw = contextqueuePop(cstate->data_queue);
+            sbuf_t *buf = bufferqueuePop(ls->data_queue);
 
             if (flush_queue)
             {
-                wioWrite(cstate->io, cw->payload);
-                contextDropPayload(cw);
+                wioWrite(ls->io, buf);
             }
             else
             {
-                contextReusePayload(cw);
+                bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), buf);
             }
-            contextDestroy(cw);
         }
 
-        wioClose(cstate->io);
+        wioClose(ls->io);
     }
-    if (cstate->write_paused)
+    writebudgetDestroy(&ls->write_budget);
+    bufferqueueDestory(ls->data_queue);
+    lineClearState(ls, sizeof(tcp_connector_lstate_t));
+}
+
+// pauses the lower side above the high watermark and resumes it at the low one, may run the writer (call it last)
+static void updateWriteBudget(tcp_connector_lstate_t *ls)
+{
+    size_t held = bufferqueueBytes(ls->data_queue) + (ls->established ? wioGetWriteBufSize(ls->io) : 0);
+
+    switch (writebudgetUpdate(&ls->write_budget, held))
     {
-        resumeLineDownSide(cstate->line);
+    case kWriteBudgetPause:
+        ls->tunnel->dw->fnPauseD(ls->tunnel->dw, ls->line);
+        break;
+    case kWriteBudgetResume:
+        ls->tunnel->dw->fnResumeD(ls->tunnel->dw, ls->line);
+        break;
+    default:
+        break;
     }
-    doneLineUpSide(cstate->line);
-    contextqueueDestory(cstate->data_queue);
-    memoryFree(cstate);
 }
 
-static bool resumeWriteQueue(tcp_connector_con_state_t *cstate)
+static bool resumeWriteQueue(tcp_connector_lstate_t *ls)
 {
-    context_queue_t *data_queue = (cstate)->data_queue;
-    wio_t           *io         = cstate->io;
-    while (contextqueueLen(data_queue) > 0)
-    {
-        context_t *cw     = contextqueuePop(data_queue);
-        int        bytes  = (int) sbufGetBufLength(cw->payload);
-        int        nwrite = wioWrite(io, cw->payload);
-        contextDropPayload(cw);
-        contextDestroy(cw);
+    buffer_queue_t *data_queue = ls->data_queue;
+    wio_t          *io         = ls->io;
+    while (bufferqueueLen(data_queue) > 0)
+    {
+        sbuf_t *buf    = bufferqueuePop(data_queue);
+        int     bytes  = (int) sbufGetBufLength(buf);
+        int     nwrite = wioWrite(io, buf);
+        tunnelMetricAdd(ls->tunnel, kTcpConnectorMetricBytesUp, (uint64_t) bytes);
         if (nwrite >= 0 && nwrite < bytes)
         {
             return false; // write pending
@@ -68,53 +152,51 @@ static bool resumeWriteQueue(tcp_connector_con_state_t *cstate)
 static void onWriteComplete(wio_t *io)
 {
     // resume the read on other end of the connection
-    tcp_connector_con_state_t *cstate = (tcp_connector_con_state_t *) (weventGetUserdata(io));
-    if (UNLIKELY(cstate == NULL))
+    tcp_connector_lstate_t *ls = (tcp_connector_lstate_t *) (weventGetUserdata(io));
+    if (UNLIKELY(ls == NULL))
     {
         return;
     }
 
-    if (wioCheckWriteComplete(io))
+    if (wioCheckWriteComplete(io) && resumeWriteQueue(ls))
     {
-
-        context_queue_t *data_queue = cstate->data_queue;
-        if (contextqueueLen(data_queue) > 0 && ! resumeWriteQueue(cstate))
-        {
-            return;
-        }
-        wioSetCallBackWrite(cstate->io, NULL);
-        cstate->write_paused = false;
-        resumeLineDownSide(cstate->line);
+        wioSetCallBackWrite(ls->io, NULL);
+        ls->write_paused = false;
     }
+    updateWriteBudget(ls);
 }
 
 static void onRecv(wio_t *io, sbuf_t *buf)
 {
-    tcp_connector_con_state_t *cstate = (tcp_connector_con_state_t *) (weventGetUserdata(io));
-    if (UNLIKELY(cstate == NULL))
+    tcp_connector_lstate_t *ls = (tcp_connector_lstate_t *) (weventGetUserdata(io));
+    if (UNLIKELY(ls == NULL))
     {
         bufferpoolResuesBuffer(wloopGetBufferPool(weventGetLoop(io)), buf);
         return;
     }
-    sbuf_t *payload = buf;
-    tunnel_t       *self    = (cstate)->tunnel;
-    line_t         *line    = (cstate)->line;
+    tunnel_t *self = ls->tunnel;
+
+    wloopStatsSetOwner(tunnelGetNode(self)->name);
+    tunnelMetricAdd(self, kTcpConnectorMetricBytesDown, sbufGetBufLength(buf));
 
-    context_t *context = contextCreate(line);
-    context->payload   = payload;
-    self->downStream(self, context);
+    self->dw->fnPayloadD(self->dw, ls->line, buf);
 }
 
 static void onClose(wio_t *io)
 {
-    tcp_connector_con_state_t *cstate = (tcp_connector_con_state_t *) (weventGetUserdata(io));
-    if (cstate != NULL)
+    tcp_connector_lstate_t *ls = (tcp_connector_lstate_t *) (weventGetUserdata(io));
+    if (ls != NULL)
     {
         LOGD("TcpConnector: received close for FD:%x ", wioGetFD(io));
-        tunnel_t  *self    = (cstate)->tunnel;
-        line_t    *line    = (cstate)->line;
-        context_t *context = contextCreateFin(line);
-        self->downStream(self, context);
+        tunnel_t *self = ls->tunnel;
+        line_t   *line = ls->line;
+
+        if (! ls->established)
+        {
+            reportConnectFailure(ls);
+        }
+        cleanup(ls, false);
+        self->dw->fnFinD(self->dw, line);
     }
     else
     {
@@ -122,32 +204,10 @@ static void onClose(wio_t *io)
     }
 }
 
-static void onLinePaused(void *userdata)
-{
-    tcp_connector_con_state_t *cstate = (tcp_connector_con_state_t *) (userdata);
-
-    if (! cstate->read_paused)
-    {
-        cstate->read_paused = true;
-        wioReadStop(cstate->io);
-    }
-}
-
-static void onLineResumed(void *userdata)
-{
-    tcp_connector_con_state_t *cstate = (tcp_connector_con_state_t *) (userdata);
-
-    if (cstate->read_paused)
-    {
-        cstate->read_paused = false;
-        wioRead(cstate->io);
-    }
-}
-
 static void onOutBoundConnected(wio_t *upstream_io)
 {
-    tcp_connector_con_state_t *cstate = weventGetUserdata(upstream_io);
-    if (UNLIKELY(cstate == NULL))
+    tcp_connector_lstate_t *ls = weventGetUserdata(upstream_io);
+    if (UNLIKELY(ls == NULL))
     {
         return;
     }
@@ -155,15 +215,27 @@ static void onOutBoundConnected(wio_t *upstream_io)
     struct timeval tv2;
     getTimeOfDay(&tv2, NULL);
 
-    double time_spent = (double) (tv2.tv_usec - (cstate->__profile_conenct).tv_usec) / 1000000 +
-                        (double) (tv2.tv_sec - (cstate->__profile_conenct).tv_sec);
+    double time_spent = (double) (tv2.tv_usec - (ls->__profile_conenct).tv_usec) / 1000000 +
+                        (double) (tv2.tv_sec - (ls->__profile_conenct).tv_sec);
     LOGD("TcpConnector: tcp connect took %d ms", (int) (time_spent * 1000));
 #endif
 
-    tunnel_t *self = cstate->tunnel;
-    line_t   *line = cstate->line;
+    tunnel_t *self = ls->tunnel;
+    line_t   *line = ls->line;
     wioSetCallBackRead(upstream_io, onRecv);
 
+    tcp_connector_state_t *state = tunnelGetState(self);
+    if (state->connect_failures[getWID()].count != 0)
+    {
+        state->connect_failures[getWID()].count = 0;
+    }
+
+    if (ls->upstream_selected)
+    {
+        upstreamsOnConnected(state->upstreams, ls->upstream_index,
+                             wloopNowMS(getWorkerLoop(getWID())) - ls->connect_start_ms);
+    }
+
     if (loggerCheckWriteLevel(getNetworkLogger(), LOG_LEVEL_DEBUG))
     {
         char localaddrstr[SOCKADDR_STRLEN] = {0};
@@ -174,228 +246,423 @@ static void onOutBoundConnected(wio_t *upstream_io)
              SOCKADDR_STR(wioGetPeerAddr(upstream_io), peeraddrstr));
     }
 
-    setupLineUpSide(line, onLinePaused, cstate, onLineResumed);
-    self->downStream(self, contextCreateEst(line));
+    ls->established = true;
+    if (! ls->read_paused)
+    {
+        wioRead(upstream_io);
+    }
+
+    if (resumeWriteQueue(ls))
+    {
+        ls->write_paused = false;
+    }
+    else
+    {
+        wioSetCallBackWrite(upstream_io, onWriteComplete);
+    }
+
+    updateWriteBudget(ls);
+
+    self->dw->fnEstD(self->dw, line);
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static wio_t *createOutboundIo(tcp_connector_state_t *state, sockaddr_u *addr)
 {
-    tcp_connector_con_state_t *cstate = CSTATE(c);
+    int sockfd = socket(addr->sa.sa_family, SOCK_STREAM, 0);
+
+    if (sockfd < 0)
+    {
+        LOGE("TcpConnector: socket fd < 0");
+        return NULL;
+    }
+
+    if (state->tcp_no_delay)
+    {
+        tcpNoDelay(sockfd, 1);
+    }
+
+    if (state->tcp_fast_open)
+    {
+        const int yes = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, (const char *) &yes, sizeof(yes));
+    }
 
-    if (c->payload != NULL)
+#ifdef OS_LINUX
+    if (state->fwmark != kFwMarkInvalid)
     {
-        if (cstate->write_paused)
+        if (setsockopt(sockfd, SOL_SOCKET, SO_MARK, &state->fwmark, sizeof(state->fwmark)) < 0)
         {
-            pauseLineDownSide(c->line);
-            contextqueuePush(cstate->data_queue, c);
+            LOGE("TcpConnector: setsockopt SO_MARK error");
+            closesocket(sockfd);
+            return NULL;
         }
-        else
-        {
-            int bytes  = (int) sbufGetBufLength(c->payload);
-            int nwrite = wioWrite(cstate->io, c->payload);
-            contextDropPayload(c);
+    }
+#endif
 
-            if (nwrite >= 0 && nwrite < bytes)
-            {
-                pauseLineDownSide(c->line);
-                cstate->write_paused = true;
-                wioSetCallBackWrite(cstate->io, onWriteComplete);
-            }
-            contextDestroy(c);
+    wio_t *io = wioGet(getWorkerLoop(getWID()), sockfd);
+    assert(io != NULL);
+
+    wioSetPeerAddr(io, &(addr->sa), (int) sockaddrLen(addr));
+    return io;
+}
+
+static void raceFail(tcp_connector_race_t *race)
+{
+    tcp_connector_lstate_t *ls   = race->ls;
+    tunnel_t               *self = ls->tunnel;
+    line_t                 *line = ls->line;
+
+    LOGD("TcpConnector: all %d addresses of %s failed", (int) race->addrs_count, line->dest_ctx.domain);
+    raceDestroy(race);
+    reportConnectFailure(ls);
+    cleanup(ls, false);
+    self->dw->fnFinD(self->dw, line);
+}
+
+static int raceFindAttempt(tcp_connector_race_t *race, wio_t *io)
+{
+    for (int i = 0; i < race->addrs_count; i++)
+    {
+        if (race->attempts[i] == io)
+        {
+            return i;
         }
     }
-    else
+    assert(false);
+    return -1;
+}
+
+static void onRaceConnected(wio_t *io)
+{
+    tcp_connector_race_t *race = weventGetUserdata(io);
+    if (UNLIKELY(race == NULL))
+    {
+        return;
+    }
+    tcp_connector_lstate_t *ls    = race->ls;
+    int                     index = raceFindAttempt(race, io);
+
+    // the winner leaves the race before the others are closed
+    race->attempts[index]              = NULL;
+    ls->line->dest_ctx.address         = race->addrs[index];
+    ls->line->dest_ctx.domain_resolved = true;
+    raceDestroy(race);
+
+    ls->io = io;
+    weventSetUserData(io, ls);
+    wioSetCallBackClose(io, onClose);
+    onOutBoundConnected(io);
+}
+
+static void onRaceClose(wio_t *io);
+
+static bool raceStartNext(tcp_connector_race_t *race)
+{
+    tcp_connector_state_t *state = tunnelGetState(race->ls->tunnel);
+
+    while (race->next_addr < race->addrs_count)
     {
-        if (c->init)
+        uint8_t index = race->next_addr++;
+        wio_t  *io    = createOutboundIo(state, &(race->addrs[index]));
+        if (io == NULL)
         {
-            tcp_connector_state_t *state = TSTATE(self);
-            CSTATE_MUT(c)                = memoryAllocate(sizeof(tcp_connector_con_state_t));
-            cstate                       = CSTATE(c);
+            continue;
+        }
+        race->attempts[index] = io;
+        race->attempts_alive++;
+        weventSetUserData(io, race);
+        wioSetCallBackConnect(io, onRaceConnected);
+        wioSetCallBackClose(io, onRaceClose);
+        // a failing connect closes the io asynchronously, the race is never re-entered from here
+        wioConnect(io);
+        return true;
+    }
+    return false;
+}
 
-            *cstate = (tcp_connector_con_state_t) {.buffer_pool  = contextGetBufferPool(c),
-                                                   .tunnel       = self,
-                                                   .line         = c->line,
-                                                   .data_queue   = contextqueueCreate(),
-                                                   .write_paused = true};
+static void onRaceClose(wio_t *io)
+{
+    tcp_connector_race_t *race = weventGetUserdata(io);
+    if (race == NULL)
+    {
+        return;
+    }
+    race->attempts[raceFindAttempt(race, io)] = NULL;
+    race->attempts_alive--;
 
-#ifdef PROFILE
-            getTimeOfDay(&(cstate->__profile_conenct), NULL);
-#endif
+    // a failed attempt does not wait for the delay, the next address starts right away
+    if (! raceStartNext(race) && race->attempts_alive == 0)
+    {
+        raceFail(race);
+    }
+}
 
-            connection_context_t *dest_ctx = &(c->line->dest_ctx);
-            connection_context_t *src_ctx  = &(c->line->src_ctx);
-            switch ((enum tcp_connector_dynamic_value_status) state->dest_addr_selected.status)
-            {
-            case kCdvsFromSource:
-                connectionContextAddrCopy(dest_ctx, src_ctx);
-                break;
-            case kCdvsConstant:
-                connectionContextAddrCopy(dest_ctx, &(state->constant_dest_addr));
-                break;
-            default:
-            case kCdvsFromDest:
-                break;
-            }
-            switch ((enum tcp_connector_dynamic_value_status) state->dest_port_selected.status)
-            {
-            case kCdvsFromSource:
-                connectionContextPortCopy(dest_ctx, src_ctx);
-                break;
-            case kCdvsConstant:
-                connectionContextPortCopy(dest_ctx, &(state->constant_dest_addr));
-                break;
-            default:
-            case kCdvsFromDest:
-                break;
-            }
+static void onRaceTimer(wtimer_t *timer)
+{
+    tcp_connector_race_t *race = weventGetUserdata(timer);
 
-            if (dest_ctx->address_type == kSatDomainName)
-            {
-                if (! dest_ctx->domain_resolved)
-                {
-                    if (! resolveContextSync(dest_ctx))
-                    {
-                        CSTATE_DROP(c);
-                        cleanup(cstate, false);
-                        goto fail;
-                    }
-                }
-            }
+    raceStartNext(race);
+    if (race->next_addr >= race->addrs_count)
+    {
+        wtimerDelete(timer);
+        race->timer = NULL;
+    }
+}
 
-            if (state->outbound_ip_range > 0)
-            {
-                if (! applyFreeBindRandomDestIp(self, dest_ctx))
-                {
-                    CSTATE_DROP(c);
-                    cleanup(cstate, false);
-                    goto fail;
-                }
-            }
+static bool raceStart(tcp_connector_lstate_t *ls, connection_context_t *dest_ctx)
+{
+    tcp_connector_state_t *state = tunnelGetState(ls->tunnel);
+    tcp_connector_race_t  *race  = memoryAllocate(sizeof(tcp_connector_race_t));
+    memorySet(race, 0, sizeof(tcp_connector_race_t));
 
-            // sockaddr_set_ipport(&(dest_ctx.addr), "127.0.0.1", 443);
+    if (dest_ctx->domain_strategy == kDsInvalid)
+    {
+        dest_ctx->domain_strategy = (enum domain_strategy) state->domain_strategy;
+    }
 
-            wloop_t *loop   = getWorkerLoop(getWID());
-            int      sockfd = socket(dest_ctx->address.sa.sa_family, SOCK_STREAM, 0);
+    int count = resolveContextSyncAll(dest_ctx, race->addrs, kTcpConnectorRaceMaxAddrs);
+    if (count <= 1)
+    {
+        // nothing to race, the caller connects the plain way
+        if (count == 1)
+        {
+            dest_ctx->address         = race->addrs[0];
+            dest_ctx->domain_resolved = true;
+        }
+        memoryFree(race);
+        return count == 1;
+    }
 
-            if (sockfd < 0)
-            {
-                LOGE("TcpConnector: socket fd < 0");
-                CSTATE_DROP(c);
-                cleanup(cstate, false);
-                goto fail;
-            }
+    race->ls          = ls;
+    race->addrs_count = (uint8_t) count;
+    ls->race          = race;
 
-            if (state->tcp_no_delay)
-            {
-                tcpNoDelay(sockfd, 1);
-            }
+    if (! raceStartNext(race))
+    {
+        ls->race = NULL;
+        memoryFree(race);
+        return false;
+    }
+    race->timer = wtimerAdd(getWorkerLoop(getWID()), onRaceTimer, (uint32_t) state->race_delay_ms, INFINITE);
+    weventSetUserData(race->timer, race);
+    return true;
+}
 
-            if (state->tcp_fast_open)
-            {
-                const int yes = 1;
-                setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, (const char *) &yes, sizeof(yes));
-            }
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    tcp_connector_state_t  *state = tunnelGetState(self);
+    tcp_connector_lstate_t *ls    = lineGetState(self, line);
 
-#ifdef OS_LINUX
-            if (state->fwmark != kFwMarkInvalid)
+    *ls = (tcp_connector_lstate_t) {.tunnel       = self,
+                                    .line         = line,
+                                    .data_queue   = bufferqueueCreate(getWorkerBufferPool(getWID())),
+                                    .write_paused = true};
+    writebudgetInit(&ls->write_budget, self, kTcpConnectorMetricQueuedBytes, state->write_high_water,
+                    state->write_low_water);
+
+#ifdef PROFILE
+    getTimeOfDay(&(ls->__profile_conenct), NULL);
+#endif
+
+    connection_context_t *dest_ctx = &(line->dest_ctx);
+    connection_context_t *src_ctx  = &(line->src_ctx);
+
+    if (state->upstreams != NULL)
+    {
+        ls->connect_start_ms  = wloopNowMS(getWorkerLoop(getWID()));
+        ls->upstream_index    = upstreamsSelect(state->upstreams, ls->connect_start_ms);
+        ls->upstream_selected = true;
+
+        connection_context_t *upstream = upstreamsGetAddress(state->upstreams, ls->upstream_index);
+        connectionContextAddrCopy(dest_ctx, upstream);
+        connectionContextPortCopy(dest_ctx, upstream);
+    }
+    else
+    {
+        switch ((enum tcp_connector_dynamic_value_status) state->dest_addr_selected.status)
+        {
+        case kCdvsFromSource:
+            connectionContextAddrCopy(dest_ctx, src_ctx);
+            break;
+        case kCdvsConstant:
+            connectionContextAddrCopy(dest_ctx, &(state->constant_dest_addr));
+            break;
+        default:
+        case kCdvsFromDest:
+            break;
+        }
+        switch ((enum tcp_connector_dynamic_value_status) state->dest_port_selected.status)
+        {
+        case kCdvsFromSource:
+            connectionContextPortCopy(dest_ctx, src_ctx);
+            break;
+        case kCdvsConstant:
+            connectionContextPortCopy(dest_ctx, &(state->constant_dest_addr));
+            break;
+        default:
+        case kCdvsFromDest:
+            break;
+        }
+    }
+
+    if (dest_ctx->address_type == kSatDomainName)
+    {
+        if (! dest_ctx->domain_resolved)
+        {
+            if (state->happy_eyeballs && state->outbound_ip_range == 0)
             {
-                if (setsockopt(sockfd, SOL_SOCKET, SO_MARK, &state->fwmark, sizeof(state->fwmark)) < 0)
+                if (! raceStart(ls, dest_ctx))
                 {
-                    LOGE("TcpConnector: setsockopt SO_MARK error");
-                    CSTATE_DROP(c);
-                    cleanup(cstate, false);
                     goto fail;
                 }
+                if (ls->race != NULL)
+                {
+                    return; // onRaceConnected takes over
+                }
+            }
+            else if (! resolveContextSync(dest_ctx))
+            {
+                goto fail;
             }
-#endif
-
-            wio_t *upstream_io = wioGet(loop, sockfd);
-            assert(upstream_io != NULL);
-
-            wioSetPeerAddr(upstream_io, &(dest_ctx->address.sa), (int) sockaddrLen(&(dest_ctx->address)));
-            cstate->io = upstream_io;
-            weventSetUserData(upstream_io, cstate);
-            wioSetCallBackConnect(upstream_io, onOutBoundConnected);
-            wioSetCallBackClose(upstream_io, onClose);
-            wioConnect(upstream_io);
-            contextDestroy(c);
         }
-        else if (c->fin)
+    }
+
+    if (state->outbound_ip_range > 0)
+    {
+        if (! applyFreeBindRandomDestIp(self, dest_ctx))
         {
-            CSTATE_DROP(c);
-            cleanup(cstate, true);
-            contextDestroy(c);
+            goto fail;
         }
     }
+
+    wio_t *upstream_io = createOutboundIo(state, &(dest_ctx->address));
+    if (upstream_io == NULL)
+    {
+        goto fail;
+    }
+
+    ls->io = upstream_io;
+    weventSetUserData(upstream_io, ls);
+    wioSetCallBackConnect(upstream_io, onOutBoundConnected);
+    wioSetCallBackClose(upstream_io, onClose);
+    wioConnect(upstream_io);
     return;
+
 fail:
-    self->dw->downStream(self->dw, contextCreateFinFrom(c));
-    contextDestroy(c);
+    reportConnectFailure(ls);
+    cleanup(ls, false);
+    self->dw->fnFinD(self->dw, line);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    tcp_connector_con_state_t *cstate = CSTATE(c);
+    tcp_connector_lstate_t *ls = lineGetState(self, line);
 
-    if (c->payload != NULL)
+    if (ls->write_paused)
     {
-#ifdef PROFILE
-        struct timeval tv1, tv2;
-        getTimeOfDay(&tv1, NULL);
-        {
-            self->dw->downStream(self->dw, c);
-        }
-        getTimeOfDay(&tv2, NULL);
-        double time_spent = (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 + (double) (tv2.tv_sec - tv1.tv_sec);
-        LOGD("TcpConnector: tcp downstream took %d ms", (int) (time_spent * 1000));
-#else
-        self->dw->downStream(self->dw, c);
-
-#endif
+        bufferqueuePush(ls->data_queue, payload);
+        updateWriteBudget(ls);
+        return;
     }
-    else
+
+    int bytes  = (int) sbufGetBufLength(payload);
+    int nwrite = wioWrite(ls->io, payload);
+    tunnelMetricAdd(self, kTcpConnectorMetricBytesUp, (uint64_t) bytes);
+
+    if (nwrite >= 0 && nwrite < bytes)
     {
+        ls->write_paused = true;
+        wioSetCallBackWrite(ls->io, onWriteComplete);
+        updateWriteBudget(ls);
+    }
+}
+
+static void upStreamFin(tunnel_t *self, line_t *line)
+{
+    tcp_connector_lstate_t *ls = lineGetState(self, line);
+
+    cleanup(ls, true);
+}
+
+static void upStreamPause(tunnel_t *self, line_t *line)
+{
+    tcp_connector_lstate_t *ls = lineGetState(self, line);
 
-        if (c->est)
+    if (! ls->read_paused)
+    {
+        ls->read_paused = true;
+        if (ls->established)
         {
-            cstate->established = true;
-            wioRead(cstate->io);
-            if (resumeWriteQueue(cstate))
-            {
-                cstate->write_paused = false;
-                resumeLineDownSide(cstate->line);
-            }
-            else
-            {
-                wioSetCallBackWrite(cstate->io, onWriteComplete);
-            }
-            self->dw->downStream(self->dw, c);
+            wioReadStop(ls->io);
         }
-        else if (c->fin)
+    }
+}
+
+static void upStreamResume(tunnel_t *self, line_t *line)
+{
+    tcp_connector_lstate_t *ls = lineGetState(self, line);
+
+    if (ls->read_paused)
+    {
+        ls->read_paused = false;
+        if (ls->established)
         {
-            CSTATE_DROP(c);
-            cleanup(cstate, false);
-            self->dw->downStream(self->dw, c);
+            wioRead(ls->io);
         }
     }
 }
 
-tunnel_t *newTcpConnector(node_instance_context_t *instance_info)
+tunnel_t *newTcpConnector(node_t *node)
 {
-    tcp_connector_state_t *state = memoryAllocate(sizeof(tcp_connector_state_t));
-    memorySet(state, 0, sizeof(tcp_connector_state_t));
-    const cJSON *settings = instance_info->node_settings_json;
+    tunnel_t *t = tunnelCreate(node, sizeof(tcp_connector_state_t), sizeof(tcp_connector_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPauseU   = &upStreamPause;
+    t->fnResumeU  = &upStreamResume;
+
+    tcp_connector_state_t *state    = tunnelGetState(t);
+    const cJSON           *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: TcpConnector->settings (object field) : The object was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
+    state->connect_failures = memoryAllocate(sizeof(tcp_connector_failures_t) * getWorkersCount());
+    memorySet(state->connect_failures, 0, sizeof(tcp_connector_failures_t) * getWorkersCount());
+
     getBoolFromJsonObjectOrDefault(&(state->tcp_no_delay), settings, "nodelay", true);
     getBoolFromJsonObjectOrDefault(&(state->tcp_fast_open), settings, "fastopen", false);
     getBoolFromJsonObjectOrDefault(&(state->reuse_addr), settings, "reuseaddr", false);
     getIntFromJsonObjectOrDefault(&(state->domain_strategy), settings, "domain-strategy", 0);
+    getBoolFromJsonObjectOrDefault(&(state->happy_eyeballs), settings, "happy-eyeballs", true);
+    getIntFromJsonObjectOrDefault(&(state->race_delay_ms), settings, "happy-eyeballs-delay",
+                                  kTcpConnectorDefaultRaceDelayMs);
+    state->race_delay_ms = max(state->race_delay_ms, kTcpConnectorMinRaceDelayMs);
+    getIntFromJsonObjectOrDefault(&(state->fwmark), settings, "fwmark", kFwMarkInvalid);
+
+    int high_water_kb = 0;
+    int low_water_kb  = 0;
+    getIntFromJsonObjectOrDefault(&high_water_kb, settings, "write-high-watermark", kWriteBudgetDefaultHighWaterKB);
+    getIntFromJsonObjectOrDefault(&low_water_kb, settings, "write-low-watermark", kWriteBudgetDefaultLowWaterKB);
+    state->write_high_water = (uint32_t) max(1, high_water_kb) * 1024;
+    state->write_low_water  = (uint32_t) min(max(0, low_water_kb), max(1, high_water_kb)) * 1024;
+
+    const cJSON *upstreams_json = cJSON_GetObjectItemCaseSensitive(settings, "upstreams");
+    if (upstreams_json != NULL)
+    {
+        state->upstreams = upstreamsCreate(upstreams_json);
+        if (state->upstreams == NULL)
+        {
+            tunnelDestroy(t);
+            return NULL;
+        }
+        return t;
+    }
 
     state->dest_addr_selected =
         parseDynamicStrValueFromJsonObject(settings, "address", 2, "src_context->address", "dest_context->address");
@@ -403,6 +670,7 @@ tunnel_t *newTcpConnector(node_instance_context_t *instance_info)
     if (state->dest_addr_selected.status == kDvsEmpty)
     {
         LOGF("JSON Error: TcpConnector->settings->address (string field) : The vaule was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
     if (state->dest_addr_selected.status == kDvsConstant)
@@ -498,6 +766,7 @@ tunnel_t *newTcpConnector(node_instance_context_t *instance_info)
     if (state->dest_port_selected.status == kDvsEmpty)
     {
         LOGF("JSON Error: TcpConnector->settings->port (number field) : The vaule was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
@@ -506,13 +775,6 @@ tunnel_t *newTcpConnector(node_instance_context_t *instance_info)
         connectionContextPortSet(&(state->constant_dest_addr), state->dest_port_selected.value);
     }
 
-    getIntFromJsonObjectOrDefault(&(state->fwmark), settings, "fwmark", kFwMarkInvalid);
-
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     return t;
 }
 
@@ -531,5 +793,8 @@ tunnel_t *destroyTcpConnector(tunnel_t *self)
 
 tunnel_metadata_t getMetadataTcpConnector(void)
 {
-    return (tunnel_metadata_t) {.version = 0001, .flags = 0x0};
+    return (tunnel_metadata_t) {.version       = 0001,
+                                .flags         = 0x0,
+                                .metrics       = kTcpConnectorMetrics,
+                                .metrics_count = ARRAY_SIZE(kTcpConnectorMetrics)};
 }
@@ -1,5 +1,8 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
+#include "buffer_queue.h"
+#include "upstreams.h"
+#include "write_budget.h"
 
 // enable profile to see how much it takes to connect and downstream write
 // #define PROFILE 1
@@ -14,36 +17,76 @@ enum tcp_connector_dynamic_value_status
 
 enum
 {
-    kFwMarkInvalid = -1
+    kFwMarkInvalid                  = -1,
+    kTcpConnectorRaceMaxAddrs       = 8,
+    kTcpConnectorDefaultRaceDelayMs = 250, // RFC 8305 "Connection Attempt Delay"
+    kTcpConnectorMinRaceDelayMs     = 10,
+    kTcpConnectorUnhealthyFailures  = 8,        // lines in a row that failed to connect on one worker
+    kTcpConnectorUnhealthyHoldMs    = 10 * 1000 // then the listener of the chain is skipped by its balance group
 };
 
+struct tcp_connector_lstate_s;
+
+// connects in a row that failed on one worker, only that worker touches it; one cache line each
+typedef struct tcp_connector_failures_s
+{
+    uint32_t count;
+    uint8_t  pad[kCpuLineCacheSize - sizeof(uint32_t)];
+
+} tcp_connector_failures_t;
+
+// Happy Eyeballs (RFC 8305): a line connecting to a domain with several addresses races them, a new attempt starts
+// every race_delay_ms (or as soon as one fails) and the first socket that connects wins, the others are closed
+typedef struct tcp_connector_race_s
+{
+    struct tcp_connector_lstate_s *ls;
+    wtimer_t                      *timer;
+    wio_t                         *attempts[kTcpConnectorRaceMaxAddrs]; // same index as addrs, NULL when not running
+    sockaddr_u                     addrs[kTcpConnectorRaceMaxAddrs];
+    uint8_t                        addrs_count;
+    uint8_t                        next_addr;
+    uint8_t                        attempts_alive;
+
+} tcp_connector_race_t;
+
 typedef struct tcp_connector_state_s
 {
     // settings
     bool             tcp_no_delay;
     bool             tcp_fast_open;
-    bool             reuse_addr; /* 8-bit pad*/
+    bool             reuse_addr;
+    bool             happy_eyeballs;
     int              domain_strategy;
+    int              race_delay_ms;
     dynamic_value_t  dest_addr_selected;
     dynamic_value_t  dest_port_selected;
     connection_context_t constant_dest_addr;
     uint64_t         outbound_ip_range;
     int              fwmark;
+    uint32_t         write_high_water; // bytes queued for a socket that pause the writer, see write_budget.h
+    uint32_t         write_low_water;
+    upstreams_t     *upstreams; // NULL unless "upstreams" is configured, then it replaces address and port
+    tcp_connector_failures_t *connect_failures; // [wid] reset by a connect that succeeds
 
 } tcp_connector_state_t;
 
-typedef struct tcp_connector_con_state_s
+// stored inside the line, no allocation per connection except the write queue
+typedef struct tcp_connector_lstate_s
 {
 #ifdef PROFILE
     struct timeval __profile_conenct;
 #endif
 
-    tunnel_t        *tunnel;
-    line_t          *line;
-    wio_t           *io;
-    buffer_pool_t   *buffer_pool;
-    context_queue_t *data_queue;
-    bool             write_paused;
-    bool             established;
-    bool             read_paused;
-} tcp_connector_con_state_t;
+    tunnel_t       *tunnel;
+    line_t         *line;
+    wio_t          *io;
+    buffer_queue_t *data_queue;
+    write_budget_t  write_budget; // data_queue plus what the socket holds
+    bool            write_paused;
+    bool            established;
+    bool            read_paused;
+    bool            upstream_selected;
+    uint32_t        upstream_index;
+    uint64_t        connect_start_ms;
+    tcp_connector_race_t *race; // only while racing the addresses of a domain
+} tcp_connector_lstate_t;
@@ -0,0 +1,340 @@
+#include "upstreams.h"
+
+#include "loggers/network_logger.h"
+
+#define kUpstreamEwmaWeight 0.25 // weight of the newest connect time
+
+typedef struct upstream_s
+{
+    connection_context_t ctx;
+    char                *name; // as configured, for the logs
+
+} upstream_t;
+
+// one worker's view of one upstream, only the owner worker reads and writes it
+typedef struct upstream_stats_s
+{
+    double   ewma_connect_ms; // 0 until the first connect
+    uint64_t ejected_until_ms;
+    uint32_t active_lines;
+    uint32_t consecutive_failures;
+    uint32_t ejections;
+    bool     probing; // the line let through after an ejection is still connecting
+
+    // from the last merge
+    double   merged_ewma_connect_ms;
+    uint64_t merged_ejected_until_ms;
+    uint32_t others_active_lines;
+
+} upstream_stats_t;
+
+// what a worker publishes for the others
+typedef struct upstream_shared_s
+{
+    atomic_uint   ewma_connect_us;
+    atomic_uint   active_lines;
+    atomic_ullong ejected_until_ms;
+
+} upstream_shared_t;
+
+typedef struct upstreams_worker_s
+{
+    upstream_stats_t  *stats;  // [upstream]
+    upstream_shared_t *shared; // [upstream]
+    uint64_t           next_merge_ms;
+
+} upstreams_worker_t;
+
+struct upstreams_s
+{
+    upstream_t         *list;
+    upstreams_worker_t *workers; // [wid]
+    uint32_t            count;
+};
+
+static bool parseUpstream(const char *str, upstream_t *out)
+{
+    const char *colon = strrchr(str, ':');
+    if (colon == NULL || colon == str || colon[1] == '\0')
+    {
+        return false;
+    }
+    int port = atoi(colon + 1);
+    if (port <= 0 || port > 65535)
+    {
+        return false;
+    }
+
+    const char *host_begin = str;
+    const char *host_end   = colon;
+    if (*host_begin == '[')
+    {
+        if (host_end[-1] != ']')
+        {
+            return false;
+        }
+        host_begin++;
+        host_end--;
+    }
+    size_t host_len = (size_t) (host_end - host_begin);
+    if (host_len == 0 || host_len > 255)
+    {
+        return false;
+    }
+
+    char *host = memoryAllocate(host_len + 1);
+    memoryCopy(host, host_begin, host_len);
+    host[host_len] = '\0';
+
+    memorySet(out, 0, sizeof(*out));
+    out->name                 = stringDuplicate(str);
+    out->ctx.address_protocol = kSapTcp;
+    out->ctx.address_type     = getHostAddrType(host);
+    if (out->ctx.address_type == kSatDomainName)
+    {
+        connectionContextDomainSetConstMem(&(out->ctx), host, (uint8_t) host_len);
+    }
+    else
+    {
+        sockaddrSetIp(&(out->ctx.address), host);
+        memoryFree(host);
+    }
+    connectionContextPortSet(&(out->ctx), (uint16_t) port);
+    return true;
+}
+
+// frees what parseUpstream allocated for the first count entries, the domain is ours even though it is set as const
+static void freeParsedUpstreams(upstreams_t *u, uint32_t count)
+{
+    for (uint32_t k = 0; k < count; k++)
+    {
+        memoryFree(u->list[k].name);
+        if (u->list[k].ctx.address_type == kSatDomainName)
+        {
+            memoryFree(u->list[k].ctx.domain);
+        }
+    }
+    memoryFree(u->list);
+    memoryFree(u);
+}
+
+upstreams_t *upstreamsCreate(const cJSON *json)
+{
+    if (! cJSON_IsArray(json) || cJSON_GetArraySize(json) <= 0)
+    {
+        LOGF("JSON Error: TcpConnector->settings->upstreams (array field) : The array was empty or invalid");
+        return NULL;
+    }
+
+    upstreams_t *u = memoryAllocate(sizeof(upstreams_t));
+    u->count       = (uint32_t) cJSON_GetArraySize(json);
+    u->list        = memoryAllocate(sizeof(upstream_t) * u->count);
+
+    uint32_t     i = 0;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, json)
+    {
+        if (! cJSON_IsString(item) || ! parseUpstream(item->valuestring, &(u->list[i])))
+        {
+            LOGF("JSON Error: TcpConnector->settings->upstreams[%u] : expected \"host:port\"", i);
+            freeParsedUpstreams(u, i);
+            return NULL;
+        }
+        i++;
+    }
+
+    const wid_t workers = getWorkersCount();
+    u->workers          = memoryAllocate(sizeof(upstreams_worker_t) * workers);
+    for (wid_t wid = 0; wid < workers; wid++)
+    {
+        // separate allocations, a worker only ever writes to its own
+        upstreams_worker_t *w = &(u->workers[wid]);
+        w->stats              = memoryAllocate(sizeof(upstream_stats_t) * u->count);
+        w->shared             = memoryAllocate(sizeof(upstream_shared_t) * u->count);
+        w->next_merge_ms      = 0;
+        memorySet(w->stats, 0, sizeof(upstream_stats_t) * u->count);
+        for (uint32_t k = 0; k < u->count; k++)
+        {
+            atomicStoreExplicit(&(w->shared[k].ewma_connect_us), 0, memory_order_relaxed);
+            atomicStoreExplicit(&(w->shared[k].active_lines), 0, memory_order_relaxed);
+            atomicStoreExplicit(&(w->shared[k].ejected_until_ms), 0, memory_order_relaxed);
+        }
+    }
+    return u;
+}
+
+static void mergeStats(upstreams_t *u, wid_t wid, uint64_t now_ms)
+{
+    upstreams_worker_t *self    = &(u->workers[wid]);
+    const wid_t         workers = getWorkersCount();
+
+    self->next_merge_ms = now_ms + kUpstreamMergeIntervalMs;
+
+    for (uint32_t i = 0; i < u->count; i++)
+    {
+        upstream_stats_t *s = &(self->stats[i]);
+        atomicStoreExplicit(&(self->shared[i].ewma_connect_us), (unsigned int) (s->ewma_connect_ms * 1000),
+                            memory_order_relaxed);
+        atomicStoreExplicit(&(self->shared[i].active_lines), s->active_lines, memory_order_relaxed);
+        atomicStoreExplicit(&(self->shared[i].ejected_until_ms), s->ejected_until_ms, memory_order_relaxed);
+    }
+
+    for (uint32_t i = 0; i < u->count; i++)
+    {
+        upstream_stats_t *s            = &(self->stats[i]);
+        uint64_t          ewma_sum_us  = 0;
+        uint32_t          ewma_samples = 0;
+        uint32_t          others       = 0;
+        uint64_t          ejected      = 0;
+
+        for (wid_t other = 0; other < workers; other++)
+        {
+            upstream_shared_t *sh      = &(u->workers[other].shared[i]);
+            unsigned int       ewma_us = atomicLoadExplicit(&(sh->ewma_connect_us), memory_order_relaxed);
+            if (ewma_us > 0)
+            {
+                ewma_sum_us += ewma_us;
+                ewma_samples++;
+            }
+            if (other != wid)
+            {
+                others += atomicLoadExplicit(&(sh->active_lines), memory_order_relaxed);
+                uint64_t until = atomicLoadExplicit(&(sh->ejected_until_ms), memory_order_relaxed);
+                if (until > now_ms)
+                {
+                    ejected = max(ejected, until);
+                }
+            }
+        }
+        s->merged_ewma_connect_ms  = ewma_samples > 0 ? (double) ewma_sum_us / ewma_samples / 1000.0 : 0;
+        s->merged_ejected_until_ms = ejected;
+        s->others_active_lines     = others;
+    }
+}
+
+static uint64_t ejectedUntil(const upstream_stats_t *s)
+{
+    return max(s->ejected_until_ms, s->merged_ejected_until_ms);
+}
+
+static bool isAvailable(const upstream_stats_t *s, uint64_t now_ms)
+{
+    return ! s->probing && ejectedUntil(s) <= now_ms;
+}
+
+static double calcCost(const upstream_stats_t *s)
+{
+    // an upstream nobody connected to yet looks fast, so it gets its first samples
+    double ewma = s->ewma_connect_ms > 0 ? s->ewma_connect_ms : s->merged_ewma_connect_ms;
+    return (ewma + 1.0) * (double) (s->active_lines + s->others_active_lines + 1);
+}
+
+// a random available upstream other than skip, the count of upstreams is small so a linear probe is fine
+static int64_t pickAvailable(upstreams_t *u, upstream_stats_t *stats, uint64_t now_ms, int64_t skip)
+{
+    uint32_t start = fastRand() % u->count;
+    for (uint32_t k = 0; k < u->count; k++)
+    {
+        uint32_t i = (start + k) % u->count;
+        if ((int64_t) i != skip && isAvailable(&(stats[i]), now_ms))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+uint32_t upstreamsSelect(upstreams_t *u, uint64_t now_ms)
+{
+    upstreams_worker_t *w = &(u->workers[getWID()]);
+    if (now_ms >= w->next_merge_ms)
+    {
+        mergeStats(u, getWID(), now_ms);
+    }
+
+    uint32_t selected;
+    int64_t  a = pickAvailable(u, w->stats, now_ms, -1);
+    if (a >= 0)
+    {
+        int64_t b = pickAvailable(u, w->stats, now_ms, a);
+        selected  = (uint32_t) ((b >= 0 && calcCost(&(w->stats[b])) < calcCost(&(w->stats[a]))) ? b : a);
+
+        upstream_stats_t *s = &(w->stats[selected]);
+        if (ejectedUntil(s) != 0)
+        {
+            // the first line after an ejection is the probe
+            s->probing = true;
+        }
+    }
+    else
+    {
+        selected = 0;
+        for (uint32_t i = 1; i < u->count; i++)
+        {
+            if (ejectedUntil(&(w->stats[i])) < ejectedUntil(&(w->stats[selected])))
+            {
+                selected = i;
+            }
+        }
+    }
+
+    w->stats[selected].active_lines++;
+    return selected;
+}
+
+connection_context_t *upstreamsGetAddress(upstreams_t *u, uint32_t index)
+{
+    return &(u->list[index].ctx);
+}
+
+void upstreamsOnConnected(upstreams_t *u, uint32_t index, uint64_t connect_ms)
+{
+    upstream_stats_t *s = &(u->workers[getWID()].stats[index]);
+
+    s->ewma_connect_ms = s->ewma_connect_ms == 0 ? (double) connect_ms
+                                                 : (kUpstreamEwmaWeight * (double) connect_ms) +
+                                                       ((1.0 - kUpstreamEwmaWeight) * s->ewma_connect_ms);
+    s->consecutive_failures = 0;
+
+    if (s->probing || ejectedUntil(s) != 0)
+    {
+        LOGI("TcpConnector: upstream %s is back after a successful probe", u->list[index].name);
+        s->probing                 = false;
+        s->ejections               = 0;
+        s->ejected_until_ms        = 0;
+        s->merged_ejected_until_ms = 0;
+    }
+}
+
+bool upstreamsOnConnectFailed(upstreams_t *u, uint32_t index, uint64_t now_ms)
+{
+    upstream_stats_t *s = &(u->workers[getWID()].stats[index]);
+
+    s->consecutive_failures++;
+    if (! s->probing && s->consecutive_failures < kUpstreamEjectFailures)
+    {
+        return false;
+    }
+
+    uint64_t duration       = (uint64_t) kUpstreamEjectBaseMs << min(s->ejections, (uint32_t) kUpstreamEjectMaxShift);
+    s->ejected_until_ms     = now_ms + duration;
+    s->consecutive_failures = 0;
+    s->probing              = false;
+    s->ejections++;
+
+    LOGW("TcpConnector: upstream %s ejected for %llu ms after failed connects", u->list[index].name,
+         (unsigned long long) duration);
+    return true;
+}
+
+void upstreamsOnConnectAborted(upstreams_t *u, uint32_t index)
+{
+    u->workers[getWID()].stats[index].probing = false;
+}
+
+void upstreamsOnLineClosed(upstreams_t *u, uint32_t index)
+{
+    upstream_stats_t *s = &(u->workers[getWID()].stats[index]);
+    assert(s->active_lines > 0);
+    s->active_lines--;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "wwapi.h"
+
+/*
+    Upstream set of TcpConnector
+
+    When the connector is configured with a list of equivalent upstreams instead of one address, every new line
+    picks one of them with power of two choices: two random upstreams are compared and the cheaper one wins, the
+    cost being the EWMA of the connect time times (active lines + 1).
+
+    An upstream whose connects fail kUpstreamEjectFailures times in a row is ejected for a while (doubling with
+    every ejection), once the time is over a single line is let through as a probe; a successful probe brings the
+    upstream back, a failed one ejects it again for longer. If every upstream is ejected the one that comes back
+    first is used anyway, a guess is better than failing the line.
+
+    Each worker keeps its own statistics and only touches them on its own thread. Every kUpstreamMergeIntervalMs a
+    worker publishes its numbers and reads what the others published (active lines, connect time, ejections), so
+    the workers steer around a slow or dead upstream together without sharing a lock.
+
+        "settings": { "upstreams": ["10.0.0.1:443", "10.0.0.2:443", "[2001:db8::1]:443", "backend.lan:443"] }
+
+*/
+
+enum
+{
+    kUpstreamEjectFailures   = 3,
+    kUpstreamEjectBaseMs     = 5 * 1000,
+    kUpstreamEjectMaxShift   = 6, // 5s, 10s ... 320s
+    kUpstreamMergeIntervalMs = 1000
+};
+
+typedef struct upstreams_s upstreams_t;
+
+/**
+ * Parses the "upstreams" array of the connector settings.
+ * @param json Array of "host:port" strings, ipv6 hosts in brackets.
+ * @return The upstream set, NULL (after logging) when the array is empty or an entry is invalid.
+ */
+upstreams_t *upstreamsCreate(const cJSON *json);
+
+/**
+ * Picks an upstream for a new line and counts the line as active on it.
+ * @param u The upstream set.
+ * @param now_ms Loop time of the calling worker.
+ * @return Index of the upstream.
+ */
+uint32_t upstreamsSelect(upstreams_t *u, uint64_t now_ms);
+
+/**
+ * @param u The upstream set.
+ * @param index Index of the upstream.
+ * @return Address and port of the upstream.
+ */
+connection_context_t *upstreamsGetAddress(upstreams_t *u, uint32_t index);
+
+/**
+ * Feeds a successful connect into the connect time average, ends a probe.
+ * @param u The upstream set.
+ * @param index Index of the upstream.
+ * @param connect_ms Time the connect took.
+ */
+void upstreamsOnConnected(upstreams_t *u, uint32_t index, uint64_t connect_ms);
+
+/**
+ * Counts a failed connect (refused, timed out, unresolvable).
+ * @param u The upstream set.
+ * @param index Index of the upstream.
+ * @param now_ms Loop time of the calling worker.
+ * @return true when this failure ejected the upstream.
+ */
+bool upstreamsOnConnectFailed(upstreams_t *u, uint32_t index, uint64_t now_ms);
+
+/**
+ * The line was closed while its connect was still running, that proves nothing about the upstream. If the line was
+ * the probe the probe is given up, so the next line probes again instead of the upstream staying out for good.
+ * @param u The upstream set.
+ * @param index Index of the upstream.
+ */
+void upstreamsOnConnectAborted(upstreams_t *u, uint32_t index);
+
+/**
+ * A line that was given this upstream is gone.
+ * @param u The upstream set.
+ * @param index Index of the upstream.
+ */
+void upstreamsOnLineClosed(upstreams_t *u, uint32_t index);
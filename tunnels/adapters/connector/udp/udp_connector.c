@@ -22,6 +22,8 @@ static void onRecvFrom(wio_t *io, sbuf_t *buf)
     tunnel_t       *self    = (cstate)->tunnel;
     line_t         *line    = (cstate)->line;
 
+    wloopStatsSetOwner(tunnelGetNode(self)->name);
+
     if (! cstate->established)
     {
         cstate->established    = true;
@@ -3,7 +3,8 @@
 #include "loggers/network_logger.h"
 #include "managers/signal_manager.h"
 #include "packet_types.h"
-#include "utils/jsonutils.h"
+#include "wproc.h"
+#include "utils/json_helpers.h"
 
 #include "ww/devices/capture/capture.h"
 
@@ -85,69 +86,99 @@ static void printIPPacketInfo(const unsigned char *buffer, unsigned int len)
     LOGD(logbuf);
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    capture_device_state_t *state = TSTATE((tunnel_t *) self);
+    (void) line;
+    capture_device_state_t *state = tunnelGetState(self);
 
-    capture_device_t *cdev = state->cdev;
-    if (! writeToCaptureDevce(cdev, c->payload))
+    if (! writeToCaptureDevce(state->cdev, payload))
     {
-        contextReusePayload(c);
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
     }
-    else
+}
+
+static void upStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
+{
+    (void) line;
+    capture_device_state_t *state = tunnelGetState(self);
+    buffer_pool_t          *pool  = getWorkerBufferPool(getWID());
+
+    for (uint32_t i = 0; i < count; i++)
     {
-        contextDropPayload(c);
+        if (! writeToCaptureDevce(state->cdev, payloads[i]))
+        {
+            bufferpoolResuesBuffer(pool, payloads[i]);
+        }
     }
-    contextDestroy(c);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
     (void) (self);
-    (void) (c);
+    (void) (line);
     assert(false);
 
-    if (c->payload)
+    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+}
+
+// the packet line of each worker is taken from the chain of the node above, once that chain exists
+static line_t *getWorkerLine(tunnel_t *self, wid_t wid)
+{
+    capture_device_state_t *state = tunnelGetState(self);
+
+    if (UNLIKELY(state->thread_lines[wid] == NULL))
     {
-        contextDropPayload(c);
+        state->thread_lines[wid] = newLine(tunnelchainGetLinePool(tunnelGetChain(self->up), wid));
     }
-    contextDestroy(c);
+    return state->thread_lines[wid];
 }
 
-static void onIPPacketReceived(struct capture_device_s *cdev, void *userdata, sbuf_t *buf, wid_t tid)
+static void onIPPacketReceived(struct capture_device_s *cdev, void *userdata, sbuf_t **bufs, uint32_t count, wid_t wid)
 {
     (void) cdev;
-    tunnel_t               *self  = userdata;
-    capture_device_state_t *state = TSTATE((tunnel_t *) self);
+    tunnel_t *self = userdata;
+
+    if (UNLIKELY(self->up == NULL))
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            bufferpoolResuesBuffer(getWorkerBufferPool(wid), bufs[i]);
+        }
+        return;
+    }
 
 #if LOG_PACKET_INFO
-    printIPPacketInfo(sbufGetRawPtr(buf), sbufGetBufLength(buf));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        printIPPacketInfo(sbufGetRawPtr(bufs[i]), sbufGetBufLength(bufs[i]));
+    }
 #endif
 
-    // bufferpoolResuesBuffer(getWorkerBufferPool(tid), buf);
-
-    context_t *ctx = contextCreate(state->thread_lines[tid]);
-    ctx->payload   = buf;
-    self->up->upStream(self->up, ctx);
+    self->up->fnPayloadBurstU(self->up, getWorkerLine(self, wid), bufs, count);
 }
 
 static void exitHook(void *userdata, int sig)
 {
     (void) sig;
-    capture_device_state_t *state = TSTATE((tunnel_t *) userdata);
+    capture_device_state_t *state = tunnelGetState((tunnel_t *) userdata);
     execCmd(state->exitcmd);
 }
 
-tunnel_t *newCaptureDevice(node_instance_context_t *instance_info)
+tunnel_t *newCaptureDevice(node_t *node)
 {
-    capture_device_state_t *state = memoryAllocate(sizeof(capture_device_state_t));
-    memorySet(state, 0, sizeof(capture_device_state_t));
+    tunnel_t *t = tunnelCreate(node, sizeof(capture_device_state_t), 0);
+
+    t->fnPayloadU      = &upStreamPayload;
+    t->fnPayloadBurstU = &upStreamPayloadBurst;
+    t->fnPayloadD      = &downStreamPayload;
 
-    cJSON *settings = instance_info->node_settings_json;
+    capture_device_state_t *state    = tunnelGetState(t);
+    cJSON                  *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: CaptureDevice->settings (object field) : The object was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
@@ -160,12 +191,14 @@ tunnel_t *newCaptureDevice(node_instance_context_t *instance_info)
     if ((int) directoin.status < kDvsIncoming)
     {
         LOGF("JSON Error: CaptureDevice->settings->direction (string field) : direction is not specified or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
     dynamic_value_t fmode = parseDynamicNumericValueFromJsonObject(settings, "filter-mode", 2, "source-ip", "dest-ip");
     if ((int) fmode.status < kDvsSourceIp)
     {
         LOGF("JSON Error: CaptureDevice->settings->filter-mode (string field) : mode is not specified or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
     state->queue_number = 200 + (fastRand() % 200);
@@ -175,8 +208,7 @@ tunnel_t *newCaptureDevice(node_instance_context_t *instance_info)
         LOGF("JSON Error: CaptureDevice->settings->ip (string field) : mode is not specified or invalid");
     }
 
-    char     *cmdbuf = memoryAllocate(200);
-    tunnel_t *t      = tunnelCreate();
+    char *cmdbuf = memoryAllocate(200);
 
     if ((int) directoin.status == kDvsIncoming)
     {
@@ -186,6 +218,7 @@ tunnel_t *newCaptureDevice(node_instance_context_t *instance_info)
             if (execCmd(cmdbuf).exit_code != 0)
             {
                 LOGF("CaptureDevicer: command failed: %s", cmdbuf);
+                tunnelDestroy(t);
                 return NULL;
             }
 
@@ -199,25 +232,20 @@ tunnel_t *newCaptureDevice(node_instance_context_t *instance_info)
         }
     }
 
+    // filled on each worker by its first burst, the receiver is not bound yet
     state->thread_lines = memoryAllocate(sizeof(line_t *) * getWorkersCount());
-    for (unsigned int i = 0; i < getWorkersCount(); i++)
-    {
-        state->thread_lines[i] = newLine(i);
-    }
+    memorySet(state->thread_lines, 0, sizeof(line_t *) * getWorkersCount());
 
     state->cdev = createCaptureDevice(state->name, state->queue_number, t, onIPPacketReceived);
 
     if (state->cdev == NULL)
     {
         LOGF("CaptureDevice: could not create device");
+        tunnelDestroy(t);
         return NULL;
     }
     bringCaptureDeviceUP(state->cdev);
 
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     return t;
 }
 
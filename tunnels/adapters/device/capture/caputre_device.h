@@ -1,5 +1,5 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
 
 // 
 //      CaptureDevice
@@ -7,7 +7,7 @@
 
 //  this node will not join a chain , it will be used by other nodes (if they accept a device)
 
-tunnel_t *        newCaptureDevice(node_instance_context_t *instance_info);
+tunnel_t *        newCaptureDevice(node_t *node);
 api_result_t      apiCaptureDevice(tunnel_t *self, const char *msg);
 tunnel_t *        destroyCaptureDevice(tunnel_t *self);
 tunnel_metadata_t getMetadataCaptureDevice(void);
@@ -1,7 +1,7 @@
 #include "raw_device.h"
 #include "loggers/network_logger.h"
 #include "packet_types.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 #include "ww/devices/raw/raw.h"
 
 #define LOG_PACKET_INFO 0
@@ -69,62 +69,92 @@ static void printIPPacketInfo(const unsigned char *buffer, unsigned int len)
     LOGD(logbuf);
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    raw_device_state_t *state = TSTATE((tunnel_t *) self);
+    (void) line;
+    raw_device_state_t *state = tunnelGetState(self);
 
-    raw_device_t *rdev = state->rdev;
-    if (! writeToRawDevce(rdev, c->payload))
+    if (! writeToRawDevce(state->rdev, payload))
     {
-        contextReusePayload(c);
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
     }
-    else
+}
+
+static void upStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
+{
+    (void) line;
+    raw_device_state_t *state = tunnelGetState(self);
+    buffer_pool_t      *pool  = getWorkerBufferPool(getWID());
+
+    for (uint32_t i = 0; i < count; i++)
     {
-        contextDropPayload(c);
+        if (! writeToRawDevce(state->rdev, payloads[i]))
+        {
+            bufferpoolResuesBuffer(pool, payloads[i]);
+        }
     }
-    contextDestroy(c);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
     (void) (self);
-    (void) (c);
+    (void) (line);
     assert(false);
 
-    if (c->payload)
+    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+}
+
+// the packet line of each worker is taken from the chain of the node above, once that chain exists
+static line_t *getWorkerLine(tunnel_t *self, wid_t wid)
+{
+    raw_device_state_t *state = tunnelGetState(self);
+
+    if (UNLIKELY(state->thread_lines[wid] == NULL))
     {
-        contextDropPayload(c);
+        state->thread_lines[wid] = newLine(tunnelchainGetLinePool(tunnelGetChain(self->up), wid));
     }
-    contextDestroy(c);
+    return state->thread_lines[wid];
 }
 
-static void onIPPacketReceived(struct raw_device_s *rdev, void *userdata, sbuf_t *buf, wid_t tid)
+static void onIPPacketReceived(struct raw_device_s *rdev, void *userdata, sbuf_t **bufs, uint32_t count, wid_t wid)
 {
     (void) rdev;
-    tunnel_t           *self  = userdata;
-    raw_device_state_t *state = TSTATE((tunnel_t *) self);
+    tunnel_t *self = userdata;
+
+    if (UNLIKELY(self->up == NULL))
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            bufferpoolResuesBuffer(getWorkerBufferPool(wid), bufs[i]);
+        }
+        return;
+    }
 
 #if LOG_PACKET_INFO
-    printIPPacketInfo(sbufGetRawPtr(buf), sbufGetBufLength(buf));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        printIPPacketInfo(sbufGetRawPtr(bufs[i]), sbufGetBufLength(bufs[i]));
+    }
 #endif
 
-    // bufferpoolResuesBuffer(getWorkerBufferPool(tid), buf);
-
-    context_t *ctx = contextCreate(state->thread_lines[tid]);
-    ctx->payload   = buf;
-    self->up->upStream(self->up, ctx);
+    self->up->fnPayloadBurstU(self->up, getWorkerLine(self, wid), bufs, count);
 }
 
-tunnel_t *newRawDevice(node_instance_context_t *instance_info)
+tunnel_t *newRawDevice(node_t *node)
 {
-    raw_device_state_t *state = memoryAllocate(sizeof(raw_device_state_t));
-    memorySet(state, 0, sizeof(raw_device_state_t));
+    tunnel_t *t = tunnelCreate(node, sizeof(raw_device_state_t), 0);
 
-    cJSON *settings = instance_info->node_settings_json;
+    t->fnPayloadU      = &upStreamPayload;
+    t->fnPayloadBurstU = &upStreamPayloadBurst;
+    t->fnPayloadD      = &downStreamPayload;
+
+    raw_device_state_t *state    = tunnelGetState(t);
+    cJSON              *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: RawDevice->settings (object field) : The object was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
@@ -137,16 +167,13 @@ tunnel_t *newRawDevice(node_instance_context_t *instance_info)
     if ((int) mode.status < kDvsWatcher)
     {
         LOGF("JSON Error: RawDevice->settings->mode (string field) : mode is not specified or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
+    // filled on each worker by its first burst, the receiver is not bound yet
     state->thread_lines = memoryAllocate(sizeof(line_t *) * getWorkersCount());
-    for (unsigned int i = 0; i < getWorkersCount(); i++)
-    {
-        state->thread_lines[i] = newLine(i);
-    }
-
-    tunnel_t *t = tunnelCreate();
+    memorySet(state->thread_lines, 0, sizeof(line_t *) * getWorkersCount());
 
     if ((int) mode.status == kDvsWatcher || (int) mode.status == kDvsBoth)
     {
@@ -161,14 +188,11 @@ tunnel_t *newRawDevice(node_instance_context_t *instance_info)
     if (state->rdev == NULL)
     {
         LOGF("RawDevice: could not create device");
+        tunnelDestroy(t);
         return NULL;
     }
     bringRawDeviceUP(state->rdev);
 
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     return t;
 }
 
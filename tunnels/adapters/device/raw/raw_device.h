@@ -1,5 +1,5 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
 
 // 
 //      RawDevice
@@ -7,7 +7,7 @@
 
 //  this node will not join a chain , it will be used by other nodes (if they accept a device)
 
-tunnel_t *        newRawDevice(node_instance_context_t *instance_info);
+tunnel_t *        newRawDevice(node_t *node);
 api_result_t      apiRawDevice(tunnel_t *self, const char *msg);
 tunnel_t *        destroyRawDevice(tunnel_t *self);
 tunnel_metadata_t getMetadataRawDevice(void);
@@ -1,7 +1,7 @@
 #include "tun_device.h"
 #include "loggers/network_logger.h"
 #include "packet_types.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
 #include "ww/devices/tun/tun.h"
 
@@ -66,75 +66,106 @@ static void printIPPacketInfo(const unsigned char *buffer, unsigned int len)
     LOGD(logbuf);
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    tun_device_state_t *state = TSTATE((tunnel_t *) self);
+    (void) line;
+    tun_device_state_t *state = tunnelGetState(self);
 
-    tun_device_t *tdev = state->tdev;
-    if (! writeToTunDevce(tdev, c->payload))
+    if (! writeToTunDevce(state->tdev, payload))
     {
-        contextReusePayload(c);
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
     }
-    else
+}
+
+static void upStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
+{
+    (void) line;
+    tun_device_state_t *state = tunnelGetState(self);
+    buffer_pool_t      *pool  = getWorkerBufferPool(getWID());
+
+    for (uint32_t i = 0; i < count; i++)
     {
-        contextDropPayload(c);
+        if (! writeToTunDevce(state->tdev, payloads[i]))
+        {
+            bufferpoolResuesBuffer(pool, payloads[i]);
+        }
     }
-
-    contextDestroy(c);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
     (void) (self);
-    (void) (c);
+    (void) (line);
     assert(false);
 
-    if (c->payload)
+    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+}
+
+// the packet line of each worker is taken from the chain of the node above, once that chain exists
+static line_t *getWorkerLine(tunnel_t *self, wid_t wid)
+{
+    tun_device_state_t *state = tunnelGetState(self);
+
+    if (UNLIKELY(state->thread_lines[wid] == NULL))
     {
-        contextDropPayload(c);
+        state->thread_lines[wid] = newLine(tunnelchainGetLinePool(tunnelGetChain(self->up), wid));
     }
-    contextDestroy(c);
+    return state->thread_lines[wid];
 }
 
-static void onIPPacketReceived(struct tun_device_s *tdev, void *userdata, sbuf_t *buf, wid_t tid)
+static void onIPPacketReceived(struct tun_device_s *tdev, void *userdata, sbuf_t **bufs, uint32_t count, wid_t wid)
 {
     (void) tdev;
-    tunnel_t           *self  = userdata;
-    tun_device_state_t *state = TSTATE((tunnel_t *) self);
+    tunnel_t *self = userdata;
+
+    if (UNLIKELY(self->up == NULL))
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            bufferpoolResuesBuffer(getWorkerBufferPool(wid), bufs[i]);
+        }
+        return;
+    }
 
 #if LOG_PACKET_INFO
-    printIPPacketInfo(sbufGetRawPtr(buf), sbufGetBufLength(buf));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        printIPPacketInfo(sbufGetRawPtr(bufs[i]), sbufGetBufLength(bufs[i]));
+    }
 #endif
 
-    // bufferpoolResuesBuffer(getWorkerBufferPool(tid), buf);
-
-    context_t *ctx = contextCreate(state->thread_lines[tid]);
-    ctx->payload   = buf;
-    self->up->upStream(self->up, ctx);
+    self->up->fnPayloadBurstU(self->up, getWorkerLine(self, wid), bufs, count);
 }
 
-tunnel_t *newTunDevice(node_instance_context_t *instance_info)
+tunnel_t *newTunDevice(node_t *node)
 {
-    tun_device_state_t *state = memoryAllocate(sizeof(tun_device_state_t));
-    memorySet(state, 0, sizeof(tun_device_state_t));
+    tunnel_t *t = tunnelCreate(node, sizeof(tun_device_state_t), 0);
 
-    cJSON *settings = instance_info->node_settings_json;
+    t->fnPayloadU      = &upStreamPayload;
+    t->fnPayloadBurstU = &upStreamPayloadBurst;
+    t->fnPayloadD      = &downStreamPayload;
+
+    tun_device_state_t *state    = tunnelGetState(t);
+    cJSON              *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: TunDevice->settings (object field) : The object was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
     if (! getStringFromJsonObject(&(state->name), settings, "device-name"))
     {
         LOGF("JSON Error: TunDevice->settings->device-name (string field) : The data was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
     if (! getStringFromJsonObject(&(state->ip_subnet), settings, "device-ip"))
     {
         LOGF("JSON Error: TunDevice->settings->device-name (string field) : The data was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
     verifyIPCdir(state->ip_subnet, getNetworkLogger());
@@ -146,28 +177,21 @@ tunnel_t *newTunDevice(node_instance_context_t *instance_info)
     char *subnet_part  = slash + 1;
     state->subnet_mask = atoi(subnet_part);
 
+    // filled on each worker by its first burst, the receiver is not bound yet
     state->thread_lines = memoryAllocate(sizeof(line_t *) * getWorkersCount());
-    for (unsigned int i = 0; i < getWorkersCount(); i++)
-    {
-        state->thread_lines[i] = newLine(i);
-    }
-
-    tunnel_t *t = tunnelCreate();
+    memorySet(state->thread_lines, 0, sizeof(line_t *) * getWorkersCount());
 
     state->tdev = createTunDevice(state->name, false, t, onIPPacketReceived);
 
     if (state->tdev == NULL)
     {
         LOGF("TunDevice: could not create device");
+        tunnelDestroy(t);
         return NULL;
     }
     assignIpToTunDevice(state->tdev, state->ip_present, state->subnet_mask);
     bringTunDeviceUP(state->tdev);
 
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     return t;
 }
 
@@ -1,16 +1,16 @@
 #include "tcp_listener.h"
 #include "buffer_pool.h"
+#include "buffer_queue.h"
 #include "wloop.h"
 #include "loggers/network_logger.h"
 #include "managers/socket_manager.h"
 #include "tunnel.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
+#include "write_budget.h"
 
 #include <string.h>
 #include <time.h>
 
-// enable profile to see some time info
-// #define PROFILE 1
 enum
 {
     kDefaultKeepAliveTimeOutMs = 60 * 1000, // same as NGINX
@@ -19,6 +19,17 @@ enum
                                                 // other end timetout is probably shorter
 };
 
+enum tcp_listener_metrics_e
+{
+    kTcpListenerMetricQueuedBytes
+};
+
+static const metric_desc_t kTcpListenerMetrics[] = {
+    [kTcpListenerMetricQueuedBytes] = {.name = "ww_tcplistener_write_queued_bytes",
+                                       .help = "bytes waiting to be written to the accepted sockets",
+                                       .type = kMetricTypeGauge},
+};
+
 typedef struct tcp_listener_state_s
 {
     // settings
@@ -26,70 +37,82 @@ typedef struct tcp_listener_state_s
     char   **white_list_raddr;
     char   **black_list_raddr;
     int      multiport_backend;
+    uint32_t write_high_water; // bytes queued for a socket that pause the writer, see write_budget.h
+    uint32_t write_low_water;
     uint16_t port_min;
     uint16_t port_max;
     bool     fast_open;
     bool     no_delay;
 } tcp_listener_state_t;
 
-typedef struct tcp_listener_con_state_s
+// stored inside the line, no allocation per connection except the write queue
+typedef struct tcp_listener_lstate_s
 {
-    wloop_t         *loop;
-    tunnel_t        *tunnel;
-    line_t          *line;
-    wio_t           *io;
-    context_queue_t *data_queue;
-    buffer_pool_t   *buffer_pool;
-    bool             write_paused;
-    bool             established;
-    bool             first_packet_sent;
-    bool             read_paused;
-} tcp_listener_con_state_t;
-
-static void cleanup(tcp_listener_con_state_t *cstate, bool flush_queue)
+    tunnel_t               *tunnel;
+    line_t                 *line;
+    wio_t                  *io;
+    buffer_queue_t         *data_queue;
+    write_budget_t          write_budget; // data_queue plus what the socket holds
+    active_lines_counter_t *active_lines;
+    bool                    write_paused;
+    bool                    established;
+    bool                    read_paused;
+} tcp_listener_lstate_t;
+
+static void cleanup(tcp_listener_lstate_t *ls, bool flush_queue)
 {
-    if (cstate->io)
+    if (ls->io)
     {
-        weventSetUserData(cstate->io, NULL);
-        while (contextqueueLen(cstate->data_queue) > 0)
+        weventSetUserData(ls->io, NULL);
+        while (bufferqueueLen(ls->data_queue) > 0)
         {
             // all data must be written before sending fin, event loop will hold them for us
-            context_t *cw = contextqueuePop(cstate->data_queue);
+            sbuf_t *buf = bufferqueuePop(ls->data_queue);
 
             if (flush_queue)
             {
-                wioWrite(cstate->io, cw->payload);
-                contextDropPayload(cw);
+                wioWrite(ls->io, buf);
             }
             else
             {
-                contextReusePayload(cw);
+                bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), buf);
             }
-            contextDestroy(cw);
         }
-        wioClose(cstate->io);
+        wioClose(ls->io);
     }
-    if (cstate->write_paused)
+    writebudgetDestroy(&ls->write_budget);
+    bufferqueueDestory(ls->data_queue);
+    activelinesDec(ls->active_lines);
+    lineClearState(ls, sizeof(tcp_listener_lstate_t));
+}
+
+// pauses the upper side above the high watermark and resumes it at the low one, may run the writer (call it last)
+static void updateWriteBudget(tcp_listener_lstate_t *ls)
+{
+    size_t held = bufferqueueBytes(ls->data_queue) + wioGetWriteBufSize(ls->io);
+
+    switch (writebudgetUpdate(&ls->write_budget, held))
     {
-        resumeLineUpSide(cstate->line);
+    case kWriteBudgetPause:
+        ls->tunnel->up->fnPauseU(ls->tunnel->up, ls->line);
+        break;
+    case kWriteBudgetResume:
+        ls->tunnel->up->fnResumeU(ls->tunnel->up, ls->line);
+        break;
+    default:
+        break;
     }
-    doneLineDownSide(cstate->line);
-    contextqueueDestory(cstate->data_queue);
-    lineDestroy(cstate->line);
-    memoryFree(cstate);
 }
 
-static bool resumeWriteQueue(tcp_listener_con_state_t *cstate)
+static bool resumeWriteQueue(tcp_listener_lstate_t *ls)
 {
-    context_queue_t *data_queue = (cstate)->data_queue;
-    wio_t           *io         = cstate->io;
-    while (contextqueueLen(data_queue) > 0)
+    buffer_queue_t *data_queue = ls->data_queue;
+    wio_t          *io         = ls->io;
+    while (bufferqueueLen(data_queue) > 0)
     {
-        context_t *cw     = contextqueuePop(data_queue);
-        int        bytes  = (int) sbufGetBufLength(cw->payload);
-        int        nwrite = wioWrite(io, cw->payload);
-        contextDropPayload(cw);
-        contextDestroy(cw);
+        sbuf_t *buf    = bufferqueuePop(data_queue);
+        int     bytes  = (int) sbufGetBufLength(buf);
+        int     nwrite = wioWrite(io, buf);
         if (nwrite >= 0 && nwrite < bytes)
         {
             return false; // write pending
@@ -102,153 +125,108 @@ static bool resumeWriteQueue(tcp_listener_con_state_t *cstate)
 static void onWriteComplete(wio_t *io)
 {
     // resume the read on other end of the connection
-    tcp_listener_con_state_t *cstate = (tcp_listener_con_state_t *) (weventGetUserdata(io));
-    if (UNLIKELY(cstate == NULL))
+    tcp_listener_lstate_t *ls = (tcp_listener_lstate_t *) (weventGetUserdata(io));
+    if (UNLIKELY(ls == NULL))
     {
         return;
     }
 
-    if (wioCheckWriteComplete(io))
+    if (wioCheckWriteComplete(io) && resumeWriteQueue(ls))
     {
-
-        context_queue_t *data_queue = cstate->data_queue;
-        if (contextqueueLen(data_queue) > 0 && ! resumeWriteQueue(cstate))
-        {
-            return;
-        }
-        wioSetCallBackWrite(cstate->io, NULL);
-        cstate->write_paused = false;
-        resumeLineUpSide(cstate->line);
+        wioSetCallBackWrite(ls->io, NULL);
+        ls->write_paused = false;
     }
+    updateWriteBudget(ls);
 }
 
-static void onLinePaused(void *userdata)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    tcp_listener_con_state_t *cstate = (tcp_listener_con_state_t *) (userdata);
+    tcp_listener_lstate_t *ls = lineGetState(self, line);
 
-    if (! cstate->read_paused)
+    if (ls->write_paused)
     {
-        cstate->read_paused = true;
-        wioReadStop(cstate->io);
+        bufferqueuePush(ls->data_queue, payload);
+        updateWriteBudget(ls);
+        return;
     }
-}
 
-static void onLineResumed(void *userdata)
-{
-    tcp_listener_con_state_t *cstate = (tcp_listener_con_state_t *) (userdata);
+    int bytes  = (int) sbufGetBufLength(payload);
+    int nwrite = wioWrite(ls->io, payload);
 
-    if (cstate->read_paused)
+    if (nwrite >= 0 && nwrite < bytes)
     {
-        cstate->read_paused = false;
-        wioRead(cstate->io);
+        ls->write_paused = true;
+        wioSetCallBackWrite(ls->io, onWriteComplete);
+        updateWriteBudget(ls);
     }
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static void downStreamEst(tunnel_t *self, line_t *line)
 {
-#ifdef PROFILE
-    if (c->payload != NULL)
-    {
-        tcp_listener_con_state_t *cstate = CSTATE(c);
+    tcp_listener_lstate_t *ls = lineGetState(self, line);
 
-        bool *first_packet_sent = &((cstate)->first_packet_sent);
+    assert(! ls->established);
+    ls->established = true;
+    wioSetKeepaliveTimeout(ls->io, kEstablishedKeepAliveTimeOutMs);
+}
 
-        if (! (*first_packet_sent))
-        {
-            *first_packet_sent = true;
-            struct timeval tv1, tv2;
-            getTimeOfDay(&tv1, NULL);
-            {
-                self->up->upStream(self->up, c);
-            }
-            getTimeOfDay(&tv2, NULL);
-            double time_spent = (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 + (double) (tv2.tv_sec - tv1.tv_sec);
-            LOGD("TcpListener: upstream took %d ms", (int) (time_spent * 1000));
-            return;
-        }
-    }
-#endif
-    if (c->fin)
-    {
-        tcp_listener_con_state_t *cstate = CSTATE(c);
-        CSTATE_DROP(c);
-        cleanup(cstate, false);
-    }
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    tcp_listener_lstate_t *ls = lineGetState(self, line);
 
-    self->up->upStream(self->up, c);
+    cleanup(ls, true);
+    lineDestroy(line);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPause(tunnel_t *self, line_t *line)
 {
-    tcp_listener_con_state_t *cstate = CSTATE(c);
+    tcp_listener_lstate_t *ls = lineGetState(self, line);
 
-    if (c->payload != NULL)
+    if (! ls->read_paused)
     {
-        if (cstate->write_paused)
-        {
-            pauseLineUpSide(c->line);
-            contextqueuePush(cstate->data_queue, c);
-        }
-        else
-        {
-            int bytes  = (int) sbufGetBufLength(c->payload);
-            int nwrite = wioWrite(cstate->io, c->payload);
-            contextDropPayload(c);
-
-            if (nwrite >= 0 && nwrite < bytes)
-            {
-                pauseLineUpSide(c->line);
-                cstate->write_paused = true;
-                wioSetCallBackWrite(cstate->io, onWriteComplete);
-            }
-            contextDestroy(c);
-        }
+        ls->read_paused = true;
+        wioReadStop(ls->io);
     }
-    else
+}
+
+static void downStreamResume(tunnel_t *self, line_t *line)
+{
+    tcp_listener_lstate_t *ls = lineGetState(self, line);
+
+    if (ls->read_paused)
     {
-        if (c->fin)
-        {
-            CSTATE_DROP(c);
-            cleanup(cstate, true);
-            contextDestroy(c);
-        }
-        else if (c->est)
-        {
-            assert(! cstate->established);
-            cstate->established = true;
-            wioSetKeepaliveTimeout(cstate->io, kEstablishedKeepAliveTimeOutMs);
-            contextDestroy(c);
-        }
+        ls->read_paused = false;
+        wioRead(ls->io);
     }
 }
 
 static void onRecv(wio_t *io, sbuf_t *buf)
 {
-    tcp_listener_con_state_t *cstate = (tcp_listener_con_state_t *) (weventGetUserdata(io));
-    if (UNLIKELY(cstate == NULL))
+    tcp_listener_lstate_t *ls = (tcp_listener_lstate_t *) (weventGetUserdata(io));
+    if (UNLIKELY(ls == NULL))
     {
         bufferpoolResuesBuffer(wloopGetBufferPool(weventGetLoop(io)), buf);
         return;
     }
-    sbuf_t *payload = buf;
-    tunnel_t       *self    = (cstate)->tunnel;
-    line_t         *line    = (cstate)->line;
+    tunnel_t *self = ls->tunnel;
 
-    context_t *context = contextCreate(line);
-    context->payload   = payload;
+    wloopStatsSetOwner(tunnelGetNode(self)->name);
 
-    self->upStream(self, context);
+    self->up->fnPayloadU(self->up, ls->line, buf);
 }
+
 static void onClose(wio_t *io)
 {
-    tcp_listener_con_state_t *cstate = (tcp_listener_con_state_t *) (weventGetUserdata(io));
-    if (cstate != NULL)
+    tcp_listener_lstate_t *ls = (tcp_listener_lstate_t *) (weventGetUserdata(io));
+    if (ls != NULL)
     {
         LOGD("TcpListener: received close for FD:%x ", wioGetFD(io));
-        tunnel_t  *self    = (cstate)->tunnel;
-        line_t    *line    = (cstate)->line;
-        context_t *context = contextCreateFin(line);
-        self->upStream(self, context);
+        tunnel_t *self = ls->tunnel;
+        line_t   *line = ls->line;
+
+        cleanup(ls, false);
+        self->up->fnFinU(self->up, line);
+        lineDestroy(line);
     }
     else
     {
@@ -261,32 +239,33 @@ static void onInboundConnected(wevent_t *ev)
     wloop_t                *loop = ev->loop;
     socket_accept_result_t *data = (socket_accept_result_t *) weventGetUserdata(ev);
     wio_t                  *io   = data->io;
-    size_t                  tid  = data->tid;
+    wid_t                   wid  = data->tid;
     wioAttach(loop, io);
     wioSetKeepaliveTimeout(io, kDefaultKeepAliveTimeOutMs);
 
-    tunnel_t                 *self   = data->tunnel;
-    line_t                   *line   = newLine(tid);
-    tcp_listener_con_state_t *cstate = memoryAllocate(sizeof(tcp_listener_con_state_t));
+    tunnel_t              *self = data->tunnel;
+    line_t                *line = newLine(tunnelchainGetLinePool(tunnelGetChain(self), wid));
+    tcp_listener_lstate_t *ls   = lineGetState(self, line);
 
-    LSTATE_MUT(line)               = cstate;
     line->src_ctx.address_protocol = kSapTcp;
     line->src_ctx.address          = *(sockaddr_u *) wioGetPeerAddr(io);
 
-    *cstate = (tcp_listener_con_state_t) {.line              = line,
-                                          .buffer_pool       = getWorkerBufferPool(tid),
-                                          .data_queue        = contextqueueCreate(),
-                                          .io                = io,
-                                          .tunnel            = self,
-                                          .write_paused      = false,
-                                          .established       = false,
-                                          .first_packet_sent = false};
-
-    setupLineDownSide(line, onLinePaused, cstate, onLineResumed);
+    *ls = (tcp_listener_lstate_t) {.line         = line,
+                                   .data_queue   = bufferqueueCreate(getWorkerBufferPool(wid)),
+                                   .io           = io,
+                                   .tunnel       = self,
+                                   .write_paused = false,
+                                   .established  = false,
+                                   .read_paused  = false,
+                                   .active_lines = data->active_lines};
+    tcp_listener_state_t *state = tunnelGetState(self);
+    writebudgetInit(&ls->write_budget, self, kTcpListenerMetricQueuedBytes, state->write_high_water,
+                    state->write_low_water);
+    activelinesInc(ls->active_lines);
 
     sockaddrSetPort(&(line->src_ctx.address), data->real_localport);
     line->src_ctx.address_type = line->src_ctx.address.sa.sa_family == AF_INET ? kSatIPV4 : kSatIPV6;
-    weventSetUserData(io, cstate);
+    weventSetUserData(io, ls);
 
     if (loggerCheckWriteLevel(getNetworkLogger(), LOG_LEVEL_DEBUG))
     {
@@ -307,15 +286,12 @@ static void onInboundConnected(wevent_t *ev)
 
     // send the init packet
     lineLock(line);
+    self->up->fnInitU(self->up, line);
+    if (! lineIsAlive(line))
     {
-        context_t *context = contextCreateInit(line);
-        self->upStream(self, context);
-        if (! lineIsAlive(line))
-        {
-            LOGW("TcpListener: socket just got closed by upstream before anything happend");
-            lineUnlock(line);
-            return;
-        }
+        LOGW("TcpListener: socket just got closed by upstream before anything happend");
+        lineUnlock(line);
+        return;
     }
     lineUnlock(line);
     wioRead(io);
@@ -365,28 +341,61 @@ static void parsePortSection(tcp_listener_state_t *state, const cJSON *settings)
     }
 }
 
-tunnel_t *newTcpListener(node_instance_context_t *instance_info)
+tunnel_t *newTcpListener(node_t *node)
 {
-    tcp_listener_state_t *state = memoryAllocate(sizeof(tcp_listener_state_t));
-    memorySet(state, 0, sizeof(tcp_listener_state_t));
-    const cJSON *settings = instance_info->node_settings_json;
+    tunnel_t *t = tunnelCreate(node, sizeof(tcp_listener_state_t), sizeof(tcp_listener_lstate_t));
+
+    t->fnPayloadD = &downStreamPayload;
+    t->fnEstD     = &downStreamEst;
+    t->fnFinD     = &downStreamFin;
+    t->fnPauseD   = &downStreamPause;
+    t->fnResumeD  = &downStreamResume;
+
+    tcp_listener_state_t *state    = tunnelGetState(t);
+    const cJSON          *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: TcpListener->settings (object field) : The object was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
     getBoolFromJsonObject(&(state->no_delay), settings, "nodelay");
 
+    int high_water_kb = 0;
+    int low_water_kb  = 0;
+    getIntFromJsonObjectOrDefault(&high_water_kb, settings, "write-high-watermark", kWriteBudgetDefaultHighWaterKB);
+    getIntFromJsonObjectOrDefault(&low_water_kb, settings, "write-low-watermark", kWriteBudgetDefaultLowWaterKB);
+    state->write_high_water = (uint32_t) max(1, high_water_kb) * 1024;
+    state->write_low_water  = (uint32_t) min(max(0, low_water_kb), max(1, high_water_kb)) * 1024;
+
     if (! getStringFromJsonObject(&(state->address), settings, "address"))
     {
         LOGF("JSON Error: TcpListener->settings->address (string field) : The data was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
     socket_filter_option_t filter_opt = {.no_delay = state->no_delay};
 
     getStringFromJsonObject(&(filter_opt.balance_group_name), settings, "balance-group");
-    getIntFromJsonObject((int *) &(filter_opt.balance_group_interval), settings, "balance-interval");
+    int balance_weight = 1;
+    getIntFromJsonObject(&balance_weight, settings, "balance-weight");
+    if (balance_weight < 1)
+    {
+        LOGF("JSON Error: TcpListener->settings->balance-weight (int field) : The value must be 1 or more");
+        tunnelDestroy(t);
+        return NULL;
+    }
+    filter_opt.balance_group_weight = (unsigned int) balance_weight;
+    if (cJSON_GetObjectItemCaseSensitive(settings, "balance-interval") != NULL)
+    {
+        LOGW("TcpListener: balance-interval is ignored, a balance group keeps a client on its member by its address");
+    }
+    dynamic_value_t dy_bm = parseDynamicStrValueFromJsonObject(settings, "balance-mode", 2, "hash", "least-lines");
+    if (dy_bm.status == 3)
+    {
+        filter_opt.balance_mode = kBalanceModeLeastLines;
+    }
 
     filter_opt.multiport_backend = kMultiportBackendNothing;
     parsePortSection(state, settings);
@@ -394,7 +403,7 @@ tunnel_t *newTcpListener(node_instance_context_t *instance_info)
     {
         filter_opt.multiport_backend = kMultiportBackendDefault;
         dynamic_value_t dy_mb =
-            parseDynamicStrValueFromJsonObject(settings, "multiport-backend", 2, "iptables", "socket");
+            parseDynamicStrValueFromJsonObject(settings, "multiport-backend", 3, "iptables", "socket", "sk-lookup");
         if (dy_mb.status == 2)
         {
             filter_opt.multiport_backend = kMultiportBackendIptables;
@@ -403,6 +412,17 @@ tunnel_t *newTcpListener(node_instance_context_t *instance_info)
         {
             filter_opt.multiport_backend = kMultiportBackendSockets;
         }
+        if (dy_mb.status == 4)
+        {
+            filter_opt.multiport_backend = kMultiportBackendSkLookup;
+        }
+    }
+
+    // keeps the connections of one client address on one worker (e.g. both halves of HalfDuplexServer)
+    dynamic_value_t dy_wa = parseDynamicStrValueFromJsonObject(settings, "worker-affinity", 1, "source-ip");
+    if (dy_wa.status == 2)
+    {
+        filter_opt.worker_affinity = kWorkerAffinitySourceAddress;
     }
 
     filter_opt.white_list_raddr = NULL;
@@ -440,10 +460,6 @@ tunnel_t *newTcpListener(node_instance_context_t *instance_info)
     filter_opt.protocol         = kSapTcp;
     filter_opt.black_list_raddr = NULL;
 
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
     socketacceptorRegister(t, filter_opt, onInboundConnected);
 
     return t;
@@ -464,5 +480,8 @@ tunnel_t *destroyTcpListener(tunnel_t *self)
 
 tunnel_metadata_t getMetadataTcpListener(void)
 {
-    return (tunnel_metadata_t) {.version = 0001, .flags = kNodeFlagChainHead};
+    return (tunnel_metadata_t) {.version       = 0001,
+                                .flags         = kNodeFlagChainHead,
+                                .metrics       = kTcpListenerMetrics,
+                                .metrics_count = ARRAY_SIZE(kTcpListenerMetrics)};
 }
@@ -28,18 +28,23 @@ typedef struct udp_listener_state_s
 
 typedef struct udp_listener_con_state_s
 {
-    wloop_t       *loop;
-    tunnel_t      *tunnel;
-    udpsock_t     *uio;
-    line_t        *line;
-    idle_item_t   *idle_handle;
-    buffer_pool_t *buffer_pool;
-    bool           established;
-    bool           first_packet_sent;
+    wloop_t                *loop;
+    tunnel_t               *tunnel;
+    udpsock_t              *uio;
+    line_t                 *line;
+    idle_item_t            *idle_handle;
+    buffer_pool_t          *buffer_pool;
+    active_lines_counter_t *active_lines;
+    bool                    established;
+    bool                    first_packet_sent;
 } udp_listener_con_state_t;
 
 static void cleanup(udp_listener_con_state_t *cstate)
 {
+    if (cstate->active_lines != NULL)
+    {
+        activelinesDec(cstate->active_lines);
+    }
 
     if (cstate->idle_handle != NULL)
     {
@@ -145,7 +150,8 @@ static void onUdpConnectonExpire(idle_item_t *idle_udp)
     self->upStream(self, context);
 }
 
-static udp_listener_con_state_t *newConnection(wid_t tid, tunnel_t *self, udpsock_t *uio, uint16_t real_localport)
+static udp_listener_con_state_t *newConnection(wid_t tid, tunnel_t *self, udpsock_t *uio,
+                                               active_lines_counter_t *active_lines, uint16_t real_localport)
 {
     line_t                   *line   = newLine(tid);
     udp_listener_con_state_t *cstate = memoryAllocate(sizeof(udp_listener_con_state_t));
@@ -159,10 +165,12 @@ static udp_listener_con_state_t *newConnection(wid_t tid, tunnel_t *self, udpsoc
                                           .buffer_pool       = getWorkerBufferPool(tid),
                                           .uio               = uio,
                                           .tunnel            = self,
+                                          .active_lines      = active_lines,
                                           .established       = false,
                                           .first_packet_sent = false};
 
     sockaddrSetPort(&(line->src_ctx.address), real_localport);
+    activelinesInc(active_lines);
 
     if (loggerCheckWriteLevel(getNetworkLogger(), LOG_LEVEL_DEBUG))
     {
@@ -198,6 +206,8 @@ static void onFilteredRecv(wevent_t *ev)
     udp_payload_t *data          = (udp_payload_t *) weventGetUserdata(ev);
     hash_t         peeraddr_hash = sockaddrCalcHashWithPort((sockaddr_u *) wioGetPeerAddr(data->sock->io));
 
+    wloopStatsSetOwner(tunnelGetNode(data->tunnel)->name);
+
     idle_item_t *idle = idleTableGetIdleItemByHash(data->tid, data->sock->table, peeraddr_hash);
     if (idle == NULL)
     {
@@ -209,7 +219,8 @@ static void onFilteredRecv(wevent_t *ev)
             udppayloadDestroy(data);
             return;
         }
-        udp_listener_con_state_t *con = newConnection(data->tid, data->tunnel, data->sock, data->real_localport);
+        udp_listener_con_state_t *con = newConnection(data->tid, data->tunnel, data->sock, data->active_lines,
+                                                      data->real_localport);
 
         if (! con)
         {
@@ -299,7 +310,23 @@ tunnel_t *newUdpListener(node_instance_context_t *instance_info)
     socket_filter_option_t filter_opt = {0};
 
     getStringFromJsonObject(&(filter_opt.balance_group_name), settings, "balance-group");
-    getIntFromJsonObject((int *) &(filter_opt.balance_group_interval), settings, "balance-interval");
+    int balance_weight = 1;
+    getIntFromJsonObject(&balance_weight, settings, "balance-weight");
+    if (balance_weight < 1)
+    {
+        LOGF("JSON Error: UdpListener->settings->balance-weight (int field) : The value must be 1 or more");
+        return NULL;
+    }
+    filter_opt.balance_group_weight = (unsigned int) balance_weight;
+    if (cJSON_GetObjectItemCaseSensitive(settings, "balance-interval") != NULL)
+    {
+        LOGW("UdpListener: balance-interval is ignored, a balance group keeps a client on its member by its address");
+    }
+    dynamic_value_t dy_bm = parseDynamicStrValueFromJsonObject(settings, "balance-mode", 2, "hash", "least-lines");
+    if (dy_bm.status == 3)
+    {
+        filter_opt.balance_mode = kBalanceModeLeastLines;
+    }
 
     filter_opt.multiport_backend = kMultiportBackendNothing;
     parsePortSection(state, settings);
@@ -307,7 +334,7 @@ tunnel_t *newUdpListener(node_instance_context_t *instance_info)
     {
         filter_opt.multiport_backend = kMultiportBackendDefault;
         dynamic_value_t dy_mb =
-            parseDynamicStrValueFromJsonObject(settings, "multiport-backend", 2, "iptables", "socket");
+            parseDynamicStrValueFromJsonObject(settings, "multiport-backend", 3, "iptables", "socket", "sk-lookup");
         if (dy_mb.status == 2)
         {
             filter_opt.multiport_backend = kMultiportBackendIptables;
@@ -316,6 +343,10 @@ tunnel_t *newUdpListener(node_instance_context_t *instance_info)
         {
             filter_opt.multiport_backend = kMultiportBackendSockets;
         }
+        if (dy_mb.status == 4)
+        {
+            filter_opt.multiport_backend = kMultiportBackendSkLookup;
+        }
     }
 
     filter_opt.white_list_raddr = NULL;
@@ -1,8 +1,8 @@
 #include "bgp4_client.h"
-#include "buffer_stream.h"
+#include "frame_decoder.h"
 
 #include "loggers/network_logger.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
 enum
 {
@@ -24,6 +24,10 @@ enum
 #define VAL_4X VAL_2X, VAL_2X
 #define VAL_8X VAL_4X, VAL_4X
 
+// marker, 2 byte length of the rest (type + payload)
+static const frame_format_t kBgpFrameFormat = {
+    .min_length = 2, .max_length = UINT16_MAX, .length_offset = kMarkerLength, .length_size = sizeof(uint16_t)};
+
 // open packet simulate:
 // Version (8bit) | My AS (16bit) | Hold Time (16bit) | BGP Identifier (32bit)
 // Optional Parameters Length (8 bit?)
@@ -36,162 +40,151 @@ typedef struct bgp4_client_state_s
     hash_t   hpassword;
 } bgp4_client_state_t;
 
-typedef struct bgp4_client_con_state_s
+typedef struct bgp4_client_lstate_s
 {
-    buffer_stream_t *read_stream;
-    bool             first_packet_sent;
+    frame_decoder_t read_decoder;
+    bool            first_packet_sent;
+
+} bgp4_client_lstate_t;
+
+static void cleanup(tunnel_t *self, line_t *line)
+{
+    bgp4_client_lstate_t *ls = lineGetState(self, line);
+    framedecoderDestroy(&(ls->read_decoder));
+    lineClearState(ls, sizeof(bgp4_client_lstate_t));
+}
 
-} bgp4_client_con_state_t;
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    bgp4_client_lstate_t *ls = lineGetState(self, line);
+
+    *ls = (bgp4_client_lstate_t) {0};
+    framedecoderInit(&(ls->read_decoder), getWorkerBufferPool(getWID()), kBgpFrameFormat);
+
+    self->up->fnInitU(self->up, line);
+}
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    bgp4_client_state_t     *state  = TSTATE(self);
-    bgp4_client_con_state_t *cstate = CSTATE(c);
+    bgp4_client_state_t  *state = tunnelGetState(self);
+    bgp4_client_lstate_t *ls    = lineGetState(self, line);
 
-    if (c->payload != NULL)
+    uint8_t bgp_type = 2 + (fastRand() % kBgpTypes - 1);
+
+    if (! ls->first_packet_sent)
     {
-        uint8_t bgp_type = 2 + (fastRand() % kBgpTypes - 1);
+        ls->first_packet_sent = true;
+
+        uint32_t additions = 3 + fastRand() % 8;
+
+        sbufShiftLeft(payload, kBgpOpenPacketHeaderSize + additions);
+        uint8_t *header = sbufGetMutablePtr(payload);
+
+        // initialize with defaults
+        memoryCopy(header, kBgpOpenInitialData, sizeof(kBgpOpenInitialData));
+
+        memoryCopy(header + 1, &state->as_number, sizeof(state->as_number));
+        memoryCopy(header + 1 + 2 + 2, &state->sim_ip, sizeof(state->sim_ip));
 
-        if (! cstate->first_packet_sent)
+        header[1 + 2 + 2 + 4] = additions;
+        for (uint32_t i = 0; i < additions; i++)
         {
-            cstate->first_packet_sent = true;
+            header[1 + 2 + 2 + 4 + 1 + i] = fastRand() % 200;
+        }
 
-            uint32_t additions = 3 + fastRand() % 8;
+        bgp_type = 1; // BGP Open
+    }
 
-            sbufShiftLeft(c->payload, kBgpOpenPacketHeaderSize + additions);
-            uint8_t *header = sbufGetMutablePtr(c->payload);
+    sbufShiftLeft(payload, 1); // type
+    sbufWriteUnAlignedUI8(payload, bgp_type);
 
-            // initialize with defaults
-            memoryCopy(header, kBgpOpenInitialData, sizeof(kBgpOpenInitialData));
+    uint16_t blen = (uint16_t) sbufGetBufLength(payload);
+    sbufShiftLeft(payload, 2); // length
+    sbufWriteUnAlignedUI16(payload, blen);
 
-            memoryCopy(header + 1, &state->as_number, sizeof(state->as_number));
-            memoryCopy(header + 1 + 2 + 2, &state->sim_ip, sizeof(state->sim_ip));
+    sbufShiftLeft(payload, kMarkerLength);
+    memorySet(sbufGetMutablePtr(payload), kMarker, kMarkerLength);
 
-            header[1 + 2 + 2 + 4] = additions;
-            for (uint32_t i = 0; i < additions; i++)
-            {
-                header[1 + 2 + 2 + 4 + 1 + i] = fastRand() % 200;
-            }
+    // todo (obfuscate) payload header should at least kMaxEncryptLen bytes be obsfucated
 
-            bgp_type = 1; // BGP Open
-        }
+    self->up->fnPayloadU(self->up, line, payload);
+}
 
-        sbufShiftLeft(c->payload, 1); // type
-        sbufWriteUnAlignedUI8(c->payload, bgp_type);
+static void upStreamFin(tunnel_t *self, line_t *line)
+{
+    cleanup(self, line);
+    self->up->fnFinU(self->up, line);
+}
 
-        uint16_t blen = (uint16_t) sbufGetBufLength(c->payload);
-        sbufShiftLeft(c->payload, 2); // length
-        sbufWriteUnAlignedUI16(c->payload, blen);
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    bgp4_client_lstate_t *ls   = lineGetState(self, line);
+    buffer_pool_t        *pool = getWorkerBufferPool(getWID());
 
-        sbufShiftLeft(c->payload, kMarkerLength);
-        memorySet(sbufGetMutablePtr(c->payload), kMarker, kMarkerLength);
+    framedecoderPush(&(ls->read_decoder), payload);
 
-        // todo (obfuscate) payload header should at least kMaxEncryptLen bytes be obsfucated
-    }
-    else
+    lineLock(line);
+    while (lineIsAlive(line))
     {
-
-        if (c->init)
+        sbuf_t                *buf    = NULL;
+        frame_decoder_result_t result = framedecoderNextBuffer(&(ls->read_decoder), &buf);
+        if (result == kFrameDecoderNeedMore)
         {
-            cstate        = memoryAllocate(sizeof(bgp4_client_con_state_t));
-            *cstate       = (bgp4_client_con_state_t) {.read_stream = bufferstreamCreate(contextGetBufferPool(c))};
-            CSTATE_MUT(c) = cstate;
+            break;
         }
-        else if (c->fin)
+        if (result == kFrameDecoderInvalid)
         {
-            bufferstreamDestroy(cstate->read_stream);
-            memoryFree(cstate);
-            CSTATE_DROP(c);
+            LOGE("Bgp4Client: message too short");
+            goto disconnect;
         }
-    }
-    self->up->upStream(self->up, c);
-}
 
-static void downStream(tunnel_t *self, context_t *c)
-{
-    bgp4_client_con_state_t *cstate = CSTATE(c);
+        static const uint8_t kExpecetd[kMarkerLength] = {VAL_8X, VAL_8X};
 
-    if (c->payload != NULL)
-    {
-        bufferStreamPushContextPayload(cstate->read_stream, c);
-        while (lineIsAlive(c->line) && bufferstreamLen(cstate->read_stream) > kBgpHeaderLen)
+        if (0 != memcmp(sbufGetRawPtr(buf), kExpecetd, kMarkerLength))
         {
-            uint16_t required_length = 0;
-            bufferstreamViewBytesAt(cstate->read_stream, kMarkerLength, (uint8_t *) &required_length,
-                                    sizeof(required_length));
-
-            if (required_length <= 1)
-            {
-                LOGE("Bgp4Client: message  too short");
-                goto disconnect;
-            }
-
-            if (bufferstreamLen(cstate->read_stream) >= ((unsigned int) kBgpHeaderLen + required_length))
-            {
-                sbuf_t *buf = bufferstreamReadExact(cstate->read_stream, kBgpHeaderLen + required_length);
-
-                static const uint8_t kExpecetd[kMarkerLength] = {VAL_8X, VAL_8X};
-
-                if (0 != memcmp(sbufGetRawPtr(buf), kExpecetd, kMarkerLength))
-                {
-                    LOGE("Bgp4Client: invalid marker");
-                    bufferstreamDestroy(cstate->read_stream);
-                    bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                    memoryFree(cstate);
-                    CSTATE_DROP(c);
-                    self->up->upStream(self->up, contextCreateFinFrom(c));
-                    self->dw->downStream(self->dw, contextCreateFinFrom(c));
-                    contextDestroy(c);
-                    return;
-                }
-                sbufShiftRight(buf, kBgpHeaderLen + 1); // 1 byte is type
-
-                if (sbufGetBufLength(buf) <= 0)
-                {
-                    LOGE("Bgp4Client: message had no payload");
-                    bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                    goto disconnect;
-                }
-                context_t *data_ctx = contextCreate(c->line);
-                data_ctx->payload   = buf;
-                self->dw->downStream(self->dw, data_ctx);
-            }
-            else
-            {
-                break;
-            }
+            LOGE("Bgp4Client: invalid marker");
+            bufferpoolResuesBuffer(pool, buf);
+            goto disconnect;
         }
-        contextDestroy(c);
-        return;
-    }
+        sbufShiftRight(buf, kBgpHeaderLen + 1); // 1 byte is type
 
-    if (c->fin)
-    {
-        bufferstreamDestroy(cstate->read_stream);
-        memoryFree(cstate);
-        CSTATE_DROP(c);
+        if (sbufGetBufLength(buf) <= 0)
+        {
+            LOGE("Bgp4Client: message had no payload");
+            bufferpoolResuesBuffer(pool, buf);
+            goto disconnect;
+        }
+        self->dw->fnPayloadD(self->dw, line, buf);
     }
-
-    self->dw->downStream(self->dw, c);
+    lineUnlock(line);
     return;
 
 disconnect:
-    bufferstreamDestroy(cstate->read_stream);
-    memoryFree(cstate);
-    CSTATE_DROP(c);
-    self->up->upStream(self->up, contextCreateFinFrom(c));
-    self->dw->downStream(self->dw, contextCreateFinFrom(c));
-    contextDestroy(c);
+    cleanup(self, line);
+    self->up->fnFinU(self->up, line);
+    self->dw->fnFinD(self->dw, line);
+    lineUnlock(line);
 }
 
-tunnel_t *newBgp4Client(node_instance_context_t *instance_info)
+static void downStreamFin(tunnel_t *self, line_t *line)
 {
+    cleanup(self, line);
+    self->dw->fnFinD(self->dw, line);
+}
+
+tunnel_t *newBgp4Client(node_t *node)
+{
+    tunnel_t *t = tunnelCreate(node, sizeof(bgp4_client_state_t), sizeof(bgp4_client_lstate_t));
 
-    bgp4_client_state_t *state = memoryAllocate(sizeof(bgp4_client_state_t));
-    memorySet(state, 0, sizeof(bgp4_client_state_t));
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnFinD     = &downStreamFin;
 
-    const cJSON *settings = instance_info->node_settings_json;
-    char        *buf      = NULL;
+    bgp4_client_state_t *state    = tunnelGetState(t);
+    const cJSON         *settings = node->node_settings_json;
+    char                *buf      = NULL;
     getStringFromJsonObjectOrDefault(&buf, settings, "password", "passwd");
     state->hpassword = calcHashBytes(buf, strlen(buf));
     memoryFree(buf);
@@ -200,11 +193,6 @@ tunnel_t *newBgp4Client(node_instance_context_t *instance_info)
     state->as_number = (uint16_t) fastRand();
     state->sim_ip    = (fastRand() * 3);
 
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     return t;
 }
 
@@ -9,222 +9,190 @@ typedef struct halfduplex_state_s
     void *_;
 } halfduplex_state_t;
 
-typedef struct halfduplex_con_state_s
+/*
+    the user line (main) knows both halves, the upload and download lines only point back to the main line
+*/
+typedef struct halfduplex_lstate_s
 {
     line_t *main_line;
     line_t *upload_line;
     line_t *download_line;
     bool    first_packet_sent;
-} halfduplex_con_state_t;
+} halfduplex_lstate_t;
 
-static void onMainLinePaused(void *cstate)
+static line_t *createHalf(tunnel_t *self, line_t *main_line)
 {
-    // pauseLineUpSide(((halfduplex_con_state_t *) cstate)->upload_line);
-    pauseLineUpSide(((halfduplex_con_state_t *) cstate)->download_line);
-}
+    line_t              *half_line = newLine(tunnelchainGetLinePool(tunnelGetChain(self), getWID()));
+    halfduplex_lstate_t *half_ls   = lineGetState(self, half_line);
 
-static void onMainLineResumed(void *cstate)
-{
-    resumeLineUpSide(((halfduplex_con_state_t *) cstate)->upload_line);
-    resumeLineUpSide(((halfduplex_con_state_t *) cstate)->download_line);
-}
-static void onUDLinePaused(void *cstate)
-{
-    pauseLineDownSide(((halfduplex_con_state_t *) cstate)->main_line);
+    *half_ls = (halfduplex_lstate_t) {.main_line = main_line};
+    return half_line;
 }
 
-static void onUDLineResumed(void *cstate)
+static void upStreamInit(tunnel_t *self, line_t *line)
 {
-    resumeLineDownSide(((halfduplex_con_state_t *) cstate)->main_line);
-    resumeLineUpSide(((halfduplex_con_state_t *) cstate)->download_line);
-    resumeLineUpSide(((halfduplex_con_state_t *) cstate)->upload_line);
-}
+    halfduplex_lstate_t *ls = lineGetState(self, line);
 
-static void upStream(tunnel_t *self, context_t *c)
-{
-    halfduplex_con_state_t *cstate = CSTATE(c);
+    *ls = (halfduplex_lstate_t) {.main_line = line};
+
+    line_t *upload_line = createHalf(self, line);
+    ls->upload_line     = upload_line;
 
-    if (c->payload != NULL)
+    lineLock(upload_line);
+    self->up->fnInitU(self->up, upload_line);
+    if (! lineIsAlive(upload_line))
     {
-        if (!cstate->first_packet_sent)
-        {
-            cstate->first_packet_sent = true;
-            // 63 bits of random is enough and is better than hashing sender addr on halfduplex server, i believe so...
-            uint32_t cids[2]   = {fastRand(), fastRand()};
-            uint8_t *cid_bytes = (uint8_t *) &(cids[0]);
-
-            context_t *intro_context = contextCreate(cstate->download_line);
-            intro_context->payload   = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-
-            cid_bytes[0] = cid_bytes[0] | (1 << 7); // kHLFDCmdDownload
-            sbufShiftLeft(intro_context->payload, sizeof(cids));
-            sbufWrite(intro_context->payload, cid_bytes, sizeof(cids));
-
-            self->up->upStream(self->up, intro_context);
-
-            if (! lineIsAlive(c->line))
-            {
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
-            }
-
-            cid_bytes[0] = cid_bytes[0] & 0x7f; // kHLFDCmdUpload
-            sbufShiftLeft(c->payload, 8);
-            sbufWrite(c->payload, cid_bytes, sizeof(cids));
-        }
-        self->up->upStream(self->up, contextSwitchLine(c, cstate->upload_line));
+        lineUnlock(upload_line);
+        return;
     }
-    else
+    lineUnlock(upload_line);
+
+    line_t *download_line = createHalf(self, line);
+    ls->download_line     = download_line;
+
+    lineLock(download_line);
+    self->up->fnInitU(self->up, download_line);
+    lineUnlock(download_line);
+}
+
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    halfduplex_lstate_t *ls = lineGetState(self, line);
+
+    if (! ls->first_packet_sent)
     {
+        ls->first_packet_sent = true;
+        // 63 bits of random is enough and is better than hashing sender addr on halfduplex server, i believe so...
+        uint32_t cids[2]   = {fastRand(), fastRand()};
+        uint8_t *cid_bytes = (uint8_t *) &(cids[0]);
 
-        if (c->init)
-        {
-            cstate = memoryAllocate(sizeof(halfduplex_con_state_t));
-
-            *cstate = (halfduplex_con_state_t) {.download_line = NULL, .upload_line = NULL, .main_line = c->line};
-
-            LSTATE_MUT(cstate->main_line) = cstate;
-
-            cstate->upload_line             = newLine(getWID());
-            LSTATE_MUT(cstate->upload_line) = cstate;
-            lineLock(cstate->upload_line);
-            self->up->upStream(self->up, contextCreateInit(cstate->upload_line));
-            if (! lineIsAlive(cstate->upload_line))
-            {
-                lineUnlock(cstate->upload_line);
-                contextDestroy(c);
-                return;
-            }
-            lineUnlock(cstate->upload_line);
-
-            cstate->download_line             = newLine(getWID());
-            LSTATE_MUT(cstate->download_line) = cstate;
-            lineLock(cstate->download_line);
-            self->up->upStream(self->up, contextCreateInit(cstate->download_line));
-
-            if (! lineIsAlive(cstate->download_line))
-            {
-                lineUnlock(cstate->download_line);
-                contextDestroy(c);
-                return;
-            }
-            lineUnlock(cstate->download_line);
-
-            setupLineUpSide(cstate->main_line, onMainLinePaused, cstate, onMainLineResumed);
-            setupLineDownSide(cstate->upload_line, onUDLinePaused, cstate, onUDLineResumed);
-            setupLineDownSide(cstate->download_line, onUDLinePaused, cstate, onUDLineResumed);
-            contextDestroy(c);
-        }
-        else if (c->fin)
+        sbuf_t *intro = bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID()));
+
+        cid_bytes[0] = cid_bytes[0] | (1 << 7); // kHLFDCmdDownload
+        sbufShiftLeft(intro, sizeof(cids));
+        sbufWrite(intro, cid_bytes, sizeof(cids));
+
+        lineLock(line);
+        self->up->fnPayloadU(self->up, ls->download_line, intro);
+
+        if (! lineIsAlive(line))
         {
-            LSTATE_DROP(cstate->main_line);
-            doneLineUpSide(cstate->main_line);
-            cstate->main_line = NULL;
-            contextDestroy(c);
-
-            line_t *upload_line   = cstate->upload_line;
-            line_t *download_line = cstate->download_line;
-
-            lineLock(download_line);
-
-            cstate->upload_line = NULL;
-            doneLineDownSide(upload_line);
-            LSTATE_DROP(upload_line);
-            self->up->upStream(self->up, contextCreateFin(upload_line));
-            lineDestroy(upload_line);
-
-            if (! lineIsAlive(download_line))
-            {
-                lineUnlock(download_line);
-                return;
-            }
-            lineUnlock(download_line);
-
-            cstate->download_line = NULL;
-            doneLineDownSide(download_line);
-            LSTATE_DROP(download_line);
-            self->up->upStream(self->up, contextCreateFin(download_line));
-            lineDestroy(download_line);
-
-            memoryFree(cstate);
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+            lineUnlock(line);
+            return;
         }
+        lineUnlock(line);
+
+        cid_bytes[0] = cid_bytes[0] & 0x7f; // kHLFDCmdUpload
+        sbufShiftLeft(payload, 8);
+        sbufWrite(payload, cid_bytes, sizeof(cids));
     }
+    self->up->fnPayloadU(self->up, ls->upload_line, payload);
+}
+
+static void upStreamFin(tunnel_t *self, line_t *line)
+{
+    halfduplex_lstate_t *ls            = lineGetState(self, line);
+    line_t              *upload_line   = ls->upload_line;
+    line_t              *download_line = ls->download_line;
+
+    lineClearState(lineGetState(self, upload_line), sizeof(halfduplex_lstate_t));
+    lineClearState(lineGetState(self, download_line), sizeof(halfduplex_lstate_t));
+    lineClearState(ls, sizeof(halfduplex_lstate_t));
+
+    self->up->fnFinU(self->up, upload_line);
+    lineDestroy(upload_line);
+
+    self->up->fnFinU(self->up, download_line);
+    lineDestroy(download_line);
 }
-static void downStream(tunnel_t *self, context_t *c)
+
+// the user can not take more data, stop reading the download half
+static void upStreamPause(tunnel_t *self, line_t *line)
+{
+    halfduplex_lstate_t *ls = lineGetState(self, line);
+    self->up->fnPauseU(self->up, ls->download_line);
+}
+
+static void upStreamResume(tunnel_t *self, line_t *line)
+{
+    halfduplex_lstate_t *ls = lineGetState(self, line);
+    self->up->fnResumeU(self->up, ls->upload_line);
+    self->up->fnResumeU(self->up, ls->download_line);
+}
+
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    halfduplex_con_state_t *cstate = CSTATE(c);
+    halfduplex_lstate_t *half_ls = lineGetState(self, line);
+    self->dw->fnPayloadD(self->dw, half_ls->main_line, payload);
+}
+
+// the user line is established once its download half is
+static void downStreamEst(tunnel_t *self, line_t *line)
+{
+    halfduplex_lstate_t *half_ls = lineGetState(self, line);
+    halfduplex_lstate_t *main_ls = lineGetState(self, half_ls->main_line);
 
-    if (c->payload != NULL)
+    if (main_ls->download_line == line)
     {
-        self->dw->downStream(self->dw, contextSwitchLine(c, cstate->main_line));
+        self->dw->fnEstD(self->dw, half_ls->main_line);
     }
-    else
+}
+
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    halfduplex_lstate_t *half_ls   = lineGetState(self, line);
+    line_t              *main_line = half_ls->main_line;
+    halfduplex_lstate_t *main_ls   = lineGetState(self, main_line);
+
+    // the download half may not exist yet if the upload half closed while it was connecting
+    line_t *other_line = main_ls->upload_line == line ? main_ls->download_line : main_ls->upload_line;
+
+    lineClearState(half_ls, sizeof(halfduplex_lstate_t));
+    lineDestroy(line);
+
+    if (other_line)
     {
-        if (c->fin)
-        {
-            if (c->line == cstate->download_line)
-            {
-                LSTATE_DROP(cstate->download_line);
-                doneLineDownSide(cstate->download_line);
-                lineDestroy(cstate->download_line);
-
-                if (cstate->upload_line)
-                {
-                    LSTATE_DROP(cstate->upload_line);
-                    doneLineDownSide(cstate->upload_line);
-                    self->up->upStream(self->up, contextCreateFin(cstate->upload_line));
-                    lineDestroy(cstate->upload_line);
-                }
-            }
-            else
-            {
-                LSTATE_DROP(cstate->upload_line);
-                doneLineDownSide(cstate->upload_line);
-                lineDestroy(cstate->upload_line);
-
-                if (cstate->download_line)
-                {
-                    LSTATE_DROP(cstate->download_line);
-                    doneLineDownSide(cstate->download_line);
-                    self->up->upStream(self->up, contextCreateFin(cstate->download_line));
-                    lineDestroy(cstate->download_line);
-                }
-            }
-            if (cstate->main_line)
-            {
-                LSTATE_DROP(cstate->main_line);
-                doneLineUpSide(cstate->main_line);
-                self->dw->downStream(self->dw, contextCreateFin(cstate->main_line));
-            }
-
-            memoryFree(cstate);
-            contextDestroy(c);
-        }
-        else
-        {
-            if (c->line == cstate->download_line)
-            {
-                self->dw->downStream(self->dw, contextSwitchLine(c, cstate->main_line));
-            }
-            else
-            {
-                contextDestroy(c);
-            }
-        }
+        lineClearState(lineGetState(self, other_line), sizeof(halfduplex_lstate_t));
+        self->up->fnFinU(self->up, other_line);
+        lineDestroy(other_line);
     }
+
+    lineClearState(main_ls, sizeof(halfduplex_lstate_t));
+    self->dw->fnFinD(self->dw, main_line);
 }
 
-tunnel_t *newHalfDuplexClient(node_instance_context_t *instance_info)
+// a half can not take more data, stop reading the user
+static void downStreamPause(tunnel_t *self, line_t *line)
 {
-    (void) instance_info;
-    halfduplex_state_t *state = memoryAllocate(sizeof(halfduplex_state_t));
-    memorySet(state, 0, sizeof(halfduplex_state_t));
+    halfduplex_lstate_t *half_ls = lineGetState(self, line);
+    self->dw->fnPauseD(self->dw, half_ls->main_line);
+}
+
+static void downStreamResume(tunnel_t *self, line_t *line)
+{
+    halfduplex_lstate_t *half_ls = lineGetState(self, line);
+    halfduplex_lstate_t *main_ls = lineGetState(self, half_ls->main_line);
 
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
+    self->dw->fnResumeD(self->dw, half_ls->main_line);
+    self->up->fnResumeU(self->up, main_ls->download_line);
+    self->up->fnResumeU(self->up, main_ls->upload_line);
+}
+
+tunnel_t *newHalfDuplexClient(node_t *node)
+{
+    tunnel_t *t = tunnelCreate(node, sizeof(halfduplex_state_t), sizeof(halfduplex_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPauseU   = &upStreamPause;
+    t->fnResumeU  = &upStreamResume;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnEstD     = &downStreamEst;
+    t->fnFinD     = &downStreamFin;
+    t->fnPauseD   = &downStreamPause;
+    t->fnResumeD  = &downStreamResume;
 
     return t;
 }
@@ -5,12 +5,56 @@
 
 #define kMaxConcurrentStreams 0xffffffffU // NOLINT
 
+enum
+{
+    kMaxGrpcMessageLength = (1 << 24)
+};
+
+// Length-Prefixed-Message: 1 byte compressed flag, 4 byte big endian length
+static const frame_format_t kGrpcFrameFormat = {
+    .max_length = kMaxGrpcMessageLength, .length_offset = 1, .length_size = 4, .big_endian = true};
+
 enum
 {
     kPingInterval = 10000
 };
 
 static void onPingTimer(wtimer_t *timer);
+static bool sendNgHttp2Data(tunnel_t *self, http2_client_con_state_t *con);
+
+/*
+    Receive windows follow the bandwidth delay product (see bdp_window.h): while DATA arrives one PING per round
+    trip goes out with the next write, the bytes that arrived until its ACK are the sample. When the window grows or
+    shrinks the connection window is set to it and a SETTINGS frame moves the initial window of the streams.
+*/
+// 8 bytes of opaque data tell our probes apart from the keepalive pings (zeros)
+#define kBdpPingOpaque ((const uint8_t *) "wwbdpprb") // NOLINT
+
+static void bdpOnDataReceived(http2_client_con_state_t *con, size_t len)
+{
+    const uint64_t now_us = wloopNowUS(getWorkerLoop(getWID()));
+
+    bdpwindowOnAcked(&con->recv_window, len, now_us);
+    if (! con->recv_window.probing)
+    {
+        nghttp2_submit_ping(con->session, NGHTTP2_FLAG_NONE, kBdpPingOpaque);
+        bdpwindowProbeStart(&con->recv_window, now_us);
+    }
+}
+
+static void bdpOnPingAck(http2_client_con_state_t *con, const nghttp2_ping *ping)
+{
+    if (memoryCompare(ping->opaque_data, kBdpPingOpaque, sizeof(ping->opaque_data)) != 0 ||
+        ! bdpwindowProbeEnd(&con->recv_window, wloopNowUS(getWorkerLoop(getWID()))))
+    {
+        return;
+    }
+    const uint32_t window = bdpwindowGet(&con->recv_window);
+
+    nghttp2_session_set_local_window_size(con->session, NGHTTP2_FLAG_NONE, 0, (int32_t) window);
+    nghttp2_settings_entry settings[] = {{NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, window}};
+    nghttp2_submit_settings(con->session, NGHTTP2_FLAG_NONE, settings, ARRAY_SIZE(settings));
+}
 
 static nghttp2_nv makeNV(const char *name, const char *value)
 {
@@ -30,58 +74,6 @@ static void printFrameHd(const nghttp2_frame_hd *hd)
     //      hd->stream_id);
 }
 
-static void onStreamLinePaused(void *arg)
-{
-    http2_client_child_con_state_t *stream = (http2_client_child_con_state_t *) arg;
-    pauseLineUpSide(stream->parent);
-}
-static void onStreamLineResumed(void *arg)
-{
-    http2_client_child_con_state_t *stream = (http2_client_child_con_state_t *) arg;
-    resumeLineUpSide(stream->parent);
-}
-
-static void onH2LinePaused(void *arg)
-{
-    http2_client_con_state_t *con  = (http2_client_con_state_t *) arg;
-    tunnel_t                 *self = con->tunnel;
-
-    line_t *stream_line = con->current_stream_write_line;
-    if (stream_line && lineIsAlive(stream_line))
-    {
-        http2_client_child_con_state_t *stream = LSTATE(stream_line);
-        stream->paused                         = true;
-        pauseLineDownSide(stream->line);
-    }
-
-    // ++(con->pause_counter);
-    // if (con->pause_counter > 8)
-    // {
-    // http2_client_child_con_state_t *stream_i;
-    // for (stream_i = con->root.next; stream_i;)
-    // {
-    //     pauseLineDownSide(stream_i->line);
-    //     stream_i = stream_i->next;
-    // }
-    // }
-}
-
-static void onH2LineResumed(void *arg)
-{
-    http2_client_con_state_t *con = (http2_client_con_state_t *) arg;
-    // con->pause_counter            = con->pause_counter > 0 ? (con->pause_counter - 1) : con->pause_counter;
-    http2_client_child_con_state_t *stream_i;
-    for (stream_i = con->root.next; stream_i;)
-    {
-        if (stream_i->paused)
-        {
-            stream_i->paused = false;
-            resumeLineDownSide(stream_i->line);
-        }
-        stream_i = stream_i->next;
-    }
-}
-
 static void addStraem(http2_client_con_state_t *con, http2_client_child_con_state_t *stream)
 {
     stream->next   = con->root.next;
@@ -143,16 +135,13 @@ static http2_client_child_con_state_t *createHttp2Stream(http2_client_con_state_
                                         "Gecko) Chrome/122.0.0.0 Safari/537.36");
     nvs[nvlen++] = makeNV("Sec-Ch-Ua-Platform", "\"Windows\"");
 
-    http2_client_child_con_state_t *stream = memoryAllocate(sizeof(http2_client_child_con_state_t));
-    memorySet(stream, 0, sizeof(http2_client_child_con_state_t));
+    http2_client_child_con_state_t *stream = lineGetState(con->tunnel, child_line);
     // stream->stream_id = nghttp2_submit_request2(con->session, NULL,  &nvs[0], nvlen, NULL,stream);
     stream->stream_id          = nghttp2_submit_headers(con->session, flags, -1, NULL, &nvs[0], nvlen, stream);
-    stream->grpc_buffer_stream = bufferstreamCreate(getWorkerBufferPool(con->line));
     stream->parent             = con->line;
     stream->line               = child_line;
     stream->tunnel             = con->tunnel;
-    LSTATE_I_MUT(stream->line, stream->tunnel->chain_index) = stream;
-    setupLineUpSide(stream->line, onStreamLinePaused, stream, onStreamLineResumed);
+    framedecoderInit(&stream->grpc_decoder, getWorkerBufferPool(getWID()), kGrpcFrameFormat);
 
     addStraem(con, stream);
 
@@ -160,47 +149,60 @@ static http2_client_child_con_state_t *createHttp2Stream(http2_client_con_state_
 }
 static void deleteHttp2Stream(http2_client_child_con_state_t *stream)
 {
-
-    LSTATE_I_DROP(stream->line, stream->tunnel->chain_index);
-    bufferstreamDestroy(stream->grpc_buffer_stream);
-    doneLineUpSide(stream->line);
-    memoryFree(stream);
+    framedecoderDestroy(&stream->grpc_decoder);
+    lineClearState(stream, sizeof(http2_client_child_con_state_t));
 }
 
-static http2_client_con_state_t *createHttp2Connection(tunnel_t *self, int tid)
+static http2_client_con_state_t *createHttp2Connection(tunnel_t *self, wid_t wid)
 {
-
-    http2_client_state_t     *state = TSTATE(self);
-    http2_client_con_state_t *con   = memoryAllocate(sizeof(http2_client_con_state_t));
-    *con                            = (http2_client_con_state_t) {.queue        = contextqueueCreate(),
-                                                                  .content_type = state->content_type,
+    http2_client_state_t     *state     = tunnelGetState(self);
+    line_t                   *main_line = newLine(tunnelchainGetLinePool(tunnelGetChain(self), wid));
+    http2_client_con_state_t *con       = lineGetState(self, main_line);
+    *con                                = (http2_client_con_state_t) {.content_type = state->content_type,
                                                                   .path         = state->path,
                                                                   .host         = state->host,
                                                                   .host_port    = state->host_port,
                                                                   .scheme       = state->scheme,
                                                                   .method       = state->content_type == kApplicationGrpc ? kHttpPost : kHttpGet,
-                                                                  .line         = newLine(tid),
-                                                                  .ping_timer   = wtimerAdd(getWorkerLoop(tid), onPingTimer, kPingInterval, INFINITE),
+                                                                  .line         = main_line,
+                                                                  .ping_timer   = wtimerAdd(getWorkerLoop(wid), onPingTimer, kPingInterval, INFINITE),
                                                                   .tunnel       = self,
-                                                                  .actions      = action_queue_t_with_capacity(16)};
-    LSTATE_MUT(con->line)           = con;
-    setupLineDownSide(con->line, onH2LinePaused, con, onH2LineResumed);
+                                                                  .actions      = action_queue_t_with_capacity(16),
+                                                                  .pending      = action_queue_t_with_capacity(16),
+                                                                  .frames       = http2_frame_queue_t_with_capacity(16)};
 
     weventSetUserData(con->ping_timer, con);
+    bdpwindowInit(&con->recv_window, &(state->thread_cpool[wid].window_budget), state->min_window, state->max_window);
     nghttp2_session_client_new2(&con->session, state->cbs, con, state->ngoptions);
     nghttp2_settings_entry settings[] = {{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, kMaxConcurrentStreams},
                                          {NGHTTP2_SETTINGS_MAX_FRAME_SIZE, (1U << 18)},
-                                         {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, (1U << 18)}
+                                         {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, state->min_window}
 
     };
     nghttp2_submit_settings(con->session, NGHTTP2_FLAG_NONE, settings, ARRAY_SIZE(settings));
+    // the connection window is not part of the settings, without this it stays at 65535
+    nghttp2_session_set_local_window_size(con->session, NGHTTP2_FLAG_NONE, 0, (int32_t) state->min_window);
 
     return con;
 }
+static void dropActions(action_queue_t *actions)
+{
+    c_foreach(k, action_queue_t, *actions)
+    {
+        if (k.ref->buf)
+        {
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), k.ref->buf);
+        }
+        lineUnlock(k.ref->stream_line);
+    }
+    action_queue_t_drop(actions);
+}
+
+// closes every stream downwards and clears the connection state, the caller destroys the main line
 static void deleteHttp2Connection(http2_client_con_state_t *con)
 {
     tunnel_t             *self  = con->tunnel;
-    http2_client_state_t *state = TSTATE(self);
+    http2_client_state_t *state = tunnelGetState(self);
 
     vec_cons     *vector = &(state->thread_cpool[getWID()].cons);
     vec_cons_iter it     = vec_cons_find(vector, con);
@@ -212,39 +214,37 @@ static void deleteHttp2Connection(http2_client_con_state_t *con)
     http2_client_child_con_state_t *stream_i;
     for (stream_i = con->root.next; stream_i;)
     {
-        http2_client_child_con_state_t *next    = stream_i->next;
-        context_t                      *fin_ctx = contextCreateFin(stream_i->line);
-        tunnel_t                       *dest    = stream_i->tunnel->dw;
+        http2_client_child_con_state_t *next       = stream_i->next;
+        line_t                         *child_line = stream_i->line;
         deleteHttp2Stream(stream_i);
-        dest->downStream(dest, fin_ctx);
+        self->dw->fnFinD(self->dw, child_line);
         stream_i = next;
     }
 
-    c_foreach(k, action_queue_t, con->actions)
-    {
-        if (k.ref->buf)
-        {
-            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), k.ref->buf);
-        }
-        lineUnlock(k.ref->stream_line);
-    }
-
-    action_queue_t_drop(&con->actions);
-    doneLineDownSide(con->line);
-    LSTATE_DROP(con->line);
+    dropActions(&con->actions);
+    dropActions(&con->pending);
+    http2datasourceDropFrames(&con->frames);
+    http2datasourceRemoveAll(&con->data_sources);
     nghttp2_session_del(con->session);
-    contextqueueDestory(con->queue);
-    lineDestroy(con->line);
+    bdpwindowDestroy(&con->recv_window);
     wtimerDelete(con->ping_timer);
-    memoryFree(con);
+    lineClearState(con, sizeof(http2_client_con_state_t));
 }
 
-static http2_client_con_state_t *takeHttp2Connection(tunnel_t *self, int tid)
+// for connections that this tunnel closes, the upper side gets the fin
+static void closeHttp2Connection(http2_client_con_state_t *con)
 {
+    tunnel_t *self      = con->tunnel;
+    line_t   *main_line = con->line;
+    deleteHttp2Connection(con);
+    self->up->fnFinU(self->up, main_line);
+    lineDestroy(main_line);
+}
 
-    http2_client_state_t *state = TSTATE(self);
-    // return createHttp2Connection(self, tid, io);
-    vec_cons *vector = &(state->thread_cpool[tid].cons);
+static http2_client_con_state_t *takeHttp2Connection(tunnel_t *self, wid_t wid)
+{
+    http2_client_state_t *state  = tunnelGetState(self);
+    vec_cons             *vector = &(state->thread_cpool[wid].cons);
 
     if (vec_cons_size(vector) > 0)
     {
@@ -268,12 +268,12 @@ static http2_client_con_state_t *takeHttp2Connection(tunnel_t *self, int tid)
             return con;
         }
 
-        con = createHttp2Connection(self, tid);
+        con = createHttp2Connection(self, wid);
         vec_cons_push(vector, con);
         return con;
     }
 
-    http2_client_con_state_t *con = createHttp2Connection(self, tid);
+    http2_client_con_state_t *con = createHttp2Connection(self, wid);
     vec_cons_push(vector, con);
     return con;
 }
@@ -284,27 +284,17 @@ static void onPingTimer(wtimer_t *timer)
     if (con->no_ping_ack)
     {
         LOGW("Http2Client: closing a session due to no ping reply");
-        context_t *con_fc   = contextCreateFin(con->line);
-        tunnel_t  *con_dest = con->tunnel->up;
-        deleteHttp2Connection(con);
-        con_dest->upStream(con_dest, con_fc);
+        closeHttp2Connection(con);
     }
     else
     {
         con->no_ping_ack = true;
         nghttp2_submit_ping(con->session, 0, NULL);
-        char   *data = NULL;
-        size_t  len;
+        // through sendNgHttp2Data, DATA frames that nghttp2 releases on the way keep their order
         line_t *h2line = con->line;
         lineLock(h2line);
-        while (0 < (len = nghttp2_session_mem_send2(con->session, (const uint8_t **) &data)))
+        while (sendNgHttp2Data(con->tunnel, con))
         {
-            sbuf_t *send_buf = bufferpoolGetLargeBuffer(getWorkerBufferPool(h2line));
-            sbufSetLength(send_buf, len);
-            sbufWrite(send_buf, data, len);
-            context_t *req = contextCreate(h2line);
-            req->payload   = send_buf;
-            con->tunnel->up->upStream(con->tunnel->up, req);
             if (! lineIsAlive(h2line))
             {
                 lineUnlock(h2line);
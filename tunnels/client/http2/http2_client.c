@@ -3,12 +3,14 @@
 #include "helpers.h"
 #include "tunnel.h"
 #include "types.h"
-#include "utils/jsonutils.h"
-
+#include "utils/json_helpers.h"
 
 enum
 {
-    kDefaultConcurrency = 64 // cons will be muxed into 1
+    kDefaultConcurrency    = 64, // cons will be muxed into 1
+    kDefaultMinRecvWindow  = (1 << 18),
+    kDefaultMaxRecvWindow  = (1 << 25),
+    kDefaultWindowBudgetMB = 256 // per worker, shared by the connections of the node
 };
 
 static int onStreamClosedCallBack(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *userdata)
@@ -23,10 +25,12 @@ static int onStreamClosedCallBack(nghttp2_session *session, int32_t stream_id, u
     // todo (optimize) nghttp2 is calling this callback even if we close the con ourselves
     // this should be omitted
 
+    http2datasourceRemove(&con->data_sources, stream_id);
     if (! stream)
     {
         return 0;
     }
+    stream->data_source = NULL;
     lineLock(stream->line);
     action_queue_t_push(&con->actions,
                         (http2_action_t) {.action_id = kActionStreamFinish, .stream_line = stream->line, .buf = NULL});
@@ -34,24 +38,12 @@ static int onStreamClosedCallBack(nghttp2_session *session, int32_t stream_id, u
     return 0;
 }
 
+// the pending data actions already hold a lock of their stream line, doHttp2Action drops the dead ones
 static void flushWriteQueue(http2_client_con_state_t *con)
 {
-    tunnel_t *self = con->tunnel;
-    while (contextqueueLen(con->queue) > 0)
+    while (action_queue_t_size(&con->pending) > 0)
     {
-        context_t *stream_context = contextqueuePop(con->queue);
-        if (lineIsAlive(stream_context->line)) // always true, since the stream is found before calling this
-        {
-            http2_client_child_con_state_t *stream = CSTATE(stream_context);
-
-            lineLock(stream->line);
-            action_queue_t_push(&con->actions, (http2_action_t) {.action_id   = kActionConData,
-                                                                 .stream_line = stream->line,
-                                                                 .buf         = stream_context->payload});
-        }
-
-        contextDropPayload(stream_context);
-        contextDestroy(stream_context);
+        action_queue_t_push(&con->actions, action_queue_t_pull_front(&con->pending));
     }
 }
 
@@ -109,7 +101,9 @@ static int onDataChunkRecvCallBack(nghttp2_session *session, uint8_t flags, int3
         return 0;
     }
 
-    sbuf_t *buf = bufferpoolGetLargeBuffer(getWorkerBufferPool(con->line));
+    bdpOnDataReceived(con, len);
+
+    sbuf_t *buf = bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID()));
     sbufSetLength(buf, len);
     sbufWrite(buf, data, len);
     lineLock(stream->line);
@@ -121,6 +115,16 @@ static int onDataChunkRecvCallBack(nghttp2_session *session, uint8_t flags, int3
     return 0;
 }
 
+static int onSendDataCallBack(nghttp2_session *session, nghttp2_frame *frame, const uint8_t *framehd, size_t length,
+                              nghttp2_data_source *source, void *userdata)
+{
+    (void) session;
+    (void) frame;
+    http2_client_con_state_t *con = (http2_client_con_state_t *) userdata;
+
+    return http2datasourceSendFrame(&con->frames, framehd, length, source);
+}
+
 static int onFrameRecvCallBack(nghttp2_session *session, const nghttp2_frame *frame, void *userdata)
 {
     (void) session;
@@ -144,6 +148,10 @@ static int onFrameRecvCallBack(nghttp2_session *session, const nghttp2_frame *fr
         break;
     case NGHTTP2_PING:
         con->no_ping_ack = false;
+        if ((frame->hd.flags & NGHTTP2_FLAG_ACK) == NGHTTP2_FLAG_ACK)
+        {
+            bdpOnPingAck(con, &frame->ping);
+        }
         break;
     case NGHTTP2_RST_STREAM:
     case NGHTTP2_WINDOW_UPDATE:
@@ -190,12 +198,12 @@ static int onFrameRecvCallBack(nghttp2_session *session, const nghttp2_frame *fr
     return 0;
 }
 
+// queues the payload in the data source of the stream, nghttp2 frames it when flow control allows
 static void sendStreamData(http2_client_con_state_t *con, http2_client_child_con_state_t *stream, sbuf_t *buf)
 {
-    http2_flag flags = kHttP2FlagNone;
     if (UNLIKELY(! stream))
     {
-        bufferpoolResuesBuffer(getWorkerBufferPool(con->line), buf);
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), buf);
         return;
     }
 
@@ -204,50 +212,101 @@ static void sendStreamData(http2_client_con_state_t *con, http2_client_child_con
         grpc_message_hd msghd;
         msghd.flags  = 0;
         msghd.length = sbufGetBufLength(buf);
-        flags        = kHttP2FlagNone;
         sbufShiftLeft(buf, GRPC_MESSAGE_HDLEN);
         grpcMessageHdPack(&msghd, sbufGetMutablePtr(buf));
     }
 
-    http2_frame_hd framehd;
-    framehd.length    = sbufGetBufLength(buf);
-    framehd.type      = kHttP2Data;
-    framehd.flags     = flags;
-    framehd.stream_id = stream->stream_id;
-    sbufShiftLeft(buf, HTTP2_FRAME_HDLEN);
-    http2FrameHdPack(&framehd, sbufGetMutablePtr(buf));
-    context_t *data                = contextCreate(con->line);
-    data->payload                  = buf;
-    line_t *h2_line = data->line;
-    // make sure line is not freed, to be able to pause it
-    lineLock(stream->line);
-    con->current_stream_write_line = stream->line;
-    con->tunnel->up->upStream(con->tunnel->up, data);
-    lineUnlock(stream->line);
-    if (lineIsAlive(h2_line))
+    if (stream->data_source == NULL)
+    {
+        stream->data_source = http2datasourceSubmit(con->session, &con->data_sources, stream->stream_id, stream->line);
+        if (UNLIKELY(stream->data_source == NULL))
+        {
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), buf);
+            return;
+        }
+    }
+
+    if (http2datasourcePush(con->session, stream->data_source, buf))
     {
-        con->current_stream_write_line = NULL;
+        // the peer does not take the data as fast (flow control), hold the writer until the queue drains
+        con->tunnel->dw->fnPauseD(con->tunnel->dw, stream->line);
     }
 }
 
-static bool sendNgHttp2Data(tunnel_t *self, http2_client_con_state_t *con)
+// writes the DATA frames nghttp2 released during the last mem_send, returns false when the connection closed
+static bool flushDataFrames(tunnel_t *self, http2_client_con_state_t *con)
 {
     line_t *main_line = con->line;
-    char   *buf       = NULL;
-    size_t  len       = nghttp2_session_mem_send(con->session, (const uint8_t **) &buf);
+
+    while (http2_frame_queue_t_size(&con->frames) > 0)
+    {
+        const http2_out_frame_t frame = http2_frame_queue_t_pull_front(&con->frames);
+
+        // make sure the stream line is not freed, to be able to pause it
+        con->current_stream_write_line = frame.stream_line;
+        self->up->fnPayloadU(self->up, main_line, frame.buf);
+        const bool alive = lineIsAlive(main_line);
+        if (alive)
+        {
+            con->current_stream_write_line = NULL;
+        }
+        lineUnlock(frame.stream_line);
+        if (! alive)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool sendNgHttp2Data(tunnel_t *self, http2_client_con_state_t *con)
+{
+    line_t  *main_line = con->line;
+    char    *buf       = NULL;
+    ssize_t  len       = nghttp2_session_mem_send(con->session, (const uint8_t **) &buf);
+    sbuf_t  *send_buf  = NULL;
+    bool     had_data  = http2_frame_queue_t_size(&con->frames) > 0;
 
     if (len > 0)
     {
-        sbuf_t *send_buf = bufferpoolGetLargeBuffer(getWorkerBufferPool(main_line));
-        sbufSetLength(send_buf, len);
-        sbufWrite(send_buf, buf, len);
-        context_t *data = contextCreate(main_line);
-        data->payload   = send_buf;
-        self->up->upStream(self->up, data);
+        send_buf = bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID()));
+        send_buf = sbufReserveSpace(send_buf, (uint32_t) len);
+        sbufSetLength(send_buf, (uint32_t) len);
+        sbufWrite(send_buf, buf, (uint32_t) len);
+    }
+
+    // the frames were released during this call before nghttp2 produced the bytes it returned
+    if (had_data && ! flushDataFrames(self, con))
+    {
+        if (send_buf)
+        {
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), send_buf);
+        }
         return true;
     }
 
-    return false;
+    if (send_buf)
+    {
+        self->up->fnPayloadU(self->up, main_line, send_buf);
+        if (! lineIsAlive(main_line))
+        {
+            return true;
+        }
+    }
+
+    if (had_data)
+    {
+        for (http2_data_source_t *s; (s = http2datasourcePopResumable(con->data_sources)) != NULL;)
+        {
+            self->dw->fnResumeD(self->dw, s->line);
+            if (! lineIsAlive(main_line))
+            {
+                return true;
+            }
+        }
+    }
+
+    return had_data || send_buf != NULL;
 }
 
 static void doHttp2Action(const http2_action_t action, http2_client_con_state_t *con)
@@ -259,13 +318,13 @@ static void doHttp2Action(const http2_action_t action, http2_client_con_state_t
     {
         if (action.buf)
         {
-            bufferpoolResuesBuffer(getWorkerBufferPool(action.stream_line), action.buf);
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), action.buf);
         }
         lineUnlock(action.stream_line);
         return;
     }
 
-    http2_client_child_con_state_t *stream = LSTATE(action.stream_line);
+    http2_client_child_con_state_t *stream = lineGetState(self, action.stream_line);
 
     assert(stream); // when the line is alive, there is no way that we lose the state
 
@@ -275,7 +334,7 @@ static void doHttp2Action(const http2_action_t action, http2_client_con_state_t
 
     case kActionStreamEst: {
 
-        stream->tunnel->dw->downStream(stream->tunnel->dw, contextCreateEst(stream->line));
+        self->dw->fnEstD(self->dw, stream->line);
     }
 
     break;
@@ -283,47 +342,43 @@ static void doHttp2Action(const http2_action_t action, http2_client_con_state_t
     case kActionStreamDataReceived: {
         if (con->content_type == kApplicationGrpc)
         {
-            bufferstreamPush(stream->grpc_buffer_stream, action.buf);
+            framedecoderPush(&stream->grpc_decoder, action.buf);
 
             while (true)
             {
-                if (stream->grpc_bytes_needed == 0 && bufferstreamLen(stream->grpc_buffer_stream) >= GRPC_MESSAGE_HDLEN)
+                sbuf_t                *gdata_buf = NULL;
+                frame_decoder_result_t result    = framedecoderNextBuffer(&stream->grpc_decoder, &gdata_buf);
+                if (result == kFrameDecoderNeedMore)
                 {
-                    sbuf_t *gheader_buf = bufferstreamReadExact(stream->grpc_buffer_stream, GRPC_MESSAGE_HDLEN);
-                    grpc_message_hd msghd;
-                    grpcMessageHdUnpack(&msghd, sbufGetRawPtr(gheader_buf));
-                    stream->grpc_bytes_needed = msghd.length;
-                    bufferpoolResuesBuffer(getWorkerBufferPool(con->line), gheader_buf);
+                    break;
                 }
-                if (stream->grpc_bytes_needed > 0 &&
-                    bufferstreamLen(stream->grpc_buffer_stream) >= stream->grpc_bytes_needed)
+                if (UNLIKELY(result == kFrameDecoderInvalid))
                 {
-                    sbuf_t *gdata_buf = bufferstreamReadExact(stream->grpc_buffer_stream, stream->grpc_bytes_needed);
-                    stream->grpc_bytes_needed = 0;
-
-                    context_t *stream_data = contextCreate(stream->line);
-                    stream_data->payload   = gdata_buf;
-
-                    stream->tunnel->dw->downStream(stream->tunnel->dw, stream_data);
+                    LOGE("Http2Client: grpc message too large");
+                    nghttp2_submit_rst_stream(con->session, NGHTTP2_FLAG_NONE, stream->stream_id,
+                                              NGHTTP2_PROTOCOL_ERROR);
+                    break;
+                }
+                sbufShiftRight(gdata_buf, framedecoderGetHeaderLength(&stream->grpc_decoder));
+                if (sbufGetBufLength(gdata_buf) == 0)
+                {
+                    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), gdata_buf);
+                    continue;
+                }
 
-                    // check http2 connection is alive
-                    if (! lineIsAlive(action.stream_line) || ! lineIsAlive(main_line))
-                    {
-                        lineUnlock(action.stream_line);
-                        return;
-                    }
+                self->dw->fnPayloadD(self->dw, stream->line, gdata_buf);
 
-                    continue;
+                // check http2 connection is alive
+                if (! lineIsAlive(action.stream_line) || ! lineIsAlive(main_line))
+                {
+                    lineUnlock(action.stream_line);
+                    return;
                 }
-                break;
             }
         }
         else
         {
-            sbuf_t *buf         = action.buf;
-            context_t      *stream_data = contextCreate(stream->line);
-            stream_data->payload        = buf;
-            stream->tunnel->dw->downStream(stream->tunnel->dw, stream_data);
+            self->dw->fnPayloadD(self->dw, stream->line, action.buf);
         }
         if (! lineIsAlive(action.stream_line) || ! lineIsAlive(main_line))
         {
@@ -334,12 +389,11 @@ static void doHttp2Action(const http2_action_t action, http2_client_con_state_t
     break;
 
     case kActionStreamFinish: {
-        context_t *fc   = contextCreateFin(stream->line);
-        tunnel_t  *dest = stream->tunnel->dw;
+        line_t *stream_line = stream->line;
         nghttp2_session_set_stream_user_data(con->session, stream->stream_id, NULL);
         removeStream(con, stream);
         deleteHttp2Stream(stream);
-        dest->downStream(dest, fc);
+        self->dw->fnFinD(self->dw, stream_line);
     }
     break;
     case kActionConData: {
@@ -354,230 +408,267 @@ static void doHttp2Action(const http2_action_t action, http2_client_con_state_t
     lineUnlock(action.stream_line);
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    http2_client_state_t *state = TSTATE(self);
+    http2_client_child_con_state_t *stream = lineGetState(self, line);
+    http2_client_con_state_t       *con    = lineGetState(self, stream->parent);
 
-    if (c->payload != NULL)
+    if (! con->handshake_completed)
     {
-        http2_client_child_con_state_t *stream = CSTATE(c);
-        http2_client_con_state_t       *con    = LSTATE(stream->parent);
+        lineLock(line);
+        action_queue_t_push(&con->pending,
+                            (http2_action_t) {.action_id = kActionConData, .stream_line = line, .buf = payload});
+        return;
+    }
+
+    sendStreamData(con, stream, payload);
 
-        if (! con->handshake_completed)
+    lineLock(con->line);
+    while (sendNgHttp2Data(self, con))
+    {
+        if (! lineIsAlive(con->line))
         {
-            contextqueuePush(con->queue, c);
-            return;
+            break;
         }
+    }
+    lineUnlock(con->line);
+}
 
-        lineLock(con->line);
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    http2_client_con_state_t       *con    = takeHttp2Connection(self, getWID());
+    http2_client_child_con_state_t *stream = createHttp2Stream(con, line);
+    nghttp2_session_set_stream_user_data(con->session, stream->stream_id, stream);
+    lineLock(con->line);
 
-        while (sendNgHttp2Data(self, con))
+    if (! con->init_sent)
+    {
+        con->init_sent = true;
+        self->up->fnInitU(self->up, con->line);
+        if (! lineIsAlive(con->line))
         {
-            if (! lineIsAlive(con->line))
-            {
-                lineUnlock(con->line);
-                contextDestroy(c);
-                return;
-            }
+            lineUnlock(con->line);
+            return;
         }
-
-        sendStreamData(con, stream, c->payload);
-        
-        lineUnlock(con->line);
-
-        contextDropPayload(c);
-        contextDestroy(c);
     }
-    else
+
+    while (sendNgHttp2Data(self, con))
     {
-        if (c->init)
+        if (! lineIsAlive(con->line))
         {
-            http2_client_con_state_t       *con    = takeHttp2Connection(self, getWID());
-            http2_client_child_con_state_t *stream = createHttp2Stream(con, c->line);
-            CSTATE_MUT(c)                          = stream;
-            nghttp2_session_set_stream_user_data(con->session, stream->stream_id, stream);
-            lineLock(con->line);
-
-            if (! con->init_sent)
-            {
-                con->init_sent = true;
-                self->up->upStream(self->up, contextCreateInit(con->line));
-                if (! lineIsAlive(con->line))
-                {
-                    lineUnlock(con->line);
-                    contextDestroy(c);
-                    return;
-                }
-            }
-
-            while (sendNgHttp2Data(self, con))
-            {
-                if (! lineIsAlive(con->line))
-                {
-                    lineUnlock(con->line);
-                    contextDestroy(c);
-                    return;
-                }
-            }
             lineUnlock(con->line);
-
-            contextDestroy(c);
+            return;
         }
-        else if (c->fin)
-        {
-            http2_client_child_con_state_t *stream = CSTATE(c);
-            http2_client_con_state_t       *con    = LSTATE(stream->parent);
-            CSTATE_DROP(c);
-
-            int flags = NGHTTP2_FLAG_END_STREAM | NGHTTP2_FLAG_END_HEADERS;
-            if (con->content_type == kApplicationGrpc)
-            {
-                nghttp2_nv nv = makeNV("grpc-status", "0");
-                nghttp2_submit_headers(con->session, flags, stream->stream_id, NULL, &nv, 1, NULL);
-            }
-            else
-            {
-                nghttp2_submit_headers(con->session, flags, stream->stream_id, NULL, NULL, 0, NULL);
-            }
-            // LOGD("closing -> %d", (int) stream->stream_id);
-            nghttp2_session_set_stream_user_data(con->session, stream->stream_id, NULL);
-            removeStream(con, stream);
-            deleteHttp2Stream(stream);
+    }
+    lineUnlock(con->line);
+}
 
-            lineLock(con->line);
-            while (sendNgHttp2Data(self, con))
-            {
-                if (! lineIsAlive(con->line))
-                {
-                    lineUnlock(con->line);
-                    contextDestroy(c);
-                    return;
-                }
-            }
-            lineUnlock(con->line);
+static void upStreamFin(tunnel_t *self, line_t *line)
+{
+    http2_client_state_t           *state  = tunnelGetState(self);
+    http2_client_child_con_state_t *stream = lineGetState(self, line);
+    http2_client_con_state_t       *con    = lineGetState(self, stream->parent);
 
-            if (con->root.next == NULL && con->childs_added >= state->concurrency)
-            {
-                context_t *con_fc   = contextCreateFin(con->line);
-                tunnel_t  *con_dest = con->tunnel->up;
-                deleteHttp2Connection(con);
-                con_dest->upStream(con_dest, con_fc);
-            }
+    int flags = NGHTTP2_FLAG_END_STREAM | NGHTTP2_FLAG_END_HEADERS;
+    if (stream->data_source)
+    {
+        // the queued data goes first, the source ends the stream after it
+        http2datasourceEnd(con->session, stream->data_source, con->content_type == kApplicationGrpc);
+    }
+    else if (con->content_type == kApplicationGrpc)
+    {
+        nghttp2_nv nv = makeNV("grpc-status", "0");
+        nghttp2_submit_headers(con->session, flags, stream->stream_id, NULL, &nv, 1, NULL);
+    }
+    else
+    {
+        nghttp2_submit_headers(con->session, flags, stream->stream_id, NULL, NULL, 0, NULL);
+    }
+    // LOGD("closing -> %d", (int) stream->stream_id);
+    nghttp2_session_set_stream_user_data(con->session, stream->stream_id, NULL);
+    removeStream(con, stream);
+    deleteHttp2Stream(stream);
 
-            contextDestroy(c);
+    lineLock(con->line);
+    while (sendNgHttp2Data(self, con))
+    {
+        if (! lineIsAlive(con->line))
+        {
+            lineUnlock(con->line);
             return;
         }
     }
+    lineUnlock(con->line);
+
+    if (con->root.next == NULL && con->childs_added >= state->concurrency && http2datasourceAllSent(con->data_sources))
+    {
+        closeHttp2Connection(con);
+    }
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+// a stream can not write downwards, stop reading the http2 connection
+static void upStreamPause(tunnel_t *self, line_t *line)
 {
-    http2_client_state_t     *state = TSTATE(self);
-    http2_client_con_state_t *con   = CSTATE(c);
-    if (c->payload != NULL)
+    http2_client_child_con_state_t *stream = lineGetState(self, line);
+    self->up->fnPauseU(self->up, stream->parent);
+}
+
+static void upStreamResume(tunnel_t *self, line_t *line)
+{
+    http2_client_child_con_state_t *stream = lineGetState(self, line);
+    self->up->fnResumeU(self->up, stream->parent);
+}
+
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    http2_client_state_t     *state = tunnelGetState(self);
+    http2_client_con_state_t *con   = lineGetState(self, line);
+    size_t                    len   = 0;
+
+    lineLock(line);
+
+    while ((len = sbufGetBufLength(payload)) > 0)
     {
-        size_t len = 0;
-        while ((len = sbufGetBufLength(c->payload)) > 0)
-        {
-            size_t  consumed = min(1 << 15UL, (ssize_t) len);
-            ssize_t ret      = nghttp2_session_mem_recv2(con->session, (const uint8_t *) sbufGetRawPtr(c->payload), consumed);
-            sbufShiftRight(c->payload, consumed);
+        size_t  consumed = min(1 << 15UL, (ssize_t) len);
+        ssize_t ret      = nghttp2_session_mem_recv2(con->session, (const uint8_t *) sbufGetRawPtr(payload), consumed);
+        sbufShiftRight(payload, consumed);
 
-            if (ret != (ssize_t) consumed)
-            {
-                // assert(false);
-                deleteHttp2Connection(con);
-                self->up->upStream(self->up, contextCreateFin(c->line));
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
-            }
+        if (ret != (ssize_t) consumed)
+        {
+            // assert(false);
+            closeHttp2Connection(con);
+            goto done;
+        }
 
-            while (sendNgHttp2Data(self, con))
+        while (sendNgHttp2Data(self, con))
+        {
+            if (! lineIsAlive(line))
             {
-                if (! lineIsAlive(c->line))
-                {
-                    contextReusePayload(c);
-                    contextDestroy(c);
-                    return;
-                }
+                goto done;
             }
+        }
 
-            while (action_queue_t_size(&con->actions) > 0)
+        while (action_queue_t_size(&con->actions) > 0)
+        {
+            const http2_action_t action = action_queue_t_pull_front(&con->actions);
+            doHttp2Action(action, con);
+            if (! lineIsAlive(line))
             {
-                const http2_action_t action = action_queue_t_pull_front(&con->actions);
-                doHttp2Action(action, con);
-                if (! lineIsAlive(c->line))
-                {
-                    contextReusePayload(c);
-                    contextDestroy(c);
-                    return;
-                }
+                goto done;
             }
+        }
 
-            while (sendNgHttp2Data(self, con))
-            {
-                if (! lineIsAlive(c->line))
-                {
-                    contextReusePayload(c);
-                    contextDestroy(c);
-                    return;
-                }
-            }
-            if (nghttp2_session_want_read(con->session) == 0 && nghttp2_session_want_write(con->session) == 0)
+        while (sendNgHttp2Data(self, con))
+        {
+            if (! lineIsAlive(line))
             {
-                context_t *fin_ctx = contextCreateFin(con->line);
-                deleteHttp2Connection(con);
-                self->up->upStream(self->up, fin_ctx);
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
+                goto done;
             }
         }
-
-        if (con->root.next == NULL && con->childs_added >= state->concurrency)
+        if (nghttp2_session_want_read(con->session) == 0 && nghttp2_session_want_write(con->session) == 0)
         {
-            context_t *con_fc = contextCreateFin(con->line);
-            deleteHttp2Connection(con);
-            self->up->upStream(self->up, con_fc);
+            closeHttp2Connection(con);
+            goto done;
         }
+    }
 
-        contextReusePayload(c);
-        contextDestroy(c);
+    if (con->root.next == NULL && con->childs_added >= state->concurrency && http2datasourceAllSent(con->data_sources))
+    {
+        closeHttp2Connection(con);
     }
-    else
+
+done:
+    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+    lineUnlock(line);
+}
+
+static void downStreamEst(tunnel_t *self, line_t *line)
+{
+    (void) self;
+    (void) line;
+}
+
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    deleteHttp2Connection(lineGetState(self, line));
+    lineDestroy(line);
+}
+
+// the http2 connection can not be written, pause the stream that was writing
+static void downStreamPause(tunnel_t *self, line_t *line)
+{
+    http2_client_con_state_t *con         = lineGetState(self, line);
+    line_t                   *stream_line = con->current_stream_write_line;
+
+    if (stream_line && lineIsAlive(stream_line))
     {
+        http2_client_child_con_state_t *stream = lineGetState(self, stream_line);
+        stream->paused                         = true;
+        self->dw->fnPauseD(self->dw, stream_line);
+    }
+}
+
+static void downStreamResume(tunnel_t *self, line_t *line)
+{
+    http2_client_con_state_t *con = lineGetState(self, line);
 
-        if (c->fin)
+    for (http2_client_child_con_state_t *stream_i = con->root.next; stream_i; stream_i = stream_i->next)
+    {
+        if (stream_i->paused)
         {
-            deleteHttp2Connection(con);
+            stream_i->paused = false;
+            self->dw->fnResumeD(self->dw, stream_i->line);
         }
-
-        contextDestroy(c);
     }
 }
 
-tunnel_t *newHttp2Client(node_instance_context_t *instance_info)
+tunnel_t *newHttp2Client(node_t *node)
 {
-    http2_client_state_t *state =
-        memoryAllocate(sizeof(http2_client_state_t) + (getWorkersCount() * sizeof(thread_connection_pool_t)));
-    memorySet(state, 0, sizeof(http2_client_state_t));
-    cJSON *settings = instance_info->node_settings_json;
+    tunnel_t *t = tunnelCreate(node, sizeof(http2_client_state_t) + getWorkersCount() * sizeof(thread_connection_pool_t),
+                               sizeof(http2_client_con_state_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPauseU   = &upStreamPause;
+    t->fnResumeU  = &upStreamResume;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnEstD     = &downStreamEst;
+    t->fnFinD     = &downStreamFin;
+    t->fnPauseD   = &downStreamPause;
+    t->fnResumeD  = &downStreamResume;
+
+    http2_client_state_t *state    = tunnelGetState(t);
+    const cJSON          *settings = node->node_settings_json;
 
     nghttp2_session_callbacks_new(&(state->cbs));
     nghttp2_session_callbacks_set_on_header_callback(state->cbs, onHeaderCallBack);
     nghttp2_session_callbacks_set_on_data_chunk_recv_callback(state->cbs, onDataChunkRecvCallBack);
     nghttp2_session_callbacks_set_on_frame_recv_callback(state->cbs, onFrameRecvCallBack);
     nghttp2_session_callbacks_set_on_stream_close_callback(state->cbs, onStreamClosedCallBack);
+    nghttp2_session_callbacks_set_send_data_callback(state->cbs, onSendDataCallBack);
+
+    int min_window = 0;
+    int max_window = 0;
+    int budget_mb  = 0;
+    getIntFromJsonObjectOrDefault(&min_window, settings, "min-window", kDefaultMinRecvWindow);
+    getIntFromJsonObjectOrDefault(&max_window, settings, "max-window", kDefaultMaxRecvWindow);
+    getIntFromJsonObjectOrDefault(&budget_mb, settings, "window-budget", kDefaultWindowBudgetMB);
 
+    state->min_window = (uint32_t) min(max(NGHTTP2_INITIAL_WINDOW_SIZE, min_window), NGHTTP2_MAX_WINDOW_SIZE);
+    state->max_window = (uint32_t) min(max((int) state->min_window, max_window), NGHTTP2_MAX_WINDOW_SIZE);
+
+    const bdp_budget_t window_budget = {.limit = (uint64_t) max(0, budget_mb) * 1024 * 1024};
     for (size_t i = 0; i < getWorkersCount(); i++)
     {
-        state->thread_cpool[i] = (thread_connection_pool_t) {.round_index = 0, .cons = vec_cons_with_capacity(8)};
+        state->thread_cpool[i] = (thread_connection_pool_t) {
+            .round_index = 0, .cons = vec_cons_with_capacity(8), .window_budget = window_budget};
     }
 
     if (! getStringFromJsonObject(&(state->host), settings, "host"))
     {
         LOGF("JSON Error: Http2Client->settings->host (string field) : The data was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
     getStringFromJsonObjectOrDefault(&(state->path), settings, "path", "/");
@@ -585,6 +676,7 @@ tunnel_t *newHttp2Client(node_instance_context_t *instance_info)
     if (! getIntFromJsonObject(&(state->host_port), settings, "port"))
     {
         LOGF("JSON Error: Http2Client->settings->port (number field) : The data was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
@@ -607,11 +699,6 @@ tunnel_t *newHttp2Client(node_instance_context_t *instance_info)
     nghttp2_option_set_no_http_messaging(state->ngoptions, 1);
     // nghttp2_option_set_no_http_messaging use this with grpc?
 
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     return t;
 }
 
@@ -630,5 +717,7 @@ tunnel_t *destroyHttp2Client(tunnel_t *self)
 
 tunnel_metadata_t getMetadataHttp2Client(void)
 {
-    return (tunnel_metadata_t) {.version = 0001, .flags = 0x0};
+    // DATA frame headers (and the gRPC prefix) are written in front of the payloads
+    return (tunnel_metadata_t) {
+        .version = 0001, .flags = 0x0, .required_padding_left = HTTP2_FRAME_HDLEN + GRPC_MESSAGE_HDLEN};
 }
@@ -1,5 +1,5 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
 
 
 //  con (http2 stream)  <------>
@@ -7,7 +7,7 @@
 //  con (http2 stream)  <------>
 
 
-tunnel_t *        newHttp2Client(node_instance_context_t *instance_info);
+tunnel_t *        newHttp2Client(node_t *node);
 api_result_t      apiHttp2Client(tunnel_t *self,const char *msg);
 tunnel_t *        destroyHttp2Client(tunnel_t *self);
 tunnel_metadata_t getMetadataHttp2Client(void);
@@ -1,7 +1,10 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
+#include "bdp_window.h"
 #include "buffer_stream.h"
+#include "frame_decoder.h"
 #include "grpc_def.h"
+#include "http2_data_source.h"
 #include "http2_def.h"
 #include "http_def.h"
 #include "loggers/network_logger.h"
@@ -20,23 +23,28 @@ typedef struct http2_action_s
 {
     enum http2_actions action_id;
     line_t            *stream_line;
-    sbuf_t    *buf;
+    sbuf_t            *buf;
 
 } http2_action_t;
 
 #define i_type action_queue_t
-#define i_key  http2_action_t 
+#define i_key  http2_action_t
 #include "stc/deque.h"
 
+/*
+    The http2 connection state lives in the line state of the main line (created by this tunnel) and each stream
+    state in the line state of its own child line, both use the same slot; the connection embeds a stream (root)
+    so it is always the bigger one and sets the line state size
+*/
 typedef struct http2_client_child_con_state_s
 {
     struct http2_client_child_con_state_s *prev, *next;
     nghttp2_stream                        *ng_stream;
-    buffer_stream_t                       *grpc_buffer_stream;
     tunnel_t                              *tunnel;
     line_t                                *parent;
     line_t                                *line;
-    size_t                                 grpc_bytes_needed;
+    http2_data_source_t                   *data_source; // NULL until the stream sends data
+    frame_decoder_t                        grpc_decoder; // only for grpc
     int32_t                                stream_id;
     bool                                   paused;
 
@@ -46,8 +54,10 @@ typedef struct http2_client_con_state_s
 {
     http2_client_child_con_state_t root;
     action_queue_t                 actions;
+    action_queue_t                 pending; // stream data waiting for the response headers
+    http2_frame_queue_t            frames;  // DATA frames nghttp2 released during mem_send
+    http2_data_source_t           *data_sources;
     nghttp2_session               *session;
-    context_queue_t               *queue;
     wtimer_t                      *ping_timer;
     tunnel_t                      *tunnel;
     line_t                        *line;
@@ -57,8 +67,8 @@ typedef struct http2_client_con_state_s
     const char                    *scheme;
     enum http_method               method;
     enum http_content_type         content_type;
+    bdp_window_t                   recv_window; // per stream and connection receive window we advertise
     size_t                         childs_added;
-    uint32_t                       pause_counter;
     int                            error;
     int                            frame_type_when_stream_closed;
     int                            host_port;
@@ -75,8 +85,9 @@ typedef struct http2_client_con_state_s
 
 typedef struct thread_connection_pool_s
 {
-    vec_cons cons;
-    size_t   round_index;
+    vec_cons     cons;
+    size_t       round_index;
+    bdp_budget_t window_budget;
 } thread_connection_pool_t;
 
 typedef struct http2_client_state_s
@@ -88,6 +99,8 @@ typedef struct http2_client_state_s
     char                      *host; // authority
     enum http_content_type     content_type;
     size_t                     concurrency;
+    uint32_t                   min_window;
+    uint32_t                   max_window;
     int                        host_port;
     int                        last_iid;
     thread_connection_pool_t   thread_cpool[];
@@ -1,8 +1,8 @@
 #include "mux_client.h"
-#include "buffer_stream.h"
+#include "frame_decoder.h"
 #include "loggers/network_logger.h"
 #include "mux_frame.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
 enum concurrency_mode
 {
@@ -10,9 +10,15 @@ enum concurrency_mode
     kCuncurrencyModeCounter = 2
 };
 
-#define i_type    vec_cons                        // NOLINT
-#define i_key     struct mux_client_con_state_s * // NOLINT
-#define i_use_cmp                                 // NOLINT
+enum
+{
+    kDefaultConnectionCapacity = 8,
+    kDefaultWidth              = 2
+};
+
+#define i_type    vec_cons                    // NOLINT
+#define i_key     struct mux_client_lstate_s * // NOLINT
+#define i_use_cmp                             // NOLINT
 #include "stc/vec.h"
 
 typedef struct thread_connection_pool_s
@@ -32,181 +38,155 @@ typedef struct mux_client_state_s
 
 } mux_client_state_t;
 
-typedef struct mux_client_child_con_state_s
-{
-
-    struct mux_client_child_con_state_s *next, *prev;
-    tunnel_t                            *tunnel;
-    line_t                              *line;
-    line_t                              *parent;
-    uint32_t                             sent_nack;
-    uint32_t                             recv_nack;
-    uint16_t                             cid;
-    bool                                 paused;
-    bool                                 first_sent;
-
-} mux_client_child_con_state_t;
-
-typedef struct mux_client_con_state_s
-{
-    struct mux_client_child_con_state_s children_root;
-
-    tunnel_t        *tunnel;
-    line_t          *line;
-    line_t          *current_writing_line;
-    buffer_stream_t *read_stream;
-    uint64_t         creation_epoch;
-    uint16_t         last_cid;
-    uint16_t         cid_min;
-    uint16_t         cid_max;
-    uint16_t         contained;
-
-} mux_client_con_state_t;
-
-static void onChildLinePaused(void *arg)
+/*
+    the child lines (from the users) and the main lines (created here, shared by many children) are both lines of
+    this chain, so they share the line state slot of this tunnel, is_child tells which half is in use
+*/
+typedef struct mux_client_lstate_s
 {
-    mux_client_child_con_state_t *stream = (mux_client_child_con_state_t *) arg;
-    pauseLineUpSide(stream->parent);
-}
-static void onChildLineResumed(void *arg)
+    struct mux_client_lstate_s *next, *prev; // child: siblings
+
+    tunnel_t *tunnel;
+    line_t   *line;
+
+    // main line
+    struct mux_client_lstate_s *children;
+    line_t                     *current_writing_line;
+    frame_decoder_t             read_decoder;
+    uint64_t                    creation_epoch;
+    uint16_t                    last_cid;
+    uint16_t                    contained;
+
+    // child line
+    line_t  *parent;
+    uint32_t sent_nack;
+    uint32_t recv_nack;
+    uint16_t cid;
+    bool     paused;
+    bool     first_sent;
+    bool     is_child;
+
+} mux_client_lstate_t;
+
+static void destroyChildConnecton(mux_client_lstate_t *child)
 {
-    mux_client_child_con_state_t *stream = (mux_client_child_con_state_t *) arg;
-    resumeLineUpSide(stream->parent);
-}
-
-static void onMainLinePaused(void *arg)
-{
-    mux_client_con_state_t *con  = (mux_client_con_state_t *) arg;
-    tunnel_t               *self = con->tunnel;
-
-    line_t *wline = con->current_writing_line;
-    if (wline && lineIsAlive(wline))
+    if (child->prev)
     {
-        mux_client_child_con_state_t *child_con = LSTATE(wline);
-        child_con->paused                       = true;
-        pauseLineDownSide(child_con->line);
+        child->prev->next = child->next;
     }
-}
-
-static void onMainLineResumed(void *arg)
-{
-    mux_client_con_state_t       *con = (mux_client_con_state_t *) arg;
-    mux_client_child_con_state_t *child_con_i;
-    for (child_con_i = con->children_root.next; child_con_i;)
+    else
     {
-        if (child_con_i->paused)
-        {
-            child_con_i->paused = false;
-            resumeLineDownSide(child_con_i->line);
-        }
-        child_con_i = child_con_i->next;
+        mux_client_lstate_t *parent = lineGetState(child->tunnel, child->parent);
+        parent->children            = child->next;
     }
-}
-
-static void destroyChildConnecton(mux_client_child_con_state_t *child)
-{
-    tunnel_t *self    = child->tunnel;
-    child->prev->next = child->next;
     if (child->next)
     {
         child->next->prev = child->prev;
     }
-    else
-    {
-        mux_client_con_state_t *parent = LSTATE(child->parent);
-        parent->children_root.prev     = NULL;
-    }
-    doneLineUpSide(child->line);
-    LSTATE_DROP(child->line);
-    memoryFree(child);
+    lineClearState(child, sizeof(mux_client_lstate_t));
 }
 
-static mux_client_child_con_state_t *createChildConnection(mux_client_con_state_t *parent, line_t *child_line)
+static void createChildConnection(mux_client_lstate_t *parent, line_t *child_line)
 {
-    mux_client_child_con_state_t *child = memoryAllocate(sizeof(mux_client_con_state_t));
+    mux_client_lstate_t *child = lineGetState(parent->tunnel, child_line);
 
-    *child = (mux_client_child_con_state_t) {.tunnel = parent->tunnel,
-                                             .line   = child_line,
-                                             .cid    = parent->last_cid++,
-                                             .next   = parent->children_root.next,
-                                             .prev   = &(parent->children_root)
-
-    };
-
-    if (parent->children_root.next == NULL)
-    {
-        parent->children_root.prev = child;
-    }
-    parent->children_root.next = child;
+    *child = (mux_client_lstate_t) {.tunnel   = parent->tunnel,
+                                    .line     = child_line,
+                                    .parent   = parent->line,
+                                    .cid      = parent->last_cid++,
+                                    .is_child = true,
+                                    .next     = parent->children,
+                                    .prev     = NULL};
 
     if (child->next)
     {
         child->next->prev = child;
     }
-    setupLineUpSide(child->line, onChildLinePaused, child, onChildLineResumed);
-
-    return child;
+    parent->children = child;
 }
 
-static void destroyMainConnecton(mux_client_con_state_t *con)
+static void removeFromPool(tunnel_t *self, mux_client_lstate_t *con)
 {
-    tunnel_t *self = con->tunnel;
+    mux_client_state_t *state  = tunnelGetState(self);
+    vec_cons           *vector = &(state->threadlocal_cons[getWID()].cons);
 
-    mux_client_child_con_state_t *child_con_i;
-    for (child_con_i = con->children_root.next; child_con_i;)
+    vec_cons_iter find_result = vec_cons_find(vector, con);
+    if (find_result.ref != vec_cons_end(vector).ref)
     {
+        vec_cons_erase_at(vector, find_result);
+    }
+}
 
-        mux_client_child_con_state_t *next    = child_con_i;
-        context_t                    *fin_ctx = contextCreateFin(child_con_i->line);
-        tunnel_t                     *dest    = con->tunnel->dw;
+// closes every stream and forgets the connection, the caller sends the main line fin and destroys it
+static void destroyMainConnecton(mux_client_lstate_t *con)
+{
+    tunnel_t *self = con->tunnel;
 
-        destroyChildConnecton(child_con_i);
-        dest->downStream(dest, fin_ctx);
-        child_con_i = next;
+    removeFromPool(self, con);
+    while (con->children)
+    {
+        line_t *child_line = con->children->line;
+        destroyChildConnecton(con->children);
+        self->dw->fnFinD(self->dw, child_line);
     }
-    bufferstreamDestroy(con->read_stream);
-    doneLineDownSide(con->line);
-    LSTATE_DROP(con->line);
-    memoryFree(con);
+    framedecoderDestroy(&con->read_decoder);
+    lineClearState(con, sizeof(mux_client_lstate_t));
 }
 
-static mux_client_con_state_t *createMainConnection(tunnel_t *self, wid_t tid)
+static void closeMainConnection(tunnel_t *self, mux_client_lstate_t *con)
 {
-    mux_client_con_state_t *con = memoryAllocate(sizeof(mux_client_con_state_t));
+    line_t *main_line = con->line;
+    destroyMainConnecton(con);
+    self->up->fnFinU(self->up, main_line);
+    lineDestroy(main_line);
+}
+
+static mux_client_lstate_t *createMainConnection(tunnel_t *self, wid_t wid)
+{
+    line_t              *main_line = newLine(tunnelchainGetLinePool(tunnelGetChain(self), wid));
+    mux_client_lstate_t *con       = lineGetState(self, main_line);
 
-    *con = (mux_client_con_state_t) {.tunnel         = self,
-                                     .line           = newLine(tid),
-                                     .children_root  = {0},
-                                     .creation_epoch = wloopNow(getWorkerLoop(tid)),
-                                     .read_stream    = bufferstreamCreate(getWorkerBufferPool(tid))};
+    *con = (mux_client_lstate_t) {
+        .tunnel = self, .line = main_line, .creation_epoch = wloopNow(getWorkerLoop(wid))};
+    framedecoderInit(&con->read_decoder, getWorkerBufferPool(wid), kMuxFrameFormat);
 
-    setupLineDownSide(con->line, onMainLinePaused, con, onMainLineResumed);
+    lineLock(main_line);
+    self->up->fnInitU(self->up, main_line);
 
-    LSTATE_MUT(con->line) = con;
+    if (! lineIsAlive(main_line))
+    {
+        lineUnlock(main_line);
+        return NULL;
+    }
+    lineUnlock(main_line);
     return con;
 }
 
-static mux_client_con_state_t *grabConnection(tunnel_t *self, wid_t tid)
+static mux_client_lstate_t *grabConnection(tunnel_t *self, wid_t wid)
 {
-    mux_client_state_t *state  = TSTATE(self);
-    vec_cons           *vector = &(state->threadlocal_cons[tid].cons);
+    mux_client_state_t *state  = tunnelGetState(self);
+    vec_cons           *vector = &(state->threadlocal_cons[wid].cons);
 
     while (true)
     {
-        unsigned int i = state->threadlocal_cons[tid].round_index;
-        state->threadlocal_cons[tid].round_index++;
-        if (state->threadlocal_cons[tid].round_index > state->width - 1)
+        unsigned int i = state->threadlocal_cons[wid].round_index;
+        state->threadlocal_cons[wid].round_index++;
+        if (state->threadlocal_cons[wid].round_index > state->width - 1)
         {
-            state->threadlocal_cons[tid].round_index = 0;
+            state->threadlocal_cons[wid].round_index = 0;
         }
 
-        if ((unsigned int)vec_cons_size(vector) <= i)
+        if ((unsigned int) vec_cons_size(vector) <= i)
         {
-            mux_client_con_state_t *con = createMainConnection(self, tid);
-            vec_cons_push(vector, con);
+            mux_client_lstate_t *con = createMainConnection(self, wid);
+            if (con != NULL)
+            {
+                con->contained = 1;
+                vec_cons_push(vector, con);
+            }
             return con;
         }
-        struct mux_client_con_state_s *con = *vec_cons_at(vector, i);
+        mux_client_lstate_t *con = *vec_cons_at(vector, i);
 
         switch (state->mode)
         {
@@ -221,297 +201,308 @@ static mux_client_con_state_t *grabConnection(tunnel_t *self, wid_t tid)
                 }
                 return con;
             }
-            else
-            {
-                vec_cons_erase_n(vector, i, 1);
-                return grabConnection(self, tid);
-            }
-
+            vec_cons_erase_n(vector, i, 1);
             break;
 
         case kCuncurrencyModeTimer:
-            if (con->creation_epoch < wloopNow(getWorkerLoop(tid)) + state->connection_cunc_duration)
+            if (con->creation_epoch + state->connection_cunc_duration > wloopNow(getWorkerLoop(wid)))
             {
                 return con;
-                break;
-            }
-            else
-            {
-                vec_cons_erase_n(vector, i, 1);
-                return grabConnection(self, tid);
             }
-
+            vec_cons_erase_n(vector, i, 1);
             break;
         }
     }
 }
 
-static bool shouldClose(tunnel_t *self, mux_client_con_state_t *main_con)
+static bool shouldClose(tunnel_t *self, mux_client_lstate_t *main_con)
 {
-    mux_client_state_t *state  = TSTATE(self);
-    wid_t               tid    =  getWID();
-    vec_cons           *vector = &(state->threadlocal_cons[tid].cons);
+    mux_client_state_t *state = tunnelGetState(self);
+
+    if (main_con->children != NULL)
+    {
+        return false;
+    }
 
     switch (state->mode)
     {
     default:
     case kCuncurrencyModeCounter:
-        if (main_con->contained >= state->connection_cunc_capacity && main_con->children_root.next == NULL)
-        {
-            vec_cons_iter find_result = vec_cons_find(vector, main_con);
-            if (find_result.ref != vec_cons_end(vector).ref)
-            {
-                vec_cons_erase_at(vector, find_result);
-            }
-            return true;
-        }
-        break;
+        return main_con->contained >= state->connection_cunc_capacity;
 
     case kCuncurrencyModeTimer:
-        if (main_con->creation_epoch >= wloopNow(getWorkerLoop(tid)) + state->connection_cunc_duration)
-        {
-            vec_cons_iter find_result = vec_cons_find(vector, main_con);
-            if (find_result.ref != vec_cons_end(vector).ref)
-            {
-                vec_cons_erase_at(vector, find_result);
-            }
-            return true;
-        }
-
-        break;
+        return main_con->creation_epoch + state->connection_cunc_duration <= wloopNow(getWorkerLoop(getWID()));
     }
-    return false;
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamInit(tunnel_t *self, line_t *line)
 {
-    mux_client_child_con_state_t *child_con = CSTATE(c);
-    if (c->payload != NULL)
-    {
-        line_t *current_writing_line = c->line;
-        line_t *main_line            = child_con->parent;
-
-        contextSwitchLine(c, main_line);
-        mux_client_con_state_t *main_con = CSTATE(c);
-
-        lineLock(main_line);
-        lineLock(current_writing_line);
-        main_con->current_writing_line = current_writing_line;
+    mux_client_lstate_t *main_con = grabConnection(self, getWID());
 
-        while (sbufGetBufLength(c->payload) > kMuxMaxFrameLength)
-        {
-            sbuf_t *chunk = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-            chunk = sbufMoveTo(chunk, c->payload, kMuxMaxFrameLength);
-
-            if (! child_con->first_sent)
-            {
-                child_con->first_sent = true;
-                makeOpenFrame(chunk, child_con->cid);
-            }
-            else
-            {
-                makeDataFrame(chunk, child_con->cid);
-            }
+    if (main_con == NULL)
+    {
+        self->dw->fnFinD(self->dw, line);
+        return;
+    }
+    createChildConnection(main_con, line);
+    self->dw->fnEstD(self->dw, line);
+}
 
-            context_t *data_chunk_ctx = contextCreateFrom(c);
-            data_chunk_ctx->payload   = chunk;
-            self->up->upStream(self->up, data_chunk_ctx);
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    mux_client_lstate_t *child_con = lineGetState(self, line);
+    line_t              *main_line = child_con->parent;
+    mux_client_lstate_t *main_con  = lineGetState(self, main_line);
 
-            if (! lineIsAlive(main_line))
-            {
-                lineUnlock(main_line);
-                lineUnlock(current_writing_line);
+    lineLock(main_line);
+    main_con->current_writing_line = line;
 
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
-            }
-        }
+    while (sbufGetBufLength(payload) > kMuxMaxFrameLength)
+    {
+        sbuf_t *chunk = bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID()));
+        chunk         = sbufMoveTo(chunk, payload, kMuxMaxFrameLength);
 
         if (! child_con->first_sent)
         {
             child_con->first_sent = true;
-            makeOpenFrame(c->payload, child_con->cid);
+            makeOpenFrame(chunk, child_con->cid);
         }
         else
         {
-            makeDataFrame(c->payload, child_con->cid);
+            makeDataFrame(chunk, child_con->cid);
         }
 
-        self->up->upStream(self->up, c);
+        self->up->fnPayloadU(self->up, main_line, chunk);
 
-        if (lineIsAlive(main_line))
+        if (! lineIsAlive(main_line))
         {
-            main_con->current_writing_line = NULL;
+            lineUnlock(main_line);
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+            return;
         }
+    }
 
-        lineUnlock(main_line);
-        lineUnlock(current_writing_line);
+    if (! child_con->first_sent)
+    {
+        child_con->first_sent = true;
+        makeOpenFrame(payload, child_con->cid);
     }
     else
     {
-        if (c->init)
-        {
-            mux_client_con_state_t *main_con = grabConnection(self, getWID());
-            child_con                        = createChildConnection(main_con, c->line);
-            CSTATE_MUT(c)                    = child_con;
-            self->dw->downStream(self->dw, contextCreateEst(c->line));
+        makeDataFrame(payload, child_con->cid);
+    }
 
-            contextDestroy(c);
-        }
-        else
-        {
-            mux_client_con_state_t *main_con = LSTATE(child_con->parent);
+    self->up->fnPayloadU(self->up, main_line, payload);
 
-            context_t *data_fin_ctx = contextCreate(child_con->parent);
-            data_fin_ctx->payload   = bufferpoolGetLargeBuffer(getWorkerBufferPool(child_con->parent));
-            makeCloseFrame(data_fin_ctx->payload, child_con->cid);
-            destroyChildConnecton(child_con);
-            lineLock(main_con->line);
-            self->up->upStream(self->up, data_fin_ctx);
+    if (lineIsAlive(main_line))
+    {
+        main_con->current_writing_line = NULL;
+    }
 
-            if (! lineIsAlive(main_con->line))
-            {
-                lineUnlock(main_con->line);
-                return;
-            }
-            lineUnlock(main_con->line);
+    lineUnlock(main_line);
+}
 
-            if (shouldClose(self, main_con))
-            {
-                context_t *main_con_fin_ctx = contextCreateFin(main_con->line);
-                destroyMainConnecton(main_con);
-                self->up->upStream(self->up, main_con_fin_ctx);
-            }
+static void upStreamFin(tunnel_t *self, line_t *line)
+{
+    mux_client_lstate_t *child_con  = lineGetState(self, line);
+    line_t              *main_line  = child_con->parent;
+    mux_client_lstate_t *main_con   = lineGetState(self, main_line);
+    bool                 first_sent = child_con->first_sent;
+    cid_t                cid        = child_con->cid;
+
+    destroyChildConnecton(child_con);
 
-            contextDestroy(c);
+    // the server has never heard of a stream that did not send anything
+    if (first_sent)
+    {
+        sbuf_t *close_data = bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID()));
+        makeCloseFrame(close_data, cid);
+
+        lineLock(main_line);
+        self->up->fnPayloadU(self->up, main_line, close_data);
+
+        if (! lineIsAlive(main_line))
+        {
+            lineUnlock(main_line);
+            return;
         }
+        lineUnlock(main_line);
+    }
+
+    if (shouldClose(self, main_con))
+    {
+        closeMainConnection(self, main_con);
     }
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+// a user connection can not take more data, stop reading the main line
+static void upStreamPause(tunnel_t *self, line_t *line)
 {
-    mux_client_con_state_t *main_con = CSTATE(c);
+    mux_client_lstate_t *child_con = lineGetState(self, line);
+    self->up->fnPauseU(self->up, child_con->parent);
+}
 
-    if (UNLIKELY(c->est))
-    {
-        contextDestroy(c);
-        return;
-    }
-    if (c->fin)
+static void upStreamResume(tunnel_t *self, line_t *line)
+{
+    mux_client_lstate_t *child_con = lineGetState(self, line);
+    self->up->fnResumeU(self->up, child_con->parent);
+}
+
+static void downStreamEst(tunnel_t *self, line_t *line)
+{
+    (void) self;
+    (void) line;
+}
+
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    destroyMainConnecton(lineGetState(self, line));
+    lineDestroy(line);
+}
+
+static mux_client_lstate_t *findChild(mux_client_lstate_t *con, cid_t cid)
+{
+    for (mux_client_lstate_t *child_i = con->children; child_i; child_i = child_i->next)
     {
-        destroyMainConnecton(main_con);
-        contextDestroy(c);
-        return;
+        if (child_i->cid == cid)
+        {
+            return child_i;
+        }
     }
-    assert(c->payload != NULL);
+    return NULL;
+}
+
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    mux_client_lstate_t *main_con = lineGetState(self, line);
+    buffer_pool_t       *pool     = getWorkerBufferPool(getWID());
+
+    framedecoderPush(&main_con->read_decoder, payload);
+
+    // a stream may close the main line while we are still parsing
+    lineLock(line);
 
-    bufferStreamPushContextPayload(main_con->read_stream, c);
-    while (bufferstreamLen(main_con->read_stream) > sizeof(mux_frame_t))
+    while (lineIsAlive(line))
     {
-        mux_length_t length;
-        bufferstreamViewBytesAt(main_con->read_stream, 0, (uint8_t *) &length, 2);
-        if (UNLIKELY(length < kMuxMinFrameLength))
+        sbuf_t                *frame_payload = NULL;
+        frame_decoder_result_t result        = framedecoderNextBuffer(&main_con->read_decoder, &frame_payload);
+        if (result == kFrameDecoderNeedMore)
         {
-            LOGE("MuxClient: payload length < kMuxMinFrameLength");
-            destroyMainConnecton(main_con);
-            self->up->upStream(self->up, contextCreateFin(c->line));
-            contextDestroy(c);
-            return;
+            break;
         }
-
-        if (bufferstreamLen(main_con->read_stream) >= length + sizeof(length))
+        if (UNLIKELY(result == kFrameDecoderInvalid))
         {
-            sbuf_t *frame_payload = bufferstreamReadExact(main_con->read_stream, length + sizeof(length));
+            LOGE("MuxClient: frame length out of range");
+            closeMainConnection(self, main_con);
+            break;
+        }
 
-            mux_frame_t frame;
-            memoryCopy(&frame, sbufGetRawPtr(frame_payload), sizeof(mux_frame_t));
-            sbufShiftRight(frame_payload, sizeof(mux_frame_t));
+        mux_frame_t frame;
+        memoryCopy(&frame, sbufGetRawPtr(frame_payload), sizeof(mux_frame_t));
+        sbufShiftRight(frame_payload, sizeof(mux_frame_t));
 
-            mux_client_child_con_state_t *child_con_i;
-            for (child_con_i = main_con->children_root.next; child_con_i;)
-            {
-                if (child_con_i->cid == frame.cid)
-                {
+        mux_client_lstate_t *child = findChild(main_con, frame.cid);
 
-                    switch (frame.flags)
-                    {
-                    case kMuxFlagClose: {
-                        bufferpoolResuesBuffer(getWorkerBufferPool(c->line), frame_payload);
-                        context_t *fin_ctx = contextCreateFin(child_con_i->line);
-                        destroyChildConnecton(child_con_i);
-                        self->dw->downStream(self->dw, fin_ctx);
-                        frame_payload = NULL;
-                    }
-
-                    break;
-
-                    case kMuxFlagData: {
-
-                        if (UNLIKELY(sbufGetBufLength(frame_payload) <= 0))
-                        {
-                            LOGE("MuxClient: payload length <= 0");
-                            bufferpoolResuesBuffer(getWorkerBufferPool(main_con->line), frame_payload);
-                            destroyMainConnecton(main_con);
-                            self->up->upStream(self->up, contextCreateFin(c->line));
-                            contextDestroy(c);
-                            return;
-                        }
-                        context_t *data_ctx = contextCreate(child_con_i->line);
-                        data_ctx->payload   = frame_payload;
-                        self->dw->downStream(self->dw, data_ctx);
-                        frame_payload = NULL;
-                    }
-
-                    break;
-
-                    case kMuxFlagFlow:
-                        LOGE("MuxClient: kMuxFlagFlow not implemented"); // fall through
-                    case kMuxFlagOpen:
-                    default:
-                        LOGE("MuxClient: incorrect frame flag");
-                        bufferpoolResuesBuffer(getWorkerBufferPool(main_con->line), frame_payload);
-                        destroyMainConnecton(main_con);
-                        self->up->upStream(self->up, contextCreateFin(c->line));
-                        contextDestroy(c);
-                        return;
-                        break;
-                    }
-                    break;
-                }
-                child_con_i = child_con_i->next;
-            }
-            if (frame_payload != NULL)
-            {
-                LOGW("MuxClient: a frame could not find consumer cid: %d", (int) frame.cid);
-                bufferpoolResuesBuffer(getWorkerBufferPool(main_con->line), frame_payload);
-            }
-            else if (! lineIsAlive(c->line))
-            {
-                contextDestroy(c);
-                return;
-            }
+        if (child == NULL)
+        {
+            LOGW("MuxClient: a frame could not find consumer cid: %d", (int) frame.cid);
+            bufferpoolResuesBuffer(pool, frame_payload);
+            continue;
         }
-        else
+
+        switch (frame.flags)
         {
+        case kMuxFlagClose: {
+            line_t *child_line = child->line;
+            bufferpoolResuesBuffer(pool, frame_payload);
+            destroyChildConnecton(child);
+            self->dw->fnFinD(self->dw, child_line);
+        }
+        break;
+
+        case kMuxFlagData:
+            if (UNLIKELY(sbufGetBufLength(frame_payload) <= 0))
+            {
+                LOGE("MuxClient: payload length <= 0");
+                bufferpoolResuesBuffer(pool, frame_payload);
+                closeMainConnection(self, main_con);
+                break;
+            }
+            self->dw->fnPayloadD(self->dw, child->line, frame_payload);
+            break;
+
+        case kMuxFlagFlow:
+            LOGE("MuxClient: kMuxFlagFlow not implemented"); // fall through
+        case kMuxFlagOpen:
+        default:
+            LOGE("MuxClient: incorrect frame flag");
+            bufferpoolResuesBuffer(pool, frame_payload);
+            closeMainConnection(self, main_con);
             break;
         }
     }
+
+    lineUnlock(line);
 }
 
-tunnel_t *newMuxClient(node_instance_context_t *instance_info)
+// the main line write is blocked, pause the user connection that was writing
+static void downStreamPause(tunnel_t *self, line_t *line)
 {
+    mux_client_lstate_t *con   = lineGetState(self, line);
+    line_t              *wline = con->current_writing_line;
+
+    if (wline && lineIsAlive(wline))
+    {
+        mux_client_lstate_t *child_con = lineGetState(self, wline);
+        child_con->paused              = true;
+        self->dw->fnPauseD(self->dw, wline);
+    }
+}
 
-    mux_client_state_t *state = memoryAllocate(sizeof(mux_client_state_t));
-    memorySet(state, 0, sizeof(mux_client_state_t));
+static void downStreamResume(tunnel_t *self, line_t *line)
+{
+    mux_client_lstate_t *con = lineGetState(self, line);
 
-    const cJSON *settings = instance_info->node_settings_json;
-    (void) settings;
+    for (mux_client_lstate_t *child_i = con->children; child_i; child_i = child_i->next)
+    {
+        if (child_i->paused)
+        {
+            child_i->paused = false;
+            self->dw->fnResumeD(self->dw, child_i->line);
+        }
+    }
+}
 
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
+tunnel_t *newMuxClient(node_t *node)
+{
+    tunnel_t *t = tunnelCreate(node, sizeof(mux_client_state_t) + sizeof(thread_connection_pool_t) * getWorkersCount(),
+                               sizeof(mux_client_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPauseU   = &upStreamPause;
+    t->fnResumeU  = &upStreamResume;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnEstD     = &downStreamEst;
+    t->fnFinD     = &downStreamFin;
+    t->fnPauseD   = &downStreamPause;
+    t->fnResumeD  = &downStreamResume;
+
+    mux_client_state_t *state    = tunnelGetState(t);
+    const cJSON        *settings = node->node_settings_json;
+
+    int capacity = kDefaultConnectionCapacity;
+    int width    = kDefaultWidth;
+    int duration = 0;
+    getIntFromJsonObject(&capacity, settings, "connection-capacity");
+    getIntFromJsonObject(&width, settings, "width");
+    getIntFromJsonObject(&duration, settings, "connection-duration");
+
+    state->mode                     = duration > 0 ? kCuncurrencyModeTimer : kCuncurrencyModeCounter;
+    state->connection_cunc_capacity = (uint32_t) max(1, capacity);
+    state->connection_cunc_duration = (uint32_t) max(0, duration);
+    state->width                    = (uint32_t) max(1, width);
 
     return t;
 }
@@ -4,7 +4,8 @@
 #include "loggers/network_logger.h"
 #include "managers/node_manager.h"
 #include "openssl_globals.h"
-#include "utils/jsonutils.h"
+#include "buffer_queue.h"
+#include "utils/json_helpers.h"
 #include <openssl/bio.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
@@ -21,15 +22,15 @@ typedef struct oss_client_state_s
 
 } oss_client_state_t;
 
-typedef struct oss_client_con_state_s
+typedef struct oss_client_lstate_s
 {
-    SSL             *ssl;
-    BIO             *rbio;
-    BIO             *wbio;
-    context_queue_t *queue;
-    bool             handshake_completed;
+    SSL            *ssl;
+    BIO            *rbio;
+    BIO            *wbio;
+    buffer_queue_t *queue;
+    bool            handshake_completed;
 
-} oss_client_con_state_t;
+} oss_client_lstate_t;
 
 enum sslstatus
 {
@@ -54,370 +55,303 @@ static enum sslstatus getSslStatus(SSL *ssl, int n)
     }
 }
 
-static void cleanup(tunnel_t *self, context_t *c)
+static void cleanup(tunnel_t *self, line_t *line)
 {
-    oss_client_con_state_t *cstate = CSTATE(c);
-    SSL_free(cstate->ssl); /* free the SSL object and its BIO's */
-    contextqueueDestory(cstate->queue);
-    memoryFree(cstate);
-    CSTATE_DROP(c);
+    oss_client_lstate_t *ls = lineGetState(self, line);
+    SSL_free(ls->ssl); /* free the SSL object and its BIO's */
+    bufferqueueDestory(ls->queue);
+    lineClearState(ls, sizeof(oss_client_lstate_t));
 }
 
-static void flushWriteQueue(tunnel_t *self, context_t *c)
+static void closeBothSides(tunnel_t *self, line_t *line)
 {
-    oss_client_con_state_t *cstate = CSTATE(c);
+    cleanup(self, line);
+    self->up->fnFinU(self->up, line);
+    self->dw->fnFinD(self->dw, line);
+}
 
-    while (lineIsAlive(c->line) && contextqueueLen(cstate->queue) > 0)
+/*
+    takes everything openssl wants to send and passes it up, returns false if the line is closed or failed,
+    the line must be locked by the caller
+*/
+static bool sendWbio(tunnel_t *self, line_t *line, oss_client_lstate_t *ls)
+{
+    buffer_pool_t *pool = getWorkerBufferPool(getWID());
+    int            n;
+    do
     {
-        self->upStream(self, contextqueuePop(cstate->queue));
-    }
+        sbuf_t *buf   = bufferpoolGetLargeBuffer(pool);
+        int     avail = (int) sbufGetRightCapacity(buf);
+        n             = BIO_read(ls->wbio, sbufGetMutablePtr(buf), avail);
+        if (n > 0)
+        {
+            sbufSetLength(buf, n);
+            self->up->fnPayloadU(self->up, line, buf);
+            if (! lineIsAlive(line))
+            {
+                return false;
+            }
+        }
+        else if (! BIO_should_retry(ls->wbio))
+        {
+            // If BIO_should_retry() is false then the cause is an error condition.
+            bufferpoolResuesBuffer(pool, buf);
+            closeBothSides(self, line);
+            return false;
+        }
+        else
+        {
+            bufferpoolResuesBuffer(pool, buf);
+        }
+    } while (n > 0);
+
+    return true;
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload);
+
+static void flushWriteQueue(tunnel_t *self, line_t *line)
 {
-    oss_client_state_t *state = TSTATE(self);
+    oss_client_lstate_t *ls = lineGetState(self, line);
 
-    if (c->payload != NULL)
+    while (lineIsAlive(line) && bufferqueueLen(ls->queue) > 0)
     {
-        oss_client_con_state_t *cstate = CSTATE(c);
+        upStreamPayload(self, line, bufferqueuePop(ls->queue));
+    }
+}
 
-        if (! cstate->handshake_completed)
-        {
-            contextqueuePush(cstate->queue, c);
-            return;
-        }
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    oss_client_lstate_t *ls   = lineGetState(self, line);
+    buffer_pool_t       *pool = getWorkerBufferPool(getWID());
 
-        enum sslstatus status;
-        int            len = (int) sbufGetBufLength(c->payload);
+    if (! ls->handshake_completed)
+    {
+        bufferqueuePush(ls->queue, payload);
+        return;
+    }
 
-        while (len > 0 && lineIsAlive(c->line))
-        {
-            int n  = SSL_write(cstate->ssl, sbufGetRawPtr(c->payload), len);
-            status = getSslStatus(cstate->ssl, n);
+    lineLock(line);
 
-            if (n > 0)
-            {
-                /* sbufConsume the waiting bytes that have been used by SSL */
-                sbufShiftRight(c->payload, n);
-                len -= n;
-                /* take the output of the SSL object and queue it for socket write */
-                do
-                {
-                    sbuf_t *buf   = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-                    int             avail = (int) sbufGetRightCapacity(buf);
-                    n                     = BIO_read(cstate->wbio, sbufGetMutablePtr(buf), avail);
-                    if (n > 0)
-                    {
-                        sbufSetLength(buf, n);
-                        context_t *send_context = contextCreateFrom(c);
-                        send_context->payload   = buf;
-                        self->up->upStream(self->up, send_context);
-                        if (! lineIsAlive(c->line))
-                        {
-                            contextReusePayload(c);
-                            contextDestroy(c);
-                            return;
-                        }
-                    }
-                    else if (! BIO_should_retry(cstate->wbio))
-                    {
-                        // If BIO_should_retry() is false then the cause is an error condition.
-                        bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                        contextReusePayload(c);
-                        goto failed;
-                    }
-                    else
-                    {
-                        bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                    }
-                } while (n > 0);
-            }
+    int len = (int) sbufGetBufLength(payload);
 
-            if (status == kSslstatusFail)
-            {
-                contextReusePayload(c);
-                goto failed;
-            }
+    while (len > 0)
+    {
+        int            n      = SSL_write(ls->ssl, sbufGetRawPtr(payload), len);
+        enum sslstatus status = getSslStatus(ls->ssl, n);
 
-            if (n == 0)
+        if (n > 0)
+        {
+            /* sbufConsume the waiting bytes that have been used by SSL */
+            sbufShiftRight(payload, n);
+            len -= n;
+            /* take the output of the SSL object and queue it for socket write */
+            if (! sendWbio(self, line, ls))
             {
                 break;
             }
         }
-        assert(sbufGetBufLength(c->payload) == 0);
-        contextReusePayload(c);
-        contextDestroy(c);
-    }
-    else
-    {
 
-        if (c->init)
+        if (status == kSslstatusFail)
         {
-            CSTATE_MUT(c)                  = memoryAllocate(sizeof(oss_client_con_state_t));
-            oss_client_con_state_t *cstate = CSTATE(c);
-            memorySet(cstate, 0, sizeof(oss_client_con_state_t));
-            cstate->rbio  = BIO_new(BIO_s_mem());
-            cstate->wbio  = BIO_new(BIO_s_mem());
-            cstate->ssl   = SSL_new(state->threadlocal_ssl_context[getWID()]);
-            cstate->queue = contextqueueCreate();
-            SSL_set_connect_state(cstate->ssl); /* sets ssl to work in client mode. */
-            SSL_set_bio(cstate->ssl, cstate->rbio, cstate->wbio);
-            SSL_set_tlsext_host_name(cstate->ssl, state->sni);
-            context_t *client_hello_ctx = contextCreateFrom(c);
-            self->up->upStream(self->up, c);
-            if (! lineIsAlive(client_hello_ctx->line))
-            {
-                contextDestroy(client_hello_ctx);
-                return;
-            }
-
-            // printSSLState(cstate->ssl);
-            int n = SSL_connect(cstate->ssl);
-            // printSSLState(cstate->ssl);
-            enum sslstatus status = getSslStatus(cstate->ssl, n);
-            /* Did SSL request to write bytes? */
-            if (status == kSslstatusWantIo)
-            {
-                sbuf_t *buf   = bufferpoolGetLargeBuffer(contextGetBufferPool(client_hello_ctx));
-                int             avail = (int) sbufGetRightCapacity(buf);
-                n                     = BIO_read(cstate->wbio, sbufGetMutablePtr(buf), avail);
-                if (n > 0)
-                {
-                    sbufSetLength(buf, n);
-                    client_hello_ctx->payload = buf;
-                    self->up->upStream(self->up, client_hello_ctx);
-                }
-                else if (! BIO_should_retry(cstate->rbio))
-                {
-                    // If BIO_should_retry() is false then the cause is an error condition.
-                    bufferpoolResuesBuffer(contextGetBufferPool(client_hello_ctx), buf);
-                    goto failed;
-                }
-                else
-                {
-                    bufferpoolResuesBuffer(contextGetBufferPool(client_hello_ctx), buf);
-                }
-            }
-            if (status == kSslstatusFail)
-            {
-                goto failed;
-            }
+            closeBothSides(self, line);
+            break;
         }
-        else if (c->fin)
-        {
 
-            cleanup(self, c);
-            self->up->upStream(self->up, c);
+        if (n == 0)
+        {
+            break;
         }
     }
 
-    return;
+    bufferpoolResuesBuffer(pool, payload);
+    lineUnlock(line);
+}
+
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    oss_client_state_t  *state = tunnelGetState(self);
+    oss_client_lstate_t *ls    = lineGetState(self, line);
+
+    *ls = (oss_client_lstate_t) {.rbio  = BIO_new(BIO_s_mem()),
+                                 .wbio  = BIO_new(BIO_s_mem()),
+                                 .ssl   = SSL_new(state->threadlocal_ssl_context[getWID()]),
+                                 .queue = bufferqueueCreate(getWorkerBufferPool(getWID()))};
+
+    SSL_set_connect_state(ls->ssl); /* sets ssl to work in client mode. */
+    SSL_set_bio(ls->ssl, ls->rbio, ls->wbio);
+    SSL_set_tlsext_host_name(ls->ssl, state->sni);
+
+    lineLock(line);
+    self->up->fnInitU(self->up, line);
+    if (! lineIsAlive(line))
+    {
+        lineUnlock(line);
+        return;
+    }
+
+    int            n      = SSL_connect(ls->ssl);
+    enum sslstatus status = getSslStatus(ls->ssl, n);
 
-failed:
-    self->up->upStream(self->up, contextCreateFinFrom(c));
+    /* Did SSL request to write bytes? (client hello) */
+    if (status == kSslstatusWantIo)
+    {
+        sendWbio(self, line, ls);
+    }
+    else if (status == kSslstatusFail)
+    {
+        closeBothSides(self, line);
+    }
+    lineUnlock(line);
+}
 
-    context_t *fail_context = contextCreateFinFrom(c);
-    cleanup(self, c);
-    contextDestroy(c);
-    self->dw->downStream(self->dw, fail_context);
+static void upStreamFin(tunnel_t *self, line_t *line)
+{
+    cleanup(self, line);
+    self->up->fnFinU(self->up, line);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    oss_client_con_state_t *cstate = CSTATE(c);
+    oss_client_lstate_t *ls   = lineGetState(self, line);
+    buffer_pool_t       *pool = getWorkerBufferPool(getWID());
+    int                  n;
+    enum sslstatus       status;
 
-    if (c->payload != NULL)
+    lineLock(line);
+
+    int len = (int) sbufGetBufLength(payload);
+
+    while (len > 0 && lineIsAlive(line))
     {
-        int            n;
-        enum sslstatus status;
+        n = BIO_write(ls->rbio, sbufGetRawPtr(payload), len);
 
-        int len = (int) sbufGetBufLength(c->payload);
+        if (n <= 0)
+        {
+            /* if BIO write fails, assume unrecoverable */
+            closeBothSides(self, line);
+            break;
+        }
+        sbufShiftRight(payload, n);
+        len -= n;
 
-        while (len > 0 && lineIsAlive(c->line))
+        if (! ls->handshake_completed)
         {
-            n = BIO_write(cstate->rbio, sbufGetRawPtr(c->payload), len);
+            n      = SSL_connect(ls->ssl);
+            status = getSslStatus(ls->ssl, n);
 
-            if (n <= 0)
+            if (status == kSslstatusFail)
             {
-                /* if BIO write fails, assume unrecoverable */
-                contextReusePayload(c);
-                goto failed;
+                SSL_get_verify_result(ls->ssl);
+                printSSLError();
+                closeBothSides(self, line);
+                break;
             }
-            sbufShiftRight(c->payload, n);
-            len -= n;
 
-            if (! cstate->handshake_completed)
+            /* Did SSL request to write bytes? */
+            if (! sendWbio(self, line, ls))
             {
-                // printSSLState(cstate->ssl);
-                n = SSL_connect(cstate->ssl);
-                // printSSLState(cstate->ssl);
-                status = getSslStatus(cstate->ssl, n);
-
-                /* Did SSL request to write bytes? */
-                if (status == kSslstatusWantIo)
-                {
-                    do
-                    {
-                        sbuf_t *buf   = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-                        int             avail = (int) sbufGetRightCapacity(buf);
-                        n                     = BIO_read(cstate->wbio, sbufGetMutablePtr(buf), avail);
-
-                        if (n > 0)
-                        {
-                            sbufSetLength(buf, n);
-                            context_t *req_cont = contextCreateFrom(c);
-                            req_cont->payload   = buf;
-                            self->up->upStream(self->up, req_cont);
-                            if (! lineIsAlive(c->line))
-                            {
-                                contextReusePayload(c);
-                                contextDestroy(c);
-                                return;
-                            }
-                        }
-                        else if (! BIO_should_retry(cstate->rbio))
-                        {
-                            // If BIO_should_retry() is false then the cause is an error condition.
-                            contextReusePayload(c);
-                            bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                            goto failed;
-                        }
-                        else
-                        {
-                            bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                        }
-                    } while (n > 0);
-                }
-                if (status == kSslstatusFail)
-                {
-                    SSL_get_verify_result(cstate->ssl);
-                    printSSLError();
-                    contextReusePayload(c);
-                    goto failed;
-                }
+                break;
+            }
 
-                /* Did SSL request to write bytes? */
-                sbuf_t *buf   = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-                int             avail = (int) sbufGetRightCapacity(buf);
-                n                     = BIO_read(cstate->wbio, sbufGetMutablePtr(buf), avail);
-                if (n > 0)
+            if (SSL_is_init_finished(ls->ssl))
+            {
+                LOGD("OpensslClient: Tls handshake complete");
+                ls->handshake_completed = true;
+                flushWriteQueue(self, line);
+                if (! lineIsAlive(line))
                 {
-                    sbufSetLength(buf, n);
-                    context_t *data_ctx = contextCreate(c->line);
-                    data_ctx->payload   = buf;
-                    self->up->upStream(self->up, data_ctx);
-                    if (! lineIsAlive(c->line))
-                    {
-                        contextReusePayload(c);
-                        contextDestroy(c);
-                        return;
-                    }
+                    break;
                 }
-                else
+                self->dw->fnEstD(self->dw, line);
+                if (! lineIsAlive(line))
                 {
-                    bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
+                    break;
                 }
-
-                if (! cstate->handshake_completed && SSL_is_init_finished(cstate->ssl))
-                {
-                    LOGD("OpensslClient: Tls handshake complete");
-                    cstate->handshake_completed = true;
-                    flushWriteQueue(self, c);
-
-                    context_t *dw_est_ctx = contextCreateFrom(c);
-                    dw_est_ctx->est       = true;
-                    self->dw->downStream(self->dw, dw_est_ctx);
-
-                    // queue is flushed and we are done
-                    // contextReusePayload(c);
-                    // contextDestroy(c);
-                    // return;
-                }
-
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
             }
+            else
+            {
+                continue;
+            }
+        }
 
-            /* The encrypted data is now in the input bio so now we can perform actual
-             * read of unencrypted data. */
+        /* The encrypted data is now in the input bio so now we can perform actual
+         * read of unencrypted data. */
 
-            do
-            {
-                sbuf_t *buf = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
+        do
+        {
+            sbuf_t *buf = bufferpoolGetLargeBuffer(pool);
 
-                sbufSetLength(buf, 0);
-                int avail = (int) sbufGetRightCapacity(buf);
-                n         = SSL_read(cstate->ssl, sbufGetMutablePtr(buf), avail);
+            sbufSetLength(buf, 0);
+            int avail = (int) sbufGetRightCapacity(buf);
+            n         = SSL_read(ls->ssl, sbufGetMutablePtr(buf), avail);
 
-                if (n > 0)
-                {
-                    sbufSetLength(buf, n);
-                    context_t *data_ctx = contextCreateFrom(c);
-                    data_ctx->payload   = buf;
-                    self->dw->downStream(self->dw, data_ctx);
-                    if (! lineIsAlive(c->line))
-                    {
-                        contextReusePayload(c);
-                        contextDestroy(c);
-                        return;
-                    }
-                }
-                else
+            if (n > 0)
+            {
+                sbufSetLength(buf, n);
+                self->dw->fnPayloadD(self->dw, line, buf);
+                if (! lineIsAlive(line))
                 {
-                    bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
+                    break;
                 }
-
-            } while (n > 0);
-
-            status = getSslStatus(cstate->ssl, n);
-
-            if (status == kSslstatusFail)
+            }
+            else
             {
-                contextReusePayload(c);
-                goto failed;
+                bufferpoolResuesBuffer(pool, buf);
             }
-        }
-        // done with socket data
-        contextReusePayload(c);
-        contextDestroy(c);
-    }
-    else
-    {
-        if (c->fin)
+
+        } while (n > 0);
+
+        if (! lineIsAlive(line))
         {
-            cleanup(self, c);
-            self->dw->downStream(self->dw, c);
+            break;
         }
-        else
+
+        status = getSslStatus(ls->ssl, n);
+
+        if (status == kSslstatusFail)
         {
-            contextDestroy(c);
+            closeBothSides(self, line);
+            break;
         }
     }
 
-    return;
-
-failed: {
-    context_t *fail_context_up = contextCreateFinFrom(c);
-    self->up->upStream(self->up, fail_context_up);
+    // done with socket data
+    bufferpoolResuesBuffer(pool, payload);
+    lineUnlock(line);
+}
 
-    context_t *fail_context = contextCreateFinFrom(c);
-    cleanup(self, c);
-    contextDestroy(c);
-    self->dw->downStream(self->dw, fail_context);
+static void downStreamEst(tunnel_t *self, line_t *line)
+{
+    // tcp is established, our own est goes down after the handshake
+    (void) self;
+    (void) line;
 }
+
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    cleanup(self, line);
+    self->dw->fnFinD(self->dw, line);
 }
 
-tunnel_t *newOpenSSLClient(node_instance_context_t *instance_info)
+tunnel_t *newOpenSSLClient(node_t *node)
 {
-    oss_client_state_t *state = memoryAllocate(sizeof(oss_client_state_t));
-    memorySet(state, 0, sizeof(oss_client_state_t));
+    tunnel_t *t = tunnelCreate(node, sizeof(oss_client_state_t), sizeof(oss_client_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnEstD     = &downStreamEst;
+    t->fnFinD     = &downStreamFin;
+
+    oss_client_state_t *state = tunnelGetState(t);
 
     state->threadlocal_ssl_context = memoryAllocate(sizeof(ssl_ctx_t) * getWorkersCount());
 
     ssl_ctx_opt_t *ssl_param = memoryAllocate(sizeof(ssl_ctx_opt_t));
     memorySet(ssl_param, 0, sizeof(ssl_ctx_opt_t));
-    const cJSON *settings = instance_info->node_settings_json;
+    const cJSON *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
@@ -470,11 +404,6 @@ tunnel_t *newOpenSSLClient(node_instance_context_t *instance_info)
     memoryFree(ssl_param);
     memoryFree(ossl_alpn);
 
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     return t;
 }
 
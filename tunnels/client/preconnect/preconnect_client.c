@@ -3,229 +3,356 @@
 #include "loggers/network_logger.h"
 #include "managers/node_manager.h"
 #include "types.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
-static void upStream(tunnel_t *self, context_t *c)
+enum preconnect_client_metrics_e
 {
+    kPreconnectClientMetricPoolHits,
+    kPreconnectClientMetricPoolMisses,
+    kPreconnectClientMetricPoolTrimmed,
+    kPreconnectClientMetricPoolUnused
+};
+
+static const metric_desc_t kPreconnectClientMetrics[] = {
+    [kPreconnectClientMetricPoolHits]    = {.name = "ww_preconnectclient_pool_hits_total",
+                                            .help = "lines that got a ready connection from the pool",
+                                            .type = kMetricTypeCounter},
+    [kPreconnectClientMetricPoolMisses]  = {.name = "ww_preconnectclient_pool_misses_total",
+                                            .help = "lines that found the pool empty and connected directly",
+                                            .type = kMetricTypeCounter},
+    [kPreconnectClientMetricPoolTrimmed] = {.name = "ww_preconnectclient_pool_trimmed_total",
+                                            .help = "idle pool connections closed because demand dropped",
+                                            .type = kMetricTypeCounter},
+    [kPreconnectClientMetricPoolUnused]  = {.name = "ww_preconnectclient_pool_unused",
+                                            .help = "established connections waiting in the pool",
+                                            .type = kMetricTypeGauge},
+};
+
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    preconnect_client_state_t  *state   = tunnelGetState(self);
+    preconnect_client_lstate_t *dls     = lineGetState(self, line);
+    const wid_t                 tid     = getWID();
+    thread_box_t               *this_tb = &(state->workers[tid]);
 
-    preconnect_client_state_t *state = TSTATE(self);
-    if (c->payload != NULL)
-    {
-        preconnect_client_con_state_t *cstate = CSTATE(c);
-        switch (cstate->mode)
-        {
+    adaptivepoolOnCheckout(&(this_tb->sizer), wloopNowMS(getWorkerLoop(tid)));
+    atomicAddExplicit(&(state->active_cons), 1, memory_order_relaxed);
 
-        case kConnectedDirect:
-            self->up->upStream(self->up, c);
-            break;
+    if (this_tb->length > 0)
+    {
+        tunnelMetricAdd(self, kPreconnectClientMetricPoolHits, 1);
+        tunnelMetricSub(self, kPreconnectClientMetricPoolUnused, 1);
+        atomicAddExplicit(&(state->unused_cons), -1, memory_order_relaxed);
 
-        case kConnectedPair:
-            self->up->upStream(self->up, contextSwitchLine(c, cstate->u));
-            break;
-        case kNotconnected:
-        default:
-            LOGF("PreConnectClient: invalid value of connection state (memory error?)");
-            exit(1);
+        preconnect_client_lstate_t *uls = this_tb->root.next;
+        removeConnection(this_tb, uls);
+        uls->d    = line;
+        uls->mode = kConnectedPair;
+        *dls      = (preconnect_client_lstate_t) {.u = uls->u, .d = line, .mode = kConnectedPair};
 
-            break;
-        }
+        self->dw->fnEstD(self->dw, line);
     }
     else
     {
-        const wid_t   tid     = getWID();
-        thread_box_t *this_tb = &(state->workers[tid]);
-        if (c->init)
-        {
+        tunnelMetricAdd(self, kPreconnectClientMetricPoolMisses, 1);
+        *dls = (preconnect_client_lstate_t) {.d = line, .mode = kConnectedDirect};
 
-            if (this_tb->length > 0)
-            {
-                atomicAddExplicit(&(state->unused_cons), -1, memory_order_relaxed);
-                atomicAddExplicit(&(state->active_cons), 1, memory_order_relaxed);
-
-                preconnect_client_con_state_t *ucon = this_tb->root.next;
-                removeConnection(this_tb, ucon);
-                ucon->d       = c->line;
-                ucon->mode    = kConnectedPair;
-                CSTATE_MUT(c) = ucon;
-                self->dw->downStream(self->dw, contextCreateEst(c->line));
-                initiateConnect(self, false);
-            }
-            else
-            {
-                atomicAddExplicit(&(state->active_cons), 1, memory_order_relaxed);
-                preconnect_client_con_state_t *dcon = createCstate(getWID());
-                CSTATE_MUT(c)                       = dcon;
-                dcon->mode                          = kConnectedDirect;
-                self->up->upStream(self->up, c);
-                return;
-            }
-            contextDestroy(c);
-        }
-        else if (c->fin)
-        {
-            preconnect_client_con_state_t *dcon = CSTATE(c);
-            CSTATE_DROP(c);
-            atomicAddExplicit(&(state->active_cons), -1, memory_order_relaxed);
-
-            switch (dcon->mode)
-            {
-            case kConnectedDirect:
-                destroyCstate(dcon);
-                self->up->upStream(self->up, c);
-                break;
-
-            case kConnectedPair: {
-                line_t *u_line = dcon->u;
-                LSTATE_DROP(dcon->u);
-                context_t *fctx = contextSwitchLine(c, u_line); // created here to prevent destruction of line
-                destroyCstate(dcon);
-                self->up->upStream(self->up, fctx);
-            }
-
-            break;
-            case kNotconnected:
-            default:
-                LOGF("PreConnectClient: invalid value of connection state (memory error?)");
-                exit(1);
-
-                break;
-            }
-        }
+        self->up->fnInitU(self->up, line);
+    }
+    initiateConnect(self, tid, false);
+}
+
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    preconnect_client_lstate_t *ls = lineGetState(self, line);
+
+    switch (ls->mode)
+    {
+    case kConnectedDirect:
+        self->up->fnPayloadU(self->up, line, payload);
+        break;
+
+    case kConnectedPair:
+        self->up->fnPayloadU(self->up, ls->u, payload);
+        break;
+
+    case kNotconnected:
+    default:
+        LOGF("PreConnectClient: invalid value of connection state (memory error?)");
+        exit(1);
+
+        break;
     }
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void upStreamFin(tunnel_t *self, line_t *line)
 {
-    preconnect_client_state_t *state = TSTATE(self);
-    if (c->payload != NULL)
+    preconnect_client_state_t  *state = tunnelGetState(self);
+    preconnect_client_lstate_t *dls   = lineGetState(self, line);
+
+    atomicAddExplicit(&(state->active_cons), -1, memory_order_relaxed);
+
+    switch (dls->mode)
     {
+    case kConnectedDirect:
+        lineClearState(dls, sizeof(preconnect_client_lstate_t));
+        self->up->fnFinU(self->up, line);
+        break;
+
+    case kConnectedPair: {
+        line_t *u_line = dls->u;
+        lineClearState(lineGetState(self, u_line), sizeof(preconnect_client_lstate_t));
+        lineClearState(dls, sizeof(preconnect_client_lstate_t));
+        self->up->fnFinU(self->up, u_line);
+        lineDestroy(u_line);
+    }
+    break;
 
-        preconnect_client_con_state_t *cstate = CSTATE(c);
+    case kNotconnected:
+    default:
+        LOGF("PreConnectClient: invalid value of connection state (memory error?)");
+        exit(1);
 
-        switch (cstate->mode)
+        break;
+    }
+}
+
+static void upStreamPause(tunnel_t *self, line_t *line)
+{
+    preconnect_client_lstate_t *ls = lineGetState(self, line);
+    self->up->fnPauseU(self->up, ls->mode == kConnectedPair ? ls->u : line);
+}
+
+static void upStreamResume(tunnel_t *self, line_t *line)
+{
+    preconnect_client_lstate_t *ls = lineGetState(self, line);
+    self->up->fnResumeU(self->up, ls->mode == kConnectedPair ? ls->u : line);
+}
+
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    preconnect_client_lstate_t *ls = lineGetState(self, line);
+
+    switch (ls->mode)
+    {
+    case kConnectedDirect:
+        self->dw->fnPayloadD(self->dw, line, payload);
+        break;
+
+    case kConnectedPair:
+        self->dw->fnPayloadD(self->dw, ls->d, payload);
+        break;
+
+    case kNotconnected:
+        LOGE("PreConnectClient: this node is not purposed to handle downstream data before pairing");
+        // fallthrough
+    default:
+        LOGF("PreConnectClient: invalid value of connection state (memory error?)");
+        exit(1);
+
+        break;
+    }
+}
+
+static void downStreamEst(tunnel_t *self, line_t *line)
+{
+    preconnect_client_state_t  *state   = tunnelGetState(self);
+    preconnect_client_lstate_t *uls     = lineGetState(self, line);
+    const wid_t                 tid     = getWID();
+    thread_box_t               *this_tb = &(state->workers[tid]);
+
+    if (uls->mode != kNotconnected)
+    {
+        if (uls->mode == kConnectedDirect)
         {
-        case kConnectedDirect:
-            self->dw->downStream(self->dw, c);
-            break;
-
-        case kConnectedPair:
-            self->dw->downStream(self->dw, contextSwitchLine(c, cstate->d));
-            break;
-
-        case kNotconnected:
-            LOGE("PreConnectClient: this node is not purposed to handle downstream data before pairing");
-            // fallthrough
-        default:
-            LOGF("PreConnectClient: invalid value of connection state (memory error?)");
-            exit(1);
-
-            break;
+            self->dw->fnEstD(self->dw, line);
         }
+        return;
     }
-    else
+
+    this_tb->connecting -= 1;
+    adaptivepoolOnConnected(&(this_tb->sizer), wloopNowMS(getWorkerLoop(tid)) - uls->connect_start_ms);
+    addConnection(this_tb, uls);
+    tunnelMetricAdd(self, kPreconnectClientMetricPoolUnused, 1);
+    unsigned int unused = atomicAddExplicit(&(state->unused_cons), 1, memory_order_relaxed);
+    LOGI("PreConnectClient: connected,    unused: %d active: %d", unused + 1, state->active_cons);
+    initiateConnect(self, tid, false);
+}
+
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    preconnect_client_state_t  *state   = tunnelGetState(self);
+    preconnect_client_lstate_t *uls     = lineGetState(self, line);
+    const wid_t                 tid     = getWID();
+    thread_box_t               *this_tb = &(state->workers[tid]);
+
+    switch (uls->mode)
     {
-        const unsigned int             tid     = getWID();
-        thread_box_t                  *this_tb = &(state->workers[tid]);
-        preconnect_client_con_state_t *ucon    = CSTATE(c);
+    case kConnectedDirect:
+        atomicAddExplicit(&(state->active_cons), -1, memory_order_relaxed);
+        lineClearState(uls, sizeof(preconnect_client_lstate_t));
+        self->dw->fnFinD(self->dw, line);
+        initiateConnect(self, tid, true);
+
+        break;
+
+    case kConnectedPair: {
+        atomicAddExplicit(&(state->active_cons), -1, memory_order_relaxed);
+        line_t *d_line = uls->d;
+        lineClearState(lineGetState(self, d_line), sizeof(preconnect_client_lstate_t));
+        lineClearState(uls, sizeof(preconnect_client_lstate_t));
+        lineDestroy(line);
+        self->dw->fnFinD(self->dw, d_line);
+        initiateConnect(self, tid, false);
+    }
+    break;
 
-        if (c->fin)
+    case kNotconnected:
+        if (uls->prev != NULL)
         {
-            CSTATE_DROP(c);
-
-            switch (ucon->mode)
-            {
-            case kConnectedDirect:
-                atomicAddExplicit(&(state->active_cons), -1, memory_order_relaxed);
-                destroyCstate(ucon);
-                self->dw->downStream(self->dw, c);
-                initiateConnect(self, true);
-
-                break;
-
-            case kConnectedPair: {
-                atomicAddExplicit(&(state->active_cons), -1, memory_order_relaxed);
-                line_t *d_line = ucon->d;
-                LSTATE_DROP(ucon->d);
-                destroyCstate(ucon);
-                self->dw->downStream(self->dw, contextSwitchLine(c, d_line));
-                initiateConnect(self, false);
-            }
-            break;
-
-            case kNotconnected:
-                if (ucon->prev != NULL)
-                {
-                    // fin after est
-                    atomicAddExplicit(&(state->unused_cons), -1, memory_order_relaxed);
-                    removeConnection(this_tb, ucon);
-                }
-                destroyCstate(ucon);
-                contextDestroy(c);
-                initiateConnect(self, true);
-
-                break;
-
-            default:
-                LOGF("PreConnectClient: invalid value of connection state (memory error?)");
-                exit(1);
-
-                break;
-            }
-            LOGD("PreConnectClient: disconnected, unused: %d active: %d", state->unused_cons, state->active_cons);
+            // fin after est
+            tunnelMetricSub(self, kPreconnectClientMetricPoolUnused, 1);
+            atomicAddExplicit(&(state->unused_cons), -1, memory_order_relaxed);
+            removeConnection(this_tb, uls);
         }
-        else if (c->est)
+        else
         {
-            if (ucon->mode == kNotconnected)
-            {
-                addConnection(this_tb, ucon);
-                contextDestroy(c);
-                unsigned int unused = atomicAddExplicit(&(state->unused_cons), 1, memory_order_relaxed);
-                LOGI("PreConnectClient: connected,    unused: %d active: %d", unused + 1, state->active_cons);
-                initiateConnect(self, false);
-            }
-            else
-            {
-                self->dw->downStream(self->dw, c);
-            }
+            this_tb->connecting -= 1;
         }
+        lineClearState(uls, sizeof(preconnect_client_lstate_t));
+        lineDestroy(line);
+        initiateConnect(self, tid, true);
+
+        break;
+
+    default:
+        LOGF("PreConnectClient: invalid value of connection state (memory error?)");
+        exit(1);
+
+        break;
     }
+    LOGD("PreConnectClient: disconnected, unused: %d active: %d", state->unused_cons, state->active_cons);
 }
 
-static void startPreconnect(wtimer_t *timer)
+static void downStreamPause(tunnel_t *self, line_t *line)
+{
+    preconnect_client_lstate_t *ls = lineGetState(self, line);
+    if (ls->mode != kNotconnected)
+    {
+        self->dw->fnPauseD(self->dw, ls->d);
+    }
+}
+
+static void downStreamResume(tunnel_t *self, line_t *line)
+{
+    preconnect_client_lstate_t *ls = lineGetState(self, line);
+    if (ls->mode != kNotconnected)
+    {
+        self->dw->fnResumeD(self->dw, ls->d);
+    }
+}
+
+static void trimIdleConnection(tunnel_t *self, thread_box_t *box)
+{
+    preconnect_client_state_t  *state = tunnelGetState(self);
+    preconnect_client_lstate_t *uls   = box->root.next;
+
+    removeConnection(box, uls);
+    atomicAddExplicit(&(state->unused_cons), -1, memory_order_relaxed);
+    tunnelMetricSub(self, kPreconnectClientMetricPoolUnused, 1);
+    tunnelMetricAdd(self, kPreconnectClientMetricPoolTrimmed, 1);
+
+    line_t *u_line = uls->u;
+    lineClearState(uls, sizeof(preconnect_client_lstate_t));
+    self->up->fnFinU(self->up, u_line);
+    lineDestroy(u_line);
+}
+
+static void onPoolTick(wtimer_t *timer)
 {
     tunnel_t                  *self  = weventGetUserdata(timer);
-    preconnect_client_state_t *state = TSTATE(self);
+    preconnect_client_state_t *state = tunnelGetState(self);
+    const wid_t                tid   = getWID();
+    thread_box_t              *box   = &(state->workers[tid]);
+    const uint64_t             now   = wloopNowMS(getWorkerLoop(tid));
+
+    const uint32_t target = adaptivepoolTick(&(box->sizer), now);
 
-    for (unsigned int i = 0; i < getWorkersCount(); i++)
+    if (adaptivepoolShouldTrim(&(box->sizer), (uint32_t) box->length, now))
     {
-        const size_t cpt = state->connection_per_thread;
-        for (size_t ci = 0; ci < cpt; ci++)
-        {
-            initiateConnect(self, true);
-        }
+        // one per tick, demand that comes back finds the rest still there
+        trimIdleConnection(self, box);
+    }
+
+    while (box->length + box->connecting < target)
+    {
+        initiateConnect(self, tid, false);
+    }
+}
+
+static void startPreconnectOnWorker(wevent_t *ev)
+{
+    tunnel_t                  *self  = weventGetUserdata(ev);
+    preconnect_client_state_t *state = tunnelGetState(self);
+    const wid_t                tid   = getWID();
+    thread_box_t              *box   = &(state->workers[tid]);
+
+    adaptivepoolInit(&(box->sizer), state->min_unused_cons, state->max_unused_cons, wloopNowMS(getWorkerLoop(tid)));
+
+    wtimer_t *tick_timer =
+        wtimerAdd(getWorkerLoop(tid), onPoolTick, adaptivepoolJitter(kAdaptivePoolWindowMs), INFINITE);
+    weventSetUserData(tick_timer, self);
+
+    for (uint32_t i = 0; i < box->sizer.target; i++)
+    {
+        initiateConnect(self, tid, true);
+    }
+}
+
+static void startPreconnect(wtimer_t *timer)
+{
+    tunnel_t *self = weventGetUserdata(timer);
+
+    // every worker sizes, refills and trims its own pool from its own timer
+    for (wid_t wid = 0; wid < getWorkersCount(); wid++)
+    {
+        wevent_t ev = {.loop = getWorkerLoop(wid), .cb = startPreconnectOnWorker};
+        ev.userdata = self;
+        wloopPostEvent(getWorkerLoop(wid), &ev);
     }
 
     wtimerDelete(timer);
 }
 
-tunnel_t *newPreConnectClient(node_instance_context_t *instance_info)
+tunnel_t *newPreConnectClient(node_t *node)
 {
     const size_t start_delay_ms = 150;
 
-    preconnect_client_state_t *state =
-        memoryAllocate(sizeof(preconnect_client_state_t) + (getWorkersCount() * sizeof(thread_box_t)));
-    memorySet(state, 0, sizeof(preconnect_client_state_t) + (getWorkersCount() * sizeof(thread_box_t)));
-    const cJSON *settings = instance_info->node_settings_json;
+    tunnel_t *t = tunnelCreate(node, sizeof(preconnect_client_state_t) + (getWorkersCount() * sizeof(thread_box_t)),
+                               sizeof(preconnect_client_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPauseU   = &upStreamPause;
+    t->fnResumeU  = &upStreamResume;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnEstD     = &downStreamEst;
+    t->fnFinD     = &downStreamFin;
+    t->fnPauseD   = &downStreamPause;
+    t->fnResumeD  = &downStreamResume;
 
-    getIntFromJsonObject((int *) &(state->min_unused_cons), settings, "minimum-unused");
+    preconnect_client_state_t *state    = tunnelGetState(t);
+    const cJSON               *settings = node->node_settings_json;
 
-    state->min_unused_cons       = min(max((getWorkersCount() * (ssize_t) 4), state->min_unused_cons), 128);
-    state->connection_per_thread = min(4, state->min_unused_cons / getWorkersCount());
+    // both limits are totals in the json, the pools are per worker
+    int minimum_unused = 0;
+    int maximum_unused = 0;
+    getIntFromJsonObjectOrDefault(&minimum_unused, settings, "minimum-unused", 0);
+    getIntFromJsonObjectOrDefault(&maximum_unused, settings, "maximum-unused", 128);
 
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
+    state->min_unused_cons = max(1, (unsigned int) max(0, minimum_unused) / getWorkersCount());
+    state->max_unused_cons = max(state->min_unused_cons, (unsigned int) max(0, maximum_unused) / getWorkersCount());
 
     wtimer_t *start_timer = wtimerAdd(getWorkerLoop(0), startPreconnect, start_delay_ms, 1);
     weventSetUserData(start_timer, t);
@@ -248,5 +375,8 @@ tunnel_t *destroyPreConnectClient(tunnel_t *self)
 
 tunnel_metadata_t getMetadataPreConnectClient(void)
 {
-    return (tunnel_metadata_t) {.version = 0001, .flags = 0x0};
+    return (tunnel_metadata_t) {.version       = 0001,
+                                .flags         = 0x0,
+                                .metrics       = kPreconnectClientMetrics,
+                                .metrics_count = ARRAY_SIZE(kPreconnectClientMetrics)};
 }
@@ -1,11 +1,11 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
 
 //
 // con <------>  PreConnectClient <-------> con (established ahead of time)
 //
 
-tunnel_t *        newPreConnectClient(node_instance_context_t *instance_info);
+tunnel_t *        newPreConnectClient(node_t *node);
 api_result_t      apiPreConnectClient(tunnel_t *self, const char *msg);
 tunnel_t *        destroyPreConnectClient(tunnel_t *self);
 tunnel_metadata_t getMetadataPreConnectClient(void);
@@ -1,5 +1,6 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
+#include "adaptive_pool.h"
 #include "buffer_stream.h"
 #include "watomic.h"
 
@@ -16,19 +17,26 @@ typedef enum
     kConnectedPair
 } connection_state;
 
-typedef struct preconnect_client_con_state_s
+/*
+    both the user line (d) and the line created here (u) carry this state, once they are paired each half points
+    to the other one
+*/
+typedef struct preconnect_client_lstate_s
 {
-    struct preconnect_client_con_state_s *prev, *next;
-    line_t                               *u;
-    line_t                               *d;
-    connection_state                      mode;
+    struct preconnect_client_lstate_s *prev, *next;
+    line_t                            *u;
+    line_t                            *d;
+    uint64_t                           connect_start_ms;
+    connection_state                   mode;
 
-} preconnect_client_con_state_t;
+} preconnect_client_lstate_t;
 
 typedef struct thread_box_s
 {
-    size_t                        length;
-    preconnect_client_con_state_t root;
+    size_t                     length;     // established and unused
+    uint32_t                   connecting; // scheduled or connecting
+    adaptive_pool_t            sizer;
+    preconnect_client_lstate_t root;
 
 } thread_box_t;
 
@@ -36,9 +44,8 @@ typedef struct preconnect_client_state_s
 {
     atomic_uint  active_cons;
     atomic_uint  unused_cons;
-    atomic_uint  round_index;
-    size_t       connection_per_thread;
-    unsigned int min_unused_cons;
+    unsigned int min_unused_cons; // per worker
+    unsigned int max_unused_cons; // per worker
     thread_box_t workers[];
 
 } preconnect_client_state_t;
@@ -1,13 +1,12 @@
 #pragma once
-#include "tunnel.h"
-#include "node.h"
+#include "wwapi.h"
 
 
 //      ---->               encode               ---->
 // con                  (protocolbuffers)               con
 //      <----               decode               <----
 
-tunnel_t         *newProtoBufClient(node_instance_context_t *instance_info);
+tunnel_t         *newProtoBufClient(node_t *node);
 api_result_t      apiProtoBufClient(tunnel_t *self, const char *msg);
 tunnel_t         *destroyProtoBufClient(tunnel_t *self);
 tunnel_metadata_t getMetadataProtoBufClient(void);
@@ -0,0 +1,76 @@
+#include "layer3_fused.h"
+#include "chain_fusion.h"
+
+#include "tunnels/layer3/ip/manipulator/ip_manipulator_step.h"
+#include "tunnels/layer3/ip/overrider/ip_overrider_step.h"
+#include "tunnels/layer3/receiver/receiver_step.h"
+#include "tunnels/layer3/sender/sender_step.h"
+
+static inline bool receiverStep(tunnel_t *t, line_t *line, sbuf_t *payload)
+{
+    (void) t;
+    (void) line;
+    return ! kCheckPackets || layer3receiverCheckPacket(payload);
+}
+
+static inline bool ipOverriderStep(tunnel_t *t, line_t *line, sbuf_t *payload)
+{
+    (void) line;
+    layer3ipoverriderApply(tunnelGetState(t), payload);
+    return true;
+}
+
+static inline bool ipManipulatorStep(tunnel_t *t, line_t *line, sbuf_t *payload)
+{
+    (void) line;
+    layer3ipmanipulatorApply(tunnelGetState(t), payload);
+    return true;
+}
+
+static inline void senderSink(tunnel_t *t, line_t *line, sbuf_t *payload)
+{
+    layer3_senderstate_t *state = tunnelGetState(t);
+
+    layer3senderRecalculateChecksums(payload);
+    state->device_tunnel->fnPayloadU(state->device_tunnel, line, payload);
+}
+
+static inline void senderSinkBurst(tunnel_t *t, line_t *line, sbuf_t **payloads, uint32_t count)
+{
+    layer3_senderstate_t *state = tunnelGetState(t);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        layer3senderRecalculateChecksums(payloads[i]);
+    }
+    state->device_tunnel->fnPayloadBurstU(state->device_tunnel, line, payloads, count);
+}
+
+#if defined(FUSE_L3_DIRECT)
+CHAINFUSION_DEFINE2(layer3Direct, receiverStep, senderSink, senderSinkBurst)
+#endif
+
+#if defined(FUSE_L3_IP_OVERRIDER)
+CHAINFUSION_DEFINE3(layer3IpOverrider, receiverStep, ipOverriderStep, senderSink, senderSinkBurst)
+#endif
+
+#if defined(FUSE_L3_IP_MANIPULATOR)
+CHAINFUSION_DEFINE3(layer3IpManipulator, receiverStep, ipManipulatorStep, senderSink, senderSinkBurst)
+#endif
+
+void layer3fusedRegisterShapes(void)
+{
+#if defined(FUSE_L3_DIRECT)
+    chainfusionRegister(CHAINFUSION_SHAPE(layer3Direct, "Layer3Receiver", "Layer3Sender"));
+#endif
+
+#if defined(FUSE_L3_IP_OVERRIDER)
+    chainfusionRegister(
+        CHAINFUSION_SHAPE(layer3IpOverrider, "Layer3Receiver", "Layer3IpOverrider", "Layer3Sender"));
+#endif
+
+#if defined(FUSE_L3_IP_MANIPULATOR)
+    chainfusionRegister(
+        CHAINFUSION_SHAPE(layer3IpManipulator, "Layer3Receiver", "Layer3IpManipulator", "Layer3Sender"));
+#endif
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include "wwapi.h"
+
+// TunDevice ------>  Layer3Receiver -> (Layer3IpOverrider | Layer3IpManipulator) -> Layer3Sender  ------> TunDevice
+//
+//  the shapes listed in WW_FUSED_CHAINS, registered with chainfusionRegister (see chain_fusion.h)
+
+void layer3fusedRegisterShapes(void);
@@ -1,7 +1,7 @@
 #include "ip_manipulator.h"
+#include "ip_manipulator_step.h"
 #include "loggers/network_logger.h"
-#include "packet_types.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
 /*****************************************************************************
 | Protocol Number | Protocol Name                                            |
@@ -57,79 +57,49 @@ enum portaction_dynamic_value_status
     kDvspaCorrupt = kDvsFirstOption
 };
 
-typedef struct layer3_ip_manipulator_state_s
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    dynamic_value_t protocol_action;
+    layer3ipmanipulatorApply(tunnelGetState(self), payload);
 
-} layer3_ip_manipulator_state_t;
-
-typedef struct layer3_ip_manipulator_con_state_s
-{
-    void *_;
-
-} layer3_ip_manipulator_con_state_t;
-
-static inline void handleProtocolAction4(struct ipv4header *ip_header, dynamic_value_t *protocol_action)
-{
-    if (protocol_action->status != kDvsEmpty)
-    {
-        ip_header->protocol = protocol_action->value;
-    }
-}
-
-static inline void handleProtocolAction6(struct ipv6header *ip_header, dynamic_value_t *protocol_action)
-{
-    if (protocol_action->status != kDvsEmpty)
-    {
-        ip_header->nexthdr = protocol_action->value;
-    }
+    self->up->fnPayloadU(self->up, line, payload);
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
 {
-    layer3_ip_manipulator_state_t *state = TSTATE(self);
+    layer3_ip_manipulator_state_t *state = tunnelGetState(self);
 
-    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(c->payload));
-
-    if (packet->ip4_header.version == 4)
-    {
-        handleProtocolAction4(&packet->ip4_header, &state->protocol_action);
-    }
-    else if (packet->ip6_header.version == 6)
+    for (uint32_t i = 0; i < count; i++)
     {
-        handleProtocolAction6(&packet->ip6_header, &state->protocol_action);
-    }
-    else
-    {
-        LOGF("IPManipulator: non ip packets is assumed to be pre-filtered by receiver node");
-        exit(1);
+        layer3ipmanipulatorApply(state, payloads[i]);
     }
 
-    self->up->upStream(self->up, c);
+    self->up->fnPayloadBurstU(self->up, line, payloads, count);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
     (void) (self);
-    (void) (c);
+    (void) (line);
     assert(false);
 
-    if (c->payload)
-    {
-        contextReusePayload(c);
-    }
-    contextDestroy(c);
+    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
 }
 
-tunnel_t *newLayer3IpManipulator(node_instance_context_t *instance_info)
+tunnel_t *newLayer3IpManipulator(node_t *node)
 {
-    layer3_ip_manipulator_state_t *state = memoryAllocate(sizeof(layer3_ip_manipulator_state_t));
-    memorySet(state, 0, sizeof(layer3_ip_manipulator_state_t));
-    cJSON *settings = instance_info->node_settings_json;
+    tunnel_t *t = tunnelCreate(node, sizeof(layer3_ip_manipulator_state_t), 0);
+
+    t->fnPayloadU      = &upStreamPayload;
+    t->fnPayloadBurstU = &upStreamPayloadBurst;
+    t->fnPayloadD      = &downStreamPayload;
+
+    layer3_ip_manipulator_state_t *state    = tunnelGetState(t);
+    cJSON                         *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: Layer3IpManipulator->settings (object field) : The object was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
@@ -146,12 +116,6 @@ tunnel_t *newLayer3IpManipulator(node_instance_context_t *instance_info)
         state->protocol_action.value = map_array[state->protocol_action.status - kDvsFirstOption];
     }
 
-    tunnel_t *t = tunnelCreate();
-
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     return t;
 }
 
@@ -0,0 +1,50 @@
+#pragma once
+#include "wwapi.h"
+
+#include "loggers/network_logger.h"
+#include "packet_types.h"
+
+/*
+    The per packet work of Layer3IpManipulator, shared with the fused layer3 pipelines (see chain_fusion.h)
+*/
+
+typedef struct layer3_ip_manipulator_state_s
+{
+    dynamic_value_t protocol_action;
+
+} layer3_ip_manipulator_state_t;
+
+static inline void handleProtocolAction4(struct ipv4header *ip_header, dynamic_value_t *protocol_action)
+{
+    if (protocol_action->status != kDvsEmpty)
+    {
+        ip_header->protocol = protocol_action->value;
+    }
+}
+
+static inline void handleProtocolAction6(struct ipv6header *ip_header, dynamic_value_t *protocol_action)
+{
+    if (protocol_action->status != kDvsEmpty)
+    {
+        ip_header->nexthdr = protocol_action->value;
+    }
+}
+
+static inline void layer3ipmanipulatorApply(layer3_ip_manipulator_state_t *state, sbuf_t *payload)
+{
+    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(payload));
+
+    if (packet->ip4_header.version == 4)
+    {
+        handleProtocolAction4(&packet->ip4_header, &state->protocol_action);
+    }
+    else if (packet->ip6_header.version == 6)
+    {
+        handleProtocolAction6(&packet->ip6_header, &state->protocol_action);
+    }
+    else
+    {
+        LOGF("IPManipulator: non ip packets is assumed to be pre-filtered by receiver node");
+        exit(1);
+    }
+}
@@ -1,8 +1,8 @@
 #include "ip_overrider.h"
+#include "ip_overrider_step.h"
 #include "wsocket.h"
 #include "loggers/network_logger.h"
-#include "packet_types.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
 enum mode_dynamic_value_status
 {
@@ -10,86 +10,66 @@ enum mode_dynamic_value_status
     kDvsDestMode
 };
 
-typedef struct layer3_ip_overrider_state_s
+static void upStreamPayloadSrcMode(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
+    layer3ipoverriderOverrideSource(tunnelGetState(self), payload);
 
-    struct in6_addr ov_6;
-    uint32_t        ov_4;
-    bool            support4;
-    bool            support6;
-
-} layer3_ip_overrider_state_t;
-
-typedef struct layer3_ip_overrider_con_state_s
-{
-    void *_;
-
-} layer3_ip_overrider_con_state_t;
+    self->up->fnPayloadU(self->up, line, payload);
+}
 
-static void upStreamSrcMode(tunnel_t *self, context_t *c)
+static void upStreamPayloadBurstSrcMode(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
 {
-    layer3_ip_overrider_state_t *state = TSTATE(self);
-
-    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(c->payload));
+    layer3_ip_overrider_state_t *state = tunnelGetState(self);
 
-    if (state->support4 && packet->ip4_header.version == 4)
+    for (uint32_t i = 0; i < count; i++)
     {
-        // alignment assumed to be correct
-        packet->ip4_header.saddr = state->ov_4;
-    }
-    else if (state->support6 && packet->ip6_header.version == 6)
-    {
-
-        // alignment assumed to be correct
-        packet->ip6_header.saddr = state->ov_6;
+        layer3ipoverriderOverrideSource(state, payloads[i]);
     }
 
-    self->up->upStream(self->up, c);
+    self->up->fnPayloadBurstU(self->up, line, payloads, count);
 }
 
-static void upStreamDestMode(tunnel_t *self, context_t *c)
+static void upStreamPayloadDestMode(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    layer3_ip_overrider_state_t *state = TSTATE(self);
+    layer3ipoverriderOverrideDest(tunnelGetState(self), payload);
 
-    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(c->payload));
+    self->up->fnPayloadU(self->up, line, payload);
+}
 
-    if (packet->ip4_header.version == 4)
-    {
-        // alignment assumed to be correct
-        packet->ip4_header.daddr = state->ov_4;
-    }
-    else if (packet->ip6_header.version == 6)
-    {
+static void upStreamPayloadBurstDestMode(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
+{
+    layer3_ip_overrider_state_t *state = tunnelGetState(self);
 
-        // alignment assumed to be correct
-        packet->ip6_header.daddr = state->ov_6;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        layer3ipoverriderOverrideDest(state, payloads[i]);
     }
 
-    self->up->upStream(self->up, c);
+    self->up->fnPayloadBurstU(self->up, line, payloads, count);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
     (void) (self);
-    (void) (c);
+    (void) (line);
     assert(false);
 
-    if (c->payload)
-    {
-        contextReusePayload(c);
-    }
-    contextDestroy(c);
+    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
 }
 
-tunnel_t *newLayer3IpOverrider(node_instance_context_t *instance_info)
+tunnel_t *newLayer3IpOverrider(node_t *node)
 {
-    layer3_ip_overrider_state_t *state = memoryAllocate(sizeof(layer3_ip_overrider_state_t));
-    memorySet(state, 0, sizeof(layer3_ip_overrider_state_t));
-    cJSON *settings = instance_info->node_settings_json;
+    tunnel_t *t = tunnelCreate(node, sizeof(layer3_ip_overrider_state_t), 0);
+
+    t->fnPayloadD = &downStreamPayload;
+
+    layer3_ip_overrider_state_t *state    = tunnelGetState(t);
+    cJSON                       *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: Layer3IpOverrider->settings (object field) : The object was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
@@ -128,11 +108,17 @@ tunnel_t *newLayer3IpOverrider(node_instance_context_t *instance_info)
         ipbuf = NULL;
     }
 
-    tunnel_t *t = tunnelCreate();
-
-    t->state      = state;
-    t->upStream   = ((int) mode_dv.status == kDvsDestMode) ? &upStreamDestMode : &upStreamSrcMode;
-    t->downStream = &downStream;
+    state->dest_mode = (int) mode_dv.status == kDvsDestMode;
+    if (state->dest_mode)
+    {
+        t->fnPayloadU      = &upStreamPayloadDestMode;
+        t->fnPayloadBurstU = &upStreamPayloadBurstDestMode;
+    }
+    else
+    {
+        t->fnPayloadU      = &upStreamPayloadSrcMode;
+        t->fnPayloadBurstU = &upStreamPayloadBurstSrcMode;
+    }
 
     return t;
 }
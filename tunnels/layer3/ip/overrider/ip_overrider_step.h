@@ -0,0 +1,65 @@
+#pragma once
+#include "wwapi.h"
+
+#include "packet_types.h"
+
+/*
+    The per packet work of Layer3IpOverrider, shared with the fused layer3 pipelines (see chain_fusion.h)
+*/
+
+typedef struct layer3_ip_overrider_state_s
+{
+
+    struct in6_addr ov_6;
+    uint32_t        ov_4;
+    bool            support4;
+    bool            support6;
+    bool            dest_mode;
+
+} layer3_ip_overrider_state_t;
+
+static inline void layer3ipoverriderOverrideSource(layer3_ip_overrider_state_t *state, sbuf_t *payload)
+{
+    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(payload));
+
+    if (state->support4 && packet->ip4_header.version == 4)
+    {
+        // alignment assumed to be correct
+        packet->ip4_header.saddr = state->ov_4;
+    }
+    else if (state->support6 && packet->ip6_header.version == 6)
+    {
+
+        // alignment assumed to be correct
+        packet->ip6_header.saddr = state->ov_6;
+    }
+}
+
+static inline void layer3ipoverriderOverrideDest(layer3_ip_overrider_state_t *state, sbuf_t *payload)
+{
+    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(payload));
+
+    if (packet->ip4_header.version == 4)
+    {
+        // alignment assumed to be correct
+        packet->ip4_header.daddr = state->ov_4;
+    }
+    else if (packet->ip6_header.version == 6)
+    {
+
+        // alignment assumed to be correct
+        packet->ip6_header.daddr = state->ov_6;
+    }
+}
+
+static inline void layer3ipoverriderApply(layer3_ip_overrider_state_t *state, sbuf_t *payload)
+{
+    if (state->dest_mode)
+    {
+        layer3ipoverriderOverrideDest(state, payload);
+    }
+    else
+    {
+        layer3ipoverriderOverrideSource(state, payload);
+    }
+}
@@ -2,7 +2,7 @@
 #include "loggers/network_logger.h"
 #include "managers/node_manager.h"
 #include "packet_types.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
 
 enum mode_dynamic_value_status
@@ -28,7 +28,8 @@ typedef struct
         struct in6_addr mask6;
     } mask;
 
-    tunnel_t *next;
+    hash_t    hash_next;
+    tunnel_t *next; // resolved when chaining, every node is created by then
     bool      v4;
 
 } routing_rule_t;
@@ -38,42 +39,37 @@ typedef struct layer3_ip_overrider_state_s
     routing_rule_t routes[8];
     int            default_rule;
     bool           default_drop;
+    bool           dest_mode;
     uint8_t        routes_len;
 
 } layer3_ip_overrider_state_t;
 
-typedef struct layer3_ip_overrider_con_state_s
+// returns the next tunnel of the first matching rule, or NULL if the packet must be dropped
+static tunnel_t *findRoute(layer3_ip_overrider_state_t *state, sbuf_t *payload)
 {
-    void *_;
-} layer3_ip_overrider_con_state_t;
-
-static void upStreamSrcMode(tunnel_t *self, context_t *c)
-{
-    layer3_ip_overrider_state_t *state = TSTATE(self);
-
-    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(c->payload));
+    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(payload));
 
     if (packet->ip4_header.version == 4)
     {
+        const struct in_addr addr = {.s_addr = state->dest_mode ? packet->ip4_header.daddr
+                                                                : packet->ip4_header.saddr};
         for (unsigned int i = 0; i < state->routes_len; i++)
         {
-            const struct in_addr addr = {.s_addr = packet->ip4_header.saddr};
             if (state->routes[i].v4 && checkIPRange4(addr, state->routes[i].ip.ip4, state->routes[i].mask.mask4))
             {
-                state->routes[i].next->upStream(state->routes[i].next, c);
-                return;
+                return state->routes[i].next;
             }
         }
     }
     else if (packet->ip6_header.version == 6)
     {
+        const struct in6_addr addr = state->dest_mode ? packet->ip6_header.daddr : packet->ip6_header.saddr;
         for (unsigned int i = 0; i < state->routes_len; i++)
         {
             if ((! state->routes[i].v4) &&
-                checkIPRange6(packet->ip6_header.saddr, state->routes[i].ip.ip6, state->routes[i].mask.mask6))
+                checkIPRange6(addr, state->routes[i].ip.ip6, state->routes[i].mask.mask6))
             {
-                state->routes[i].next->upStream(state->routes[i].next, c);
-                return;
+                return state->routes[i].next;
             }
         }
     }
@@ -81,69 +77,137 @@ static void upStreamSrcMode(tunnel_t *self, context_t *c)
     if (state->default_drop)
     {
         LOGD("Layer3IpRoutingTable: dropped a packet that did not match any rule");
-        contextReusePayload(c);
-        contextDestroy(c);
+        return NULL;
     }
-    else
+    return state->routes[state->default_rule].next;
+}
+
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    tunnel_t *next = findRoute(tunnelGetState(self), payload);
+
+    if (next == NULL)
     {
-        state->routes[state->default_rule].next->upStream(state->routes[state->default_rule].next, c);
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+        return;
     }
+    next->fnPayloadU(next, line, payload);
 }
 
-static void upStreamDestMode(tunnel_t *self, context_t *c)
+/*
+    The burst is cut into runs of consecutive packets that take the same route, each run goes to its route as
+    one sub burst, so packet order is kept within every route
+*/
+static void upStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
 {
-    layer3_ip_overrider_state_t *state = TSTATE(self);
+    layer3_ip_overrider_state_t *state = tunnelGetState(self);
 
-    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(c->payload));
+    tunnel_t *run_next  = NULL;
+    uint32_t  run_start = 0;
+    uint32_t  kept      = 0;
 
-    if (packet->ip4_header.version == 4)
+    for (uint32_t i = 0; i < count; i++)
     {
-        for (unsigned int i = 0; i < state->routes_len; i++)
+        tunnel_t *next = findRoute(state, payloads[i]);
+
+        if (next == NULL)
         {
-            const struct in_addr addr = {.s_addr = packet->ip4_header.saddr};
-            if (checkIPRange4(addr, state->routes[i].ip.ip4, state->routes[i].mask.mask4))
-            {
-                state->routes[i].next->upStream(state->routes[i].next, c);
-            }
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payloads[i]);
+            continue;
+        }
+
+        if (next != run_next && kept > run_start)
+        {
+            run_next->fnPayloadBurstU(run_next, line, payloads + run_start, kept - run_start);
+            run_start = kept;
         }
+        run_next         = next;
+        payloads[kept++] = payloads[i];
     }
-    else if (packet->ip4_header.version == 6)
+
+    if (kept > run_start)
     {
-        for (unsigned int i = 0; i < state->routes_len; i++)
+        run_next->fnPayloadBurstU(run_next, line, payloads + run_start, kept - run_start);
+    }
+}
+
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    (void) (self);
+    (void) (line);
+    assert(false);
+
+    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+}
+
+static bool isFirstRuleOf(layer3_ip_overrider_state_t *state, unsigned int rule_index)
+{
+    for (unsigned int i = 0; i < rule_index; i++)
+    {
+        if (state->routes[i].next == state->routes[rule_index].next)
         {
-            if (checkIPRange6(packet->ip6_header.daddr, state->routes[i].ip.ip6, state->routes[i].mask.mask6))
-            {
-                state->routes[i].next->upStream(state->routes[i].next, c);
-            }
+            return false;
         }
     }
+    return true;
+}
 
-    if (state->default_drop)
+// every route branch joins the chain of this node, so they all share its line
+static void onChain(tunnel_t *t, tunnel_chain_t *tc)
+{
+    layer3_ip_overrider_state_t *state = tunnelGetState(t);
+    node_manager_config_t       *cfg   = tunnelGetNode(t)->node_manager_config;
+
+    tunnelchainInsert(tc, t);
+
+    for (unsigned int i = 0; i < state->routes_len; i++)
     {
-        LOGD("Layer3IpRoutingTable: dropped a packet that did not match any rule");
-        contextReusePayload(c);
-        contextDestroy(c);
+        node_t *next = nodemanagerGetNode(cfg, state->routes[i].hash_next);
+        assert(next != NULL && next->instance != NULL); // checked by parseRule, every node is created by now
+
+        state->routes[i].next = next->instance;
+        if (! isFirstRuleOf(state, i))
+        {
+            continue;
+        }
+        tunnelBindDown(t, next->instance);
+        next->instance->onChain(next->instance, tc);
     }
-    else
+}
+
+static void onIndex(tunnel_t *t, tunnel_array_t *arr, uint16_t *index, uint16_t *mem_offset)
+{
+    layer3_ip_overrider_state_t *state = tunnelGetState(t);
+
+    tunnelarrayInesert(arr, t);
+    t->chain_index   = *index;
+    t->lstate_offset = *mem_offset;
+    (*index)++;
+    *mem_offset += t->lstate_size;
+
+    for (unsigned int i = 0; i < state->routes_len; i++)
     {
-        state->routes[state->default_rule].next->upStream(state->routes[state->default_rule].next, c);
+        if (isFirstRuleOf(state, i))
+        {
+            state->routes[i].next->onIndex(state->routes[i].next, arr, index, mem_offset);
+        }
     }
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void onStart(tunnel_t *t)
 {
-    (void) (self);
-    (void) (c);
-    assert(false);
+    layer3_ip_overrider_state_t *state = tunnelGetState(t);
 
-    if (c->payload)
+    for (unsigned int i = 0; i < state->routes_len; i++)
     {
-        contextReusePayload(c);
+        if (isFirstRuleOf(state, i))
+        {
+            state->routes[i].next->onStart(state->routes[i].next);
+        }
     }
-    contextDestroy(c);
 }
 
-static routing_rule_t parseRule(struct node_manager_config_s *cfg, unsigned int chain_index, const cJSON *rule_obj)
+static routing_rule_t parseRule(node_manager_config_t *cfg, const cJSON *rule_obj)
 {
     char *temp = NULL;
 
@@ -177,30 +241,31 @@ static routing_rule_t parseRule(struct node_manager_config_s *cfg, unsigned int
         exit(1);
     }
 
-    if (node->instance == NULL)
-    {
-        nodemanagerRunNode(cfg, node, chain_index + 1);
-        if (node->instance == NULL)
-        {
-            exit(1);
-        }
-    }
     memoryFree(temp);
 
-    rule.next = node->instance;
+    rule.hash_next = hash_node_name;
 
     return rule;
 }
 
-tunnel_t *newLayer3IpRoutingTable(node_instance_context_t *instance_info)
+tunnel_t *newLayer3IpRoutingTable(node_t *node)
 {
-    layer3_ip_overrider_state_t *state = memoryAllocate(sizeof(layer3_ip_overrider_state_t));
-    memorySet(state, 0, sizeof(layer3_ip_overrider_state_t));
-    cJSON *settings = instance_info->node_settings_json;
+    tunnel_t *t = tunnelCreate(node, sizeof(layer3_ip_overrider_state_t), 0);
+
+    t->fnPayloadU      = &upStreamPayload;
+    t->fnPayloadBurstU = &upStreamPayloadBurst;
+    t->fnPayloadD      = &downStreamPayload;
+    t->onChain         = &onChain;
+    t->onIndex         = &onIndex;
+    t->onStart         = &onStart;
+
+    layer3_ip_overrider_state_t *state    = tunnelGetState(t);
+    cJSON                       *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: Layer3IpRoutingTable->settings (object field) : The object was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
@@ -209,7 +274,7 @@ tunnel_t *newLayer3IpRoutingTable(node_instance_context_t *instance_info)
     if (def_action.status == kDvsConstant)
     {
         state->default_drop = false;
-        state->default_rule = (int) def_action.status;
+        state->default_rule = (int) def_action.value;
     }
     else
     {
@@ -226,6 +291,7 @@ tunnel_t *newLayer3IpRoutingTable(node_instance_context_t *instance_info)
              "want to filter based on source ip or dest ip?");
         exit(1);
     }
+    state->dest_mode = (int) mode_dv.status == kDvsDestMode;
     dynamicvalueDestroy(mode_dv);
 
 
@@ -240,7 +306,12 @@ tunnel_t *newLayer3IpRoutingTable(node_instance_context_t *instance_info)
     const cJSON *list_item = NULL;
     cJSON_ArrayForEach(list_item, rules)
     {
-        state->routes[i++] = parseRule(instance_info->node_manager_config, instance_info->chain_index, list_item);
+        if (i == ARRAY_SIZE(state->routes))
+        {
+            LOGF("Layer3IpRoutingTable: too much rules");
+            exit(1);
+        }
+        state->routes[i++] = parseRule(node->node_manager_config, list_item);
     }
 
     if (i == 0)
@@ -248,19 +319,8 @@ tunnel_t *newLayer3IpRoutingTable(node_instance_context_t *instance_info)
         LOGF("Layer3IpRoutingTable: no rules");
         exit(1);
     }
-    if (i > ARRAY_SIZE(state->routes))
-    {
-        LOGF("Layer3IpRoutingTable: too much rules");
-        exit(1);
-    }
     state->routes_len = i;
 
-    tunnel_t *t = tunnelCreate();
-
-    t->state      = state;
-    t->upStream   = ((int) mode_dv.status == kDvsDestMode) ? &upStreamDestMode : &upStreamSrcMode;
-    t->downStream = &downStream;
-
     return t;
 }
 api_result_t apiLayer3IpRoutingTable(tunnel_t *self, const char *msg)
@@ -1,27 +1,9 @@
 #include "receiver.h"
+#include "receiver_step.h"
 #include "wsocket.h"
 #include "loggers/network_logger.h"
 #include "managers/node_manager.h"
-#include "packet_types.h"
-#include "utils/jsonutils.h"
-#include "utils/stringutils.h"
-
-typedef struct layer3_receiver_state_s
-{
-    char     *device_name;
-    tunnel_t *device_tunnel;
-
-} layer3_receiver_state_t;
-
-typedef struct layer3_receiver_con_state_s
-{
-    void *_;
-} layer3_receiver_con_state_t;
-
-enum
-{
-    kCheckPackets = true
-};
+#include "utils/json_helpers.h"
 
 enum mode_dynamic_value_status
 {
@@ -30,118 +12,107 @@ enum mode_dynamic_value_status
 };
 
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    // layer3_receiver_state_t *state = TSTATE(self);
-    (void) (self);
+    /*      im not sure these checks are necessary    */
+    if (kCheckPackets && ! layer3receiverCheckPacket(payload))
+    {
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+        return;
+    }
 
-    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(c->payload));
+    self->up->fnPayloadU(self->up, line, payload);
+}
 
-    /*      im not sure these checks are necessary    */
+static void upStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
+{
     if (kCheckPackets)
     {
-        if (packet->ip4_header.version == 4)
+        // dropped packets are squeezed out of the array, the rest keep their order
+        buffer_pool_t *pool = getWorkerBufferPool(getWID());
+        uint32_t       kept = 0;
+        for (uint32_t i = 0; i < count; i++)
         {
-            if (UNLIKELY(sbufGetBufLength(c->payload) < sizeof(struct ipv4header)))
+            if (UNLIKELY(! layer3receiverCheckPacket(payloads[i])))
             {
-                LOGW("Layer3Receiver: dropped a ipv4 packet that was too small");
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
+                bufferpoolResuesBuffer(pool, payloads[i]);
+                continue;
             }
+            payloads[kept++] = payloads[i];
         }
-        else if (packet->ip6_header.version == 6)
-        {
-
-            if (UNLIKELY(sbufGetBufLength(c->payload) < sizeof(struct ipv6header)))
-            {
-                LOGW("Layer3Receiver: dropped a ipv6 packet that was too small");
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
-            }
-        }
-        else
-        {
-            LOGW("Layer3Receiver: dropped a non ip protocol packet");
-            contextReusePayload(c);
-            contextDestroy(c);
-            return;
-        }
+        count = kept;
     }
 
-    self->up->upStream(self->up, c);
+    if (count > 0)
+    {
+        self->up->fnPayloadBurstU(self->up, line, payloads, count);
+    }
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
     (void) (self);
-    (void) (c);
+    (void) (line);
     assert(false);
 
-    if (c->payload)
-    {
-        contextReusePayload(c);
-    }
-    contextDestroy(c);
+    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
 }
 
-tunnel_t *newLayer3Receiver(node_instance_context_t *instance_info)
+tunnel_t *newLayer3Receiver(node_t *node)
 {
-    layer3_receiver_state_t *state = memoryAllocate(sizeof(layer3_receiver_state_t));
-    memorySet(state, 0, sizeof(layer3_receiver_state_t));
-    cJSON *settings = instance_info->node_settings_json;
+    tunnel_t *t = tunnelCreate(node, sizeof(layer3_receiver_state_t), 0);
+
+    t->fnPayloadU      = &upStreamPayload;
+    t->fnPayloadBurstU = &upStreamPayloadBurst;
+    t->fnPayloadD      = &downStreamPayload;
+
+    layer3_receiver_state_t *state    = tunnelGetState(t);
+    cJSON                   *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: Layer3Receiver->settings (object field) : The object was empty or invalid");
-        memoryFree(state);
+        tunnelDestroy(t);
         return NULL;
     }
 
     if (! getStringFromJsonObject(&(state->device_name), settings, "device"))
     {
         LOGF("JSON Error: Layer3Receiver->settings->device (string field) : The string was empty or invalid");
-        memoryFree(state);
+        tunnelDestroy(t);
         return NULL;
     }
 
     hash_t  hash_tdev_name = calcHashBytes(state->device_name, strlen(state->device_name));
-    node_t *tundevice_node = nodemanagerGetNode(instance_info->node_manager_config, hash_tdev_name);
-    
+    node_t *tundevice_node = nodemanagerGetNode(node->node_manager_config, hash_tdev_name);
+
     if (tundevice_node == NULL)
     {
         LOGF("Layer3Receiver: could not find tun device node \"%s\"", state->device_name);
-        memoryFree(state);
+        tunnelDestroy(t);
         return NULL;
     }
 
     if (tundevice_node->instance == NULL)
     {
-        nodemanagerRunNode(instance_info->node_manager_config, tundevice_node, 0);
+        nodemanagerRunNode(node->node_manager_config, tundevice_node, 0);
     }
 
     if (tundevice_node->instance == NULL)
     {
-        memoryFree(state);
+        tunnelDestroy(t);
         return NULL;
     }
 
     if (tundevice_node->instance->up != NULL)
     {
         LOGF("Layer3Receiver: tun device \"%s\" cannot be used by 2 receivers", state->device_name);
-        memoryFree(state);
+        tunnelDestroy(t);
         return NULL;
     }
 
     state->device_tunnel = tundevice_node->instance;
 
-    tunnel_t *t = tunnelCreate();
-
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     tunnelBind(tundevice_node->instance, t);
 
     return t;
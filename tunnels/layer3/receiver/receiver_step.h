@@ -0,0 +1,50 @@
+#pragma once
+#include "wwapi.h"
+
+#include "loggers/network_logger.h"
+#include "packet_types.h"
+
+/*
+    The per packet work of Layer3Receiver, shared with the fused layer3 pipelines (see chain_fusion.h)
+*/
+
+typedef struct layer3_receiver_state_s
+{
+    char     *device_name;
+    tunnel_t *device_tunnel;
+
+} layer3_receiver_state_t;
+
+enum
+{
+    kCheckPackets = true
+};
+
+static inline bool layer3receiverCheckPacket(sbuf_t *payload)
+{
+    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(payload));
+
+    if (packet->ip4_header.version == 4)
+    {
+        if (UNLIKELY(sbufGetBufLength(payload) < sizeof(struct ipv4header)))
+        {
+            LOGW("Layer3Receiver: dropped a ipv4 packet that was too small");
+            return false;
+        }
+    }
+    else if (packet->ip6_header.version == 6)
+    {
+
+        if (UNLIKELY(sbufGetBufLength(payload) < sizeof(struct ipv6header)))
+        {
+            LOGW("Layer3Receiver: dropped a ipv6 packet that was too small");
+            return false;
+        }
+    }
+    else
+    {
+        LOGW("Layer3Receiver: dropped a non ip protocol packet");
+        return false;
+    }
+    return true;
+}
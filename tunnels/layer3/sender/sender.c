@@ -1,23 +1,11 @@
 #include "sender.h"
+#include "sender_step.h"
 #include "wsocket.h"
 #include "loggers/network_logger.h"
 #include "managers/node_manager.h"
-#include "packet_types.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
 
-typedef struct layer3_senderstate_s
-{
-    char     *device_name;
-    tunnel_t *device_tunnel;
-
-} layer3_senderstate_t;
-
-typedef struct layer3_sendercon_state_s
-{
-    void *_;
-} layer3_sendercon_state_t;
-
 static void printSendingIPPacketInfo(const unsigned char *buffer, unsigned int len)
 {
     char  src_ip[INET6_ADDRSTRLEN];
@@ -66,71 +54,46 @@ static void printSendingIPPacketInfo(const unsigned char *buffer, unsigned int l
     LOGD(logbuf);
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    layer3_senderstate_t *state = TSTATE(self);
+    layer3_senderstate_t *state = tunnelGetState(self);
 
-    // printSendingIPPacketInfo(sbufGetRawPtr(c->payload), sbufGetBufLength(c->payload));
+    // printSendingIPPacketInfo(sbufGetRawPtr(payload), sbufGetBufLength(payload));
 
-    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(c->payload));
-    unsigned int ip_header_len;
+    layer3senderRecalculateChecksums(payload);
 
-    /* Tcp checksum must be recalculated even if ip header is the only changed part of packet */
-
-    if (packet->ip4_header.version == 4)
-    {
-        ip_header_len = packet->ip4_header.ihl * 4;
-
-        packet->ip4_header.check = 0x0;
-        packet->ip4_header.check = standardCheckSum((void *) packet, packet->ip4_header.ihl * 4);
+    state->device_tunnel->fnPayloadU(state->device_tunnel, line, payload);
+}
 
-        if (packet->ip4_header.protocol == 6)
-        {
-            struct tcpheader *tcp_header = (struct tcpheader *) (sbufGetMutablePtr(c->payload) + ip_header_len);
-            tcpCheckSum4(&(packet->ip4_header), tcp_header);
-        }
-    }
-    else if (packet->ip6_header.version == 6)
-    {
-        ip_header_len = sizeof(struct ipv6header);
+static void upStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
+{
+    layer3_senderstate_t *state = tunnelGetState(self);
 
-        if (packet->ip6_header.nexthdr == 6)
-        {
-            struct tcpheader *tcp_header = (struct tcpheader *) (sbufGetMutablePtr(c->payload) + ip_header_len);
-            tcpCheckSum6(&(packet->ip6_header), tcp_header);
-        }
-    }
-    else
+    for (uint32_t i = 0; i < count; i++)
     {
-        LOGF("Layer3Sender: non ip packets is assumed to be pre-filtered by receiver node");
-        exit(1);
+        layer3senderRecalculateChecksums(payloads[i]);
     }
 
-    state->device_tunnel->upStream(state->device_tunnel, c);
+    state->device_tunnel->fnPayloadBurstU(state->device_tunnel, line, payloads, count);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
     (void) (self);
-    (void) (c);
+    (void) (line);
     assert(false);
 
-    if (c->payload)
-    {
-        contextReusePayload(c);
-    }
-    contextDestroy(c);
+    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
 }
 
 // only for debug and tests
 static void onTimer(wtimer_t *timer)
 {
     LOGD("sending...");
-    tunnel_t             *self  = weventGetUserdata(timer);
-    layer3_senderstate_t *state = TSTATE(self);
-    line_t               *l     = newLine(0);
-    context_t            *c     = contextCreate(l);
-    c->payload                  = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
+    tunnel_t             *self    = weventGetUserdata(timer);
+    layer3_senderstate_t *state   = tunnelGetState(self);
+    line_t               *l       = newLine(tunnelchainGetLinePool(tunnelGetChain(self), getWID()));
+    sbuf_t               *payload = bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID()));
 
     // unsigned char bpacket[] = {0x45, 0x00, 0x00, 0x2C, 0x00, 0x01, 0x00, 0x00, 0x40, 0x06, 0x00, 0xC4, 0xC0, 0x00,
     // 0x02,
@@ -142,70 +105,70 @@ static void onTimer(wtimer_t *timer)
                                0x02, 0x22, 0xC2, 0x95, 0x43, 0x78, 0x0C, 0x00, 0x50, 0xF4, 0x70, 0x98, 0x8B, 0x00, 0x00,
                                0x00, 0x00, 0x60, 0x02, 0xFF, 0xFF, 0x18, 0xC6, 0x00, 0x00, 0x02, 0x04, 0x05, 0xB4};
 
-    sbufSetLength(c->payload, sizeof(bpacket));
-    sbufWrite(c->payload, bpacket, sizeof(bpacket));
+    sbufSetLength(payload, sizeof(bpacket));
+    sbufWrite(payload, bpacket, sizeof(bpacket));
 
-    printSendingIPPacketInfo(sbufGetRawPtr(c->payload), sbufGetBufLength(c->payload));
+    printSendingIPPacketInfo(sbufGetRawPtr(payload), sbufGetBufLength(payload));
 
-    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(c->payload));
+    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(payload));
 
     packet->ip4_header.check = 0x0;
 
     int ip_header_len        = packet->ip4_header.ihl * 4;
     packet->ip4_header.check = standardCheckSum((void *) packet, ip_header_len);
 
-    state->device_tunnel->upStream(state->device_tunnel, c);
+    state->device_tunnel->fnPayloadU(state->device_tunnel, l, payload);
+    lineDestroy(l);
 }
 
-tunnel_t *newLayer3Sender(node_instance_context_t *instance_info)
+tunnel_t *newLayer3Sender(node_t *node)
 {
-    layer3_senderstate_t *state = memoryAllocate(sizeof(layer3_senderstate_t));
-    memorySet(state, 0, sizeof(layer3_senderstate_t));
-    cJSON *settings = instance_info->node_settings_json;
+    tunnel_t *t = tunnelCreate(node, sizeof(layer3_senderstate_t), 0);
+
+    t->fnPayloadU      = &upStreamPayload;
+    t->fnPayloadBurstU = &upStreamPayloadBurst;
+    t->fnPayloadD      = &downStreamPayload;
+
+    layer3_senderstate_t *state    = tunnelGetState(t);
+    cJSON                *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: Layer3Sender->settings (object field) : The object was empty or invalid");
-        memoryFree(state);
+        tunnelDestroy(t);
         return NULL;
     }
 
     if (! getStringFromJsonObject(&(state->device_name), settings, "device"))
     {
         LOGF("JSON Error: Layer3Sender->settings->device (string field) : The string was empty or invalid");
-        memoryFree(state);
+        tunnelDestroy(t);
         return NULL;
     }
 
     hash_t  hash_tdev_name = calcHashBytes(state->device_name, strlen(state->device_name));
-    node_t *tundevice_node = nodemanagerGetNode(instance_info->node_manager_config, hash_tdev_name);
+    node_t *tundevice_node = nodemanagerGetNode(node->node_manager_config, hash_tdev_name);
 
     if (tundevice_node == NULL)
     {
         LOGF("Layer3Sender: could not find tun device node \"%s\"", state->device_name);
-        memoryFree(state);
+        tunnelDestroy(t);
         return NULL;
     }
 
     if (tundevice_node->instance == NULL)
     {
-        nodemanagerRunNode(instance_info->node_manager_config, tundevice_node, 0);
+        nodemanagerRunNode(node->node_manager_config, tundevice_node, 0);
     }
 
     if (tundevice_node->instance == NULL)
     {
-        memoryFree(state);
+        tunnelDestroy(t);
         return NULL;
     }
 
     state->device_tunnel = tundevice_node->instance;
 
-    tunnel_t *t = tunnelCreate();
-
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     // for testing
     // wtimer_t *tm = wtimerAdd(getWorkerLoop(0), onTimer, 500, INFINITE);
     // weventSetUserData(tm, t);
@@ -0,0 +1,53 @@
+#pragma once
+#include "wwapi.h"
+
+#include "loggers/network_logger.h"
+#include "packet_types.h"
+
+/*
+    The per packet work of Layer3Sender, shared with the fused layer3 pipelines (see chain_fusion.h)
+*/
+
+typedef struct layer3_senderstate_s
+{
+    char     *device_name;
+    tunnel_t *device_tunnel;
+
+} layer3_senderstate_t;
+
+static inline void layer3senderRecalculateChecksums(sbuf_t *payload)
+{
+    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(payload));
+    unsigned int ip_header_len;
+
+    /* Tcp checksum must be recalculated even if ip header is the only changed part of packet */
+
+    if (packet->ip4_header.version == 4)
+    {
+        ip_header_len = packet->ip4_header.ihl * 4;
+
+        packet->ip4_header.check = 0x0;
+        packet->ip4_header.check = standardCheckSum((void *) packet, packet->ip4_header.ihl * 4);
+
+        if (packet->ip4_header.protocol == 6)
+        {
+            struct tcpheader *tcp_header = (struct tcpheader *) (sbufGetMutablePtr(payload) + ip_header_len);
+            tcpCheckSum4(&(packet->ip4_header), tcp_header);
+        }
+    }
+    else if (packet->ip6_header.version == 6)
+    {
+        ip_header_len = sizeof(struct ipv6header);
+
+        if (packet->ip6_header.nexthdr == 6)
+        {
+            struct tcpheader *tcp_header = (struct tcpheader *) (sbufGetMutablePtr(payload) + ip_header_len);
+            tcpCheckSum6(&(packet->ip6_header), tcp_header);
+        }
+    }
+    else
+    {
+        LOGF("Layer3Sender: non ip packets is assumed to be pre-filtered by receiver node");
+        exit(1);
+    }
+}
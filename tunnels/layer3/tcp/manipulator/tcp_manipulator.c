@@ -3,7 +3,7 @@
 #include "wsocket.h"
 #include "loggers/network_logger.h"
 #include "packet_types.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
 enum bitaction_dynamic_value_status
 {
@@ -27,11 +27,6 @@ typedef struct layer3_tcp_manipulator_state_s
 
 } layer3_tcp_manipulator_state_t;
 
-typedef struct layer3_tcp_manipulator_con_state_s
-{
-    void *_;
-
-} layer3_tcp_manipulator_con_state_t;
 
 static inline void handleResetBitAction(struct tcpheader *tcp_header, dynamic_value_t *reset_bit)
 {
@@ -93,11 +88,10 @@ static inline void handleDestPortAction(struct tcpheader *tcp_header, dynamic_va
     }
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+// returns false if the packet is malformed and must be dropped, non tcp packets are passed unchanged
+static bool manipulatePacket(layer3_tcp_manipulator_state_t *state, sbuf_t *payload)
 {
-    layer3_tcp_manipulator_state_t *state = TSTATE(self);
-
-    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(c->payload));
+    packet_mask *packet = (packet_mask *) (sbufGetMutablePtr(payload));
 
     unsigned int ip_header_len;
 
@@ -105,38 +99,32 @@ static void upStream(tunnel_t *self, context_t *c)
     {
         ip_header_len = packet->ip4_header.ihl * 4;
 
-        if (UNLIKELY(sbufGetBufLength(c->payload) < ip_header_len + sizeof(struct tcpheader)))
+        if (UNLIKELY(sbufGetBufLength(payload) < ip_header_len + sizeof(struct tcpheader)))
         {
             LOGW("TcpManipulator: dropped an ipv4 packet, length is too short for TCP header");
-            contextReusePayload(c);
-            contextDestroy(c);
-            return;
+            return false;
         }
 
         if (packet->ip4_header.protocol != 6)
         {
             // LOGD("TcpManipulator: ipv4 packet is not TCP");
-            self->up->upStream(self->up, c);
-            return;
+            return true;
         }
     }
     else if (packet->ip6_header.version == 6)
     {
         ip_header_len = sizeof(struct ipv6header);
 
-        if (UNLIKELY(sbufGetBufLength(c->payload) < ip_header_len + sizeof(struct tcpheader)))
+        if (UNLIKELY(sbufGetBufLength(payload) < ip_header_len + sizeof(struct tcpheader)))
         {
             LOGW("TcpManipulator: dropped an ipv6 packet, length is too short for TCP header");
-            contextReusePayload(c);
-            contextDestroy(c);
-            return;
+            return false;
         }
 
         if (packet->ip6_header.nexthdr != 6)
         {
             // LOGD("TcpManipulator: ipv6 packet is not TCP");
-            self->up->upStream(self->up, c);
-            return;
+            return true;
         }
     }
     else
@@ -145,41 +133,74 @@ static void upStream(tunnel_t *self, context_t *c)
         exit(1);
     }
 
-    struct tcpheader *tcp_header = (struct tcpheader *) (sbufGetMutablePtr(c->payload) + ip_header_len);
+    struct tcpheader *tcp_header = (struct tcpheader *) (sbufGetMutablePtr(payload) + ip_header_len);
 
     handleResetBitAction(tcp_header, &(state->reset_bit_action));
 
     handleSourcePortAction(tcp_header, &(state->source_port_action), state->corrupt_password,
-                           ((const char *) sbufGetMutablePtr(c->payload) + sbufGetBufLength(c->payload)));
+                           ((const char *) sbufGetMutablePtr(payload) + sbufGetBufLength(payload)));
 
     handleDestPortAction(tcp_header, &(state->dest_port_action), state->corrupt_password,
-                         ((const char *) sbufGetMutablePtr(c->payload) + sbufGetBufLength(c->payload)));
+                         ((const char *) sbufGetMutablePtr(payload) + sbufGetBufLength(payload)));
+    return true;
+}
 
-    self->up->upStream(self->up, c);
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    if (! manipulatePacket(tunnelGetState(self), payload))
+    {
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+        return;
+    }
+
+    self->up->fnPayloadU(self->up, line, payload);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void upStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
 {
-    (void) (self);
-    (void) (c);
-    assert(false);
+    layer3_tcp_manipulator_state_t *state = tunnelGetState(self);
+    uint32_t                        kept  = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (UNLIKELY(! manipulatePacket(state, payloads[i])))
+        {
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payloads[i]);
+            continue;
+        }
+        payloads[kept++] = payloads[i];
+    }
 
-    if (c->payload)
+    if (kept > 0)
     {
-        contextReusePayload(c);
+        self->up->fnPayloadBurstU(self->up, line, payloads, kept);
     }
-    contextDestroy(c);
 }
 
-tunnel_t *newLayer3TcpManipulator(node_instance_context_t *instance_info)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    layer3_tcp_manipulator_state_t *state = memoryAllocate(sizeof(layer3_tcp_manipulator_state_t));
-    memorySet(state, 0, sizeof(layer3_tcp_manipulator_state_t));
-    cJSON *settings = instance_info->node_settings_json;
+    (void) (self);
+    (void) (line);
+    assert(false);
+
+    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+}
+
+tunnel_t *newLayer3TcpManipulator(node_t *node)
+{
+    tunnel_t *t = tunnelCreate(node, sizeof(layer3_tcp_manipulator_state_t), 0);
+
+    t->fnPayloadU      = &upStreamPayload;
+    t->fnPayloadBurstU = &upStreamPayloadBurst;
+    t->fnPayloadD      = &downStreamPayload;
+
+    layer3_tcp_manipulator_state_t *state    = tunnelGetState(t);
+    cJSON                          *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: Layer3TcpManipulator->settings (object field) : The object was empty or invalid");
+        tunnelDestroy(t);
         return NULL;
     }
 
@@ -195,12 +216,6 @@ tunnel_t *newLayer3TcpManipulator(node_instance_context_t *instance_info)
         state->corrupt_password = state->corrupt_password % 29;
     }
 
-    tunnel_t *t = tunnelCreate();
-
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     return t;
 }
 
@@ -1,8 +1,8 @@
 #include "bgp4_server.h"
-#include "buffer_stream.h"
+#include "frame_decoder.h"
 
 #include "loggers/network_logger.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
 enum
 {
@@ -24,173 +24,174 @@ enum
 #define VAL_4X VAL_2X, VAL_2X
 #define VAL_8X VAL_4X, VAL_4X
 
-typedef struct bgp4_client_state_s
+// marker, 2 byte length of the rest (type + payload)
+static const frame_format_t kBgpFrameFormat = {
+    .min_length = 2, .max_length = UINT16_MAX, .length_offset = kMarkerLength, .length_size = sizeof(uint16_t)};
+
+typedef struct bgp4_server_state_s
 {
     uint16_t as_number;
     uint32_t sim_ip;
     hash_t   hpassword;
-} bgp4_client_state_t;
+} bgp4_server_state_t;
+
+typedef struct bgp4_server_lstate_s
+{
+    frame_decoder_t read_decoder;
+    bool            open_received;
+
+} bgp4_server_lstate_t;
+
+static void cleanup(tunnel_t *self, line_t *line)
+{
+    bgp4_server_lstate_t *ls = lineGetState(self, line);
+    framedecoderDestroy(&(ls->read_decoder));
+    lineClearState(ls, sizeof(bgp4_server_lstate_t));
+}
 
-typedef struct bgp4_client_con_state_s
+static void upStreamInit(tunnel_t *self, line_t *line)
 {
-    buffer_stream_t *read_stream;
-    bool             open_received;
+    bgp4_server_lstate_t *ls = lineGetState(self, line);
+
+    *ls = (bgp4_server_lstate_t) {0};
+    framedecoderInit(&(ls->read_decoder), getWorkerBufferPool(getWID()), kBgpFrameFormat);
 
-} bgp4_client_con_state_t;
+    self->up->fnInitU(self->up, line);
+}
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    bgp4_client_con_state_t *cstate = CSTATE(c);
+    bgp4_server_lstate_t *ls   = lineGetState(self, line);
+    buffer_pool_t        *pool = getWorkerBufferPool(getWID());
 
-    if (c->payload != NULL)
+    framedecoderPush(&(ls->read_decoder), payload);
+
+    lineLock(line);
+    while (lineIsAlive(line))
     {
-        bufferStreamPushContextPayload(cstate->read_stream, c);
-        while (lineIsAlive(c->line) && bufferstreamLen(cstate->read_stream) > kBgpHeaderLen)
+        sbuf_t                *buf    = NULL;
+        frame_decoder_result_t result = framedecoderNextBuffer(&(ls->read_decoder), &buf);
+        if (result == kFrameDecoderNeedMore)
+        {
+            break;
+        }
+        if (result == kFrameDecoderInvalid)
         {
-            uint16_t required_length = 0;
-            bufferstreamViewBytesAt(cstate->read_stream, kMarkerLength, (uint8_t *) &required_length,
-                                    sizeof(required_length));
-            if (required_length <= 1)
+            LOGE("Bgp4Server: message too short");
+            goto disconnect;
+        }
+
+        static const uint8_t kExpecetd[kMarkerLength] = {VAL_8X, VAL_8X};
+
+        if (0 != memcmp(sbufGetRawPtr(buf), kExpecetd, kMarkerLength))
+        {
+            LOGE("Bgp4Server: invalid marker");
+            bufferpoolResuesBuffer(pool, buf);
+            goto disconnect;
+        }
+        sbufShiftRight(buf, kBgpHeaderLen);
+
+        if (! ls->open_received)
+        {
+            if (sbufGetBufLength(buf) < kBgpOpenPacketHeaderSize + 1) // +1 for type
             {
-                LOGE("Bgp4Server: message too short");
+                LOGE("Bgp4Server: open packet length is shorter than bgp header");
+                bufferpoolResuesBuffer(pool, buf);
                 goto disconnect;
             }
 
-            if (bufferstreamLen(cstate->read_stream) >= ((unsigned int) kBgpHeaderLen + required_length))
+            uint8_t bgp_type;
+            sbufReadUnAlignedUI8(buf, &bgp_type);
+            if (bgp_type == 1)
             {
-                sbuf_t *buf = bufferstreamReadExact(cstate->read_stream, kBgpHeaderLen + required_length);
-
-                static const uint8_t kExpecetd[kMarkerLength] = {VAL_8X, VAL_8X};
-
-                if (0 != memcmp(sbufGetRawPtr(buf), kExpecetd, kMarkerLength))
-                {
-                    LOGE("Bgp4Server: invalid marker");
-                    bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                    goto disconnect;
-                }
-                sbufShiftRight(buf, kBgpHeaderLen);
-
-                if (! cstate->open_received)
-                {
-                    if (sbufGetBufLength(buf) < kBgpOpenPacketHeaderSize + 1) // +1 for type
-                    {
-                        LOGE("Bgp4Server: open packet length is shorter than bgp header");
-                        bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                        goto disconnect;
-                    }
-
-                    uint8_t bgp_type;
-                    sbufReadUnAlignedUI8(buf, &bgp_type);
-                    if (bgp_type == 1)
-                    {
-                        cstate->open_received = true;
-                    }
-                    else
-                    {
-                        LOGE("Bgp4Server: first message type was not bgp_open");
-                        bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                        goto disconnect;
-                    }
-
-                    sbufShiftRight(buf, kBgpOpenPacketHeaderSize); // now at index addition
-
-                    uint8_t bgp_additions;
-                    sbufReadUnAlignedUI8(buf, &bgp_additions);
-
-                    if (bgp_additions > 0 && sbufGetBufLength(buf) - 1 < bgp_additions)
-                    {
-                        LOGE("Bgp4Server: open message had extensions more than the length");
-                        bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                        goto disconnect;
-                    }
-                    sbufShiftRight(buf, bgp_additions + 1); // pass addition count and items
-                }
-                else
-                {
-                    sbufShiftRight(buf, 1); // pass type
-                }
-
-                if (sbufGetBufLength(buf) <= 0)
-                {
-                    LOGE("Bgp4Server: message had no payload");
-                    bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                    goto disconnect;
-                }
-
-                context_t *data_ctx = contextCreate(c->line);
-                data_ctx->payload   = buf;
-                self->up->upStream(self->up, data_ctx);
+                ls->open_received = true;
             }
             else
             {
-                break;
+                LOGE("Bgp4Server: first message type was not bgp_open");
+                bufferpoolResuesBuffer(pool, buf);
+                goto disconnect;
+            }
+
+            sbufShiftRight(buf, kBgpOpenPacketHeaderSize); // now at index addition
+
+            uint8_t bgp_additions;
+            sbufReadUnAlignedUI8(buf, &bgp_additions);
+
+            if (bgp_additions > 0 && sbufGetBufLength(buf) - 1 < bgp_additions)
+            {
+                LOGE("Bgp4Server: open message had extensions more than the length");
+                bufferpoolResuesBuffer(pool, buf);
+                goto disconnect;
             }
+            sbufShiftRight(buf, bgp_additions + 1); // pass addition count and items
+        }
+        else
+        {
+            sbufShiftRight(buf, 1); // pass type
         }
-        contextDestroy(c);
-        return;
-    }
 
-    if (c->init)
-    {
-        cstate        = memoryAllocate(sizeof(bgp4_client_con_state_t));
-        *cstate       = (bgp4_client_con_state_t){.read_stream = bufferstreamCreate(contextGetBufferPool(c))};
-        CSTATE_MUT(c) = cstate;
-    }
-    else if (c->fin)
-    {
-        bufferstreamDestroy(cstate->read_stream);
-        memoryFree(cstate);
-        CSTATE_DROP(c);
-    }
+        if (sbufGetBufLength(buf) <= 0)
+        {
+            LOGE("Bgp4Server: message had no payload");
+            bufferpoolResuesBuffer(pool, buf);
+            goto disconnect;
+        }
 
-    self->up->upStream(self->up, c);
+        self->up->fnPayloadU(self->up, line, buf);
+    }
+    lineUnlock(line);
     return;
 
 disconnect:
-    bufferstreamDestroy(cstate->read_stream);
-    memoryFree(cstate);
-    CSTATE_DROP(c);
-    self->up->upStream(self->up, contextCreateFinFrom(c));
-    self->dw->downStream(self->dw, contextCreateFinFrom(c));
-    contextDestroy(c);
+    cleanup(self, line);
+    self->up->fnFinU(self->up, line);
+    self->dw->fnFinD(self->dw, line);
+    lineUnlock(line);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void upStreamFin(tunnel_t *self, line_t *line)
 {
+    cleanup(self, line);
+    self->up->fnFinU(self->up, line);
+}
 
-    if (c->payload != NULL)
-    {
-        uint8_t bgp_type = 2 + (fastRand() % kBgpTypes - 1);
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    uint8_t bgp_type = 2 + (fastRand() % kBgpTypes - 1);
 
-        sbufShiftLeft(c->payload, 1); // type
-        sbufWriteUnAlignedUI8(c->payload, bgp_type);
+    sbufShiftLeft(payload, 1); // type
+    sbufWriteUnAlignedUI8(payload, bgp_type);
 
-        uint16_t blen = (uint16_t) sbufGetBufLength(c->payload);
-        sbufShiftLeft(c->payload, 2); // length
-        sbufWriteUnAlignedUI16(c->payload, blen);
+    uint16_t blen = (uint16_t) sbufGetBufLength(payload);
+    sbufShiftLeft(payload, 2); // length
+    sbufWriteUnAlignedUI16(payload, blen);
 
-        sbufShiftLeft(c->payload, kMarkerLength);
-        memorySet(sbufGetMutablePtr(c->payload), kMarker, kMarkerLength);
-    }
-    else if (c->fin)
-    {
-        bgp4_client_con_state_t *cstate = CSTATE(c);
-        bufferstreamDestroy(cstate->read_stream);
-        memoryFree(cstate);
-        CSTATE_DROP(c);
-    }
+    sbufShiftLeft(payload, kMarkerLength);
+    memorySet(sbufGetMutablePtr(payload), kMarker, kMarkerLength);
 
-    self->dw->downStream(self->dw, c);
+    self->dw->fnPayloadD(self->dw, line, payload);
 }
 
-tunnel_t *newBgp4Server(node_instance_context_t *instance_info)
+static void downStreamFin(tunnel_t *self, line_t *line)
 {
+    cleanup(self, line);
+    self->dw->fnFinD(self->dw, line);
+}
 
-    bgp4_client_state_t *state = memoryAllocate(sizeof(bgp4_client_state_t));
-    memorySet(state, 0, sizeof(bgp4_client_state_t));
+tunnel_t *newBgp4Server(node_t *node)
+{
+    tunnel_t *t = tunnelCreate(node, sizeof(bgp4_server_state_t), sizeof(bgp4_server_lstate_t));
 
-    const cJSON *settings = instance_info->node_settings_json;
-    char        *buf      = NULL;
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnFinD     = &downStreamFin;
+
+    bgp4_server_state_t *state    = tunnelGetState(t);
+    const cJSON         *settings = node->node_settings_json;
+    char                *buf      = NULL;
     getStringFromJsonObjectOrDefault(&buf, settings, "password", "passwd");
     state->hpassword = calcHashBytes(buf, strlen(buf));
     memoryFree(buf);
@@ -199,11 +200,6 @@ tunnel_t *newBgp4Server(node_instance_context_t *instance_info)
     state->as_number = (uint16_t) fastRand();
     state->sim_ip    = (fastRand() * 3);
 
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-
     return t;
 }
 
@@ -1,22 +1,33 @@
 #include "halfduplex_server.h"
 
 #include "buffer_pool.h"
-#include "wmutex.h"
 #include "loggers/network_logger.h"
-#include "pipe_line.h"
+#include "pipe_tunnel.h"
 #include "shiftbuffer.h"
 #include "tunnel.h"
 #include "worker.h"
 
-#define i_type hmap_cons_t                            // NOLINT
-#define i_key  hash_t                                 // NOLINT
-#define i_val  struct halfduplex_server_con_state_s * // NOLINT
-#include "stc/hmap.h"
+/*
+    Pairing
+
+    The two halves of a connection carry the same hash, the first half to arrive waits for the other one in a
+    map. The maps are sharded per worker, a worker only touches its own shard and a waiting half always lives
+    in the shard of the worker that owns its line, so there are no locks.
+
+    When the second half lands on the same worker (which the listener can arrange with "worker-affinity":
+    "source-ip", both halves come from the same client address), the pair is found in the local shard and runs
+    on that worker without ever crossing threads.
+
+    Otherwise the halves meet through the home worker of their hash (hash % workers): a half that finds nothing
+    locally registers its worker at the directory of the home shard with a message, once the directory knows
+    both workers it tells the upload worker where the download half is, and the upload half is piped there.
+
+*/
 
 enum
 {
     kHmapCap      = 16 * 4,
-    kMaxBuffering = (65535 * 2)
+    kMaxBuffering = (65535 * 2) // a waiting upload half stops reading here until its pair arrives
 };
 
 enum connection_status
@@ -28,714 +39,649 @@ enum connection_status
     kCsDownloadDirect
 };
 
-typedef struct halfduplex_server_state_s
+enum halfduplex_server_msg_type
 {
-    wmutex_t upload_line_map_mutex;
-    hmap_cons_t    upload_line_map;
+    kMsgRegisterUpload,
+    kMsgRegisterDownload,
+    kMsgUnRegisterUpload,
+    kMsgUnRegisterDownload,
+    kMsgDownloadIsOn
+};
 
-    wmutex_t download_line_map_mutex;
-    hmap_cons_t    download_line_map;
+typedef struct halfduplex_server_dir_entry_s
+{
+    wid_t upload_tid;
+    wid_t download_tid;
+    bool  has_upload;
+    bool  has_download;
 
-} halfduplex_server_state_t;
+} halfduplex_server_dir_entry_t;
 
-typedef struct halfduplex_server_con_state_s
+#define i_type hmap_cons_t                            // NOLINT
+#define i_key  hash_t                                 // NOLINT
+#define i_val  struct halfduplex_server_lstate_s * // NOLINT
+#include "stc/hmap.h"
+
+#define i_type hmap_dir_t                    // NOLINT
+#define i_key  hash_t                        // NOLINT
+#define i_val  halfduplex_server_dir_entry_t // NOLINT
+#include "stc/hmap.h"
+
+typedef struct halfduplex_server_shard_s
+{
+    hmap_cons_t upload_line_map;   // halves waiting on this worker
+    hmap_cons_t download_line_map;
+    hmap_dir_t  directory;         // workers of the halves whose home is this worker but wait elsewhere
+
+} ATTR_ALIGNED_LINE_CACHE halfduplex_server_shard_t;
+
+typedef struct halfduplex_server_state_s
 {
+    halfduplex_server_shard_t *shards; // one per worker
+    void                      *shards_memptr;
 
-    sbuf_t        *buffering;
+} halfduplex_server_state_t;
+
+/*
+    the upload, download and main line of a pair all carry this state, each one knows the other two
+*/
+typedef struct halfduplex_server_lstate_s
+{
+    sbuf_t                *buffering;
     line_t                *upload_line;
     line_t                *download_line;
     line_t                *main_line;
     enum connection_status state;
+    bool                   registered;       // known to the directory of the home worker
+    bool                   buffering_paused; // the upload line was paused at kMaxBuffering
 
     hash_t hash;
-} halfduplex_server_con_state_t;
+} halfduplex_server_lstate_t;
 
-struct notify_argument_s
+typedef struct halfduplex_server_msg_s
 {
-    tunnel_t *self;
-    hash_t    hash;
-    uint8_t   tid;
-};
+    tunnel_t                       *self;
+    hash_t                          hash;
+    enum halfduplex_server_msg_type type;
+    wid_t                           tid;
 
-static void onMainLinePaused(void *_cstate)
-{
-    halfduplex_server_con_state_t *cstate = _cstate;
+} halfduplex_server_msg_t;
 
-    pauseLineDownSide(cstate->upload_line);
+static inline halfduplex_server_shard_t *getLocalShard(tunnel_t *self)
+{
+    halfduplex_server_state_t *state = tunnelGetState(self);
+    return &(state->shards[getWID()]);
 }
 
-static void onMainLineResumed(void *_cstate)
+static inline wid_t getHomeWorker(hash_t hash)
 {
-    halfduplex_server_con_state_t *cstate = _cstate;
-
-    resumeLineDownSide(cstate->upload_line);
-    resumeLineDownSide(cstate->download_line);
+    return (wid_t) (hash % getWorkersCount());
 }
 
-static void onDownloadLinePaused(void *_cstate)
+static void handleMessage(halfduplex_server_msg_t *msg);
+
+static void callHandleMessage(wevent_t *ev)
 {
-    halfduplex_server_con_state_t *cstate = _cstate;
-    pauseLineUpSide(cstate->main_line);
+    halfduplex_server_msg_t *msg = weventGetUserdata(ev);
+    handleMessage(msg);
+    memoryFree(msg);
 }
 
-static void onDownloadLineResumed(void *_cstate)
+// messages to the own worker are handled right away, the others are posted to the loop of that worker
+static void sendMessage(tunnel_t *self, wid_t to, enum halfduplex_server_msg_type type, hash_t hash, wid_t tid)
 {
-    halfduplex_server_con_state_t *cstate = _cstate;
-    resumeLineUpSide(cstate->main_line);
+    halfduplex_server_msg_t msg = {.self = self, .hash = hash, .type = type, .tid = tid};
+
+    if (to == getWID())
+    {
+        handleMessage(&msg);
+        return;
+    }
+
+    halfduplex_server_msg_t *evdata = memoryAllocate(sizeof(halfduplex_server_msg_t));
+    *evdata                         = msg;
+
+    wevent_t ev;
+    memorySet(&ev, 0, sizeof(ev));
+    ev.loop = getWorkerLoop(to);
+    ev.cb   = callHandleMessage;
+    weventSetUserData(&ev, evdata);
+    wloopPostEvent(getWorkerLoop(to), &ev);
 }
 
-static void onUploadDirectLinePaused(void *_cstate)
+static void registerAtHome(tunnel_t *self, halfduplex_server_lstate_t *ls, bool is_upload)
 {
-    halfduplex_server_con_state_t *cstate = _cstate;
-    pauseLineUpSide(cstate->main_line);
+    ls->registered = true;
+    sendMessage(self, getHomeWorker(ls->hash), is_upload ? kMsgRegisterUpload : kMsgRegisterDownload,
+                ls->hash, getWID());
 }
 
-static void onUploadDirectLineResumed(void *_cstate)
+static void unRegisterAtHome(tunnel_t *self, halfduplex_server_lstate_t *ls, bool is_upload)
 {
-    halfduplex_server_con_state_t *cstate = _cstate;
-    resumeLineUpSide(cstate->main_line);
+    if (! ls->registered)
+    {
+        return;
+    }
+    ls->registered = false;
+    sendMessage(self, getHomeWorker(ls->hash), is_upload ? kMsgUnRegisterUpload : kMsgUnRegisterDownload,
+                ls->hash, getWID());
 }
 
-static void upStream(tunnel_t *self, context_t *c);
-
-static void notifyDownloadLineIsReadyForBind(hash_t hash, tunnel_t *self, uint8_t this_tid)
+// runs on the worker of the waiting upload half, the download half waits on download_tid
+static void moveUploadLineTo(tunnel_t *self, hash_t hash, wid_t download_tid)
 {
-    halfduplex_server_state_t *state = TSTATE(self);
+    halfduplex_server_shard_t *shard = getLocalShard(self);
+
+    hmap_cons_t_iter f_iter = hmap_cons_t_find(&(shard->upload_line_map), hash);
+    if (f_iter.ref == hmap_cons_t_end(&(shard->upload_line_map)).ref)
+    {
+        // the connection just closed
+        return;
+    }
+
+    halfduplex_server_lstate_t *upload_ls = ((halfduplex_server_lstate_t *) ((*f_iter.ref).second));
+    hmap_cons_t_erase_at(&(shard->upload_line_map), f_iter);
+
+    line_t *upload_line = upload_ls->upload_line;
+    sbuf_t *buffering   = upload_ls->buffering;
+    bool    paused      = upload_ls->buffering_paused;
+    lineClearState(upload_ls, sizeof(halfduplex_server_lstate_t));
+
+    // reading resumes on the next loop iteration, by then the line is piped
+    if (paused)
+    {
+        self->dw->fnResumeD(self->dw, upload_line);
+    }
+
+    // the buffered data still starts with the hash, the pair is made again over there
+    pipeTo(self, upload_line, download_tid);
+
+    if (buffering)
+    {
+        pipeUpStreamPayload(self, upload_line, buffering);
+    }
+}
 
-    mutexLock(&(state->upload_line_map_mutex));
+// the directory of the home worker
+static void updateDirectory(halfduplex_server_msg_t *msg)
+{
+    halfduplex_server_shard_t *shard = getLocalShard(msg->self);
 
-    hmap_cons_t_iter f_iter = hmap_cons_t_find(&(state->upload_line_map), hash);
-    bool             found  = f_iter.ref != hmap_cons_t_end(&(state->upload_line_map)).ref;
+    hmap_dir_t_iter f_iter = hmap_dir_t_find(&(shard->directory), msg->hash);
+    bool            found  = f_iter.ref != hmap_dir_t_end(&(shard->directory)).ref;
 
-    if (found)
+    if (msg->type == kMsgUnRegisterUpload || msg->type == kMsgUnRegisterDownload)
     {
-        // upload pair is found
-        uint8_t tid_upload_line = (*f_iter.ref).second->upload_line->tid;
-        if (this_tid != tid_upload_line)
+        if (! found)
         {
-            mutexUnlock(&(state->upload_line_map_mutex));
             return;
         }
-        halfduplex_server_con_state_t *upload_line_cstate = ((halfduplex_server_con_state_t *) ((*f_iter.ref).second));
+        halfduplex_server_dir_entry_t *entry = &(f_iter.ref->second);
+        if (msg->type == kMsgUnRegisterUpload && entry->has_upload && entry->upload_tid == msg->tid)
+        {
+            entry->has_upload = false;
+        }
+        if (msg->type == kMsgUnRegisterDownload && entry->has_download && entry->download_tid == msg->tid)
+        {
+            entry->has_download = false;
+        }
+        if (! entry->has_upload && ! entry->has_download)
+        {
+            hmap_dir_t_erase_at(&(shard->directory), f_iter);
+        }
+        return;
+    }
 
-        hmap_cons_t_erase_at(&(state->upload_line_map), f_iter);
-        mutexUnlock(&(state->upload_line_map_mutex));
+    if (! found)
+    {
+        f_iter.ref = hmap_dir_t_insert(&(shard->directory), msg->hash, (halfduplex_server_dir_entry_t) {0}).ref;
+    }
+    halfduplex_server_dir_entry_t *entry = &(f_iter.ref->second);
 
-        mutexLock(&(state->download_line_map_mutex));
-        f_iter = hmap_cons_t_find(&(state->download_line_map), hash);
-        found  = f_iter.ref != hmap_cons_t_end(&(state->download_line_map)).ref;
+    if (msg->type == kMsgRegisterUpload)
+    {
+        entry->has_upload = true;
+        entry->upload_tid = msg->tid;
+    }
+    else
+    {
+        entry->has_download = true;
+        entry->download_tid = msg->tid;
+    }
+
+    if (entry->has_upload && entry->has_download)
+    {
+        wid_t upload_tid   = entry->upload_tid;
+        wid_t download_tid = entry->download_tid;
+        hmap_dir_t_erase(&(shard->directory), msg->hash);
 
-        if (found)
+        // halves on the same worker pair by themselves
+        if (upload_tid != download_tid)
         {
-            // downlod pair is found
-            uint8_t tid_download_line = (*f_iter.ref).second->download_line->tid;
-            mutexUnlock(&(state->download_line_map_mutex));
+            sendMessage(msg->self, upload_tid, kMsgDownloadIsOn, msg->hash, download_tid);
+        }
+    }
+}
+
+static void handleMessage(halfduplex_server_msg_t *msg)
+{
+    switch (msg->type)
+    {
+    case kMsgRegisterUpload:
+    case kMsgRegisterDownload:
+    case kMsgUnRegisterUpload:
+    case kMsgUnRegisterDownload:
+        updateDirectory(msg);
+        break;
+
+    case kMsgDownloadIsOn:
+        moveUploadLineTo(msg->self, msg->hash, msg->tid);
+        break;
 
-            // a very rare case is when this_tid == tid_download_line
+    default:
+        LOGF("HalfDuplexServer: Unexpected  [%s:%d]", __FILENAME__, __LINE__);
+        exit(1);
+        break;
+    }
+}
 
-            LSTATE_DROP(upload_line_cstate->upload_line);
+// the finished line is "from", the other two lines of the pair are closed here
+static void closePair(tunnel_t *self, halfduplex_server_lstate_t *ls, line_t *from)
+{
+    line_t *upload_line   = ls->upload_line;
+    line_t *download_line = ls->download_line;
+    line_t *main_line     = ls->main_line;
 
-            pipeTo(self, upload_line_cstate->upload_line, tid_download_line);
+    lineClearState(lineGetState(self, upload_line), sizeof(halfduplex_server_lstate_t));
+    lineClearState(lineGetState(self, download_line), sizeof(halfduplex_server_lstate_t));
+    lineClearState(lineGetState(self, main_line), sizeof(halfduplex_server_lstate_t));
 
-            if (upload_line_cstate->buffering)
-            {
-                context_t *bctx = contextCreate(upload_line_cstate->upload_line);
-                bctx->payload   = upload_line_cstate->buffering;
-                pipeUpStream(bctx);
-            }
-            memoryFree(upload_line_cstate);
-        }
-        else
-        {
-            mutexUnlock(&(state->download_line_map_mutex));
-
-            LSTATE_DROP(upload_line_cstate->upload_line);
-            if (isDownPiped(upload_line_cstate->upload_line))
-            {
-                pipeDownStream(contextCreateFin(upload_line_cstate->upload_line));
-            }
-            else
-            {
-                self->dw->downStream(self->dw, contextCreateFin(upload_line_cstate->upload_line));
-            }
-            memoryFree(upload_line_cstate);
-        }
+    if (from != main_line)
+    {
+        self->up->fnFinU(self->up, main_line);
     }
-    else
+    lineDestroy(main_line);
+
+    if (from != download_line)
     {
-        mutexUnlock(&(state->upload_line_map_mutex));
+        self->dw->fnFinD(self->dw, download_line);
+    }
+    if (from != upload_line)
+    {
+        self->dw->fnFinD(self->dw, upload_line);
+    }
+}
 
-        // the connection just closed
+// both halves are on this worker now, they share one line to the next tunnel, NULL if that line closed at once
+static line_t *pairHalves(tunnel_t *self, halfduplex_server_lstate_t *upload_ls,
+                          halfduplex_server_lstate_t *download_ls)
+{
+    line_t                     *main_line = newLine(tunnelchainGetLinePool(tunnelGetChain(self), getWID()));
+    halfduplex_server_lstate_t *main_ls   = lineGetState(self, main_line);
+
+    upload_ls->state           = kCsUploadDirect;
+    upload_ls->download_line   = download_ls->download_line;
+    upload_ls->main_line       = main_line;
+    download_ls->state         = kCsDownloadDirect;
+    download_ls->upload_line   = upload_ls->upload_line;
+    download_ls->main_line     = main_line;
+    *main_ls                   = (halfduplex_server_lstate_t) {.state         = kCsUnkown,
+                                                               .upload_line   = upload_ls->upload_line,
+                                                               .download_line = download_ls->download_line,
+                                                               .main_line     = main_line};
+
+    lineLock(main_line);
+    self->up->fnInitU(self->up, main_line);
+
+    if (! lineIsAlive(main_line))
+    {
+        lineUnlock(main_line);
+        return NULL;
     }
+    lineUnlock(main_line);
+    return main_line;
 }
 
-static void callNotifyDownloadLineIsReadyForBind(wevent_t *ev)
+static void onUploadHalf(tunnel_t *self, line_t *line, halfduplex_server_lstate_t *ls, sbuf_t *payload)
 {
-    struct notify_argument_s *args = weventGetUserdata(ev);
-    notifyDownloadLineIsReadyForBind(args->hash, args->self, args->tid);
-    memoryFree(args);
+    halfduplex_server_shard_t *shard = getLocalShard(self);
+    buffer_pool_t             *pool  = getWorkerBufferPool(getWID());
+
+    ls->upload_line         = line;
+    hmap_cons_t_iter f_iter = hmap_cons_t_find(&(shard->download_line_map), ls->hash);
+    bool             found  = f_iter.ref != hmap_cons_t_end(&(shard->download_line_map)).ref;
+
+    if (! found)
+    {
+        ls->state         = kCsUploadInTable;
+        bool push_succeed = hmap_cons_t_insert(&(shard->upload_line_map), ls->hash, ls).inserted;
+
+        if (! push_succeed)
+        {
+            LOGW("HalfDuplexServer: duplicate upload connection closed");
+            bufferpoolResuesBuffer(pool, payload);
+            lineClearState(ls, sizeof(halfduplex_server_lstate_t));
+            self->dw->fnFinD(self->dw, line);
+            return;
+        }
+
+        ls->buffering = payload;
+        // upload connection is waiting in the pool, the download half may be on another worker
+        registerAtHome(self, ls, true);
+        return;
+    }
+
+    // pair is found, a waiting half always lives on the worker of its line
+    halfduplex_server_lstate_t *download_ls = ((halfduplex_server_lstate_t *) ((*f_iter.ref).second));
+    hmap_cons_t_erase_at(&(shard->download_line_map), f_iter);
+    unRegisterAtHome(self, download_ls, false);
+
+    assert(download_ls->state == kCsDownloadInTable);
+
+    line_t *main_line = pairHalves(self, ls, download_ls);
+    if (main_line == NULL)
+    {
+        bufferpoolResuesBuffer(pool, payload);
+        return;
+    }
+
+    sbufShiftRight(payload, sizeof(uint64_t));
+    if (sbufGetBufLength(payload) > 0)
+    {
+        self->up->fnPayloadU(self->up, main_line, payload);
+        return;
+    }
+    bufferpoolResuesBuffer(pool, payload);
 }
 
-// todo (rename+format) names are not meaningful at all!
-static void upStream(tunnel_t *self, context_t *c)
+static void onDownloadHalf(tunnel_t *self, line_t *line, halfduplex_server_lstate_t *ls, sbuf_t *payload)
 {
-    if (isUpPiped(c->line))
+    halfduplex_server_shard_t *shard = getLocalShard(self);
+    buffer_pool_t             *pool  = getWorkerBufferPool(getWID());
+
+    // the download half carries nothing but the hash
+    bufferpoolResuesBuffer(pool, payload);
+    ls->download_line = line;
+
+    hmap_cons_t_iter f_iter = hmap_cons_t_find(&(shard->upload_line_map), ls->hash);
+    bool             found  = f_iter.ref != hmap_cons_t_end(&(shard->upload_line_map)).ref;
+
+    if (! found)
+    {
+        ls->state         = kCsDownloadInTable;
+        bool push_succeed = hmap_cons_t_insert(&(shard->download_line_map), ls->hash, ls).inserted;
+        if (! push_succeed)
+        {
+            LOGW("HalfDuplexServer: duplicate download connection closed");
+            lineClearState(ls, sizeof(halfduplex_server_lstate_t));
+            self->dw->fnFinD(self->dw, line);
+            return;
+        }
+        // the upload half may be on another worker, it will be piped here
+        registerAtHome(self, ls, false);
+        return;
+    }
+
+    // pair is found
+    halfduplex_server_lstate_t *upload_ls = ((halfduplex_server_lstate_t *) ((*f_iter.ref).second));
+    hmap_cons_t_erase_at(&(shard->upload_line_map), f_iter);
+    unRegisterAtHome(self, upload_ls, true);
+
+    assert(upload_ls->state == kCsUploadInTable);
+    assert(upload_ls->buffering);
+
+    sbuf_t *buffering = upload_ls->buffering;
+    bool    paused    = upload_ls->buffering_paused;
+
+    upload_ls->buffering        = NULL;
+    upload_ls->buffering_paused = false;
+
+    line_t *main_line = pairHalves(self, upload_ls, ls);
+    if (main_line == NULL)
+    {
+        bufferpoolResuesBuffer(pool, buffering);
+        return;
+    }
+
+    if (paused)
     {
-        pipeUpStream(c);
+        self->dw->fnResumeD(self->dw, ls->upload_line);
+    }
+
+    sbufShiftRight(buffering, sizeof(uint64_t));
+    if (sbufGetBufLength(buffering) > 0)
+    {
+        self->up->fnPayloadU(self->up, main_line, buffering);
         return;
     }
+    bufferpoolResuesBuffer(pool, buffering);
+}
+
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    halfduplex_server_lstate_t *ls = lineGetState(self, line);
+
+    *ls = (halfduplex_server_lstate_t) {.state = kCsUnkown};
 
-    halfduplex_server_state_t     *state  = TSTATE(self);
-    halfduplex_server_con_state_t *cstate = CSTATE(c);
-    if (c->payload != NULL)
+    // a piped upload line was established on its own worker already
+    if (! pipeIsPiped(self, line))
     {
-        assert(cstate != NULL);
+        self->dw->fnEstD(self->dw, line);
+    }
+}
 
-        sbuf_t *buf = c->payload;
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    halfduplex_server_lstate_t *ls   = lineGetState(self, line);
+    buffer_pool_t              *pool = getWorkerBufferPool(getWID());
+
+    switch (ls->state)
+    {
 
-        switch (cstate->state)
+    case kCsUnkown: {
+        if (ls->buffering)
         {
+            payload       = sbufAppendMerge(pool, ls->buffering, payload);
+            ls->buffering = NULL;
+        }
 
-        case kCsUnkown: {
-
-            if (cstate->buffering)
-            {
-                c->payload        = sbufAppendMerge(contextGetBufferPool(c), c->payload, cstate->buffering);
-                cstate->buffering = NULL;
-            }
-
-            if (sbufGetBufLength(buf) < sizeof(uint64_t))
-            {
-                cstate->buffering = c->payload;
-                c->payload        = NULL;
-                contextDestroy(c);
-                return;
-            }
-            const bool is_upload                   = (((uint8_t *) sbufGetRawPtr(c->payload))[0] & 0x80) == 0x0;
-            ((uint8_t *) sbufGetMutablePtr(c->payload))[0] = (((uint8_t *) sbufGetRawPtr(c->payload))[0] & 0x7F);
-
-            hash_t hash = 0x0;
-            sbufReadUnAlignedUI64(c->payload, (uint64_t *) &hash);
-            cstate->hash = hash;
-
-            if (is_upload)
-            {
-                cstate->upload_line = c->line;
-                mutexLock(&(state->download_line_map_mutex));
-                hmap_cons_t_iter f_iter = hmap_cons_t_find(&(state->download_line_map), hash);
-                bool             found  = f_iter.ref != hmap_cons_t_end(&(state->download_line_map)).ref;
-
-                if (found)
-                {
-                    // pair is found
-                    uint8_t tid_download_line = (*f_iter.ref).second->download_line->tid;
-
-                    if (tid_download_line == getWID())
-                    {
-                        line_t *download_line =
-                            ((halfduplex_server_con_state_t *) ((*f_iter.ref).second))->download_line;
-                        cstate->download_line = download_line;
-
-                        halfduplex_server_con_state_t *download_line_cstate =
-                            ((halfduplex_server_con_state_t *) ((*f_iter.ref).second));
-
-                        hmap_cons_t_erase_at(&(state->download_line_map), f_iter);
-                        mutexUnlock(&(state->download_line_map_mutex));
-                        cstate->state = kCsUploadDirect;
-                        setupLineUpSide(c->line, onUploadDirectLinePaused, cstate, onUploadDirectLineResumed);
-
-                        assert(download_line_cstate->state == kCsDownloadInTable);
-
-                        download_line_cstate->state       = kCsDownloadDirect;
-                        download_line_cstate->upload_line = c->line;
-                        setupLineUpSide(download_line, onDownloadLinePaused, download_line_cstate,
-                                        onDownloadLineResumed);
-
-                        line_t *main_line               = newLine(tid_download_line);
-                        download_line_cstate->main_line = main_line;
-                        cstate->main_line               = main_line;
-                        setupLineDownSide(main_line, onMainLinePaused, download_line_cstate, onMainLineResumed);
-                        lineLock(main_line);
-                        self->up->upStream(self->up, contextCreateInit(main_line));
-
-                        if (! lineIsAlive(main_line))
-                        {
-                            lineUnlock(main_line);
-                            contextReusePayload(c);
-                            contextDestroy(c);
-                            return;
-                        }
-
-                        lineUnlock(main_line);
-                        sbufShiftRight(c->payload, sizeof(uint64_t));
-                        if (sbufGetBufLength(buf) > 0)
-                        {
-                            self->up->upStream(self->up, contextSwitchLine(c, main_line));
-                            return;
-                        }
-                        contextReusePayload(c);
-                    }
-                    else
-                    {
-                        mutexUnlock(&(state->download_line_map_mutex));
-
-                        CSTATE_DROP(c);
-                        memoryFree(cstate);
-
-                        pipeTo(self, c->line, tid_download_line);
-                        pipeUpStream(c);
-                        return; // piped to another worker which has waiting connections
-                    }
-                }
-                else
-                {
-                    mutexUnlock(&(state->download_line_map_mutex));
-                    cstate->state = kCsUploadInTable;
-
-                    mutexLock(&(state->upload_line_map_mutex));
-                    bool push_succeed = hmap_cons_t_insert(&(state->upload_line_map), hash, cstate).inserted;
-                    mutexUnlock(&(state->upload_line_map_mutex));
-
-                    if (! push_succeed)
-                    {
-                        LOGW("HalfDuplexServer: duplicate upload connection closed");
-                        CSTATE_DROP(c);
-                        contextReusePayload(c);
-                        memoryFree(cstate);
-                        if (isDownPiped(c->line))
-                        {
-                            pipeDownStream(contextCreateFinFrom(c));
-                        }
-                        else
-                        {
-                            self->dw->downStream(self->dw, contextCreateFinFrom(c));
-                        }
-                        contextDestroy(c);
-                        return;
-                    }
-
-                    cstate->buffering = buf;
-                    c->payload        = NULL;
-                    // upload connection is waiting in the pool
-                }
-            }
-            else
-            {
-                contextReusePayload(c);
-                cstate->download_line = c->line;
-
-                mutexLock(&(state->upload_line_map_mutex));
-                hmap_cons_t_iter f_iter = hmap_cons_t_find(&(state->upload_line_map), hash);
-                bool             found  = f_iter.ref != hmap_cons_t_end(&(state->upload_line_map)).ref;
-
-                if (found)
-                {
-                    // pair is found
-                    uint8_t tid_upload_line = (*f_iter.ref).second->upload_line->tid;
-
-                    if (tid_upload_line == getWID())
-                    {
-                        halfduplex_server_con_state_t *upload_line_cstate =
-                            ((halfduplex_server_con_state_t *) ((*f_iter.ref).second));
-                        hmap_cons_t_erase_at(&(state->upload_line_map), f_iter);
-                        mutexUnlock(&(state->upload_line_map_mutex));
-                        cstate->state       = kCsDownloadDirect;
-                        cstate->upload_line = upload_line_cstate->upload_line;
-                        setupLineUpSide(c->line, onDownloadLinePaused, cstate, onDownloadLineResumed);
-
-                        assert(upload_line_cstate->state == kCsUploadInTable);
-
-                        setupLineUpSide(upload_line_cstate->upload_line, onUploadDirectLinePaused, upload_line_cstate,
-                                        onUploadDirectLineResumed);
-                        upload_line_cstate->state         = kCsUploadDirect;
-                        upload_line_cstate->download_line = c->line;
-
-                        line_t *main_line             = newLine(tid_upload_line);
-                        upload_line_cstate->main_line = main_line;
-                        cstate->main_line             = main_line;
-                        setupLineDownSide(main_line, onMainLinePaused, cstate, onMainLineResumed);
-                        lineLock(main_line);
-                        self->up->upStream(self->up, contextCreateInit(main_line));
-
-                        if (! lineIsAlive(main_line))
-                        {
-                            lineUnlock(main_line);
-                            contextDestroy(c);
-                            return;
-                        }
-                        lineUnlock(main_line);
-
-                        assert(upload_line_cstate->buffering);
-
-                        if (sbufGetBufLength(upload_line_cstate->buffering) > 0)
-                        {
-                            context_t *buf_ctx            = contextCreate(main_line);
-                            buf_ctx->payload              = upload_line_cstate->buffering;
-                            upload_line_cstate->buffering = NULL;
-                            sbufShiftRight(buf_ctx->payload, sizeof(uint64_t));
-                            self->up->upStream(self->up, buf_ctx);
-                        }
-                        else
-                        {
-                            bufferpoolResuesBuffer(contextGetBufferPool(c), upload_line_cstate->buffering);
-                            upload_line_cstate->buffering = NULL;
-                        }
-                    }
-                    else
-                    {
-                        mutexUnlock(&(state->upload_line_map_mutex));
-
-                        cstate->state = kCsDownloadInTable;
-
-                        mutexLock(&(state->download_line_map_mutex));
-                        bool push_succeed = hmap_cons_t_insert(&(state->download_line_map), hash, cstate).inserted;
-                        mutexUnlock(&(state->download_line_map_mutex));
-                        if (! push_succeed)
-                        {
-                            LOGW("HalfDuplexServer: duplicate download connection closed");
-                            CSTATE_DROP(c);
-                            memoryFree(cstate);
-                            self->dw->downStream(self->dw, contextCreateFinFrom(c));
-                            contextDestroy(c);
-                            return;
-                        }
-
-                        // tell upload line to re-check
-                        struct notify_argument_s *evdata = memoryAllocate(sizeof(struct notify_argument_s));
-                        *evdata = (struct notify_argument_s) {.self = self, .hash = hash, .tid = tid_upload_line};
-
-                        wevent_t ev;
-                        memorySet(&ev, 0, sizeof(ev));
-                        ev.loop = getWorkerLoop(tid_upload_line);
-                        ev.cb   = callNotifyDownloadLineIsReadyForBind;
-                        weventSetUserData(&ev, evdata);
-                        wloopPostEvent(getWorkerLoop(tid_upload_line), &ev);
-                    }
-                }
-                else
-                {
-                    mutexUnlock(&(state->upload_line_map_mutex));
-                    cstate->state = kCsDownloadInTable;
-
-                    mutexLock(&(state->download_line_map_mutex));
-                    bool push_succeed = hmap_cons_t_insert(&(state->download_line_map), hash, cstate).inserted;
-                    mutexUnlock(&(state->download_line_map_mutex));
-                    if (! push_succeed)
-                    {
-                        LOGW("HalfDuplexServer: duplicate download connection closed");
-                        CSTATE_DROP(c);
-                        memoryFree(cstate);
-                        self->dw->downStream(self->dw, contextCreateFinFrom(c));
-                        contextDestroy(c);
-                        return;
-                    }
-                }
-            }
-            contextDestroy(c);
-
-            break;
+        if (sbufGetBufLength(payload) < sizeof(uint64_t))
+        {
+            ls->buffering = payload;
+            return;
         }
-        break;
+        const bool is_upload                        = (((uint8_t *) sbufGetRawPtr(payload))[0] & 0x80) == 0x0;
+        ((uint8_t *) sbufGetMutablePtr(payload))[0] = (((uint8_t *) sbufGetRawPtr(payload))[0] & 0x7F);
 
-        case kCsUploadInTable:
-            if (cstate->buffering)
-            {
-                cstate->buffering = sbufAppendMerge(contextGetBufferPool(c), cstate->buffering, c->payload);
-            }
-            else
-            {
-                cstate->buffering = c->payload;
-            }
-            contextDropPayload(c);
-            if (sbufGetBufLength(cstate->buffering) >= kMaxBuffering)
-            {
-                bufferpoolResuesBuffer(contextGetBufferPool(c), cstate->buffering);
-                cstate->buffering = NULL;
-            }
-            contextDestroy(c);
-            break;
-
-        case kCsUploadDirect:
-            self->up->upStream(self->up, contextSwitchLine(c, cstate->main_line));
-            break;
-
-        case kCsDownloadDirect:
-        case kCsDownloadInTable:
-            contextReusePayload(c);
-            contextDestroy(c);
-            break;
+        hash_t hash = 0x0;
+        sbufReadUnAlignedUI64(payload, (uint64_t *) &hash);
+        ls->hash = hash;
+
+        if (is_upload)
+        {
+            onUploadHalf(self, line, ls, payload);
         }
-    }
-    else
-    {
-        if (c->init)
+        else
         {
-            cstate  = memoryAllocate(sizeof(halfduplex_server_con_state_t));
-            *cstate = (halfduplex_server_con_state_t) {
-                .state = kCsUnkown, .buffering = NULL, .upload_line = NULL, .download_line = NULL};
-
-            CSTATE_MUT(c) = cstate;
-            if (isDownPiped(c->line))
-            {
-                // pipe dose not care
-            }
-            else
-            {
-                self->dw->downStream(self->dw, contextCreateEst(c->line));
-            }
-            contextDestroy(c);
+            onDownloadHalf(self, line, ls, payload);
         }
-        else if (c->fin)
+    }
+    break;
+
+    case kCsUploadInTable:
+        ls->buffering = sbufAppendMerge(pool, ls->buffering, payload);
+
+        if (! ls->buffering_paused && sbufGetBufLength(ls->buffering) >= kMaxBuffering)
         {
-            assert(cstate != NULL);
-
-            switch (cstate->state)
-            {
-
-            case kCsUnkown:
-                if (cstate->buffering)
-                {
-                    bufferpoolResuesBuffer(contextGetBufferPool(c), cstate->buffering);
-                }
-                CSTATE_DROP(c);
-                memoryFree(cstate);
-                contextDestroy(c);
-                break;
-
-            case kCsUploadInTable: {
-
-                mutexLock(&(state->upload_line_map_mutex));
-
-                hmap_cons_t_iter f_iter = hmap_cons_t_find(&(state->upload_line_map), cstate->hash);
-                bool             found  = f_iter.ref != hmap_cons_t_end(&(state->upload_line_map)).ref;
-                if (! found)
-                {
-                    LOGF("HalfDuplexServer: Thread safety is done incorrectly  [%s:%d]", __FILENAME__, __LINE__);
-                    exit(1);
-                }
-                hmap_cons_t_erase_at(&(state->upload_line_map), f_iter);
-
-                mutexUnlock(&(state->upload_line_map_mutex));
-                bufferpoolResuesBuffer(contextGetBufferPool(c), cstate->buffering);
-                CSTATE_DROP(c);
-                memoryFree(cstate);
-                contextDestroy(c);
-            }
-            break;
-
-            case kCsDownloadInTable: {
-                mutexLock(&(state->download_line_map_mutex));
-
-                hmap_cons_t_iter f_iter = hmap_cons_t_find(&(state->download_line_map), cstate->hash);
-                bool             found  = f_iter.ref != hmap_cons_t_end(&(state->download_line_map)).ref;
-                if (! found)
-                {
-                    LOGF("HalfDuplexServer: Thread safety is done incorrectly  [%s:%d]", __FILENAME__, __LINE__);
-                    exit(1);
-                }
-                hmap_cons_t_erase_at(&(state->download_line_map), f_iter);
-
-                mutexUnlock(&(state->download_line_map_mutex));
-                CSTATE_DROP(c);
-                memoryFree(cstate);
-                contextDestroy(c);
-            }
-            break;
-
-            case kCsDownloadDirect: {
-                doneLineUpSide(c->line);
-
-                halfduplex_server_con_state_t *cstate_download = cstate;
-                LSTATE_DROP(cstate_download->download_line);
-                cstate_download->download_line = NULL;
-
-                if (cstate_download->main_line)
-                {
-                    doneLineDownSide(cstate_download->main_line);
-                    self->up->upStream(self->up, contextCreateFin(cstate_download->main_line));
-                    lineDestroy(cstate_download->main_line);
-                    cstate_download->main_line = NULL;
-                }
-
-                if (cstate_download->upload_line)
-                {
-                    doneLineUpSide(cstate_download->upload_line);
-
-                    halfduplex_server_con_state_t *cstate_upload = LSTATE(cstate_download->upload_line);
-                    LSTATE_DROP(cstate_download->upload_line);
-                    cstate_upload->main_line     = NULL;
-                    cstate_upload->download_line = NULL;
-                    cstate_upload->upload_line   = NULL;
-
-                    assert(cstate_upload->state == kCsUploadDirect);
-                    if (isDownPiped(cstate_download->upload_line))
-                    {
-                        pipeDownStream(contextCreateFin(cstate_download->upload_line));
-                    }
-                    else
-                    {
-                        self->dw->downStream(self->dw, contextCreateFin(cstate_download->upload_line));
-                    }
-                    cstate_download->upload_line = NULL;
-                    memoryFree(cstate_upload);
-                }
-
-                memoryFree(cstate_download);
-                contextDestroy(c);
-            }
-            break;
-
-            case kCsUploadDirect: {
-                doneLineUpSide(c->line);
-
-                halfduplex_server_con_state_t *cstate_upload = cstate;
-                LSTATE_DROP(cstate_upload->upload_line);
-                cstate_upload->upload_line = NULL;
-
-                if (cstate_upload->main_line)
-                {
-                    doneLineDownSide(cstate_upload->main_line);
-                    self->up->upStream(self->up, contextCreateFin(cstate_upload->main_line));
-                    lineDestroy(cstate_upload->main_line);
-                    cstate_upload->main_line = NULL;
-                }
-
-                if (cstate_upload->download_line)
-                {
-                    doneLineUpSide(cstate_upload->download_line);
-
-                    halfduplex_server_con_state_t *cstate_download = LSTATE(cstate_upload->download_line);
-                    LSTATE_MUT(cstate_upload->download_line)       = NULL;
-                    cstate_download->main_line                     = NULL;
-                    cstate_download->download_line                 = NULL;
-                    cstate_download->upload_line                   = NULL;
-
-                    self->dw->downStream(self->dw, contextCreateFin(cstate_upload->download_line));
-                    cstate_upload->download_line = NULL;
-                    memoryFree(cstate_download);
-                }
-
-                memoryFree(cstate_upload);
-                contextDestroy(c);
-            }
-            break;
-
-            default:
-                LOGF("HalfDuplexServer: Unexpected  [%s:%d]", __FILENAME__, __LINE__);
-                exit(1);
-                break;
-            }
+            // keep what was sent, just stop reading until the download half shows up
+            ls->buffering_paused = true;
+            self->dw->fnPauseD(self->dw, line);
         }
+        break;
+
+    case kCsUploadDirect:
+        self->up->fnPayloadU(self->up, ls->main_line, payload);
+        break;
+
+    case kCsDownloadDirect:
+    case kCsDownloadInTable:
+        bufferpoolResuesBuffer(pool, payload);
+        break;
     }
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void upStreamFin(tunnel_t *self, line_t *line)
 {
-    contextSwitchLine(c, ((halfduplex_server_con_state_t *) (c->line->dw_state))->download_line);
-    halfduplex_server_con_state_t *cstate = CSTATE(c);
-    if (c->payload != NULL)
+    halfduplex_server_lstate_t *ls   = lineGetState(self, line);
+    buffer_pool_t              *pool = getWorkerBufferPool(getWID());
+
+    switch (ls->state)
     {
-        switch (cstate->state)
+
+    case kCsUnkown:
+        if (ls->buffering)
         {
-        case kCsDownloadDirect:
-            self->dw->downStream(self->dw, c);
-            break;
-
-        case kCsUnkown:
-        case kCsUploadInTable:
-        case kCsDownloadInTable:
-        case kCsUploadDirect:
-        default:
-            LOGF("HalfDuplexServer: Unexpected  [%s:%d]", __FILENAME__, __LINE__);
+            bufferpoolResuesBuffer(pool, ls->buffering);
+        }
+        lineClearState(ls, sizeof(halfduplex_server_lstate_t));
+        break;
+
+    case kCsUploadInTable: {
+        halfduplex_server_shard_t *shard = getLocalShard(self);
+
+        hmap_cons_t_iter f_iter = hmap_cons_t_find(&(shard->upload_line_map), ls->hash);
+        bool             found  = f_iter.ref != hmap_cons_t_end(&(shard->upload_line_map)).ref;
+        if (! found)
+        {
+            LOGF("HalfDuplexServer: Thread safety is done incorrectly  [%s:%d]", __FILENAME__, __LINE__);
             exit(1);
-            break;
         }
-    }
-    else
-    {
-        if (c->fin)
+        hmap_cons_t_erase_at(&(shard->upload_line_map), f_iter);
+        unRegisterAtHome(self, ls, true);
+
+        if (ls->buffering)
         {
-            switch (cstate->state)
-            {
-            case kCsDownloadDirect:
-                assert(cstate->upload_line);
-
-                doneLineUpSide(cstate->upload_line);
-                doneLineUpSide(cstate->download_line);
-                doneLineDownSide(cstate->main_line);
-                lineDestroy(cstate->main_line);
-
-                halfduplex_server_con_state_t *upload_line_cstate = LSTATE(cstate->upload_line);
-                upload_line_cstate->download_line                 = NULL;
-                upload_line_cstate->main_line                     = NULL;
-
-                LSTATE_MUT(cstate->download_line) = NULL;
-                cstate->download_line             = NULL;
-                cstate->main_line                 = NULL;
-
-                self->dw->downStream(self->dw, contextCreateFin(c->line));
-
-                upload_line_cstate = cstate->upload_line == NULL ? NULL : LSTATE(cstate->upload_line);
-                if (upload_line_cstate)
-                {
-                    line_t *upload_line             = cstate->upload_line;
-                    LSTATE_MUT(cstate->upload_line) = NULL;
-                    upload_line_cstate->upload_line = NULL;
-                    cstate->upload_line             = NULL;
-
-                    assert(upload_line_cstate->state == kCsUploadDirect);
-
-                    if (isDownPiped(upload_line))
-                    {
-                        pipeDownStream(contextCreateFin(upload_line));
-                    }
-                    else
-                    {
-                        self->dw->downStream(self->dw, contextCreateFin(upload_line));
-                    }
-                    memoryFree(upload_line_cstate);
-                }
-
-                memoryFree(cstate);
-                contextDestroy(c);
-
-                break;
-
-            case kCsUnkown:
-            case kCsUploadInTable:
-            case kCsDownloadInTable:
-            case kCsUploadDirect:
-            default:
-                LOGF("HalfDuplexServer: Unexpected  [%s:%d]", __FILENAME__, __LINE__);
-                exit(1);
-                break;
-            }
+            bufferpoolResuesBuffer(pool, ls->buffering);
         }
-        else if (c->est)
+        lineClearState(ls, sizeof(halfduplex_server_lstate_t));
+    }
+    break;
+
+    case kCsDownloadInTable: {
+        halfduplex_server_shard_t *shard = getLocalShard(self);
+
+        hmap_cons_t_iter f_iter = hmap_cons_t_find(&(shard->download_line_map), ls->hash);
+        bool             found  = f_iter.ref != hmap_cons_t_end(&(shard->download_line_map)).ref;
+        if (! found)
         {
-            contextDestroy(c);
+            LOGF("HalfDuplexServer: Thread safety is done incorrectly  [%s:%d]", __FILENAME__, __LINE__);
+            exit(1);
         }
+        hmap_cons_t_erase_at(&(shard->download_line_map), f_iter);
+        unRegisterAtHome(self, ls, false);
+
+        lineClearState(ls, sizeof(halfduplex_server_lstate_t));
+    }
+    break;
+
+    case kCsDownloadDirect:
+    case kCsUploadDirect:
+        closePair(self, ls, line);
+        break;
+
+    default:
+        LOGF("HalfDuplexServer: Unexpected  [%s:%d]", __FILENAME__, __LINE__);
+        exit(1);
+        break;
     }
 }
 
-tunnel_t *newHalfDuplexServer(node_instance_context_t *instance_info)
+// the client side of a half can not take more data, stop reading the main line
+static void upStreamPause(tunnel_t *self, line_t *line)
 {
-    (void) instance_info;
+    halfduplex_server_lstate_t *ls = lineGetState(self, line);
 
-    halfduplex_server_state_t *state = memoryAllocate(sizeof(halfduplex_server_state_t));
-    memorySet(state, 0, sizeof(halfduplex_server_state_t));
+    if (ls->state == kCsUploadDirect || ls->state == kCsDownloadDirect)
+    {
+        self->up->fnPauseU(self->up, ls->main_line);
+    }
+}
+
+static void upStreamResume(tunnel_t *self, line_t *line)
+{
+    halfduplex_server_lstate_t *ls = lineGetState(self, line);
+
+    if (ls->state == kCsUploadDirect || ls->state == kCsDownloadDirect)
+    {
+        self->up->fnResumeU(self->up, ls->main_line);
+    }
+}
+
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    halfduplex_server_lstate_t *main_ls = lineGetState(self, line);
+    self->dw->fnPayloadD(self->dw, main_ls->download_line, payload);
+}
+
+static void downStreamEst(tunnel_t *self, line_t *line)
+{
+    (void) self;
+    (void) line;
+}
+
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    closePair(self, lineGetState(self, line), line);
+}
+
+// the main line can not take more data, stop reading the upload half
+static void downStreamPause(tunnel_t *self, line_t *line)
+{
+    halfduplex_server_lstate_t *main_ls = lineGetState(self, line);
+    self->dw->fnPauseD(self->dw, main_ls->upload_line);
+}
 
-    mutexInit(&state->upload_line_map_mutex);
-    mutexInit(&state->download_line_map_mutex);
-    state->download_line_map = hmap_cons_t_with_capacity(kHmapCap);
-    state->upload_line_map   = hmap_cons_t_with_capacity(kHmapCap);
+static void downStreamResume(tunnel_t *self, line_t *line)
+{
+    halfduplex_server_lstate_t *main_ls = lineGetState(self, line);
+    self->dw->fnResumeD(self->dw, main_ls->upload_line);
+    self->dw->fnResumeD(self->dw, main_ls->download_line);
+}
+
+tunnel_t *newHalfDuplexServer(node_t *node)
+{
+    tunnel_t *t = tunnelCreate(node, sizeof(halfduplex_server_state_t), sizeof(halfduplex_server_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPauseU   = &upStreamPause;
+    t->fnResumeU  = &upStreamResume;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnEstD     = &downStreamEst;
+    t->fnFinD     = &downStreamFin;
+    t->fnPauseD   = &downStreamPause;
+    t->fnResumeD  = &downStreamResume;
+
+    halfduplex_server_state_t *state = tunnelGetState(t);
+
+    // every worker writes its own shard, they are kept on separate cache lines
+    const size_t shards_size = sizeof(halfduplex_server_shard_t) * getWorkersCount();
+    state->shards_memptr     = memoryAllocate(shards_size + kCpuLineCacheSize);
+    state->shards = (halfduplex_server_shard_t *) ALIGN2((uintptr_t) state->shards_memptr, kCpuLineCacheSize);
+
+    for (wid_t wi = 0; wi < getWorkersCount(); wi++)
+    {
+        state->shards[wi] = (halfduplex_server_shard_t) {.upload_line_map   = hmap_cons_t_with_capacity(kHmapCap),
+                                                         .download_line_map = hmap_cons_t_with_capacity(kHmapCap),
+                                                         .directory         = hmap_dir_t_with_capacity(kHmapCap)};
+    }
 
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
+    // upload halves move to the worker of their download half, the pipe tunnel in front of us carries them
+    tunnel_t *pt = pipetunnelCreate(t);
+    tunnelDestroy(t);
 
-    return t;
+    return pt;
 }
 
 api_result_t apiHalfDuplexServer(tunnel_t *self, const char *msg)
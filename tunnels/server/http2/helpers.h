@@ -5,6 +5,49 @@
 
 #define kMaxConcurrentStreams 0xffffffffU // NOLINT
 
+enum
+{
+    kMaxGrpcMessageLength = (1 << 24)
+};
+
+// Length-Prefixed-Message: 1 byte compressed flag, 4 byte big endian length
+static const frame_format_t kGrpcFrameFormat = {
+    .max_length = kMaxGrpcMessageLength, .length_offset = 1, .length_size = 4, .big_endian = true};
+
+/*
+    Receive windows follow the bandwidth delay product (see bdp_window.h): while DATA arrives one PING per round
+    trip goes out with the next write, the bytes that arrived until its ACK are the sample. When the window grows or
+    shrinks the connection window is set to it and a SETTINGS frame moves the initial window of the streams.
+*/
+// 8 bytes of opaque data tell our probes apart from the keepalive pings (zeros)
+#define kBdpPingOpaque ((const uint8_t *) "wwbdpprb") // NOLINT
+
+static void bdpOnDataReceived(http2_server_con_state_t *con, size_t len)
+{
+    const uint64_t now_us = wloopNowUS(getWorkerLoop(getWID()));
+
+    bdpwindowOnAcked(&con->recv_window, len, now_us);
+    if (! con->recv_window.probing)
+    {
+        nghttp2_submit_ping(con->session, NGHTTP2_FLAG_NONE, kBdpPingOpaque);
+        bdpwindowProbeStart(&con->recv_window, now_us);
+    }
+}
+
+static void bdpOnPingAck(http2_server_con_state_t *con, const nghttp2_ping *ping)
+{
+    if (memoryCompare(ping->opaque_data, kBdpPingOpaque, sizeof(ping->opaque_data)) != 0 ||
+        ! bdpwindowProbeEnd(&con->recv_window, wloopNowUS(getWorkerLoop(getWID()))))
+    {
+        return;
+    }
+    const uint32_t window = bdpwindowGet(&con->recv_window);
+
+    nghttp2_session_set_local_window_size(con->session, NGHTTP2_FLAG_NONE, 0, (int32_t) window);
+    nghttp2_settings_entry settings[] = {{NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, window}};
+    nghttp2_submit_settings(con->session, NGHTTP2_FLAG_NONE, settings, ARRAY_SIZE(settings));
+}
+
 static nghttp2_nv makeNV(const char *name, const char *value)
 {
     nghttp2_nv nv;
@@ -43,100 +86,65 @@ static void removeStream(http2_server_con_state_t *con, http2_server_child_con_s
     }
 }
 
-static void onStreamLinePaused(void *arg)
-{
-    http2_server_child_con_state_t *stream = (http2_server_child_con_state_t *) arg;
-    pauseLineDownSide(stream->parent);
-}
-static void onStreamLineResumed(void *arg)
+static http2_server_child_con_state_t *createHttp2Stream(http2_server_con_state_t *con, tunnel_t *self,
+                                                         int32_t stream_id)
 {
-    http2_server_child_con_state_t *stream = (http2_server_child_con_state_t *) arg;
-    resumeLineDownSide(stream->parent);
-}
+    line_t                         *child_line = newLine(tunnelchainGetLinePool(tunnelGetChain(self), getWID()));
+    http2_server_child_con_state_t *stream     = lineGetState(self, child_line);
 
-static void onH2LinePaused(void *arg)
-{
-    http2_server_con_state_t       *con = (http2_server_con_state_t *) arg;
-    http2_server_child_con_state_t *stream_i;
-    for (stream_i = con->root.next; stream_i;)
-    {
-        pauseLineUpSide(stream_i->line);
-        stream_i = stream_i->next;
-    }
-}
-
-static void onH2LineResumed(void *arg)
-{
-    http2_server_con_state_t       *con = (http2_server_con_state_t *) arg;
-    http2_server_child_con_state_t *stream_i;
-    for (stream_i = con->root.next; stream_i;)
-    {
-        resumeLineUpSide(stream_i->line);
-        stream_i = stream_i->next;
-    }
-}
+    *stream = (http2_server_child_con_state_t) {.stream_id = stream_id,
 
-static http2_server_child_con_state_t *createHttp2Stream(http2_server_con_state_t *con, line_t *this_line,
-                                                         tunnel_t *self, int32_t stream_id)
-{
-    http2_server_child_con_state_t *stream = memoryAllocate(sizeof(http2_server_child_con_state_t));
-
-    *stream = (http2_server_child_con_state_t) {.stream_id          = stream_id,
-                                                .grpc_buffer_stream = NULL,
-
-                                                .parent = this_line,
-                                                .line   = newLine(this_line->tid),
+                                                .parent = con->line,
+                                                .line   = child_line,
                                                 .tunnel = self};
 
     if (con->content_type == kApplicationGrpc)
     {
-        stream->grpc_buffer_stream = bufferstreamCreate(getWorkerBufferPool(this_line));
+        framedecoderInit(&stream->grpc_decoder, getWorkerBufferPool(getWID()), kGrpcFrameFormat);
     }
 
-    LSTATE_MUT(stream->line) = stream;
     nghttp2_session_set_stream_user_data(con->session, stream_id, stream);
-    setupLineDownSide(stream->line, onStreamLinePaused, stream, onStreamLineResumed);
 
     return stream;
 }
+
+// clears the stream state, the caller sends the fin (if needed) and then destroys the line
 static void deleteHttp2Stream(http2_server_child_con_state_t *stream)
 {
-    LSTATE_I_DROP(stream->line, stream->tunnel->chain_index);
+    framedecoderDestroy(&stream->grpc_decoder);
 
-    if (stream->grpc_buffer_stream)
-    {
-        bufferstreamDestroy(stream->grpc_buffer_stream);
-    }
-
-    doneLineDownSide(stream->line);
-    lineDestroy(stream->line);
     if (stream->request_path)
     {
         memoryFree(stream->request_path);
     }
-    memoryFree(stream);
+    lineClearState(stream, sizeof(http2_server_child_con_state_t));
 }
 
 static http2_server_con_state_t *createHttp2Connection(tunnel_t *self, line_t *line)
 {
-    http2_server_state_t     *state = TSTATE(self);
-    http2_server_con_state_t *con   = memoryAllocate(sizeof(http2_server_con_state_t));
-    memorySet(con, 0, sizeof(http2_server_con_state_t));
+    http2_server_state_t     *state = tunnelGetState(self);
+    http2_server_con_state_t *con   = lineGetState(self, line);
+
     nghttp2_session_server_new2(&con->session, state->cbs, con, state->ngoptions);
     con->tunnel  = self;
     con->line    = line;
     con->actions = action_queue_t_with_capacity(16);
-    setupLineUpSide(line, onH2LinePaused, con, onH2LineResumed);
+    con->frames  = http2_frame_queue_t_with_capacity(16);
+    bdpwindowInit(&con->recv_window, &(state->window_budgets[getWID()]), state->min_window, state->max_window);
 
     nghttp2_settings_entry settings[] = {
         {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, kMaxConcurrentStreams},
         {NGHTTP2_SETTINGS_MAX_FRAME_SIZE, (1U << 18)},
-        {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, (1U << 18)},
+        {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, state->min_window},
 
     };
     nghttp2_submit_settings(con->session, NGHTTP2_FLAG_NONE, settings, ARRAY_SIZE(settings));
+    // the connection window is not part of the settings, without this it stays at 65535
+    nghttp2_session_set_local_window_size(con->session, NGHTTP2_FLAG_NONE, 0, (int32_t) state->min_window);
     return con;
 }
+
+// closes every stream upwards and clears the connection state, the main line itself is not touched
 static void deleteHttp2Connection(http2_server_con_state_t *con)
 {
     tunnel_t                       *self = con->tunnel;
@@ -144,11 +152,11 @@ static void deleteHttp2Connection(http2_server_con_state_t *con)
 
     for (stream_i = con->root.next; stream_i;)
     {
-        context_t                      *fin_ctx = contextCreateFin(stream_i->line);
-        tunnel_t                       *dest    = stream_i->tunnel->up;
-        http2_server_child_con_state_t *next    = stream_i->next;
+        http2_server_child_con_state_t *next       = stream_i->next;
+        line_t                         *child_line = stream_i->line;
         deleteHttp2Stream(stream_i);
-        dest->upStream(dest, fin_ctx);
+        self->up->fnFinU(self->up, child_line);
+        lineDestroy(child_line);
         stream_i = next;
     }
 
@@ -161,9 +169,10 @@ static void deleteHttp2Connection(http2_server_con_state_t *con)
         lineUnlock(k.ref->stream_line);
     }
     action_queue_t_drop(&con->actions);
+    http2datasourceDropFrames(&con->frames);
+    http2datasourceRemoveAll(&con->data_sources);
 
-    doneLineUpSide(con->line);
     nghttp2_session_del(con->session);
-    LSTATE_DROP(con->line);
-    memoryFree(con);
+    bdpwindowDestroy(&con->recv_window);
+    lineClearState(con, sizeof(http2_server_con_state_t));
 }
@@ -5,7 +5,14 @@
 #include "loggers/network_logger.h"
 #include "nghttp2/nghttp2.h"
 #include "types.h"
+#include "utils/json_helpers.h"
 
+enum
+{
+    kDefaultMinRecvWindow  = (1 << 18),
+    kDefaultMaxRecvWindow  = (1 << 25),
+    kDefaultWindowBudgetMB = 256 // per worker, shared by the connections of the node
+};
 
 static int onStreamClosedCallBack(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *userdata)
 {
@@ -17,11 +24,13 @@ static int onStreamClosedCallBack(nghttp2_session *session, int32_t stream_id, u
 
     // todo (optimize) nghttp2 is calling this callback even if we close the con ourselves
     // this should be omitted
-    
+
+    http2datasourceRemove(&con->data_sources, stream_id);
     if (! stream)
     {
         return 0;
     }
+    stream->data_source = NULL;
     lineLock(stream->line);
     action_queue_t_push(&con->actions,
                         (http2_action_t) {.action_id = kActionStreamFinish, .stream_line = stream->line, .buf = NULL});
@@ -96,7 +105,9 @@ static int onDataChunkRecvCallBack(nghttp2_session *session, uint8_t flags, int3
         return 0;
     }
 
-    sbuf_t *buf = bufferpoolGetLargeBuffer(getWorkerBufferPool(con->line));
+    bdpOnDataReceived(con, len);
+
+    sbuf_t *buf = bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID()));
     sbufSetLength(buf, len);
     sbufWrite(buf, data, len);
 
@@ -107,6 +118,16 @@ static int onDataChunkRecvCallBack(nghttp2_session *session, uint8_t flags, int3
     return 0;
 }
 
+static int onSendDataCallBack(nghttp2_session *session, nghttp2_frame *frame, const uint8_t *framehd, size_t length,
+                              nghttp2_data_source *source, void *userdata)
+{
+    (void) session;
+    (void) frame;
+    http2_server_con_state_t *con = (http2_server_con_state_t *) userdata;
+
+    return http2datasourceSendFrame(&con->frames, framehd, length, source);
+}
+
 static int onFrameRecvCallBack(nghttp2_session *session, const nghttp2_frame *frame, void *userdata)
 {
     (void) session;
@@ -127,6 +148,10 @@ static int onFrameRecvCallBack(nghttp2_session *session, const nghttp2_frame *fr
     case NGHTTP2_SETTINGS:
         break;
     case NGHTTP2_PING:
+        if ((frame->hd.flags & NGHTTP2_FLAG_ACK) == NGHTTP2_FLAG_ACK)
+        {
+            bdpOnPingAck(con, &frame->ping);
+        }
         break;
     case NGHTTP2_RST_STREAM:
     case NGHTTP2_WINDOW_UPDATE:
@@ -171,8 +196,7 @@ static int onFrameRecvCallBack(nghttp2_session *session, const nghttp2_frame *fr
 
             nghttp2_submit_headers(con->session, flags, frame->hd.stream_id, NULL, &nvs[0], nvlen, NULL);
 
-            http2_server_child_con_state_t *stream =
-                createHttp2Stream(con, con->line, con->tunnel, frame->hd.stream_id);
+            http2_server_child_con_state_t *stream = createHttp2Stream(con, con->tunnel, frame->hd.stream_id);
             addStream(con, stream);
 
             lineLock(stream->line);
@@ -184,15 +208,13 @@ static int onFrameRecvCallBack(nghttp2_session *session, const nghttp2_frame *fr
     return 0;
 }
 
-
-
+// queues the payload in the data source of the stream, nghttp2 frames it when flow control allows
 static void sendStreamResposnseData(http2_server_con_state_t *con, http2_server_child_con_state_t *stream,
                                     sbuf_t *buf)
 {
-    http2_flag flags = kHttP2FlagNone;
     if (UNLIKELY(! stream))
     {
-        bufferpoolResuesBuffer(getWorkerBufferPool(con->line), buf);
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), buf);
         return;
     }
 
@@ -201,41 +223,93 @@ static void sendStreamResposnseData(http2_server_con_state_t *con, http2_server_
         grpc_message_hd msghd;
         msghd.flags  = 0;
         msghd.length = sbufGetBufLength(buf);
-        flags        = kHttP2FlagNone;
         sbufShiftLeft(buf, GRPC_MESSAGE_HDLEN);
         grpcMessageHdPack(&msghd, sbufGetMutablePtr(buf));
     }
 
-    http2_frame_hd framehd;
-    framehd.length    = sbufGetBufLength(buf);
-    framehd.type      = kHttP2Data;
-    framehd.flags     = flags;
-    framehd.stream_id = stream->stream_id;
-    sbufShiftLeft(buf, HTTP2_FRAME_HDLEN);
-    http2FrameHdPack(&framehd, sbufGetMutablePtr(buf));
-    context_t *response_data = contextCreate(con->line);
-    response_data->payload   = buf;
-    con->tunnel->dw->downStream(con->tunnel->dw, response_data);
+    if (stream->data_source == NULL)
+    {
+        stream->data_source = http2datasourceSubmit(con->session, &con->data_sources, stream->stream_id, stream->line);
+        if (UNLIKELY(stream->data_source == NULL))
+        {
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), buf);
+            return;
+        }
+    }
+
+    if (http2datasourcePush(con->session, stream->data_source, buf))
+    {
+        // the peer does not take the data as fast (flow control), hold the writer until the queue drains
+        con->tunnel->up->fnPauseU(con->tunnel->up, stream->line);
+    }
 }
 
-static bool sendNgHttp2Data(tunnel_t *self, http2_server_con_state_t *con)
+// writes the DATA frames nghttp2 released during the last mem_send, returns false when the connection closed
+static bool flushDataFrames(tunnel_t *self, http2_server_con_state_t *con)
 {
     line_t *main_line = con->line;
-    char   *data      = NULL;
-    size_t  len       = nghttp2_session_mem_send(con->session, (const uint8_t **) &data);
+
+    while (http2_frame_queue_t_size(&con->frames) > 0)
+    {
+        const http2_out_frame_t frame = http2_frame_queue_t_pull_front(&con->frames);
+
+        self->dw->fnPayloadD(self->dw, main_line, frame.buf);
+        lineUnlock(frame.stream_line);
+        if (! lineIsAlive(main_line))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool sendNgHttp2Data(tunnel_t *self, http2_server_con_state_t *con)
+{
+    line_t  *main_line = con->line;
+    char    *data      = NULL;
+    ssize_t  len       = nghttp2_session_mem_send(con->session, (const uint8_t **) &data);
+    sbuf_t  *send_buf  = NULL;
+    bool     had_data  = http2_frame_queue_t_size(&con->frames) > 0;
 
     if (len > 0)
     {
-        sbuf_t *send_buf = sbufReserveSpace(bufferpoolGetLargeBuffer(getWorkerBufferPool(main_line)),len);
-        sbufSetLength(send_buf, len);
-        sbufWrite(send_buf, data, len);
-        context_t *response_data = contextCreate(main_line);
-        response_data->payload   = send_buf;
-        self->dw->downStream(self->dw, response_data);
+        send_buf = sbufReserveSpace(bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID())), (uint32_t) len);
+        sbufSetLength(send_buf, (uint32_t) len);
+        sbufWrite(send_buf, data, (uint32_t) len);
+    }
+
+    // the frames were released during this call before nghttp2 produced the bytes it returned
+    if (had_data && ! flushDataFrames(self, con))
+    {
+        if (send_buf)
+        {
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), send_buf);
+        }
         return true;
     }
 
-    return false;
+    if (send_buf)
+    {
+        self->dw->fnPayloadD(self->dw, main_line, send_buf);
+        if (! lineIsAlive(main_line))
+        {
+            return true;
+        }
+    }
+
+    if (had_data)
+    {
+        for (http2_data_source_t *s; (s = http2datasourcePopResumable(con->data_sources)) != NULL;)
+        {
+            self->up->fnResumeU(self->up, s->line);
+            if (! lineIsAlive(main_line))
+            {
+                return true;
+            }
+        }
+    }
+
+    return had_data || send_buf != NULL;
 }
 
 static void doHttp2Action(const http2_action_t action, http2_server_con_state_t *con)
@@ -246,12 +320,12 @@ static void doHttp2Action(const http2_action_t action, http2_server_con_state_t
     {
         if (action.buf)
         {
-            bufferpoolResuesBuffer(getWorkerBufferPool(action.stream_line), action.buf);
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), action.buf);
         }
         lineUnlock(action.stream_line);
         return;
     }
-    http2_server_child_con_state_t *stream = LSTATE(action.stream_line);
+    http2_server_child_con_state_t *stream = lineGetState(self, action.stream_line);
 
     assert(stream); // when the line is alive, there is no way that we lose the state
 
@@ -260,7 +334,7 @@ static void doHttp2Action(const http2_action_t action, http2_server_con_state_t
 
     case kActionStreamInit: {
 
-        stream->tunnel->up->upStream(stream->tunnel->up, contextCreateInit(stream->line));
+        self->up->fnInitU(self->up, stream->line);
     }
 
     break;
@@ -268,46 +342,43 @@ static void doHttp2Action(const http2_action_t action, http2_server_con_state_t
     case kActionStreamDataReceived: {
         if (con->content_type == kApplicationGrpc)
         {
-            bufferstreamPush(stream->grpc_buffer_stream, action.buf);
+            framedecoderPush(&stream->grpc_decoder, action.buf);
 
             while (true)
             {
-                if (stream->grpc_bytes_needed == 0 && bufferstreamLen(stream->grpc_buffer_stream) >= GRPC_MESSAGE_HDLEN)
+                sbuf_t                *gdata_buf = NULL;
+                frame_decoder_result_t result    = framedecoderNextBuffer(&stream->grpc_decoder, &gdata_buf);
+                if (result == kFrameDecoderNeedMore)
+                {
+                    break;
+                }
+                if (UNLIKELY(result == kFrameDecoderInvalid))
                 {
-                    sbuf_t *gheader_buf = bufferstreamReadExact(stream->grpc_buffer_stream, GRPC_MESSAGE_HDLEN);
-                    grpc_message_hd msghd;
-                    grpcMessageHdUnpack(&msghd, sbufGetRawPtr(gheader_buf));
-                    stream->grpc_bytes_needed = msghd.length;
-                    bufferpoolResuesBuffer(getWorkerBufferPool(con->line), gheader_buf);
+                    LOGE("Http2Server: grpc message too large");
+                    nghttp2_submit_rst_stream(con->session, NGHTTP2_FLAG_NONE, stream->stream_id,
+                                              NGHTTP2_PROTOCOL_ERROR);
+                    break;
                 }
-                if (stream->grpc_bytes_needed > 0 &&
-                    bufferstreamLen(stream->grpc_buffer_stream) >= stream->grpc_bytes_needed)
+                sbufShiftRight(gdata_buf, framedecoderGetHeaderLength(&stream->grpc_decoder));
+                if (sbufGetBufLength(gdata_buf) == 0)
                 {
-                    sbuf_t *gdata_buf = bufferstreamReadExact(stream->grpc_buffer_stream, stream->grpc_bytes_needed);
-                    stream->grpc_bytes_needed = 0;
-
-                    context_t *stream_data = contextCreate(stream->line);
-                    stream_data->payload   = gdata_buf;
-                    stream->tunnel->up->upStream(stream->tunnel->up, stream_data);
-
-                    // check http2 connection is alive
-                    if (! lineIsAlive(action.stream_line) || ! lineIsAlive(main_line))
-                    {
-                        lineUnlock(action.stream_line);
-                        return;
-                    }
+                    bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), gdata_buf);
                     continue;
                 }
-                break;
+
+                self->up->fnPayloadU(self->up, stream->line, gdata_buf);
+
+                // check http2 connection is alive
+                if (! lineIsAlive(action.stream_line) || ! lineIsAlive(main_line))
+                {
+                    lineUnlock(action.stream_line);
+                    return;
+                }
             }
         }
         else
         {
-            sbuf_t *buf         = action.buf;
-            context_t      *stream_data = contextCreate(stream->line);
-
-            stream_data->payload = buf;
-            stream->tunnel->up->upStream(stream->tunnel->up, stream_data);
+            self->up->fnPayloadU(self->up, stream->line, action.buf);
         }
 
         if (! lineIsAlive(action.stream_line) || ! lineIsAlive(main_line))
@@ -320,12 +391,12 @@ static void doHttp2Action(const http2_action_t action, http2_server_con_state_t
     break;
 
     case kActionStreamFinish: {
-        context_t *fc   = contextCreateFin(stream->line);
-        tunnel_t  *dest = stream->tunnel->up;
+        line_t *stream_line = stream->line;
         nghttp2_session_set_stream_user_data(con->session, stream->stream_id, NULL);
         removeStream(con, stream);
         deleteHttp2Stream(stream);
-        dest->upStream(dest, fc);
+        self->up->fnFinU(self->up, stream_line);
+        lineDestroy(stream_line);
     }
     break;
 
@@ -339,184 +410,218 @@ static void doHttp2Action(const http2_action_t action, http2_server_con_state_t
     lineUnlock(action.stream_line);
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    if (c->payload != NULL)
-    {
-        http2_server_con_state_t *con = CSTATE(c);
-        size_t                    len = 0;
+    http2_server_con_state_t *con  = lineGetState(self, line);
+    buffer_pool_t            *pool = getWorkerBufferPool(getWID());
+    size_t                    len  = 0;
 
-        while ((len = sbufGetBufLength(c->payload)) > 0)
-        {
-            size_t  consumed = min(1 << 15UL, (ssize_t) len);
-            ssize_t ret      = nghttp2_session_mem_recv2(con->session, (const uint8_t *) sbufGetRawPtr(c->payload), consumed);
-            sbufShiftRight(c->payload, consumed);
+    lineLock(line);
 
-            if (ret != (ssize_t) consumed)
-            {
-                // assert(false);
-                deleteHttp2Connection(con);
-                self->dw->downStream(self->dw, contextCreateFin(c->line));
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
-            }
+    while ((len = sbufGetBufLength(payload)) > 0)
+    {
+        size_t  consumed = min(1 << 15UL, (ssize_t) len);
+        ssize_t ret      = nghttp2_session_mem_recv2(con->session, (const uint8_t *) sbufGetRawPtr(payload), consumed);
+        sbufShiftRight(payload, consumed);
 
-            while (sendNgHttp2Data(self, con))
-            {
-                if (! lineIsAlive(c->line))
-                {
-                    contextReusePayload(c);
-                    contextDestroy(c);
-                    return;
-                }
-            }
+        if (ret != (ssize_t) consumed)
+        {
+            // assert(false);
+            deleteHttp2Connection(con);
+            self->dw->fnFinD(self->dw, line);
+            break;
+        }
 
-            while (action_queue_t_size(&con->actions) > 0)
+        while (sendNgHttp2Data(self, con))
+        {
+            if (! lineIsAlive(line))
             {
-                const http2_action_t action = action_queue_t_pull_front(&con->actions);
-                doHttp2Action(action, con);
-                if (! lineIsAlive(c->line))
-                {
-                    contextReusePayload(c);
-                    contextDestroy(c);
-                    return;
-                }
+                goto done;
             }
+        }
 
-            while (sendNgHttp2Data(self, con))
+        while (action_queue_t_size(&con->actions) > 0)
+        {
+            const http2_action_t action = action_queue_t_pull_front(&con->actions);
+            doHttp2Action(action, con);
+            if (! lineIsAlive(line))
             {
-                if (! lineIsAlive(c->line))
-                {
-                    contextReusePayload(c);
-                    contextDestroy(c);
-                    return;
-                }
+                goto done;
             }
+        }
 
-            if (nghttp2_session_want_read(con->session) == 0 && nghttp2_session_want_write(con->session) == 0)
+        while (sendNgHttp2Data(self, con))
+        {
+            if (! lineIsAlive(line))
             {
-                context_t *fin_ctx = contextCreateFin(con->line);
-                deleteHttp2Connection(con);
-                self->dw->downStream(self->dw, fin_ctx);
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
+                goto done;
             }
         }
 
-        contextReusePayload(c);
-        contextDestroy(c);
+        if (nghttp2_session_want_read(con->session) == 0 && nghttp2_session_want_write(con->session) == 0)
+        {
+            deleteHttp2Connection(con);
+            self->dw->fnFinD(self->dw, line);
+            break;
+        }
     }
-    else
+
+done:
+    bufferpoolResuesBuffer(pool, payload);
+    lineUnlock(line);
+}
+
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    createHttp2Connection(self, line);
+    self->dw->fnEstD(self->dw, line);
+}
+
+static void upStreamFin(tunnel_t *self, line_t *line)
+{
+    deleteHttp2Connection(lineGetState(self, line));
+}
+
+// the main line can not be written, pause all streams
+static void upStreamPause(tunnel_t *self, line_t *line)
+{
+    http2_server_con_state_t *con = lineGetState(self, line);
+
+    for (http2_server_child_con_state_t *stream_i = con->root.next; stream_i; stream_i = stream_i->next)
     {
-        if (c->init)
-        {
-            CSTATE_MUT(c) = createHttp2Connection(self, c->line);
-            self->dw->downStream(self->dw, contextCreateEst(c->line));
+        self->up->fnPauseU(self->up, stream_i->line);
+    }
+}
 
-            contextDestroy(c);
-        }
-        else if (c->fin)
-        {
-            deleteHttp2Connection(CSTATE(c));
-            contextDestroy(c);
-        }
+static void upStreamResume(tunnel_t *self, line_t *line)
+{
+    http2_server_con_state_t *con = lineGetState(self, line);
+
+    for (http2_server_child_con_state_t *stream_i = con->root.next; stream_i; stream_i = stream_i->next)
+    {
+        self->up->fnResumeU(self->up, stream_i->line);
     }
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    http2_server_child_con_state_t *stream = CSTATE(c);
-    http2_server_con_state_t       *con    = LSTATE(stream->parent);
+    http2_server_child_con_state_t *stream = lineGetState(self, line);
+    http2_server_con_state_t       *con    = lineGetState(self, stream->parent);
+
+    sendStreamResposnseData(con, stream, payload);
 
-    if (c->payload != NULL)
+    lineLock(con->line);
+    while (sendNgHttp2Data(self, con))
     {
-        lineLock(con->line);
-        while (sendNgHttp2Data(self, con))
+        if (! lineIsAlive(con->line))
         {
-            if (! lineIsAlive(con->line))
-            {
-                lineUnlock(con->line);
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
-            }
+            break;
         }
-        lineUnlock(con->line);
+    }
+    lineUnlock(con->line);
+}
+
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    http2_server_child_con_state_t *stream = lineGetState(self, line);
+    http2_server_con_state_t       *con    = lineGetState(self, stream->parent);
 
-        sendStreamResposnseData(con, stream, c->payload);
-        contextDropPayload(c);
-        contextDestroy(c);
+    if (stream->data_source)
+    {
+        // the queued data goes first, the source ends the stream after it
+        http2datasourceEnd(con->session, stream->data_source, con->content_type == kApplicationGrpc);
+    }
+    else if (con->content_type == kApplicationGrpc)
+    {
+        nghttp2_nv nv = makeNV("grpc-status", "0");
+        nghttp2_submit_trailer(con->session, stream->stream_id, &nv, 1);
     }
     else
     {
-        if (c->fin)
-        {
-            if (con->content_type == kApplicationGrpc)
-            {
-                nghttp2_nv nv = makeNV("grpc-status", "0");
-                nghttp2_submit_trailer(con->session, stream->stream_id, &nv, 1);
-            }
-            else
-            {
-                nghttp2_submit_trailer(con->session, stream->stream_id, NULL, 0);
-            }
-
-            // LOGE("closing -> %d", stream->stream_id);
-            nghttp2_session_set_stream_user_data(con->session, stream->stream_id, NULL);
-            removeStream(con, stream);
-            deleteHttp2Stream(stream);
+        nghttp2_submit_trailer(con->session, stream->stream_id, NULL, 0);
+    }
 
-            lineLock(con->line);
-            while (sendNgHttp2Data(self, con))
-            {
-                if (! lineIsAlive(con->line))
-                {
-                    lineUnlock(con->line);
-                    contextDestroy(c);
-                    return;
-                }
-            }
-            lineUnlock(con->line);
+    // LOGE("closing -> %d", stream->stream_id);
+    nghttp2_session_set_stream_user_data(con->session, stream->stream_id, NULL);
+    removeStream(con, stream);
+    deleteHttp2Stream(stream);
+    lineDestroy(line);
 
-            if (nghttp2_session_want_read(con->session) == 0 && nghttp2_session_want_write(con->session) == 0)
-            {
-                context_t *fin_ctx = contextCreateFin(con->line);
-                deleteHttp2Connection(con);
-                self->dw->downStream(self->dw, fin_ctx);
-            }
-
-            contextDestroy(c);
-        }
-        else
+    lineLock(con->line);
+    while (sendNgHttp2Data(self, con))
+    {
+        if (! lineIsAlive(con->line))
         {
-            contextDestroy(c);
+            lineUnlock(con->line);
+            return;
         }
     }
+    lineUnlock(con->line);
+
+    if (nghttp2_session_want_read(con->session) == 0 && nghttp2_session_want_write(con->session) == 0)
+    {
+        line_t *main_line = con->line;
+        deleteHttp2Connection(con);
+        self->dw->fnFinD(self->dw, main_line);
+    }
 }
 
-tunnel_t *newHttp2Server(node_instance_context_t *instance_info)
+// a stream can not take more data, stop reading the http2 connection
+static void downStreamPause(tunnel_t *self, line_t *line)
 {
-    (void) instance_info;
-    http2_server_state_t *state = memoryAllocate(sizeof(http2_server_state_t));
-    memorySet(state, 0, sizeof(http2_server_state_t));
+    http2_server_child_con_state_t *stream = lineGetState(self, line);
+    self->dw->fnPauseD(self->dw, stream->parent);
+}
+
+static void downStreamResume(tunnel_t *self, line_t *line)
+{
+    http2_server_child_con_state_t *stream = lineGetState(self, line);
+    self->dw->fnResumeD(self->dw, stream->parent);
+}
+
+tunnel_t *newHttp2Server(node_t *node)
+{
+    tunnel_t *t = tunnelCreate(node, sizeof(http2_server_state_t) + getWorkersCount() * sizeof(bdp_budget_t),
+                               sizeof(http2_server_con_state_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPauseU   = &upStreamPause;
+    t->fnResumeU  = &upStreamResume;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnFinD     = &downStreamFin;
+    t->fnPauseD   = &downStreamPause;
+    t->fnResumeD  = &downStreamResume;
+
+    http2_server_state_t *state    = tunnelGetState(t);
+    const cJSON          *settings = node->node_settings_json;
 
     nghttp2_session_callbacks_new(&(state->cbs));
     nghttp2_session_callbacks_set_on_header_callback(state->cbs, onHeaderCallBack);
     nghttp2_session_callbacks_set_on_data_chunk_recv_callback(state->cbs, onDataChunkRecvCallBack);
     nghttp2_session_callbacks_set_on_frame_recv_callback(state->cbs, onFrameRecvCallBack);
     nghttp2_session_callbacks_set_on_stream_close_callback(state->cbs, onStreamClosedCallBack);
+    nghttp2_session_callbacks_set_send_data_callback(state->cbs, onSendDataCallBack);
 
     nghttp2_option_new(&(state->ngoptions));
     nghttp2_option_set_peer_max_concurrent_streams(state->ngoptions, kMaxConcurrentStreams);
     nghttp2_option_set_no_closed_streams(state->ngoptions, 1);
     nghttp2_option_set_no_http_messaging(state->ngoptions, 1);
 
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
+    int min_window = 0;
+    int max_window = 0;
+    int budget_mb  = 0;
+    getIntFromJsonObjectOrDefault(&min_window, settings, "min-window", kDefaultMinRecvWindow);
+    getIntFromJsonObjectOrDefault(&max_window, settings, "max-window", kDefaultMaxRecvWindow);
+    getIntFromJsonObjectOrDefault(&budget_mb, settings, "window-budget", kDefaultWindowBudgetMB);
+
+    state->min_window = (uint32_t) min(max(NGHTTP2_INITIAL_WINDOW_SIZE, min_window), NGHTTP2_MAX_WINDOW_SIZE);
+    state->max_window = (uint32_t) min(max((int) state->min_window, max_window), NGHTTP2_MAX_WINDOW_SIZE);
+    for (wid_t wid = 0; wid < getWorkersCount(); wid++)
+    {
+        state->window_budgets[wid].limit = (uint64_t) max(0, budget_mb) * 1024 * 1024;
+    }
 
     return t;
 }
@@ -537,5 +642,7 @@ tunnel_t *destroyHttp2Server(tunnel_t *self)
 
 tunnel_metadata_t getMetadataHttp2Server(void)
 {
-    return (tunnel_metadata_t) {.version = 0001, .flags = 0x0};
+    // DATA frame headers (and the gRPC prefix) are written in front of the payloads
+    return (tunnel_metadata_t) {
+        .version = 0001, .flags = 0x0, .required_padding_left = HTTP2_FRAME_HDLEN + GRPC_MESSAGE_HDLEN};
 }
@@ -1,12 +1,13 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
+#include "bdp_window.h"
 #include "buffer_stream.h"
+#include "frame_decoder.h"
+#include "http2_data_source.h"
 
 #include "http_def.h"
 #include "nghttp2/nghttp2.h"
 
-
-
 enum http2_actions
 {
     kActionInvalid,
@@ -21,23 +22,28 @@ typedef struct http2_action_s
 {
     enum http2_actions action_id;
     line_t            *stream_line;
-    sbuf_t    *buf;
+    sbuf_t            *buf;
 
 } http2_action_t;
 
 #define i_type action_queue_t
-#define i_key  http2_action_t 
+#define i_key  http2_action_t
 #include "stc/deque.h"
 
+/*
+    The http2 connection state lives in the line state of the main line and each stream state in the line state
+    of its own child line, both use the same slot; the connection embeds a stream (root) so it is always the
+    bigger one and sets the line state size
+*/
 typedef struct http2_server_child_con_state_s
 {
     struct http2_server_child_con_state_s *prev, *next;
     char                                  *request_path;
-    buffer_stream_t                       *grpc_buffer_stream;
     line_t                                *parent;
     line_t                                *line;
     tunnel_t                              *tunnel;
-    size_t                                 grpc_bytes_needed;
+    http2_data_source_t                   *data_source;  // NULL until the stream sends data
+    frame_decoder_t                        grpc_decoder; // only for grpc
     int32_t                                stream_id;
 
 } http2_server_child_con_state_t;
@@ -46,11 +52,13 @@ typedef struct http2_server_con_state_s
 {
     http2_server_child_con_state_t root;
     action_queue_t                 actions;
+    http2_frame_queue_t            frames; // DATA frames nghttp2 released during mem_send
+    http2_data_source_t           *data_sources;
     nghttp2_session               *session;
     tunnel_t                      *tunnel;
     line_t                        *line;
+    bdp_window_t                   recv_window; // per stream and connection receive window we advertise
     enum http_content_type         content_type;
-    uint32_t                       pause_counter;
     int                            error;
     int                            frame_type_when_stream_closed;
 
@@ -61,5 +69,8 @@ typedef struct http2_server_state_s
     nghttp2_session_callbacks *cbs;
     tunnel_t                  *fallback;
     nghttp2_option            *ngoptions;
+    uint32_t                   min_window;
+    uint32_t                   max_window;
+    bdp_budget_t               window_budgets[]; // [wid]
 
 } http2_server_state_t;
@@ -1,5 +1,5 @@
 #include "mux_server.h"
-#include "buffer_stream.h"
+#include "frame_decoder.h"
 #include "loggers/network_logger.h"
 #include "mux_frame.h"
 
@@ -9,388 +9,336 @@ typedef struct mux_server_state_s
 
 } mux_server_state_t;
 
-typedef struct mux_server_child_con_state_s
+/*
+    the main line (from the client) and the child lines (created here, one per stream) are both lines of this
+    chain, so they share the line state slot of this tunnel, is_child tells which half is in use
+*/
+typedef struct mux_server_lstate_s
 {
+    struct mux_server_lstate_s *next, *prev; // child: siblings
 
-    struct mux_server_child_con_state_s *next, *prev;
-    tunnel_t                            *tunnel;
-    line_t                              *line;
-    line_t                              *parent;
-    uint32_t                             sent_nack;
-    uint32_t                             recv_nack;
-    uint16_t                             cid;
-    bool                                 paused;
+    tunnel_t *tunnel;
+    line_t   *line;
 
-} mux_server_child_con_state_t;
+    // main line
+    struct mux_server_lstate_s *children;
+    line_t                     *current_writing_line;
+    frame_decoder_t             read_decoder;
+    uint16_t                    last_cid;
 
-typedef struct mux_server_con_state_s
-{
-    struct mux_server_child_con_state_s children_root;
-
-    tunnel_t        *tunnel;
-    line_t          *line;
-    line_t          *current_writing_line;
-    buffer_stream_t *read_stream;
-    uint16_t         last_cid;
-    uint16_t         cid_min;
-    uint16_t         cid_max;
-    uint16_t         contained;
+    // child line
+    line_t  *parent;
+    uint32_t sent_nack;
+    uint32_t recv_nack;
+    uint16_t cid;
+    bool     paused;
+    bool     is_child;
 
-} mux_server_con_state_t;
-
-static void onChildLinePaused(void *arg)
-{
-    mux_server_child_con_state_t *stream = (mux_server_child_con_state_t *) arg;
-    pauseLineDownSide(stream->parent);
-}
-static void onChildLineResumed(void *arg)
-{
-    mux_server_child_con_state_t *stream = (mux_server_child_con_state_t *) arg;
-    resumeLineDownSide(stream->parent);
-}
+} mux_server_lstate_t;
 
-static void onMainLinePaused(void *arg)
+static void destroyChildConnecton(mux_server_lstate_t *child)
 {
-    mux_server_con_state_t *con  = (mux_server_con_state_t *) arg;
-    tunnel_t               *self = con->tunnel;
-
-    line_t *wline = con->current_writing_line;
-    if (wline && lineIsAlive(wline))
+    if (child->prev)
     {
-        mux_server_child_con_state_t *child_con = LSTATE(wline);
-        child_con->paused                       = true;
-        pauseLineUpSide(child_con->line);
+        child->prev->next = child->next;
     }
-}
-
-static void onMainLineResumed(void *arg)
-{
-    mux_server_con_state_t       *con = (mux_server_con_state_t *) arg;
-    mux_server_child_con_state_t *child_con_i;
-    for (child_con_i = con->children_root.next; child_con_i;)
+    else
     {
-        if (child_con_i->paused)
-        {
-            child_con_i->paused = false;
-            resumeLineUpSide(child_con_i->line);
-        }
-        child_con_i = child_con_i->next;
+        mux_server_lstate_t *parent = lineGetState(child->tunnel, child->parent);
+        parent->children            = child->next;
     }
-}
-
-static void destroyChildConnecton(mux_server_child_con_state_t *child)
-{
-    tunnel_t *self    = child->tunnel;
-    child->prev->next = child->next;
     if (child->next)
     {
         child->next->prev = child->prev;
     }
-    else
-    {
-        mux_server_con_state_t *parent = LSTATE(child->parent);
-        parent->children_root.prev     = NULL;
-    }
-    doneLineDownSide(child->line);
-    LSTATE_DROP(child->line);
-    memoryFree(child);
+    lineClearState(child, sizeof(mux_server_lstate_t));
 }
 
-static mux_server_child_con_state_t *createChildConnection(mux_server_con_state_t *parent, wid_t tid)
+static mux_server_lstate_t *createChildConnection(mux_server_lstate_t *parent)
 {
-    mux_server_child_con_state_t *child = memoryAllocate(sizeof(mux_server_con_state_t));
-
-    *child = (mux_server_child_con_state_t) {.tunnel = parent->tunnel,
-                                             .line   = newLine(tid),
-                                             .cid    = parent->last_cid++,
-                                             .next   = parent->children_root.next,
-                                             .prev   = &(parent->children_root)
-
-    };
-
-    if (parent->children_root.next == NULL)
-    {
-        parent->children_root.prev = child;
-    }
-    parent->children_root.next = child;
+    tunnel_t            *self       = parent->tunnel;
+    line_t              *child_line = newLine(tunnelchainGetLinePool(tunnelGetChain(self), getWID()));
+    mux_server_lstate_t *child      = lineGetState(self, child_line);
+
+    *child = (mux_server_lstate_t) {.tunnel   = self,
+                                    .line     = child_line,
+                                    .parent   = parent->line,
+                                    .cid      = parent->last_cid++,
+                                    .is_child = true,
+                                    .next     = parent->children,
+                                    .prev     = NULL};
 
     if (child->next)
     {
         child->next->prev = child;
     }
-    setupLineDownSide(child->line, onChildLinePaused, child, onChildLineResumed);
+    parent->children = child;
 
     return child;
 }
 
-static void destroyMainConnecton(mux_server_con_state_t *con)
+// closes every stream, the caller sends the main line fin
+static void destroyMainConnecton(mux_server_lstate_t *con)
 {
     tunnel_t *self = con->tunnel;
 
-    mux_server_child_con_state_t *child_con_i;
-    for (child_con_i = con->children_root.next; child_con_i;)
+    while (con->children)
     {
-
-        mux_server_child_con_state_t *next    = child_con_i;
-        context_t                    *fin_ctx = contextCreateFin(child_con_i->line);
-        tunnel_t                     *dest    = con->tunnel->up;
-
-        destroyChildConnecton(child_con_i);
-        dest->upStream(dest, fin_ctx);
-        child_con_i = next;
+        line_t *child_line = con->children->line;
+        destroyChildConnecton(con->children);
+        self->up->fnFinU(self->up, child_line);
+        lineDestroy(child_line);
     }
-    bufferstreamDestroy(con->read_stream);
-    doneLineUpSide(con->line);
-    LSTATE_DROP(con->line);
-    memoryFree(con);
+    framedecoderDestroy(&con->read_decoder);
+    lineClearState(con, sizeof(mux_server_lstate_t));
 }
 
-static mux_server_con_state_t *createMainConnection(tunnel_t *self, line_t *main_line)
+static void closeMainConnection(tunnel_t *self, mux_server_lstate_t *con)
 {
-    mux_server_con_state_t *con = memoryAllocate(sizeof(mux_server_con_state_t));
+    line_t *main_line = con->line;
+    destroyMainConnecton(con);
+    self->dw->fnFinD(self->dw, main_line);
+}
 
-    *con = (mux_server_con_state_t) {.tunnel        = self,
-                                     .line          = main_line,
-                                     .children_root = {0},
-                                     .read_stream   = bufferstreamCreate(getWorkerBufferPool(main_line))};
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    mux_server_lstate_t *con = lineGetState(self, line);
 
-    setupLineDownSide(con->line, onMainLinePaused, con, onMainLineResumed);
+    *con = (mux_server_lstate_t) {.tunnel = self, .line = line};
+    framedecoderInit(&con->read_decoder, getWorkerBufferPool(getWID()), kMuxFrameFormat);
 
-    LSTATE_MUT(con->line) = con;
-    return con;
+    self->dw->fnEstD(self->dw, line);
+}
+
+static void upStreamFin(tunnel_t *self, line_t *line)
+{
+    destroyMainConnecton(lineGetState(self, line));
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+static mux_server_lstate_t *findChild(mux_server_lstate_t *con, cid_t cid)
 {
-    mux_server_con_state_t *main_con = CSTATE(c);
-    if (c->payload != NULL)
+    for (mux_server_lstate_t *child_i = con->children; child_i; child_i = child_i->next)
     {
-        bufferStreamPushContextPayload(main_con->read_stream, c);
-        while (bufferstreamLen(main_con->read_stream) > sizeof(mux_frame_t))
+        if (child_i->cid == cid)
         {
-            mux_length_t length;
-            bufferstreamViewBytesAt(main_con->read_stream, 0, (uint8_t *) &length, 2);
-            if (UNLIKELY(length < kMuxMinFrameLength))
-            {
-                LOGE("MuxServer: payload length < kMuxMinFrameLength");
-                destroyMainConnecton(main_con);
-                self->dw->downStream(self->dw, contextCreateFin(c->line));
+            return child_i;
+        }
+    }
+    return NULL;
+}
 
-                contextDestroy(c);
-                return;
-            }
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    mux_server_lstate_t *main_con = lineGetState(self, line);
+    buffer_pool_t       *pool     = getWorkerBufferPool(getWID());
+
+    framedecoderPush(&main_con->read_decoder, payload);
 
-            if (bufferstreamLen(main_con->read_stream) >= length + sizeof(length))
+    // a stream may close the main line while we are still parsing
+    lineLock(line);
+
+    while (lineIsAlive(line))
+    {
+        sbuf_t                *frame_payload = NULL;
+        frame_decoder_result_t result        = framedecoderNextBuffer(&main_con->read_decoder, &frame_payload);
+        if (result == kFrameDecoderNeedMore)
+        {
+            break;
+        }
+        if (UNLIKELY(result == kFrameDecoderInvalid))
+        {
+            LOGE("MuxServer: frame length out of range");
+            closeMainConnection(self, main_con);
+            break;
+        }
+
+        mux_frame_t frame;
+        memoryCopy(&frame, sbufGetRawPtr(frame_payload), sizeof(mux_frame_t));
+        sbufShiftRight(frame_payload, sizeof(mux_frame_t));
+
+        if (frame.flags == kMuxFlagOpen)
+        {
+            if (UNLIKELY(sbufGetBufLength(frame_payload) <= 0))
             {
-                sbuf_t *frame_payload = bufferstreamReadExact(main_con->read_stream, length + sizeof(length));
-
-                mux_frame_t frame;
-                memoryCopy(&frame, sbufGetRawPtr(frame_payload), sizeof(mux_frame_t));
-                sbufShiftRight(frame_payload, sizeof(mux_frame_t));
-
-                if (frame.flags == kMuxFlagOpen)
-                {
-                    if (UNLIKELY(sbufGetBufLength(frame_payload) <= 0))
-                    {
-                        LOGE("MuxServer: payload length <= 0");
-                        bufferpoolResuesBuffer(getWorkerBufferPool(main_con->line), frame_payload);
-                        destroyMainConnecton(main_con);
-                        self->dw->downStream(self->dw, contextCreateFin(c->line));
-                        contextDestroy(c);
-                        continue;
-                    }
-
-                    mux_server_child_con_state_t *child      = createChildConnection(main_con, getWID());
-                    line_t                       *child_line = child->line;
-                    lineLock(child_line);
-
-                    self->up->upStream(self->up, contextCreateInit(child->line));
-
-                    if (! lineIsAlive(child_line))
-                    {
-                        lineUnlock(child_line);
-                        bufferpoolResuesBuffer(getWorkerBufferPool(main_con->line), frame_payload);
-                        continue;
-                    }
-                    lineUnlock(child_line);
-
-                    context_t *data_ctx = contextCreate(child_line);
-                    data_ctx->payload   = frame_payload;
-                    self->up->upStream(self->up, data_ctx);
-
-                    if (! lineIsAlive(c->line))
-                    {
-                        contextDestroy(c);
-                        return;
-                    }
-                    continue;
-                }
-
-                mux_server_child_con_state_t *child_con_i;
-                for (child_con_i = main_con->children_root.next; child_con_i;)
-                {
-                    if (child_con_i->cid == frame.cid)
-                    {
-
-                        switch (frame.flags)
-                        {
-                        case kMuxFlagClose: {
-                            bufferpoolResuesBuffer(getWorkerBufferPool(c->line), frame_payload);
-                            context_t *fin_ctx = contextCreateFin(child_con_i->line);
-                            destroyChildConnecton(child_con_i);
-                            self->dw->downStream(self->dw, fin_ctx);
-                            frame_payload = NULL;
-                        }
-
-                        break;
-
-                        case kMuxFlagData: {
-                            if (UNLIKELY(sbufGetBufLength(frame_payload) <= 0))
-                            {
-                                LOGE("MuxServer: payload length <= 0");
-                                bufferpoolResuesBuffer(getWorkerBufferPool(main_con->line), frame_payload);
-                                destroyMainConnecton(main_con);
-                                self->dw->downStream(self->dw, contextCreateFin(c->line));
-                                contextDestroy(c);
-                                return;
-                            }
-
-                            context_t *data_ctx = contextCreate(child_con_i->line);
-                            data_ctx->payload   = frame_payload;
-                            self->dw->downStream(self->dw, data_ctx);
-                            frame_payload = NULL;
-                        }
-
-                        break;
-
-                        case kMuxFlagFlow:
-                            LOGE("MuxServer: kMuxFlagFlow not implemented"); // fall through
-                        default:
-                            LOGE("MuxServer: incorrect frame flag");
-                            bufferpoolResuesBuffer(getWorkerBufferPool(main_con->line), frame_payload);
-                            destroyMainConnecton(main_con);
-                            self->dw->downStream(self->dw, contextCreateFin(c->line));
-                            contextDestroy(c);
-                            return;
-                            break;
-                        }
-                        break;
-                    }
-                    child_con_i = child_con_i->next;
-                }
-                if (frame_payload != NULL)
-                {
-                    LOGW("MuxServer: a frame could not find consumer cid: %d", (int) frame.cid);
-                    bufferpoolResuesBuffer(getWorkerBufferPool(main_con->line), frame_payload);
-                }
-                else if (! lineIsAlive(c->line))
-                {
-                    contextDestroy(c);
-                    return;
-                }
+                LOGE("MuxServer: payload length <= 0");
+                bufferpoolResuesBuffer(pool, frame_payload);
+                closeMainConnection(self, main_con);
+                break;
             }
-            else
+
+            mux_server_lstate_t *child      = createChildConnection(main_con);
+            line_t              *child_line = child->line;
+            lineLock(child_line);
+
+            self->up->fnInitU(self->up, child_line);
+
+            if (! lineIsAlive(child_line))
             {
-                break;
+                lineUnlock(child_line);
+                bufferpoolResuesBuffer(pool, frame_payload);
+                continue;
             }
+            lineUnlock(child_line);
+
+            self->up->fnPayloadU(self->up, child_line, frame_payload);
+            continue;
         }
-    }
-    else
-    {
-        if (c->init)
+
+        mux_server_lstate_t *child = findChild(main_con, frame.cid);
+
+        if (child == NULL)
         {
-            main_con = createMainConnection(self, c->line);
-            // child_con                          = createChildConnection(main_con, c->line);
-            CSTATE_MUT(c) = main_con;
-            self->dw->downStream(self->dw, contextCreateEst(c->line));
-            contextDestroy(c);
+            LOGW("MuxServer: a frame could not find consumer cid: %d", (int) frame.cid);
+            bufferpoolResuesBuffer(pool, frame_payload);
+            continue;
         }
-        else
+
+        switch (frame.flags)
         {
-            destroyMainConnecton(main_con);
-            contextDestroy(c);
+        case kMuxFlagClose: {
+            line_t *child_line = child->line;
+            bufferpoolResuesBuffer(pool, frame_payload);
+            destroyChildConnecton(child);
+            self->up->fnFinU(self->up, child_line);
+            lineDestroy(child_line);
+        }
+        break;
+
+        case kMuxFlagData:
+            if (UNLIKELY(sbufGetBufLength(frame_payload) <= 0))
+            {
+                LOGE("MuxServer: payload length <= 0");
+                bufferpoolResuesBuffer(pool, frame_payload);
+                closeMainConnection(self, main_con);
+                break;
+            }
+            self->up->fnPayloadU(self->up, child->line, frame_payload);
+            break;
+
+        case kMuxFlagFlow:
+            LOGE("MuxServer: kMuxFlagFlow not implemented"); // fall through
+        default:
+            LOGE("MuxServer: incorrect frame flag");
+            bufferpoolResuesBuffer(pool, frame_payload);
+            closeMainConnection(self, main_con);
+            break;
         }
     }
+
+    lineUnlock(line);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    mux_server_child_con_state_t *child_con = CSTATE(c);
+    mux_server_lstate_t *child_con = lineGetState(self, line);
+    line_t              *main_line = child_con->parent;
+    mux_server_lstate_t *main_con  = lineGetState(self, main_line);
 
-    if (c->payload != NULL)
-    {
-        line_t                 *current_writing_line = c->line;
-        line_t                 *main_line            = child_con->parent;
-        mux_server_con_state_t *main_con             = LSTATE(main_line);
+    lineLock(main_line);
+    main_con->current_writing_line = line;
 
-        contextSwitchLine(c, main_line);
+    while (sbufGetBufLength(payload) > kMuxMaxFrameLength)
+    {
+        sbuf_t *chunk = bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID()));
+        chunk         = sbufMoveTo(chunk, payload, kMuxMaxFrameLength);
+        makeDataFrame(chunk, child_con->cid);
 
-        lineLock(main_line);
-        lineLock(current_writing_line);
-        main_con->current_writing_line = current_writing_line;
+        self->dw->fnPayloadD(self->dw, main_line, chunk);
 
-        while (sbufGetBufLength(c->payload) > kMuxMaxFrameLength)
+        if (! lineIsAlive(main_line))
         {
-            sbuf_t *chunk = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-            chunk = sbufMoveTo(chunk, c->payload, kMuxMaxFrameLength);
-            makeDataFrame(chunk, child_con->cid);
+            lineUnlock(main_line);
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+            return;
+        }
+    }
 
-            context_t *data_chunk_ctx = contextCreateFrom(c);
-            data_chunk_ctx->payload   = chunk;
-            self->dw->downStream(self->dw, data_chunk_ctx);
+    makeDataFrame(payload, child_con->cid);
 
-            if (! lineIsAlive(main_line))
-            {
-                lineUnlock(main_line);
-                lineUnlock(current_writing_line);
+    self->dw->fnPayloadD(self->dw, main_line, payload);
 
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
-            }
-        }
+    if (lineIsAlive(main_line))
+    {
+        main_con->current_writing_line = NULL;
+    }
 
-        makeDataFrame(c->payload, child_con->cid);
+    lineUnlock(main_line);
+}
 
-        self->up->upStream(self->up, c);
+static void downStreamEst(tunnel_t *self, line_t *line)
+{
+    // the client already considers the stream open
+    (void) self;
+    (void) line;
+}
 
-        if (lineIsAlive(main_line))
-        {
-            main_con->current_writing_line = NULL;
-        }
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    mux_server_lstate_t *child_con  = lineGetState(self, line);
+    line_t              *main_line  = child_con->parent;
+    sbuf_t              *close_data = bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID()));
+
+    makeCloseFrame(close_data, child_con->cid);
+    destroyChildConnecton(child_con);
+    lineDestroy(line);
+    self->dw->fnPayloadD(self->dw, main_line, close_data);
+}
+
+// a stream can not take more data, stop reading the main line
+static void downStreamPause(tunnel_t *self, line_t *line)
+{
+    mux_server_lstate_t *child_con = lineGetState(self, line);
+    self->dw->fnPauseD(self->dw, child_con->parent);
+}
+
+static void downStreamResume(tunnel_t *self, line_t *line)
+{
+    mux_server_lstate_t *child_con = lineGetState(self, line);
+    self->dw->fnResumeD(self->dw, child_con->parent);
+}
 
-        lineUnlock(main_line);
-        lineUnlock(current_writing_line);
+// the main line write is blocked, pause the stream that was writing
+static void upStreamPause(tunnel_t *self, line_t *line)
+{
+    mux_server_lstate_t *con   = lineGetState(self, line);
+    line_t              *wline = con->current_writing_line;
+
+    if (wline && lineIsAlive(wline))
+    {
+        mux_server_lstate_t *child_con = lineGetState(self, wline);
+        child_con->paused              = true;
+        self->up->fnPauseU(self->up, wline);
     }
-    else
+}
+
+static void upStreamResume(tunnel_t *self, line_t *line)
+{
+    mux_server_lstate_t *con = lineGetState(self, line);
+
+    for (mux_server_lstate_t *child_i = con->children; child_i; child_i = child_i->next)
     {
-        if (c->fin)
-        {
-            context_t *data_fin_ctx = contextCreate(child_con->parent);
-            data_fin_ctx->payload   = bufferpoolGetLargeBuffer(getWorkerBufferPool(child_con->parent));
-            makeCloseFrame(data_fin_ctx->payload, child_con->cid);
-            destroyChildConnecton(child_con);
-            self->dw->downStream(self->dw, data_fin_ctx);
-            return;
-        }
-        if (UNLIKELY(c->est))
+        if (child_i->paused)
         {
-            contextDestroy(c);
-            return;
+            child_i->paused = false;
+            self->up->fnResumeU(self->up, child_i->line);
         }
     }
 }
 
-tunnel_t *newMuxServer(node_instance_context_t *instance_info)
+tunnel_t *newMuxServer(node_t *node)
 {
-    (void) instance_info;
-    mux_server_state_t *state = memoryAllocate(sizeof(mux_server_state_t));
-    memorySet(state, 0, sizeof(mux_server_state_t));
-
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
+    tunnel_t *t = tunnelCreate(node, sizeof(mux_server_state_t), sizeof(mux_server_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPauseU   = &upStreamPause;
+    t->fnResumeU  = &upStreamResume;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnEstD     = &downStreamEst;
+    t->fnFinD     = &downStreamFin;
+    t->fnPauseD   = &downStreamPause;
+    t->fnResumeD  = &downStreamResume;
 
     return t;
 }
@@ -5,7 +5,7 @@
 #include "loggers/network_logger.h"
 #include "managers/node_manager.h"
 #include "openssl_globals.h"
-#include "utils/jsonutils.h"
+#include "utils/json_helpers.h"
 
 #include <openssl/bio.h>
 #include <openssl/err.h>
@@ -31,7 +31,7 @@ typedef struct oss_server_state_s
 
 } oss_server_state_t;
 
-typedef struct oss_server_con_state_s
+typedef struct oss_server_lstate_s
 {
 
     buffer_stream_t *fallback_buf;
@@ -46,7 +46,7 @@ typedef struct oss_server_con_state_s
 
     bool fallback_disabled;
 
-} oss_server_con_state_t;
+} oss_server_lstate_t;
 
 static int onAlpnSelect(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in,
                         unsigned int inlen, void *arg)
@@ -101,9 +101,9 @@ static size_t paddingDecisionCb(SSL *ssl, int type, size_t len, void *arg)
 {
     (void) ssl;
     (void) type;
-    oss_server_con_state_t *cstate = arg;
+    oss_server_lstate_t *ls = arg;
     // todo (private note)
-    if (cstate->reply_sent_tit >= 1 && cstate->reply_sent_tit < 4)
+    if (ls->reply_sent_tit >= 1 && ls->reply_sent_tit < 4)
     {
         if (len <= 4096)
         {
@@ -125,462 +125,389 @@ static size_t paddingDecisionCb(SSL *ssl, int type, size_t len, void *arg)
     return 0;
 }
 
-static void cleanup(tunnel_t *self, context_t *c)
+static void cleanup(tunnel_t *self, line_t *line)
 {
-    oss_server_con_state_t *cstate = CSTATE(c);
-    bufferstreamDestroy(cstate->fallback_buf);
-    SSL_free(cstate->ssl); /* free the SSL object and its BIO's */
-    memoryFree(cstate);
-    CSTATE_DROP(c);
+    oss_server_lstate_t *ls = lineGetState(self, line);
+    bufferstreamDestroy(ls->fallback_buf);
+    SSL_free(ls->ssl); /* free the SSL object and its BIO's */
+    lineClearState(ls, sizeof(oss_server_lstate_t));
 }
 
-static void fallbackWrite(tunnel_t *self, context_t *c)
+// closes the upper side, whichever of the chain or the fallback got the init
+static void cleanupAndFinUp(tunnel_t *self, line_t *line)
 {
-    if (! lineIsAlive(c->line))
+    oss_server_state_t  *state              = tunnelGetState(self);
+    oss_server_lstate_t *ls                 = lineGetState(self, line);
+    bool                 fallback_mode      = ls->fallback_mode;
+    bool                 fallback_init_sent = ls->fallback_init_sent;
+    bool                 init_sent          = ls->init_sent;
+
+    cleanup(self, line);
+
+    if (fallback_mode)
     {
-        contextDestroy(c);
-        return;
+        if (fallback_init_sent)
+        {
+            state->fallback->fnFinU(state->fallback, line);
+        }
     }
-    assert(c->payload == NULL); // payload must be consumed
-    oss_server_state_t     *state  = TSTATE(self);
-    oss_server_con_state_t *cstate = CSTATE(c);
+    else if (init_sent)
+    {
+        self->up->fnFinU(self->up, line);
+    }
+}
+
+static void disconnect(tunnel_t *self, line_t *line)
+{
+    cleanupAndFinUp(self, line);
+    self->dw->fnFinD(self->dw, line);
+}
 
-    if (! cstate->fallback_init_sent)
+// the line must be locked by the caller
+static void fallbackWrite(tunnel_t *self, line_t *line)
+{
+    if (! lineIsAlive(line))
     {
-        cstate->fallback_init_sent = true;
+        return;
+    }
+    oss_server_state_t  *state = tunnelGetState(self);
+    oss_server_lstate_t *ls    = lineGetState(self, line);
 
-        context_t *init_ctx = contextCreateInit(c->line);
-        cstate->init_sent   = true;
-        state->fallback->upStream(state->fallback, init_ctx);
-        if (! lineIsAlive(c->line))
+    if (! ls->fallback_init_sent)
+    {
+        ls->fallback_init_sent = true;
+        ls->init_sent          = true;
+        state->fallback->fnInitU(state->fallback, line);
+        if (! lineIsAlive(line))
         {
-            contextDestroy(c);
             return;
         }
     }
-    size_t record_len = bufferstreamLen(cstate->fallback_buf);
+    size_t record_len = bufferstreamLen(ls->fallback_buf);
     if (record_len == 0)
     {
-        contextDestroy(c);
         return;
     }
-    c->payload = bufferstreamIdealRead(cstate->fallback_buf);
-    state->fallback->upStream(state->fallback, c);
+    state->fallback->fnPayloadU(state->fallback, line, bufferstreamIdealRead(ls->fallback_buf));
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+/*
+    takes everything openssl wants to send and passes it down, returns false if the line is closed or failed,
+    the line must be locked by the caller
+*/
+static bool sendWbio(tunnel_t *self, line_t *line, oss_server_lstate_t *ls)
 {
-    oss_server_state_t     *state  = TSTATE(self);
-    oss_server_con_state_t *cstate = CSTATE(c);
-
-    if (c->payload != NULL)
+    buffer_pool_t *pool = getWorkerBufferPool(getWID());
+    int            n;
+    do
     {
-
-        if (state->fallback != NULL && ! cstate->handshake_completed)
+        sbuf_t      *buf   = bufferpoolGetLargeBuffer(pool);
+        unsigned int avail = sbufGetRightCapacity(buf);
+        n                  = BIO_read(ls->wbio, sbufGetMutablePtr(buf), (int) avail);
+        if (n > 0)
         {
-            bufferstreamPush(cstate->fallback_buf, sbufDuplicateByPool(contextGetBufferPool(c),c->payload));
+            sbufSetLength(buf, n);
+            self->dw->fnPayloadD(self->dw, line, buf);
+            if (! lineIsAlive(line))
+            {
+                return false;
+            }
         }
-
-        if (cstate->fallback_mode)
+        else if (! BIO_should_retry(ls->wbio))
         {
-            contextReusePayload(c);
-            fallbackWrite(self, c);
-            return;
+            // If BIO_should_retry() is false then the cause is an error condition.
+            bufferpoolResuesBuffer(pool, buf);
+            disconnect(self, line);
+            return false;
         }
-        
-        enum sslstatus status;
-        int            n;
-        unsigned int   len = sbufGetBufLength(c->payload);
-
-        while (len > 0 && lineIsAlive(c->line))
+        else
         {
-            n = BIO_write(cstate->rbio, sbufGetRawPtr(c->payload), (int) len);
-
-            if (n <= 0)
-            {
-                /* if BIO write fails, assume unrecoverable */
-                contextReusePayload(c);
-                goto disconnect;
-            }
-            sbufShiftRight(c->payload, n);
-            len -= n;
+            bufferpoolResuesBuffer(pool, buf);
+        }
+    } while (n > 0);
 
-            if (! SSL_is_init_finished(cstate->ssl))
-            {
-                n      = SSL_accept(cstate->ssl);
-                status = getSslstatus(cstate->ssl, n);
+    return true;
+}
 
-                /* Did SSL request to write bytes? */
-                if (status == kSslstatusWantIo)
-                {
-                    do
-                    {
-                        sbuf_t *buf   = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-                        unsigned int    avail = sbufGetRightCapacity(buf);
-                        n                     = BIO_read(cstate->wbio, sbufGetMutablePtr(buf), (int) avail);
-                        // assert(-1 == BIO_read(cstate->wbio, sbufGetRawPtr(buf), avail));
-                        if (n > 0)
-                        {
-                            // since then, we should not go to fallback
-                            cstate->fallback_disabled = true;
-
-                            sbufSetLength(buf, n);
-                            context_t *answer = contextCreateFrom(c);
-                            answer->payload   = buf;
-                            self->dw->downStream(self->dw, answer);
-
-                            if (! lineIsAlive(c->line))
-                            {
-                                contextReusePayload(c);
-                                contextDestroy(c);
-                                return;
-                            }
-                        }
-                        else if (! BIO_should_retry(cstate->wbio))
-                        {
-                            // If BIO_should_retry() is false then the cause is an error condition.
-                            contextReusePayload(c);
-                            bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                            goto disconnect;
-                        }
-                        else
-                        {
-                            bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                        }
-                    } while (n > 0);
-                }
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    oss_server_state_t  *state = tunnelGetState(self);
+    oss_server_lstate_t *ls    = lineGetState(self, line);
 
-                if (status == kSslstatusFail)
-                {
-                    contextReusePayload(c); // payload already buffered
-                    printSSLError();
-                    if (state->fallback != NULL && ! cstate->fallback_disabled)
-                    {
-                        cstate->fallback_mode = true;
-                        fallbackWrite(self, c);
-                        return;
-                    }
+    *ls = (oss_server_lstate_t) {.rbio         = BIO_new(BIO_s_mem()),
+                                 .wbio         = BIO_new(BIO_s_mem()),
+                                 .ssl          = SSL_new(state->threadlocal_ssl_context[getWID()]),
+                                 .fallback_buf = bufferstreamCreate(getWorkerBufferPool(getWID()))};
 
-                    goto disconnect;
-                }
+    SSL_set_accept_state(ls->ssl); /* sets ssl to work in server mode. */
+    SSL_set_bio(ls->ssl, ls->rbio, ls->wbio);
+    if (state->anti_tit)
+    {
+        if (1 != SSL_set_record_padding_callback(ls->ssl, paddingDecisionCb))
+        {
+            LOGW("OpensslServer: Could not set ssl padding hook");
+        }
+        SSL_set_record_padding_callback_arg(ls->ssl, ls);
+    }
+}
 
-                if (! SSL_is_init_finished(cstate->ssl))
-                {
-                    contextReusePayload(c);
-                    contextDestroy(c);
-                    return;
-                }
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    oss_server_state_t  *state = tunnelGetState(self);
+    oss_server_lstate_t *ls    = lineGetState(self, line);
+    buffer_pool_t       *pool  = getWorkerBufferPool(getWID());
 
-                LOGD("OpensslServer: Tls handshake complete");
-                cstate->handshake_completed = true;
-                bufferstreamEmpty(cstate->fallback_buf);
-            }
+    if (state->fallback != NULL && ! ls->handshake_completed)
+    {
+        bufferstreamPush(ls->fallback_buf, sbufDuplicateByPool(pool, payload));
+    }
 
-            /* The encrypted data is now in the input bio so now we can perform actual
-             * read of unencrypted data. */
+    lineLock(line);
 
-            do
-            {
-                sbuf_t *buf = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-                sbufSetLength(buf, 0);
-                unsigned int avail = sbufGetRightCapacity(buf);
-                n                  = SSL_read(cstate->ssl, sbufGetMutablePtr(buf), (int) avail);
+    if (ls->fallback_mode)
+    {
+        bufferpoolResuesBuffer(pool, payload);
+        fallbackWrite(self, line);
+        lineUnlock(line);
+        return;
+    }
 
-                if (n > 0)
-                {
-                    if (UNLIKELY(! cstate->init_sent))
-                    {
-                        self->up->upStream(self->up, contextCreateInit(c->line));
-                        if (! lineIsAlive(c->line))
-                        {
-                            LOGW("OpensslServer: next node instantly closed the init with fin");
-                            contextReusePayload(c);
-                            contextDestroy(c);
-
-                            return;
-                        }
-                        cstate->init_sent = true;
-                    }
+    enum sslstatus status;
+    int            n;
+    unsigned int   len = sbufGetBufLength(payload);
 
-                    sbufSetLength(buf, n);
-                    context_t *data_ctx = contextCreateFrom(c);
-                    data_ctx->payload   = buf;
-                    self->up->upStream(self->up, data_ctx);
-                    if (! lineIsAlive(c->line))
-                    {
-                        contextReusePayload(c);
-                        contextDestroy(c);
-                        return;
-                    }
-                }
-                else
-                {
-                    bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                }
+    while (len > 0 && lineIsAlive(line))
+    {
+        n = BIO_write(ls->rbio, sbufGetRawPtr(payload), (int) len);
 
-            } while (n > 0);
+        if (n <= 0)
+        {
+            /* if BIO write fails, assume unrecoverable */
+            disconnect(self, line);
+            break;
+        }
+        sbufShiftRight(payload, n);
+        len -= n;
 
-            status = getSslstatus(cstate->ssl, n);
+        if (! SSL_is_init_finished(ls->ssl))
+        {
+            n      = SSL_accept(ls->ssl);
+            status = getSslstatus(ls->ssl, n);
 
-            /* Did SSL request to write bytes? This can happen if peer has requested SSL
-             * renegotiation. */
+            /* Did SSL request to write bytes? */
             if (status == kSslstatusWantIo)
             {
-                do
+                // since then, we should not go to fallback
+                ls->fallback_disabled = true;
+                if (! sendWbio(self, line, ls))
                 {
-                    sbuf_t *buf   = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-                    unsigned int    avail = sbufGetRightCapacity(buf);
-
-                    n = BIO_read(cstate->wbio, sbufGetMutablePtr(buf), (int) avail);
-                    if (n > 0)
-                    {
-                        sbufSetLength(buf, n);
-                        context_t *answer = contextCreateFrom(c);
-                        answer->payload   = buf;
-                        self->dw->downStream(self->dw, answer);
-                        if (! lineIsAlive(c->line))
-                        {
-                            contextReusePayload(c);
-                            contextDestroy(c);
-
-                            return;
-                        }
-                    }
-                    else if (! BIO_should_retry(cstate->wbio))
-                    {
-                        // If BIO_should_retry() is false then the cause is an error condition.
-                        bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                        contextReusePayload(c);
-                        goto disconnect;
-                    }
-                    else
-                    {
-                        bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                    }
-                } while (n > 0);
+                    break;
+                }
             }
 
             if (status == kSslstatusFail)
             {
-                contextReusePayload(c);
-                goto disconnect;
+                printSSLError();
+                if (state->fallback != NULL && ! ls->fallback_disabled)
+                {
+                    // payload is already buffered
+                    ls->fallback_mode = true;
+                    fallbackWrite(self, line);
+                    break;
+                }
+
+                disconnect(self, line);
+                break;
             }
-        }
-        // done with socket data
-        contextReusePayload(c);
-        contextDestroy(c);
-    }
-    else
-    {
 
-        if (c->init)
-        {
-            CSTATE_MUT(c) = memoryAllocate(sizeof(oss_server_con_state_t));
-            memorySet(CSTATE(c), 0, sizeof(oss_server_con_state_t));
-            cstate               = CSTATE(c);
-            cstate->rbio         = BIO_new(BIO_s_mem());
-            cstate->wbio         = BIO_new(BIO_s_mem());
-            cstate->ssl          = SSL_new(state->threadlocal_ssl_context[getWID()]);
-            cstate->fallback_buf = bufferstreamCreate(contextGetBufferPool(c));
-            SSL_set_accept_state(cstate->ssl); /* sets ssl to work in server mode. */
-            SSL_set_bio(cstate->ssl, cstate->rbio, cstate->wbio);
-            if (state->anti_tit)
+            if (! SSL_is_init_finished(ls->ssl))
             {
-                if (1 != SSL_set_record_padding_callback(cstate->ssl, paddingDecisionCb))
-                {
-                    LOGW("OpensslServer: Could not set ssl padding hook");
-                }
-                SSL_set_record_padding_callback_arg(cstate->ssl, cstate);
+                continue;
             }
-            contextDestroy(c);
+
+            LOGD("OpensslServer: Tls handshake complete");
+            ls->handshake_completed = true;
+            bufferstreamEmpty(ls->fallback_buf);
         }
-        else if (c->fin)
+
+        /* The encrypted data is now in the input bio so now we can perform actual
+         * read of unencrypted data. */
+
+        do
         {
+            sbuf_t *buf = bufferpoolGetLargeBuffer(pool);
+            sbufSetLength(buf, 0);
+            unsigned int avail = sbufGetRightCapacity(buf);
+            n                  = SSL_read(ls->ssl, sbufGetMutablePtr(buf), (int) avail);
 
-            if (cstate->fallback_mode)
+            if (n > 0)
             {
-                if (cstate->fallback_init_sent)
+                if (UNLIKELY(! ls->init_sent))
                 {
-                    cleanup(self, c);
-                    state->fallback->upStream(state->fallback, c);
+                    ls->init_sent = true;
+                    self->up->fnInitU(self->up, line);
+                    if (! lineIsAlive(line))
+                    {
+                        LOGW("OpensslServer: next node instantly closed the init with fin");
+                        bufferpoolResuesBuffer(pool, buf);
+                        break;
+                    }
                 }
-                else
+
+                sbufSetLength(buf, n);
+                self->up->fnPayloadU(self->up, line, buf);
+                if (! lineIsAlive(line))
                 {
-                    cleanup(self, c);
-                    contextDestroy(c);
+                    break;
                 }
             }
-            else if (cstate->init_sent)
-            {
-                cleanup(self, c);
-                self->up->upStream(self->up, c);
-            }
             else
             {
-                cleanup(self, c);
-                contextDestroy(c);
+                bufferpoolResuesBuffer(pool, buf);
             }
+
+        } while (n > 0);
+
+        if (! lineIsAlive(line))
+        {
+            break;
         }
-    }
 
-    return;
+        status = getSslstatus(ls->ssl, n);
 
-disconnect:
-    if (cstate->init_sent)
-    {
-        self->up->upStream(self->up, contextCreateFinFrom(c));
+        /* Did SSL request to write bytes? This can happen if peer has requested SSL
+         * renegotiation. */
+        if (status == kSslstatusWantIo)
+        {
+            if (! sendWbio(self, line, ls))
+            {
+                break;
+            }
+        }
+
+        if (status == kSslstatusFail)
+        {
+            disconnect(self, line);
+            break;
+        }
     }
 
-    context_t *fail_context = contextCreateFinFrom(c);
-    cleanup(self, c);
-    contextDestroy(c);
-    self->dw->downStream(self->dw, fail_context);
+    // done with socket data
+    bufferpoolResuesBuffer(pool, payload);
+    lineUnlock(line);
+}
+
+static void upStreamFin(tunnel_t *self, line_t *line)
+{
+    cleanupAndFinUp(self, line);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    oss_server_state_t     *state  = TSTATE(self);
-    oss_server_con_state_t *cstate = CSTATE(c);
+    oss_server_state_t  *state = tunnelGetState(self);
+    oss_server_lstate_t *ls    = lineGetState(self, line);
+    buffer_pool_t       *pool  = getWorkerBufferPool(getWID());
 
-    if (c->payload != NULL)
+    if (state->anti_tit && lineIsAuthenticated(line))
     {
-        if (state->anti_tit && lineIsAuthenticated(c->line))
-        {
-            // if (cstate->reply_sent_tit <= 1)
-            cstate->reply_sent_tit += 1;
-            // this crashes ... openssl said this can be set to null again but seems not :(
-            // if (1 != SSL_set_record_padding_callback(cstate->ssl, NULL))
-            //     LOGW("OpensslServer: Could not set ssl padding");
-        }
+        // if (ls->reply_sent_tit <= 1)
+        ls->reply_sent_tit += 1;
+        // this crashes ... openssl said this can be set to null again but seems not :(
+        // if (1 != SSL_set_record_padding_callback(ls->ssl, NULL))
+        //     LOGW("OpensslServer: Could not set ssl padding");
+    }
 
-        enum sslstatus status;
+    enum sslstatus status;
 
-        if (! cstate->handshake_completed)
+    if (! ls->handshake_completed)
+    {
+        if (ls->fallback_mode)
         {
-            if (cstate->fallback_mode)
-            {
-                self->dw->downStream(self->dw, c);
-                return; // not gona encrypt fall back data
-            }
-
-            LOGF("How it is possible to receive data before sending init to upstream?");
-            exit(1);
+            self->dw->fnPayloadD(self->dw, line, payload);
+            return; // not gona encrypt fall back data
         }
-        int len = (int) sbufGetBufLength(c->payload);
-        while (len > 0 && lineIsAlive(c->line))
-        {
 
-            /*
-                todo (test code)
-                testing how the filtering behaves if we force protocol client to recevie at least
-                2 full chunks before sending anymore data
-
-                sometimes udp or is the underlying protocol so we should not do weird
-                kind of stuff to that data otherwise speedtest app may sometimes give up the test :(
-                forexample speedtest first packet is sometimes 65 bytes total !
-            */
-            int sbufConsume = len;
-            if ((cstate->reply_sent_tit == 1 && len > 256))
-            {
-                cstate->reply_sent_tit++;
-                sbufConsume = 128;
-            }
+        LOGF("How it is possible to receive data before sending init to upstream?");
+        exit(1);
+    }
 
-            int n  = SSL_write(cstate->ssl, sbufGetRawPtr(c->payload), sbufConsume);
-            status = getSslstatus(cstate->ssl, n);
-            assert(n == sbufConsume);
+    lineLock(line);
 
-            if (n > 0)
-            {
-                /* sbufConsume the waiting bytes that have been used by SSL */
-                sbufShiftRight(c->payload, n);
-                len -= n;
-                /* take the output of the SSL object and queue it for socket write */
-                do
-                {
-                    sbuf_t *buf   = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-                    unsigned int    avail = sbufGetRightCapacity(buf);
-                    n                     = BIO_read(cstate->wbio, sbufGetMutablePtr(buf), (int) avail);
-                    if (n > 0)
-                    {
-                        sbufSetLength(buf, n);
-                        context_t *dw_context = contextCreateFrom(c);
-                        dw_context->payload   = buf;
-                        self->dw->downStream(self->dw, dw_context);
-                        if (! lineIsAlive(c->line))
-                        {
-                            contextReusePayload(c);
-                            contextDestroy(c);
-
-                            return;
-                        }
-                    }
-                    else if (! BIO_should_retry(cstate->wbio))
-                    {
-                        // If BIO_should_retry() is false then the cause is an error condition.
-                        bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                        contextReusePayload(c);
-                        goto disconnect;
-                    }
-                    else
-                    {
-                        bufferpoolResuesBuffer(contextGetBufferPool(c), buf);
-                    }
-                } while (n > 0);
-            }
+    int len = (int) sbufGetBufLength(payload);
+    while (len > 0 && lineIsAlive(line))
+    {
 
-            if (status == kSslstatusFail)
-            {
-                contextReusePayload(c);
-                goto disconnect;
-            }
+        /*
+            todo (test code)
+            testing how the filtering behaves if we force protocol client to recevie at least
+            2 full chunks before sending anymore data
+
+            sometimes udp or is the underlying protocol so we should not do weird
+            kind of stuff to that data otherwise speedtest app may sometimes give up the test :(
+            forexample speedtest first packet is sometimes 65 bytes total !
+        */
+        int sbufConsume = len;
+        if ((ls->reply_sent_tit == 1 && len > 256))
+        {
+            ls->reply_sent_tit++;
+            sbufConsume = 128;
+        }
 
-            if (n == 0)
+        int n  = SSL_write(ls->ssl, sbufGetRawPtr(payload), sbufConsume);
+        status = getSslstatus(ls->ssl, n);
+        assert(n == sbufConsume);
+
+        if (n > 0)
+        {
+            /* sbufConsume the waiting bytes that have been used by SSL */
+            sbufShiftRight(payload, n);
+            len -= n;
+            /* take the output of the SSL object and queue it for socket write */
+            if (! sendWbio(self, line, ls))
             {
                 break;
             }
         }
-        assert(sbufGetBufLength(c->payload) == 0);
-        contextReusePayload(c);
-        contextDestroy(c);
 
-        return;
-    }
+        if (status == kSslstatusFail)
+        {
+            disconnect(self, line);
+            break;
+        }
 
-    if (c->est)
-    {
-        self->dw->downStream(self->dw, c);
-        return;
-    }
-    if (c->fin)
-    {
-        cleanup(self, c);
-        self->dw->downStream(self->dw, c);
+        if (n == 0)
+        {
+            break;
+        }
     }
 
-    return;
-
-disconnect: {
-    context_t *fail_context_up = contextCreateFinFrom(c);
-    self->up->upStream(self->up, fail_context_up);
-
-    context_t *fail_context = contextCreateFinFrom(c);
-    cleanup(self, c);
-    contextDestroy(c);
-    self->dw->downStream(self->dw, fail_context);
+    bufferpoolResuesBuffer(pool, payload);
+    lineUnlock(line);
 }
+
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    cleanup(self, line);
+    self->dw->fnFinD(self->dw, line);
 }
 
-tunnel_t *newOpenSSLServer(node_instance_context_t *instance_info)
+tunnel_t *newOpenSSLServer(node_t *node)
 {
-    oss_server_state_t *state = memoryAllocate(sizeof(oss_server_state_t));
-    memorySet(state, 0, sizeof(oss_server_state_t));
+    tunnel_t *t = tunnelCreate(node, sizeof(oss_server_state_t), sizeof(oss_server_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnFinD     = &downStreamFin;
+
+    oss_server_state_t *state = tunnelGetState(t);
 
     state->threadlocal_ssl_context = memoryAllocate(sizeof(ssl_ctx_t) * getWorkersCount());
 
     ssl_ctx_opt_t *ssl_param = memoryAllocate(sizeof(ssl_ctx_opt_t));
     memorySet(ssl_param, 0, sizeof(ssl_ctx_opt_t));
-    const cJSON *settings = instance_info->node_settings_json;
+    const cJSON *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
@@ -647,7 +574,7 @@ tunnel_t *newOpenSSLServer(node_instance_context_t *instance_info)
     else
     {
         hash_t  hash_next = calcHashBytes(fallback_node, strlen(fallback_node));
-        node_t *next_node = nodemanagerGetNode(instance_info->node_manager_config, hash_next);
+        node_t *next_node = nodemanagerGetNode(node->node_manager_config, hash_next);
         if (next_node == NULL)
         {
             LOGF("OpensslServer: fallback node not found");
@@ -656,7 +583,7 @@ tunnel_t *newOpenSSLServer(node_instance_context_t *instance_info)
 
         if (next_node->instance == NULL)
         {
-            nodemanagerRunNode(instance_info->node_manager_config, next_node, instance_info->chain_index + 1);
+            nodemanagerRunNode(node->node_manager_config, next_node, 0);
         }
 
         state->fallback = next_node->instance;
@@ -686,14 +613,10 @@ tunnel_t *newOpenSSLServer(node_instance_context_t *instance_info)
     memoryFree((char *) ssl_param->key_file);
     memoryFree(ssl_param);
 
-    tunnel_t *t = tunnelCreate();
-    t->state    = state;
     if (state->fallback != NULL)
     {
         tunnelBindDown(t, state->fallback);
     }
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
 
     return t;
 }
@@ -8,81 +8,66 @@ typedef struct preconnect_server_state_s
     void *_;
 } preconnect_server_state_t;
 
-typedef struct preconnect_server_con_state_s
+typedef struct preconnect_server_lstate_s
 {
     bool init_sent;
-    bool first_packet_sent;
 
-} preconnect_server_con_state_t;
+} preconnect_server_lstate_t;
 
-static void upStream(tunnel_t *self, context_t *c)
+// the client opens these ahead of time, the line only goes up once it carries data
+static void upStreamInit(tunnel_t *self, line_t *line)
 {
-    preconnect_server_con_state_t *cstate = CSTATE(c);
+    preconnect_server_lstate_t *ls = lineGetState(self, line);
+    *ls                            = (preconnect_server_lstate_t) {.init_sent = false};
+}
 
-    if (c->payload != NULL)
-    {
-        if (! cstate->first_packet_sent)
-        {
-            cstate->first_packet_sent = true;
-            cstate->init_sent         = true;
-            self->up->upStream(self->up, contextCreateInit(c->line));
-            if (! lineIsAlive(c->line))
-            {
-                contextReusePayload(c);
-                contextDestroy(c);
-                return;
-            }
-        }
-        self->up->upStream(self->up, c);
-    }
-    else if (c->init)
-    {
-        cstate        = memoryAllocate(sizeof(preconnect_server_con_state_t));
-        *cstate       = (preconnect_server_con_state_t) {.init_sent = false, .first_packet_sent = false};
-        CSTATE_MUT(c) = cstate;
-        contextDestroy(c);
-        return;
-    }
-    else if (c->fin)
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    preconnect_server_lstate_t *ls = lineGetState(self, line);
+
+    if (! ls->init_sent)
     {
-        bool send_fin = cstate->init_sent;
-        memoryFree(cstate);
-        CSTATE_DROP(c);
-        if (send_fin)
-        {
-            self->up->upStream(self->up, c);
-        }
-        else
+        ls->init_sent = true;
+
+        lineLock(line);
+        self->up->fnInitU(self->up, line);
+        if (! lineIsAlive(line))
         {
-            contextDestroy(c);
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+            lineUnlock(line);
+            return;
         }
-
-        return;
+        lineUnlock(line);
     }
+    self->up->fnPayloadU(self->up, line, payload);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void upStreamFin(tunnel_t *self, line_t *line)
 {
+    preconnect_server_lstate_t *ls       = lineGetState(self, line);
+    bool                        send_fin = ls->init_sent;
 
-    if (c->fin)
+    lineClearState(ls, sizeof(preconnect_server_lstate_t));
+    if (send_fin)
     {
-        memoryFree(CSTATE(c));
-        CSTATE_DROP(c);
+        self->up->fnFinU(self->up, line);
     }
+}
 
-    self->dw->downStream(self->dw, c);
+static void downStreamFin(tunnel_t *self, line_t *line)
+{
+    lineClearState(lineGetState(self, line), sizeof(preconnect_server_lstate_t));
+    self->dw->fnFinD(self->dw, line);
 }
 
-tunnel_t *newPreConnectServer(node_instance_context_t *instance_info)
+tunnel_t *newPreConnectServer(node_t *node)
 {
-    (void) instance_info;
-    preconnect_server_state_t *state = memoryAllocate(sizeof(preconnect_server_state_t));
-    memorySet(state, 0, sizeof(preconnect_server_state_t));
-
-    tunnel_t *t   = tunnelCreate();
-    t->state      = state;
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
+    tunnel_t *t = tunnelCreate(node, sizeof(preconnect_server_state_t), sizeof(preconnect_server_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnFinD     = &downStreamFin;
 
     return t;
 }
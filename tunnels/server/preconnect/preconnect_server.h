@@ -1,12 +1,12 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
 
 //
 // con <------>  PreConnectServer (initiate upstream after we've got some data) <-------> con
 //
 //
 
-tunnel_t *        newPreConnectServer(node_instance_context_t *instance_info);
+tunnel_t *        newPreConnectServer(node_t *node);
 api_result_t      apiPreConnectServer(tunnel_t *self, const char *msg);
 tunnel_t *        destroyPreConnectServer(tunnel_t *self);
 tunnel_metadata_t getMetadataPreConnectServer(void);
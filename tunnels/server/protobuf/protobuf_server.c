@@ -1,16 +1,13 @@
 #include "protobuf_server.h"
 
+#include "bdp_window.h"
 #include "buffer_pool.h"
-#include "buffer_stream.h"
+#include "frame_decoder.h"
 #include "loggers/network_logger.h"
-#include "node.h"
 #include "shiftbuffer.h"
 #include "tunnel.h"
 #include "uleb128.h"
-#include <stdatomic.h>
-#include <stddef.h>
-#include <stdint.h>
-#include <stdlib.h>
+#include "utils/json_helpers.h"
 /*
     we shall not use nanopb or any protobuf lib because they need atleast 1 memcopy
     i have read the byte array implemntation of the protoc and
@@ -18,215 +15,220 @@
 */
 enum
 {
-    kMaxPacketSize    = (65536 * 1),
-    kMaxRecvBeforeAck = (1 << 16),
-    kMaxSendBeforeAck = (1 << 22)
+    kMaxPacketSize         = (65536 * 1),
+    kMaxRecvBeforeAck      = (1 << 16),
+    kDefaultMinSendWindow  = (1 << 18),
+    kDefaultMaxSendWindow  = (1 << 25),
+    kDefaultWindowBudgetMB = 256 // per worker, shared by the lines of the node
 };
 
+/*
+    The send window (bytes written and not yet acknowledged by the peer) used to be a fixed 4MB; it is now sized from
+    the bandwidth delay product the acks show (see bdp_window.h), between "min-window" and "max-window" (bytes), and
+    the growth of all lines on a worker is capped by "window-budget" (MB).
+
+    The peer acknowledges every recv_ack_threshold bytes, at most kMaxRecvBeforeAck and at least 4 times per
+    min-window so a line that sits at the smallest window never waits for an ack that will not come.
+*/
 typedef struct protobuf_server_state_s
 {
-    void *_;
+    uint32_t     min_window;
+    uint32_t     max_window;
+    uint32_t     recv_ack_threshold;
+    bdp_budget_t budgets[]; // [wid]
+
 } protobuf_server_state_t;
 
-typedef struct protobuf_server_con_state_s
+// flag byte, uleb128 length, payload
+static const frame_format_t kProtoBufFrameFormat = {
+    .min_length = 1, .max_length = kMaxPacketSize, .length_offset = 1, .length_size = kFrameLengthUleb128};
+
+typedef struct protobuf_server_lstate_s
 {
-    buffer_stream_t *stream_buf;
-    size_t           bytes_sent_nack;
-    size_t           bytes_received_nack;
+    frame_decoder_t decoder;
+    size_t          bytes_sent_nack;
+    size_t          bytes_received_nack;
+    bdp_window_t    send_window;
 
-} protobuf_server_con_state_t;
+} protobuf_server_lstate_t;
 
-static void cleanup(protobuf_server_con_state_t *cstate)
+static void cleanup(tunnel_t *self, line_t *line)
 {
-    bufferstreamDestroy(cstate->stream_buf);
-    memoryFree(cstate);
+    protobuf_server_lstate_t *ls = lineGetState(self, line);
+    bdpwindowDestroy(&(ls->send_window));
+    framedecoderDestroy(&(ls->decoder));
+    lineClearState(ls, sizeof(protobuf_server_lstate_t));
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+// flag byte and uleb128 length go in front of the payload, no copy
+static void writeFrameHeader(sbuf_t *buf, uint8_t flag)
 {
-    protobuf_server_con_state_t *cstate = CSTATE(c);
+    size_t blen             = sbufGetBufLength(buf);
+    size_t calculated_bytes = sizeUleb128(blen);
+    sbufShiftLeft(buf, calculated_bytes + 1);
+    writeUleb128(sbufGetMutablePtr(buf) + 1, blen);
+    sbufWriteUnAlignedUI8(buf, flag);
+}
 
-    if (c->payload != NULL)
-    {
-        buffer_stream_t *bstream = cstate->stream_buf;
-        bufferStreamPushContextPayload(bstream, c);
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    protobuf_server_state_t  *state = tunnelGetState(self);
+    protobuf_server_lstate_t *ls    = lineGetState(self, line);
 
-        while (true)
-        {
-            if (bufferstreamLen(bstream) < 2)
-            {
-                contextDestroy(c);
-                return;
-            }
-            sbuf_t *full_data = bufferstreamFullRead(bstream);
-            uint8_t         flags;
-            sbufReadUnAlignedUI8(full_data, &flags);
-            sbufShiftRight(full_data, 1); // first byte is  (protobuf flag)
+    *ls = (protobuf_server_lstate_t) {0};
+    framedecoderInit(&(ls->decoder), getWorkerBufferPool(getWID()), kProtoBufFrameFormat);
+    bdpwindowInit(&(ls->send_window), &(state->budgets[getWID()]), state->min_window, state->max_window);
 
-            const uint8_t *uleb_data    = sbufGetRawPtr(full_data);
-            uint64_t       data_len     = 0;
-            size_t         bytes_passed = readUleb128ToUint64(uleb_data, uleb_data + sbufGetBufLength(full_data), &data_len);
+    self->up->fnInitU(self->up, line);
+}
 
-            if (data_len == 0 || (sbufGetBufLength(full_data) - (bytes_passed)) < data_len)
-            {
-                sbufShiftLeft(full_data, 1); // bring the data back to its original form
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    protobuf_server_state_t  *state = tunnelGetState(self);
+    protobuf_server_lstate_t *ls    = lineGetState(self, line);
+    buffer_pool_t            *pool  = getWorkerBufferPool(getWID());
 
-                bufferstreamPush(bstream, full_data);
-                contextDestroy(c);
-                return;
-            }
+    framedecoderPush(&(ls->decoder), payload);
 
-            if (data_len > kMaxPacketSize)
-            {
-                LOGE("ProtoBufServer: rejected, size too large");
-                bufferpoolResuesBuffer(contextGetBufferPool(c), full_data);
-                goto disconnect;
-            }
-
-            sbufShiftRight(full_data, bytes_passed);
+    lineLock(line);
+    while (true)
+    {
+        sbuf_t                *full_data = NULL;
+        frame_decoder_result_t result    = framedecoderNextBuffer(&(ls->decoder), &full_data);
+        if (result == kFrameDecoderNeedMore)
+        {
+            break;
+        }
+        if (result == kFrameDecoderInvalid)
+        {
+            LOGE("ProtoBufServer: rejected, invalid frame size");
+            goto disconnect;
+        }
 
-            if (flags == 0x1 && data_len == sizeof(uint32_t))
-            {
-                uint32_t consumed;
-                memoryCopy(&consumed, sbufGetRawPtr(full_data), sizeof(uint32_t));
-                consumed = ntohl(consumed);
-                sbufShiftRight(full_data, sizeof(uint32_t));
+        uint8_t flags;
+        sbufReadUnAlignedUI8(full_data, &flags); // first byte is  (protobuf flag)
+        sbufShiftRight(full_data, framedecoderGetHeaderLength(&(ls->decoder)));
+        const size_t data_len = sbufGetBufLength(full_data);
 
-                cstate->bytes_sent_nack -= consumed;
+        if (flags == 0x1 && data_len == sizeof(uint32_t))
+        {
+            uint32_t consumed;
+            memoryCopy(&consumed, sbufGetRawPtr(full_data), sizeof(uint32_t));
+            consumed = ntohl(consumed);
+            bufferpoolResuesBuffer(pool, full_data);
 
-                if (cstate->bytes_sent_nack <= kMaxSendBeforeAck / 2)
-                {
-                    resumeLineUpSide(c->line);
-                }
+            ls->bytes_sent_nack -= consumed;
+            bdpwindowOnAcked(&(ls->send_window), consumed, wloopNowUS(getWorkerLoop(getWID())));
 
-                if (sbufGetBufLength(full_data) > 0)
-                {
-                    bufferstreamPush(bstream, full_data);
-                }
-                else
+            if (ls->bytes_sent_nack <= bdpwindowGet(&(ls->send_window)) / 2)
+            {
+                self->up->fnResumeU(self->up, line);
+                if (! lineIsAlive(line))
                 {
-                    bufferpoolResuesBuffer(contextGetBufferPool(c), full_data);
+                    break;
                 }
             }
-            else if (flags == '\n')
+        }
+        else if (flags == '\n')
+        {
+            ls->bytes_received_nack += data_len;
+            if (ls->bytes_received_nack >= state->recv_ack_threshold)
             {
-
-                cstate->bytes_received_nack += (size_t) data_len;
-                if (cstate->bytes_received_nack >= kMaxRecvBeforeAck)
+                sbuf_t *flowctl_buf = bufferpoolGetSmallBuffer(pool);
+                sbufSetLength(flowctl_buf, sizeof(uint32_t));
+                sbufWriteUnAlignedUI32(flowctl_buf, htonl(ls->bytes_received_nack));
+                ls->bytes_received_nack = 0;
+                writeFrameHeader(flowctl_buf, 0x1);
+
+                self->dw->fnPayloadD(self->dw, line, flowctl_buf);
+                if (! lineIsAlive(line))
                 {
-
-                    sbuf_t *flowctl_buf = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-                    sbufSetLength(flowctl_buf, sizeof(uint32_t));
-                    sbufWriteUnAlignedUI32(flowctl_buf, htonl(cstate->bytes_received_nack));
-                    cstate->bytes_received_nack = 0;
-
-                    size_t blen             = sbufGetBufLength(flowctl_buf);
-                    size_t calculated_bytes = sizeUleb128(blen);
-                    sbufShiftLeft(flowctl_buf, calculated_bytes + 1);
-                    writeUleb128(sbufGetMutablePtr(flowctl_buf) + 1, blen);
-                    sbufWriteUnAlignedUI8(flowctl_buf, 0x1);
-
-                    context_t *send_flow_ctx = contextCreateFrom(c);
-                    send_flow_ctx->payload   = flowctl_buf;
-                    self->dw->downStream(self->dw, send_flow_ctx);
-                    if (! lineIsAlive(c->line))
-                    {
-                        bufferpoolResuesBuffer(contextGetBufferPool(c), full_data);
-                        contextDestroy(c);
-                        return;
-                    }
-                }
-
-                context_t *upstream_ctx = contextCreateFrom(c);
-                upstream_ctx->payload   = bufferpoolGetLargeBuffer(contextGetBufferPool(c));
-
-                upstream_ctx->payload = sbufMoveTo(upstream_ctx->payload, full_data, data_len);
-
-                if (sbufGetBufLength(full_data) > 0)
-                {
-                    bufferstreamPush(bstream, full_data);
-                }
-                else
-                {
-                    bufferpoolResuesBuffer(contextGetBufferPool(c), full_data);
-                }
-                self->up->upStream(self->up, upstream_ctx);
-
-                if (! lineIsAlive(c->line))
-                {
-                    contextDestroy(c);
-                    return;
+                    bufferpoolResuesBuffer(pool, full_data);
+                    break;
                 }
             }
-            else
-            {
-                LOGE("ProtoBufServer: rejected, invalid flag");
-                bufferpoolResuesBuffer(contextGetBufferPool(c), full_data);
 
-                goto disconnect;
+            // the frame buffer itself goes on, the decoder already cut it out of the stream
+            self->up->fnPayloadU(self->up, line, full_data);
+            if (! lineIsAlive(line))
+            {
+                break;
             }
         }
-    }
-    else
-    {
-        if (c->init)
-        {
-            cstate        = memoryAllocate(sizeof(protobuf_server_con_state_t));
-            *cstate       = (protobuf_server_con_state_t) {.stream_buf = bufferstreamCreate(contextGetBufferPool(c))};
-            CSTATE_MUT(c) = cstate;
-        }
-        else if (c->fin)
+        else
         {
-            cleanup(cstate);
-            CSTATE_DROP(c);
+            LOGE("ProtoBufServer: rejected, invalid flag");
+            bufferpoolResuesBuffer(pool, full_data);
+            goto disconnect;
         }
-        self->up->upStream(self->up, c);
     }
-
+    lineUnlock(line);
     return;
+
 disconnect:
-    cleanup(cstate);
-    CSTATE_DROP(c);
-    self->up->upStream(self->up, contextCreateFin(c->line));
-    self->dw->downStream(self->dw, contextCreateFin(c->line));
-    contextDestroy(c);
+    cleanup(self, line);
+    self->up->fnFinU(self->up, line);
+    self->dw->fnFinD(self->dw, line);
+    lineUnlock(line);
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void upStreamFin(tunnel_t *self, line_t *line)
 {
-    protobuf_server_con_state_t *cstate = CSTATE(c);
+    cleanup(self, line);
+    self->up->fnFinU(self->up, line);
+}
 
-    if (c->payload != NULL)
-    {
-        size_t blen             = sbufGetBufLength(c->payload);
-        size_t calculated_bytes = sizeUleb128(blen);
-        sbufShiftLeft(c->payload, calculated_bytes + 1);
-        writeUleb128(sbufGetMutablePtr(c->payload) + 1, blen);
-        sbufWriteUnAlignedUI8(c->payload, '\n');
-        cstate->bytes_sent_nack += blen;
-        if (cstate->bytes_sent_nack > kMaxSendBeforeAck)
-        {
-            pauseLineUpSide(c->line);
-        }
-    }
-    else
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    protobuf_server_lstate_t *ls   = lineGetState(self, line);
+    size_t                    blen = sbufGetBufLength(payload);
+
+    writeFrameHeader(payload, '\n');
+    ls->bytes_sent_nack += blen;
+    bdpwindowOnSent(&(ls->send_window), blen, wloopNowUS(getWorkerLoop(getWID())));
+
+    if (ls->bytes_sent_nack > bdpwindowGet(&(ls->send_window)))
     {
-        if (c->fin)
-        {
-            cleanup(cstate);
-            CSTATE_DROP(c);
-        }
+        self->up->fnPauseU(self->up, line);
     }
-    self->dw->downStream(self->dw, c);
+    self->dw->fnPayloadD(self->dw, line, payload);
 }
 
-tunnel_t *newProtoBufServer(node_instance_context_t *instance_info)
+static void downStreamFin(tunnel_t *self, line_t *line)
 {
+    cleanup(self, line);
+    self->dw->fnFinD(self->dw, line);
+}
 
-    (void) instance_info;
-    tunnel_t *t   = tunnelCreate();
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
+tunnel_t *newProtoBufServer(node_t *node)
+{
+    const size_t state_size = sizeof(protobuf_server_state_t) + (getWorkersCount() * sizeof(bdp_budget_t));
+
+    tunnel_t *t = tunnelCreate(node, (uint16_t) state_size, sizeof(protobuf_server_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnFinD     = &downStreamFin;
+
+    protobuf_server_state_t *state    = tunnelGetState(t);
+    const cJSON             *settings = node->node_settings_json;
+
+    int min_window = 0;
+    int max_window = 0;
+    int budget_mb  = 0;
+    getIntFromJsonObjectOrDefault(&min_window, settings, "min-window", kDefaultMinSendWindow);
+    getIntFromJsonObjectOrDefault(&max_window, settings, "max-window", kDefaultMaxSendWindow);
+    getIntFromJsonObjectOrDefault(&budget_mb, settings, "window-budget", kDefaultWindowBudgetMB);
+
+    state->min_window         = (uint32_t) max(kMaxPacketSize, min_window);
+    state->max_window         = (uint32_t) max((int) state->min_window, max_window);
+    state->recv_ack_threshold = min((uint32_t) kMaxRecvBeforeAck, state->min_window / 4);
+    for (wid_t wid = 0; wid < getWorkersCount(); wid++)
+    {
+        state->budgets[wid] = (bdp_budget_t) {.limit = (uint64_t) max(0, budget_mb) * 1024 * 1024};
+    }
 
     return t;
 }
@@ -1,11 +1,11 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
 
 //      ---->               decode               ---->
 // con                  (protocolbuffers)               con
 //      <----               encode               <----
 
-tunnel_t *        newProtoBufServer(node_instance_context_t *instance_info);
+tunnel_t *        newProtoBufServer(node_t *node);
 api_result_t      apiProtoBufServer(tunnel_t *self, const char *msg);
 tunnel_t *        destroyProtoBufServer(tunnel_t *self);
 tunnel_metadata_t getMetadataProtoBufServer(void);
@@ -1,8 +1,8 @@
 #include "trojan_auth_server.h"
 #include "loggers/network_logger.h"
 #include "managers/node_manager.h"
-#include "utils/jsonutils.h"
-#include "utils/objects/user.h"
+#include "utils/json_helpers.h"
+#include "objects/user.h"
 
 #define i_type hmap_users_t    // NOLINT
 #define i_key  hash_t          // NOLINT
@@ -18,220 +18,404 @@ enum
 
 typedef struct trojan_auth_server_state_s
 {
-    config_file_t *config_file;
-    tunnel_t      *fallback;
-    int            fallback_delay;
-    hmap_users_t   users;
+    tunnel_t    *fallback;
+    int          fallback_delay;
+    hmap_users_t users;
 
 } trojan_auth_server_state_t;
 
-typedef struct trojan_auth_server_con_state_s
+typedef struct trojan_auth_server_lstate_s
 {
-    bool authenticated;
-    bool init_sent;
-    bool first_packet_received;
-
-} trojan_auth_server_con_state_t;
+    tunnel_t      *tunnel;
+    line_t        *line;
+    trojan_user_t *tuser;
+    wtimer_t      *shaper_timer[2]; // indexed by user_dir_e
+    bool           peer_paused[2];  // pause from the neighbour that consumes that direction
+    bool           authenticated;
+    bool           init_sent;
+    bool           first_packet_received;
+
+} trojan_auth_server_lstate_t;
+
+typedef struct fallback_timer_data_s
+{
+    tunnel_t *tunnel;
+    line_t   *line;
+    sbuf_t   *payload;
+} fallback_timer_data_t;
 
-struct timer_eventdata
+static void cleanup(tunnel_t *self, line_t *line)
 {
-    tunnel_t  *self;
-    context_t *c;
-};
+    trojan_auth_server_lstate_t *ls = lineGetState(self, line);
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (ls->shaper_timer[i] != NULL)
+        {
+            wtimerDelete(ls->shaper_timer[i]);
+        }
+    }
+    if (ls->tuser != NULL)
+    {
+        userConnectionClosed(&ls->tuser->user, getWID());
+    }
+    lineClearState(ls, sizeof(trojan_auth_server_lstate_t));
+}
 
-static struct timer_eventdata *newTimerData(tunnel_t *self, context_t *c)
+// closes the upper side, whichever of the chain or the fallback got the init
+static void cleanupAndFinUp(tunnel_t *self, line_t *line)
 {
-    struct timer_eventdata *result = memoryAllocate(sizeof(struct timer_eventdata));
-    result->self                   = self;
-    result->c                      = c;
-    return result;
+    trojan_auth_server_state_t  *state     = tunnelGetState(self);
+    trojan_auth_server_lstate_t *ls        = lineGetState(self, line);
+    bool                         init_sent = ls->init_sent;
+    bool                         auth      = ls->authenticated;
+
+    cleanup(self, line);
+
+    if (! init_sent)
+    {
+        return;
+    }
+    if (auth)
+    {
+        self->up->fnFinU(self->up, line);
+    }
+    else
+    {
+        state->fallback->fnFinU(state->fallback, line);
+    }
 }
 
 static void onFallbackTimer(wtimer_t *timer)
 {
-    struct timer_eventdata     *data  = weventGetUserdata(timer);
-    tunnel_t                   *self  = data->self;
-    trojan_auth_server_state_t *state = TSTATE(self);
-    context_t                  *c     = data->c;
+    fallback_timer_data_t      *data  = weventGetUserdata(timer);
+    trojan_auth_server_state_t *state = tunnelGetState(data->tunnel);
+    line_t                     *line  = data->line;
 
-    memoryFree(data);
     wtimerDelete(timer);
 
-    if (! lineIsAlive(c->line))
+    if (lineIsAlive(line))
+    {
+        state->fallback->fnPayloadU(state->fallback, line, data->payload);
+    }
+    else
+    {
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), data->payload);
+    }
+    lineUnlock(line);
+    memoryFree(data);
+}
+
+// not a trojan user, the line goes to the fallback or is closed when there is none
+static void rejectPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    trojan_auth_server_state_t  *state = tunnelGetState(self);
+    trojan_auth_server_lstate_t *ls    = lineGetState(self, line);
+
+    if (state->fallback == NULL)
+    {
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+        cleanup(self, line);
+        self->dw->fnFinD(self->dw, line);
+        return;
+    }
+
+    if (! ls->init_sent)
     {
-        if (c->payload != NULL)
+        ls->init_sent = true;
+        lineLock(line);
+        state->fallback->fnInitU(state->fallback, line);
+        if (! lineIsAlive(line))
         {
-            contextReusePayload(c);
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+            lineUnlock(line);
+            return;
         }
-        contextDestroy(c);
+        lineUnlock(line);
+    }
+
+    if (state->fallback_delay <= 0)
+    {
+        state->fallback->fnPayloadU(state->fallback, line, payload);
         return;
     }
-    state->fallback->upStream(state->fallback, c);
+
+    // the timer keeps the line locked until it hands the payload over
+    fallback_timer_data_t *data = memoryAllocate(sizeof(fallback_timer_data_t));
+    *data = (fallback_timer_data_t) {.tunnel = self, .line = line, .payload = payload};
+    lineLock(line);
+
+    wtimer_t *t = wtimerAdd(getWorkerLoop(getWID()), onFallbackTimer, state->fallback_delay, 1);
+    weventSetUserData(t, data);
 }
 
-static void upStream(tunnel_t *self, context_t *c)
+// the paused side is the one that produces the data: the client for upload, the upstream for download
+static void sendShaperSignal(trojan_auth_server_lstate_t *ls, user_dir_e dir, bool pause)
 {
-    trojan_auth_server_state_t     *state  = TSTATE(self);
-    trojan_auth_server_con_state_t *cstate = CSTATE(c);
+    tunnel_t *self = ls->tunnel;
 
-    if (c->payload != NULL)
+    if (dir == kUserDirUp)
     {
-        if (cstate->authenticated)
-        {
-            self->up->upStream(self->up, c);
-        }
-        else if (! cstate->first_packet_received)
+        if (pause)
         {
-            cstate->first_packet_received = true;
-            // struct timeval tv1, tv2;
-            // getTimeOfDay(&tv1, NULL);
-            {
-
-                // beware! trojan auth will not use stream buffer, at least the auth chunk must come in first sequence
-                // the payload must not come buffered here (gfw can do this and detect trojan authentication
-                // but the client is not supposed to send small segments)
-                // so , if its incomplete we go to fallback!
-                // this is also mentioned in standard trojan docs (first packet also contains part of final payload)
-                size_t len = sbufGetBufLength(c->payload);
-                if (len < (sizeof(sha224_hex_t) + kCRLFLen))
-                {
-                    // invalid protocol
-                    LOGW("TrojanAuthServer: detected non trojan protocol, rejected");
-                    goto failed;
-                }
-
-                if (((unsigned char *) sbufGetRawPtr(c->payload))[sizeof(sha224_hex_t)] != '\r' ||
-                    ((unsigned char *) sbufGetRawPtr(c->payload))[sizeof(sha224_hex_t) + 1] != '\n')
-                {
-                    LOGW("TrojanAuthServer: detected non trojan protocol, rejected");
-                    goto failed;
-                }
-
-                hash_t kh = calcHashBytes(sbufGetRawPtr(c->payload), sizeof(sha224_hex_t));
-
-                hmap_users_t_iter find_result = hmap_users_t_find(&(state->users), kh);
-                if (find_result.ref == hmap_users_t_end(&(state->users)).ref)
-                {
-                    // user not in database
-                    LOGW("TrojanAuthServer: a trojan-user rejected because not found in database");
-                    goto failed;
-                }
-                trojan_user_t *tuser = (find_result.ref->second);
-                if (! tuser->user.enable)
-                {
-                    // user disabled
-                    LOGW("TrojanAuthServer: user \"%s\" rejected because not enabled", tuser->user.name);
-
-                    goto failed;
-                }
-                LOGD("TrojanAuthServer: user \"%s\" accepted", tuser->user.name);
-                cstate->authenticated = true;
-                lineAuthenticate(c->line);
-                cstate->init_sent = true;
-                self->up->upStream(self->up, contextCreateInit(c->line));
-                if (! lineIsAlive(c->line))
-                {
-                    contextReusePayload(c);
-                    contextDestroy(c);
-                    return;
-                }
-
-                sbufShiftRight(c->payload, sizeof(sha224_hex_t) + kCRLFLen);
-                self->up->upStream(self->up, c);
-            }
-            // getTimeOfDay(&tv2, NULL);
-            // double time_spent = (double)(tv2.tv_usec - tv1.tv_usec) / 1000000 + (double)(tv2.tv_sec -
-            // tv1.tv_sec); LOGD("Auth: took %lf sec", time_spent);
+            self->dw->fnPauseD(self->dw, ls->line);
         }
         else
         {
-            goto failed;
+            self->dw->fnResumeD(self->dw, ls->line);
         }
     }
     else
     {
-        if (c->init)
+        if (pause)
         {
-            cstate        = memoryAllocate(sizeof(trojan_auth_server_con_state_t));
-            *cstate       = (trojan_auth_server_con_state_t) {0};
-            CSTATE_MUT(c) = cstate;
-            contextDestroy(c);
+            self->up->fnPauseU(self->up, ls->line);
         }
-        else if (c->fin)
+        else
         {
-            bool init_sent = cstate->init_sent;
-            bool auth      = cstate->authenticated;
-            memoryFree(CSTATE(c));
-            CSTATE_DROP(c);
-            if (init_sent)
-            {
-                if (auth)
-                {
-                    self->up->upStream(self->up, c);
-                }
-                else
-                {
-                    state->fallback->upStream(state->fallback, c);
-                }
-            }
-            else
-            {
-                contextDestroy(c);
-            }
+            self->up->fnResumeU(self->up, ls->line);
         }
     }
+}
 
-    return;
-failed:
-    if (state->fallback != NULL)
+static void onShaperTimer(wtimer_t *timer)
+{
+    trojan_auth_server_lstate_t *ls  = weventGetUserdata(timer);
+    user_dir_e                   dir = ls->shaper_timer[kUserDirUp] == timer ? kUserDirUp : kUserDirDown;
+
+    wtimerDelete(timer);
+    ls->shaper_timer[dir] = NULL;
+
+    uint32_t wait_ms = userShaperRefill(&ls->tuser->user, getWID(), dir);
+    if (wait_ms == 0)
     {
-        goto fallback;
+        // the neighbour still holds its own pause, its resume will follow
+        if (! ls->peer_paused[dir])
+        {
+            sendShaperSignal(ls, dir, false);
+        }
+        return;
     }
+    ls->shaper_timer[dir] = wtimerAdd(getWorkerLoop(getWID()), onShaperTimer, wait_ms, 1);
+    weventSetUserData(ls->shaper_timer[dir], ls);
+}
 
-    // disconnect:
-    contextReusePayload(c);
-    memoryFree(CSTATE(c));
-    CSTATE_DROP(c);
-    context_t *reply = contextCreateFinFrom(c);
-    contextDestroy(c);
-    self->dw->downStream(self->dw, reply);
-    return;
-fallback:
-    if (! cstate->init_sent)
+/*
+    called after the payload is passed, so the data is never dropped; the sender is paused until the user
+    bucket pays back the debt
+*/
+static void shapeLine(trojan_auth_server_lstate_t *ls, user_dir_e dir)
+{
+    if (ls->shaper_timer[dir] != NULL)
+    {
+        return; // already paused
+    }
+    uint32_t wait_ms = userShaperRefill(&ls->tuser->user, getWID(), dir);
+    if (wait_ms == 0)
     {
-        cstate->init_sent = true;
-        state->fallback->upStream(state->fallback, contextCreateInit(c->line));
-        if (! lineIsAlive(c->line))
+        return;
+    }
+    ls->shaper_timer[dir] = wtimerAdd(getWorkerLoop(getWID()), onShaperTimer, wait_ms, 1);
+    weventSetUserData(ls->shaper_timer[dir], ls);
+    sendShaperSignal(ls, dir, true);
+}
+
+static void upStreamInit(tunnel_t *self, line_t *line)
+{
+    trojan_auth_server_lstate_t *ls = lineGetState(self, line);
+
+    // the init goes up (or to the fallback) once the first packet tells who the client is
+    *ls = (trojan_auth_server_lstate_t) {.tunnel = self, .line = line};
+}
+
+static void upStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
+{
+    trojan_auth_server_state_t  *state = tunnelGetState(self);
+    trojan_auth_server_lstate_t *ls    = lineGetState(self, line);
+
+    if (ls->authenticated)
+    {
+        bool shape = ! userAccount(&ls->tuser->user, getWID(), kUserDirUp, sbufGetBufLength(payload));
+
+        lineLock(line);
+        self->up->fnPayloadU(self->up, line, payload);
+        if (shape && lineIsAlive(line))
         {
-            contextReusePayload(c);
-            contextDestroy(c);
-            return;
+            shapeLine(ls, kUserDirUp);
         }
+        lineUnlock(line);
+        return;
     }
-    if (state->fallback_delay <= 0)
+
+    if (ls->first_packet_received)
+    {
+        rejectPayload(self, line, payload);
+        return;
+    }
+    ls->first_packet_received = true;
+
+    // beware! trojan auth will not use stream buffer, at least the auth chunk must come in first sequence
+    // the payload must not come buffered here (gfw can do this and detect trojan authentication
+    // but the client is not supposed to send small segments)
+    // so , if its incomplete we go to fallback!
+    // this is also mentioned in standard trojan docs (first packet also contains part of final payload)
+    size_t len = sbufGetBufLength(payload);
+    if (len < (sizeof(sha224_hex_t) + kCRLFLen))
+    {
+        // invalid protocol
+        LOGW("TrojanAuthServer: detected non trojan protocol, rejected");
+        rejectPayload(self, line, payload);
+        return;
+    }
+
+    if (((unsigned char *) sbufGetRawPtr(payload))[sizeof(sha224_hex_t)] != '\r' ||
+        ((unsigned char *) sbufGetRawPtr(payload))[sizeof(sha224_hex_t) + 1] != '\n')
+    {
+        LOGW("TrojanAuthServer: detected non trojan protocol, rejected");
+        rejectPayload(self, line, payload);
+        return;
+    }
+
+    hash_t kh = calcHashBytes(sbufGetRawPtr(payload), sizeof(sha224_hex_t));
+
+    hmap_users_t_iter find_result = hmap_users_t_find(&(state->users), kh);
+    if (find_result.ref == hmap_users_t_end(&(state->users)).ref)
+    {
+        // user not in database
+        LOGW("TrojanAuthServer: a trojan-user rejected because not found in database");
+        rejectPayload(self, line, payload);
+        return;
+    }
+    trojan_user_t *tuser = (find_result.ref->second);
+    if (! tuser->user.enable)
+    {
+        // user disabled
+        LOGW("TrojanAuthServer: user \"%s\" rejected because not enabled", tuser->user.name);
+        rejectPayload(self, line, payload);
+        return;
+    }
+    LOGD("TrojanAuthServer: user \"%s\" accepted", tuser->user.name);
+    ls->authenticated = true;
+    ls->tuser         = tuser;
+    userConnectionOpened(&tuser->user, getWID());
+    lineAuthenticate(line);
+    ls->init_sent = true;
+
+    lineLock(line);
+    self->up->fnInitU(self->up, line);
+    if (! lineIsAlive(line))
+    {
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
+        lineUnlock(line);
+        return;
+    }
+    lineUnlock(line);
+
+    sbufShiftRight(payload, sizeof(sha224_hex_t) + kCRLFLen);
+    userAccount(&tuser->user, getWID(), kUserDirUp, sbufGetBufLength(payload));
+    self->up->fnPayloadU(self->up, line, payload);
+}
+
+static void upStreamFin(tunnel_t *self, line_t *line)
+{
+    cleanupAndFinUp(self, line);
+}
+
+// the client can not take more, stop the side that feeds the download direction
+static void upStreamPause(tunnel_t *self, line_t *line)
+{
+    trojan_auth_server_state_t  *state = tunnelGetState(self);
+    trojan_auth_server_lstate_t *ls    = lineGetState(self, line);
+
+    ls->peer_paused[kUserDirDown] = true;
+    if (! ls->init_sent)
+    {
+        return;
+    }
+    if (ls->authenticated)
+    {
+        self->up->fnPauseU(self->up, line);
+    }
+    else
+    {
+        state->fallback->fnPauseU(state->fallback, line);
+    }
+}
+
+static void upStreamResume(tunnel_t *self, line_t *line)
+{
+    trojan_auth_server_state_t  *state = tunnelGetState(self);
+    trojan_auth_server_lstate_t *ls    = lineGetState(self, line);
+
+    ls->peer_paused[kUserDirDown] = false;
+    if (! ls->init_sent)
     {
-        state->fallback->upStream(state->fallback, c);
+        return;
+    }
+    if (ls->authenticated)
+    {
+        // while the shaper holds the download direction, its timer resumes it
+        if (ls->shaper_timer[kUserDirDown] == NULL)
+        {
+            self->up->fnResumeU(self->up, line);
+        }
     }
     else
     {
-        wtimer_t *t = wtimerAdd(getWorkerLoop(c->line), onFallbackTimer, state->fallback_delay, 1);
-        weventSetUserData(t, newTimerData(self, c));
+        state->fallback->fnResumeU(state->fallback, line);
     }
 }
 
-static void downStream(tunnel_t *self, context_t *c)
+static void downStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
-    if (c->fin)
+    trojan_auth_server_lstate_t *ls = lineGetState(self, line);
+
+    if (ls->tuser == NULL)
+    {
+        // fallback
+        self->dw->fnPayloadD(self->dw, line, payload);
+        return;
+    }
+
+    bool shape = ! userAccount(&ls->tuser->user, getWID(), kUserDirDown, sbufGetBufLength(payload));
+
+    lineLock(line);
+    self->dw->fnPayloadD(self->dw, line, payload);
+    if (shape && lineIsAlive(line))
     {
-        memoryFree(CSTATE(c));
-        CSTATE_DROP(c);
+        shapeLine(ls, kUserDirDown);
     }
-    self->dw->downStream(self->dw, c);
+    lineUnlock(line);
 }
 
-static void parse(tunnel_t *t, cJSON *settings, node_instance_context_t *instance_info)
+static void downStreamFin(tunnel_t *self, line_t *line)
 {
-    trojan_auth_server_state_t *state = t->state;
+    cleanup(self, line);
+    self->dw->fnFinD(self->dw, line);
+}
+
+static void downStreamPause(tunnel_t *self, line_t *line)
+{
+    trojan_auth_server_lstate_t *ls = lineGetState(self, line);
+
+    ls->peer_paused[kUserDirUp] = true;
+    self->dw->fnPauseD(self->dw, line);
+}
+
+static void downStreamResume(tunnel_t *self, line_t *line)
+{
+    trojan_auth_server_lstate_t *ls = lineGetState(self, line);
+
+    ls->peer_paused[kUserDirUp] = false;
+    if (ls->shaper_timer[kUserDirUp] == NULL)
+    {
+        self->dw->fnResumeD(self->dw, line);
+    }
+}
+
+static void parse(tunnel_t *t, const cJSON *settings, node_t *node)
+{
+    trojan_auth_server_state_t *state = tunnelGetState(t);
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: TrojanAuthServer->Settings (object field) was empty or invalid");
@@ -261,6 +445,7 @@ static void parse(tunnel_t *t, cJSON *settings, node_instance_context_t *instanc
             memorySet(tuser, 0, sizeof(trojan_user_t));
             tuser->user = *user;
             memoryFree(user);
+            userCreateWorkerStats(&tuser->user);
             sha224((uint8_t *) tuser->user.uid, strlen(tuser->user.uid), &(tuser->sha224_of_user_uid[0]));
 
             for (size_t i = 0; i < sizeof(sha224_t); i++)
@@ -298,7 +483,7 @@ static void parse(tunnel_t *t, cJSON *settings, node_instance_context_t *instanc
         }
 
         hash_t  hash_next     = calcHashBytes(fallback_node_name, strlen(fallback_node_name));
-        node_t *fallback_node = nodemanagerGetNode(instance_info->node_manager_config, hash_next);
+        node_t *fallback_node = nodemanagerGetNode(node->node_manager_config, hash_next);
         if (fallback_node == NULL)
         {
             LOGF("TrojanAuthServer: fallback node not found");
@@ -306,36 +491,44 @@ static void parse(tunnel_t *t, cJSON *settings, node_instance_context_t *instanc
         }
         if (fallback_node->instance == NULL)
         {
-            nodemanagerRunNode(instance_info->node_manager_config, fallback_node, instance_info->chain_index + 1);
+            nodemanagerRunNode(node->node_manager_config, fallback_node, 0);
         }
         state->fallback = fallback_node->instance;
-
-        if (state->fallback != NULL)
-        {
-            state->fallback->dw = t;
-        }
     }
     memoryFree(fallback_node_name);
 }
 
-tunnel_t *newTrojanAuthServer(node_instance_context_t *instance_info)
+tunnel_t *newTrojanAuthServer(node_t *node)
 {
-    trojan_auth_server_state_t *state = memoryAllocate(sizeof(trojan_auth_server_state_t));
-    memorySet(state, 0, sizeof(trojan_auth_server_state_t));
-    state->users    = hmap_users_t_with_capacity(kVecCap);
-    cJSON *settings = instance_info->node_settings_json;
+    const cJSON *settings = node->node_settings_json;
 
     if (! (cJSON_IsObject(settings) && settings->child != NULL))
     {
         LOGF("JSON Error: TrojanAuthServer->settings (object field) : The object was empty or invalid");
         return NULL;
     }
-    tunnel_t *t = tunnelCreate();
-    t->state    = state;
 
-    t->upStream   = &upStream;
-    t->downStream = &downStream;
-    parse(t, settings, instance_info);
+    tunnel_t *t = tunnelCreate(node, sizeof(trojan_auth_server_state_t), sizeof(trojan_auth_server_lstate_t));
+
+    t->fnInitU    = &upStreamInit;
+    t->fnPayloadU = &upStreamPayload;
+    t->fnFinU     = &upStreamFin;
+    t->fnPauseU   = &upStreamPause;
+    t->fnResumeU  = &upStreamResume;
+    t->fnPayloadD = &downStreamPayload;
+    t->fnFinD     = &downStreamFin;
+    t->fnPauseD   = &downStreamPause;
+    t->fnResumeD  = &downStreamResume;
+
+    trojan_auth_server_state_t *state = tunnelGetState(t);
+    state->users                      = hmap_users_t_with_capacity(kVecCap);
+
+    parse(t, settings, node);
+
+    if (state->fallback != NULL)
+    {
+        tunnelBindDown(t, state->fallback);
+    }
 
     return t;
 }
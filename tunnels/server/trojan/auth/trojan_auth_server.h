@@ -1,5 +1,5 @@
 #pragma once
-#include "api.h"
+#include "wwapi.h"
 #include "shared/trojan/trojan_types.h"
 
 //
@@ -9,7 +9,7 @@
 //
 //
 
-tunnel_t         *newTrojanAuthServer(node_instance_context_t *instance_info);
+tunnel_t         *newTrojanAuthServer(node_t *node);
 api_result_t      apiTrojanAuthServer(tunnel_t *self, const char *msg);
 tunnel_t         *destroyTrojanAuthServer(tunnel_t *self);
 tunnel_metadata_t getMetadataTrojanAuthServer(void);
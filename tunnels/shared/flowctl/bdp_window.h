@@ -0,0 +1,162 @@
+#pragma once
+#include "wwapi.h"
+
+/*
+    Bandwidth delay product driven flow control window (in the spirit of gRPC's BDP probing)
+
+    One probe per round trip measures how many bytes the peer delivered during that round trip, that is the
+    bandwidth delay product the path has shown. When a sample fills more than 2/3 of the window and the bandwidth of
+    the sample beats the best seen so far, the window is what limits the line: it grows to 2 * sample. Samples that
+    stay below 1/4 of the window for kBdpShrinkAfterProbes probes in a row shrink it back to 2 * sample, so slow or
+    idle lines give their memory back.
+
+    The window stays inside [min_window, max_window] of the node settings, and every byte above min_window is charged
+    to a budget that all lines of the node on one worker share: with thousands of lines the sum of their windows
+    can not pass the budget, a line that finds the budget spent keeps its current window.
+
+    Two ways to feed it:
+      sender side (ProtoBuf)  bdpwindowOnSent when data leaves, bdpwindowOnAcked when the peer acknowledges;
+                              a probe starts with a send and ends when the acks pass the last byte sent before it
+      receiver side (HTTP/2)  bdpwindowProbeStart when a PING goes out, bdpwindowOnAcked for every received DATA byte,
+                              bdpwindowProbeEnd when the PING ACK comes back
+
+    A window is owned by the worker of its line, no atomics.
+*/
+
+enum
+{
+    kBdpShrinkAfterProbes = 8
+};
+
+typedef struct bdp_budget_s
+{
+    uint64_t committed; // sum of (window - min_window) of the lines
+    uint64_t limit;
+
+} bdp_budget_t;
+
+typedef struct bdp_window_s
+{
+    bdp_budget_t *budget;
+    uint64_t      sent_total;
+    uint64_t      acked_total;
+    uint64_t      probe_seq;        // sent_total when the probe started (sender side)
+    uint64_t      probe_acked_base; // acked_total when the probe started
+    uint64_t      probe_start_us;
+    double        peak_bandwidth; // bytes per us
+    uint32_t      window;
+    uint32_t      min_window;
+    uint32_t      max_window;
+    uint32_t      rtt_us; // of the last probe
+    uint8_t       small_samples;
+    bool          probing;
+    bool          ack_clocked; // the probe ends by acks (sender side) rather than by bdpwindowProbeEnd
+
+} bdp_window_t;
+
+static inline void bdpwindowInit(bdp_window_t *w, bdp_budget_t *budget, uint32_t min_window, uint32_t max_window)
+{
+    *w = (bdp_window_t) {.budget     = budget,
+                         .window     = min_window,
+                         .min_window = min_window,
+                         .max_window = max(min_window, max_window)};
+}
+
+static inline void bdpwindowDestroy(bdp_window_t *w)
+{
+    w->budget->committed -= w->window - w->min_window;
+}
+
+static inline uint32_t bdpwindowGet(const bdp_window_t *w)
+{
+    return w->window;
+}
+
+static inline void bdpwindowProbeStart(bdp_window_t *w, uint64_t now_us)
+{
+    w->probing          = true;
+    w->ack_clocked      = false;
+    w->probe_start_us   = now_us;
+    w->probe_seq        = w->sent_total;
+    w->probe_acked_base = w->acked_total;
+}
+
+static inline void bdpwindowResize(bdp_window_t *w, uint32_t wanted)
+{
+    wanted = min(max(wanted, w->min_window), w->max_window);
+    if (wanted > w->window)
+    {
+        uint64_t grow = wanted - w->window;
+        uint64_t room = w->budget->limit > w->budget->committed ? w->budget->limit - w->budget->committed : 0;
+        grow          = min(grow, room);
+        w->budget->committed += grow;
+        w->window += (uint32_t) grow;
+    }
+    else
+    {
+        w->budget->committed -= w->window - wanted;
+        w->window = wanted;
+    }
+}
+
+// ends the running probe, returns true when the window changed
+static inline bool bdpwindowProbeEnd(bdp_window_t *w, uint64_t now_us)
+{
+    if (! w->probing)
+    {
+        return false;
+    }
+    w->probing = false;
+
+    w->rtt_us = (uint32_t) max((uint64_t) 1, now_us - w->probe_start_us);
+
+    const uint64_t sample    = w->acked_total - w->probe_acked_base;
+    const uint32_t old       = w->window;
+    const double   bandwidth = (double) sample / w->rtt_us;
+
+    if (bandwidth > w->peak_bandwidth)
+    {
+        w->peak_bandwidth = bandwidth;
+        w->small_samples  = 0;
+        if (sample * 3 > (uint64_t) w->window * 2)
+        {
+            bdpwindowResize(w, (uint32_t) min(sample * 2, (uint64_t) UINT32_MAX));
+        }
+    }
+    else if (sample * 4 < w->window)
+    {
+        if (++w->small_samples >= kBdpShrinkAfterProbes)
+        {
+            // the path changed or the line went quiet, start measuring the peak again from here
+            w->small_samples  = 0;
+            w->peak_bandwidth = bandwidth;
+            bdpwindowResize(w, (uint32_t) (sample * 2));
+        }
+    }
+    else
+    {
+        w->small_samples = 0;
+    }
+    return w->window != old;
+}
+
+static inline void bdpwindowOnSent(bdp_window_t *w, uint64_t bytes, uint64_t now_us)
+{
+    if (! w->probing)
+    {
+        bdpwindowProbeStart(w, now_us);
+        w->ack_clocked = true;
+    }
+    w->sent_total += bytes;
+}
+
+// acknowledged bytes (sender side) or received bytes (receiver side), returns true when the window changed
+static inline bool bdpwindowOnAcked(bdp_window_t *w, uint64_t bytes, uint64_t now_us)
+{
+    w->acked_total += bytes;
+    if (w->probing && w->ack_clocked && w->acked_total > w->probe_seq)
+    {
+        return bdpwindowProbeEnd(w, now_us);
+    }
+    return false;
+}
@@ -0,0 +1,279 @@
+#pragma once
+#include "wwapi.h"
+#include "buffer_queue.h"
+#include "http2_def.h"
+#include "nghttp2/nghttp2.h"
+
+/*
+    Zero copy DATA frames for Http2Client and Http2Server
+
+    Stream payloads wait in a queue of their stream that nghttp2 reads through a data provider with
+    NGHTTP2_DATA_FLAG_NO_COPY: nghttp2 only decides how many bytes the next DATA frame carries (flow control, max
+    frame size) and hands the 9 byte frame header to the send_data callback, which writes it into the left padding
+    of the payload buffer (the gRPC prefix is already there) and passes the same sbuf_t on. A buffer is split only
+    when a frame ends inside it, then the smaller side is copied.
+
+    The callbacks run inside nghttp2_session_mem_send where nothing may be written to a line (the write could
+    close the connection and free the session under nghttp2), so the frames wait in the frame queue of the
+    connection and the tunnel flushes them after mem_send returns, before the bytes it returned.
+
+    A source outlives the stream state: a finished stream still drains its queue and ends with END_STREAM (or the
+    gRPC trailers), so sources are allocated on their own, kept in a list of the connection and freed when nghttp2
+    closes the stream or the connection goes away. A source keeps its stream line locked.
+
+    Everything here is owned by the worker of the connection.
+*/
+
+enum
+{
+    kHttp2SourceHighWater = (1 << 20), // queued bytes that pause the writer of the stream
+    kHttp2SourceLowWater  = (1 << 18)  // and resume it
+};
+
+typedef struct http2_data_source_s
+{
+    struct http2_data_source_s *next;
+    buffer_queue_t             *queue;
+    line_t                     *line; // the stream line
+    int32_t                     stream_id;
+    bool                        deferred; // the read callback found the queue empty, resume on the next push
+    bool                        eof;
+    bool                        grpc_trailers; // end with grpc-status trailers instead of END_STREAM on DATA
+    bool                        paused;        // the writer of the stream is paused by this source
+
+} http2_data_source_t;
+
+typedef struct http2_out_frame_s
+{
+    sbuf_t *buf;
+    line_t *stream_line; // locked until the frame is written
+
+} http2_out_frame_t;
+
+#define i_type http2_frame_queue_t // NOLINT
+#define i_key  http2_out_frame_t   // NOLINT
+#include "stc/deque.h"
+
+static nghttp2_ssize http2datasourceRead(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                                         uint32_t *data_flags, nghttp2_data_source *source, void *userdata)
+{
+    (void) buf;
+    (void) userdata;
+    http2_data_source_t *s = source->ptr;
+
+    if (bufferqueueLen(s->queue) == 0 && ! s->eof)
+    {
+        s->deferred = true;
+        return NGHTTP2_ERR_DEFERRED;
+    }
+
+    size_t len = 0;
+    if (bufferqueueLen(s->queue) > 0)
+    {
+        *data_flags |= NGHTTP2_DATA_FLAG_NO_COPY;
+        len = min(length, (size_t) sbufGetBufLength(bufferqueueFront(s->queue)));
+    }
+
+    if (s->eof && len == bufferqueueBytes(s->queue))
+    {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+        if (s->grpc_trailers)
+        {
+            const nghttp2_nv trailers[] = {{.name     = (uint8_t *) "grpc-status",
+                                            .value    = (uint8_t *) "0",
+                                            .namelen  = sizeof("grpc-status") - 1,
+                                            .valuelen = sizeof("0") - 1,
+                                            .flags    = NGHTTP2_NV_FLAG_NONE}};
+
+            *data_flags |= NGHTTP2_DATA_FLAG_NO_END_STREAM;
+            nghttp2_submit_trailer(session, stream_id, trailers, ARRAY_SIZE(trailers));
+        }
+    }
+    return (nghttp2_ssize) len;
+}
+
+/**
+ * Creates the source of a stream and attaches it to the stream as its data provider.
+ * @param session The nghttp2 session.
+ * @param list The source list of the connection.
+ * @param stream_id The stream.
+ * @param line The stream line, locked by the source.
+ * @return The source, NULL when nghttp2 refused it (the stream is closed).
+ */
+static inline http2_data_source_t *http2datasourceSubmit(nghttp2_session *session, http2_data_source_t **list,
+                                                         int32_t stream_id, line_t *line)
+{
+    http2_data_source_t *s = memoryAllocate(sizeof(http2_data_source_t));
+    *s                     = (http2_data_source_t) {.queue     = bufferqueueCreate(getWorkerBufferPool(getWID())),
+                                                    .line      = line,
+                                                    .stream_id = stream_id};
+
+    nghttp2_data_provider2 provider = {.source.ptr = s, .read_callback = http2datasourceRead};
+    if (nghttp2_submit_data2(session, NGHTTP2_FLAG_NONE, stream_id, &provider) != 0)
+    {
+        bufferqueueDestory(s->queue);
+        memoryFree(s);
+        return NULL;
+    }
+    lineLock(line);
+    s->next = *list;
+    *list   = s;
+    return s;
+}
+
+static inline void http2datasourceFree(http2_data_source_t *s)
+{
+    bufferqueueDestory(s->queue);
+    lineUnlock(s->line);
+    memoryFree(s);
+}
+
+// called when nghttp2 closes the stream, it will not read the source again
+static inline void http2datasourceRemove(http2_data_source_t **list, int32_t stream_id)
+{
+    for (http2_data_source_t **i = list; *i; i = &(*i)->next)
+    {
+        if ((*i)->stream_id == stream_id)
+        {
+            http2_data_source_t *s = *i;
+            *i                     = s->next;
+            http2datasourceFree(s);
+            return;
+        }
+    }
+}
+
+static inline void http2datasourceRemoveAll(http2_data_source_t **list)
+{
+    while (*list)
+    {
+        http2_data_source_t *s = *list;
+        *list                  = s->next;
+        http2datasourceFree(s);
+    }
+}
+
+static inline void http2datasourceWakeUp(nghttp2_session *session, http2_data_source_t *s)
+{
+    if (s->deferred)
+    {
+        s->deferred = false;
+        nghttp2_session_resume_data(session, s->stream_id);
+    }
+}
+
+/**
+ * Queues a payload (gRPC prefix already in place) of the stream.
+ * @param session The nghttp2 session.
+ * @param s The data source of the stream.
+ * @param buf The payload.
+ * @return true when the writer of the stream should pause, http2datasourcePopResumable tells when it can go on.
+ */
+static inline bool http2datasourcePush(nghttp2_session *session, http2_data_source_t *s, sbuf_t *buf)
+{
+    bufferqueuePush(s->queue, buf);
+    http2datasourceWakeUp(session, s);
+
+    if (! s->paused && bufferqueueBytes(s->queue) > kHttp2SourceHighWater)
+    {
+        s->paused = true;
+        return true;
+    }
+    return false;
+}
+
+// no more payloads, the stream ends once the queue is drained
+static inline void http2datasourceEnd(nghttp2_session *session, http2_data_source_t *s, bool grpc_trailers)
+{
+    s->eof           = true;
+    s->grpc_trailers = grpc_trailers;
+    http2datasourceWakeUp(session, s);
+}
+
+// true when every queued payload has been framed, closing the connection loses nothing
+static inline bool http2datasourceAllSent(const http2_data_source_t *list)
+{
+    for (const http2_data_source_t *s = list; s; s = s->next)
+    {
+        if (bufferqueueLen(s->queue) > 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// returns a source whose paused writer can go on (and clears its mark), NULL when there is none
+static inline http2_data_source_t *http2datasourcePopResumable(http2_data_source_t *list)
+{
+    for (http2_data_source_t *s = list; s; s = s->next)
+    {
+        if (s->paused && bufferqueueBytes(s->queue) <= kHttp2SourceLowWater)
+        {
+            s->paused = false;
+            if (lineIsAlive(s->line))
+            {
+                return s;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The body of the send_data callback: takes the payload of the frame from the source, puts the frame header in
+ * front of it and queues it for the connection. Only frames with payload come here, an empty DATA frame that ends
+ * the stream is made by nghttp2 itself.
+ * @param frames The frame queue of the connection.
+ * @param framehd The 9 byte frame header from nghttp2.
+ * @param length The payload length, what the read callback returned.
+ * @param source The data source of the stream.
+ * @return 0
+ */
+static inline int http2datasourceSendFrame(http2_frame_queue_t *frames, const uint8_t *framehd, size_t length,
+                                           nghttp2_data_source *source)
+{
+    http2_data_source_t *s    = source->ptr;
+    sbuf_t              *buf  = bufferqueuePop(s->queue);
+    const uint32_t       rest = sbufGetBufLength(buf) - (uint32_t) length;
+
+    if (rest > 0)
+    {
+        // a window or the max frame size ended the frame inside this buffer, copy the smaller side
+        sbuf_t *copy = bufferpoolGetLargeBuffer(getWorkerBufferPool(getWID()));
+        if (rest < length)
+        {
+            copy = sbufReserveSpace(copy, rest);
+            sbufSetLength(copy, rest);
+            memoryCopy(sbufGetMutablePtr(copy), sbufGetRawPtr(buf) + length, rest);
+            sbufSetLength(buf, (uint32_t) length);
+            bufferqueuePushFront(s->queue, copy);
+        }
+        else
+        {
+            copy = sbufReserveSpace(copy, (uint32_t) length);
+            sbufSetLength(copy, (uint32_t) length);
+            memoryCopy(sbufGetMutablePtr(copy), sbufGetRawPtr(buf), length);
+            sbufShiftRight(buf, (uint32_t) length);
+            bufferqueuePushFront(s->queue, buf);
+            buf = copy;
+        }
+    }
+
+    sbufShiftLeft(buf, HTTP2_FRAME_HDLEN);
+    memoryCopy(sbufGetMutablePtr(buf), framehd, HTTP2_FRAME_HDLEN);
+
+    lineLock(s->line);
+    http2_frame_queue_t_push(frames, (http2_out_frame_t) {.buf = buf, .stream_line = s->line});
+    return 0;
+}
+
+static inline void http2datasourceDropFrames(http2_frame_queue_t *frames)
+{
+    c_foreach(k, http2_frame_queue_t, *frames)
+    {
+        bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), k.ref->buf);
+        lineUnlock(k.ref->stream_line);
+    }
+    http2_frame_queue_t_drop(frames);
+}
@@ -1,4 +1,4 @@
-
+#pragma once
 #include "wsocket.h"
 #include <stdint.h>
 #include <stdlib.h>
@@ -1,4 +1,5 @@
 #pragma once
+#include "frame_decoder.h"
 #include "shiftbuffer.h"
 #include <stdint.h>
 
@@ -25,6 +26,10 @@ enum
     kMuxMaxFrameLength = (1U << (8*sizeof(mux_length_t))) - (1+kMuxMinFrameLength)
 };
 
+// how the main line is cut into frames, the length field counts the bytes after itself
+static const frame_format_t kMuxFrameFormat = {
+    .min_length = kMuxMinFrameLength, .max_length = UINT16_MAX, .length_size = sizeof(mux_length_t)};
+
 
 
 
@@ -0,0 +1,97 @@
+#pragma once
+#include "wwapi.h"
+
+/*
+    Demand driven sizing of a per worker pool of ready outbound connections (PreConnectClient, ReverseClient)
+
+    The pool should hold just enough connections to serve the checkouts that arrive while a refill is still
+    connecting: target = checkout rate * connect time * kAdaptivePoolHeadroom (Little's law with room for bursts),
+    clamped to [min, max] of the node settings.
+
+    Both inputs are EWMAs: the checkout rate is folded in once per kAdaptivePoolWindowMs (the owner calls
+    adaptivepoolTick from a timer, so the rate also decays when nobody checks out), the connect time is fed
+    on every established pool connection. Connections above the target that stayed unused for
+    kAdaptivePoolIdleTrimMs are trimmed one per tick.
+
+    Refills are delayed by a random jitter so workers (and instances) that lost their connections at the same
+    moment do not reconnect in lockstep.
+
+    Everything here is owned by one worker, no atomics.
+*/
+
+enum
+{
+    kAdaptivePoolWindowMs     = 1000,
+    kAdaptivePoolIdleTrimMs   = 30 * 1000,
+    kAdaptivePoolHeadroom     = 2,
+    kAdaptivePoolInitialRttMs = 250 // until the first connection is measured
+};
+
+#define kAdaptivePoolEwmaWeight 0.3
+
+typedef struct adaptive_pool_s
+{
+    double   checkout_rate;  // per second
+    double   connect_rtt_ms; // 0 until the first sample
+    uint64_t window_start_ms;
+    uint64_t last_checkout_ms;
+    uint32_t window_checkouts;
+    uint32_t min_size;
+    uint32_t max_size;
+    uint32_t target;
+
+} adaptive_pool_t;
+
+static inline void adaptivepoolInit(adaptive_pool_t *p, uint32_t min_size, uint32_t max_size, uint64_t now_ms)
+{
+    *p = (adaptive_pool_t) {.window_start_ms  = now_ms,
+                            .last_checkout_ms = now_ms,
+                            .min_size         = min_size,
+                            .max_size         = max(min_size, max_size),
+                            .target           = min_size};
+}
+
+static inline void adaptivepoolOnCheckout(adaptive_pool_t *p, uint64_t now_ms)
+{
+    p->window_checkouts += 1;
+    p->last_checkout_ms = now_ms;
+}
+
+static inline void adaptivepoolOnConnected(adaptive_pool_t *p, uint64_t connect_ms)
+{
+    p->connect_rtt_ms = p->connect_rtt_ms == 0
+                            ? (double) connect_ms
+                            : (kAdaptivePoolEwmaWeight * (double) connect_ms) +
+                                  ((1.0 - kAdaptivePoolEwmaWeight) * p->connect_rtt_ms);
+}
+
+// folds the finished window into the rate and recomputes the target, returns the target
+static inline uint32_t adaptivepoolTick(adaptive_pool_t *p, uint64_t now_ms)
+{
+    if (now_ms < p->window_start_ms + kAdaptivePoolWindowMs)
+    {
+        return p->target;
+    }
+    double window_rate = (double) p->window_checkouts * 1000.0 / (double) (now_ms - p->window_start_ms);
+
+    p->checkout_rate =
+        (kAdaptivePoolEwmaWeight * window_rate) + ((1.0 - kAdaptivePoolEwmaWeight) * p->checkout_rate);
+    p->window_checkouts = 0;
+    p->window_start_ms  = now_ms;
+
+    double   rtt_ms = p->connect_rtt_ms > 0 ? p->connect_rtt_ms : kAdaptivePoolInitialRttMs;
+    uint32_t needed = (uint32_t) (p->checkout_rate * rtt_ms / 1000.0 * kAdaptivePoolHeadroom) + 1;
+    p->target       = min(max(needed, p->min_size), p->max_size);
+    return p->target;
+}
+
+static inline bool adaptivepoolShouldTrim(const adaptive_pool_t *p, uint32_t unused, uint64_t now_ms)
+{
+    return unused > p->target && now_ms >= p->last_checkout_ms + kAdaptivePoolIdleTrimMs;
+}
+
+// base delay plus up to 50% random jitter
+static inline unsigned int adaptivepoolJitter(unsigned int base_ms)
+{
+    return base_ms + (fastRand() % (base_ms / 2 + 1));
+}
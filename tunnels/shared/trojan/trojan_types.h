@@ -1,6 +1,7 @@
 #pragma once
 
 
+#include "objects/user.h"
 #include "sha2.h"
 
 typedef unsigned char sha224_t[SHA224_DIGEST_SIZE];
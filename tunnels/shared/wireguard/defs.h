@@ -63,7 +63,7 @@ typedef struct wireguard_keypair_s
     uint32_t last_tx;
     uint32_t last_rx;
     uint32_t kepair_ms;
-    uint32_t replay_mitmap;
+    uint32_t replay_bitmap;
     bool     valid;
     bool     is_client_side;
     bool     sending_valid;
@@ -0,0 +1,285 @@
+#include "waffinity.h"
+#include "wsysinfo.h"
+
+#ifdef OS_LINUX
+#include <dirent.h>
+#include <sched.h>
+#endif
+
+static bool cpuListContains(const cpu_list_t *list, int cpu)
+{
+    for (uint16_t i = 0; i < list->count; i++)
+    {
+        if (list->cpus[i] == cpu)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void cpuListAdd(cpu_list_t *list, int cpu)
+{
+    if (cpu < 0 || cpu >= kAffinityMaxCpus || list->count == kAffinityMaxCpus || cpuListContains(list, cpu))
+    {
+        return;
+    }
+    list->cpus[list->count++] = (uint16_t) cpu;
+}
+
+bool affinityParseCpuList(const char *str, cpu_list_t *out)
+{
+    const char *p = str;
+
+    while (*p != '\0')
+    {
+        while (*p == ' ' || *p == ',')
+        {
+            p++;
+        }
+        if (*p == '\0' || *p == '\n')
+        {
+            break;
+        }
+
+        char *end;
+        long  first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+        {
+            return false;
+        }
+        long last = first;
+        p         = end;
+
+        if (*p == '-')
+        {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+            {
+                return false;
+            }
+            p = end;
+        }
+
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            cpuListAdd(out, (int) cpu);
+        }
+
+        if (*p != ',' && *p != '\0' && *p != '\n' && *p != ' ')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef OS_LINUX
+
+static bool readSmallFile(const char *path, char *buf, size_t size)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return false;
+    }
+    size_t n = fread(buf, 1, size - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    return n > 0;
+}
+
+static bool addIrqCpus(long irq, cpu_list_t *out)
+{
+    char path[64];
+    char buf[256];
+
+    snprintf(path, sizeof(path), "/proc/irq/%ld/smp_affinity_list", irq);
+    if (! readSmallFile(path, buf, sizeof(buf)))
+    {
+        return false;
+    }
+    return affinityParseCpuList(buf, out);
+}
+
+int affinityGetNumaNodeIdLimit(void)
+{
+    int  limit = 0;
+    DIR *dir   = opendir("/sys/devices/system/node");
+    if (dir == NULL)
+    {
+        return 1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            limit = max(limit, atoi(entry->d_name + 4) + 1);
+        }
+    }
+    closedir(dir);
+    return max(limit, 1);
+}
+
+int affinityGetCpuNumaNode(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+    int            node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+void affinityGetAllCpus(cpu_list_t *out)
+{
+    int ncpu   = (int) sysconf(_SC_NPROCESSORS_CONF);
+    int nnodes = affinityGetNumaNodeIdLimit();
+
+    for (int node = 0; node < nnodes; node++)
+    {
+        for (int cpu = 0; cpu < ncpu; cpu++)
+        {
+            if (affinityGetCpuNumaNode(cpu) == node)
+            {
+                cpuListAdd(out, cpu);
+            }
+        }
+    }
+    // cpus on nodes we could not enumerate
+    for (int cpu = 0; cpu < ncpu; cpu++)
+    {
+        cpuListAdd(out, cpu);
+    }
+}
+
+bool affinityGetNicIrqCpus(const char *ifname, cpu_list_t *out)
+{
+    uint16_t count_before = out->count;
+    char     path[256];
+
+    // msi(-x) capable cards list their vectors here
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", ifname);
+    DIR *dir = opendir(path);
+    if (dir != NULL)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9')
+            {
+                addIrqCpus(atol(entry->d_name), out);
+            }
+        }
+        closedir(dir);
+    }
+
+    // otherwise the queues are usually named after the interface in /proc/interrupts ("eth0-TxRx-0")
+    if (out->count == count_before)
+    {
+        FILE *f = fopen("/proc/interrupts", "r");
+        if (f == NULL)
+        {
+            return false;
+        }
+        char   line[4096];
+        size_t ifname_len = strlen(ifname);
+        while (fgets(line, sizeof(line), f) != NULL)
+        {
+            const char *at = strstr(line, ifname);
+            if (at == NULL || (at[ifname_len] != '-' && at[ifname_len] != '\n' && at[ifname_len] != '\0'))
+            {
+                continue;
+            }
+            addIrqCpus(atol(line), out);
+        }
+        fclose(f);
+    }
+
+    return out->count != count_before;
+}
+
+int affinityGetNicNumaNode(const char *ifname)
+{
+    char path[256];
+    char buf[32];
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", ifname);
+    if (! readSmallFile(path, buf, sizeof(buf)))
+    {
+        return -1;
+    }
+    return atoi(buf);
+}
+
+bool affinityPinCurrentThread(const cpu_list_t *cpus)
+{
+    assert(cpus->count > 0);
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (uint16_t i = 0; i < cpus->count; i++)
+    {
+        CPU_SET(cpus->cpus[i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+#else
+
+int affinityGetNumaNodeIdLimit(void)
+{
+    return 1;
+}
+
+int affinityGetCpuNumaNode(int cpu)
+{
+    (void) cpu;
+    return 0;
+}
+
+void affinityGetAllCpus(cpu_list_t *out)
+{
+    int ncpu = getNCPU();
+    for (int cpu = 0; cpu < ncpu; cpu++)
+    {
+        cpuListAdd(out, cpu);
+    }
+}
+
+bool affinityGetNicIrqCpus(const char *ifname, cpu_list_t *out)
+{
+    (void) ifname;
+    (void) out;
+    return false;
+}
+
+int affinityGetNicNumaNode(const char *ifname)
+{
+    (void) ifname;
+    return -1;
+}
+
+bool affinityPinCurrentThread(const cpu_list_t *cpus)
+{
+    (void) cpus;
+    return false;
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef WW_AFFINITY_H_
+#define WW_AFFINITY_H_
+
+#include "wlibc.h"
+
+/*
+    CPU affinity and NUMA topology
+
+    Helpers to pin the calling thread to a set of cpus and to learn where cpus, memory nodes and network cards
+    sit on the machine. The topology is read from sysfs / procfs on linux; on other platforms pinning is not
+    supported and every cpu is reported on node 0, so callers just run unpinned.
+
+    Cpu lists use the kernel list format, e.g. "0-3,8,10-11".
+*/
+
+enum
+{
+    kAffinityMaxCpus = 1024
+};
+
+typedef struct cpu_list_s
+{
+    uint16_t count;
+    uint16_t cpus[kAffinityMaxCpus];
+
+} cpu_list_t;
+
+/**
+ * Parses a cpu list in the kernel format ("0-3,8"), cpus already in the list are not added again.
+ * @param str The list.
+ * @param out The parsed cpus are appended to it.
+ * @return false when the string is malformed.
+ */
+WW_EXPORT bool affinityParseCpuList(const char *str, cpu_list_t *out);
+
+/**
+ * Node ids can be sparse (node0 and node2 only), arrays indexed by affinityGetCpuNumaNode() are sized by this.
+ * @return The highest NUMA node id of the machine plus one, at least 1.
+ */
+WW_EXPORT int affinityGetNumaNodeIdLimit(void);
+
+/**
+ * @param cpu The cpu.
+ * @return The NUMA node of the cpu, 0 when unknown.
+ */
+WW_EXPORT int affinityGetCpuNumaNode(int cpu);
+
+/**
+ * Lists every configured cpu, grouped by NUMA node (all cpus of node 0 first, then node 1 ...).
+ * @param out The cpus are appended to it.
+ */
+WW_EXPORT void affinityGetAllCpus(cpu_list_t *out);
+
+/**
+ * Collects the cpus that serve the interrupts of a network interface (from the smp_affinity_list of its IRQs).
+ * @param ifname The interface name, e.g. "eth0".
+ * @param out The cpus are appended to it.
+ * @return false when no IRQ of the interface was found.
+ */
+WW_EXPORT bool affinityGetNicIrqCpus(const char *ifname, cpu_list_t *out);
+
+/**
+ * @param ifname The interface name.
+ * @return The NUMA node the network card is attached to, -1 when unknown.
+ */
+WW_EXPORT int affinityGetNicNumaNode(const char *ifname);
+
+/**
+ * Pins the calling thread to the given cpus.
+ * @param cpus The cpus, must not be empty.
+ * @return false when pinning failed or is not supported.
+ */
+WW_EXPORT bool affinityPinCurrentThread(const cpu_list_t *cpus);
+
+#endif // WW_AFFINITY_H_
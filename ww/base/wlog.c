@@ -1,5 +1,6 @@
 #include "wlog.h"
 #include "wmutex.h"
+#include "wthread.h"
 
 // #include "wtime.h"
 #define SECONDS_PER_HOUR 3600
@@ -28,6 +29,10 @@ struct logger_s
     time_t             last_logfile_ts;
     int                can_write_cnt;
 
+    // async mode, see loggerEnableAsync
+    int async;
+    int in_batch; // the writer thread is draining, fflush once per batch instead of per line
+
     wmutex_t mutex_; // thread-safe
 };
 
@@ -54,6 +59,8 @@ static void initLogger(logger_t *logger)
     loggerSetFile(logger, DEFAULT_LOG_FILE);
     logger->last_logfile_ts = 0;
     logger->can_write_cnt   = -1;
+    logger->async           = 0;
+    logger->in_batch        = 0;
     mutexInit(&logger->mutex_);
 }
 
@@ -89,6 +96,11 @@ void loggerDestroy(logger_t *logger)
 {
     if (logger)
     {
+        if (logger->async)
+        {
+            // the writer may still hold lines of this logger, drain them and fall back to sync mode
+            loggerStopAsyncWriter();
+        }
         if (logger->buf)
         {
             memoryFree(logger->buf);
@@ -387,7 +399,7 @@ void loggerWrite(logger_t *logger, const char *buf, int len)
     if (fp)
     {
         fwrite(buf, 1, len, fp);
-        if (logger->enable_fsync)
+        if (logger->enable_fsync && ! logger->in_batch)
         {
             fflush(fp);
         }
@@ -411,11 +423,8 @@ static int i2a(int i, char *buf, int len)
     return len;
 }
 
-int loggerPrintVA(logger_t *logger, int level, const char *fmt, va_list ap)
+static int formatLogLine(logger_t *logger, char *buf, int bufsize, int level, const char *fmt, va_list ap)
 {
-    if (level < logger->level)
-        return -10;
-
     int year, month, day, hour, min, sec, us;
 #ifdef _WIN32
     SYSTEMTIME tm;
@@ -456,12 +465,7 @@ int loggerPrintVA(logger_t *logger, int level, const char *fmt, va_list ap)
     }
 #undef XXX
 
-    // lock logger->buf
-    mutexLock(&logger->mutex_);
-
-    char *buf     = logger->buf;
-    int   bufsize = logger->bufsize;
-    int   len     = 0;
+    int len = 0;
 
     if (logger->enable_color)
     {
@@ -541,14 +545,308 @@ int loggerPrintVA(logger_t *logger, int level, const char *fmt, va_list ap)
         len += snprintf(buf + len, bufsize - len, "%s", CLR_CLR);
     }
 
-    if (len < bufsize)
+    if (len >= bufsize)
+    {
+        // vsnprintf returns the would-be length on truncation
+        len = bufsize - 1;
+    }
+    buf[len++] = '\n';
+    return len;
+}
+
+/*
+    Async mode
+
+    Every producer thread gets its own single-producer/single-consumer byte ring on first use, the line is
+    formatted on the producer thread (no lock) and copied into its ring, the writer thread drains all rings
+    and calls the logger handlers in batches (one fflush per batch)
+
+    If a ring is full the line is dropped and counted, the data path never waits for the disk
+
+    Fatal lines (and threads that could not get a ring) still go through the synchronous path
+*/
+
+enum
+{
+    kLogRingSize        = 1 << 18, // per producer thread, must be a power of 2
+    kLogMaxRings        = 256,
+    kLogWriterIdleMS    = 2,
+    kLogMaxBatchLoggers = 8
+};
+
+typedef struct log_record_s
+{
+    logger_t *logger;
+    int32_t   level;
+    int32_t   len; // negative len marks a wrap to the ring start
+    char      text[];
+} log_record_t;
+
+typedef struct log_ring_s
+{
+    ATTR_ALIGNED_LINE_CACHE atomic_ullong head; // producer
+    ATTR_ALIGNED_LINE_CACHE atomic_ullong tail; // writer thread
+    char                   *buf;
+} log_ring_t;
+
+static log_ring_t              *s_log_rings[kLogMaxRings];
+static atomic_uint              s_log_rings_count       = 0;
+static atomic_ullong            s_log_dropped           = 0;
+static atomic_bool              s_log_writer_running    = false;
+static atomic_bool              s_log_async_mutex_ready = false;
+static wthread_t                s_log_writer;
+static wmutex_t                 s_log_async_mutex;
+static thread_local log_ring_t *tl_log_ring        = NULL;
+static thread_local bool        tl_log_ring_failed = false;
+static thread_local char        tl_log_buf[DEFAULT_LOG_MAX_BUFSIZE];
+
+static inline uint32_t logRecordSize(int len)
+{
+    return (uint32_t) ((sizeof(log_record_t) + (size_t) len + 7) & ~((size_t) 7));
+}
+
+static log_ring_t *getThreadLogRing(void)
+{
+    if (LIKELY(tl_log_ring != NULL) || tl_log_ring_failed)
+    {
+        return tl_log_ring;
+    }
+
+    mutexLock(&s_log_async_mutex);
+    unsigned int count = atomicLoadExplicit(&s_log_rings_count, memory_order_relaxed);
+    if (count >= kLogMaxRings)
+    {
+        mutexUnlock(&s_log_async_mutex);
+        tl_log_ring_failed = true;
+        return NULL;
+    }
+    log_ring_t *ring = memoryAllocate(sizeof(log_ring_t));
+    memorySet(ring, 0, sizeof(log_ring_t));
+    ring->buf          = memoryAllocate(kLogRingSize);
+    s_log_rings[count] = ring;
+    // publish the ring only after it is fully initialized
+    atomicStoreExplicit(&s_log_rings_count, count + 1, memory_order_release);
+    mutexUnlock(&s_log_async_mutex);
+
+    // rings are never freed, a thread that exits leaves an empty ring behind
+    tl_log_ring = ring;
+    return ring;
+}
+
+static bool logRingPush(log_ring_t *ring, logger_t *logger, int level, const char *text, int len)
+{
+    uint32_t need       = logRecordSize(len);
+    uint64_t head       = atomicLoadExplicit(&ring->head, memory_order_relaxed);
+    uint64_t tail       = atomicLoadExplicit(&ring->tail, memory_order_acquire);
+    uint32_t pos        = (uint32_t) (head & (kLogRingSize - 1));
+    uint32_t contiguous = kLogRingSize - pos;
+    uint32_t total      = contiguous < need ? contiguous + need : need;
+
+    if (kLogRingSize - (head - tail) < total)
+    {
+        return false;
+    }
+
+    if (contiguous < need)
+    {
+        // records are 8 byte aligned, so the gap is either big enough for a marker or the reader skips it
+        if (contiguous >= sizeof(log_record_t))
+        {
+            ((log_record_t *) (ring->buf + pos))->len = -1;
+        }
+        head += contiguous;
+        pos = 0;
+    }
+
+    log_record_t *rec = (log_record_t *) (ring->buf + pos);
+    rec->logger       = logger;
+    rec->level        = level;
+    rec->len          = len;
+    memoryCopy(rec->text, text, (size_t) len);
+
+    atomicStoreExplicit(&ring->head, head + need, memory_order_release);
+    return true;
+}
+
+static void addBatchLogger(logger_t **batch, int *batch_count, logger_t *logger)
+{
+    for (int i = 0; i < *batch_count; i++)
+    {
+        if (batch[i] == logger)
+        {
+            return;
+        }
+    }
+    if (*batch_count < kLogMaxBatchLoggers)
+    {
+        batch[(*batch_count)++] = logger;
+    }
+}
+
+static size_t drainLogRing(log_ring_t *ring, logger_t **batch, int *batch_count)
+{
+    uint64_t tail    = atomicLoadExplicit(&ring->tail, memory_order_relaxed);
+    uint64_t head    = atomicLoadExplicit(&ring->head, memory_order_acquire);
+    size_t   drained = 0;
+
+    while (tail != head)
+    {
+        uint32_t pos        = (uint32_t) (tail & (kLogRingSize - 1));
+        uint32_t contiguous = kLogRingSize - pos;
+
+        if (contiguous < sizeof(log_record_t))
+        {
+            tail += contiguous;
+            continue;
+        }
+        log_record_t *rec = (log_record_t *) (ring->buf + pos);
+        if (rec->len < 0)
+        {
+            tail += contiguous;
+            continue;
+        }
+
+        logger_t *logger = rec->logger;
+        mutexLock(&logger->mutex_);
+        logger->in_batch = 1;
+        if (logger->handler)
+        {
+            logger->handler(rec->level, rec->text, rec->len);
+        }
+        mutexUnlock(&logger->mutex_);
+        addBatchLogger(batch, batch_count, logger);
+
+        tail += logRecordSize(rec->len);
+        drained++;
+    }
+    atomicStoreExplicit(&ring->tail, tail, memory_order_release);
+    return drained;
+}
+
+static size_t drainAllLogRings(void)
+{
+    logger_t *batch[kLogMaxBatchLoggers];
+    int       batch_count = 0;
+    size_t    drained     = 0;
+
+    unsigned int count = atomicLoadExplicit(&s_log_rings_count, memory_order_acquire);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        drained += drainLogRing(s_log_rings[i], batch, &batch_count);
+    }
+
+    for (int i = 0; i < batch_count; i++)
+    {
+        mutexLock(&batch[i]->mutex_);
+        batch[i]->in_batch = 0;
+        if (batch[i]->fp_ && batch[i]->enable_fsync)
+        {
+            fflush(batch[i]->fp_);
+        }
+        mutexUnlock(&batch[i]->mutex_);
+    }
+    return drained;
+}
+
+static WTHREAD_ROUTINE(logWriterThread)
+{
+    (void) userdata;
+    unsigned long long reported_drops = 0;
+
+    while (atomicLoadExplicit(&s_log_writer_running, memory_order_relaxed))
+    {
+        size_t drained = drainAllLogRings();
+
+        unsigned long long drops = atomicLoadExplicit(&s_log_dropped, memory_order_relaxed);
+        if (drops != reported_drops)
+        {
+            char msg[96];
+            int  len = snprintf(msg, sizeof(msg), "wlog: %llu log lines dropped so far (ring full)\n", drops);
+            stderrLogger(LOG_LEVEL_WARN, msg, len);
+            reported_drops = drops;
+        }
+
+        if (drained == 0)
+        {
+            hv_msleep(kLogWriterIdleMS);
+        }
+    }
+    // final drain, producers may still have lines in their rings
+    drainAllLogRings();
+    return 0;
+}
+
+static void stopLogWriterAtExit(void)
+{
+    loggerStopAsyncWriter();
+}
+
+void loggerStopAsyncWriter(void)
+{
+    bool expected = true;
+    if (atomicCompareExchangeExplicit(&s_log_writer_running, &expected, false, memory_order_relaxed,
+                                      memory_order_relaxed))
+    {
+        threadJoin(s_log_writer);
+    }
+}
+
+void loggerEnableAsync(logger_t *logger, int on)
+{
+    bool expected = false;
+    if (atomicCompareExchangeExplicit(&s_log_async_mutex_ready, &expected, true, memory_order_relaxed,
+                                      memory_order_relaxed))
+    {
+        mutexInit(&s_log_async_mutex);
+    }
+
+    if (on)
+    {
+        expected = false;
+        if (atomicCompareExchangeExplicit(&s_log_writer_running, &expected, true, memory_order_relaxed,
+                                          memory_order_relaxed))
+        {
+            s_log_writer = threadCreate(logWriterThread, NULL);
+            atexit(stopLogWriterAtExit);
+        }
+    }
+    logger->async = on;
+}
+
+unsigned long long loggerGetDroppedCount(void)
+{
+    return atomicLoadExplicit(&s_log_dropped, memory_order_relaxed);
+}
+
+int loggerPrintVA(logger_t *logger, int level, const char *fmt, va_list ap)
+{
+    if (level < logger->level)
+        return -10;
+
+    if (logger->async && level < LOG_LEVEL_FATAL &&
+        atomicLoadExplicit(&s_log_writer_running, memory_order_relaxed))
     {
-        buf[len++] = '\n';
+        log_ring_t *ring = getThreadLogRing();
+        if (ring != NULL)
+        {
+            int bufsize = min((int) logger->bufsize, (int) sizeof(tl_log_buf));
+            int len     = formatLogLine(logger, tl_log_buf, bufsize, level, fmt, ap);
+            if (! logRingPush(ring, logger, level, tl_log_buf, len))
+            {
+                atomicAddExplicit(&s_log_dropped, 1, memory_order_relaxed);
+                return -11;
+            }
+            return len;
+        }
     }
 
+    // lock logger->buf
+    mutexLock(&logger->mutex_);
+
+    int len = formatLogLine(logger, logger->buf, (int) logger->bufsize, level, fmt, ap);
     if (logger->handler)
     {
-        logger->handler(level, buf, len);
+        logger->handler(level, logger->buf, len);
     }
     // else
     // {
@@ -3,6 +3,12 @@
 
 /*
  * wlog is thread-safe
+ *
+ * loggers in async mode (loggerEnableAsync) do not take the logger mutex on the calling thread, lines go through a
+ * per thread ring to a background writer, a full ring drops the line (see loggerGetDroppedCount)
+ *
+ * WW_LOG_MIN_LEVEL (build flag, numeric log_level_e) removes LOGD / LOGI calls below it at compile time, their
+ * arguments are not evaluated
  */
 
 #include "wlibc.h"
@@ -108,6 +114,11 @@ WW_EXPORT void loggerSetMaxBufSIze(logger_t *logger, unsigned int bufsize);
 WW_EXPORT void loggerEnableColor(logger_t *logger, int on);
 WW_EXPORT int  loggerPrintVA(logger_t *logger, int level, const char *fmt, va_list ap);
 
+// async mode, the writer thread is started by the first logger that enables it and stopped at exit
+WW_EXPORT void               loggerEnableAsync(logger_t *logger, int on);
+WW_EXPORT void               loggerStopAsyncWriter(void);
+WW_EXPORT unsigned long long loggerGetDroppedCount(void);
+
 static inline int loggerPrint(logger_t *logger, int level, const char *fmt, ...)
 {
     va_list myargs;
@@ -136,7 +147,11 @@ WW_EXPORT void      loggerDestroyDefaultLogger(void);
 #define wlog loggerGetDefaultLogger()
 #endif
 
-#define checkWLogWriteLevel(level)        loggerCheckWriteLevel(wlog, level)
+#ifndef WW_LOG_MIN_LEVEL
+#define WW_LOG_MIN_LEVEL 0 // LOG_LEVEL_VERBOSE
+#endif
+
+#define checkWLogWriteLevel(level) ((int) (level) >= WW_LOG_MIN_LEVEL && loggerCheckWriteLevel(wlog, level))
 
 // below for android
 #if defined(ANDROID) || defined(__ANDROID__)
@@ -224,8 +239,29 @@ static inline void wlogf(const char *fmt, ...)
 
 // macro alias
 #if ! defined(LOGD) && ! defined(LOGI) && ! defined(LOGW) && ! defined(LOGE) && ! defined(LOGF)
+
+// the dead branch keeps the arguments "used" for the compiler, but nothing is evaluated
+#define WW_LOG_ELIDED(fn, ...)                                                                                         \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (0)                                                                                                         \
+        {                                                                                                              \
+            fn(__VA_ARGS__);                                                                                           \
+        }                                                                                                              \
+    } while (0)
+
+#if WW_LOG_MIN_LEVEL > 1 // LOG_LEVEL_DEBUG
+#define LOGD(...) WW_LOG_ELIDED(wlogd, __VA_ARGS__)
+#else
 #define LOGD wlogd
+#endif
+
+#if WW_LOG_MIN_LEVEL > 2 // LOG_LEVEL_INFO
+#define LOGI(...) WW_LOG_ELIDED(wlogi, __VA_ARGS__)
+#else
 #define LOGI wlogi
+#endif
+
 #define LOGW wlogw
 #define LOGE wloge
 #define LOGF wlogf
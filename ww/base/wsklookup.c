@@ -0,0 +1,201 @@
+#include "wsklookup.h"
+
+#ifdef OS_LINUX
+#include <fcntl.h>
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+
+#ifndef SK_PASS
+#define SK_PASS 1
+#endif
+
+enum
+{
+    kSkLookupProgLength = 22,
+    kSkLookupPassLabel  = 20
+};
+
+static int sysBpf(int cmd, union bpf_attr *attr)
+{
+    return (int) syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static struct bpf_insn bpfInsn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+    return (struct bpf_insn){.code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm};
+}
+
+static int createSockMap(void)
+{
+    union bpf_attr attr;
+    memorySet(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_SOCKMAP;
+    attr.key_size    = sizeof(uint32_t);
+    attr.value_size  = sizeof(uint64_t);
+    attr.max_entries = 1;
+    return sysBpf(BPF_MAP_CREATE, &attr);
+}
+
+/*
+    if (ctx->local_port < min || ctx->local_port > max || ctx->protocol != protocol)
+        return SK_PASS;
+    sk = map_lookup_elem(&map, &zero);
+    if (sk)
+    {
+        sk_assign(ctx, sk, 0);
+        sk_release(sk);
+    }
+    return SK_PASS;
+*/
+static void buildProgram(struct bpf_insn *prog, int map_fd, int protocol, uint16_t port_min, uint16_t port_max)
+{
+    const int16_t off_port     = (int16_t) offsetof(struct bpf_sk_lookup, local_port);
+    const int16_t off_protocol = (int16_t) offsetof(struct bpf_sk_lookup, protocol);
+#define TO_PASS(pc) ((int16_t) (kSkLookupPassLabel - ((pc) + 1)))
+
+    prog[0]  = bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+    prog[1]  = bpfInsn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, off_port, 0);
+    prog[2]  = bpfInsn(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_2, 0, TO_PASS(2), port_min);
+    prog[3]  = bpfInsn(BPF_JMP | BPF_JGT | BPF_K, BPF_REG_2, 0, TO_PASS(3), port_max);
+    prog[4]  = bpfInsn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, off_protocol, 0);
+    prog[5]  = bpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, TO_PASS(5), protocol);
+    prog[6]  = bpfInsn(BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0, -4, 0);
+    prog[7]  = bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+    prog[8]  = bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4);
+    prog[9]  = bpfInsn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+    prog[10] = bpfInsn(0, 0, 0, 0, 0);
+    prog[11] = bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+    prog[12] = bpfInsn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, TO_PASS(12), 0);
+    prog[13] = bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0);
+    prog[14] = bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0);
+    prog[15] = bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_7, 0, 0);
+    prog[16] = bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0);
+    prog[17] = bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_assign);
+    prog[18] = bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0);
+    prog[19] = bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_release);
+    prog[20] = bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS);
+    prog[21] = bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+#undef TO_PASS
+}
+
+// loads the program and links it to the network namespace of the process, returns the link fd or -1
+static int linkProgram(int map_fd, int protocol, uint16_t port_min, uint16_t port_max)
+{
+    int            prog_fd = -1;
+    int            netns   = -1;
+    int            link_fd = -1;
+    union bpf_attr attr;
+
+    struct bpf_insn prog[kSkLookupProgLength];
+    buildProgram(prog, map_fd, protocol, port_min, port_max);
+
+    static const char license[] = "GPL";
+    memorySet(&attr, 0, sizeof(attr));
+    attr.prog_type            = BPF_PROG_TYPE_SK_LOOKUP;
+    attr.expected_attach_type = BPF_SK_LOOKUP;
+    attr.insns                = (uint64_t) (uintptr_t) prog;
+    attr.insn_cnt             = kSkLookupProgLength;
+    attr.license              = (uint64_t) (uintptr_t) license;
+    prog_fd                   = sysBpf(BPF_PROG_LOAD, &attr);
+    if (prog_fd < 0)
+    {
+        goto done;
+    }
+
+    netns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (netns < 0)
+    {
+        goto done;
+    }
+
+    memorySet(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd     = (uint32_t) prog_fd;
+    attr.link_create.target_fd   = (uint32_t) netns;
+    attr.link_create.attach_type = BPF_SK_LOOKUP;
+
+    link_fd = sysBpf(BPF_LINK_CREATE, &attr);
+
+done:;
+    int saved_errno = errno;
+    if (netns >= 0)
+    {
+        close(netns);
+    }
+    if (prog_fd >= 0)
+    {
+        close(prog_fd);
+    }
+    errno = saved_errno;
+    return link_fd;
+}
+
+bool sklookupIsSupported(void)
+{
+    int map_fd = createSockMap();
+    if (map_fd < 0)
+    {
+        return false;
+    }
+
+    // the same program the listeners use, with the range [1 - 0] that no port is inside, so it steers nothing
+    // while it is linked; closing the link detaches it again
+    int link_fd     = linkProgram(map_fd, IPPROTO_TCP, 1, 0);
+    int saved_errno = errno;
+    if (link_fd >= 0)
+    {
+        close(link_fd);
+    }
+    close(map_fd);
+    errno = saved_errno;
+    return link_fd >= 0;
+}
+
+bool sklookupAttach(int protocol, uint16_t port_min, uint16_t port_max, int fd)
+{
+    bool           result = false;
+    union bpf_attr attr;
+
+    int map_fd = createSockMap();
+    if (map_fd < 0)
+    {
+        return false;
+    }
+
+    uint32_t key   = 0;
+    uint64_t value = (uint64_t) fd;
+    memorySet(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t) map_fd;
+    attr.key    = (uint64_t) (uintptr_t) &key;
+    attr.value  = (uint64_t) (uintptr_t) &value;
+    attr.flags  = BPF_ANY;
+    if (sysBpf(BPF_MAP_UPDATE_ELEM, &attr) == 0)
+    {
+        // the link (and with it the program and the map) lives as long as its fd, that is until the process exits
+        result = linkProgram(map_fd, protocol, port_min, port_max) >= 0;
+    }
+
+    int saved_errno = errno;
+    close(map_fd);
+    errno = saved_errno;
+    return result;
+}
+
+#else
+
+bool sklookupIsSupported(void)
+{
+    return false;
+}
+
+bool sklookupAttach(int protocol, uint16_t port_min, uint16_t port_max, int fd)
+{
+    (void) protocol;
+    (void) port_min;
+    (void) port_max;
+    (void) fd;
+    errno = ENOTSUP;
+    return false;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef WW_SKLOOKUP_H_
+#define WW_SKLOOKUP_H_
+
+#include "wlibc.h"
+
+/*
+    Socket lookup steering (BPF_PROG_TYPE_SK_LOOKUP)
+
+    Lets one listening socket receive the connections / datagrams of a whole port range, without NAT and without one
+    socket per port. A tiny bpf program is attached to the network namespace of the process; for every incoming
+    connection or datagram whose protocol matches and whose destination port is inside the range, it assigns the
+    socket stored in a one entry sockmap, before the kernel does its normal lookup.
+
+    Nothing is rewritten on the packet, so getsockname on an accepted tcp socket returns the port the client really
+    connected to; for udp the destination is read with IP_ORIGDSTADDR (see wioEnableRecvOrigDst).
+
+    If the socket is part of a SO_REUSEPORT group, the kernel picks the member of the group after the assignment.
+
+    Needs linux 5.9+ and CAP_NET_ADMIN / CAP_BPF (or root). The program is detached when the process exits.
+*/
+
+/**
+ * Checks whether this kernel and these privileges allow attaching sk_lookup programs: loads a program that steers
+ * nothing, links it to the network namespace and detaches it again.
+ * @return true when supported.
+ */
+WW_EXPORT bool sklookupIsSupported(void);
+
+/**
+ * Steers every connection (tcp) or datagram (udp) to a port in [port_min, port_max] to a socket.
+ * @param protocol IPPROTO_TCP or IPPROTO_UDP.
+ * @param port_min First port of the range.
+ * @param port_max Last port of the range.
+ * @param fd The listening (tcp) or bound (udp) socket.
+ * @return false when the program could not be loaded or attached, errno tells why.
+ */
+WW_EXPORT bool sklookupAttach(int protocol, uint16_t port_min, uint16_t port_max, int fd);
+
+#endif // WW_SKLOOKUP_H_
@@ -46,6 +46,27 @@ uint32_t bufferpoolGetSmallBufferSize(buffer_pool_t *pool)
     return pool->small_buffers_size;
 }
 
+/**
+ * Creates a buffer, carved from the slab of the master pool when it has one with room for it.
+ * @param pool The master pool.
+ * @param size The minimum capacity of the buffer.
+ * @param pad_left The left padding of the buffer.
+ * @return A pointer to the created buffer.
+ */
+static sbuf_t *createBuffer(master_pool_t *pool, uint32_t size, uint16_t pad_left)
+{
+    slab_t *slab = masterpoolGetSlab(pool, sbufGetAllocationSize(size, pad_left));
+    if (slab != NULL)
+    {
+        void *memory = slabAllocate(slab);
+        if (memory != NULL)
+        {
+            return sbufCreateIn(memory, size, pad_left);
+        }
+    }
+    return sbufNewWithPadding(size, pad_left);
+}
+
 /**
  * Creates a large buffer using the provided create handler.
  * @param pool The master pool.
@@ -54,10 +75,8 @@ uint32_t bufferpoolGetSmallBufferSize(buffer_pool_t *pool)
  */
 static master_pool_item_t *createLargeBufHandle(master_pool_t *pool, void *userdata)
 {
-    (void) pool;
-
     buffer_pool_t *bpool = userdata;
-    return sbufNewWithPadding(bpool->large_buffers_size, bpool->large_buffer_left_padding);
+    return createBuffer(pool, bpool->large_buffers_size, bpool->large_buffer_left_padding);
 }
 
 /**
@@ -68,9 +87,8 @@ static master_pool_item_t *createLargeBufHandle(master_pool_t *pool, void *userd
  */
 static master_pool_item_t *createSmallBufHandle(master_pool_t *pool, void *userdata)
 {
-    (void) pool;
     buffer_pool_t *bpool = userdata;
-    return sbufNewWithPadding(bpool->small_buffers_size, bpool->small_buffer_left_padding);
+    return createBuffer(pool, bpool->small_buffers_size, bpool->small_buffer_left_padding);
 }
 
 /**
@@ -137,7 +155,7 @@ static void reChargeSmallBuffers(buffer_pool_t *pool)
  * Performs the initial charge of the buffer pool.
  * @param pool The buffer pool.
  */
-static void firstCharge(buffer_pool_t *pool)
+void bufferpoolFirstCharge(buffer_pool_t *pool)
 {
     if (pool->large_buffers_mp)
     {
@@ -244,6 +262,12 @@ sbuf_t *bufferpoolGetSmallBuffer(buffer_pool_t *pool)
  */
 void bufferpoolResuesBuffer(buffer_pool_t *pool, sbuf_t *b)
 {
+    if (sbufIsShared(b))
+    {
+        // a view (or the stream) still points into it, the last holder recycles it
+        b->refc--;
+        return;
+    }
 
 #if defined(DEBUG) && defined(BYPASS_BUFFERPOOL)
     sbufDestroy(b);
@@ -373,6 +397,6 @@ buffer_pool_t *bufferpoolCreate(master_pool_t *mp_large, master_pool_t *mp_small
     memorySet((void *) ptr_pool->small_buffers, 0xFE, container_len);
 #endif
 
-    // firstCharge(ptr_pool);
+    // bufferpoolFirstCharge(ptr_pool);
     return ptr_pool;
 }
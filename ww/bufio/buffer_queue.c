@@ -0,0 +1,74 @@
+#include "buffer_queue.h"
+#include "stc/common.h"
+
+#define i_type sbuf_queue_t
+#define i_key  sbuf_t *
+#include "stc/deque.h"
+
+enum
+{
+    kQCap = 16
+};
+
+struct buffer_queue_s
+{
+    sbuf_queue_t   q;
+    buffer_pool_t *pool;
+    size_t         bytes;
+};
+
+buffer_queue_t *bufferqueueCreate(buffer_pool_t *pool)
+{
+    buffer_queue_t *bq = memoryAllocate(sizeof(buffer_queue_t));
+    bq->q              = sbuf_queue_t_with_capacity(kQCap);
+    bq->pool           = pool;
+    bq->bytes          = 0;
+    return bq;
+}
+
+void bufferqueueDestory(buffer_queue_t *self)
+{
+    c_foreach(i, sbuf_queue_t, self->q)
+    {
+        bufferpoolResuesBuffer(self->pool, *i.ref);
+    }
+
+    sbuf_queue_t_drop(&self->q);
+    memoryFree(self);
+}
+
+void bufferqueuePush(buffer_queue_t *self, sbuf_t *b)
+{
+    self->bytes += sbufGetBufLength(b);
+    sbuf_queue_t_push_back(&self->q, b);
+}
+
+// puts back (the rest of) a buffer that was popped
+void bufferqueuePushFront(buffer_queue_t *self, sbuf_t *b)
+{
+    self->bytes += sbufGetBufLength(b);
+    sbuf_queue_t_push_front(&self->q, b);
+}
+
+sbuf_t *bufferqueuePop(buffer_queue_t *self)
+{
+    sbuf_t *b = sbuf_queue_t_pull_front(&self->q);
+    self->bytes -= sbufGetBufLength(b);
+    return b;
+}
+
+// the buffer stays in the queue, its length must not change while it is there
+sbuf_t *bufferqueueFront(buffer_queue_t *self)
+{
+    return *sbuf_queue_t_front(&self->q);
+}
+
+size_t bufferqueueLen(buffer_queue_t *self)
+{
+    return sbuf_queue_t_size(&self->q);
+}
+
+size_t bufferqueueBytes(buffer_queue_t *self)
+{
+    return self->bytes;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "buffer_pool.h"
+#include "shiftbuffer.h"
+#include "wlibc.h"
+
+/*
+    a queue for sbuf_t, adapters keep the payloads here while the socket write is blocked, same as context_queue
+    but for the line based api where a payload travels without a context
+
+    the queue owns the buffers it holds, destroying it returns them to the pool
+*/
+
+typedef struct buffer_queue_s buffer_queue_t;
+
+buffer_queue_t *bufferqueueCreate(buffer_pool_t *pool);
+void            bufferqueueDestory(buffer_queue_t *self);
+void            bufferqueuePush(buffer_queue_t *self, sbuf_t *b);
+void            bufferqueuePushFront(buffer_queue_t *self, sbuf_t *b);
+sbuf_t         *bufferqueuePop(buffer_queue_t *self);
+sbuf_t         *bufferqueueFront(buffer_queue_t *self);
+size_t          bufferqueueLen(buffer_queue_t *self);
+size_t          bufferqueueBytes(buffer_queue_t *self);
@@ -1,5 +1,6 @@
 #include "buffer_stream.h"
 #include "buffer_pool.h"
+#include "buffer_view.h"
 #include "shiftbuffer.h"
 #include "stc/common.h"
 
@@ -61,18 +62,22 @@ void bufferstreamPush(buffer_stream_t *self, sbuf_t *buf)
 
     BUFFER_WONT_BE_REUSED(buf);
 
-    if (self->size > 0 && queue_size(&self->q) == 1)
+    // only small buffers are worth a copy into the tail, big ones are just queued (views/chains read across them)
+    if (self->size > 0 && queue_size(&self->q) == 1 && sbufGetBufLength(buf) <= kConcatMaxThreshould)
     {
         sbuf_t  *last       = *queue_front(&self->q);
-        uint32_t write_size = min(sbufGetRightCapacity(last), sbufGetBufLength(buf));
+        uint32_t last_len   = sbufGetBufLength(last);
+        uint32_t write_size = min(sbufGetRightCapacity(last) - last_len, sbufGetBufLength(buf));
 
         if (write_size > 0)
         {
+            // appended after the data of the tail, views into it keep their range
             self->size += write_size;
-            sbufWrite(last, buf, write_size);
+            sbufSetLength(last, last_len + write_size);
+            memoryCopy(sbufGetMutablePtr(last) + last_len, sbufGetRawPtr(buf), write_size);
             if (sbufGetBufLength(buf) == write_size)
             {
-                sbufDestroy(buf);
+                bufferpoolResuesBuffer(self->pool, buf);
                 return;
             }
             sbufShiftRight(buf, write_size);
@@ -83,6 +88,23 @@ void bufferstreamPush(buffer_stream_t *self, sbuf_t *buf)
     self->size += sbufGetBufLength(buf);
 }
 
+/**
+ * Makes sure the caller gets a buffer that no view points into, since it is free to write into it.
+ * @param self The buffer stream.
+ * @param b A buffer pulled out of the stream.
+ * @return b itself, or a private copy of its data.
+ */
+static sbuf_t *takePrivate(buffer_stream_t *self, sbuf_t *b)
+{
+    if (LIKELY(! sbufIsShared(b)))
+    {
+        return b;
+    }
+    sbuf_t *copy = sbufDuplicateByPool(self->pool, b);
+    bufferpoolResuesBuffer(self->pool, b);
+    return copy;
+}
+
 /**
  * Reads an exact number of bytes from the buffer stream.
  * @param self The buffer stream.
@@ -94,13 +116,25 @@ sbuf_t *bufferstreamReadExact(buffer_stream_t *self, size_t bytes)
     assert(self->size >= bytes && bytes > 0);
     self->size -= bytes;
 
-    sbuf_t *container = queue_pull_front(&self->q);
+    sbuf_t *container = takePrivate(self, queue_pull_front(&self->q));
 
     while (true)
     {
         size_t available = sbufGetBufLength(container);
         if (available > bytes)
         {
+            size_t rest = available - bytes;
+            if (rest < bytes)
+            {
+                // copy whichever side is smaller, here the leftover moves and the frame stays in place
+                sbuf_t *leftover = bufferpoolGetLargeBuffer(self->pool);
+                leftover         = sbufReserveSpace(leftover, (uint32_t) rest);
+                sbufSetLength(leftover, (uint32_t) rest);
+                memoryCopy(sbufGetMutablePtr(leftover), sbufGetRawPtr(container) + bytes, rest);
+                sbufSetLength(container, (uint32_t) bytes);
+                queue_push_front(&self->q, leftover);
+                return container;
+            }
             sbuf_t *slice = bufferpoolGetLargeBuffer(self->pool);
             slice         = sbufMoveTo(slice, container, bytes);
             queue_push_front(&self->q, container);
@@ -114,6 +148,66 @@ sbuf_t *bufferstreamReadExact(buffer_stream_t *self, size_t bytes)
     }
 }
 
+/**
+ * Reads an exact number of bytes from the buffer stream as views, without copying or merging.
+ * @param self The buffer stream.
+ * @param bytes The number of bytes to read.
+ * @param out Receives the frame, one segment per buffer it spans; release it with sbufchainRelease.
+ */
+void bufferstreamReadExactView(buffer_stream_t *self, size_t bytes, sbuf_chain_t *out)
+{
+    assert(self->size >= bytes && bytes > 0);
+    self->size -= bytes;
+    sbufchainInit(out);
+
+    while (bytes > 0)
+    {
+        sbuf_t  *front     = *queue_front(&self->q);
+        uint32_t available = sbufGetBufLength(front);
+
+        if (available > bytes)
+        {
+            // the frame ends inside this buffer, the stream keeps the buffer and the view shares it
+            sbufchainAppend(out, sbufviewCreate(front, 0, (uint32_t) bytes));
+            sbufShiftRight(front, (uint32_t) bytes);
+            return;
+        }
+
+        if (UNLIKELY(out->count == kSbufChainMaxSegments - 1 && available < bytes))
+        {
+            // pathological fragmentation, the rest of the frame is gathered into the last segment
+            sbuf_t *rest = bufferpoolGetLargeBuffer(self->pool);
+            rest         = sbufReserveSpace(rest, (uint32_t) bytes);
+            sbufSetLength(rest, (uint32_t) bytes);
+            uint32_t written = 0;
+            while (bytes > 0)
+            {
+                front          = *queue_front(&self->q);
+                uint32_t chunk = (uint32_t) min((size_t) sbufGetBufLength(front), bytes);
+                memoryCopy(sbufGetMutablePtr(rest) + written, sbufGetRawPtr(front), chunk);
+                written += chunk;
+                bytes -= chunk;
+                if (chunk == sbufGetBufLength(front))
+                {
+                    queue_pop_front(&self->q);
+                    bufferpoolResuesBuffer(self->pool, front);
+                }
+                else
+                {
+                    sbufShiftRight(front, chunk);
+                }
+            }
+            sbufchainAppend(out, sbufviewAdopt(rest));
+            return;
+        }
+
+        // the whole buffer belongs to the frame, the stream hands its reference over to the chain
+        queue_pop_front(&self->q);
+        sbufchainAppend(out, sbufviewAdopt(front));
+        bytes -= available;
+    }
+}
+
 /**
  * Reads at least a specified number of bytes from the buffer stream.
  * @param self The buffer stream.
@@ -125,7 +219,7 @@ sbuf_t *bufferstreamReadAtLeast(buffer_stream_t *self, size_t bytes)
     assert(self->size >= bytes && bytes > 0);
     self->size -= bytes;
 
-    sbuf_t *container = queue_pull_front(&self->q);
+    sbuf_t *container = takePrivate(self, queue_pull_front(&self->q));
 
     while (true)
     {
@@ -148,7 +242,7 @@ sbuf_t *bufferstreamIdealRead(buffer_stream_t *self)
     assert(self->size > 0);
     sbuf_t *container = queue_pull_front(&self->q);
     self->size -= sbufGetBufLength(container);
-    return container;
+    return takePrivate(self, container);
 }
 
 /**
@@ -3,6 +3,7 @@
 
 
 #include "buffer_pool.h"
+#include "buffer_view.h"
 #include "shiftbuffer.h"
 
 /*
@@ -12,6 +13,9 @@
     you can for example check byte index 1 or 5 of the buffers without concating them, then
     you'll be able to read only when your protocol is satisfied, the size you want
 
+    bufferstreamReadExact gives a plain buffer (it copies when the frame does not line up with the buffers),
+    bufferstreamReadExactView gives the same bytes as a chain of views (buffer_view.h) and never copies
+
 
 */
 
@@ -63,6 +67,14 @@ void bufferstreamPush(buffer_stream_t *self, sbuf_t *buf);
  */
 sbuf_t *bufferstreamReadExact(buffer_stream_t *self, size_t bytes);
 
+/**
+ * Reads an exact number of bytes from the buffer stream as views, without copying or merging.
+ * @param self The buffer stream.
+ * @param bytes The number of bytes to read.
+ * @param out Receives the frame, one segment per buffer it spans; release it with sbufchainRelease.
+ */
+void bufferstreamReadExactView(buffer_stream_t *self, size_t bytes, sbuf_chain_t *out);
+
 /**
  * Reads at least a specified number of bytes from the buffer stream.
  * @param self The buffer stream.
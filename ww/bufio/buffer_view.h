@@ -0,0 +1,195 @@
+#pragma once
+#include "wlibc.h"
+
+#include "buffer_pool.h"
+#include "shiftbuffer.h"
+
+/*
+    Read only views into pooled buffers
+
+    A view is a (buffer, offset, length) triple that holds one reference of the buffer (sbufRef), so the buffer
+    goes back to its pool when the last view and the original holder have released it. Making a view never
+    copies the data.
+
+    A chain is a small iovec-like list of views, buffer_stream hands out frames that span several buffers as a
+    chain instead of merging them, the consumer can parse it in place, hand it to writev, or gather it into one
+    sbuf_t only if it really needs contiguous memory.
+
+    Views are read only, never write into the memory of a view; the bytes may be visible through other views.
+
+*/
+
+enum
+{
+    kSbufChainMaxSegments = 16
+};
+
+typedef struct sbuf_view_s
+{
+    sbuf_t  *backing;
+    uint32_t offset; // absolute index in backing->buf
+    uint32_t len;
+
+} sbuf_view_t;
+
+typedef struct sbuf_chain_s
+{
+    uint32_t    len;   // total bytes of all segments
+    uint32_t    count; // number of segments
+    sbuf_view_t segs[kSbufChainMaxSegments];
+
+} sbuf_chain_t;
+
+/**
+ * Makes a view of part of the data of a buffer, the buffer gets one more holder.
+ * @param b The buffer.
+ * @param at Start of the view, relative to the current data of b.
+ * @param len Length of the view.
+ * @return The view.
+ */
+static inline sbuf_view_t sbufviewCreate(sbuf_t *b, uint32_t at, uint32_t len)
+{
+    assert(at + len <= sbufGetBufLength(b));
+    return (sbuf_view_t) {.backing = sbufRef(b), .offset = b->curpos + at, .len = len};
+}
+
+/**
+ * Wraps a buffer that the caller owns into a view without adding a holder, the view takes over the ownership.
+ * @param b The buffer.
+ * @return The view covering all the data of b.
+ */
+static inline sbuf_view_t sbufviewAdopt(sbuf_t *b)
+{
+    return (sbuf_view_t) {.backing = b, .offset = b->curpos, .len = sbufGetBufLength(b)};
+}
+
+static inline const uint8_t *sbufviewGetRawPtr(const sbuf_view_t *v)
+{
+    return &(v->backing->buf[v->offset]);
+}
+
+static inline uint32_t sbufviewGetLength(const sbuf_view_t *v)
+{
+    return v->len;
+}
+
+/**
+ * Drops the reference of the view, the backing buffer is recycled if this was its last holder.
+ * @param pool The pool of the worker that created the view.
+ * @param v The view, it is cleared.
+ */
+static inline void sbufviewRelease(buffer_pool_t *pool, sbuf_view_t *v)
+{
+    if (v->backing != NULL)
+    {
+        bufferpoolResuesBuffer(pool, v->backing);
+        v->backing = NULL;
+        v->len     = 0;
+    }
+}
+
+static inline void sbufchainInit(sbuf_chain_t *c)
+{
+    c->len   = 0;
+    c->count = 0;
+}
+
+static inline uint32_t sbufchainLen(const sbuf_chain_t *c)
+{
+    return c->len;
+}
+
+static inline bool sbufchainIsFull(const sbuf_chain_t *c)
+{
+    return c->count == kSbufChainMaxSegments;
+}
+
+// the chain takes over the reference held by the view
+static inline void sbufchainAppend(sbuf_chain_t *c, sbuf_view_t v)
+{
+    assert(! sbufchainIsFull(c));
+    c->segs[c->count++] = v;
+    c->len += v.len;
+}
+
+static inline void sbufchainRelease(buffer_pool_t *pool, sbuf_chain_t *c)
+{
+    for (uint32_t i = 0; i < c->count; i++)
+    {
+        sbufviewRelease(pool, &c->segs[i]);
+    }
+    sbufchainInit(c);
+}
+
+/**
+ * Copies bytes out of the chain without consuming it.
+ * @param c The chain.
+ * @param at Offset in the chain.
+ * @param dest Destination memory.
+ * @param len Number of bytes, at + len must not pass the end of the chain.
+ */
+static inline void sbufchainRead(const sbuf_chain_t *c, uint32_t at, void *dest, uint32_t len)
+{
+    assert(at + len <= c->len);
+    uint8_t *out = dest;
+    for (uint32_t i = 0; i < c->count && len > 0; i++)
+    {
+        const sbuf_view_t *v = &c->segs[i];
+        if (at >= v->len)
+        {
+            at -= v->len;
+            continue;
+        }
+        uint32_t n = min(v->len - at, len);
+        memoryCopy(out, sbufviewGetRawPtr(v) + at, n);
+        out += n;
+        len -= n;
+        at = 0;
+    }
+}
+
+#if defined(OS_UNIX)
+#include <sys/uio.h>
+/**
+ * Fills an iovec array for writev / sendmsg.
+ * @param c The chain.
+ * @param iov At least c->count entries.
+ * @return Number of filled entries.
+ */
+static inline int sbufchainToIovec(const sbuf_chain_t *c, struct iovec *iov)
+{
+    for (uint32_t i = 0; i < c->count; i++)
+    {
+        iov[i].iov_base = (void *) sbufviewGetRawPtr(&c->segs[i]);
+        iov[i].iov_len  = c->segs[i].len;
+    }
+    return (int) c->count;
+}
+#endif
+
+/**
+ * Turns the chain into one writable buffer and releases the chain. It does not copy when the chain is a single
+ * view whose backing buffer has no other holder, otherwise the data is gathered into a pool buffer.
+ * @param pool The buffer pool of this worker.
+ * @param c The chain, it is empty after the call.
+ * @return The buffer holding all the bytes of the chain.
+ */
+static inline sbuf_t *sbufchainGather(buffer_pool_t *pool, sbuf_chain_t *c)
+{
+    assert(c->count > 0);
+    if (c->count == 1 && ! sbufIsShared(c->segs[0].backing))
+    {
+        sbuf_t *b = c->segs[0].backing;
+        b->curpos = c->segs[0].offset;
+        b->len    = c->segs[0].len;
+        sbufchainInit(c);
+        return b;
+    }
+
+    sbuf_t *result = bufferpoolGetLargeBuffer(pool);
+    result         = sbufReserveSpace(result, c->len);
+    sbufSetLength(result, c->len);
+    sbufchainRead(c, 0, sbufGetMutablePtr(result), c->len);
+    sbufchainRelease(pool, c);
+    return result;
+}
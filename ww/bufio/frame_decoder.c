@@ -0,0 +1,132 @@
+#include "frame_decoder.h"
+
+enum
+{
+    kUleb128MaxBytes = 5 // enough for a uint32_t
+};
+
+void framedecoderInit(frame_decoder_t *self, buffer_pool_t *pool, frame_format_t format)
+{
+    assert(format.length_size == 1 || format.length_size == 2 || format.length_size == 4 ||
+           format.length_size == kFrameLengthUleb128);
+    assert(format.length_offset + kUleb128MaxBytes <= kFrameDecoderMaxHeader);
+    assert(format.min_length <= format.max_length && format.max_length <= UINT32_MAX - kFrameDecoderMaxHeader);
+
+    *self = (frame_decoder_t) {.stream = bufferstreamCreate(pool), .format = format};
+}
+
+void framedecoderDestroy(frame_decoder_t *self)
+{
+    if (self->stream != NULL)
+    {
+        bufferstreamDestroy(self->stream);
+        self->stream = NULL;
+    }
+}
+
+static uint32_t readFixedLength(const uint8_t *p, uint8_t size, bool big_endian)
+{
+    switch (size)
+    {
+    case 1:
+        return p[0];
+    case 2: {
+        uint16_t v;
+        memoryCopy(&v, p, sizeof(v));
+        return big_endian ? ntohs(v) : v;
+    }
+    default: {
+        uint32_t v;
+        memoryCopy(&v, p, sizeof(v));
+        return big_endian ? ntohl(v) : v;
+    }
+    }
+}
+
+// parses the header of the next frame once enough bytes are buffered
+static frame_decoder_result_t parseHeader(frame_decoder_t *self)
+{
+    const frame_format_t *f         = &self->format;
+    const size_t          available = bufferstreamLen(self->stream);
+    uint8_t               header[kFrameDecoderMaxHeader];
+    uint32_t              length = 0;
+
+    if (f->length_size != kFrameLengthUleb128)
+    {
+        const uint32_t header_len = f->length_offset + f->length_size;
+        if (available < header_len)
+        {
+            return kFrameDecoderNeedMore;
+        }
+        bufferstreamViewBytesAt(self->stream, f->length_offset, header, f->length_size);
+        length           = readFixedLength(header, f->length_size, f->big_endian);
+        self->header_len = header_len;
+    }
+    else
+    {
+        if (available <= f->length_offset)
+        {
+            return kFrameDecoderNeedMore;
+        }
+        const uint32_t peek = (uint32_t) min(available - f->length_offset, (size_t) kUleb128MaxBytes);
+        bufferstreamViewBytesAt(self->stream, f->length_offset, header, peek);
+
+        uint32_t i = 0;
+        for (;; i++)
+        {
+            if (i == peek)
+            {
+                return peek == kUleb128MaxBytes ? kFrameDecoderInvalid : kFrameDecoderNeedMore;
+            }
+            length |= (uint32_t) (header[i] & 0x7F) << (7 * i);
+            if ((header[i] & 0x80) == 0)
+            {
+                break;
+            }
+        }
+        self->header_len = f->length_offset + i + 1;
+    }
+
+    if (length < f->min_length || length > f->max_length)
+    {
+        return kFrameDecoderInvalid;
+    }
+    self->frame_len = self->header_len + length;
+    return kFrameDecoderFrame;
+}
+
+static frame_decoder_result_t waitFrame(frame_decoder_t *self)
+{
+    if (self->frame_len == 0)
+    {
+        frame_decoder_result_t result = parseHeader(self);
+        if (result != kFrameDecoderFrame)
+        {
+            return result;
+        }
+    }
+    // the usual case while a big frame trickles in: one comparison, nothing is touched
+    return bufferstreamLen(self->stream) >= self->frame_len ? kFrameDecoderFrame : kFrameDecoderNeedMore;
+}
+
+frame_decoder_result_t framedecoderNext(frame_decoder_t *self, sbuf_chain_t *out)
+{
+    frame_decoder_result_t result = waitFrame(self);
+    if (result == kFrameDecoderFrame)
+    {
+        bufferstreamReadExactView(self->stream, self->frame_len, out);
+        self->frame_len = 0;
+    }
+    return result;
+}
+
+frame_decoder_result_t framedecoderNextBuffer(frame_decoder_t *self, sbuf_t **out)
+{
+    frame_decoder_result_t result = waitFrame(self);
+    if (result == kFrameDecoderFrame)
+    {
+        *out            = bufferstreamReadExact(self->stream, self->frame_len);
+        self->frame_len = 0;
+    }
+    return result;
+}
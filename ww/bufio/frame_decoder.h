@@ -0,0 +1,122 @@
+#pragma once
+#include "wlibc.h"
+
+#include "buffer_pool.h"
+#include "buffer_stream.h"
+#include "buffer_view.h"
+
+/*
+    Incremental decoder for length prefixed frames
+
+    Most framed protocols here put a length field at a fixed offset of the header and the payload right after it
+    (Mux, Bgp4, gRPC, ProtoBuf). Reading them by merging everything buffered so far and pushing it back
+    when the frame is incomplete costs a copy of the whole backlog on every read, quadratic for a big frame that
+    arrives in many small reads.
+
+    The decoder keeps the buffers in a buffer_stream, peeks only the header bytes across buffer boundaries (no
+    merge), and remembers the length of the frame it is collecting; until enough bytes are buffered a read costs one
+    comparison. Complete frames come out as views (framedecoderNext, never copies) or as one buffer
+    (framedecoderNextBuffer, copies only a frame that spans buffers, once).
+
+    A frame is the header (length_offset bytes, the length field) followed by length payload bytes; the frame
+    handed out includes the header, framedecoderGetHeaderLength tells where the payload starts.
+
+        Mux       {.length_offset = 0,  .length_size = 2}  host order
+        Bgp4      {.length_offset = 16, .length_size = 2}  host order
+        gRPC      {.length_offset = 1,  .length_size = 4, .big_endian = true}
+        ProtoBuf  {.length_offset = 1,  .length_size = kFrameLengthUleb128}
+
+*/
+
+enum
+{
+    kFrameLengthUleb128    = 0xFF, // length_size of a varint (protobuf) length, at most 5 bytes
+    kFrameDecoderMaxHeader = 32
+};
+
+typedef enum frame_decoder_result_e
+{
+    kFrameDecoderNeedMore,
+    kFrameDecoderFrame,
+    kFrameDecoderInvalid // length out of [min_length, max_length] or a broken varint, the connection is unusable
+
+} frame_decoder_result_t;
+
+typedef struct frame_format_s
+{
+    uint32_t min_length; // limits of the value of the length field
+    uint32_t max_length;
+    uint8_t  length_offset; // header bytes before the length field
+    uint8_t  length_size;   // 1, 2, 4 or kFrameLengthUleb128
+    bool     big_endian;    // otherwise host order, ignored for varints
+
+} frame_format_t;
+
+typedef struct frame_decoder_s
+{
+    buffer_stream_t *stream;
+    frame_format_t   format;
+    uint32_t         header_len; // of the frame being collected (or the last one handed out)
+    uint32_t         frame_len;  // header + payload, 0 while the header is not complete
+
+} frame_decoder_t;
+
+/**
+ * Prepares a decoder with an empty buffer stream.
+ * @param self The decoder.
+ * @param pool The buffer pool of the worker.
+ * @param format Where the length is and which lengths are acceptable.
+ */
+void framedecoderInit(frame_decoder_t *self, buffer_pool_t *pool, frame_format_t format);
+
+/**
+ * Returns the buffered bytes to the pool, the decoder can be initialized again. A zeroed decoder that was never
+ * initialized is fine too.
+ * @param self The decoder.
+ */
+void framedecoderDestroy(frame_decoder_t *self);
+
+/**
+ * Queues received bytes, the decoder owns the buffer.
+ * @param self The decoder.
+ * @param buf The buffer.
+ */
+static inline void framedecoderPush(frame_decoder_t *self, sbuf_t *buf)
+{
+    bufferstreamPush(self->stream, buf);
+}
+
+/**
+ * Takes the next complete frame as views into the received buffers.
+ * @param self The decoder.
+ * @param out Receives the frame (header included) when the result is kFrameDecoderFrame; release it with
+ * sbufchainRelease.
+ * @return kFrameDecoderFrame, kFrameDecoderNeedMore or kFrameDecoderInvalid.
+ */
+frame_decoder_result_t framedecoderNext(frame_decoder_t *self, sbuf_chain_t *out);
+
+/**
+ * Takes the next complete frame as one writable buffer.
+ * @param self The decoder.
+ * @param out Receives the frame (header included) when the result is kFrameDecoderFrame.
+ * @return kFrameDecoderFrame, kFrameDecoderNeedMore or kFrameDecoderInvalid.
+ */
+frame_decoder_result_t framedecoderNextBuffer(frame_decoder_t *self, sbuf_t **out);
+
+/**
+ * @param self The decoder.
+ * @return Header length of the frame that was handed out last, the payload starts there.
+ */
+static inline uint32_t framedecoderGetHeaderLength(const frame_decoder_t *self)
+{
+    return self->header_len;
+}
+
+/**
+ * @param self The decoder.
+ * @return Bytes buffered and not yet handed out.
+ */
+static inline size_t framedecoderLen(const frame_decoder_t *self)
+{
+    return bufferstreamLen(self->stream);
+}
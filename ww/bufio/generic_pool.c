@@ -117,6 +117,15 @@ static generic_pool_t *allocateGenericPool(master_pool_t *mp, uint32_t item_size
  */
 static pool_item_t *poolDefaultAllocator(generic_pool_t *pool)
 {
+    slab_t *slab = masterpoolGetSlab(pool->mp, pool->item_size);
+    if (slab != NULL)
+    {
+        pool_item_t *item = slabAllocate(slab);
+        if (item != NULL)
+        {
+            return item;
+        }
+    }
     return memoryAllocate(pool->item_size);
 }
 
@@ -127,7 +136,12 @@ static pool_item_t *poolDefaultAllocator(generic_pool_t *pool)
  */
 static void poolDefaultDeallocator(generic_pool_t *pool, pool_item_t *item)
 {
-    (void) pool;
+    slab_t *slab = slabFind(item);
+    if (slab != NULL)
+    {
+        slabFree(slab, item);
+        return;
+    }
     memoryFree(item);
 }
 
@@ -71,7 +71,8 @@ master_pool_t *masterpoolCreateWithCapacity(uint32_t pool_width)
                           .cap                 = pool_width,
                           .len                 = 0,
                           .create_item_handle  = defaultCreateHandle,
-                          .destroy_item_handle = defaultDestroyHandle};
+                          .destroy_item_handle = defaultDestroyHandle,
+                          .slab_page_size      = kSlabPageNormal};
 
     memoryCopy(pool_ptr, &pool, sizeof(master_pool_t));
     mutexInit(&(pool_ptr->mutex));
@@ -94,11 +95,62 @@ void masterpoolInstallCallBacks(master_pool_t *pool, MasterPoolItemCreateHandle
     mutexUnlock(&(pool->mutex));
 }
 
+/**
+ * Backs the items of the pool with a huge page slab.
+ * @param pool The master pool.
+ * @param items Number of items the arena is sized for.
+ * @param page_size Huge page size.
+ */
+void masterpoolEnableSlab(master_pool_t *pool, uint32_t items, slab_page_size_t page_size)
+{
+    mutexLock(&(pool->mutex));
+    pool->slab_items     = items;
+    pool->slab_page_size = items > 0 ? page_size : kSlabPageNormal;
+    mutexUnlock(&(pool->mutex));
+}
+
+/**
+ * Gets the slab of the pool, reserving it on the first call.
+ * @param pool The master pool.
+ * @param item_size Size of the item about to be created.
+ * @return The slab, NULL when the pool has none or its items are smaller than item_size.
+ */
+slab_t *masterpoolGetSlab(master_pool_t *pool, uint32_t item_size)
+{
+    slab_t *slab = atomicLoadExplicit(&(pool->slab), memory_order_acquire);
+
+    if (UNLIKELY(slab == NULL))
+    {
+        mutexLock(&(pool->mutex));
+        slab = atomicLoadExplicit(&(pool->slab), memory_order_relaxed);
+        if (slab == NULL && pool->slab_page_size != kSlabPageNormal)
+        {
+            slab = slabCreate(item_size, (size_t) ALIGN2(item_size, kCpuLineCacheSize) * pool->slab_items,
+                              pool->slab_page_size);
+            atomicStoreExplicit(&(pool->slab), slab, memory_order_release);
+            // not retried when it failed
+            pool->slab_page_size = kSlabPageNormal;
+        }
+        mutexUnlock(&(pool->mutex));
+    }
+
+    if (slab == NULL || item_size > slabGetItemSize(slab))
+    {
+        return NULL;
+    }
+    return slab;
+}
+
 /**
  * Destroys the master pool and frees its resources.
  * @param pool The master pool to destroy.
  */
 void masterpoolDestroy(master_pool_t *pool)
 {
+    slab_t *slab = atomicLoadExplicit(&(pool->slab), memory_order_relaxed);
+    if (slab != NULL)
+    {
+        slabDestroy(slab);
+    }
     memoryFree(pool->memptr);
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "slab.h"
 #include "wlibc.h"
 #include "wmutex.h"
 
@@ -68,6 +69,11 @@ typedef struct master_pool_s
     MasterPoolItemDestroyHandle destroy_item_handle;
     atomic_uint                 len;
     const uint32_t              cap;
+    atomic_ullong               stat_hits;   // items handed out from the pool (metrics)
+    atomic_ullong               stat_misses; // items that had to be created because the pool was empty
+    _Atomic(slab_t *)           slab;        // see masterpoolGetSlab
+    slab_page_size_t            slab_page_size;
+    uint32_t                    slab_items;
     void                       *available[];
 } ATTR_ALIGNED_LINE_CACHE master_pool_t;
 
@@ -102,10 +108,15 @@ static inline void masterpoolGetItems(master_pool_t *const pool, master_pool_ite
             {
                 iptr[i] = pool->available[pbase + i];
             }
+            atomicAddExplicit(&(pool->stat_hits), consumed, memory_order_relaxed);
         }
         mutexUnlock(&(pool->mutex));
     }
 
+    if (i < count)
+    {
+        atomicAddExplicit(&(pool->stat_misses), count - i, memory_order_relaxed);
+    }
     for (; i < count; i++)
     {
         iptr[i] = pool->create_item_handle(pool, userdata);
@@ -168,6 +179,23 @@ static inline void masterpoolReuseItems(master_pool_t *const pool, master_pool_i
 void masterpoolInstallCallBacks(master_pool_t *pool, MasterPoolItemCreateHandle create_h,
                                 MasterPoolItemDestroyHandle destroy_h);
 
+/**
+ * Backs the items of the pool with a huge page slab (slab.h). The arena is reserved when the first item is
+ * created, sized for that item; nothing changes when the slab cannot be created.
+ * @param pool The master pool, before any item is created.
+ * @param items Number of items the arena is sized for.
+ * @param page_size Huge page size, kSlabPageNormal leaves the pool as it is.
+ */
+void masterpoolEnableSlab(master_pool_t *pool, uint32_t items, slab_page_size_t page_size);
+
+/**
+ * Gets the slab the create handles of the pool carve their items from, thread safe.
+ * @param pool The master pool.
+ * @param item_size Size of the item about to be created.
+ * @return The slab, NULL when the pool has none or its items are smaller than item_size.
+ */
+slab_t *masterpoolGetSlab(master_pool_t *pool, uint32_t item_size);
+
 /**
  * Creates a master pool with a specified capacity.
  * @param pool_width The width of the pool.
@@ -1,4 +1,5 @@
 #include "shiftbuffer.h"
+#include "slab.h"
 #include "wlibc.h"
 
 // #define LEFTPADDING  ((RAM_PROFILE >= kRamProfileS2Memory ? (1U << 10) : (1U << 8)) - (sizeof(uint32_t) * 3))
@@ -12,33 +13,72 @@
  */
 void sbufDestroy(sbuf_t *b)
 {
+    if (sbufIsShared(b))
+    {
+        b->refc--;
+        return;
+    }
+    slab_t *slab = slabFind(b);
+    if (UNLIKELY(slab != NULL))
+    {
+        slabFree(slab, b);
+        return;
+    }
     memoryFree(b);
 }
 
-/**
- * Creates a new shift buffer with specified minimum capacity and left padding.
- * @param minimum_capacity The minimum capacity of the buffer.
- * @param pad_left The left padding of the buffer.
- * @return A pointer to the created shift buffer.
- */
-sbuf_t *sbufNewWithPadding(uint32_t minimum_capacity, uint16_t pad_left)
+static uint32_t roundCapacity(uint32_t minimum_capacity)
 {
     if (minimum_capacity != 0 && minimum_capacity % kCpuLineCacheSize != 0)
     {
         minimum_capacity = (max(kCpuLineCacheSize, minimum_capacity) + kCpuLineCacheSizeMin1) & ~kCpuLineCacheSizeMin1;
     }
+    return minimum_capacity;
+}
 
-    uint32_t real_cap = minimum_capacity + pad_left;
-    sbuf_t  *b        = memoryAllocate(real_cap + 128);
+/**
+ * Gets the number of bytes sbufNewWithPadding allocates for a buffer.
+ * @param minimum_capacity The minimum capacity of the buffer.
+ * @param pad_left The left padding of the buffer.
+ * @return The allocation size.
+ */
+uint32_t sbufGetAllocationSize(uint32_t minimum_capacity, uint16_t pad_left)
+{
+    return roundCapacity(minimum_capacity) + pad_left + 128;
+}
+
+/**
+ * Creates a shift buffer in memory the caller provides.
+ * @param memory At least sbufGetAllocationSize bytes.
+ * @param minimum_capacity The minimum capacity of the buffer.
+ * @param pad_left The left padding of the buffer.
+ * @return A pointer to the created shift buffer.
+ */
+sbuf_t *sbufCreateIn(void *memory, uint32_t minimum_capacity, uint16_t pad_left)
+{
+    sbuf_t *b = memory;
 
     b->len      = 0;
     b->curpos   = pad_left;
-    b->capacity = real_cap;
+    b->capacity = roundCapacity(minimum_capacity) + pad_left;
     b->l_pad    = pad_left;
+    b->refc     = 0;
 
     return b;
 }
 
+/**
+ * Creates a new shift buffer with specified minimum capacity and left padding.
+ * @param minimum_capacity The minimum capacity of the buffer.
+ * @param pad_left The left padding of the buffer.
+ * @return A pointer to the created shift buffer.
+ */
+sbuf_t *sbufNewWithPadding(uint32_t minimum_capacity, uint16_t pad_left)
+{
+    return sbufCreateIn(memoryAllocate(sbufGetAllocationSize(minimum_capacity, pad_left)), minimum_capacity,
+                        pad_left);
+}
+
 /**
  * Creates a new shift buffer with specified minimum capacity.
  * @param minimum_capacity The minimum capacity of the buffer.
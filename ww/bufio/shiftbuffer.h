@@ -11,6 +11,10 @@
     This buffer is supposed to be taken out of a pool (buffer_pool.h)
     and some of the other useful functions are defined there
 
+    refc counts the extra holders of the memory (views, see buffer_view.h), a buffer with refc == 0 is owned by
+    exactly one holder like before. Every holder releases it the normal way (bufferpoolResuesBuffer / sbufDestroy)
+    and only the last release really recycles it. The count is not atomic, views stay on the worker that made them
+
 
 */
 
@@ -20,6 +24,7 @@ struct sbuf_s
     uint32_t len;
     uint32_t capacity;
     uint16_t l_pad;
+    uint16_t refc; // fits in the alignment gap before buf, sbuf_t size is unchanged
 #ifdef COMPILER_MSVC
     ATTR_ALIGNED_16 uint8_t buf[];
 #else
@@ -43,6 +48,24 @@ void sbufDestroy(sbuf_t *b);
  */
 sbuf_t *sbufNewWithPadding(uint32_t minimum_capacity, uint16_t pad_left);
 
+/**
+ * Gets the number of bytes sbufNewWithPadding allocates for a buffer.
+ * @param minimum_capacity The minimum capacity of the buffer.
+ * @param pad_left The left padding of the buffer.
+ * @return The allocation size.
+ */
+uint32_t sbufGetAllocationSize(uint32_t minimum_capacity, uint16_t pad_left);
+
+/**
+ * Creates a shift buffer in memory the caller provides (a slab item, see slab.h), sbufDestroy gives the memory
+ * back to its slab.
+ * @param memory At least sbufGetAllocationSize bytes.
+ * @param minimum_capacity The minimum capacity of the buffer.
+ * @param pad_left The left padding of the buffer.
+ * @return A pointer to the created shift buffer.
+ */
+sbuf_t *sbufCreateIn(void *memory, uint32_t minimum_capacity, uint16_t pad_left);
+
 /**
  * Creates a new shift buffer with specified minimum capacity.
  * @param minimum_capacity The minimum capacity of the buffer.
@@ -82,6 +105,29 @@ sbuf_t *sbufSlice(sbuf_t *b, uint32_t bytes);
  */
 sbuf_t *sbufDuplicate(sbuf_t *b);
 
+/**
+ * Adds a holder to the buffer, the buffer is recycled only after every holder released it.
+ * @param b The buffer.
+ * @return The same buffer.
+ */
+static inline sbuf_t *sbufRef(sbuf_t *const b)
+{
+    assert(b->refc < UINT16_MAX);
+    b->refc++;
+    return b;
+}
+
+/**
+ * Checks if the memory of the buffer is shared with views, writing to a shared buffer is only safe
+ * outside of the ranges that views point to.
+ * @param b The buffer.
+ * @return True if someone else also holds the buffer.
+ */
+static inline bool sbufIsShared(const sbuf_t *const b)
+{
+    return b->refc > 0;
+}
+
 /**
  * Gets the total capacity of the buffer.
  * @param b The buffer.
@@ -99,7 +145,7 @@ static inline uint32_t sbufGetTotalCapacity(sbuf_t *const b)
  */
 static inline uint32_t sbufGetTotalCapacityNoPadding(sbuf_t *const b)
 {
-    assert(((uint32_t) b->l_pad) >= b->capacity);
+    assert(b->capacity >= ((uint32_t) b->l_pad));
 
     return b->capacity - ((uint32_t) b->l_pad);
 }
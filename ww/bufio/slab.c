@@ -0,0 +1,221 @@
+#include "slab.h"
+
+#include "loggers/internal_logger.h"
+
+#ifdef OS_UNIX
+#include <sys/mman.h>
+#endif
+
+typedef struct slab_free_item_s
+{
+    struct slab_free_item_s *next;
+
+} slab_free_item_t;
+
+struct slab_s
+{
+    uint8_t          *base;
+    uint8_t          *end;
+    size_t            map_size;
+    uint32_t          item_size;
+    atomic_size_t     offset; // bump pointer, items below it were handed out at least once
+    wmutex_t          mutex;
+    slab_free_item_t *free_list;
+    atomic_uint       free_len;
+};
+
+static _Atomic(slab_t *) arenas[kSlabMaxArenas];
+static atomic_uint       arenas_count;
+
+// false when every slot is taken, the pool of that slab keeps using malloc then
+static bool registerArena(slab_t *slab)
+{
+    unsigned int index = atomicLoadExplicit(&arenas_count, memory_order_relaxed);
+    do
+    {
+        if (index >= kSlabMaxArenas)
+        {
+            return false;
+        }
+    } while (! atomicCompareExchangeExplicit(&arenas_count, &index, index + 1, memory_order_relaxed,
+                                             memory_order_relaxed));
+
+    atomicStoreExplicit(&arenas[index], slab, memory_order_release);
+    return true;
+}
+
+#ifdef OS_LINUX
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+static void *mapArena(size_t *size, slab_page_size_t page_size)
+{
+    const size_t huge = page_size == kSlabPage1GB ? (1UL << 30) : (1UL << 21);
+    const int    flag = page_size == kSlabPage1GB ? MAP_HUGE_1GB : MAP_HUGE_2MB;
+
+    *size   = ALIGN2(*size, huge);
+    void *p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flag, -1, 0);
+    if (p != MAP_FAILED)
+    {
+        return p;
+    }
+
+    // no reserved huge pages of that size, let the kernel back a 2MB aligned mapping with transparent ones
+    const size_t thp_align = 1UL << 21;
+    uint8_t     *raw = mmap(NULL, *size + thp_align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((void *) raw == MAP_FAILED)
+    {
+        return NULL;
+    }
+    uint8_t *aligned = (uint8_t *) ALIGN2((uintptr_t) raw, thp_align);
+    if (aligned != raw)
+    {
+        munmap(raw, aligned - raw);
+    }
+    munmap(aligned + *size, (raw + thp_align) - aligned);
+
+    if (madvise(aligned, *size, MADV_HUGEPAGE) != 0)
+    {
+        LOGW("Slab: transparent huge pages are not available, the arena uses normal pages");
+    }
+    else
+    {
+        LOGD("Slab: MAP_HUGETLB failed, the arena uses transparent huge pages");
+    }
+    return aligned;
+}
+
+static void unmapArena(void *base, size_t size)
+{
+    munmap(base, size);
+}
+
+#else
+
+static void *mapArena(size_t *size, slab_page_size_t page_size)
+{
+    (void) size;
+    (void) page_size;
+    return NULL;
+}
+
+static void unmapArena(void *base, size_t size)
+{
+    (void) base;
+    (void) size;
+}
+
+#endif
+
+slab_t *slabCreate(uint32_t item_size, size_t reserve_bytes, slab_page_size_t page_size)
+{
+    if (page_size == kSlabPageNormal || item_size == 0 || reserve_bytes == 0)
+    {
+        return NULL;
+    }
+
+    item_size     = (uint32_t) ALIGN2(item_size, kCpuLineCacheSize);
+    size_t size   = max(reserve_bytes, (size_t) item_size);
+    void  *memory = mapArena(&size, page_size);
+    if (memory == NULL)
+    {
+        LOGW("Slab: could not map a %zu byte arena, the pool falls back to malloc", size);
+        return NULL;
+    }
+
+    slab_t *slab = memoryAllocate(sizeof(slab_t));
+    *slab        = (slab_t) {.base = memory, .end = (uint8_t *) memory + size, .map_size = size, .item_size = item_size};
+    atomicStoreExplicit(&slab->offset, 0, memory_order_relaxed);
+    atomicStoreExplicit(&slab->free_len, 0, memory_order_relaxed);
+    mutexInit(&slab->mutex);
+
+    if (! registerArena(slab))
+    {
+        LOGW("Slab: all %d arenas are taken, the pool falls back to malloc", kSlabMaxArenas);
+        unmapArena(slab->base, slab->map_size);
+        mutexDestroy(&slab->mutex);
+        memoryFree(slab);
+        return NULL;
+    }
+    return slab;
+}
+
+void slabDestroy(slab_t *slab)
+{
+    unsigned int count = atomicLoadExplicit(&arenas_count, memory_order_acquire);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (atomicLoadExplicit(&arenas[i], memory_order_relaxed) == slab)
+        {
+            // the slot stays, lookups just skip it
+            atomicStoreExplicit(&arenas[i], NULL, memory_order_release);
+        }
+    }
+    unmapArena(slab->base, slab->map_size);
+    mutexDestroy(&slab->mutex);
+    memoryFree(slab);
+}
+
+void *slabAllocate(slab_t *slab)
+{
+    if (atomicLoadExplicit(&slab->free_len, memory_order_relaxed) > 0)
+    {
+        mutexLock(&slab->mutex);
+        slab_free_item_t *item = slab->free_list;
+        if (item != NULL)
+        {
+            slab->free_list = item->next;
+            atomicAddExplicit(&slab->free_len, -1, memory_order_relaxed);
+        }
+        mutexUnlock(&slab->mutex);
+        if (item != NULL)
+        {
+            return item;
+        }
+    }
+
+    size_t offset = atomicAddExplicit(&slab->offset, slab->item_size, memory_order_relaxed);
+    if (offset + slab->item_size > (size_t) (slab->end - slab->base))
+    {
+        return NULL;
+    }
+    return slab->base + offset;
+}
+
+void slabFree(slab_t *slab, void *item)
+{
+    slab_free_item_t *fi = item;
+
+    mutexLock(&slab->mutex);
+    fi->next        = slab->free_list;
+    slab->free_list = fi;
+    atomicAddExplicit(&slab->free_len, 1, memory_order_relaxed);
+    mutexUnlock(&slab->mutex);
+}
+
+uint32_t slabGetItemSize(const slab_t *slab)
+{
+    return slab->item_size;
+}
+
+slab_t *slabFind(const void *ptr)
+{
+    unsigned int count = atomicLoadExplicit(&arenas_count, memory_order_acquire);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        slab_t *slab = atomicLoadExplicit(&arenas[i], memory_order_acquire);
+        if (slab != NULL && (const uint8_t *) ptr >= slab->base && (const uint8_t *) ptr < slab->end)
+        {
+            return slab;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "wlibc.h"
+#include "wmutex.h"
+
+/*
+    Slab
+
+    An opt-in backend for the items of a master pool (master_pool.h). Instead of one memoryAllocate per item, a
+    slab reserves one arena up front and carves fixed size, cache line aligned items out of it; the arena is
+    backed by huge pages so tens of thousands of pooled buffers cost a handful of TLB entries.
+
+    The arena is mapped with MAP_HUGETLB (2MB or 1GB pages) when the system has huge pages reserved, otherwise it
+    is a normal mapping advised with MADV_HUGEPAGE (transparent huge pages), and when neither is possible no slab
+    is created and the pool keeps using memoryAllocate.
+
+    Items are handed out by bumping an offset, freed items go to a free list and are handed out again first. When
+    the arena is used up slabAllocate returns NULL and the caller falls back to memoryAllocate, so an arena is
+    sized for the steady state of the pool, not for its peak.
+
+    The memory of an item does not tell where it came from, slabFind looks the address up in the (few) arenas so
+    the generic free paths (sbufDestroy) can route a slab item back to its slab.
+
+*/
+
+typedef enum slab_page_size_e
+{
+    kSlabPageNormal = 0, // no huge pages, the slab is not created
+    kSlabPage2MB,
+    kSlabPage1GB
+
+} slab_page_size_t;
+
+enum
+{
+    kSlabMaxArenas = 32
+};
+
+typedef struct slab_s slab_t;
+
+/**
+ * Reserves an arena for items of a fixed size.
+ * @param item_size Size of one item, rounded up to the cache line size.
+ * @param reserve_bytes Size of the arena, rounded up to the page size.
+ * @param page_size Huge page size to ask for, falls back to transparent huge pages.
+ * @return The slab, NULL when huge pages are disabled, no arena could be mapped or all kSlabMaxArenas are taken.
+ */
+slab_t *slabCreate(uint32_t item_size, size_t reserve_bytes, slab_page_size_t page_size);
+
+/**
+ * Unmaps the arena, every item of the slab must be freed before.
+ * @param slab The slab.
+ */
+void slabDestroy(slab_t *slab);
+
+/**
+ * Takes one item, thread safe.
+ * @param slab The slab.
+ * @return The item, NULL when the arena is used up.
+ */
+void *slabAllocate(slab_t *slab);
+
+/**
+ * Gives an item back, thread safe.
+ * @param slab The slab that owns the item.
+ * @param item The item.
+ */
+void slabFree(slab_t *slab, void *item);
+
+/**
+ * @param slab The slab.
+ * @return The (cache line aligned) size of the items of the slab.
+ */
+uint32_t slabGetItemSize(const slab_t *slab);
+
+/**
+ * Finds the slab whose arena holds an address.
+ * @param ptr The address.
+ * @return The slab, NULL when the address was not carved from any slab.
+ */
+slab_t *slabFind(const void *ptr);
@@ -4,11 +4,19 @@
 #include "wplatform.h"
 #include "wthread.h"
 #include "master_pool.h"
+#include "worker.h"
 #include <stdint.h>
 
+enum
+{
+    kCaptureReadBurstMax = 64 // packets handed to a worker in one read event (same as kTunnelBurstMax)
+};
+
 struct capture_device_s;
 
-typedef void (*CaptureReadEventHandle)(struct capture_device_s *cdev, void *userdata, sbuf_t *buf, wid_t tid);
+// called on the worker with a burst of packets, the callee owns the buffers but not the array
+typedef void (*CaptureReadEventHandle)(struct capture_device_s *cdev, void *userdata, sbuf_t **bufs, uint32_t count,
+                                       wid_t tid);
 
 typedef struct capture_device_s
 {
@@ -1,5 +1,6 @@
 #include "capture.h"
 #include "generic_pool.h"
+#include "global_state.h"
 #include "wchan.h"
 #include "loggers/internal_logger.h"
 #include "worker.h"
@@ -28,7 +29,8 @@ enum
 struct msg_event
 {
     capture_device_t *cdev;
-    sbuf_t   *buf;
+    uint32_t          count;
+    sbuf_t           *bufs[kCaptureReadBurstMax];
 };
 
 static pool_item_t *allocCaptureMsgPoolHandle(master_pool_t *pool, void *userdata)
@@ -50,17 +52,19 @@ static void localThreadEventReceived(wevent_t *ev)
     struct msg_event *msg = weventGetUserdata(ev);
     wid_t             tid = (wid_t) (wloopTID(weventGetLoop(ev)));
 
-    msg->cdev->read_event_callback(msg->cdev, msg->cdev->userdata, msg->buf, tid);
+    msg->cdev->read_event_callback(msg->cdev, msg->cdev->userdata, msg->bufs, msg->count, tid);
 
     masterpoolReuseItems(msg->cdev->reader_message_pool, (void **) &msg, 1, msg->cdev);
 }
 
-static void distributePacketPayload(capture_device_t *cdev, wid_t target_tid, sbuf_t *buf)
+static void distributePacketPayloads(capture_device_t *cdev, wid_t target_tid, sbuf_t **bufs, uint32_t count)
 {
     struct msg_event *msg;
     masterpoolGetItems(cdev->reader_message_pool, (const void **) &(msg), 1, cdev);
 
-    *msg = (struct msg_event) {.cdev = cdev, .buf = buf};
+    msg->cdev  = cdev;
+    msg->count = count;
+    memoryCopy(msg->bufs, bufs, sizeof(sbuf_t *) * count);
 
     wevent_t ev;
     memorySet(&ev, 0, sizeof(ev));
@@ -171,17 +175,21 @@ static bool netfilterSetQueueLength(int netfilter_socket, uint16_t qnumber, uint
 }
 
 /*
- * Get a packet from netfilter.
+ * Get a packet from netfilter, flags are passed to recvfrom (MSG_DONTWAIT), on failure errno tells why.
  */
-static int netfilterGetPacket(int netfilter_socket, uint16_t qnumber, sbuf_t *buff)
+static int netfilterGetPacket(int netfilter_socket, uint16_t qnumber, sbuf_t *buff, int flags)
 {
     // Read a message from netlink
     char               nl_buff[512 + kEthDataLen + sizeof(struct ethhdr) + sizeof(struct nfqnl_msg_packet_hdr)];
     struct sockaddr_nl nl_addr;
     socklen_t          nl_addr_len = sizeof(nl_addr);
     ssize_t            result =
-        recvfrom(netfilter_socket, nl_buff, sizeof(nl_buff), 0, (struct sockaddr *) &nl_addr, &nl_addr_len);
+        recvfrom(netfilter_socket, nl_buff, sizeof(nl_buff), flags, (struct sockaddr *) &nl_addr, &nl_addr_len);
 
+    if (result < 0)
+    {
+        return -1;
+    }
     if (result <= (int) sizeof(struct nlmsghdr))
     {
         errno = EINVAL;
@@ -280,38 +288,57 @@ static int netfilterGetPacket(int netfilter_socket, uint16_t qnumber, sbuf_t *bu
     return (int) (nl_data_size);
 }
 
+/*
+    The first packet of a burst is waited for, the rest are taken with MSG_DONTWAIT until the queue is drained or
+    the burst is full, then the burst is posted to the next worker
+*/
 static WTHREAD_ROUTINE(routineReadFromCapture) // NOLINT
 {
     capture_device_t *cdev           = userdata;
     wid_t             distribute_tid = 0;
-    sbuf_t   *buf;
+    sbuf_t           *bufs[kCaptureReadBurstMax];
+    uint32_t          count = 0;
+    sbuf_t           *buf;
     ssize_t           nread;
 
+    pinHelperThread();
+
     while (atomicLoadExplicit(&(cdev->running), memory_order_relaxed))
     {
         buf = bufferpoolGetSmallBuffer(cdev->reader_buffer_pool);
 
         buf = sbufReserveSpace(buf, kReadPacketSize);
 
-        nread = netfilterGetPacket(cdev->socket, cdev->queue_number, buf);
+        nread = netfilterGetPacket(cdev->socket, cdev->queue_number, buf, count > 0 ? MSG_DONTWAIT : 0);
 
         if (nread == 0)
         {
             bufferpoolResuesBuffer(cdev->reader_buffer_pool, buf);
             LOGW("CaptureDevice: Exit read routine due to End Of File");
-            return 0;
+            break;
         }
 
         if (nread < 0)
         {
             bufferpoolResuesBuffer(cdev->reader_buffer_pool, buf);
-            LOGW("CaptureDevice: failed to read a packet from netfilter socket, retrying...");
-            continue;
+            if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                LOGW("CaptureDevice: failed to read a packet from netfilter socket, retrying...");
+                continue;
+            }
+        }
+        else
+        {
+            sbufSetLength(buf, nread);
+            bufs[count++] = buf;
+            if (count < kCaptureReadBurstMax)
+            {
+                continue;
+            }
         }
 
-        sbufSetLength(buf, nread);
-
-        distributePacketPayload(cdev, distribute_tid++, buf);
+        distributePacketPayloads(cdev, distribute_tid++, bufs, count);
+        count = 0;
 
         if (distribute_tid >= getWorkersCount())
         {
@@ -319,6 +346,11 @@ static WTHREAD_ROUTINE(routineReadFromCapture) // NOLINT
         }
     }
 
+    for (uint32_t i = 0; i < count; i++)
+    {
+        bufferpoolResuesBuffer(cdev->reader_buffer_pool, bufs[i]);
+    }
+
     return 0;
 }
 
@@ -328,6 +360,8 @@ static WTHREAD_ROUTINE(routineWriteToCapture) // NOLINT
     sbuf_t   *buf;
     ssize_t           nwrite;
 
+    pinHelperThread();
+
     while (atomicLoadExplicit(&(cdev->running), memory_order_relaxed))
     {
         if (! chanRecv(cdev->writer_buffer_channel, &buf))
@@ -4,11 +4,19 @@
 #include "wplatform.h"
 #include "wthread.h"
 #include "master_pool.h"
+#include "worker.h"
 #include <stdint.h>
 
+enum
+{
+    kRawReadBurstMax = 64 // packets handed to a worker in one read event (same as kTunnelBurstMax)
+};
+
 struct raw_device_s;
 
-typedef void (*RawReadEventHandle)(struct raw_device_s *rdev, void *userdata, sbuf_t *buf, wid_t tid);
+// called on the worker with a burst of packets, the callee owns the buffers but not the array
+typedef void (*RawReadEventHandle)(struct raw_device_s *rdev, void *userdata, sbuf_t **bufs, uint32_t count,
+                                   wid_t tid);
 
 typedef struct raw_device_s
 {
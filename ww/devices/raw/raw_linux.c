@@ -22,8 +22,9 @@ enum
 
 struct msg_event
 {
-    raw_device_t   *rdev;
-    sbuf_t *buf;
+    raw_device_t *rdev;
+    uint32_t      count;
+    sbuf_t       *bufs[kRawReadBurstMax];
 };
 
 static pool_item_t *allocRawMsgPoolHandle(master_pool_t *pool, void *userdata)
@@ -45,17 +46,19 @@ static void localThreadEventReceived(wevent_t *ev)
     struct msg_event *msg = weventGetUserdata(ev);
     wid_t             tid = (wid_t) (wloopTID(weventGetLoop(ev)));
 
-    msg->rdev->read_event_callback(msg->rdev, msg->rdev->userdata, msg->buf, tid);
+    msg->rdev->read_event_callback(msg->rdev, msg->rdev->userdata, msg->bufs, msg->count, tid);
 
     masterpoolReuseItems(msg->rdev->reader_message_pool, (void **) &msg, 1, msg->rdev);
 }
 
-static void distributePacketPayload(raw_device_t *rdev, wid_t target_tid, sbuf_t *buf)
+static void distributePacketPayloads(raw_device_t *rdev, wid_t target_tid, sbuf_t **bufs, uint32_t count)
 {
     struct msg_event *msg;
     masterpoolGetItems(rdev->reader_message_pool, (const void **) &(msg), 1, rdev);
 
-    *msg = (struct msg_event) {.rdev = rdev, .buf = buf};
+    msg->rdev  = rdev;
+    msg->count = count;
+    memoryCopy(msg->bufs, bufs, sizeof(sbuf_t *) * count);
 
     wevent_t ev;
     memorySet(&ev, 0, sizeof(ev));
@@ -65,46 +68,66 @@ static void distributePacketPayload(raw_device_t *rdev, wid_t target_tid, sbuf_t
     wloopPostEvent(getWorkerLoop(target_tid), &ev);
 }
 
+/*
+    The first receive of a burst blocks, the rest use MSG_DONTWAIT and the burst is posted to the next worker as
+    soon as the socket is drained or the burst is full
+*/
 static WTHREAD_ROUTINE(routineReadFromRaw) // NOLINT
 {
     raw_device_t   *rdev           = userdata;
     wid_t           distribute_tid = 0;
-    sbuf_t *buf;
+    sbuf_t         *bufs[kRawReadBurstMax];
+    uint32_t        count = 0;
+    sbuf_t         *buf;
     ssize_t         nread;
     struct sockaddr saddr;
     int             saddr_len = sizeof(saddr);
 
+    pinHelperThread();
+
     while (atomicLoadExplicit(&(rdev->running), memory_order_relaxed))
     {
         buf = bufferpoolGetSmallBuffer(rdev->reader_buffer_pool);
 
         buf = sbufReserveSpace(buf, kReadPacketSize);
 
-        nread = recvfrom(rdev->socket, sbufGetMutablePtr(buf), kReadPacketSize, 0, &saddr, (socklen_t *) &saddr_len);
+        nread = recvfrom(rdev->socket, sbufGetMutablePtr(buf), kReadPacketSize, count > 0 ? MSG_DONTWAIT : 0, &saddr,
+                         (socklen_t *) &saddr_len);
 
         if (nread == 0)
         {
             bufferpoolResuesBuffer(rdev->reader_buffer_pool, buf);
             LOGW("RawDevice: Exit read routine due to End Of File");
-            return 0;
+            break;
         }
 
         if (nread < 0)
         {
             bufferpoolResuesBuffer(rdev->reader_buffer_pool, buf);
 
-            LOGE("RawDevice: reading a packet from RAW device failed, code: %d", (int) nread);
-            if (errno == EINVAL || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                LOGE("RawDevice: reading a packet from RAW device failed, code: %d", (int) nread);
+                if (errno == EINVAL || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                {
+                    continue;
+                }
+                LOGE("RawDevice: Exit read routine due to critical error");
+                break;
+            }
+        }
+        else
+        {
+            sbufSetLength(buf, nread);
+            bufs[count++] = buf;
+            if (count < kRawReadBurstMax)
             {
                 continue;
             }
-            LOGE("RawDevice: Exit read routine due to critical error");
-            return 0;
         }
 
-        sbufSetLength(buf, nread);
-
-        distributePacketPayload(rdev, distribute_tid++, buf);
+        distributePacketPayloads(rdev, distribute_tid++, bufs, count);
+        count = 0;
 
         if (distribute_tid >= getWorkersCount())
         {
@@ -112,6 +135,11 @@ static WTHREAD_ROUTINE(routineReadFromRaw) // NOLINT
         }
     }
 
+    for (uint32_t i = 0; i < count; i++)
+    {
+        bufferpoolResuesBuffer(rdev->reader_buffer_pool, bufs[i]);
+    }
+
     return 0;
 }
 
@@ -121,6 +149,8 @@ static WTHREAD_ROUTINE(routineWriteToRaw) // NOLINT
     sbuf_t *buf;
     ssize_t         nwrite;
 
+    pinHelperThread();
+
     while (atomicLoadExplicit(&(rdev->running), memory_order_relaxed))
     {
         if (! chanRecv(rdev->writer_buffer_channel, &buf))
@@ -9,6 +9,11 @@
 
 #define TUN_LOG_EVERYTHING false
 
+enum
+{
+    kTunReadBurstMax = 64 // packets handed to a worker in one read event (same as kTunnelBurstMax)
+};
+
 #ifdef OS_UNIX
 typedef int tun_handle_t;
 #else
@@ -17,7 +22,9 @@ typedef void *tun_handle_t; // Windows handle (void* can hold HANDLE)
 
 struct tun_device_s;
 
-typedef void (*TunReadEventHandle)(struct tun_device_s *tdev, void *userdata, sbuf_t *buf, wid_t tid);
+// called on the worker with a burst of packets, the callee owns the buffers but not the array
+typedef void (*TunReadEventHandle)(struct tun_device_s *tdev, void *userdata, sbuf_t **bufs, uint32_t count,
+                                   wid_t tid);
 
 typedef struct tun_device_s
 {
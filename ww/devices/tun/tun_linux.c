@@ -11,6 +11,7 @@
 #include <linux/if_tun.h>
 #include <linux/ipv6.h>
 #include <netinet/ip.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 
 
@@ -18,13 +19,15 @@ enum
 {
     kReadPacketSize          = 1500,
     kMasterMessagePoosbufGetLeftCapacity    = 64,
-    kTunWriteChannelQueueMax = 256
+    kTunWriteChannelQueueMax = 256,
+    kPollTimeoutMs           = 200
 };
 
 struct msg_event
 {
-    tun_device_t   *tdev;
-    sbuf_t *buf;
+    tun_device_t *tdev;
+    uint32_t      count;
+    sbuf_t       *bufs[kTunReadBurstMax];
 };
 
 static void printIPPacketInfo(const char *devname, const unsigned char *buffer)
@@ -94,17 +97,20 @@ static void localThreadEventReceived(wevent_t *ev)
     struct msg_event *msg = weventGetUserdata(ev);
     wid_t             tid = (wid_t) (wloopTID(weventGetLoop(ev)));
 
-    msg->tdev->read_event_callback(msg->tdev, msg->tdev->userdata, msg->buf, tid);
+    msg->tdev->read_event_callback(msg->tdev, msg->tdev->userdata, msg->bufs, msg->count, tid);
 
     masterpoolReuseItems(msg->tdev->reader_message_pool, (void **) &msg, 1, msg->tdev);
 }
 
-static void distributePacketPayload(tun_device_t *tdev, wid_t target_tid, sbuf_t *buf)
+// one message carries the whole burst, so the worker pays one wakeup and one chain traversal per burst
+static void distributePacketPayloads(tun_device_t *tdev, wid_t target_tid, sbuf_t **bufs, uint32_t count)
 {
     struct msg_event *msg;
     masterpoolGetItems(tdev->reader_message_pool, (const void **) &(msg), 1, tdev);
 
-    *msg = (struct msg_event) {.tdev = tdev, .buf = buf};
+    msg->tdev  = tdev;
+    msg->count = count;
+    memoryCopy(msg->bufs, bufs, sizeof(sbuf_t *) * count);
 
     wevent_t ev;
     memorySet(&ev, 0, sizeof(ev));
@@ -114,12 +120,27 @@ static void distributePacketPayload(tun_device_t *tdev, wid_t target_tid, sbuf_t
     wloopPostEvent(getWorkerLoop(target_tid), &ev);
 }
 
+// waits until the device is ready or the timeout passes, so the routines still see the running flag
+static void waitForDevice(tun_handle_t handle, short events)
+{
+    struct pollfd pfd = {.fd = handle, .events = events};
+    poll(&pfd, 1, kPollTimeoutMs);
+}
+
+/*
+    The device is non blocking, the reader drains it into a burst until it would block or the burst is full, then
+    posts the burst to the next worker; it only sleeps in poll when there is nothing to hand over
+*/
 static WTHREAD_ROUTINE(routineReadFromTun) // NOLINT
 {
-    tun_device_t   *tdev           = userdata;
-    wid_t           distribute_tid = 0;
-    sbuf_t *buf;
-    ssize_t         nread;
+    tun_device_t *tdev           = userdata;
+    wid_t         distribute_tid = 0;
+    sbuf_t       *bufs[kTunReadBurstMax];
+    uint32_t      count = 0;
+    sbuf_t       *buf;
+    ssize_t       nread;
+
+    pinHelperThread();
 
     while (atomicLoadExplicit(&(tdev->running), memory_order_relaxed))
     {
@@ -133,30 +154,50 @@ static WTHREAD_ROUTINE(routineReadFromTun) // NOLINT
         {
             bufferpoolResuesBuffer(tdev->reader_buffer_pool, buf);
             LOGW("TunDevice: Exit read routine due to End Of File");
-            return 0;
+            break;
         }
 
         if (nread < 0)
         {
             bufferpoolResuesBuffer(tdev->reader_buffer_pool, buf);
 
-            LOGE("TunDevice: reading a packet from TUN device failed, code: %d", (int) nread);
-            if (errno == EINVAL || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
+                if (count == 0)
+                {
+                    waitForDevice(tdev->handle, POLLIN);
+                    continue;
+                }
+            }
+            else
+            {
+                LOGE("TunDevice: reading a packet from TUN device failed, code: %d", (int) nread);
+                if (errno != EINVAL && errno != EINTR)
+                {
+                    LOGE("TunDevice: Exit read routine due to critical error");
+                    break;
+                }
                 continue;
             }
-            LOGE("TunDevice: Exit read routine due to critical error");
-            return 0;
         }
+        else
+        {
+            sbufSetLength(buf, nread);
 
-        sbufSetLength(buf, nread);
+            if (TUN_LOG_EVERYTHING)
+            {
+                LOGD("TunDevice: read %zd bytes from device %s", nread, tdev->name);
+            }
 
-        if (TUN_LOG_EVERYTHING)
-        {
-            LOGD("TunDevice: read %zd bytes from device %s", nread, tdev->name);
+            bufs[count++] = buf;
+            if (count < kTunReadBurstMax)
+            {
+                continue;
+            }
         }
 
-        distributePacketPayload(tdev, distribute_tid++, buf);
+        distributePacketPayloads(tdev, distribute_tid++, bufs, count);
+        count = 0;
 
         if (distribute_tid >= getWorkersCount())
         {
@@ -164,14 +205,21 @@ static WTHREAD_ROUTINE(routineReadFromTun) // NOLINT
         }
     }
 
+    for (uint32_t i = 0; i < count; i++)
+    {
+        bufferpoolResuesBuffer(tdev->reader_buffer_pool, bufs[i]);
+    }
+
     return 0;
 }
 
 static WTHREAD_ROUTINE(routineWriteToTun) // NOLINT
 {
-    tun_device_t   *tdev = userdata;
-    sbuf_t *buf;
-    ssize_t         nwrite;
+    tun_device_t *tdev = userdata;
+    sbuf_t       *buf;
+    ssize_t       nwrite;
+
+    pinHelperThread();
 
     while (atomicLoadExplicit(&(tdev->running), memory_order_relaxed))
     {
@@ -185,6 +233,13 @@ static WTHREAD_ROUTINE(routineWriteToTun) // NOLINT
 
         nwrite = write(tdev->handle, sbufGetRawPtr(buf), sbufGetBufLength(buf));
 
+        while (nwrite < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+               atomicLoadExplicit(&(tdev->running), memory_order_relaxed))
+        {
+            waitForDevice(tdev->handle, POLLOUT);
+            nwrite = write(tdev->handle, sbufGetRawPtr(buf), sbufGetBufLength(buf));
+        }
+
         bufferpoolResuesBuffer(tdev->writer_buffer_pool, buf);
 
         if (nwrite == 0)
@@ -343,6 +398,14 @@ tun_device_t *createTunDevice(const char *name, bool offload, void *userdata, Tu
         return NULL;
     }
 
+    // the read routine builds bursts, it must be able to see that the device is drained
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0)
+    {
+        LOGE("TunDevice: could not set the device non blocking");
+        close(fd);
+        return NULL;
+    }
+
     buffer_pool_t *reader_bpool =
         bufferpoolCreate(GSTATE.masterpool_buffer_pools_large, GSTATE.masterpool_buffer_pools_small, 
                          (0) + GSTATE.ram_profile,SMALL_BUFFER_SIZE,LARGE_BUFFER_SIZE);
@@ -136,6 +136,38 @@ static int nio_connect_async(wio_t* io) {
     return 0;
 }
 
+#if defined(OS_LINUX) && defined(IP_ORIGDSTADDR)
+static int recvOrigDst(wio_t* io, void* buf, int len) {
+    char          control[CMSG_SPACE(sizeof(struct sockaddr_in6))];
+    struct iovec  iov = {.iov_base = buf, .iov_len = (size_t)len};
+    struct msghdr msg = {.msg_name       = io->peeraddr,
+                         .msg_namelen    = sizeof(sockaddr_u),
+                         .msg_iov        = &iov,
+                         .msg_iovlen     = 1,
+                         .msg_control    = control,
+                         .msg_controllen = sizeof(control)};
+
+    int nread = (int)recvmsg(io->fd, &msg, 0);
+    if (nread < 0) {
+        return nread;
+    }
+    io->origdst_port = 0;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_ORIGDSTADDR) {
+            struct sockaddr_in dst;
+            memoryCopy(&dst, CMSG_DATA(c), sizeof(dst));
+            io->origdst_port = ntohs(dst.sin_port);
+        }
+        else if (c->cmsg_level == IPPROTO_IPV6 && c->cmsg_type == IPV6_ORIGDSTADDR) {
+            struct sockaddr_in6 dst;
+            memoryCopy(&dst, CMSG_DATA(c), sizeof(dst));
+            io->origdst_port = ntohs(dst.sin6_port);
+        }
+    }
+    return nread;
+}
+#endif
+
 static int __nio_read(wio_t* io, void* buf, int len) {
     int nread = 0;
     switch (io->io_type) {
@@ -150,6 +182,12 @@ static int __nio_read(wio_t* io, void* buf, int len) {
         break;
     case WIO_TYPE_UDP:
     case WIO_TYPE_IP: {
+#if defined(OS_LINUX) && defined(IP_ORIGDSTADDR)
+        if (io->recvorigdst) {
+            nread = recvOrigDst(io, buf, len);
+            break;
+        }
+#endif
         socklen_t addrlen = sizeof(sockaddr_u);
         nread = recvfrom(io->fd, buf, len, 0, io->peeraddr, &addrlen);
     } break;
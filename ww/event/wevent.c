@@ -95,6 +95,7 @@ void wioReady(wio_t* io) {
     io->recv = io->send = 0;
     io->recvfrom = io->sendto = 0;
     io->close = 0;
+    io->recvorigdst = 0;
     // public:
     io->id = wioSetNextID();
     io->io_type = WIO_TYPE_UNKNOWN;
@@ -103,6 +104,7 @@ void wioReady(wio_t* io) {
     io->last_read_hrtime = io->last_write_hrtime = io->loop->cur_hrtime;
 
     io->read_flags = 0;
+    io->origdst_port = 0;
     // write_queue
     io->write_bufsize = 0;
     io->max_write_bufsize = MAX_WRITE_BUFSIZE;
@@ -224,6 +226,32 @@ struct sockaddr* wioGetPeerAddr(wio_t* io) {
     return io->peeraddr;
 }
 
+int wioEnableRecvOrigDst(wio_t* io) {
+#if defined(OS_LINUX) && defined(IP_RECVORIGDSTADDR)
+    int on = 1;
+    int ret = 0;
+    if (io->localaddr->sa_family == AF_INET6) {
+        ret = setsockopt(io->fd, IPPROTO_IPV6, IPV6_RECVORIGDSTADDR, (const char*)&on, sizeof(on));
+        // dualstack sockets get the v4 datagrams with a v4 cmsg
+        setsockopt(io->fd, IPPROTO_IP, IP_RECVORIGDSTADDR, (const char*)&on, sizeof(on));
+    }
+    else {
+        ret = setsockopt(io->fd, IPPROTO_IP, IP_RECVORIGDSTADDR, (const char*)&on, sizeof(on));
+    }
+    if (ret == 0) {
+        io->recvorigdst = 1;
+    }
+    return ret;
+#else
+    (void)io;
+    return -1;
+#endif
+}
+
+uint16_t wioGetOrigDstPort(wio_t* io) {
+    return io->origdst_port;
+}
+
 waccept_cb wioGetCallBackAccept(wio_t* io) {
     return io->accept_cb;
 }
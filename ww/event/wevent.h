@@ -25,7 +25,14 @@
 #define WIO_READ_UNTIL_DELIM    0x4
 
 ARRAY_DECL(wio_t*, io_array)
-QUEUE_DECL(wevent_t, event_queue)
+
+// post_us is only stamped when the loop records stats (wloop_stats.h)
+typedef struct custom_event_s {
+    wevent_t ev;
+    uint64_t post_us;
+} custom_event_t;
+
+QUEUE_DECL(custom_event_t, event_queue)
 
 struct wloop_s {
     uint32_t                    flags;
@@ -62,6 +69,10 @@ struct wloop_s {
     int                         eventfds[2];
     event_queue                 custom_events;
     wmutex_t                    custom_events_mutex;
+    // latency histograms, NULL unless wloopEnableStats
+    struct wloop_stats_s*       stats;
+    // called at the end of every iteration, NULL unless wloopSetIterationCallBack
+    wloop_iteration_cb          iteration_cb;
 };
 
 uint64_t wloopGetNextEventID(void);
@@ -114,6 +125,7 @@ struct wio_s {
     unsigned    recvfrom    :1;
     unsigned    sendto      :1;
     unsigned    close       :1;
+    unsigned    recvorigdst :1; // udp: read the original destination of each datagram (IP_ORIGDSTADDR)
 // public:
     wio_type_e  io_type;
     uint32_t    id; // fd cannot be used as unique identifier, so we provide an id
@@ -139,6 +151,7 @@ struct wio_s {
     uint64_t            last_write_hrtime;
     // read
     unsigned int        read_flags;
+    uint16_t            origdst_port; // destination port of the last datagram, when recvorigdst
     // write
     struct write_queue  write_queue;
     // wrecursive_mutex_t  write_mutex; // lock write and write_queue
@@ -1,6 +1,7 @@
 #include "wloop.h"
 #include "wevent.h"
 #include "iowatcher.h"
+#include "wloop_stats.h"
 
 #include "wdef.h"
 #include "ev_memory.h"
@@ -118,7 +119,15 @@ static int wloopProcessPendings(wloop_t* loop) {
             next = cur->pending_next;
             if (cur->pending) {
                 if (cur->active && cur->cb) {
-                    cur->cb(cur);
+                    if (UNLIKELY(loop->stats != NULL)) {
+                        loop->stats->owner = NULL;
+                        uint64_t begin_us = getHRTimeUs();
+                        cur->cb(cur);
+                        wloopstatsRecordCallback(loop->stats, (void*)cur->cb, cur->event_type, getHRTimeUs() - begin_us);
+                    }
+                    else {
+                        cur->cb(cur);
+                    }
                     ++ncbs;
                 }
                 cur->pending = 0;
@@ -135,12 +144,23 @@ static int wloopProcessPendings(wloop_t* loop) {
     return ncbs;
 }
 
+// records the phase that started at begin_us and returns the start of the next one
+static uint64_t wloopStatsPhaseEnd(wloop_stats_t* stats, wloop_hist_e phase, uint64_t begin_us) {
+    uint64_t now_us = getHRTimeUs();
+    wloopstatsRecord(&stats->hists[phase], now_us - begin_us);
+    return now_us;
+}
+
 // wloopProcessIOS -> wloopProcessTimers -> wloopProcessIdles -> wloopProcessPendings
 int wloopProcessEvents(wloop_t* loop, int timeout_ms) {
     // ios -> timers -> idles
     int nios, ntimers, nidles;
     nios = ntimers = nidles = 0;
 
+    wloop_stats_t* stats = loop->stats;
+    uint64_t phase_us = 0;
+    uint64_t busy_us = 0;
+
     // calc blocktime
     int32_t blocktime_ms = timeout_ms;
     if (loop->ntimers) {
@@ -159,6 +179,9 @@ int wloopProcessEvents(wloop_t* loop, int timeout_ms) {
         blocktime_ms = min(blocktime_ms, timeout_ms);
     }
 
+    if (UNLIKELY(stats != NULL)) {
+        phase_us = getHRTimeUs();
+    }
     if (loop->nios) {
         nios = wloopProcessIOS(loop, blocktime_ms);
     }
@@ -166,15 +189,24 @@ int wloopProcessEvents(wloop_t* loop, int timeout_ms) {
         hv_msleep(blocktime_ms);
     }
     wloopUpdateTime(loop);
+    if (UNLIKELY(stats != NULL)) {
+        wloopstatsRecord(&stats->hists[WLOOP_HIST_POLL], loop->cur_hrtime - phase_us);
+    }
     // wakeup by wloopStop
     if (loop->status == WLOOP_STATUS_STOP) {
         return 0;
     }
 
 process_timers:
+    if (UNLIKELY(stats != NULL)) {
+        busy_us = phase_us = getHRTimeUs();
+    }
     if (loop->ntimers) {
         ntimers = wloopProcessTimers(loop);
     }
+    if (UNLIKELY(stats != NULL)) {
+        phase_us = wloopStatsPhaseEnd(stats, WLOOP_HIST_TIMERS, phase_us);
+    }
 
     int npendings = loop->npendings;
     if (npendings == 0) {
@@ -182,7 +214,17 @@ process_timers:
             nidles = wloopProcessIdles(loop);
         }
     }
+    if (UNLIKELY(stats != NULL)) {
+        phase_us = wloopStatsPhaseEnd(stats, WLOOP_HIST_IDLES, phase_us);
+    }
     int ncbs = wloopProcessPendings(loop);
+    if (loop->iteration_cb) {
+        loop->iteration_cb(loop);
+    }
+    if (UNLIKELY(stats != NULL)) {
+        phase_us = wloopStatsPhaseEnd(stats, WLOOP_HIST_PENDINGS, phase_us);
+        wloopstatsRecord(&stats->hists[WLOOP_HIST_ITERATION], phase_us - busy_us);
+    }
     printd("blocktime=%d nios=%d/%u ntimers=%d/%u nidles=%d/%u nactives=%d npendings=%d ncbs=%d\n", blocktime, nios, loop->nios, ntimers, loop->ntimers, nidles,
            loop->nidles, loop->nactives, npendings, ncbs);
     (void)nios;
@@ -199,8 +241,9 @@ static void wloopStatTimerCallBack(wtimer_t* timer) {
 
 static void eventFDReadCB(wio_t* io, sbuf_t* buf) {
     wloop_t* loop = io->loop;
-    wevent_t* pev = NULL;
+    custom_event_t* pev = NULL;
     wevent_t ev;
+    uint64_t post_us;
     uint64_t count = sbufGetBufLength(buf);
 #if defined(OS_UNIX) && HAVE_EVENTFD
     assert(sbufGetBufLength(buf) == sizeof(count));
@@ -216,11 +259,22 @@ static void eventFDReadCB(wio_t* io, sbuf_t* buf) {
         if (pev == NULL) {
             goto unlock;
         }
-        ev = *pev;
+        ev = pev->ev;
+        post_us = pev->post_us;
         event_queue_pop_front(&loop->custom_events);
         // NOTE: unlock before cb, avoid deadlock if wloopPostEvent called in cb.
         mutexUnlock(&loop->custom_events_mutex);
-        if (ev.cb) {
+        if (UNLIKELY(loop->stats != NULL) && ev.cb) {
+            uint64_t begin_us = getHRTimeUs();
+            if (post_us != 0) {
+                wloopstatsRecord(&loop->stats->hists[WLOOP_HIST_QUEUE_DELAY], begin_us - min(post_us, begin_us));
+            }
+            // each custom event is a callback of its own, the eventfd io callback around them is recorded as well
+            loop->stats->owner = NULL;
+            ev.cb(&ev);
+            wloopstatsRecordCallback(loop->stats, (void*)ev.cb, WEVENT_TYPE_CUSTOM, getHRTimeUs() - begin_us);
+        }
+        else if (ev.cb) {
             ev.cb(&ev);
         }
     }
@@ -304,7 +358,8 @@ void wloopPostEvent(wloop_t* loop, wevent_t* ev) {
     if (loop->custom_events.maxsize == 0) {
         event_queue_init(&loop->custom_events, CUSTOM_EVENT_QUEUE_INIT_SIZE);
     }
-    event_queue_push_back(&loop->custom_events, ev);
+    custom_event_t cev = {.ev = *ev, .post_us = loop->stats != NULL ? getHRTimeUs() : 0};
+    event_queue_push_back(&loop->custom_events, &cev);
 unlock:
     mutexUnlock(&loop->custom_events_mutex);
 }
@@ -399,6 +454,14 @@ static void wloopCleanup(wloop_t* loop) {
     event_queue_cleanup(&loop->custom_events);
     mutexUnlock(&loop->custom_events_mutex);
     mutexDestroy(&loop->custom_events_mutex);
+
+    // stats
+    if (loop->stats) {
+        if (tl_wloop_stats == loop->stats) {
+            tl_wloop_stats = NULL;
+        }
+        EVENTLOOP_FREE(loop->stats);
+    }
 }
 
 wloop_t* wloopCreate(int flags, buffer_pool_t* swimmingpool, long wid) {
@@ -434,6 +497,7 @@ int wloopRun(wloop_t* loop) {
 
     loop->status = WLOOP_STATUS_RUNNING;
     loop->pid = getTID();
+    tl_wloop_stats = loop->stats;
     // loop->tid = getTID();  tid is taken at wloop_create
     // wlogd("wloopRun tid=%ld", loop->tid);
 
@@ -565,6 +629,21 @@ uint32_t wloopNTimers(wloop_t* loop) {
     return loop->ntimers;
 }
 
+void wloopEnableStats(wloop_t* loop) {
+    assert(loop->status != WLOOP_STATUS_RUNNING);
+    if (loop->stats == NULL) {
+        EVENTLOOP_ALLOC_SIZEOF(loop->stats);
+    }
+}
+
+wloop_stats_t* wloopGetStats(wloop_t* loop) {
+    return loop->stats;
+}
+
+void wloopSetIterationCallBack(wloop_t* loop, wloop_iteration_cb cb) {
+    loop->iteration_cb = cb;
+}
+
 uint32_t wloopNIdles(wloop_t* loop) {
     return loop->nidles;
 }
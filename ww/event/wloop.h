@@ -28,6 +28,7 @@ typedef void (*wconnect_cb)(wio_t* io);
 typedef void (*wread_cb)(wio_t* io, sbuf_t* buf);
 typedef void (*wwrite_cb)(wio_t* io);
 typedef void (*wclose_cb)(wio_t* io);
+typedef void (*wloop_iteration_cb)(wloop_t* loop);
 
 typedef enum { WLOOP_STATUS_STOP, WLOOP_STATUS_RUNNING, WLOOP_STATUS_PAUSE, WLOOP_STATUS_DESTROY } wloop_status_e;
 
@@ -158,6 +159,12 @@ WW_EXPORT uint64_t wloopCount(wloop_t* loop);
 WW_EXPORT uint32_t wloopNIOS(wloop_t* loop);
 // @return number of timers
 WW_EXPORT uint32_t wloopNTimers(wloop_t* loop);
+// starts recording latency histograms (see wloop_stats.h), call it before wloopRun
+WW_EXPORT void wloopEnableStats(wloop_t* loop);
+// @return stats of the loop, NULL when disabled
+WW_EXPORT struct wloop_stats_s* wloopGetStats(wloop_t* loop);
+// cb runs on the loop thread at the end of every iteration, after the pending callbacks
+WW_EXPORT void wloopSetIterationCallBack(wloop_t* loop, wloop_iteration_cb cb);
 // @return number of idles
 WW_EXPORT uint32_t wloopNIdles(wloop_t* loop);
 // @return number of active events
@@ -273,6 +280,11 @@ WW_EXPORT struct sockaddr_u* wioGetLocaladdrU(wio_t* io);
 WW_EXPORT struct sockaddr_u* wioGetPeerAddrU(wio_t* io);
 WW_EXPORT struct sockaddr* wioGetLocaladdr(wio_t* io);
 WW_EXPORT struct sockaddr* wioGetPeerAddr(wio_t* io);
+// udp: the destination of every datagram is read with IP_ORIGDSTADDR, for sockets that receive datagrams sent to
+// other ports (sk_lookup steering). @return 0 on success
+WW_EXPORT int wioEnableRecvOrigDst(wio_t* io);
+// destination port of the last datagram read, 0 if unknown
+WW_EXPORT uint16_t wioGetOrigDstPort(wio_t* io);
 WW_EXPORT void wioSetContext(wio_t* io, void* ctx);
 WW_EXPORT void* wioGetContext(wio_t* io);
 WW_EXPORT bool wioIsOpened(wio_t* io);
@@ -0,0 +1,116 @@
+#include "wloop_stats.h"
+#include "wloop.h"
+
+#include "wmath.h"
+#include "wtime.h"
+
+thread_local wloop_stats_t* tl_wloop_stats = NULL;
+
+static const char* hist_names[WLOOP_HIST_MAX] = {
+    [WLOOP_HIST_ITERATION]   = "iteration",
+    [WLOOP_HIST_POLL]        = "poll",
+    [WLOOP_HIST_TIMERS]      = "timers",
+    [WLOOP_HIST_IDLES]       = "idles",
+    [WLOOP_HIST_PENDINGS]    = "pendings",
+    [WLOOP_HIST_QUEUE_DELAY] = "queue_delay",
+    [WLOOP_HIST_CALLBACK]    = "callback",
+};
+
+const char* wloopstatsHistName(wloop_hist_e hist) {
+    return hist_names[hist];
+}
+
+const char* wloopstatsEventTypeName(int event_type) {
+    switch (event_type) {
+    case WEVENT_TYPE_IO:
+        return "io";
+    case WEVENT_TYPE_TIMEOUT:
+    case WEVENT_TYPE_PERIOD:
+        return "timer";
+    case WEVENT_TYPE_IDLE:
+        return "idle";
+    case WEVENT_TYPE_CUSTOM:
+        return "custom";
+    default:
+        return "unknown";
+    }
+}
+
+uint64_t wloopstatsPercentile(wloop_hist_t* hist, double percentile) {
+    uint64_t total = atomicLoadExplicit(&hist->count, memory_order_relaxed);
+    if (total == 0) return 0;
+
+    uint64_t target = (uint64_t)((percentile / 100.0) * (double)total);
+    if (target == 0) target = 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < WLOOP_HIST_BUCKETS; ++i) {
+        seen += atomicLoadExplicit(&hist->buckets[i], memory_order_relaxed);
+        if (seen >= target) {
+            return wloopstatsBucketUpperBound(i);
+        }
+    }
+    // buckets were updated after count was read
+    return atomicLoadExplicit(&hist->max, memory_order_relaxed);
+}
+
+void wloopstatsRecordCallback(wloop_stats_t* stats, void* cb, int event_type, uint64_t duration_us) {
+    wloopstatsRecord(&stats->hists[WLOOP_HIST_CALLBACK], duration_us);
+    if (duration_us < WLOOP_STATS_SLOW_US || duration_us <= stats->slowest_min_us) {
+        return;
+    }
+
+    // replace the fastest entry of the table, then find the new minimum
+    unsigned victim = 0;
+    for (unsigned i = 1; i < WLOOP_STATS_SLOWEST; ++i) {
+        if (stats->slowest[i].duration_us < stats->slowest[victim].duration_us) {
+            victim = i;
+        }
+    }
+
+    unsigned seq = atomicLoadExplicit(&stats->slowest_seq, memory_order_relaxed);
+    atomicStoreExplicit(&stats->slowest_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    stats->slowest[victim] = (wloop_slow_cb_t){.duration_us = duration_us,
+                                               .when_ms     = getTimeOfDayMS(),
+                                               .owner       = stats->owner,
+                                               .cb          = cb,
+                                               .event_type  = event_type};
+
+    atomicStoreExplicit(&stats->slowest_seq, seq + 2, memory_order_release);
+
+    uint64_t new_min = stats->slowest[0].duration_us;
+    for (unsigned i = 1; i < WLOOP_STATS_SLOWEST; ++i) {
+        new_min = min(new_min, stats->slowest[i].duration_us);
+    }
+    stats->slowest_min_us = new_min;
+}
+
+int wloopstatsCopySlowest(wloop_stats_t* stats, wloop_slow_cb_t out[WLOOP_STATS_SLOWEST]) {
+    unsigned before, after;
+    do {
+        before = atomicLoadExplicit(&stats->slowest_seq, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        memoryCopy(out, stats->slowest, sizeof(wloop_slow_cb_t) * WLOOP_STATS_SLOWEST);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomicLoadExplicit(&stats->slowest_seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+
+    // insertion sort, slowest first, and drop the empty slots
+    int n = 0;
+    for (int i = 0; i < WLOOP_STATS_SLOWEST; ++i) {
+        if (out[i].duration_us == 0) continue;
+        wloop_slow_cb_t item = out[i];
+        int             j    = n - 1;
+        while (j >= 0 && out[j].duration_us < item.duration_us) {
+            out[j + 1] = out[j];
+            --j;
+        }
+        out[j + 1] = item;
+        ++n;
+    }
+    return n;
+}
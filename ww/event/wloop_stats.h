@@ -0,0 +1,143 @@
+#ifndef WW_LOOP_STATS_H_
+#define WW_LOOP_STATS_H_
+
+#include "wexport.h"
+#include "wplatform.h"
+#include "wdef.h"
+#include "watomic.h"
+
+/*
+    Event loop latency instrumentation
+
+    Off by default, a loop only records anything after wloopEnableStats(), until then the loop pays one
+    pointer check per iteration and per callback
+
+    Everything is in microseconds and recorded into HDR style histograms (8 linear sub buckets per power of two,
+    so any recorded value is off by at most 12.5%), one set per loop:
+
+        iteration     busy time of one wloopProcessEvents round (poll wait excluded)
+        poll          time blocked inside the io multiplexer
+        timers        wloopProcessTimers
+        idles         wloopProcessIdles
+        pendings      wloopProcessPendings, this is where io/timer/idle callbacks run
+        queue_delay   time a posted custom event waited between wloopPostEvent and its callback
+        callback      duration of each single callback (io, timer, idle, custom)
+
+    The slowest callbacks (above WLOOP_STATS_SLOW_US) are kept in a small table together with their owner, the
+    owner is a name that the running callback announces through wloopStatsSetOwner(), adapters set it to their
+    node name when they enter the chain, callbacks that never set it are reported by event type and address
+
+    Only the loop thread writes, readers (metrics endpoint, log dump) do relaxed loads and the slow table is
+    guarded by a sequence counter, so readers never block the loop
+*/
+
+#define WLOOP_HIST_SUB_BITS 3
+#define WLOOP_HIST_SUB_COUNT (1 << WLOOP_HIST_SUB_BITS)
+#define WLOOP_HIST_BUCKETS ((64 - WLOOP_HIST_SUB_BITS + 1) * WLOOP_HIST_SUB_COUNT)
+
+#define WLOOP_STATS_SLOWEST 16
+#define WLOOP_STATS_SLOW_US 1000
+
+typedef enum {
+    WLOOP_HIST_ITERATION = 0,
+    WLOOP_HIST_POLL,
+    WLOOP_HIST_TIMERS,
+    WLOOP_HIST_IDLES,
+    WLOOP_HIST_PENDINGS,
+    WLOOP_HIST_QUEUE_DELAY,
+    WLOOP_HIST_CALLBACK,
+    WLOOP_HIST_MAX
+} wloop_hist_e;
+
+typedef struct wloop_hist_s {
+    atomic_ullong count;
+    atomic_ullong sum;
+    atomic_ullong max;
+    atomic_ullong buckets[WLOOP_HIST_BUCKETS];
+} wloop_hist_t;
+
+typedef struct wloop_slow_cb_s {
+    uint64_t    duration_us;
+    uint64_t    when_ms; // unix time
+    const char* owner;
+    void*       cb;
+    int         event_type;
+} wloop_slow_cb_t;
+
+typedef struct wloop_stats_s {
+    wloop_hist_t    hists[WLOOP_HIST_MAX];
+    wloop_slow_cb_t slowest[WLOOP_STATS_SLOWEST];
+    atomic_uint     slowest_seq; // odd while the loop thread is updating the table
+    uint64_t        slowest_min_us;
+    const char*     owner;       // set by the running callback, reset before every callback
+} wloop_stats_t;
+
+// the stats of the loop running on this thread, NULL when disabled
+extern thread_local wloop_stats_t* tl_wloop_stats;
+
+static inline unsigned wloopstatsLog2(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - (unsigned)__builtin_clzll(v);
+#else
+    unsigned r = 0;
+    while (v >>= 1) ++r;
+    return r;
+#endif
+}
+
+static inline unsigned wloopstatsBucketIndex(uint64_t v) {
+    if (v < WLOOP_HIST_SUB_COUNT) return (unsigned)v;
+    unsigned e = wloopstatsLog2(v);
+    return ((e - WLOOP_HIST_SUB_BITS + 1) << WLOOP_HIST_SUB_BITS) +
+           (unsigned)((v >> (e - WLOOP_HIST_SUB_BITS)) & (WLOOP_HIST_SUB_COUNT - 1));
+}
+
+// highest value that still falls into this bucket
+static inline uint64_t wloopstatsBucketUpperBound(unsigned index) {
+    if (index < WLOOP_HIST_SUB_COUNT) return index;
+    unsigned e   = (index >> WLOOP_HIST_SUB_BITS) + WLOOP_HIST_SUB_BITS - 1;
+    uint64_t sub = index & (WLOOP_HIST_SUB_COUNT - 1);
+    uint64_t low = (WLOOP_HIST_SUB_COUNT + sub) << (e - WLOOP_HIST_SUB_BITS);
+    return low + ((1ULL << (e - WLOOP_HIST_SUB_BITS)) - 1);
+}
+
+static inline void wloopstatsAddLocal(atomic_ullong* counter, uint64_t value) {
+    // single writer, the loop thread
+    atomicStoreExplicit(counter, atomicLoadExplicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void wloopstatsRecord(wloop_hist_t* hist, uint64_t value_us) {
+    wloopstatsAddLocal(&hist->buckets[wloopstatsBucketIndex(value_us)], 1);
+    wloopstatsAddLocal(&hist->count, 1);
+    wloopstatsAddLocal(&hist->sum, value_us);
+    if (value_us > atomicLoadExplicit(&hist->max, memory_order_relaxed)) {
+        atomicStoreExplicit(&hist->max, value_us, memory_order_relaxed);
+    }
+}
+
+// names the node that owns the currently running callback, a no-op unless the loop of this thread records stats
+static inline void wloopStatsSetOwner(const char* owner) {
+    if (UNLIKELY(tl_wloop_stats != NULL)) {
+        tl_wloop_stats->owner = owner;
+    }
+}
+
+WW_EXPORT const char* wloopstatsHistName(wloop_hist_e hist);
+
+// value at the given percentile (0-100) taken from a racy but consistent enough snapshot of the histogram
+WW_EXPORT uint64_t wloopstatsPercentile(wloop_hist_t* hist, double percentile);
+
+// records a finished callback into the callback histogram and, if slow enough, into the slow table
+WW_EXPORT void wloopstatsRecordCallback(wloop_stats_t* stats, void* cb, int event_type, uint64_t duration_us);
+
+/**
+ * Copies the slowest callbacks table without blocking the loop thread.
+ * @param stats Stats of the loop.
+ * @param out Receives up to WLOOP_STATS_SLOWEST entries, sorted from the slowest.
+ * @return Number of valid entries.
+ */
+WW_EXPORT int wloopstatsCopySlowest(wloop_stats_t* stats, wloop_slow_cb_t out[WLOOP_STATS_SLOWEST]);
+
+WW_EXPORT const char* wloopstatsEventTypeName(int event_type);
+
+#endif // WW_LOOP_STATS_H_
@@ -4,9 +4,12 @@
 #include "loggers/dns_logger.h"
 #include "loggers/internal_logger.h"
 #include "loggers/network_logger.h"
+#include "managers/metrics_manager.h"
 #include "managers/node_manager.h"
 #include "managers/signal_manager.h"
 #include "managers/socket_manager.h"
+#include "pipe_ring.h"
+#include "waffinity.h"
 
 ww_global_state_t global_ww_state = {0};
 
@@ -42,26 +45,157 @@ static void initializeShortCuts(void)
     GSTATE.shortcut_loops              = (wloop_t **) (space + (0ULL * total_workers));
     GSTATE.shortcut_buffer_pools       = (buffer_pool_t **) (space + (1ULL * total_workers));
     GSTATE.shortcut_context_pools      = (generic_pool_t **) (space + (2ULL * total_workers));
-    GSTATE.shortcut_pipetunnel_msg_pools = (generic_pool_t **) (space + (3ULL * total_workers));
 
     for (unsigned int tid = 0; tid < GSTATE.workers_count; tid++)
     {
 
         GSTATE.shortcut_context_pools[tid]      = WORKERS[tid].context_pool;
-        GSTATE.shortcut_pipetunnel_msg_pools[tid] = WORKERS[tid].pipetunnel_msg_pool;
         GSTATE.shortcut_buffer_pools[tid]       = WORKERS[tid].buffer_pool;
         GSTATE.shortcut_loops[tid]              = WORKERS[tid].loop;
     }
 }
 
-static void initializeMasterPools(void)
+// a slab is sized for the steady state of its master pool: every thread local pool full (2 * width) plus the
+// master pool itself (4 * width); the accept thread and the devices count as two more threads
+static void enableSlab(master_pool_t *mp, uint32_t threads, uint32_t width)
+{
+    masterpoolEnableSlab(mp, ((threads + 2) * 2 * width) + (4 * width), GSTATE.huge_pages);
+}
+
+static uint32_t countWorkersOnNode(int node)
+{
+    uint32_t count = 0;
+    for (wid_t wid = 0; wid < WORKERS_COUNT; wid++)
+    {
+        const int cpu = GSTATE.worker_cpus->cpus[wid % GSTATE.worker_cpus->count];
+        count += affinityGetCpuNumaNode(cpu) == node ? 1 : 0;
+    }
+    return count;
+}
+
+static void initializeMasterPools(bool numa_local_pools)
 {
     assert(GSTATE.initialized);
 
     GSTATE.masterpool_buffer_pools_large = masterpoolCreateWithCapacity(2 * ((0) + GSTATE.ram_profile));
     GSTATE.masterpool_buffer_pools_small = masterpoolCreateWithCapacity(2 * ((0) + GSTATE.ram_profile));
     GSTATE.masterpool_context_pools      = masterpoolCreateWithCapacity(2 * ((16) + GSTATE.ram_profile));
-    GSTATE.masterpool_pipetunnel_msg_pools = masterpoolCreateWithCapacity(2 * ((8) + GSTATE.ram_profile));
+
+    enableSlab(GSTATE.masterpool_context_pools, WORKERS_COUNT, (16) + GSTATE.ram_profile);
+
+    const int nodes = affinityGetNumaNodeIdLimit(); // ids, not a count: workers index the arrays by node id
+    if (! numa_local_pools || nodes <= 1 || GSTATE.worker_cpus == NULL)
+    {
+        enableSlab(GSTATE.masterpool_buffer_pools_large, WORKERS_COUNT, (0) + GSTATE.ram_profile);
+        enableSlab(GSTATE.masterpool_buffer_pools_small, WORKERS_COUNT, (0) + GSTATE.ram_profile);
+        return;
+    }
+
+    // workers of one node share its master pools, so a buffer never bounces to a worker on another node;
+    // node 0 keeps the global pools which the helper threads use too, ids without workers stay NULL
+    GSTATE.masterpool_buffer_pools_large_per_node = memoryAllocate(sizeof(master_pool_t *) * nodes);
+    GSTATE.masterpool_buffer_pools_small_per_node = memoryAllocate(sizeof(master_pool_t *) * nodes);
+    memorySet(GSTATE.masterpool_buffer_pools_large_per_node, 0, sizeof(master_pool_t *) * nodes);
+    memorySet(GSTATE.masterpool_buffer_pools_small_per_node, 0, sizeof(master_pool_t *) * nodes);
+
+    GSTATE.masterpool_buffer_pools_large_per_node[0] = GSTATE.masterpool_buffer_pools_large;
+    GSTATE.masterpool_buffer_pools_small_per_node[0] = GSTATE.masterpool_buffer_pools_small;
+    for (int node = 1; node < nodes; node++)
+    {
+        if (countWorkersOnNode(node) == 0)
+        {
+            continue;
+        }
+        GSTATE.masterpool_buffer_pools_large_per_node[node] =
+            masterpoolCreateWithCapacity(2 * ((0) + GSTATE.ram_profile));
+        GSTATE.masterpool_buffer_pools_small_per_node[node] =
+            masterpoolCreateWithCapacity(2 * ((0) + GSTATE.ram_profile));
+    }
+
+    // each node gets its own arena, first touched by the workers of that node
+    for (int node = 0; node < nodes; node++)
+    {
+        if (GSTATE.masterpool_buffer_pools_large_per_node[node] == NULL)
+        {
+            continue;
+        }
+        enableSlab(GSTATE.masterpool_buffer_pools_large_per_node[node], countWorkersOnNode(node),
+                   (0) + GSTATE.ram_profile);
+        enableSlab(GSTATE.masterpool_buffer_pools_small_per_node[node], countWorkersOnNode(node),
+                   (0) + GSTATE.ram_profile);
+    }
+}
+
+static cpu_list_t *parseCpuListOrExit(const char *str, const char *what)
+{
+    cpu_list_t *list = memoryAllocate(sizeof(cpu_list_t));
+    memorySet(list, 0, sizeof(cpu_list_t));
+
+    if (str == NULL || strcmp(str, "auto") == 0)
+    {
+        affinityGetAllCpus(list);
+    }
+    else if (! affinityParseCpuList(str, list) || list->count == 0)
+    {
+        LOGF("CoreSettings: invalid %s cpu list \"%s\"", what, str);
+        exit(1);
+    }
+    return list;
+}
+
+static void initializeAffinity(const ww_construction_data_t *init_data)
+{
+    if (init_data->helper_cpus != NULL)
+    {
+        GSTATE.helper_cpus = parseCpuListOrExit(init_data->helper_cpus, "helper");
+    }
+
+    if (init_data->worker_cpus == NULL && init_data->irq_interface == NULL)
+    {
+        return;
+    }
+
+    cpu_list_t *candidates = parseCpuListOrExit(init_data->worker_cpus, "worker");
+
+    if (init_data->irq_interface != NULL)
+    {
+        // workers first take the cpus that receive the nic interrupts, then the other cpus of the nic's node
+        cpu_list_t *ordered = memoryAllocate(sizeof(cpu_list_t));
+        cpu_list_t *irq     = memoryAllocate(sizeof(cpu_list_t));
+        memorySet(ordered, 0, sizeof(cpu_list_t));
+        memorySet(irq, 0, sizeof(cpu_list_t));
+
+        if (! affinityGetNicIrqCpus(init_data->irq_interface, irq))
+        {
+            LOGW("Affinity: no IRQ found for interface %s, irq locality is ignored", init_data->irq_interface);
+        }
+        const int nic_node = affinityGetNicNumaNode(init_data->irq_interface);
+
+        for (int pass = 0; pass < 3; pass++)
+        {
+            for (uint16_t i = 0; i < candidates->count; i++)
+            {
+                const int cpu    = candidates->cpus[i];
+                bool      is_irq = false;
+                for (uint16_t k = 0; k < irq->count; k++)
+                {
+                    is_irq = is_irq || irq->cpus[k] == cpu;
+                }
+                const bool on_nic_node = nic_node >= 0 && affinityGetCpuNumaNode(cpu) == nic_node;
+
+                if ((pass == 0 && is_irq) || (pass == 1 && ! is_irq && on_nic_node) ||
+                    (pass == 2 && ! is_irq && ! on_nic_node))
+                {
+                    ordered->cpus[ordered->count++] = (uint16_t) cpu;
+                }
+            }
+        }
+        memoryFree(irq);
+        memoryFree(candidates);
+        candidates = ordered;
+    }
+
+    GSTATE.worker_cpus = candidates;
 }
 
 void createGlobalState(const ww_construction_data_t init_data)
@@ -95,8 +229,10 @@ void createGlobalState(const ww_construction_data_t init_data)
 
     // workers and pools creation
     {
-        WORKERS_COUNT      = init_data.workers_count;
-        GSTATE.ram_profile = init_data.ram_profile;
+        WORKERS_COUNT       = init_data.workers_count;
+        GSTATE.ram_profile  = init_data.ram_profile;
+        GSTATE.huge_pages   = init_data.huge_pages;
+        GSTATE.write_budget = (uint64_t) init_data.write_budget_mb * 1024 * 1024;
 
         if (WORKERS_COUNT <= 0 || WORKERS_COUNT > (254))
         {
@@ -106,7 +242,8 @@ void createGlobalState(const ww_construction_data_t init_data)
 
         WORKERS = (worker_t *) memoryAllocate(sizeof(worker_t) * (WORKERS_COUNT));
 
-        initializeMasterPools();
+        initializeAffinity(&init_data);
+        initializeMasterPools(init_data.numa_local_pools);
 
         for (unsigned int i = 0; i < WORKERS_COUNT; ++i)
         {
@@ -114,6 +251,20 @@ void createGlobalState(const ww_construction_data_t init_data)
         }
 
         initializeShortCuts();
+
+        // loops exist now, pipe tunnel traffic between them goes through the rings
+        piperingsCreate();
+    }
+
+    // before any node is created, nodes register their counters at creation
+    metricsmanagerCreate((wid_t) WORKERS_COUNT);
+    if (init_data.loop_stats)
+    {
+        metricsmanagerEnableLoopStats();
+    }
+    if (init_data.metrics_listen_address != NULL)
+    {
+        metricsmanagerStartEndpoint(init_data.metrics_listen_address);
     }
 
     GSTATE.signal_manager = createSignalManager();
@@ -131,6 +282,14 @@ void createGlobalState(const ww_construction_data_t init_data)
     }
 }
 
+void pinHelperThread(void)
+{
+    if (GSTATE.helper_cpus != NULL && ! affinityPinCurrentThread(GSTATE.helper_cpus))
+    {
+        LOGW("Affinity: could not pin helper thread");
+    }
+}
+
 void runMainThread(void)
 {
     assert(GSTATE.initialized);
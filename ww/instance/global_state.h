@@ -25,25 +25,30 @@ typedef struct
 
 typedef struct ww_global_state_s
 {
-    wloop_t                **shortcut_loops;
-    buffer_pool_t          **shortcut_buffer_pools;
-    generic_pool_t         **shortcut_context_pools;
-    generic_pool_t         **shortcut_pipetunnel_msg_pools;
-    master_pool_t           *masterpool_buffer_pools_large;
-    master_pool_t           *masterpool_buffer_pools_small;
-    master_pool_t           *masterpool_context_pools;
-    master_pool_t           *masterpool_pipetunnel_msg_pools;
-    worker_t                *workers;
-    struct signal_manager_s *signal_manager;
-    struct socket_manager_s *socekt_manager;
-    struct node_manager_s   *node_manager;
-    struct logger_s         *core_logger;
-    struct logger_s         *network_logger;
-    struct logger_s         *dns_logger;
-    struct logger_s         *ww_logger;
-    uint32_t                 workers_count;
-    uint32_t                 ram_profile;
-    bool                     initialized;
+    wloop_t                 **shortcut_loops;
+    buffer_pool_t           **shortcut_buffer_pools;
+    generic_pool_t          **shortcut_context_pools;
+    master_pool_t            *masterpool_buffer_pools_large;
+    master_pool_t            *masterpool_buffer_pools_small;
+    master_pool_t            *masterpool_context_pools;
+    master_pool_t           **masterpool_buffer_pools_large_per_node; // NULL unless numa local pools
+    master_pool_t           **masterpool_buffer_pools_small_per_node;
+    struct cpu_list_s        *worker_cpus; // NULL when workers are not pinned
+    struct cpu_list_s        *helper_cpus; // NULL when helper threads are not pinned
+    slab_page_size_t          huge_pages;  // kSlabPageNormal unless the pools are backed by huge page slabs
+    worker_t                 *workers;
+    struct signal_manager_s  *signal_manager;
+    struct socket_manager_s  *socekt_manager;
+    struct node_manager_s    *node_manager;
+    struct metrics_manager_s *metrics_manager;
+    struct logger_s          *core_logger;
+    struct logger_s          *network_logger;
+    struct logger_s          *dns_logger;
+    struct logger_s          *ww_logger;
+    uint32_t                  workers_count;
+    uint32_t                  ram_profile;
+    uint64_t                  write_budget; // per worker, see write_budget.h, 0 is unlimited
+    bool                      initialized;
 
 } ww_global_state_t;
 
@@ -55,6 +60,14 @@ typedef struct
     logger_construction_data_t core_logger_data;
     logger_construction_data_t network_logger_data;
     logger_construction_data_t dns_logger_data;
+    char                      *metrics_listen_address; // NULL disables the endpoint, counters are always on
+    bool                       loop_stats;             // event loop latency histograms, exported by the endpoint
+    uint32_t                   write_budget_mb;        // bytes the write queues of one worker may hold, 0 unlimited
+    char                      *worker_cpus;            // NULL leaves workers unpinned, "auto" uses every cpu
+    char                      *helper_cpus;            // accept / device / metrics threads, NULL leaves them free
+    char                      *irq_interface;          // workers take the cpus serving this nic's IRQs first
+    bool                       numa_local_pools;       // buffer master pools per NUMA node
+    slab_page_size_t           huge_pages;             // huge page slabs for buffers and contexts
 
 } ww_construction_data_t;
 
@@ -86,11 +99,6 @@ static inline generic_pool_t *getWorkerContextPool(wid_t tid)
     return GSTATE.shortcut_context_pools[tid];
 }
 
-static inline generic_pool_t *getWorkerPipeTunnelMsgPool(wid_t tid)
-{
-    return GSTATE.shortcut_pipetunnel_msg_pools[tid];
-}
-
 static inline struct wloop_s *getWorkerLoop(wid_t tid)
 {
     return GSTATE.shortcut_loops[tid];
@@ -98,6 +106,9 @@ static inline struct wloop_s *getWorkerLoop(wid_t tid)
 
 WW_EXPORT void runMainThread(void);
 
+// pins the calling helper thread (accept, device, metrics) to the helper cpus, if configured
+WW_EXPORT void pinHelperThread(void);
+
 WW_EXPORT void               createGlobalState(ww_construction_data_t data);
 WW_EXPORT ww_global_state_t *globalStateGet(void);
 WW_EXPORT void               globalStateSet(ww_global_state_t *state);
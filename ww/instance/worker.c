@@ -1,8 +1,9 @@
 #include "worker.h"
 #include "context.h"
 #include "global_state.h"
-#include "pipe_tunnel.h"
+#include "loggers/internal_logger.h"
 #include "tunnel.h"
+#include "waffinity.h"
 #include "wloop.h"
 #include "wthread.h"
 
@@ -12,16 +13,27 @@ thread_local wid_t tl_wid;
 
 void workerInit(worker_t *worker, wid_t wid)
 {
-    *worker = (worker_t){.wid = wid};
+    *worker = (worker_t){.wid = wid, .cpu = -1};
+
+    if (GSTATE.worker_cpus != NULL)
+    {
+        worker->cpu       = GSTATE.worker_cpus->cpus[wid % GSTATE.worker_cpus->count];
+        worker->numa_node = affinityGetCpuNumaNode(worker->cpu);
+    }
+
+    master_pool_t *mp_large = GSTATE.masterpool_buffer_pools_large;
+    master_pool_t *mp_small = GSTATE.masterpool_buffer_pools_small;
+    if (GSTATE.masterpool_buffer_pools_large_per_node != NULL)
+    {
+        mp_large = GSTATE.masterpool_buffer_pools_large_per_node[worker->numa_node];
+        mp_small = GSTATE.masterpool_buffer_pools_small_per_node[worker->numa_node];
+    }
 
     worker->context_pool = genericpoolCreateWithDefaultAllocatorAndCapacity(
         GSTATE.masterpool_context_pools, sizeof(context_t), (16) + GSTATE.ram_profile);
 
-    worker->pipetunnel_msg_pool = genericpoolCreateWithDefaultAllocatorAndCapacity(
-        GSTATE.masterpool_pipetunnel_msg_pools, pipeLineGetMesageSize(), (8) + GSTATE.ram_profile);
-
-    worker->buffer_pool = bufferpoolCreate(GSTATE.masterpool_buffer_pools_large, GSTATE.masterpool_buffer_pools_small,
-                                           (0) + GSTATE.ram_profile, SMALL_BUFFER_SIZE, LARGE_BUFFER_SIZE);
+    worker->buffer_pool =
+        bufferpoolCreate(mp_large, mp_small, (0) + GSTATE.ram_profile, SMALL_BUFFER_SIZE, LARGE_BUFFER_SIZE);
 
     // note that loop depeneds on worker->buffer_pool
     worker->loop = wloopCreate(WLOOP_FLAG_AUTO_FREE, worker->buffer_pool, wid);
@@ -31,6 +43,17 @@ void workerRun(worker_t *worker)
 {
     tl_wid = worker->wid;
     frandInit();
+
+    if (worker->cpu >= 0)
+    {
+        cpu_list_t cpus = {.count = 1, .cpus = {(uint16_t) worker->cpu}};
+        if (! affinityPinCurrentThread(&cpus))
+        {
+            LOGW("Affinity: could not pin worker %d to cpu %d", worker->wid, worker->cpu);
+        }
+        // the buffers are created (first touched) here, so they land on the node of the worker's cpu
+        bufferpoolFirstCharge(worker->buffer_pool);
+    }
     wloopRun(worker->loop);
     wloopDestroy(&worker->loop);
 }
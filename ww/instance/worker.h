@@ -15,8 +15,10 @@ typedef struct worker_s
     wloop_t        *loop;
     buffer_pool_t  *buffer_pool;
     generic_pool_t *context_pool;
-    generic_pool_t *pipetunnel_msg_pool;
     wthread_t       thread;
+    int             cpu;          // -1 when not pinned
+    int             numa_node;    // of cpu, 0 when not pinned
+    uint64_t        write_queued; // bytes held by the write queues of the lines of this worker, see write_budget.h
     wid_t           wid;
 
 } worker_t;
@@ -168,6 +168,8 @@ static inline int atomic_compare_exchange_strong(intptr_t *object, intptr_t *exp
 #define atomicIncExplicit(p, x) atomicAddExplicit(p, x, 1)
 #define atomicDecExplicit(p, x) atomicSubExplicit(p, x, 1)
 
+#define atomicExchangeExplicit atomic_exchange_explicit
+
 #define atomicCompareExchange         atomic_compare_exchange_strong
 #define atomicCompareExchangeExplicit atomic_compare_exchange_strong_explicit
 
@@ -61,6 +61,7 @@ logger_t *createCoreLogger(const char *log_file, bool console)
     }
 
     atexit(destroyCoreLogger);
+    loggerEnableAsync(logger, 1);
     return logger;
 }
 
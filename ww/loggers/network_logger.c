@@ -61,6 +61,8 @@ logger_t *createNetworkLogger(const char *log_file, bool console)
     }
 
     atexit(destroyNetworkLogger);
+    // hot paths log through this one, never let workers wait on the disk
+    loggerEnableAsync(logger, 1);
     return logger;
 }
 
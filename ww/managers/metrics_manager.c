@@ -0,0 +1,449 @@
+#include "metrics_manager.h"
+
+#include "loggers/internal_logger.h"
+#include "wloop_stats.h"
+#include "wlog.h"
+#include "wsocket.h"
+
+enum
+{
+    kMetricsTextInitCap   = 16 * 1024,
+    kMetricsRequestBufLen = 2048
+};
+
+static const metric_desc_t kBuiltinMetrics[] = {
+    {.name = "ww_lines_active", .help = "lines that are not freed yet, all chains", .type = kMetricTypeGauge},
+    {.name = "ww_write_queued_bytes",
+     .help = "bytes held by the write queues of the lines, all chains",
+     .type = kMetricTypeGauge},
+    {.name = "ww_write_budget_pauses_total",
+     .help = "writers paused early because the write budget of their worker was spent",
+     .type = kMetricTypeCounter},
+};
+
+void metricstextAppend(metrics_text_t *out, const char *fmt, ...)
+{
+    while (true)
+    {
+        va_list args;
+        va_start(args, fmt);
+        int written = vsnprintf(out->buf + out->len, out->cap - out->len, fmt, args);
+        va_end(args);
+
+        if (written < 0)
+        {
+            return;
+        }
+        if ((size_t) written < out->cap - out->len)
+        {
+            out->len += (size_t) written;
+            return;
+        }
+        out->cap = out->cap * 2 + (size_t) written;
+        out->buf = memoryReAllocate(out->buf, out->cap);
+    }
+}
+
+static void collectMasterPools(void *userdata, metrics_text_t *out)
+{
+    (void) userdata;
+    static const struct
+    {
+        const char *name;
+        size_t      offset;
+    } kPools[] = {
+        {"buffer_large", offsetof(ww_global_state_t, masterpool_buffer_pools_large)},
+        {"buffer_small", offsetof(ww_global_state_t, masterpool_buffer_pools_small)},
+        {"context", offsetof(ww_global_state_t, masterpool_context_pools)},
+    };
+
+    metricstextAppend(out, "# HELP ww_masterpool_items items parked in the master pool\n"
+                           "# TYPE ww_masterpool_items gauge\n");
+    for (size_t i = 0; i < ARRAY_SIZE(kPools); i++)
+    {
+        master_pool_t *mp = *(master_pool_t **) ((uint8_t *) &GSTATE + kPools[i].offset);
+        metricstextAppend(out, "ww_masterpool_items{pool=\"%s\"} %u\n", kPools[i].name,
+                          atomicLoadExplicit(&mp->len, memory_order_relaxed));
+    }
+
+    // a hit is an item a worker pool got back from the master pool, a miss had to be allocated
+    metricstextAppend(out, "# HELP ww_masterpool_hits_total items served from the master pool\n"
+                           "# TYPE ww_masterpool_hits_total counter\n");
+    for (size_t i = 0; i < ARRAY_SIZE(kPools); i++)
+    {
+        master_pool_t *mp = *(master_pool_t **) ((uint8_t *) &GSTATE + kPools[i].offset);
+        metricstextAppend(out, "ww_masterpool_hits_total{pool=\"%s\"} %llu\n", kPools[i].name,
+                          (unsigned long long) atomicLoadExplicit(&mp->stat_hits, memory_order_relaxed));
+    }
+    metricstextAppend(out, "# HELP ww_masterpool_misses_total items allocated because the master pool was empty\n"
+                           "# TYPE ww_masterpool_misses_total counter\n");
+    for (size_t i = 0; i < ARRAY_SIZE(kPools); i++)
+    {
+        master_pool_t *mp = *(master_pool_t **) ((uint8_t *) &GSTATE + kPools[i].offset);
+        metricstextAppend(out, "ww_masterpool_misses_total{pool=\"%s\"} %llu\n", kPools[i].name,
+                          (unsigned long long) atomicLoadExplicit(&mp->stat_misses, memory_order_relaxed));
+    }
+}
+
+static void collectLogDrops(void *userdata, metrics_text_t *out)
+{
+    (void) userdata;
+    metricstextAppend(out,
+                      "# HELP ww_log_dropped_total log lines dropped because a log ring was full\n"
+                      "# TYPE ww_log_dropped_total counter\n"
+                      "ww_log_dropped_total %llu\n",
+                      loggerGetDroppedCount());
+}
+
+static void collectLoopStats(void *userdata, metrics_text_t *out)
+{
+    (void) userdata;
+    static const double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    // a summary per phase is a few lines per worker, full histograms would be hundreds of series each
+    metricstextAppend(out, "# HELP ww_loop_latency_us event loop phase, queue delay and callback durations\n"
+                           "# TYPE ww_loop_latency_us summary\n");
+    for (wid_t wi = 0; wi < getWorkersCount(); wi++)
+    {
+        wloop_stats_t *stats = wloopGetStats(getWorkerLoop(wi));
+        if (stats == NULL)
+        {
+            continue;
+        }
+        for (int h = 0; h < WLOOP_HIST_MAX; h++)
+        {
+            wloop_hist_t *hist = &stats->hists[h];
+            const char   *name = wloopstatsHistName((wloop_hist_e) h);
+            for (size_t q = 0; q < ARRAY_SIZE(kQuantiles); q++)
+            {
+                metricstextAppend(out, "ww_loop_latency_us{worker=\"%u\",phase=\"%s\",quantile=\"%g\"} %llu\n",
+                                  (unsigned int) wi, name, kQuantiles[q],
+                                  (unsigned long long) wloopstatsPercentile(hist, kQuantiles[q] * 100.0));
+            }
+            metricstextAppend(out, "ww_loop_latency_us_sum{worker=\"%u\",phase=\"%s\"} %llu\n", (unsigned int) wi,
+                              name, (unsigned long long) atomicLoadExplicit(&hist->sum, memory_order_relaxed));
+            metricstextAppend(out, "ww_loop_latency_us_count{worker=\"%u\",phase=\"%s\"} %llu\n", (unsigned int) wi,
+                              name, (unsigned long long) atomicLoadExplicit(&hist->count, memory_order_relaxed));
+        }
+    }
+
+    metricstextAppend(out, "# HELP ww_loop_latency_max_us longest recorded duration per phase\n"
+                           "# TYPE ww_loop_latency_max_us gauge\n");
+    for (wid_t wi = 0; wi < getWorkersCount(); wi++)
+    {
+        wloop_stats_t *stats = wloopGetStats(getWorkerLoop(wi));
+        if (stats == NULL)
+        {
+            continue;
+        }
+        for (int h = 0; h < WLOOP_HIST_MAX; h++)
+        {
+            metricstextAppend(out, "ww_loop_latency_max_us{worker=\"%u\",phase=\"%s\"} %llu\n", (unsigned int) wi,
+                              wloopstatsHistName((wloop_hist_e) h),
+                              (unsigned long long) atomicLoadExplicit(&stats->hists[h].max, memory_order_relaxed));
+        }
+    }
+
+    metricstextAppend(out, "# HELP ww_loop_slow_callback_us slowest callbacks seen by each worker\n"
+                           "# TYPE ww_loop_slow_callback_us gauge\n");
+    for (wid_t wi = 0; wi < getWorkersCount(); wi++)
+    {
+        wloop_stats_t *stats = wloopGetStats(getWorkerLoop(wi));
+        if (stats == NULL)
+        {
+            continue;
+        }
+        wloop_slow_cb_t slowest[WLOOP_STATS_SLOWEST];
+        int             n = wloopstatsCopySlowest(stats, slowest);
+        for (int i = 0; i < n; i++)
+        {
+            char owner[kMetricsMaxNameLen];
+            if (slowest[i].owner != NULL)
+            {
+                snprintf(owner, sizeof(owner), "%s", slowest[i].owner);
+            }
+            else
+            {
+                snprintf(owner, sizeof(owner), "%p", slowest[i].cb);
+            }
+            metricstextAppend(out,
+                              "ww_loop_slow_callback_us{worker=\"%u\",rank=\"%d\",owner=\"%s\",type=\"%s\","
+                              "at_ms=\"%llu\"} %llu\n",
+                              (unsigned int) wi, i, owner, wloopstatsEventTypeName(slowest[i].event_type),
+                              (unsigned long long) slowest[i].when_ms, (unsigned long long) slowest[i].duration_us);
+        }
+    }
+}
+
+void metricsmanagerEnableLoopStats(void)
+{
+    for (wid_t wi = 0; wi < getWorkersCount(); wi++)
+    {
+        wloopEnableStats(getWorkerLoop(wi));
+    }
+    metricsmanagerRegisterCollector(collectLoopStats, NULL);
+}
+
+metrics_manager_t *metricsmanagerCreate(wid_t workers_count)
+{
+    assert(GSTATE.metrics_manager == NULL);
+
+    metrics_manager_t *mm = memoryAllocate(sizeof(metrics_manager_t));
+    memorySet(mm, 0, sizeof(metrics_manager_t));
+    mutexInit(&mm->mutex);
+
+    mm->workers_count        = workers_count;
+    mm->worker_blocks        = memoryAllocate(sizeof(atomic_ullong *) * workers_count);
+    mm->worker_blocks_memory = memoryAllocate(sizeof(void *) * workers_count);
+
+    const size_t block_size = sizeof(atomic_ullong) * kMetricsMaxCounters;
+    for (wid_t wi = 0; wi < workers_count; wi++)
+    {
+        // separate allocations, aligned by hand so no two workers ever share a line
+        mm->worker_blocks_memory[wi] = memoryAllocate(block_size + kCpuLineCacheSize);
+        mm->worker_blocks[wi] =
+            (atomic_ullong *) (((uintptr_t) mm->worker_blocks_memory[wi] + kCpuLineCacheSize - 1) &
+                               ~((uintptr_t) kCpuLineCacheSize - 1));
+        memorySet(mm->worker_blocks[wi], 0, block_size);
+    }
+
+    GSTATE.metrics_manager = mm;
+
+    mm->lines_active        = metricsmanagerRegister(NULL, kBuiltinMetrics, ARRAY_SIZE(kBuiltinMetrics));
+    mm->write_queued_bytes  = (metric_id_t) (mm->lines_active + 1);
+    mm->write_budget_pauses = (metric_id_t) (mm->lines_active + 2);
+    metricsmanagerRegisterCollector(collectMasterPools, NULL);
+    metricsmanagerRegisterCollector(collectLogDrops, NULL);
+    return mm;
+}
+
+void metricsmanagerDestroy(metrics_manager_t *mm)
+{
+    for (wid_t wi = 0; wi < mm->workers_count; wi++)
+    {
+        memoryFree(mm->worker_blocks_memory[wi]);
+    }
+    memoryFree(mm->worker_blocks_memory);
+    memoryFree(mm->worker_blocks);
+    memoryFree(mm->listen_address);
+    mutexDestroy(&mm->mutex);
+    memoryFree(mm);
+}
+
+metric_id_t metricsmanagerRegister(const char *node_name, const metric_desc_t *descs, uint16_t count)
+{
+    metrics_manager_t *mm = metricsmanagerGet();
+    mutexLock(&mm->mutex);
+
+    if (mm->entries_len + count > kMetricsMaxCounters)
+    {
+        mutexUnlock(&mm->mutex);
+        LOGF("MetricsManager: too many metrics registered (max %d)", kMetricsMaxCounters);
+        exit(1);
+    }
+
+    metric_id_t base = (metric_id_t) mm->entries_len;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        metrics_entry_t *e = &mm->entries[mm->entries_len++];
+        e->desc            = &descs[i];
+        e->node_name[0]    = '\0';
+        if (node_name != NULL)
+        {
+            snprintf(e->node_name, sizeof(e->node_name), "%s", node_name);
+        }
+    }
+    mutexUnlock(&mm->mutex);
+    return base;
+}
+
+void metricsmanagerRegisterCollector(MetricsCollectorFn fn, void *userdata)
+{
+    metrics_manager_t *mm = metricsmanagerGet();
+    mutexLock(&mm->mutex);
+    if (mm->collectors_len >= kMetricsMaxCollectors)
+    {
+        mutexUnlock(&mm->mutex);
+        LOGF("MetricsManager: too many metric collectors registered (max %d)", kMetricsMaxCollectors);
+        exit(1);
+    }
+    mm->collectors[mm->collectors_len++] = (metrics_collector_t) {.fn = fn, .userdata = userdata};
+    mutexUnlock(&mm->mutex);
+}
+
+static uint64_t sumCounter(metrics_manager_t *mm, uint32_t id)
+{
+    uint64_t sum = 0;
+    for (wid_t wi = 0; wi < mm->workers_count; wi++)
+    {
+        sum += atomicLoadExplicit(&mm->worker_blocks[wi][id], memory_order_relaxed);
+    }
+    return sum;
+}
+
+void metricsmanagerRender(metrics_text_t *out)
+{
+    metrics_manager_t *mm = metricsmanagerGet();
+
+    out->cap = kMetricsTextInitCap;
+    out->len = 0;
+    out->buf = memoryAllocate(out->cap);
+
+    mutexLock(&mm->mutex);
+
+    // prometheus wants HELP/TYPE once per metric name, so group the entries of the same name (nodes of same type)
+    for (uint32_t i = 0; i < mm->entries_len; i++)
+    {
+        const metric_desc_t *desc = mm->entries[i].desc;
+
+        bool seen = false;
+        for (uint32_t j = 0; j < i; j++)
+        {
+            if (strcmp(mm->entries[j].desc->name, desc->name) == 0)
+            {
+                seen = true;
+                break;
+            }
+        }
+        if (seen)
+        {
+            continue;
+        }
+
+        metricstextAppend(out, "# HELP %s %s\n# TYPE %s %s\n", desc->name, desc->help, desc->name,
+                          desc->type == kMetricTypeCounter ? "counter" : "gauge");
+
+        for (uint32_t j = i; j < mm->entries_len; j++)
+        {
+            if (strcmp(mm->entries[j].desc->name, desc->name) != 0)
+            {
+                continue;
+            }
+            // gauges can be decremented on another worker, the wrapped sum is still right as a signed value
+            uint64_t    value = sumCounter(mm, j);
+            const char *node  = mm->entries[j].node_name;
+            if (desc->type == kMetricTypeGauge)
+            {
+                metricstextAppend(out, node[0] ? "%s{node=\"%s\"} %lld\n" : "%s%s %lld\n", desc->name, node,
+                                  (long long) value);
+            }
+            else
+            {
+                metricstextAppend(out, node[0] ? "%s{node=\"%s\"} %llu\n" : "%s%s %llu\n", desc->name, node,
+                                  (unsigned long long) value);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < mm->collectors_len; i++)
+    {
+        mm->collectors[i].fn(mm->collectors[i].userdata, out);
+    }
+
+    mutexUnlock(&mm->mutex);
+}
+
+static void serveMetricsClient(int fd)
+{
+    // we do not care about the request, any request gets the metrics page
+    char    request[kMetricsRequestBufLen];
+    ssize_t unused = recv(fd, request, sizeof(request), 0);
+    (void) unused;
+
+    metrics_text_t text;
+    metricsmanagerRender(&text);
+
+    char header[160];
+    int  header_len = snprintf(header, sizeof(header),
+                               "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\n"
+                               "Connection: close\r\n\r\n",
+                               text.len);
+
+    send(fd, header, (size_t) header_len, 0);
+
+    size_t sent = 0;
+    while (sent < text.len)
+    {
+        ssize_t n = send(fd, text.buf + sent, text.len - sent, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        sent += (size_t) n;
+    }
+    memoryFree(text.buf);
+    closesocket(fd);
+}
+
+static WTHREAD_ROUTINE(metricsEndpointThread)
+{
+    int listen_fd = (int) (intptr_t) userdata;
+
+    pinHelperThread();
+
+    while (true)
+    {
+        int fd = (int) accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (socketERRNO() == EINTR)
+            {
+                continue;
+            }
+            LOGE("MetricsManager: accept failed: %s", socketStrError(socketERRNO()));
+            break;
+        }
+        // a scraper that stops reading must not hang the endpoint forever
+        socketOptionSNDTIME(fd, 2000);
+        socketOptionRecvTime(fd, 2000);
+        serveMetricsClient(fd);
+    }
+    closesocket(listen_fd);
+    return 0;
+}
+
+bool metricsmanagerStartEndpoint(const char *listen_address)
+{
+    metrics_manager_t *mm = metricsmanagerGet();
+    int                listen_fd;
+
+    if (strncmp(listen_address, "unix:", 5) == 0)
+    {
+#ifdef ENABLE_UDS
+        const char *path = listen_address + 5;
+        remove(path);
+        listen_fd = wwListenUnix(path);
+#else
+        LOGE("MetricsManager: unix socket endpoint requested but this build has no unix socket support");
+        return false;
+#endif
+    }
+    else
+    {
+        char *host = stringDuplicate(listen_address);
+        char *sep  = strrchr(host, ':');
+        if (sep == NULL)
+        {
+            LOGE("MetricsManager: invalid listen address \"%s\", expected ip:port or unix:/path", listen_address);
+            memoryFree(host);
+            return false;
+        }
+        *sep     = '\0';
+        int port = atoi(sep + 1);
+        listen_fd = wwListen(port, host);
+        memoryFree(host);
+    }
+
+    if (listen_fd < 0)
+    {
+        LOGE("MetricsManager: could not listen on \"%s\"", listen_address);
+        return false;
+    }
+
+    mm->listen_address  = stringDuplicate(listen_address);
+    mm->endpoint_thread = threadCreate(metricsEndpointThread, (void *) (intptr_t) listen_fd);
+    LOGI("MetricsManager: serving prometheus metrics on %s", listen_address);
+    return true;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "wlibc.h"
+
+#include "global_state.h"
+#include "wmutex.h"
+#include "wthread.h"
+#include "worker.h"
+
+/*
+    Metrics manager
+
+    Every worker owns a block of counters, the blocks are separate cache line aligned allocations and only the
+    owner worker writes to its block, so the hot path is a relaxed load + store on a line that never leaves the core
+
+    Counters are summed across workers only when somebody reads them (the endpoint), gauges work the same way
+    since an increment on one worker and a decrement on another still sum up correctly
+
+    Nodes register their counters once at creation through tunnel_metadata_t (metrics, metrics_count), the node
+    name becomes the "node" label; anything that is cheaper to compute on read (pool sizes, dropped logs) is
+    added as a collector callback
+
+    The endpoint serves Prometheus text format over plain http on its own thread, it never touches the workers:
+
+        "misc": { "metrics": "127.0.0.1:9100" }
+        "misc": { "metrics": "unix:/run/waterwall-metrics.sock" }
+
+    "loop-stats": true in misc additionally exports the event loop latency summaries and slowest callbacks of
+    every worker (see wloop_stats.h)
+
+*/
+
+enum
+{
+    kMetricsMaxCounters   = 4096,
+    kMetricsMaxCollectors = 32,
+    kMetricsMaxNameLen    = 64
+};
+
+typedef enum
+{
+    kMetricTypeCounter,
+    kMetricTypeGauge
+} metric_type_e;
+
+typedef struct metric_desc_s
+{
+    const char   *name; // prometheus metric name, e.g "ww_node_bytes_up_total"
+    const char   *help;
+    metric_type_e type;
+
+} metric_desc_t;
+
+typedef uint16_t metric_id_t;
+
+typedef struct metrics_text_s
+{
+    char  *buf;
+    size_t len;
+    size_t cap;
+
+} metrics_text_t;
+
+typedef void (*MetricsCollectorFn)(void *userdata, metrics_text_t *out);
+
+typedef struct metrics_entry_s
+{
+    const metric_desc_t *desc;
+    char                 node_name[kMetricsMaxNameLen];
+
+} metrics_entry_t;
+
+typedef struct metrics_collector_s
+{
+    MetricsCollectorFn fn;
+    void              *userdata;
+
+} metrics_collector_t;
+
+typedef struct metrics_manager_s
+{
+    atomic_ullong      **worker_blocks; // [wid][metric_id]
+    void               **worker_blocks_memory;
+    metrics_entry_t      entries[kMetricsMaxCounters];
+    metrics_collector_t  collectors[kMetricsMaxCollectors];
+    wmutex_t             mutex; // registration only
+    uint32_t             entries_len;
+    uint32_t             collectors_len;
+    wid_t                workers_count;
+    metric_id_t          lines_active;
+    metric_id_t          write_queued_bytes;
+    metric_id_t          write_budget_pauses;
+    wthread_t            endpoint_thread;
+    char                *listen_address;
+
+} metrics_manager_t;
+
+metrics_manager_t *metricsmanagerCreate(wid_t workers_count);
+void               metricsmanagerDestroy(metrics_manager_t *mm);
+
+static inline metrics_manager_t *metricsmanagerGet(void)
+{
+    return GSTATE.metrics_manager;
+}
+
+/**
+ * Registers a block of metrics, the returned id is the id of descs[0], the rest follow it.
+ * @param node_name Value of the "node" label (can be NULL for global metrics).
+ * @param descs Descriptions, must stay valid for the whole program (usually static const arrays).
+ * @param count Number of descriptions.
+ * @return Base id of the block.
+ */
+metric_id_t metricsmanagerRegister(const char *node_name, const metric_desc_t *descs, uint16_t count);
+
+void metricsmanagerRegisterCollector(MetricsCollectorFn fn, void *userdata);
+
+// turns on the event loop histograms of every worker (wloop_stats.h), must be called before the workers run
+void metricsmanagerEnableLoopStats(void);
+
+// renders everything in prometheus text format, the caller frees out->buf
+void metricsmanagerRender(metrics_text_t *out);
+
+// starts the endpoint thread, listen_address is "ip:port" or "unix:/path"
+bool metricsmanagerStartEndpoint(const char *listen_address);
+
+void metricstextAppend(metrics_text_t *out, const char *fmt, ...);
+
+static inline void metricsAdd(metric_id_t id, uint64_t value)
+{
+    atomic_ullong *counter = &(metricsmanagerGet()->worker_blocks[getWID()][id]);
+    // single writer per block, no locked instruction needed
+    atomicStoreExplicit(counter, atomicLoadExplicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void metricsSub(metric_id_t id, uint64_t value)
+{
+    atomic_ullong *counter = &(metricsmanagerGet()->worker_blocks[getWID()][id]);
+    atomicStoreExplicit(counter, atomicLoadExplicit(counter, memory_order_relaxed) - value, memory_order_relaxed);
+}
+
+static inline void metricsInc(metric_id_t id)
+{
+    metricsAdd(id, 1);
+}
+
+static inline void metricsDec(metric_id_t id)
+{
+    metricsSub(id, 1);
+}
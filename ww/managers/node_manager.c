@@ -1,5 +1,6 @@
 #include "node_manager.h"
 #include "chain.h"
+#include "chain_fusion.h"
 #include "utils/json_helpers.h"
 #include "loggers/internal_logger.h"
 
@@ -97,6 +98,12 @@ static void runNodes(node_manager_config_t *cfg)
             assert(n1 != NULL && n1->instance == NULL);
             t_array[index++] = n1->instance = n1->createHandle(n1);
 
+            if (n1->instance != NULL && n1->metadata.metrics_count > 0)
+            {
+                n1->instance->metrics_base =
+                    metricsmanagerRegister(n1->name, n1->metadata.metrics, n1->metadata.metrics_count);
+            }
+
             if (nodeHasFlagChainHead(n1))
             {
                 t_starters_array[index_starters++] = n1->instance;
@@ -164,6 +171,7 @@ static void runNodes(node_manager_config_t *cfg)
             uint16_t       mem_offset = 0;
             tunnel->onIndex(tunnel, &ta, &index, &mem_offset);
             tunnelGetChain(tunnel)->tunnels = ta;
+            chainfusionApply(tunnelGetChain(tunnel));
 
             for (int cti = 0; cti < ta.len; cti++)
             {
@@ -3,6 +3,7 @@
 #include "generic_pool.h"
 #include "global_state.h"
 #include "loggers/internal_logger.h"
+#include "node.h"
 #include "signal_manager.h"
 #include "stc/common.h"
 #include "tunnel.h"
@@ -10,10 +11,17 @@
 #include "wloop.h"
 #include "wmutex.h"
 #include "wproc.h"
+#include "wsklookup.h"
+
+typedef struct balance_group_s
+{
+    balance_mode_t mode;
+
+} balance_group_t;
 
 #define i_type balancegroup_registry_t // NOLINT
 #define i_key  hash_t                  // NOLINT
-#define i_val  widle_table_t *         // NOLINT
+#define i_val  balance_group_t *       // NOLINT
 
 #include "stc/hmap.h"
 
@@ -23,10 +31,14 @@ typedef struct socket_filter_s
         wio_t  *listen_io;
         wio_t **listen_ios;
     };
-    socket_filter_option_t option;
-    tunnel_t              *tunnel;
-    onAccept               cb;
-    bool                   v6_dualstack;
+    socket_filter_option_t  option;
+    tunnel_t               *tunnel;
+    onAccept                cb;
+    active_lines_counter_t *active_lines; // [wid]
+    hash_t                  balance_key;  // identity of the member in rendezvous hashing, stable across restarts
+    uint64_t                unhealthy_until_ms; // skipped in pass 0 until this getHRTimeUs() / 1000 deadline
+    bool                    v6_dualstack;
+    bool                    backend_defaulted; // multiport_backend was picked by us, not set in the config
 
 } socket_filter_t;
 
@@ -39,12 +51,37 @@ typedef struct socket_filter_s
 
 enum
 {
-    kSoOriginalDest          = 80,
-    kFilterLevels            = 4,
-    kMaxBalanceSelections    = 64,
-    kDefalultBalanceInterval = 60 * 1000
+    kSoOriginalDest       = 80,
+    kFilterLevels         = 4,
+    kMaxBalanceSelections = 64,
+    kPortsCount           = 65536,
+    kDispatchTcp          = 0,
+    kDispatchUdp          = 1,
+    kDispatchProtocols    = 2
 };
 
+// a run of ports with the same candidates, a slice of dispatch_table_t.candidates
+typedef struct dispatch_list_s
+{
+    uint32_t begin;
+    uint32_t len;
+
+} dispatch_list_t;
+
+/*
+    The filters compiled for dispatch, so that an accepted socket or a received datagram costs an array index and a
+    scan of the filters that can actually take it. For each protocol and local port the candidates are listed in the
+    order the filters are tried (priority level, then registration order); ports between the same filter boundaries
+    share one list, so a protocol has at most 2 * filters + 1 lists.
+*/
+typedef struct dispatch_table_s
+{
+    uint16_t          list_of_port[kDispatchProtocols][kPortsCount];
+    dispatch_list_t  *lists;
+    socket_filter_t **candidates;
+
+} dispatch_table_t;
+
 typedef struct socket_manager_s
 {
     filters_t filters[kFilterLevels];
@@ -67,6 +104,10 @@ typedef struct socket_manager_s
     balancegroup_registry_t balance_groups;
     wthread_t               accept_thread;
     worker_t               *worker;
+    dispatch_table_t       *dispatch; // built and swapped on the accept thread, which is also its only reader
+
+    uint8_t tcp_ports_overlapped[kPortsCount];
+    uint8_t udp_ports_overlapped[kPortsCount];
 
     uint16_t last_round_tid;
     bool     iptables_installed;
@@ -74,6 +115,7 @@ typedef struct socket_manager_s
     bool     lsof_installed;
     bool     iptable_cleaned;
     bool     iptables_used;
+    bool     sk_lookup_supported;
     bool     started;
 
 } socket_manager_state_t;
@@ -277,13 +319,10 @@ static void parseWhiteListOption(socket_filter_option_t *option)
     }
 }
 
+static void onFilterRegisteredAtRuntime(wevent_t *ev);
+
 void socketacceptorRegister(tunnel_t *tunnel, socket_filter_option_t option, onAccept cb)
 {
-    if (state->started)
-    {
-        LOGF("SocketManager: cannot register after accept thread starts");
-        exit(1);
-    }
     socket_filter_t *filter   = memoryAllocate(sizeof(socket_filter_t));
     unsigned int     pirority = 0;
     if (option.multiport_backend == kMultiportBackendNothing)
@@ -303,32 +342,192 @@ void socketacceptorRegister(tunnel_t *tunnel, socket_filter_option_t option, onA
 
     if (option.balance_group_name)
     {
-        hash_t         name_hash = calcHashBytes(option.balance_group_name, strlen(option.balance_group_name));
-        widle_table_t *b_table   = NULL;
+        hash_t           name_hash = calcHashBytes(option.balance_group_name, strlen(option.balance_group_name));
+        balance_group_t *group     = NULL;
         mutexLock(&(state->mutex));
 
         balancegroup_registry_t_iter find_result = balancegroup_registry_t_find(&(state->balance_groups), name_hash);
 
         if (find_result.ref == balancegroup_registry_t_end(&(state->balance_groups)).ref)
         {
-            b_table = idleTableCreate(state->worker->loop);
-            balancegroup_registry_t_insert(&(state->balance_groups), name_hash, b_table);
+            group  = memoryAllocate(sizeof(balance_group_t));
+            *group = (balance_group_t){.mode = option.balance_mode};
+            balancegroup_registry_t_insert(&(state->balance_groups), name_hash, group);
         }
         else
         {
-            b_table = (find_result.ref->second);
+            group = (find_result.ref->second);
         }
 
         mutexUnlock(&(state->mutex));
 
-        option.shared_balance_table = b_table;
+        option.balance_group = group;
     }
 
-    *filter = (socket_filter_t){.tunnel = tunnel, .option = option, .cb = cb, .listen_io = NULL};
+    const char *node_name = tunnelGetNode(tunnel)->name;
+
+    *filter = (socket_filter_t){.tunnel       = tunnel,
+                                .option       = option,
+                                .cb           = cb,
+                                .listen_io    = NULL,
+                                .balance_key  = calcHashBytes(node_name, strlen(node_name)),
+                                .active_lines = memoryAllocate(sizeof(active_lines_counter_t) * getWorkersCount())};
+    memorySet(filter->active_lines, 0, sizeof(active_lines_counter_t) * getWorkersCount());
 
     mutexLock(&(state->mutex));
     filters_t_push(&(state->filters[pirority]), filter);
+    bool started = state->started;
+    mutexUnlock(&(state->mutex));
+
+    if (started)
+    {
+        // the accept thread listens on it and swaps in a new dispatch table
+        wevent_t ev = (wevent_t){.loop = state->worker->loop, .cb = onFilterRegisteredAtRuntime, .userdata = filter};
+        wloopPostEvent(state->worker->loop, &ev);
+    }
+}
+
+typedef struct unhealthy_report_s
+{
+    tunnel_chain_t *chain;
+    uint64_t        until_ms;
+
+} unhealthy_report_t;
+
+// runs on the accept thread, the only reader of the deadline
+static void onUnhealthyReport(wevent_t *ev)
+{
+    unhealthy_report_t *report = weventGetUserdata(ev);
+
+    // only a registration at runtime can grow the filter vectors under us
+    mutexLock(&(state->mutex));
+    for (int ri = 0; ri < kFilterLevels; ri++)
+    {
+        c_foreach(k, filters_t, state->filters[ri])
+        {
+            if (tunnelGetChain((*(k.ref))->tunnel) == report->chain)
+            {
+                (*(k.ref))->unhealthy_until_ms = report->until_ms;
+            }
+        }
+    }
     mutexUnlock(&(state->mutex));
+
+    memoryFree(report);
+}
+
+void socketacceptorSetChainUnhealthy(tunnel_chain_t *chain, uint32_t duration_ms)
+{
+    unhealthy_report_t *report = memoryAllocate(sizeof(unhealthy_report_t));
+
+    // a deadline rather than a flag, an unhealthy member gets no lines and would never see the traffic that heals it
+    *report = (unhealthy_report_t){.chain    = chain,
+                                   .until_ms = duration_ms == 0 ? 0 : (getHRTimeUs() / 1000) + duration_ms};
+
+    wevent_t ev = (wevent_t){.loop = state->worker->loop, .cb = onUnhealthyReport, .userdata = report};
+    wloopPostEvent(state->worker->loop, &ev);
+}
+
+static int comparePorts(const void *a, const void *b)
+{
+    return (int) (*(const uint32_t *) a) - (int) (*(const uint32_t *) b);
+}
+
+static int getDispatchProtocol(enum socket_address_protocol protocol)
+{
+    return protocol == kSapTcp ? kDispatchTcp : protocol == kSapUdp ? kDispatchUdp : -1;
+}
+
+static void compileDispatchProtocol(dispatch_table_t *table, int dp, uint32_t *bounds, uint32_t *lists_len,
+                                    uint32_t *candidates_len)
+{
+    uint32_t bounds_len  = 0;
+    bounds[bounds_len++] = 0;
+    for (int ri = (kFilterLevels - 1); ri >= 0; ri--)
+    {
+        c_foreach(k, filters_t, state->filters[ri])
+        {
+            const socket_filter_option_t *option = &(*(k.ref))->option;
+            if (getDispatchProtocol(option->protocol) == dp)
+            {
+                bounds[bounds_len++] = option->port_min;
+                bounds[bounds_len++] = (uint32_t) option->port_max + 1;
+            }
+        }
+    }
+    qsort(bounds, bounds_len, sizeof(uint32_t), comparePorts);
+
+    for (uint32_t bi = 0; bi < bounds_len; bi++)
+    {
+        uint32_t first = bounds[bi];
+        uint32_t end   = bi + 1 < bounds_len ? bounds[bi + 1] : kPortsCount;
+        if (first >= end || first >= kPortsCount)
+        {
+            continue; // duplicate bound
+        }
+
+        dispatch_list_t *list = &table->lists[*lists_len];
+        *list                 = (dispatch_list_t){.begin = *candidates_len, .len = 0};
+        for (int ri = (kFilterLevels - 1); ri >= 0; ri--)
+        {
+            c_foreach(k, filters_t, state->filters[ri])
+            {
+                const socket_filter_option_t *option = &(*(k.ref))->option;
+                if (getDispatchProtocol(option->protocol) == dp && option->port_min <= first &&
+                    option->port_max >= first)
+                {
+                    table->candidates[(*candidates_len)++] = *(k.ref);
+                    list->len++;
+                }
+            }
+        }
+        for (uint32_t port = first; port < end; port++)
+        {
+            table->list_of_port[dp][port] = (uint16_t) *lists_len;
+        }
+        (*lists_len)++;
+    }
+}
+
+// called with the mutex held
+static dispatch_table_t *compileDispatchTable(void)
+{
+    uint32_t filters_count = 0;
+    for (int ri = 0; ri < kFilterLevels; ri++)
+    {
+        filters_count += (uint32_t) filters_t_size(&(state->filters[ri]));
+    }
+
+    const uint32_t    max_lists = kDispatchProtocols * (2 * filters_count + 1);
+    dispatch_table_t *table     = memoryAllocate(sizeof(dispatch_table_t));
+    table->lists                = memoryAllocate(sizeof(dispatch_list_t) * max_lists);
+    table->candidates           = memoryAllocate(sizeof(socket_filter_t *) * max(1U, max_lists * filters_count));
+
+    uint32_t *bounds         = memoryAllocate(sizeof(uint32_t) * (2 * filters_count + 1));
+    uint32_t  lists_len      = 0;
+    uint32_t  candidates_len = 0;
+    for (int dp = 0; dp < kDispatchProtocols; dp++)
+    {
+        compileDispatchProtocol(table, dp, bounds, &lists_len, &candidates_len);
+    }
+    memoryFree(bounds);
+    return table;
+}
+
+static void destroyDispatchTable(dispatch_table_t *table)
+{
+    if (table == NULL)
+    {
+        return;
+    }
+    memoryFree(table->lists);
+    memoryFree(table->candidates);
+    memoryFree(table);
+}
+
+static inline dispatch_list_t getDispatchList(int dp, uint16_t local_port)
+{
+    return state->dispatch->lists[state->dispatch->list_of_port[dp][local_port]];
 }
 
 static inline uint16_t getCurrentDistributeTid(void)
@@ -345,16 +544,90 @@ static inline void incrementDistributeTid(void)
     }
 }
 
-static void distributeSocket(void *io, socket_filter_t *filter, uint16_t local_port)
+// weighted rendezvous (highest random weight) score of a member for a source, -weight / ln(u) with u in (0, 1)
+static double rendezvousScore(hash_t src_hash, hash_t member_key, unsigned int weight)
 {
+    const hash_t pair[2] = {src_hash, member_key};
+    const hash_t h       = calcHashBytes(pair, sizeof(pair));
+    const double u       = ((double) (h >> 11) + 1.0) / 9007199254740994.0; // 2^53 + 2
+    return -(double) weight / log(u);
+}
 
-    wid_t tid = (uint8_t) getCurrentDistributeTid();
+static int countActiveLines(const socket_filter_t *filter)
+{
+    int sum = 0;
+    for (wid_t wid = 0; wid < getWorkersCount(); wid++)
+    {
+        sum += atomicLoadExplicit(&filter->active_lines[wid].value, memory_order_relaxed);
+    }
+    return max(sum, 0);
+}
+
+/*
+    Picks one of the members of a balance group that passed the filters, only the source address (no port) is
+    hashed so every connection of a client lands on the same member. Unhealthy members are only considered when no
+    other member is left.
+*/
+static socket_filter_t *selectBalanceMember(socket_filter_t **members, uint8_t members_length, hash_t src_hash)
+{
+    const balance_mode_t     mode       = members[0]->option.balance_group->mode;
+    const unsigned long long now_ms     = getHRTimeUs() / 1000;
+    socket_filter_t         *best       = NULL;
+    double                   best_score = 0;
+    double                   best_load  = 0;
+
+    for (int pass = 0; pass < 2 && best == NULL; pass++)
+    {
+        for (uint8_t i = 0; i < members_length; i++)
+        {
+            socket_filter_t *member = members[i];
+            unsigned int     weight = member->option.balance_group_weight;
+
+            if (pass == 0 && now_ms < member->unhealthy_until_ms)
+            {
+                continue;
+            }
+            double score = rendezvousScore(src_hash, member->balance_key, weight);
+
+            if (mode == kBalanceModeLeastLines)
+            {
+                double load = (double) countActiveLines(member) / (double) weight;
+                if (best == NULL || load < best_load || (load == best_load && score > best_score))
+                {
+                    best       = member;
+                    best_score = score;
+                    best_load  = load;
+                }
+            }
+            else if (best == NULL || score > best_score)
+            {
+                best       = member;
+                best_score = score;
+            }
+        }
+    }
+    return best;
+}
+
+static void distributeSocket(void *io, socket_filter_t *filter, uint16_t local_port)
+{
+    wid_t tid;
+    if (filter->option.worker_affinity == kWorkerAffinitySourceAddress)
+    {
+        tid = (wid_t) (sockaddrCalcHashNoPort((sockaddr_u *) wioGetPeerAddrU(io)) % getWorkersCount());
+    }
+    else
+    {
+        tid = (uint8_t) getCurrentDistributeTid();
+        incrementDistributeTid();
+    }
 
     mutexLock(&(state->tcp_pools[tid].mutex));
     socket_accept_result_t *result = genericpoolGetItem(state->tcp_pools[tid].pool);
     mutexUnlock(&(state->tcp_pools[tid].mutex));
 
     result->real_localport = local_port;
+    result->active_lines   = &filter->active_lines[tid];
 
     wloop_t *worker_loop = getWorkerLoop(tid);
     wevent_t ev          = (wevent_t){.loop = worker_loop, .cb = filter->cb};
@@ -362,7 +635,6 @@ static void distributeSocket(void *io, socket_filter_t *filter, uint16_t local_p
     result->io           = io;
     result->tunnel       = filter->tunnel;
     ev.userdata          = result;
-    incrementDistributeTid();
 
     wloopPostEvent(worker_loop, &ev);
 }
@@ -377,7 +649,7 @@ static void noTcpSocketConsumerFound(wio_t *io)
     wioClose(io);
 }
 
-static bool checkIpIsWhiteList(sockaddr_u *addr, const socket_filter_option_t option)
+static bool checkIpIsWhiteList(sockaddr_u *addr, const socket_filter_option_t *option)
 {
     const bool     is_v4 = addr->sa.sa_family == AF_INET;
     struct in_addr ipv4_addr;
@@ -386,11 +658,11 @@ static bool checkIpIsWhiteList(sockaddr_u *addr, const socket_filter_option_t op
     {
         ipv4_addr = addr->sin.sin_addr;
     v4checks:
-        for (unsigned int i = 0; i < option.white_list_parsed_length; i++)
+        for (unsigned int i = 0; i < option->white_list_parsed_length; i++)
         {
 
-            if (checkIPRange4(ipv4_addr, *(struct in_addr *) &(option.white_list_parsed[i].ip_bytes_buf),
-                              *(struct in_addr *) &(option.white_list_parsed[i].mask_bytes_buf)))
+            if (checkIPRange4(ipv4_addr, *(struct in_addr *) &(option->white_list_parsed[i].ip_bytes_buf),
+                              *(struct in_addr *) &(option->white_list_parsed[i].mask_bytes_buf)))
             {
                 return true;
             }
@@ -404,11 +676,11 @@ static bool checkIpIsWhiteList(sockaddr_u *addr, const socket_filter_option_t op
             goto v4checks;
         }
 
-        for (unsigned int i = 0; i < option.white_list_parsed_length; i++)
+        for (unsigned int i = 0; i < option->white_list_parsed_length; i++)
         {
 
-            if (checkIPRange6(addr->sin6.sin6_addr, option.white_list_parsed[i].ip_bytes_buf,
-                              option.white_list_parsed[i].mask_bytes_buf))
+            if (checkIPRange6(addr->sin6.sin6_addr, option->white_list_parsed[i].ip_bytes_buf,
+                              option->white_list_parsed[i].mask_bytes_buf))
             {
                 return true;
             }
@@ -424,93 +696,59 @@ static void distributeTcpSocket(wio_t *io, uint16_t local_port)
 
     static socket_filter_t *balance_selection_filters[kMaxBalanceSelections];
     uint8_t                 balance_selection_filters_length = 0;
-    widle_table_t          *selected_balance_table           = NULL;
-    hash_t                  src_hash                         = 0x0;
-    bool                    src_hashed                       = false;
-    const uint8_t           this_tid                         = state->worker->wid;
+    balance_group_t        *selected_balance_group           = NULL;
 
-    for (int ri = (kFilterLevels - 1); ri >= 0; ri--)
+    const dispatch_list_t list = getDispatchList(kDispatchTcp, local_port);
+    for (uint32_t ci = list.begin; ci < list.begin + list.len; ci++)
     {
-        c_foreach(k, filters_t, state->filters[ri])
-        {
-            socket_filter_t       *filter   = *(k.ref);
-            socket_filter_option_t option   = filter->option;
-            uint16_t               port_min = option.port_min;
-            uint16_t               port_max = option.port_max;
+        socket_filter_t              *filter = state->dispatch->candidates[ci];
+        const socket_filter_option_t *option = &filter->option;
 
-            if (selected_balance_table != NULL && option.shared_balance_table != selected_balance_table)
-            {
-                continue;
-            }
+        if (selected_balance_group != NULL && option->balance_group != selected_balance_group)
+        {
+            continue;
+        }
 
-            if (option.protocol != kSapTcp || port_min > local_port || port_max < local_port)
+        if (option->white_list_raddr != NULL)
+        {
+            if (! checkIpIsWhiteList(paddr, option))
             {
                 continue;
             }
+        }
 
-            if (option.white_list_raddr != NULL)
-            {
-                if (! checkIpIsWhiteList(paddr, option))
-                {
-                    continue;
-                }
-            }
-
-            if (option.shared_balance_table)
+        if (option->balance_group)
+        {
+            if (UNLIKELY(balance_selection_filters_length >= kMaxBalanceSelections))
             {
-                if (! src_hashed)
-                {
-                    src_hash = sockaddrCalcHashNoPort((sockaddr_u *) wioGetPeerAddrU(io));
-                }
-                idle_item_t *idle_item = idleTableGetIdleItemByHash(this_tid, option.shared_balance_table, src_hash);
-
-                if (idle_item)
-                {
-                    socket_filter_t *target_filter = idle_item->userdata;
-                    idleTableKeepIdleItemForAtleast(option.shared_balance_table, idle_item,
-                                                    option.balance_group_interval == 0 ? kDefalultBalanceInterval
-                                                                                       : option.balance_group_interval);
-                    if (option.no_delay)
-                    {
-                        tcpNoDelay(wioGetFD(io), 1);
-                    }
-                    wioDetach(io);
-                    distributeSocket(io, target_filter, local_port);
-                    return;
-                }
-
-                if (UNLIKELY(balance_selection_filters_length >= kMaxBalanceSelections))
-                {
-                    // probably never but the limit can be simply increased
-                    LOGW("SocketManager: balance between more than %d tunnels is not supported", kMaxBalanceSelections);
-                    continue;
-                }
-                balance_selection_filters[balance_selection_filters_length++] = filter;
-                selected_balance_table                                        = option.shared_balance_table;
+                // probably never but the limit can be simply increased
+                LOGW("SocketManager: balance between more than %d tunnels is not supported", kMaxBalanceSelections);
                 continue;
             }
+            balance_selection_filters[balance_selection_filters_length++] = filter;
+            selected_balance_group                                        = option->balance_group;
+            continue;
+        }
 
-            if (option.no_delay)
-            {
-                tcpNoDelay(wioGetFD(io), 1);
-            }
-            wioDetach(io);
-            distributeSocket(io, filter, local_port);
-            return;
+        if (option->no_delay)
+        {
+            tcpNoDelay(wioGetFD(io), 1);
         }
+        wioDetach(io);
+        distributeSocket(io, filter, local_port);
+        return;
     }
 
     if (balance_selection_filters_length > 0)
     {
-        socket_filter_t *filter = balance_selection_filters[fastRand() % balance_selection_filters_length];
-        idleItemNew(filter->option.shared_balance_table, src_hash, filter, NULL, this_tid,
-                    filter->option.balance_group_interval == 0 ? kDefalultBalanceInterval
-                                                               : filter->option.balance_group_interval);
+        socket_filter_t *filter = selectBalanceMember(balance_selection_filters, balance_selection_filters_length,
+                                                      sockaddrCalcHashNoPort(paddr));
 
         if (filter->option.no_delay)
         {
             tcpNoDelay(wioGetFD(io), 1);
         }
+        wioDetach(io);
         distributeSocket(io, filter, local_port);
     }
     else
@@ -552,6 +790,10 @@ static void onAcceptTcpMultiPort(wio_t *io)
 
 static multiport_backend_t getDefaultMultiPortBackend(void)
 {
+    if (state->sk_lookup_supported)
+    {
+        return kMultiportBackendSkLookup;
+    }
     if (state->iptables_installed)
     {
         return kMultiportBackendIptables;
@@ -636,6 +878,87 @@ static void listenTcpMultiPortSockets(wloop_t *loop, socket_filter_t *filter, ch
     }
 }
 
+// binds the socket that receives the whole range to the highest free port of the range
+static wio_t *listenOnFreePortInRange(wloop_t *loop, char *host, uint16_t port_min, uint16_t port_max,
+                                      uint8_t *ports_overlapped, bool tcp)
+{
+    for (uint16_t port = port_max;; port--)
+    {
+        if (ports_overlapped[port] != 1)
+        {
+            ports_overlapped[port] = 1;
+            wio_t *io = tcp ? wloopCreateTcpServer(loop, host, port, onAcceptTcpSinglePort)
+                            : wloopCreateUdpServer(loop, host, port);
+            if (io != NULL)
+            {
+                return io;
+            }
+        }
+        if (port == port_min)
+        {
+            return NULL;
+        }
+    }
+}
+
+static void checkSkLookupSupported(void)
+{
+    if (! state->sk_lookup_supported)
+    {
+        LOGF("SocketManager: multi port backend \"sk-lookup\" colud not start, error: not supported (needs linux 5.9+ "
+             "and CAP_NET_ADMIN)");
+        exit(1);
+    }
+}
+
+/*
+    The attach can still be refused after the probe passed (a seccomp / lsm policy, a netns we may not touch). When
+    sk-lookup was only our default the listener goes on with the next backend, an explicit "sk-lookup" stops.
+    Returns false when the filter has to be listened again with another backend.
+*/
+static bool onSkLookupAttachFailed(socket_filter_t *filter, uint8_t *ports_overlapped, const char *proto)
+{
+    const char *host = filter->option.host;
+    if (! filter->backend_defaulted)
+    {
+        LOGF("SocketManager: could not attach sk_lookup program for %s:[%u - %u] (%s), error: %s", host,
+             filter->option.port_min, filter->option.port_max, proto, strerror(errno));
+        exit(1);
+    }
+    LOGW("SocketManager: could not attach sk_lookup program for %s:[%u - %u] (%s), error: %s, falling back", host,
+         filter->option.port_min, filter->option.port_max, proto, strerror(errno));
+
+    ports_overlapped[sockaddrPort((sockaddr_u *) wioGetLocaladdrU(filter->listen_io))] = 0;
+    wioClose(filter->listen_io);
+    filter->listen_io                = NULL;
+    state->sk_lookup_supported       = false;
+    filter->option.multiport_backend = kMultiportBackendDefault;
+    return false;
+}
+
+static bool listenTcpMultiPortSkLookup(wloop_t *loop, socket_filter_t *filter, char *host, uint16_t port_min,
+                                       uint8_t *ports_overlapped, uint16_t port_max)
+{
+    checkSkLookupSupported();
+
+    // the accepted sockets are not nated, getsockname gives the real local port
+    filter->listen_io = listenOnFreePortInRange(loop, host, port_min, port_max, ports_overlapped, true);
+    if (filter->listen_io == NULL)
+    {
+        LOGF("SocketManager: stopping due to null socket handle");
+        exit(1);
+    }
+    filter->v6_dualstack = wioGetLocaladdr(filter->listen_io)->sa_family == AF_INET6;
+
+    if (! sklookupAttach(IPPROTO_TCP, port_min, port_max, wioGetFD(filter->listen_io)))
+    {
+        return onSkLookupAttachFailed(filter, ports_overlapped, "TCP");
+    }
+    LOGI("SocketManager: listening on %s:[%u - %u] >> %d (%s, sk-lookup)", host, port_min, port_max,
+         sockaddrPort((sockaddr_u *) wioGetLocaladdrU(filter->listen_io)), "TCP");
+    return true;
+}
+
 static void listenTcpSinglePort(wloop_t *loop, socket_filter_t *filter, char *host, uint16_t port,
                                 uint8_t *ports_overlapped)
 {
@@ -655,45 +978,57 @@ static void listenTcpSinglePort(wloop_t *loop, socket_filter_t *filter, char *ho
     filter->v6_dualstack = wioGetLocaladdr(filter->listen_io)->sa_family == AF_INET6;
 }
 
-static void listenTcp(wloop_t *loop, uint8_t *ports_overlapped)
+static void listenTcpFilter(wloop_t *loop, socket_filter_t *filter, uint8_t *ports_overlapped)
 {
-    for (int ri = (kFilterLevels - 1); ri >= 0; ri--)
+    if (filter->option.multiport_backend == kMultiportBackendDefault)
     {
-        c_foreach(k, filters_t, state->filters[ri])
+        filter->option.multiport_backend = getDefaultMultiPortBackend();
+        filter->backend_defaulted        = true;
+    }
+
+    socket_filter_option_t option   = filter->option;
+    uint16_t               port_min = option.port_min;
+    uint16_t               port_max = option.port_max;
+    if (port_min > port_max)
+    {
+        LOGF("SocketManager: port min must be lower than port max");
+        exit(1);
+    }
+    else if (port_min == port_max)
+    {
+        option.multiport_backend = kMultiportBackendNothing;
+    }
+    if (option.protocol == kSapTcp)
+    {
+        if (option.multiport_backend == kMultiportBackendIptables)
         {
-            socket_filter_t *filter = *(k.ref);
-            if (filter->option.multiport_backend == kMultiportBackendDefault)
+            listenTcpMultiPortIptables(loop, filter, option.host, port_min, ports_overlapped, port_max);
+        }
+        else if (option.multiport_backend == kMultiportBackendSockets)
+        {
+            listenTcpMultiPortSockets(loop, filter, option.host, port_min, ports_overlapped, port_max);
+        }
+        else if (option.multiport_backend == kMultiportBackendSkLookup)
+        {
+            if (! listenTcpMultiPortSkLookup(loop, filter, option.host, port_min, ports_overlapped, port_max))
             {
-                filter->option.multiport_backend = getDefaultMultiPortBackend();
+                listenTcpFilter(loop, filter, ports_overlapped);
             }
+        }
+        else
+        {
+            listenTcpSinglePort(loop, filter, option.host, port_min, ports_overlapped);
+        }
+    }
+}
 
-            socket_filter_option_t option   = filter->option;
-            uint16_t               port_min = option.port_min;
-            uint16_t               port_max = option.port_max;
-            if (port_min > port_max)
-            {
-                LOGF("SocketManager: port min must be lower than port max");
-                exit(1);
-            }
-            else if (port_min == port_max)
-            {
-                option.multiport_backend = kMultiportBackendNothing;
-            }
-            if (option.protocol == kSapTcp)
-            {
-                if (option.multiport_backend == kMultiportBackendIptables)
-                {
-                    listenTcpMultiPortIptables(loop, filter, option.host, port_min, ports_overlapped, port_max);
-                }
-                else if (option.multiport_backend == kMultiportBackendSockets)
-                {
-                    listenTcpMultiPortSockets(loop, filter, option.host, port_min, ports_overlapped, port_max);
-                }
-                else
-                {
-                    listenTcpSinglePort(loop, filter, option.host, port_min, ports_overlapped);
-                }
-            }
+static void listenTcp(wloop_t *loop, uint8_t *ports_overlapped)
+{
+    for (int ri = (kFilterLevels - 1); ri >= 0; ri--)
+    {
+        c_foreach(k, filters_t, state->filters[ri])
+        {
+            listenTcpFilter(loop, *(k.ref), ports_overlapped);
         }
     }
 }
@@ -716,6 +1051,7 @@ static void postPayload(udp_payload_t post_pl, socket_filter_t *filter)
     *pl = post_pl;
 
     pl->tunnel           = filter->tunnel;
+    pl->active_lines     = &filter->active_lines[pl->tid];
     wloop_t *worker_loop = getWorkerLoop(pl->tid);
     wevent_t ev          = (wevent_t){.loop = worker_loop, .cb = filter->cb};
     ev.userdata          = (void *) pl;
@@ -731,76 +1067,46 @@ static void distributeUdpPayload(const udp_payload_t pl)
 
     static socket_filter_t *balance_selection_filters[kMaxBalanceSelections];
     uint8_t                 balance_selection_filters_length = 0;
-    widle_table_t          *selected_balance_table           = NULL;
-    hash_t                  src_hash                         = 0x0;
-    bool                    src_hashed                       = false;
-    const uint8_t           this_tid                         = state->worker->wid;
+    balance_group_t        *selected_balance_group           = NULL;
 
-    for (int ri = (kFilterLevels - 1); ri >= 0; ri--)
+    const dispatch_list_t list = getDispatchList(kDispatchUdp, local_port);
+    for (uint32_t ci = list.begin; ci < list.begin + list.len; ci++)
     {
-        c_foreach(k, filters_t, state->filters[ri])
-        {
+        socket_filter_t              *filter = state->dispatch->candidates[ci];
+        const socket_filter_option_t *option = &filter->option;
 
-            socket_filter_t       *filter   = *(k.ref);
-            socket_filter_option_t option   = filter->option;
-            uint16_t               port_min = option.port_min;
-            uint16_t               port_max = option.port_max;
+        if (selected_balance_group != NULL && option->balance_group != selected_balance_group)
+        {
+            continue;
+        }
 
-            if (selected_balance_table != NULL && option.shared_balance_table != selected_balance_table)
+        if (option->white_list_raddr != NULL)
+        {
+            if (! checkIpIsWhiteList(paddr, option))
             {
                 continue;
             }
-
-            if (option.protocol != kSapUdp || port_min > local_port || port_max < local_port)
+        }
+        if (option->balance_group)
+        {
+            if (UNLIKELY(balance_selection_filters_length >= kMaxBalanceSelections))
             {
+                // probably never but the limit can be simply increased
+                LOGW("SocketManager: balance between more than %d tunnels is not supported", kMaxBalanceSelections);
                 continue;
             }
-            if (option.white_list_raddr != NULL)
-            {
-                if (! checkIpIsWhiteList(paddr, option))
-                {
-                    continue;
-                }
-            }
-            if (option.shared_balance_table)
-            {
-                if (! src_hashed)
-                {
-                    src_hash = sockaddrCalcHashNoPort((sockaddr_u *) wioGetPeerAddrU(pl.sock->io));
-                }
-                idle_item_t *idle_item = idleTableGetIdleItemByHash(this_tid, option.shared_balance_table, src_hash);
-
-                if (idle_item)
-                {
-                    socket_filter_t *target_filter = idle_item->userdata;
-                    idleTableKeepIdleItemForAtleast(option.shared_balance_table, idle_item,
-                                                    option.balance_group_interval == 0 ? kDefalultBalanceInterval
-                                                                                       : option.balance_group_interval);
-                    postPayload(pl, target_filter);
-                    return;
-                }
-
-                if (UNLIKELY(balance_selection_filters_length >= kMaxBalanceSelections))
-                {
-                    // probably never but the limit can be simply increased
-                    LOGW("SocketManager: balance between more than %d tunnels is not supported", kMaxBalanceSelections);
-                    continue;
-                }
-                balance_selection_filters[balance_selection_filters_length++] = filter;
-                selected_balance_table                                        = option.shared_balance_table;
-                continue;
-            }
-
-            postPayload(pl, filter);
-            return;
+            balance_selection_filters[balance_selection_filters_length++] = filter;
+            selected_balance_group                                        = option->balance_group;
+            continue;
         }
+
+        postPayload(pl, filter);
+        return;
     }
     if (balance_selection_filters_length > 0)
     {
-        socket_filter_t *filter = balance_selection_filters[fastRand() % balance_selection_filters_length];
-        idleItemNew(filter->option.shared_balance_table, src_hash, filter, NULL, this_tid,
-                    filter->option.balance_group_interval == 0 ? kDefalultBalanceInterval
-                                                               : filter->option.balance_group_interval);
+        socket_filter_t *filter = selectBalanceMember(balance_selection_filters, balance_selection_filters_length,
+                                                      sockaddrCalcHashNoPort(paddr));
         postPayload(pl, filter);
     }
     else
@@ -847,47 +1153,153 @@ static void listenUdpSinglePort(wloop_t *loop, socket_filter_t *filter, char *ho
     wioRead(filter->listen_io);
 }
 
+typedef struct udp_multiport_sock_s
+{
+    udpsock_t        sock; // first member, the payloads of the main port point to it
+    socket_filter_t *filter;
+    udpsock_t      **reply_socks; // [port - port_min], bound lazily so that replies leave from the port the peer used
+
+} udp_multiport_sock_t;
+
+static udpsock_t *getReplySocket(udp_multiport_sock_t *msock, uint16_t port)
+{
+    udpsock_t **slot = &msock->reply_socks[port - msock->filter->option.port_min];
+    if (*slot != NULL)
+    {
+        return *slot;
+    }
+
+    // datagrams to this port are still steered to the main socket, this one only sends
+    wio_t *io = wloopCreateUdpServer(state->worker->loop, msock->filter->option.host, port);
+    if (io == NULL)
+    {
+        LOGW("SocketManager: could not bind reply socket on %s:[%u] (%s), replying from the main port",
+             msock->filter->option.host, port, "UDP");
+        *slot = &msock->sock;
+        return *slot;
+    }
+    udpsock_t *socket = memoryAllocate(sizeof(udpsock_t));
+    *socket           = (udpsock_t){.io = io, .table = idleTableCreate(state->worker->loop)};
+    weventSetUserData(io, socket);
+    *slot = socket;
+    return socket;
+}
+
+static void onRecvFromMultiPort(wio_t *io, sbuf_t *buf)
+{
+    udp_multiport_sock_t *msock      = weventGetUserdata(io);
+    udpsock_t            *socket     = &msock->sock;
+    uint16_t              bound_port = sockaddrPort((sockaddr_u *) wioGetLocaladdrU(io));
+    uint16_t              local_port = wioGetOrigDstPort(io);
+
+    if (local_port == 0)
+    {
+        local_port = bound_port;
+    }
+    if (local_port != bound_port)
+    {
+        socket = getReplySocket(msock, local_port);
+        // writes go to the peer address of the io, see postUdpWrite
+        memoryCopy(wioGetPeerAddrU(socket->io), wioGetPeerAddrU(io), sizeof(sockaddr_u));
+    }
+
+    udp_payload_t item = (udp_payload_t){.sock           = socket,
+                                         .buf            = buf,
+                                         .tid            = local_port % getWorkersCount(),
+                                         .peer_addr      = *(sockaddr_u *) wioGetPeerAddrU(io),
+                                         .real_localport = local_port};
+
+    distributeUdpPayload(item);
+}
+
+static bool listenUdpMultiPortSkLookup(wloop_t *loop, socket_filter_t *filter, char *host, uint16_t port_min,
+                                       uint8_t *ports_overlapped, uint16_t port_max)
+{
+    checkSkLookupSupported();
+
+    filter->listen_io = listenOnFreePortInRange(loop, host, port_min, port_max, ports_overlapped, false);
+    if (filter->listen_io == NULL)
+    {
+        LOGF("SocketManager: stopping due to null socket handle");
+        exit(1);
+    }
+    if (wioEnableRecvOrigDst(filter->listen_io) != 0)
+    {
+        LOGF("SocketManager: could not enable IP_RECVORIGDSTADDR on %s (%s), error: %s", host, "UDP", strerror(errno));
+        exit(1);
+    }
+
+    if (! sklookupAttach(IPPROTO_UDP, port_min, port_max, wioGetFD(filter->listen_io)))
+    {
+        return onSkLookupAttachFailed(filter, ports_overlapped, "UDP");
+    }
+
+    const size_t          ports = (size_t) port_max - port_min + 1;
+    udp_multiport_sock_t *msock = memoryAllocate(sizeof(udp_multiport_sock_t));
+    *msock                      = (udp_multiport_sock_t){.filter = filter};
+    msock->sock                 = (udpsock_t){.io = filter->listen_io, .table = idleTableCreate(loop)};
+    msock->reply_socks          = memoryAllocate(sizeof(udpsock_t *) * ports);
+    memorySet(msock->reply_socks, 0, sizeof(udpsock_t *) * ports);
+
+    weventSetUserData(filter->listen_io, msock);
+    wioSetCallBackRead(filter->listen_io, onRecvFromMultiPort);
+    wioRead(filter->listen_io);
+    LOGI("SocketManager: listening on %s:[%u - %u] >> %d (%s, sk-lookup)", host, port_min, port_max,
+         sockaddrPort((sockaddr_u *) wioGetLocaladdrU(filter->listen_io)), "UDP");
+    return true;
+}
+
 // todo (udp manager)
-static void listenUdp(wloop_t *loop, uint8_t *ports_overlapped)
+static void listenUdpFilter(wloop_t *loop, socket_filter_t *filter, uint8_t *ports_overlapped)
 {
-    for (int ri = (kFilterLevels - 1); ri >= 0; ri--)
+    if (filter->option.multiport_backend == kMultiportBackendDefault)
     {
-        c_foreach(k, filters_t, state->filters[ri])
+        filter->option.multiport_backend = getDefaultMultiPortBackend();
+        filter->backend_defaulted        = true;
+    }
+
+    socket_filter_option_t option   = filter->option;
+    uint16_t               port_min = option.port_min;
+    uint16_t               port_max = option.port_max;
+    if (port_min > port_max)
+    {
+        LOGF("SocketManager: port min must be lower than port max");
+        exit(1);
+    }
+    else if (port_min == port_max)
+    {
+        option.multiport_backend = kMultiportBackendNothing;
+    }
+    if (option.protocol == kSapUdp)
+    {
+        if (option.multiport_backend == kMultiportBackendIptables ||
+            option.multiport_backend == kMultiportBackendSockets)
         {
-            socket_filter_t *filter = *(k.ref);
-            if (filter->option.multiport_backend == kMultiportBackendDefault)
+            // listenUdpMultiPortIptables / listenUdpMultiPortSockets are not written yet
+            LOGE("SocketManager: multi port udp needs the \"sk-lookup\" backend, %s:[%u - %u] (%s) is not listened",
+                 option.host, port_min, port_max, "UDP");
+        }
+        else if (option.multiport_backend == kMultiportBackendSkLookup)
+        {
+            if (! listenUdpMultiPortSkLookup(loop, filter, option.host, port_min, ports_overlapped, port_max))
             {
-                filter->option.multiport_backend = getDefaultMultiPortBackend();
+                listenUdpFilter(loop, filter, ports_overlapped);
             }
+        }
+        else
+        {
+            listenUdpSinglePort(loop, filter, option.host, port_min, ports_overlapped);
+        }
+    }
+}
 
-            socket_filter_option_t option   = filter->option;
-            uint16_t               port_min = option.port_min;
-            uint16_t               port_max = option.port_max;
-            if (port_min > port_max)
-            {
-                LOGF("SocketManager: port min must be lower than port max");
-                exit(1);
-            }
-            else if (port_min == port_max)
-            {
-                option.multiport_backend = kMultiportBackendNothing;
-            }
-            if (option.protocol == kSapUdp)
-            {
-                if (option.multiport_backend == kMultiportBackendIptables)
-                {
-                    ;
-                    // listenUdpMultiPortIptables(loop, filter, option.host, port_min, ports_overlapped, port_max);
-                }
-                else if (option.multiport_backend == kMultiportBackendSockets)
-                {
-                    // listenUdpMultiPortSockets(loop, filter, option.host, port_min, ports_overlapped, port_max);
-                }
-                else
-                {
-                    listenUdpSinglePort(loop, filter, option.host, port_min, ports_overlapped);
-                }
-            }
+static void listenUdp(wloop_t *loop, uint8_t *ports_overlapped)
+{
+    for (int ri = (kFilterLevels - 1); ri >= 0; ri--)
+    {
+        c_foreach(k, filters_t, state->filters[ri])
+        {
+            listenUdpFilter(loop, *(k.ref), ports_overlapped);
         }
     }
 }
@@ -912,6 +1324,27 @@ void postUdpWrite(udpsock_t *socket_io, uint8_t tid_from, sbuf_t *buf)
     wloopPostEvent(weventGetLoop(socket_io->io), &ev);
 }
 
+static void onFilterRegisteredAtRuntime(wevent_t *ev)
+{
+    socket_filter_t *filter = weventGetUserdata(ev);
+
+    mutexLock(&(state->mutex));
+    if (filter->option.protocol == kSapTcp)
+    {
+        listenTcpFilter(state->worker->loop, filter, state->tcp_ports_overlapped);
+    }
+    else
+    {
+        listenUdpFilter(state->worker->loop, filter, state->udp_ports_overlapped);
+    }
+    dispatch_table_t *old_table = state->dispatch;
+    state->dispatch             = compileDispatchTable();
+    mutexUnlock(&(state->mutex));
+
+    // dispatching runs on this thread as well, nothing is scanning the old table now
+    destroyDispatchTable(old_table);
+}
+
 static WTHREAD_ROUTINE(accept_thread) // NOLINT
 {
     (void) userdata;
@@ -919,18 +1352,14 @@ static WTHREAD_ROUTINE(accept_thread) // NOLINT
     assert(state && state->worker->loop && ! state->started);
 
     frandInit();
+    pinHelperThread();
 
     mutexLock(&(state->mutex));
 
-    {
-        uint8_t ports_overlapped[65536] = {0};
-        listenTcp(state->worker->loop, ports_overlapped);
-    }
-    {
-        uint8_t ports_overlapped[65536] = {0};
-        listenUdp(state->worker->loop, ports_overlapped);
-    }
-    state->started = true;
+    listenTcp(state->worker->loop, state->tcp_ports_overlapped);
+    listenUdp(state->worker->loop, state->udp_ports_overlapped);
+    state->dispatch = compileDispatchTable();
+    state->started  = true;
     mutexUnlock(&(state->mutex));
 
     wloopRun(state->worker->loop);
@@ -1004,6 +1433,7 @@ socket_manager_state_t *socketmanagerCreate(void)
 
     state->iptables_installed = checkCommandAvailable("iptables");
     state->lsof_installed     = checkCommandAvailable("lsof");
+    state->sk_lookup_supported = sklookupIsSupported();
 #if SUPPORT_V6
     state->ip6tables_installed = checkCommandAvailable("ip6tables");
 #endif
@@ -14,11 +14,42 @@ typedef enum
     kMultiportBackendNothing,
     kMultiportBackendDefault,
     kMultiportBackendIptables,
-    kMultiportBackendSockets
+    kMultiportBackendSockets,
+    kMultiportBackendSkLookup // one socket for the whole range, steered by a bpf sk_lookup program (wsklookup.h)
 } multiport_backend_t;
 
+typedef enum
+{
+    kWorkerAffinityRoundRobin,
+    kWorkerAffinitySourceAddress // the worker is picked by the hash of the peer address (without port)
+} worker_affinity_t;
+
+typedef enum
+{
+    kBalanceModeHash,      // weighted rendezvous hash of the source address, a client stays on its member
+    kBalanceModeLeastLines // the member with the fewest open lines per weight, ties go to the rendezvous winner
+} balance_mode_t;
+
 struct balance_group_s;
 
+// open lines of a listener on one worker, only that worker writes it, the accept thread sums them (least-lines)
+typedef struct active_lines_counter_s
+{
+    atomic_int value;
+    uint8_t    pad[kCpuLineCacheSize - sizeof(atomic_int)];
+
+} active_lines_counter_t;
+
+static inline void activelinesInc(active_lines_counter_t *c)
+{
+    atomicStoreExplicit(&c->value, atomicLoadExplicit(&c->value, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+static inline void activelinesDec(active_lines_counter_t *c)
+{
+    atomicStoreExplicit(&c->value, atomicLoadExplicit(&c->value, memory_order_relaxed) - 1, memory_order_relaxed);
+}
+
 /*
     socket_filter_option_t provides information about which forxample protocol (tcp ? udp?)
     which ports (single? range?)
@@ -26,6 +57,12 @@ struct balance_group_s;
 
     the acceptor wants, they fill the information and register it by calling socketacceptorRegister
 
+    acceptors that share a balance_group_name and match the same socket form a balance group, one of them is
+    picked by balance_mode; the choice is computed from the source address alone (no shared table, no lock),
+    so adding or removing a member only moves the clients that land on it. balance_group_weight (1 or more) scales
+    the share of a member, and members marked unhealthy (socketacceptorSetChainUnhealthy, TcpConnector does it
+    for the chain it serves after repeated connect failures) are skipped for a while as long as a healthy one is left
+
 */
 typedef struct socket_filter_option_s
 {
@@ -35,11 +72,13 @@ typedef struct socket_filter_option_s
     char                        *balance_group_name;
     enum socket_address_protocol protocol;
     multiport_backend_t          multiport_backend;
+    worker_affinity_t            worker_affinity;
     uint16_t                     port_min;
     uint16_t                     port_max;
     bool                         fast_open;
     bool                         no_delay;
-    unsigned int                 balance_group_interval;
+    balance_mode_t               balance_mode; // the mode of the first member that names the group wins
+    unsigned int                 balance_group_weight;
 
     // private
     unsigned int white_list_parsed_length;
@@ -49,7 +88,7 @@ typedef struct socket_filter_option_s
         struct in6_addr mask_bytes_buf;
     } *white_list_parsed;
 
-    widle_table_t *shared_balance_table;
+    struct balance_group_s *balance_group;
 
 } socket_filter_option_t;
 
@@ -59,6 +98,7 @@ typedef struct socket_accept_result_s
     wio_t                       *io;
     tunnel_t                    *tunnel;
     enum socket_address_protocol protocol;
+    active_lines_counter_t      *active_lines; // of the worker, the listener counts the lines it opens there
     uint8_t                      tid;
     uint16_t                     real_localport;
 
@@ -81,6 +121,7 @@ typedef struct udp_payload_s
     udpsock_t      *sock;
     tunnel_t       *tunnel;
     sbuf_t *buf;
+    active_lines_counter_t *active_lines; // of the worker, the listener counts the lines it opens there
     sockaddr_u      peer_addr;
     uint16_t        real_localport;
     uint8_t         tid;
@@ -94,4 +135,5 @@ struct socket_manager_s *socketmanagerCreate(void);
 void                     socketmanagerSet(struct socket_manager_s *state);
 void                     socketmanagerStart(void);
 void                     socketacceptorRegister(tunnel_t *tunnel, socket_filter_option_t option, onAccept cb);
+void                     socketacceptorSetChainUnhealthy(tunnel_chain_t *chain, uint32_t duration_ms); // 0 heals it
 void                     postUdpWrite(udpsock_t *socket_io, uint8_t tid_from, sbuf_t *buf);
@@ -3,6 +3,7 @@
 #include "loggers/internal_logger.h"
 #include "node_builder/node.h"
 #include "global_state.h"
+#include "line.h"
 
 void tunnelarrayInesert(tunnel_array_t *tc, tunnel_t *t)
 {
@@ -27,17 +28,20 @@ void tunnelchainInsert(tunnel_chain_t *tci, tunnel_t *t)
 tunnel_chain_t *tunnelchainCreate(void)
 {
     tunnel_chain_t *tc = memoryAllocate(sizeof(tunnel_chain_t) + sizeof(void *) * getWorkersCount());
+    memorySet(tc, 0, sizeof(tunnel_chain_t) + sizeof(void *) * getWorkersCount());
+    tc->workers_count = getWorkersCount();
     return tc;
 }
 
 void tunnelchainFinalize(tunnel_chain_t *tc)
 {
+    // no slab here: a chain needs a few KB of lines, an arena of its own would take a whole huge page
     tc->masterpool_line_pool = masterpoolCreateWithCapacity(2 * ((8) + GSTATE.ram_profile));
 
     for (uint32_t i = 0; i < tc->workers_count; i++)
     {
         tc->line_pools[i] = genericpoolCreateWithDefaultAllocatorAndCapacity(
-            tc->masterpool_line_pool , tc->sum_line_state_size, (8) + GSTATE.ram_profile);
+            tc->masterpool_line_pool, sizeof(line_t) + tc->sum_line_state_size, (8) + GSTATE.ram_profile);
     }
 
     
@@ -0,0 +1,80 @@
+#include "chain_fusion.h"
+
+#include "loggers/internal_logger.h"
+#include "node_builder/node.h"
+
+static chain_fusion_shape_t shapes[kChainFusionMaxShapes];
+static hash_t               shapes_type_hashes[kChainFusionMaxShapes][kChainFusionMaxShapeLen];
+static uint8_t              shapes_len[kChainFusionMaxShapes];
+static uint32_t             shapes_count;
+
+void chainfusionRegister(chain_fusion_shape_t shape)
+{
+    if (shapes_count == kChainFusionMaxShapes)
+    {
+        LOGF("ChainFusion: too many fused shapes");
+        exit(1);
+    }
+
+    uint8_t len = 0;
+    while (len < kChainFusionMaxShapeLen && shape.node_types[len] != NULL)
+    {
+        shapes_type_hashes[shapes_count][len] = calcHashBytes(shape.node_types[len], strlen(shape.node_types[len]));
+        len++;
+    }
+    assert(len >= 2);
+
+    shapes_len[shapes_count] = len;
+    shapes[shapes_count++]   = shape;
+}
+
+static bool matchesAt(const tunnel_array_t *ta, uint16_t at, uint32_t shape_index)
+{
+    uint8_t len = shapes_len[shape_index];
+
+    if (at + len > ta->len)
+    {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < len; i++)
+    {
+        tunnel_t *t = ta->tuns[at + i];
+
+        if (tunnelGetNode(t)->hash_type != shapes_type_hashes[shape_index][i])
+        {
+            return false;
+        }
+        // the index order of branching nodes is not the flow order, so the binding is checked too
+        if (i + 1 < len && t->up != ta->tuns[at + i + 1])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void chainfusionApply(tunnel_chain_t *tc)
+{
+    tunnel_array_t *ta = &tc->tunnels;
+
+    for (uint16_t at = 0; at < ta->len; at++)
+    {
+        for (uint32_t si = 0; si < shapes_count; si++)
+        {
+            if (! matchesAt(ta, at, si))
+            {
+                continue;
+            }
+            tunnel_t *first        = ta->tuns[at];
+            first->fnPayloadU      = shapes[si].fnPayloadU;
+            first->fnPayloadBurstU = shapes[si].fnPayloadBurstU;
+
+            LOGD("ChainFusion: fused shape \"%s\" starting at node \"%s\"", shapes[si].name,
+                 tunnelGetNode(first)->name);
+
+            at += shapes_len[si] - 1;
+            break;
+        }
+    }
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include "wlibc.h"
+
+#include "tunnel.h"
+
+/*
+    Chain fusion
+
+    Every hop of a chain is an indirect call through tunnel_t::up, the compiler cannot inline across it even
+    though a chain never changes once it is indexed. For a few common fixed shapes (e.g. Layer3Receiver ->
+    Layer3IpOverrider -> Layer3Sender) the nodes expose their per packet work as static inline "steps", and a
+    fused routine calls the steps of the whole shape back to back, so the hops inline into one function.
+
+    A step has the form
+
+        static inline bool step(tunnel_t *t, line_t *line, sbuf_t *payload)
+
+    it returns false when the packet must be dropped (the fused routine recycles the buffer), the last element of
+    a shape is a sink that consumes the buffer
+
+        static inline void sink(tunnel_t *t, line_t *line, sbuf_t *payload)
+        static inline void sinkBurst(tunnel_t *t, line_t *line, sbuf_t **payloads, uint32_t count)
+
+    Shapes are compiled in only when listed in the WW_FUSED_CHAINS cmake option, they are registered at startup
+    and the node manager installs the fused routines on the first tunnel of every chain segment that matches a
+    shape (node types in order, each tunnel bound to the next one). Nothing changes for chains that do not match.
+
+    Steps must behave exactly like the fnPayloadU of their node, the fused routine replaces only fnPayloadU and
+    fnPayloadBurstU of the first tunnel, every other routine (and the unfused nodes) stay as they are.
+
+*/
+
+enum
+{
+    kChainFusionMaxShapes   = 16,
+    kChainFusionMaxShapeLen = 4
+};
+
+typedef struct chain_fusion_shape_s
+{
+    const char                   *name;
+    const char                   *node_types[kChainFusionMaxShapeLen]; // in upstream order, NULL terminated
+    TunnelFlowRoutinePayload      fnPayloadU;
+    TunnelFlowRoutinePayloadBurst fnPayloadBurstU;
+
+} chain_fusion_shape_t;
+
+/**
+ * Registers a fused shape, must be called before the nodes are chained.
+ * @param shape The shape, node_types must stay valid for the whole program (string literals).
+ */
+void chainfusionRegister(chain_fusion_shape_t shape);
+
+/**
+ * Installs the fused routines on every part of the chain that matches a registered shape.
+ * @param tc The chain, after its tunnels are indexed.
+ */
+void chainfusionApply(tunnel_chain_t *tc);
+
+/*
+    The fused routines of a shape, t0 is the first tunnel of the matched segment, the rest are reached through
+    up which never changes after chaining; dropped packets are squeezed out of the burst before the sink
+*/
+
+#define CHAINFUSION_DEFINE2(name, step0, sink1, sinkburst1)                                                          \
+    static void name##PayloadU(tunnel_t *t0, line_t *line, sbuf_t *payload)                                          \
+    {                                                                                                                \
+        tunnel_t *t1 = t0->up;                                                                                       \
+        if (! step0(t0, line, payload))                                                                              \
+        {                                                                                                            \
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);                                          \
+            return;                                                                                                  \
+        }                                                                                                            \
+        sink1(t1, line, payload);                                                                                    \
+    }                                                                                                                \
+    static void name##PayloadBurstU(tunnel_t *t0, line_t *line, sbuf_t **payloads, uint32_t count)                   \
+    {                                                                                                                \
+        tunnel_t *t1   = t0->up;                                                                                     \
+        uint32_t  kept = 0;                                                                                          \
+        for (uint32_t i = 0; i < count; i++)                                                                         \
+        {                                                                                                            \
+            if (! step0(t0, line, payloads[i]))                                                                      \
+            {                                                                                                        \
+                bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payloads[i]);                                  \
+                continue;                                                                                            \
+            }                                                                                                        \
+            payloads[kept++] = payloads[i];                                                                          \
+        }                                                                                                            \
+        if (kept > 0)                                                                                                \
+        {                                                                                                            \
+            sinkburst1(t1, line, payloads, kept);                                                                    \
+        }                                                                                                            \
+    }
+
+#define CHAINFUSION_DEFINE3(name, step0, step1, sink2, sinkburst2)                                                   \
+    static void name##PayloadU(tunnel_t *t0, line_t *line, sbuf_t *payload)                                          \
+    {                                                                                                                \
+        tunnel_t *t1 = t0->up;                                                                                       \
+        tunnel_t *t2 = t1->up;                                                                                       \
+        if (! step0(t0, line, payload) || ! step1(t1, line, payload))                                                \
+        {                                                                                                            \
+            bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);                                          \
+            return;                                                                                                  \
+        }                                                                                                            \
+        sink2(t2, line, payload);                                                                                    \
+    }                                                                                                                \
+    static void name##PayloadBurstU(tunnel_t *t0, line_t *line, sbuf_t **payloads, uint32_t count)                   \
+    {                                                                                                                \
+        tunnel_t *t1   = t0->up;                                                                                     \
+        tunnel_t *t2   = t1->up;                                                                                     \
+        uint32_t  kept = 0;                                                                                          \
+        for (uint32_t i = 0; i < count; i++)                                                                         \
+        {                                                                                                            \
+            if (! step0(t0, line, payloads[i]) || ! step1(t1, line, payloads[i]))                                    \
+            {                                                                                                        \
+                bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payloads[i]);                                  \
+                continue;                                                                                            \
+            }                                                                                                        \
+            payloads[kept++] = payloads[i];                                                                          \
+        }                                                                                                            \
+        if (kept > 0)                                                                                                \
+        {                                                                                                            \
+            sinkburst2(t2, line, payloads, kept);                                                                    \
+        }                                                                                                            \
+    }
+
+// the shape value for chainfusionRegister of a shape made by CHAINFUSION_DEFINEx(fused, ...)
+#define CHAINFUSION_SHAPE(fused, ...)                                                                                \
+    ((chain_fusion_shape_t) {.name            = #fused,                                                              \
+                             .node_types      = {__VA_ARGS__},                                                       \
+                             .fnPayloadU      = fused##PayloadU,                                                     \
+                             .fnPayloadBurstU = fused##PayloadBurstU})
@@ -2,6 +2,12 @@
 
 void contextApplyOnTunnelU(context_t *c, tunnel_t *t)
 {
+    if (c->payload != NULL)
+    {
+        t->fnPayloadU(t, c->line, c->payload);
+        return;
+    }
+
     if (c->init)
     {
         t->fnInitU(t, c->line);
@@ -35,6 +41,12 @@ void contextApplyOnTunnelU(context_t *c, tunnel_t *t)
 
 void contextApplyOnTunnelD(context_t *c, tunnel_t *t)
 {
+    if (c->payload != NULL)
+    {
+        t->fnPayloadD(t, c->line, c->payload);
+        return;
+    }
+
     if (c->init)
     {
         t->fnInitD(t, c->line);
@@ -57,6 +57,7 @@ static inline line_t *newLine(generic_pool_t *pool)
         .src_ctx  = (connection_context_t){.address.sa = (struct sockaddr){.sa_family = AF_INET, .sa_data = {0}}}};
 
     memorySet(&l->tunnels_line_state[0], 0, genericpoolGetItemSize(l->pool) - sizeof(line_t));
+    metricsInc(metricsmanagerGet()->lines_active);
 
     return l;
 }
@@ -92,6 +93,7 @@ static inline void lineUnRefInternal(line_t *const l)
         memoryFree(l->dest_ctx.domain);
     }
 
+    metricsDec(metricsmanagerGet()->lines_active);
     genericpoolReuseItem(l->pool, l);
 }
 
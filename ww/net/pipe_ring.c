@@ -0,0 +1,299 @@
+#include "pipe_ring.h"
+
+#include "buffer_pool.h"
+#include "global_state.h"
+
+typedef struct pipe_ring_s
+{
+    void *memptr;
+
+    // written by the consumer
+    atomic_uint head;
+    atomic_uint returns_tail;
+    atomic_bool wakeup_pending;
+    uint32_t    owed_buffers; // large buffers received from the producer, not returned yet
+    uint8_t     pad0[kCpuLineCacheSize];
+
+    // written by the producer
+    atomic_uint      tail;
+    atomic_uint      returns_head;
+    atomic_bool      producer_waiting;
+    bool             listed; // in the publish list of the producer
+    uint32_t         tail_local;
+    uint32_t         overflow_len;
+    uint32_t         overflow_cap;
+    pipe_ring_msg_t *overflow;
+    uint8_t          pad1[kCpuLineCacheSize];
+
+    pipe_ring_msg_t items[kPipeRingCap];
+    sbuf_t         *returns[kPipeRingReturnCap];
+
+} pipe_ring_t;
+
+typedef struct pipe_rings_s
+{
+    wid_t workers;
+    _Atomic(pipe_ring_t *) rings[]; // [from * workers + to]
+
+} pipe_rings_t;
+
+static pipe_rings_t *pipe_rings;
+
+// rings this worker wrote to since its last publish, and whether it owes a batch of buffers to another worker
+static thread_local wid_t    tl_publish_list[254];
+static thread_local uint32_t tl_publish_list_len;
+static thread_local bool     tl_owes_buffers;
+
+static pipe_ring_t *loadRing(wid_t from, wid_t to)
+{
+    return atomicLoadExplicit(&pipe_rings->rings[from * pipe_rings->workers + to], memory_order_acquire);
+}
+
+static pipe_ring_t *createRing(wid_t from, wid_t to)
+{
+    void        *memptr = memoryAllocate(sizeof(pipe_ring_t) + kCpuLineCacheSize);
+    pipe_ring_t *ring   = (pipe_ring_t *) ALIGN2((uintptr_t) memptr, kCpuLineCacheSize);
+
+    memorySet(ring, 0, sizeof(pipe_ring_t));
+    ring->memptr = memptr;
+
+    // only the producer creates its rings, the consumer sees the ring once its pointer is published
+    atomicStoreExplicit(&pipe_rings->rings[from * pipe_rings->workers + to], ring, memory_order_release);
+    return ring;
+}
+
+static uint32_t ringSpace(pipe_ring_t *ring)
+{
+    return kPipeRingCap - (ring->tail_local - atomicLoadExplicit(&ring->head, memory_order_acquire));
+}
+
+static void pushOverflow(pipe_ring_t *ring, pipe_ring_msg_t *msg)
+{
+    if (ring->overflow_len == ring->overflow_cap)
+    {
+        ring->overflow_cap = ring->overflow_cap == 0 ? kPipeRingCap : ring->overflow_cap * 2;
+        ring->overflow     = memoryReAllocate(ring->overflow, sizeof(pipe_ring_msg_t) * ring->overflow_cap);
+    }
+    ring->overflow[ring->overflow_len++] = *msg;
+}
+
+static void moveOverflow(pipe_ring_t *ring)
+{
+    if (ring->overflow_len == 0)
+    {
+        return;
+    }
+
+    uint32_t n = min(ringSpace(ring), ring->overflow_len);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        ring->items[ring->tail_local++ & (kPipeRingCap - 1)] = ring->overflow[i];
+    }
+    ring->overflow_len -= n;
+    if (ring->overflow_len > 0 && n > 0)
+    {
+        memoryMove(ring->overflow, ring->overflow + n, sizeof(pipe_ring_msg_t) * ring->overflow_len);
+    }
+}
+
+static void listRing(pipe_ring_t *ring, wid_t to)
+{
+    if (! ring->listed)
+    {
+        ring->listed                           = true;
+        tl_publish_list[tl_publish_list_len++] = to;
+    }
+}
+
+static void onRingsReady(wevent_t *ev);
+static void onProducerNudged(wevent_t *ev);
+
+static void postToWorker(wid_t wid, wevent_cb cb)
+{
+    wevent_t ev;
+    memorySet(&ev, 0, sizeof(ev));
+    ev.loop = getWorkerLoop(wid);
+    ev.cb   = cb;
+    wloopPostEvent(getWorkerLoop(wid), &ev);
+}
+
+static void publishRing(pipe_ring_t *ring, wid_t to)
+{
+    moveOverflow(ring);
+
+    if (ring->overflow_len > 0)
+    {
+        atomicStoreExplicit(&ring->producer_waiting, true, memory_order_seq_cst);
+        // the consumer may have made room before it could see the flag
+        moveOverflow(ring);
+    }
+
+    if (ring->tail_local != atomicLoadExplicit(&ring->tail, memory_order_relaxed))
+    {
+        atomicStoreExplicit(&ring->tail, ring->tail_local, memory_order_seq_cst);
+
+        // one wakeup per batch, none if the consumer is already going to drain
+        if (! atomicExchangeExplicit(&ring->wakeup_pending, true, memory_order_seq_cst))
+        {
+            postToWorker(to, onRingsReady);
+        }
+    }
+
+    // buffers the consumer sent back for the ones it received from us
+    buffer_pool_t *pool         = getWorkerBufferPool(getWID());
+    uint32_t       returns_head = atomicLoadExplicit(&ring->returns_head, memory_order_relaxed);
+    uint32_t       returns_tail = atomicLoadExplicit(&ring->returns_tail, memory_order_acquire);
+    if (returns_head != returns_tail)
+    {
+        for (; returns_head != returns_tail; returns_head++)
+        {
+            bufferpoolResuesBuffer(pool, ring->returns[returns_head & (kPipeRingReturnCap - 1)]);
+        }
+        atomicStoreExplicit(&ring->returns_head, returns_head, memory_order_release);
+    }
+
+    ring->listed = false;
+}
+
+static void returnBuffers(wid_t wid)
+{
+    buffer_pool_t *pool = getWorkerBufferPool(wid);
+
+    tl_owes_buffers = false;
+    for (wid_t from = 0; from < pipe_rings->workers; from++)
+    {
+        pipe_ring_t *ring = loadRing(from, wid);
+        if (ring == NULL || ring->owed_buffers < kPipeRingReturnBatch)
+        {
+            continue;
+        }
+
+        uint32_t returns_tail = atomicLoadExplicit(&ring->returns_tail, memory_order_relaxed);
+        uint32_t space =
+            kPipeRingReturnCap - (returns_tail - atomicLoadExplicit(&ring->returns_head, memory_order_acquire));
+        uint32_t n = min(space, ring->owed_buffers);
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            ring->returns[returns_tail++ & (kPipeRingReturnCap - 1)] = bufferpoolGetLargeBuffer(pool);
+        }
+        atomicStoreExplicit(&ring->returns_tail, returns_tail, memory_order_release);
+
+        ring->owed_buffers -= n;
+        // the lane was full, try again next iteration
+        tl_owes_buffers = tl_owes_buffers || ring->owed_buffers >= kPipeRingReturnBatch;
+    }
+}
+
+static void onLoopIteration(wloop_t *loop)
+{
+    (void) loop;
+
+    if (tl_publish_list_len > 0)
+    {
+        wid_t from = getWID();
+        for (uint32_t i = 0; i < tl_publish_list_len; i++)
+        {
+            wid_t to = tl_publish_list[i];
+            publishRing(loadRing(from, to), to);
+        }
+        tl_publish_list_len = 0;
+    }
+
+    if (tl_owes_buffers)
+    {
+        returnBuffers(getWID());
+    }
+}
+
+static void onRingsReady(wevent_t *ev)
+{
+    (void) ev;
+    wid_t wid = getWID();
+
+    for (wid_t from = 0; from < pipe_rings->workers; from++)
+    {
+        pipe_ring_t *ring = loadRing(from, wid);
+        if (ring == NULL || ! atomicLoadExplicit(&ring->wakeup_pending, memory_order_relaxed))
+        {
+            continue;
+        }
+        // cleared before reading tail, a batch published after this wakes us up again
+        atomicStoreExplicit(&ring->wakeup_pending, false, memory_order_seq_cst);
+
+        uint32_t head = atomicLoadExplicit(&ring->head, memory_order_relaxed);
+        uint32_t tail = atomicLoadExplicit(&ring->tail, memory_order_seq_cst);
+
+        for (; head != tail; head++)
+        {
+            pipe_ring_msg_t *msg = &ring->items[head & (kPipeRingCap - 1)];
+            if (msg->ctx.payload != NULL && bufferpoolCheckIskLargeBuffer(msg->ctx.payload))
+            {
+                ring->owed_buffers += 1;
+                tl_owes_buffers = tl_owes_buffers || ring->owed_buffers >= kPipeRingReturnBatch;
+            }
+            msg->handle(msg);
+        }
+        atomicStoreExplicit(&ring->head, head, memory_order_seq_cst);
+
+        if (atomicExchangeExplicit(&ring->producer_waiting, false, memory_order_seq_cst))
+        {
+            postToWorker(from, onProducerNudged);
+        }
+    }
+}
+
+static void onProducerNudged(wevent_t *ev)
+{
+    (void) ev;
+    wid_t wid = getWID();
+
+    // published again at the end of this iteration
+    for (wid_t to = 0; to < pipe_rings->workers; to++)
+    {
+        pipe_ring_t *ring = loadRing(wid, to);
+        if (ring != NULL && ring->overflow_len > 0)
+        {
+            listRing(ring, to);
+        }
+    }
+}
+
+void piperingsCreate(void)
+{
+    wid_t workers = getWorkersCount();
+
+    pipe_rings = memoryAllocate(sizeof(pipe_rings_t) + sizeof(_Atomic(pipe_ring_t *)) * workers * workers);
+    pipe_rings->workers = workers;
+    for (uint32_t i = 0; i < (uint32_t) workers * workers; i++)
+    {
+        atomicStoreExplicit(&pipe_rings->rings[i], NULL, memory_order_relaxed);
+    }
+
+    for (wid_t wid = 0; wid < workers; wid++)
+    {
+        wloopSetIterationCallBack(getWorkerLoop(wid), onLoopIteration);
+    }
+}
+
+void piperingsSend(wid_t wid_to, pipe_ring_msg_t msg)
+{
+    wid_t        wid_from = getWID();
+    pipe_ring_t *ring     = loadRing(wid_from, wid_to);
+
+    if (UNLIKELY(ring == NULL))
+    {
+        ring = createRing(wid_from, wid_to);
+    }
+
+    if (ring->overflow_len == 0 && ringSpace(ring) > 0)
+    {
+        ring->items[ring->tail_local++ & (kPipeRingCap - 1)] = msg;
+    }
+    else
+    {
+        pushOverflow(ring, &msg);
+    }
+
+    listRing(ring, wid_to);
+}
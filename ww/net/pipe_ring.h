@@ -0,0 +1,58 @@
+#pragma once
+#include "wlibc.h"
+
+#include "context.h"
+#include "tunnel.h"
+#include "worker.h"
+
+/*
+    Pipe rings
+
+    The cross worker messages of pipe tunnels (pipe_tunnel.h) go through a matrix of single producer / single
+    consumer rings, ring [from][to] is written only by worker "from" and read only by worker "to", neither side
+    takes a lock or allocates.
+
+    A message is written into the ring when it is sent, but the ring is published once per loop iteration (the
+    iteration callback of the loop) with one wakeup of the destination for the whole batch; a destination that
+    is already woken up and has not drained yet is not woken up again.
+
+    When a ring is full the rest of the batch waits in order on the producer side, the consumer nudges the
+    producer once it made room.
+
+    Payload buffers travel with the messages from the pool of one worker into the pool of the other. The
+    receiver counts them and sends the same number of buffers back through the return lane of the ring in
+    batches, the origin puts them back into its pool when it publishes, so the pools do not drift apart.
+
+*/
+
+enum
+{
+    kPipeRingCap         = 256, // power of 2
+    kPipeRingReturnCap   = 64,  // power of 2
+    kPipeRingReturnBatch = 16
+};
+
+typedef struct pipe_ring_msg_s pipe_ring_msg_t;
+
+typedef void (*PipeRingMsgHandle)(pipe_ring_msg_t *msg);
+
+struct pipe_ring_msg_s
+{
+    PipeRingMsgHandle handle; // called on the destination worker
+    tunnel_t         *tunnel;
+    context_t         ctx;
+};
+
+/**
+ * Creates the ring matrix and installs the iteration callback on every worker loop, called once after the
+ * workers are created.
+ */
+void piperingsCreate(void);
+
+/**
+ * Queues a message for another worker, must be called on a worker thread. The message is delivered in order
+ * with the other messages of this worker to the same destination.
+ * @param wid_to The destination worker.
+ * @param msg The message, copied into the ring.
+ */
+void piperingsSend(wid_t wid_to, pipe_ring_msg_t msg);
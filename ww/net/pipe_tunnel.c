@@ -1,39 +1,30 @@
 #include "pipe_tunnel.h"
 #include "context.h"
-#include "generic_pool.h"
 #include "loggers/internal_logger.h"
 #include "managers/node_manager.h"
+#include "pipe_ring.h"
 #include "tunnel.h"
-#include "loggers/internal_logger.h"
 
+/*
+    A piped line has a left side (the worker that owns the line, where the previous tunnel runs) and a right side
+    (the worker the child runs on). Each open side holds one reference and so does every message in flight, the
+    line itself is locked on the left worker until the last reference is gone, so a side that already closed can
+    never see it freed under a message that is still on its way.
+*/
 typedef struct pipetunnel_line_state_s
 {
-    atomic_int    refc;
-    atomic_bool   closed;
+    atomic_int     refc;
     _Atomic(wid_t) left_wid;
     _Atomic(wid_t) right_wid;
-    bool          active;
-    bool          left_open;
-    bool          right_open;
+    bool           active;
+    bool           left_open;  // only touched on the left worker
+    bool           right_open; // only touched on the right worker
 
 } pipetunnel_line_state_t;
 
-typedef struct pipetunnel_msg_event_s
-{
-    tunnel_t *tunnel;
-    context_t ctx;
-
-} pipetunnel_msg_event_t;
-
-size_t pipeLineGetMesageSize(void)
-{
-    return sizeof(pipetunnel_msg_event_t);
-}
-
 static void initializeLineState(pipetunnel_line_state_t *ls, wid_t wid_to)
 {
-    atomicStoreExplicit(&ls->refc, 0, memory_order_relaxed);
-    atomicStoreExplicit(&ls->closed, false, memory_order_relaxed);
+    atomicStoreExplicit(&ls->refc, 2, memory_order_relaxed);
     atomicStoreExplicit(&ls->left_wid, getWID(), memory_order_relaxed);
     atomicStoreExplicit(&ls->right_wid, wid_to, memory_order_relaxed);
     ls->active     = true;
@@ -44,7 +35,6 @@ static void initializeLineState(pipetunnel_line_state_t *ls, wid_t wid_to)
 static void deinitializeLineState(pipetunnel_line_state_t *ls)
 {
     atomicStoreExplicit(&ls->refc, 0, memory_order_relaxed);
-    atomicStoreExplicit(&ls->closed, false, memory_order_relaxed);
     atomicStoreExplicit(&ls->left_wid, 0, memory_order_relaxed);
     atomicStoreExplicit(&ls->right_wid, 0, memory_order_relaxed);
     ls->active     = false;
@@ -52,116 +42,120 @@ static void deinitializeLineState(pipetunnel_line_state_t *ls)
     ls->right_open = false;
 }
 
+static void onMsgReceivedUp(pipe_ring_msg_t *msg);
+static void onMsgReceivedDown(pipe_ring_msg_t *msg);
+
+static void onMsgRelease(pipe_ring_msg_t *msg)
+{
+    deinitializeLineState((pipetunnel_line_state_t *) lineGetState(msg->tunnel, msg->ctx.line));
+    lineUnlock(msg->ctx.line);
+}
+
 static void lock(pipetunnel_line_state_t *ls)
 {
     int old_refc = atomicAddExplicit(&ls->refc, 1, memory_order_relaxed);
 
     (void) old_refc;
+    assert(old_refc > 0);
 }
 
-static void unlock(pipetunnel_line_state_t *ls)
+// the last reference releases the line on its own worker
+static void unlock(tunnel_t *t, line_t *l, pipetunnel_line_state_t *ls)
 {
-    int old_refc = atomicAddExplicit(&ls->refc, -1, memory_order_relaxed);
-    if (old_refc == 1)
+    int old_refc = atomicAddExplicit(&ls->refc, -1, memory_order_acq_rel);
+    if (old_refc != 1)
+    {
+        return;
+    }
+
+    wid_t left_wid = atomicLoadRelaxed(&ls->left_wid);
+    if (left_wid == getWID())
     {
         deinitializeLineState(ls);
+        lineUnlock(l);
+        return;
     }
+    piperingsSend(left_wid, (pipe_ring_msg_t) {.handle = onMsgRelease, .tunnel = t, .ctx = {.line = l}});
 }
 
-static void sendMessageUp(pipetunnel_line_state_t *ls, pipetunnel_msg_event_t *msg, wid_t wid_to);
-static void sendMessageDown(pipetunnel_line_state_t *ls, pipetunnel_msg_event_t *msg, wid_t wid_to);
+// cross worker messages go through the pipe rings (pipe_ring.h), they are delivered in order per worker pair
+static void sendMessageUp(pipetunnel_line_state_t *ls, tunnel_t *t, context_t ctx, wid_t wid_to)
+{
+    lock(ls);
+    piperingsSend(wid_to, (pipe_ring_msg_t) {.handle = onMsgReceivedUp, .tunnel = t, .ctx = ctx});
+}
 
-static void onMsgReceivedUp(wevent_t *ev)
+static void sendMessageDown(pipetunnel_line_state_t *ls, tunnel_t *t, context_t ctx, wid_t wid_to)
 {
-    pipetunnel_msg_event_t  *msg_ev = weventGetUserdata(ev);
-    tunnel_t                *t      = msg_ev->tunnel;
-    line_t                  *l      = msg_ev->ctx.line;
-    wid_t                    tid    = wloopGetWID(weventGetLoop(ev));
+    lock(ls);
+    piperingsSend(wid_to, (pipe_ring_msg_t) {.handle = onMsgReceivedDown, .tunnel = t, .ctx = ctx});
+}
+
+static void onMsgReceivedUp(pipe_ring_msg_t *msg)
+{
+    tunnel_t                *t      = msg->tunnel;
+    line_t                  *l      = msg->ctx.line;
     pipetunnel_line_state_t *lstate = (pipetunnel_line_state_t *) lineGetState(t, l);
 
     if (atomicLoadRelaxed(&(lstate->right_wid)) != getWID())
     {
-        sendMessageUp(lstate, msg_ev, atomicLoadRelaxed(&(lstate->right_wid)));
-        unlock(lstate);
+        sendMessageUp(lstate, t, msg->ctx, atomicLoadRelaxed(&(lstate->right_wid)));
+        unlock(t, l, lstate);
         return;
     }
 
     if (! lstate->right_open)
     {
-        if (msg_ev->ctx.payload != NULL)
+        if (msg->ctx.payload != NULL)
         {
-            contextReusePayload(&msg_ev->ctx);
+            contextReusePayload(&msg->ctx);
         }
     }
+    else if (msg->ctx.fin)
+    {
+        lstate->right_open = false;
+        contextApplyOnTunnelU(&msg->ctx, (tunnel_t *) tunnelGetState(t));
+        unlock(t, l, lstate);
+    }
     else
     {
-        contextApplyOnTunnelU(&msg_ev->ctx, (tunnel_t *) tunnelGetState(t));
+        contextApplyOnTunnelU(&msg->ctx, (tunnel_t *) tunnelGetState(t));
     }
-    genericpoolReuseItem(getWorkerPipeTunnelMsgPool(tid), msg_ev);
-    unlock(lstate);
+    unlock(t, l, lstate);
 }
 
-static void sendMessageUp(pipetunnel_line_state_t *ls, pipetunnel_msg_event_t *msg, wid_t wid_to)
+static void onMsgReceivedDown(pipe_ring_msg_t *msg)
 {
-
-    lock(ls);
-    // struct msg_event *evdata = genericpoolGetItem(getWorkerPipeTunnelMsgPool(wid_from));
-    // *evdata = (struct msg_event){.ls = ls, .function = *(void **) (&fn), .arg = arg, .target_tid = wid_to};
-
-    wevent_t ev;
-    memorySet(&ev, 0, sizeof(ev));
-    ev.loop = getWorkerLoop(wid_to);
-    ev.cb   = onMsgReceivedUp;
-    weventSetUserData(&ev, msg);
-    wloopPostEvent(getWorkerLoop(wid_to), &ev);
-}
-
-static void onMsgReceivedDown(wevent_t *ev)
-{
-    pipetunnel_msg_event_t  *msg_ev = weventGetUserdata(ev);
-    tunnel_t                *t      = msg_ev->tunnel;
-    line_t                  *l      = msg_ev->ctx.line;
-    wid_t                    tid    = wloopGetWID(weventGetLoop(ev));
+    tunnel_t                *t      = msg->tunnel;
+    line_t                  *l      = msg->ctx.line;
     pipetunnel_line_state_t *lstate = (pipetunnel_line_state_t *) lineGetState(t, l);
 
-    if (atomicLoadRelaxed(&(lstate->left_wid)) != getWID())
-    {
-        sendMessageDown(lstate, msg_ev, atomicLoadRelaxed(&(lstate->left_wid)));
-        unlock(lstate);
-        return;
-    }
-
     if (! lstate->left_open)
     {
-        if (msg_ev->ctx.payload != NULL)
+        if (msg->ctx.payload != NULL)
         {
-            contextReusePayload(&msg_ev->ctx);
+            contextReusePayload(&msg->ctx);
         }
     }
+    else if (msg->ctx.fin)
+    {
+        lstate->left_open = false;
+        contextApplyOnTunnelD(&msg->ctx, t->dw);
+        unlock(t, l, lstate);
+    }
     else
     {
-        contextApplyOnTunnelD(&msg_ev->ctx, t->dw);
+        contextApplyOnTunnelD(&msg->ctx, t->dw);
     }
-    genericpoolReuseItem(getWorkerPipeTunnelMsgPool(tid), msg_ev);
-    unlock(lstate);
+    unlock(t, l, lstate);
 }
 
-static void sendMessageDown(pipetunnel_line_state_t *ls, pipetunnel_msg_event_t *msg, wid_t wid_to)
-{
-
-    lock(ls);
-
-    wevent_t ev;
-    memorySet(&ev, 0, sizeof(ev));
-    ev.loop = getWorkerLoop(wid_to);
-    ev.cb   = onMsgReceivedUp;
-    weventSetUserData(&ev, msg);
-    wloopPostEvent(getWorkerLoop(wid_to), &ev);
-}
+/*
+    Upstream, runs on the left worker
+*/
 
 void pipetunnelDefaultUpStreamInit(tunnel_t *self, line_t *line)
 {
-
     pipetunnel_line_state_t *lstate = (pipetunnel_line_state_t *) lineGetState(self, line);
     tunnel_t                *child  = tunnelGetState(self);
 
@@ -171,17 +165,13 @@ void pipetunnelDefaultUpStreamInit(tunnel_t *self, line_t *line)
         return;
     }
 
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->left_open)
     {
         return;
     }
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .init = true};
+    context_t ctx = {.line = line, .init = true};
 
-    msg->tunnel = self;
-    msg->ctx    = ctx;
-
-    sendMessageUp(lstate, msg, lstate->right_wid);
+    sendMessageUp(lstate, self, ctx, atomicLoadRelaxed(&lstate->right_wid));
 }
 
 void pipetunnelDefaultUpStreamEst(tunnel_t *self, line_t *line)
@@ -195,17 +185,13 @@ void pipetunnelDefaultUpStreamEst(tunnel_t *self, line_t *line)
         return;
     }
 
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->left_open)
     {
         return;
     }
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .est = true};
-
-    msg->tunnel = self;
-    msg->ctx    = ctx;
+    context_t ctx = {.line = line, .est = true};
 
-    sendMessageUp(lstate, msg, lstate->right_wid);
+    sendMessageUp(lstate, self, ctx, atomicLoadRelaxed(&lstate->right_wid));
 }
 
 void pipetunnelDefaultUpStreamFin(tunnel_t *self, line_t *line)
@@ -219,21 +205,16 @@ void pipetunnelDefaultUpStreamFin(tunnel_t *self, line_t *line)
         return;
     }
 
-    lstate->left_open = false;
-
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->left_open)
     {
         return;
     }
+    lstate->left_open = false;
 
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .fin = true};
-
-    msg->tunnel = self;
-    msg->ctx    = ctx;
+    context_t ctx = {.line = line, .fin = true};
 
-    sendMessageUp(lstate, msg, lstate->right_wid);
-    unlock(lstate);
+    sendMessageUp(lstate, self, ctx, atomicLoadRelaxed(&lstate->right_wid));
+    unlock(self, line, lstate);
 }
 
 void pipetunnelDefaultUpStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
@@ -247,18 +228,14 @@ void pipetunnelDefaultUpStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payl
         return;
     }
 
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->left_open)
     {
         bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
         return;
     }
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .payload = payload};
+    context_t ctx = {.line = line, .payload = payload};
 
-    msg->tunnel = self;
-    msg->ctx    = ctx;
-
-    sendMessageUp(lstate, msg, lstate->right_wid);
+    sendMessageUp(lstate, self, ctx, atomicLoadRelaxed(&lstate->right_wid));
 }
 
 void pipetunnelDefaultUpStreamPause(tunnel_t *self, line_t *line)
@@ -272,22 +249,17 @@ void pipetunnelDefaultUpStreamPause(tunnel_t *self, line_t *line)
         return;
     }
 
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->left_open)
     {
         return;
     }
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .pause = true};
-
-    msg->tunnel = self;
-    msg->ctx    = ctx;
+    context_t ctx = {.line = line, .pause = true};
 
-    sendMessageUp(lstate, msg, lstate->right_wid);
+    sendMessageUp(lstate, self, ctx, atomicLoadRelaxed(&lstate->right_wid));
 }
 
 void pipetunnelDefaultUpStreamResume(tunnel_t *self, line_t *line)
 {
-
     pipetunnel_line_state_t *lstate = (pipetunnel_line_state_t *) lineGetState(self, line);
     tunnel_t                *child  = tunnelGetState(self);
 
@@ -297,151 +269,127 @@ void pipetunnelDefaultUpStreamResume(tunnel_t *self, line_t *line)
         return;
     }
 
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->left_open)
     {
         return;
     }
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .resume = true};
-
-    msg->tunnel = self;
-    msg->ctx    = ctx;
+    context_t ctx = {.line = line, .resume = true};
 
-    sendMessageUp(lstate, msg, lstate->right_wid);
+    sendMessageUp(lstate, self, ctx, atomicLoadRelaxed(&lstate->right_wid));
 }
 
 /*
-    Downstream
+    Downstream, called by the child on the right worker, lines that are not piped go straight to the previous
+    tunnel
 */
 
 void pipetunnelDefaultdownStreamInit(tunnel_t *self, line_t *line)
 {
-    (void) self;
-    (void) line;
-    assert(false); // unreachable code
+    pipetunnel_line_state_t *lstate = (pipetunnel_line_state_t *) lineGetState(self, line);
+
+    assert(! lstate->active); // a piped line is never initiated from the right side
+    (void) lstate;
+    self->dw->fnInitD(self->dw, line);
 }
 
 void pipetunnelDefaultdownStreamEst(tunnel_t *self, line_t *line)
 {
     pipetunnel_line_state_t *lstate = (pipetunnel_line_state_t *) lineGetState(self, line);
-    tunnel_t                *child  = tunnelGetState(self);
 
     if (! lstate->active)
     {
-        child->fnEstD(child, line);
+        self->dw->fnEstD(self->dw, line);
         return;
     }
 
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->right_open)
     {
         return;
     }
 
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .est = true};
-
-    msg->tunnel = self;
-    msg->ctx    = ctx;
+    context_t ctx = {.line = line, .est = true};
 
-    sendMessageDown(lstate, msg, lstate->left_wid);
+    sendMessageDown(lstate, self, ctx, atomicLoadRelaxed(&lstate->left_wid));
 }
 
 void pipetunnelDefaultdownStreamFin(tunnel_t *self, line_t *line)
 {
     pipetunnel_line_state_t *lstate = (pipetunnel_line_state_t *) lineGetState(self, line);
-    tunnel_t                *child  = tunnelGetState(self);
 
     if (! lstate->active)
     {
-        child->fnFinD(child, line);
+        self->dw->fnFinD(self->dw, line);
         return;
     }
 
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->right_open)
     {
         return;
     }
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .fin = true};
+    lstate->right_open = false;
 
-    msg->tunnel = self;
-    msg->ctx    = ctx;
+    context_t ctx = {.line = line, .fin = true};
 
-    sendMessageDown(lstate, msg, lstate->left_wid);
-    unlock(lstate);
+    sendMessageDown(lstate, self, ctx, atomicLoadRelaxed(&lstate->left_wid));
+    unlock(self, line, lstate);
 }
 
 void pipetunnelDefaultdownStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
     pipetunnel_line_state_t *lstate = (pipetunnel_line_state_t *) lineGetState(self, line);
-    tunnel_t                *child  = tunnelGetState(self);
 
     if (! lstate->active)
     {
-        child->fnPayloadD(child, line, payload);
+        self->dw->fnPayloadD(self->dw, line, payload);
         return;
     }
 
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->right_open)
     {
         bufferpoolResuesBuffer(getWorkerBufferPool(getWID()), payload);
         return;
     }
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .payload = payload};
-
-    msg->tunnel = self;
-    msg->ctx    = ctx;
+    context_t ctx = {.line = line, .payload = payload};
 
-    sendMessageDown(lstate, msg, lstate->left_wid);
+    sendMessageDown(lstate, self, ctx, atomicLoadRelaxed(&lstate->left_wid));
 }
 
 void pipetunnelDefaultDownStreamPause(tunnel_t *self, line_t *line)
 {
     pipetunnel_line_state_t *lstate = (pipetunnel_line_state_t *) lineGetState(self, line);
-    tunnel_t                *child  = tunnelGetState(self);
 
     if (! lstate->active)
     {
-        child->fnPauseD(child, line);
+        self->dw->fnPauseD(self->dw, line);
         return;
     }
 
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->right_open)
     {
         return;
     }
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .pause = true};
-
-    msg->tunnel = self;
-    msg->ctx    = ctx;
+    context_t ctx = {.line = line, .pause = true};
 
-    sendMessageDown(lstate, msg, lstate->left_wid);
+    sendMessageDown(lstate, self, ctx, atomicLoadRelaxed(&lstate->left_wid));
 }
 
 void pipetunnelDefaultDownStreamResume(tunnel_t *self, line_t *line)
 {
     pipetunnel_line_state_t *lstate = (pipetunnel_line_state_t *) lineGetState(self, line);
-    tunnel_t                *child  = tunnelGetState(self);
 
     if (! lstate->active)
     {
-        child->fnResumeD(child, line);
+        self->dw->fnResumeD(self->dw, line);
         return;
     }
 
-    if (atomicLoadExplicit(&lstate->closed, memory_order_relaxed))
+    if (! lstate->right_open)
     {
         return;
     }
-    pipetunnel_msg_event_t *msg = genericpoolGetItem(getWorkerPipeTunnelMsgPool(getWID()));
-    context_t               ctx = {.line = line, .resume = true};
-
-    msg->tunnel = self;
-    msg->ctx    = ctx;
+    context_t ctx = {.line = line, .resume = true};
 
-    sendMessageDown(lstate, msg, lstate->left_wid);
+    sendMessageDown(lstate, self, ctx, atomicLoadRelaxed(&lstate->left_wid));
 }
 
 void pipetunnelDefaultOnChain(tunnel_t *t, tunnel_chain_t *tc)
@@ -470,7 +418,7 @@ void pipetunnelDefaultOnIndex(tunnel_t *t, tunnel_array_t *arr, uint16_t *index,
 void pipetunnelDefaultOnPrepair(tunnel_t *t)
 {
     tunnel_t *child = tunnelGetState(t);
-    child->onStart(child);
+    child->onPrepair(child);
 }
 
 void pipetunnelDefaultOnStart(tunnel_t *t)
@@ -517,16 +465,23 @@ void pipetunnelDestroy(tunnel_t *t)
     tunnelDestroy(t);
 }
 
+static tunnel_t *getPipeTunnel(tunnel_t *child)
+{
+    // the child lives in the state of its pipe tunnel (pipetunnelCreate)
+    return (tunnel_t *) (((uint8_t *) child) - sizeof(tunnel_t));
+}
+
 void pipeTo(tunnel_t *t, line_t *l, wid_t wid_to)
 {
-    tunnel_t                *master = (tunnel_t *) (((uint8_t *) t) - sizeof(tunnel_t));
+    tunnel_t                *master = getPipeTunnel(t);
     pipetunnel_line_state_t *ls     = (pipetunnel_line_state_t *) lineGetState(master, l);
 
     if (ls->active)
     {
         LOGW("double pipe (beta)");
-        
-        if (atomicLoadExplicit(&ls->closed, memory_order_relaxed))
+
+        // called on the current right worker, the right side moves on
+        if (! ls->right_open)
         {
             return;
         }
@@ -535,6 +490,18 @@ void pipeTo(tunnel_t *t, line_t *l, wid_t wid_to)
     else
     {
         initializeLineState(ls, wid_to);
+        lineLock(l);
     }
-    t->fnInitU(t, l);
+    sendMessageUp(ls, master, (context_t) {.line = l, .init = true}, wid_to);
+}
+
+bool pipeIsPiped(tunnel_t *t, line_t *l)
+{
+    return ((pipetunnel_line_state_t *) lineGetState(getPipeTunnel(t), l))->active;
+}
+
+void pipeUpStreamPayload(tunnel_t *t, line_t *l, sbuf_t *payload)
+{
+    tunnel_t *master = getPipeTunnel(t);
+    master->fnPayloadU(master, l, payload);
 }
@@ -5,8 +5,6 @@
 
 
 
-size_t pipeLineGetMesageSize(void);
-
 void pipetunnelDefaultUpStreamInit(tunnel_t *self, line_t *line);
 void pipetunnelDefaultUpStreamEst(tunnel_t *self, line_t *line);
 void pipetunnelDefaultUpStreamFin(tunnel_t *self, line_t *line);
@@ -27,4 +25,10 @@ void pipetunnelDefaultOnStart(tunnel_t *t);
 tunnel_t *pipetunnelCreate(tunnel_t *child);
 void      pipetunnelDestroy(tunnel_t *t);
 
-void pipeTo(tunnel_t *t, line_t* l,wid_t wid_to);
+/*
+    pipeTo moves the rest of a line to another worker, t is the child of a pipe tunnel and the call is made on the
+    worker that currently runs the child for this line, the child then receives an init for the line on wid_to
+*/
+void pipeTo(tunnel_t *t, line_t *l, wid_t wid_to);
+bool pipeIsPiped(tunnel_t *t, line_t *l);
+void pipeUpStreamPayload(tunnel_t *t, line_t *l, sbuf_t *payload);
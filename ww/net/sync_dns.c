@@ -37,3 +37,74 @@ bool resolveContextSync(connection_context_t *sctx)
     sctx->domain_resolved = true;
     return true;
 }
+
+int resolveContextSyncAll(const connection_context_t *sctx, sockaddr_u *addrs, int max)
+{
+    assert(sctx->address_type == kSatDomainName && sctx->domain != NULL && max > 0);
+
+    struct addrinfo hints;
+    memorySet(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (sctx->domain_strategy == kDsOnlyIpV4)
+    {
+        hints.ai_family = AF_INET;
+    }
+    else if (sctx->domain_strategy == kDsOnlyIpV6)
+    {
+        hints.ai_family = AF_INET6;
+    }
+
+    struct addrinfo *ais = NULL;
+    int              ret = getaddrinfo(sctx->domain, NULL, &hints, &ais);
+    if (ret != 0 || ais == NULL)
+    {
+        LOGE("SyncDns: resolve failed  %s", sctx->domain);
+        return 0;
+    }
+
+    int first_family = ais->ai_family;
+    if (sctx->domain_strategy == kDsPreferIpV4)
+    {
+        first_family = AF_INET;
+    }
+    else if (sctx->domain_strategy == kDsPreferIpV6)
+    {
+        first_family = AF_INET6;
+    }
+
+    // pick from the two families in turn, each cursor walks the list to the next answer of its own family
+    const uint16_t   port        = sockaddrPort((sockaddr_u *) &(sctx->address));
+    struct addrinfo *cursors[2]  = {ais, ais};
+    const int        families[2] = {first_family, first_family == AF_INET ? AF_INET6 : AF_INET};
+    int              count       = 0;
+
+    for (int turn = 0; count < max && (cursors[0] != NULL || cursors[1] != NULL); turn ^= 1)
+    {
+        struct addrinfo *ai = cursors[turn];
+        while (ai != NULL && (ai->ai_family != families[turn] || ai->ai_addrlen > sizeof(sockaddr_u)))
+        {
+            ai = ai->ai_next;
+        }
+        if (ai == NULL)
+        {
+            cursors[turn] = NULL;
+            continue;
+        }
+        cursors[turn] = ai->ai_next;
+
+        memorySet(&addrs[count], 0, sizeof(sockaddr_u));
+        memoryCopy(&addrs[count], ai->ai_addr, ai->ai_addrlen);
+        sockaddrSetPort(&addrs[count], port);
+        count++;
+    }
+    freeaddrinfo(ais);
+
+    if (count > 0 && loggerCheckWriteLevel(getDnsLogger(), (log_level_e) LOG_LEVEL_INFO))
+    {
+        char ip[64];
+        sockaddrStr(&addrs[0], ip, 64);
+        LOGI("SyncDns: %s resolved to %d addresses, first %s", sctx->domain, count, ip);
+    }
+    return count;
+}
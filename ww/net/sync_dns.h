@@ -5,3 +5,15 @@
 // TODO (internal cache , prefer v4/6)
 bool resolveContextSync(connection_context_t *s_ctx);
 
+/*
+    Resolves every address of the domain (A and AAAA, one getaddrinfo call for both families) and orders them for
+    connection racing as RFC 8305 section 4 asks: the resolver order (RFC 6724) is kept inside a family and the
+    families are interleaved, starting with the preferred one. s_ctx->domain_strategy picks the preferred family or
+    filters one out; when it is not set the family of the resolver's first answer goes first.
+
+    The port of s_ctx is set on every address. s_ctx itself is not touched.
+
+    returns the number of addresses written, 0 when resolving failed
+*/
+int resolveContextSyncAll(const connection_context_t *s_ctx, sockaddr_u *addrs, int max);
+
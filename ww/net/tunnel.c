@@ -51,6 +51,20 @@ void tunnelDefaultUpStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
     self->up->fnPayloadU(self->up, line, payload);
 }
 
+void tunnelDefaultUpStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
+{
+    if (self->fnPayloadU == &tunnelDefaultUpStreamPayload)
+    {
+        assert(self->up != NULL);
+        self->up->fnPayloadBurstU(self->up, line, payloads, count);
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        self->fnPayloadU(self, line, payloads[i]);
+    }
+}
+
 void tunnelDefaultUpStreamPause(tunnel_t *self, line_t *line)
 {
     assert(self->up != NULL);
@@ -66,37 +80,51 @@ void tunnelDefaultUpStreamResume(tunnel_t *self, line_t *line)
 void tunnelDefaultdownStreamInit(tunnel_t *self, line_t *line)
 {
     assert(self->dw != NULL);
-    self->up->fnInitD(self->up, line);
+    self->dw->fnInitD(self->dw, line);
 }
 
 void tunnelDefaultdownStreamEst(tunnel_t *self, line_t *line)
 {
     assert(self->dw != NULL);
-    self->up->fnEstD(self->up, line);
+    self->dw->fnEstD(self->dw, line);
 }
 
 void tunnelDefaultdownStreamFin(tunnel_t *self, line_t *line)
 {
     assert(self->dw != NULL);
-    self->up->fnFinD(self->up, line);
+    self->dw->fnFinD(self->dw, line);
 }
 
 void tunnelDefaultdownStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload)
 {
     assert(self->dw != NULL);
-    self->up->fnPayloadD(self->up, line, payload);
+    self->dw->fnPayloadD(self->dw, line, payload);
+}
+
+void tunnelDefaultdownStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count)
+{
+    if (self->fnPayloadD == &tunnelDefaultdownStreamPayload)
+    {
+        assert(self->dw != NULL);
+        self->dw->fnPayloadBurstD(self->dw, line, payloads, count);
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        self->fnPayloadD(self, line, payloads[i]);
+    }
 }
 
 void tunnelDefaultDownStreamPause(tunnel_t *self, line_t *line)
 {
     assert(self->dw != NULL);
-    self->up->fnPauseD(self->up, line);
+    self->dw->fnPauseD(self->dw, line);
 }
 
 void tunnelDefaultDownStreamResume(tunnel_t *self, line_t *line)
 {
     assert(self->dw != NULL);
-    self->up->fnResumeD(self->up, line);
+    self->dw->fnResumeD(self->dw, line);
 }
 
 void tunnelDefaultOnChain(tunnel_t *t, tunnel_chain_t *tc)
@@ -170,25 +198,27 @@ tunnel_t *tunnelCreate(node_t *node, uint16_t tstate_size, uint16_t lstate_size)
     memorySet(ptr, 0, tsize);
 
     *ptr = (tunnel_t){
-                      .fnInitU     = &tunnelDefaultUpStreamInit,
-                      .fnInitD     = &tunnelDefaultdownStreamInit,
-                      .fnPayloadU  = &tunnelDefaultUpStreamPayload,
-                      .fnPayloadD  = &tunnelDefaultdownStreamPayload,
-                      .fnEstU      = &tunnelDefaultUpStreamEst,
-                      .fnEstD      = &tunnelDefaultdownStreamEst,
-                      .fnFinU      = &tunnelDefaultUpStreamFin,
-                      .fnFinD      = &tunnelDefaultdownStreamFin,
-                      .fnPauseU    = &tunnelDefaultUpStreamPause,
-                      .fnPauseD    = &tunnelDefaultDownStreamPause,
-                      .fnResumeU   = &tunnelDefaultUpStreamResume,
-                      .fnResumeD   = &tunnelDefaultDownStreamResume,
-                      .onChain     = &tunnelDefaultOnChain,
-                      .onIndex     = &tunnelDefaultOnIndex,
-                      .onPrepair   = &tunnelDefaultOnPrepair,
-                      .onStart     = &tunnelDefaultOnStart,
-                      .tstate_size = tstate_size,
-                      .lstate_size = lstate_size,
-                      .node        = node};
+                      .fnInitU         = &tunnelDefaultUpStreamInit,
+                      .fnInitD         = &tunnelDefaultdownStreamInit,
+                      .fnPayloadU      = &tunnelDefaultUpStreamPayload,
+                      .fnPayloadD      = &tunnelDefaultdownStreamPayload,
+                      .fnPayloadBurstU = &tunnelDefaultUpStreamPayloadBurst,
+                      .fnPayloadBurstD = &tunnelDefaultdownStreamPayloadBurst,
+                      .fnEstU          = &tunnelDefaultUpStreamEst,
+                      .fnEstD          = &tunnelDefaultdownStreamEst,
+                      .fnFinU          = &tunnelDefaultUpStreamFin,
+                      .fnFinD          = &tunnelDefaultdownStreamFin,
+                      .fnPauseU        = &tunnelDefaultUpStreamPause,
+                      .fnPauseD        = &tunnelDefaultDownStreamPause,
+                      .fnResumeU       = &tunnelDefaultUpStreamResume,
+                      .fnResumeD       = &tunnelDefaultDownStreamResume,
+                      .onChain         = &tunnelDefaultOnChain,
+                      .onIndex         = &tunnelDefaultOnIndex,
+                      .onPrepair       = &tunnelDefaultOnPrepair,
+                      .onStart         = &tunnelDefaultOnStart,
+                      .tstate_size     = tstate_size,
+                      .lstate_size     = lstate_size,
+                      .node            = node};
 
     return ptr;
 }
@@ -3,9 +3,11 @@
 #include "chain.h"
 #include "connection_context.h"
 #include "generic_pool.h"
+#include "managers/metrics_manager.h"
 #include "shiftbuffer.h"
 #include "wlibc.h"
 #include "wloop.h"
+#include "wloop_stats.h"
 #include "worker.h"
 
 
@@ -48,6 +50,7 @@ typedef void (*TunnelChainFn)(tunnel_t *, tunnel_chain_t *info);
 typedef void (*TunnelIndexFn)(tunnel_t *, tunnel_array_t *arr, uint16_t *index, uint16_t *mem_offset);
 typedef void (*TunnelFlowRoutineInit)(tunnel_t *, line_t *line);
 typedef void (*TunnelFlowRoutinePayload)(tunnel_t *, line_t *line, sbuf_t *payload);
+typedef void (*TunnelFlowRoutinePayloadBurst)(tunnel_t *, line_t *line, sbuf_t **payloads, uint32_t count);
 typedef void (*TunnelFlowRoutineEst)(tunnel_t *, line_t *line);
 typedef void (*TunnelFlowRoutineFin)(tunnel_t *, line_t *line);
 typedef void (*TunnelFlowRoutinePause)(tunnel_t *, line_t *line);
@@ -63,12 +66,37 @@ typedef splice_retcode_t (*TunnelFlowRoutineSplice)(tunnel_t *, line_t *line, in
 //     struct line_s *dw;
 // } pipe_line_t;
 
+enum
+{
+    kTunnelBurstMax = 64
+};
+
 /*
     Tunnel is just a doubly linked list, it has its own state, per connection state is stored in line structure
     which later gets accessed by the chain_index which is fixed
 
     node(Create) -> onChain -> onChainingComplete -> onIndex -> onChainStart -> node(Destroy)
 
+    Flow routines carry no context object, a payload hop is a single indirect call:
+
+        fnInitU / fnEstD        the line opens (Init travels up, Est comes back down)
+        fnPayloadU / fnPayloadD the callee owns the buffer from now on
+        fnFinU / fnFinD         the line is closed in that direction, the caller must not use its own line state
+                                after sending it, and it must not expect a Fin back
+        fnPauseU / fnResumeU    sent up by a tunnel that can not write downwards right now, the adapter on the
+                                top stops / resumes reading (fnPauseD / fnResumeD is the same thing, downwards)
+
+    A tunnel that needs to touch the line after a call that may close it, locks the line (lineLock) before the
+    call and checks lineIsAlive after it; pass-through hops never lock, tunnels that emit several payloads for one
+    input (decoders, muxers) lock once per input, not per emitted payload
+
+    fnPayloadBurstU / fnPayloadBurstD carry up to kTunnelBurstMax packets of one line in a single call, packet
+    adapters (tun, raw, capture) produce them from their read loops. A node that implements it works on the whole
+    array in a loop, the default splits the burst into fnPayload calls of the node itself, or forwards it as is when
+    the node has no payload routine of its own (pass-through). The callee owns every buffer of the array, it may
+    reorder or compact the array (to drop packets) but must not keep it after the call. Bursts are only sent on
+    lines that outlive the call (the per worker packet lines), so no node checks lineIsAlive between the packets
+
 */
 struct tunnel_s
 {
@@ -77,18 +105,20 @@ struct tunnel_s
     // TunnelFlowRoutine upStream;
     // TunnelFlowRoutine downStream;
 
-    TunnelFlowRoutineInit    fnInitU;
-    TunnelFlowRoutineInit    fnInitD;
-    TunnelFlowRoutinePayload fnPayloadU;
-    TunnelFlowRoutinePayload fnPayloadD;
-    TunnelFlowRoutineEst     fnEstU;
-    TunnelFlowRoutineEst     fnEstD;
-    TunnelFlowRoutineFin     fnFinU;
-    TunnelFlowRoutineFin     fnFinD;
-    TunnelFlowRoutinePause   fnPauseU;
-    TunnelFlowRoutinePause   fnPauseD;
-    TunnelFlowRoutineResume  fnResumeU;
-    TunnelFlowRoutineResume  fnResumeD;
+    TunnelFlowRoutineInit         fnInitU;
+    TunnelFlowRoutineInit         fnInitD;
+    TunnelFlowRoutinePayload      fnPayloadU;
+    TunnelFlowRoutinePayload      fnPayloadD;
+    TunnelFlowRoutinePayloadBurst fnPayloadBurstU;
+    TunnelFlowRoutinePayloadBurst fnPayloadBurstD;
+    TunnelFlowRoutineEst          fnEstU;
+    TunnelFlowRoutineEst          fnEstD;
+    TunnelFlowRoutineFin          fnFinU;
+    TunnelFlowRoutineFin          fnFinD;
+    TunnelFlowRoutinePause        fnPauseU;
+    TunnelFlowRoutinePause        fnPauseD;
+    TunnelFlowRoutineResume       fnResumeU;
+    TunnelFlowRoutineResume       fnResumeD;
 
     TunnelChainFn  onChain;
     TunnelIndexFn  onIndex;
@@ -101,6 +131,8 @@ struct tunnel_s
     uint16_t lstate_offset;
     uint16_t chain_index;
 
+    metric_id_t metrics_base; // id of the first metric this node registered (tunnel_metadata_t)
+
     node_t         *node;
     tunnel_chain_t *chain;
 
@@ -114,6 +146,17 @@ struct tunnel_s
 tunnel_t *tunnelCreate(node_t *node, uint16_t tstate_size, uint16_t lstate_size);
 void      tunnelDestroy(tunnel_t *self);
 
+// metric is the index in the metric_desc_t array that the node published in its metadata
+static inline void tunnelMetricAdd(tunnel_t *self, uint16_t metric, uint64_t value)
+{
+    metricsAdd((metric_id_t) (self->metrics_base + metric), value);
+}
+
+static inline void tunnelMetricSub(tunnel_t *self, uint16_t metric, uint64_t value)
+{
+    metricsSub((metric_id_t) (self->metrics_base + metric), value);
+}
+
 static inline void tunnelSetState(tunnel_t *self, void *state)
 {
     memoryCopy(&(self->state[0]), state, self->tstate_size);
@@ -126,12 +169,14 @@ void tunnelDefaultUpStreamInit(tunnel_t *self, line_t *line);
 void tunnelDefaultUpStreamEst(tunnel_t *self, line_t *line);
 void tunnelDefaultUpStreamFin(tunnel_t *self, line_t *line);
 void tunnelDefaultUpStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload);
+void tunnelDefaultUpStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count);
 void tunnelDefaultUpStreamPause(tunnel_t *self, line_t *line);
 void tunnelDefaultUpStreamResume(tunnel_t *self, line_t *line);
 void tunnelDefaultdownStreamInit(tunnel_t *self, line_t *line);
 void tunnelDefaultdownStreamEst(tunnel_t *self, line_t *line);
 void tunnelDefaultdownStreamFin(tunnel_t *self, line_t *line);
 void tunnelDefaultdownStreamPayload(tunnel_t *self, line_t *line, sbuf_t *payload);
+void tunnelDefaultdownStreamPayloadBurst(tunnel_t *self, line_t *line, sbuf_t **payloads, uint32_t count);
 void tunnelDefaultDownStreamPause(tunnel_t *self, line_t *line);
 void tunnelDefaultDownStreamResume(tunnel_t *self, line_t *line);
 void tunnelDefaultOnChain(tunnel_t *t, tunnel_chain_t *tc);
@@ -164,7 +209,7 @@ static uint16_t tunnelGetStateSize(tunnel_t *self)
 
 static uint16_t tunnelGetLineStateSize(tunnel_t *self)
 {
-    return self->tstate_size;
+    return self->lstate_size;
 }
 
 static uint16_t tunnelGetCorrectAllignedStateSize(uint16_t size)
@@ -0,0 +1,130 @@
+#pragma once
+#include "wlibc.h"
+
+#include "global_state.h"
+#include "managers/metrics_manager.h"
+#include "tunnel.h"
+#include "worker.h"
+
+/*
+    Byte accounted write back-pressure
+
+    A line that holds payloads it could not write yet (its own queue and what the socket still has to send) keeps
+    a write_budget_t and reports how many bytes it holds after every change. The writer on the other side is paused
+    once the line holds more than high_water and resumed once it is back at low_water, so a line holds at most
+    high_water plus the payloads that were already on their way.
+
+    Every held byte is also charged to the worker of the line. While all lines of a worker together hold more than
+    the worker budget (misc "write-budget", MB), a line pauses its writer as soon as it holds more than low_water:
+    pause comes earlier instead of every line filling its queue up to high_water, and the memory of a worker stays
+    near the budget under load.
+
+    The per line bytes feed a gauge of the node, the worker totals are ww_write_queued_bytes and
+    ww_write_budget_pauses_total.
+
+    Owned by the worker of the line, no atomics.
+*/
+
+enum
+{
+    kWriteBudgetDefaultHighWaterKB = 1024, // node settings "write-high-watermark" / "write-low-watermark"
+    kWriteBudgetDefaultLowWaterKB  = 256
+};
+
+typedef enum write_budget_action_e
+{
+    kWriteBudgetKeep,
+    kWriteBudgetPause, // pause the writer
+    kWriteBudgetResume // resume the writer
+
+} write_budget_action_t;
+
+typedef struct write_budget_s
+{
+    tunnel_t *tunnel; // owner of the gauge
+    uint32_t  held;   // charged to the worker and the gauge
+    uint32_t  high_water;
+    uint32_t  low_water;
+    uint16_t  gauge; // metric of the tunnel
+    bool      paused;
+
+} write_budget_t;
+
+/**
+ * Prepares the budget of a line, it holds nothing yet.
+ * @param b The budget.
+ * @param tunnel The tunnel whose gauge counts the bytes.
+ * @param gauge The gauge metric of the tunnel.
+ * @param high_water Bytes that pause the writer.
+ * @param low_water Bytes that resume it.
+ */
+static inline void writebudgetInit(write_budget_t *b, tunnel_t *tunnel, uint16_t gauge, uint32_t high_water,
+                                   uint32_t low_water)
+{
+    *b = (write_budget_t) {
+        .tunnel = tunnel, .high_water = high_water, .low_water = min(low_water, high_water), .gauge = gauge};
+}
+
+static inline bool writebudgetWorkerSpent(void)
+{
+    return GSTATE.write_budget != 0 && getWorker(getWID())->write_queued > GSTATE.write_budget;
+}
+
+static inline void writebudgetCharge(write_budget_t *b, uint32_t held)
+{
+    worker_t *w = getWorker(getWID());
+    if (held >= b->held)
+    {
+        uint32_t delta = held - b->held;
+        w->write_queued += delta;
+        metricsAdd(metricsmanagerGet()->write_queued_bytes, delta);
+        tunnelMetricAdd(b->tunnel, b->gauge, delta);
+    }
+    else
+    {
+        uint32_t delta = b->held - held;
+        w->write_queued -= delta;
+        metricsSub(metricsmanagerGet()->write_queued_bytes, delta);
+        tunnelMetricSub(b->tunnel, b->gauge, delta);
+    }
+    b->held = held;
+}
+
+/**
+ * Records what the line holds now.
+ * @param b The budget.
+ * @param held Bytes queued by the line plus what its socket still has to send.
+ * @return What to do with the writer, a pause is returned once and followed by one resume.
+ */
+static inline write_budget_action_t writebudgetUpdate(write_budget_t *b, size_t held)
+{
+    writebudgetCharge(b, (uint32_t) min(held, (size_t) UINT32_MAX));
+
+    if (! b->paused)
+    {
+        if (b->held > b->high_water)
+        {
+            b->paused = true;
+            return kWriteBudgetPause;
+        }
+        if (b->held > b->low_water && writebudgetWorkerSpent())
+        {
+            b->paused = true;
+            metricsInc(metricsmanagerGet()->write_budget_pauses);
+            return kWriteBudgetPause;
+        }
+        return kWriteBudgetKeep;
+    }
+    if (b->held <= b->low_water)
+    {
+        b->paused = false;
+        return kWriteBudgetResume;
+    }
+    return kWriteBudgetKeep;
+}
+
+// gives the charge back, the line holds nothing anymore
+static inline void writebudgetDestroy(write_budget_t *b)
+{
+    writebudgetCharge(b, 0);
+}
@@ -18,9 +18,11 @@ enum node_flags
 
 typedef struct tunnel_metadata_s
 {
-    int32_t         version;
-    enum node_flags flags;
-    uint16_t        required_padding_left;
+    int32_t              version;
+    enum node_flags      flags;
+    uint16_t             required_padding_left;
+    uint16_t             metrics_count;
+    const metric_desc_t *metrics; // registered once per node instance, labeled with the node name
 } tunnel_metadata_t;
 
 typedef struct node_s node_t;
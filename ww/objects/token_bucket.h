@@ -0,0 +1,108 @@
+#pragma once
+#include "wlibc.h"
+
+/*
+    Shared token bucket (bytes per second), refilled lazily by whoever takes tokens from it
+
+    Workers are not supposed to hit this for every packet, they borrow a chunk of tokens into a worker local
+    counter and only come back when that runs out, so the atomics here are touched a few times per chunk
+
+    rate == 0 means unlimited
+
+*/
+
+enum
+{
+    kTokenBucketMinChunk = 16 * 1024
+};
+
+typedef struct token_bucket_s
+{
+    atomic_llong  tokens;
+    atomic_ullong last_refill_us;
+    uint64_t      rate;
+    uint64_t      burst;
+    uint64_t      chunk;
+
+} ATTR_ALIGNED_LINE_CACHE token_bucket_t;
+
+static inline void tokenbucketInit(token_bucket_t *tb, uint64_t rate, uint64_t burst, uint64_t now_us)
+{
+    tb->rate  = rate;
+    tb->burst = burst == 0 ? rate : burst;
+    // around 100 borrows per second for the whole bucket, but never so small that a full packet needs 2 rounds
+    tb->chunk = max(rate / 100, (uint64_t) kTokenBucketMinChunk);
+    atomicStoreExplicit(&tb->tokens, (long long) tb->burst, memory_order_relaxed);
+    atomicStoreExplicit(&tb->last_refill_us, now_us, memory_order_relaxed);
+}
+
+static inline bool tokenbucketIsUnlimited(const token_bucket_t *tb)
+{
+    return tb->rate == 0;
+}
+
+static inline void tokenbucketRefill(token_bucket_t *tb, uint64_t now_us)
+{
+    uint64_t last = atomicLoadExplicit(&tb->last_refill_us, memory_order_relaxed);
+    if (now_us <= last)
+    {
+        return;
+    }
+    // after a long idle time the bucket is simply full, clamping the elapsed time keeps the product in range
+    uint64_t elapsed = min(now_us - last, (tb->burst / tb->rate + 1) * 1000000);
+    uint64_t add     = (elapsed * tb->rate) / 1000000;
+    if (add == 0)
+    {
+        return;
+    }
+    // only the thread that moves the timestamp gets to add the tokens
+    if (! atomicCompareExchangeExplicit(&tb->last_refill_us, &last, now_us, memory_order_relaxed,
+                                        memory_order_relaxed))
+    {
+        return;
+    }
+
+    long long cur = atomicLoadExplicit(&tb->tokens, memory_order_relaxed);
+    long long next;
+    do
+    {
+        next = cur + (long long) add;
+        if (next > (long long) tb->burst)
+        {
+            next = (long long) tb->burst;
+        }
+    } while (! atomicCompareExchangeExplicit(&tb->tokens, &cur, next, memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * Takes up to want tokens from the bucket.
+ * @param tb The bucket.
+ * @param want Number of tokens (bytes) requested.
+ * @param now_us Current time in microseconds.
+ * @return Number of tokens granted, can be less than want (or 0).
+ */
+static inline uint64_t tokenbucketTake(token_bucket_t *tb, uint64_t want, uint64_t now_us)
+{
+    tokenbucketRefill(tb, now_us);
+
+    long long cur = atomicLoadExplicit(&tb->tokens, memory_order_relaxed);
+    long long grant;
+    do
+    {
+        if (cur <= 0)
+        {
+            return 0;
+        }
+        grant = cur < (long long) want ? cur : (long long) want;
+    } while (
+        ! atomicCompareExchangeExplicit(&tb->tokens, &cur, cur - grant, memory_order_relaxed, memory_order_relaxed));
+
+    return (uint64_t) grant;
+}
+
+// how long it takes for the bucket to produce this many tokens, at least 1ms
+static inline uint32_t tokenbucketWaitTimeMS(const token_bucket_t *tb, uint64_t tokens)
+{
+    uint64_t ms = (tokens * 1000) / tb->rate;
+    return ms == 0 ? 1 : (uint32_t) min(ms, (uint64_t) 1000);
+}
@@ -1,4 +1,26 @@
 #include "objects/user.h"
+#include "global_state.h"
+#include "utils/json_helpers.h"
+
+static void parseUserLimits(user_t *user, const cJSON *user_json)
+{
+    const cJSON *limit_json = cJSON_GetObjectItemCaseSensitive(user_json, "limit");
+    if (! cJSON_IsObject(limit_json))
+    {
+        return;
+    }
+    // bytes per second, 0 or missing means unlimited
+    const cJSON *bandwidth_json = cJSON_GetObjectItemCaseSensitive(limit_json, "bandwidth");
+    if (cJSON_IsObject(bandwidth_json))
+    {
+        int up   = 0;
+        int down = 0;
+        getIntFromJsonObjectOrDefault(&up, bandwidth_json, "up", 0);
+        getIntFromJsonObjectOrDefault(&down, bandwidth_json, "down", 0);
+        user->limit.bandwidth.u = up > 0 ? (unsigned long long) up : 0;
+        user->limit.bandwidth.d = down > 0 ? (unsigned long long) down : 0;
+    }
+}
 
 struct user_s *parseUserFromJsonObject(const cJSON *user_json)
 {
@@ -27,7 +49,52 @@ struct user_s *parseUserFromJsonObject(const cJSON *user_json)
         return NULL;
     }
     user->enable = enable;
-    // TODO (parse user) parse more fields from user like limits/dates/etc..
+    parseUserLimits(user, user_json);
+    // TODO (parse user) parse more fields from user like dates/etc..
     return user;
 }
 
+void userCreateWorkerStats(user_t *user)
+{
+    assert(user->wstats == NULL);
+    size_t size = sizeof(user_worker_stat_t) * getWorkersCount();
+
+    // over allocate to give each worker its own cache line
+    user->wstats_memory = memoryAllocate(size + kCpuLineCacheSize);
+    user->wstats = (user_worker_stat_t *) (((uintptr_t) user->wstats_memory + kCpuLineCacheSize - 1) &
+                                           ~((uintptr_t) kCpuLineCacheSize - 1));
+    memorySet(user->wstats, 0, size);
+
+    uint64_t now_us = getHRTimeUs();
+    tokenbucketInit(&user->bandwidth_bucket[kUserDirUp], user->limit.bandwidth.u, 0, now_us);
+    tokenbucketInit(&user->bandwidth_bucket[kUserDirDown], user->limit.bandwidth.d, 0, now_us);
+}
+
+void userDestroyWorkerStats(user_t *user)
+{
+    memoryFree(user->wstats_memory);
+    user->wstats_memory = NULL;
+    user->wstats        = NULL;
+}
+
+void userAggregateStats(user_t *user)
+{
+    if (user->wstats == NULL)
+    {
+        return;
+    }
+    uint64_t up      = 0;
+    uint64_t down    = 0;
+    uint64_t cons_in = 0;
+
+    for (wid_t wi = 0; wi < getWorkersCount(); wi++)
+    {
+        user_worker_stat_t *ws = &user->wstats[wi];
+        up += atomicLoadExplicit(&ws->traffic[kUserDirUp], memory_order_relaxed);
+        down += atomicLoadExplicit(&ws->traffic[kUserDirDown], memory_order_relaxed);
+        cons_in += atomicLoadExplicit(&ws->cons_in, memory_order_relaxed);
+    }
+    atomicStoreExplicit(&user->stats.traffic.u, up, memory_order_relaxed);
+    atomicStoreExplicit(&user->stats.traffic.d, down, memory_order_relaxed);
+    atomicStoreExplicit(&user->stats.cons_in, cons_in, memory_order_relaxed);
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include "wlibc.h"
 #include "cJSON.h"
+#include "objects/token_bucket.h"
+#include "worker.h"
 
 
 typedef struct ud_s
@@ -32,6 +34,12 @@ typedef struct user_time_info_s
     atomic_bool since_first_use;
 } user_time_info_t;
 
+/*
+    user_stat_t is the aggregated view (api, limits), it is only refreshed by userAggregateStats()
+
+    the data path writes to user_worker_stat_t instead, one cache line per worker, only the owner worker writes to
+    it so there is no atomic read-modify-write and no line bouncing between cores; readers just do relaxed loads
+*/
 typedef struct user_stat_s
 {
 
@@ -43,6 +51,21 @@ typedef struct user_stat_s
     ud_t          traffic;
 } user_stat_t;
 
+typedef enum
+{
+    kUserDirUp   = 0,
+    kUserDirDown = 1
+} user_dir_e;
+
+typedef struct user_worker_stat_s
+{
+    atomic_ullong traffic[2];
+    atomic_ullong cons_in;
+    // tokens borrowed from the user bandwidth bucket, can go negative (debt) since we never drop data
+    int64_t tokens[2];
+
+} ATTR_ALIGNED_LINE_CACHE user_worker_stat_t;
+
 typedef struct user_s
 {
     struct cJSON   *json;
@@ -58,8 +81,99 @@ typedef struct user_s
     user_time_info_t timeinfo;
     user_stat_t      stats;
 
+    // data path, see userCreateWorkerStats
+    user_worker_stat_t *wstats;
+    void               *wstats_memory;
+    token_bucket_t      bandwidth_bucket[2];
+
 } user_t;
 
 
 struct user_s;
 struct user_s *parseUserFromJsonObject(const cJSON *user_json);
+
+/*
+    allocates the per worker counters and prepares the bandwidth buckets, must be called after the workers count
+    is known and before any line of this user is accounted
+*/
+void userCreateWorkerStats(user_t *user);
+void userDestroyWorkerStats(user_t *user);
+
+// sums up the worker counters into user->stats, this is the lazy part; call it from api / limit checks only
+void userAggregateStats(user_t *user);
+
+static inline void userStatAddLocal(atomic_ullong *counter, uint64_t value)
+{
+    // single writer, a plain load/store pair is enough and much cheaper than a locked add
+    atomicStoreExplicit(counter, atomicLoadExplicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void userStatSubLocal(atomic_ullong *counter, uint64_t value)
+{
+    atomicStoreExplicit(counter, atomicLoadExplicit(counter, memory_order_relaxed) - value, memory_order_relaxed);
+}
+
+static inline user_worker_stat_t *userGetWorkerStat(user_t *user, wid_t wid)
+{
+    return &user->wstats[wid];
+}
+
+static inline void userConnectionOpened(user_t *user, wid_t wid)
+{
+    userStatAddLocal(&userGetWorkerStat(user, wid)->cons_in, 1);
+}
+
+static inline void userConnectionClosed(user_t *user, wid_t wid)
+{
+    userStatSubLocal(&userGetWorkerStat(user, wid)->cons_in, 1);
+}
+
+/**
+ * Accounts traffic of the user on this worker and charges the bandwidth shaper.
+ * @param user The user.
+ * @param wid The calling worker.
+ * @param dir Direction of the data (up: from the user, down: to the user).
+ * @param bytes Size of the payload.
+ * @return false if the user has used up its bandwidth, the caller should pause that direction
+ *         and call userShaperRefill() later. The data itself is never dropped.
+ */
+static inline bool userAccount(user_t *user, wid_t wid, user_dir_e dir, uint32_t bytes)
+{
+    user_worker_stat_t *ws = userGetWorkerStat(user, wid);
+    userStatAddLocal(&ws->traffic[dir], bytes);
+
+    token_bucket_t *tb = &user->bandwidth_bucket[dir];
+    if (LIKELY(tokenbucketIsUnlimited(tb)))
+    {
+        return true;
+    }
+
+    ws->tokens[dir] -= bytes;
+    if (LIKELY(ws->tokens[dir] >= 0))
+    {
+        return true;
+    }
+    // slow path, once per borrowed chunk
+    ws->tokens[dir] += (int64_t) tokenbucketTake(tb, (uint64_t) (-ws->tokens[dir]) + tb->chunk, getHRTimeUs());
+    return ws->tokens[dir] >= 0;
+}
+
+/**
+ * Tries to pay back the debt of a paused direction.
+ * @return 0 if the direction can be resumed, otherwise the suggested delay in milliseconds before trying again.
+ */
+static inline uint32_t userShaperRefill(user_t *user, wid_t wid, user_dir_e dir)
+{
+    user_worker_stat_t *ws = userGetWorkerStat(user, wid);
+    token_bucket_t     *tb = &user->bandwidth_bucket[dir];
+
+    if (ws->tokens[dir] < 0)
+    {
+        ws->tokens[dir] += (int64_t) tokenbucketTake(tb, (uint64_t) (-ws->tokens[dir]) + tb->chunk, getHRTimeUs());
+    }
+    if (ws->tokens[dir] >= 0)
+    {
+        return 0;
+    }
+    return tokenbucketWaitTimeMS(tb, (uint64_t) (-ws->tokens[dir]));
+}